@@ -0,0 +1 @@
+#define BUILD_TAG "5efae9d"
@@ -59,6 +59,7 @@ try:
     r.run()
 
     while not r.ev_3d.fired:
+        agx.wait_channels()
         agx.asc.work()
         agx.poll_channels()
 
@@ -233,6 +233,7 @@ try:
 
     for r in renderers:
         while not r.ev_ta.fired:
+            agx.wait_channels()
             agx.asc.work()
             agx.poll_channels()
 
@@ -241,6 +242,7 @@ try:
 
     for r in renderers:
         while not r.ev_3d.fired:
+            agx.wait_channels()
             agx.asc.work()
             agx.poll_channels()
             #print("==========================================")
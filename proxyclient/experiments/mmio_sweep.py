@@ -25,10 +25,7 @@ if args.print:
 granule = 0x4000
 
 lp = LinkedProgram(u)
-lp.load_inline_c(f'''
-	#define GRANULE {granule}
-	''' + '''
-	#include "exception.h"
+lp.load_inline_c('''
 	#include "utils.h"
 	#include "soc.h"
 
@@ -36,38 +33,14 @@ lp.load_inline_c(f'''
 	{
 		return chip_id == T6000;
 	}
-
-	void sweep(u64 from, u64 to, u64 target)
-	{
-		u32 *mask = (u32 *) target;
-		exc_guard = GUARD_MARK | GUARD_SILENT;
-
-		int bitp = 0;
-		for (u64 p = from; p < to; p += GRANULE) {
-			sysop("dsb sy");
-			sysop("isb");
-			bool hit = read32(p) != 0xabad1dea;
-
-			if (hit)
-				*mask |= (1 << bitp);
-			else
-				*mask &= ~(1 << bitp);
-
-			if (++bitp >= 32) {
-				bitp = 0;
-				mask++;
-			}
-		}
-
-		sysop("dsb sy");
-		sysop("isb");
-	}
 	''')
 
 def do_sweep(maskrange):
-	masklen = (maskrange.stop - maskrange.start) // granule // 32 * 4 + 4
+	count = (maskrange.stop - maskrange.start) // granule
+	masklen = count // 32 * 4 + 4
 	mask_base = u.heap.malloc(masklen)
-	lp.sweep(maskrange.start, maskrange.stop, mask_base)
+	p.memset32(mask_base, 0, masklen)
+	p.memprobe(maskrange.start, count, granule, 4, mask_base)
 	mask = iface.readmem(mask_base, masklen)
 	u.heap.free(mask_base)
 	return np.frombuffer(mask, dtype=np.uint8)
@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, struct
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+from m1n1.setup import *
+
+# Compare m1n1 built with and without MMU_MAX_BLOCKS=1: prints how the identity map is built and
+# how many TLB misses a large copy on the boot CPU takes.
+
+PMCR0 = "s3_1_c15_c0_0"
+PMCR1 = "s3_1_c15_c1_0"
+PMESR0 = "s3_1_c15_c5_0"
+PMC2 = "s3_2_c15_c2_0"
+PMC3 = "s3_2_c15_c3_0"
+
+MMU_TABLE_WALK_DATA = 0x08
+L2_TLB_MISS_DATA = 0x0b
+
+SIZE = 128 * 1024 * 1024
+
+with u.heap.guarded_malloc(24) as buf:
+    if p.mmu_get_stats(buf, 24) < 0:
+        raise Exception("MMU is not initialized")
+    l2_blocks, l3_tables, l3_pages = struct.unpack("<3Q", iface.readmem(buf, 24))
+
+print(f"MMU: {l2_blocks} L2 blocks, {l3_pages} L3 pages in {l3_tables} L3 tables")
+
+src = u.memalign(0x4000, SIZE)
+dst = u.memalign(0x4000, SIZE)
+
+saved = [u.mrs(r) for r in (PMCR0, PMCR1, PMESR0)]
+
+# PMC2/PMC3, counted in EL1 which covers m1n1 at EL2 with E2H
+u.msr(PMESR0, MMU_TABLE_WALK_DATA | (L2_TLB_MISS_DATA << 8))
+u.msr(PMCR1, 0xc << 16)
+u.msr(PMC2, 0)
+u.msr(PMC3, 0)
+u.msr(PMCR0, (saved[0] & ~0xff) | 0xc)
+
+p.memcpy64(dst, src, SIZE)
+
+u.msr(PMCR0, saved[0])
+walks = u.mrs(PMC2)
+misses = u.mrs(PMC3)
+
+u.msr(PMCR1, saved[1])
+u.msr(PMESR0, saved[2])
+
+print(f"Copied {SIZE >> 20}MB: {walks} data table walks, {misses} L2 TLB misses")
+
+u.free(dst)
+u.free(src)
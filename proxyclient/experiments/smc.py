@@ -31,15 +31,35 @@ def gpio_key(pin):
 count = smcep.read32b("#KEY")
 print(f"Key count: {count}")
 
-for i in range(count):
-    k = smcep.get_key_by_index(i)
-    length, type, flags = smcep.get_key_info(k)
+# Fetch the key list, their info and values in bulk, one device-side batch at a time
+keys = smcep.batch([("index", i) for i in range(count)])
+infos = smcep.batch([("info", k) for k in keys])
+readable = [(k, info) for k, info in zip(keys, infos)
+            if not isinstance(info, SMCError) and info[2] & 0x80 and info[0] <= 120]
+values = dict(zip((k for k, _ in readable), smcep.batch([("r", k, info[0]) for k, info in readable])))
+
+for i, (k, info) in enumerate(zip(keys, infos)):
+    if isinstance(info, SMCError):
+        print(f"#{i}: {k} = <error {info}>")
+        continue
+    length, type, flags = info
     if flags & 0x80:
-        try:
-            val = smcep.read_type(k, length, type)
-            print(f"#{i}: {k} = ({type}, {flags:#x}) {val}")
-        except SMCError as e:
-            print(f"#{i}: {k} = ({type}, {flags:#x}) <error {e}>")
+        if k not in values:
+            # Too large for a batch op
+            try:
+                values[k] = smcep.read(k, length)
+            except SMCError as e:
+                values[k] = e
+        val = values[k]
+        if isinstance(val, SMCError):
+            print(f"#{i}: {k} = ({type}, {flags:#x}) <error {val}>")
+            continue
+        fmt, func = smcep.TYPE_MAP.get(type, (None, None))
+        if fmt:
+            val = struct.unpack(fmt, val)[0]
+        if func:
+            val = func(val)
+        print(f"#{i}: {k} = ({type}, {flags:#x}) {val}")
     else:
         print(f"#{i}: {k} = ({type}, {flags:#x}) <not available>")
 
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Native versions of the proxy transport checksums, loaded through ctypes by accel.py.
+ * Build with:
+ *
+ *   cc -O2 -shared -fPIC -o proxyclient/m1n1/_accel.so proxyclient/m1n1/_accel.c
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+static int crc32c_ready;
+
+static void crc32c_init(void)
+{
+    for (int i = 0; i < 256; i++) {
+        uint32_t v = i;
+        for (int j = 0; j < 8; j++)
+            v = (v >> 1) ^ (v & 1 ? CRC32C_POLY : 0);
+        crc32c_table[0][i] = v;
+    }
+
+    for (int i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] =
+                (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+
+    crc32c_ready = 1;
+}
+
+/* Same as m1n1's checksum() in uartproxy.c */
+uint32_t m1n1_checksum(const uint8_t *data, size_t len)
+{
+    uint32_t sum = 0xdeadbeef;
+
+    while (len--)
+        sum = sum * 31337 + (*data++ ^ 0x5a);
+
+    return sum ^ 0xaddedbad;
+}
+
+/* Slicing-by-8, continuing from crc like zlib.crc32() */
+uint32_t m1n1_crc32c(uint32_t crc, const uint8_t *data, size_t len)
+{
+    if (!crc32c_ready)
+        crc32c_init();
+
+    crc = ~crc;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+        data += 8;
+        len -= 8;
+    }
+#endif
+
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
@@ -0,0 +1,41 @@
+# SPDX-License-Identifier: MIT
+'''Optional native checksums for the proxy transport.
+
+Loads _accel.so (built from _accel.c, see there) from this directory, or the library named by
+$M1N1_ACCEL. When there is none, checksum and crc32c are None and callers use Python code.
+'''
+import ctypes, os
+
+__all__ = ["checksum", "crc32c"]
+
+checksum = None
+crc32c = None
+
+def _load():
+    path = os.environ.get("M1N1_ACCEL",
+                          os.path.join(os.path.dirname(os.path.abspath(__file__)), "_accel.so"))
+    try:
+        return ctypes.CDLL(path)
+    except OSError:
+        return None
+
+def _buffer(data):
+    # ctypes takes bytes as-is; anything else (bytearray, memoryview) gets copied once
+    if isinstance(data, bytes):
+        return data
+    return bytes(data)
+
+_lib = _load()
+if _lib is not None:
+    _lib.m1n1_checksum.restype = ctypes.c_uint32
+    _lib.m1n1_checksum.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+    _lib.m1n1_crc32c.restype = ctypes.c_uint32
+    _lib.m1n1_crc32c.argtypes = [ctypes.c_uint32, ctypes.c_char_p, ctypes.c_size_t]
+
+    def checksum(data):
+        data = _buffer(data)
+        return _lib.m1n1_checksum(data, len(data))
+
+    def crc32c(data, crc=0):
+        data = _buffer(data)
+        return _lib.m1n1_crc32c(crc, data, len(data))
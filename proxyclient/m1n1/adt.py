@@ -1,5 +1,5 @@
 # SPDX-License-Identifier: MIT
-import itertools, fnmatch, sys
+import itertools, fnmatch, sys, os, struct, hashlib, pickle
 from construct import *
 
 from .utils import AddrLookup, FourCC, SafeGreedyRange
@@ -380,44 +380,160 @@ def build_prop(path, name, v, t=None):
 
     return t.build(v)
 
+# Placeholders in ADTProperties for values that have not been parsed out of the blob yet
+_UNDECODED = object()
+_DECODING = object()
+
+class ADTProperties(dict):
+    '''A node's properties, each one parsed from the raw ADT the first time it is looked at'''
+    def __init__(self, node, raw=None):
+        super().__init__()
+        self._node = node
+        self._raw = raw or {}
+        for name in self._raw:
+            dict.__setitem__(self, name, _UNDECODED)
+
+    def _raw_value(self, name):
+        size, off = self._raw[name]
+        return size, self._node._raw[0][off:off + (size & 0x7fffffff)]
+
+    def _decode(self, name):
+        node = self._node
+        size, value = self._raw_value(name)
+        is_template = bool(size & 0x80000000)
+        path = node._parent_path + node._raw_name
+
+        # Type inference can look at other properties, but never at the one being parsed
+        dict.__setitem__(self, name, _DECODING)
+        try:
+            t, v = parse_prop(node, path, node._raw_name, name, value, is_template)
+        except Exception as e:
+            dict.__setitem__(self, name, _UNDECODED)
+            print(f"Exception parsing {path}.{name} value {value.hex()}:", file=sys.stderr)
+            raise
+
+        node._types[name] = t, is_template
+        dict.__setitem__(self, name, v)
+        return v
+
+    def _untouched(self):
+        return len(self) == len(self._raw) and all(v is _UNDECODED for v in dict.values(self))
+
+    def __getitem__(self, name):
+        v = dict.__getitem__(self, name)
+        if v is _UNDECODED:
+            v = self._decode(name)
+        elif v is _DECODING:
+            raise KeyError(name)
+        return v
+
+    def __setitem__(self, name, value):
+        # Parse the old value first so the property keeps its type when built
+        if dict.get(self, name) is _UNDECODED:
+            self._decode(name)
+        dict.__setitem__(self, name, value)
+
+    def get(self, name, default=None):
+        try:
+            return self[name]
+        except KeyError:
+            return default
+
+    def pop(self, name, *default):
+        if name in self:
+            v = self[name]
+            del self[name]
+            return v
+        return dict.pop(self, name, *default)
+
+    def values(self):
+        return [self[k] for k in self]
+
+    def items(self):
+        return [(k, self[k]) for k in self]
+
+    def __repr__(self):
+        return repr(dict(self.items()))
+
+def _index_node(data, off, nodes):
+    start = off
+    prop_count, child_count = struct.unpack_from("<II", data, off)
+    off += 8
+
+    props = []
+    for i in range(prop_count):
+        name = data[off:off + 32].split(b"\0", 1)[0].decode("ascii")
+        size, = struct.unpack_from("<I", data, off + 32)
+        props.append((name, size, off + 36))
+        off += 36 + (((size & 0x7fffffff) + 3) & ~3)
+
+    idx = len(nodes)
+    nodes.append(None)
+    children = []
+    for i in range(child_count):
+        child, off = _index_node(data, off, nodes)
+        children.append(child)
+
+    nodes[idx] = (start, off, tuple(props), tuple(children))
+    return idx, off
+
+def index_adt(data):
+    '''Offsets of every node and property in an ADT blob, in pre-order with the root first'''
+    nodes = []
+    _index_node(data, 0, nodes)
+    return nodes
+
+# The index only depends on the ADT contents, so it is kept across sessions keyed by their hash.
+# Set M1N1ADTCACHE to another directory, or to an empty string to disable this.
+ADT_CACHE_DIR = os.environ.get("M1N1ADTCACHE",
+                               os.path.join(os.path.expanduser("~"), ".cache", "m1n1", "adt"))
+ADT_CACHE_VERSION = 1
+
+def load_index(data):
+    if not ADT_CACHE_DIR:
+        return index_adt(data)
+
+    key = hashlib.sha256(data).hexdigest()
+    path = os.path.join(ADT_CACHE_DIR, f"{key}.{ADT_CACHE_VERSION}.idx")
+    try:
+        with open(path, "rb") as fd:
+            return pickle.load(fd)
+    except (OSError, EOFError, pickle.UnpicklingError):
+        pass
+
+    index = index_adt(data)
+    try:
+        os.makedirs(ADT_CACHE_DIR, exist_ok=True)
+        with open(path + ".tmp", "wb") as fd:
+            pickle.dump(index, fd, protocol=pickle.HIGHEST_PROTOCOL)
+        os.replace(path + ".tmp", path)
+    except OSError:
+        pass
+
+    return index
+
 class ADTNode:
     def __init__(self, val=None, path="/", parent=None):
-        self._children = []
-        self._properties = {}
         self._types = {}
         self._parent_path = path
         self._parent = parent
+        # (blob, index, node number) for nodes loaded from an ADT, their children are only
+        # created when first needed
+        self._raw = val
 
-        if val is not None:
-            for p in val.properties:
-                if p.name == "name":
-                    _name = p.value.decode("ascii").rstrip("\0")
-                    break
-            else:
-                raise ValueError(f"Node in {path} has no name!")
+        if val is None:
+            self._children = []
+            self._properties = ADTProperties(self)
+            return
 
-            path = self._parent_path + _name
+        data, index, idx = val
+        raw = {name: (size, off) for name, size, off in index[idx][2]}
+        if "name" not in raw:
+            raise ValueError(f"Node in {path} has no name!")
 
-            for p in val.properties:
-                is_template = bool(p.size & 0x80000000)
-                try:
-                    t, v = parse_prop(self, path, _name, p.name, p.value, is_template)
-                    self._types[p.name] = t, is_template
-                    self._properties[p.name] = v
-                except Exception as e:
-                    print(f"Exception parsing {path}.{p.name} value {p.value.hex()}:", file=sys.stderr)
-                    raise
-
-            # Second pass
-            for k, (t, is_template) in self._types.items():
-                if t is None:
-                    t, v = parse_prop(self, path, _name, k, self._properties[k], is_template)
-                    self._types[k] = t, is_template
-                    self._properties[k] = v
-
-            for c in val.children:
-                node = ADTNode(c, f"{self._path}/", parent=self)
-                self._children.append(node)
+        size, off = raw["name"]
+        self._raw_name = data[off:off + (size & 0x7fffffff)].decode("ascii").rstrip("\0")
+        self._properties = ADTProperties(self, raw)
 
     @property
     def _path(self):
@@ -470,6 +586,12 @@ class ADTNode:
         del self._children[item]
 
     def __getattr__(self, attr):
+        if attr == "_children":
+            data, index, idx = self._raw
+            children = [ADTNode((data, index, child), f"{self._path}/", parent=self)
+                        for child in index[idx][3]]
+            self.__dict__["_children"] = children
+            return children
         attr = attr.replace("_", "-")
         attr = attr.replace("--", "_")
         if attr in self._properties:
@@ -600,8 +722,35 @@ class ADTNode:
         }
         return data
 
+    def _build(self, out):
+        props = self._properties
+
+        # Nothing below this node was looked at, so the original bytes are still good
+        if self._raw is not None and "_children" not in self.__dict__ and props._untouched():
+            data, index, idx = self._raw
+            start, end = index[idx][:2]
+            out.append(data[start:end])
+            return
+
+        out.append(struct.pack("<II", len(props), len(self._children)))
+        for k in props:
+            if dict.__getitem__(props, k) is _UNDECODED:
+                size, value = props._raw_value(k)
+            else:
+                t, is_template = self._types.get(k, (None, False))
+                value = build_prop(self._path, k, props[k], t=t)
+                size = len(value) | (0x80000000 if is_template else 0)
+            out.append(struct.pack("<32sI", k.encode("ascii"), size))
+            out.append(value)
+            out.append(bytes(-len(value) % 4))
+
+        for c in self._children:
+            c._build(out)
+
     def build(self):
-        return ADTNodeStruct.build(self.tostruct())
+        out = []
+        self._build(out)
+        return b"".join(out)
 
     def walk_tree(self):
         yield self
@@ -627,7 +776,8 @@ class ADTNode:
         return lookup
 
 def load_adt(data):
-    return ADTNode(ADTNodeStruct.parse(data))
+    data = bytes(data)
+    return ADTNode((data, load_index(data), 0))
 
 if __name__ == "__main__":
     import sys, argparse, pathlib
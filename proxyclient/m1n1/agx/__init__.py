@@ -186,6 +186,13 @@ class AGX:
             self.ch.stats.poll()
         self.ch.event.poll()
 
+    def wait_channels(self, timeout=0.1):
+        '''Sleep on m1n1 until the firmware sends a message or writes to one of the RX channels'''
+        chans = self.ch.log + [self.ch.ktrace, self.ch.event]
+        if self.show_stats:
+            chans.append(self.ch.stats)
+        self.asc.wait_messages(timeout, [chan.watch() for chan in chans])
+
     def kick_firmware(self):
         self.asc.db.doorbell(0x10)
 
@@ -19,6 +19,7 @@ class GPUChannel:
         self.state = self.STATE_FIELDS(self.u, self.state_addr)
         self.state.READ_PTR.val = 0
         self.state.WRITE_PTR.val = 0
+        self.rptr = 0
 
     @classmethod
     @property
@@ -53,6 +54,11 @@ class GPURXChannel(GPUChannel):
             self.handle_message(self.MSG_CLASS.parse(msg))
             rptr = (rptr + 1) % self.ring_size
         self.state.READ_PTR.val = rptr
+        self.rptr = rptr
+
+    def watch(self):
+        # Fires once the firmware moves WRITE_PTR past what we last consumed
+        return self.state.WRITE_PTR.addr, 0xffffffff, self.rptr
 
     def handle_message(self, msg):
         self.log(f"Message: {msg}")
@@ -1,5 +1,5 @@
 # SPDX-License-Identifier: MIT
-import os, tempfile, shutil, subprocess
+import os, re, json, struct, hashlib, tempfile, shutil, subprocess
 
 __all__ = ["AsmException", "ARMAsm"]
 
@@ -36,15 +36,87 @@ else:
     OBJDUMP = toolchain + "%ARCHobjdump"
     NM = toolchain + "%ARCHnm"
 
+# Assembled snippets are cached by content, toolchain and base address, in memory and on disk
+# (set M1N1_ASM_CACHE to another directory, or to nothing to keep it in memory only)
+ASM_CACHE_DIR = os.environ.get("M1N1_ASM_CACHE",
+                               os.path.join(os.path.expanduser("~"), ".cache", "m1n1", "asm"))
+
+_asm_cache = {}
+_toolchain_ids = {}
+
 class AsmException(Exception):
     pass
 
 class BaseAsm(object):
     def __init__(self, source, addr = 0):
         self.source = source
-        self._tmp = tempfile.mkdtemp() + os.sep
+        self._tmp = None
+        self.elffile = None
         self.addr = addr
-        self.compile(source)
+        if self._encode(source):
+            return
+        key = self._cache_key(source)
+        if not self._cache_load(key):
+            self.compile(source)
+            self._cache_store(key)
+
+    def _encode(self, source):
+        return False
+
+    def _toolchain_id(self):
+        '''Identifies the assembler without running it, by the path and mtime of its binary'''
+        cc = CC.replace("%ARCH", self.ARCH)
+        if cc not in _toolchain_ids:
+            path = shutil.which(cc.split()[0])
+            try:
+                mtime = os.stat(path).st_mtime_ns if path else 0
+            except OSError:
+                mtime = 0
+            _toolchain_ids[cc] = f"{cc}:{path}:{mtime}"
+        return _toolchain_ids[cc]
+
+    def _cache_key(self, source):
+        ident = (type(self).__name__, self._toolchain_id(), LD, self.CFLAGS, self.LDFLAGS,
+                 self.addr, self.HEADER, source, self.FOOTER)
+        return hashlib.sha256(repr(ident).encode("utf-8")).hexdigest()
+
+    def _cache_load(self, key):
+        entry = _asm_cache.get(key)
+        if entry is None and ASM_CACHE_DIR:
+            try:
+                with open(os.path.join(ASM_CACHE_DIR, key + ".json")) as fd:
+                    blob = json.load(fd)
+                entry = bytes.fromhex(blob["data"]), blob["symbols"]
+                _asm_cache[key] = entry
+            except (OSError, ValueError, KeyError):
+                return False
+        if entry is None:
+            return False
+        self._set_result(*entry)
+        return True
+
+    def _cache_store(self, key):
+        entry = self.data, self.symbols
+        _asm_cache[key] = entry
+        if not ASM_CACHE_DIR:
+            return
+        try:
+            os.makedirs(ASM_CACHE_DIR, exist_ok=True)
+            fd, tmp = tempfile.mkstemp(dir=ASM_CACHE_DIR)
+            with os.fdopen(fd, "w") as f:
+                json.dump({"data": self.data.hex(), "symbols": self.symbols}, f)
+            os.replace(tmp, os.path.join(ASM_CACHE_DIR, key + ".json"))
+        except OSError:
+            pass
+
+    def _set_result(self, data, symbols):
+        self.data = data
+        self.symbols = dict(symbols)
+        for name, addr in self.symbols.items():
+            setattr(self, name, addr)
+        self.start = self._start
+        self.len = len(self.data)
+        self.end = self.start + self.len
 
     def _call(self, program, args):
         subprocess.check_call(program.replace("%ARCH", self.ARCH) + " " + args, shell=True)
@@ -53,6 +125,8 @@ class BaseAsm(object):
         return subprocess.check_output(program.replace("%ARCH", self.ARCH) + " " + args, shell=True).decode("ascii")
 
     def compile(self, source):
+        if not self._tmp:
+            self._tmp = tempfile.mkdtemp() + os.sep
         self.sfile = self._tmp + "b.S"
         with open(self.sfile, "w") as fd:
             fd.write(self.HEADER + "\n")
@@ -70,22 +144,28 @@ class BaseAsm(object):
         self._call(NM, f"{self.elffile} > {self.nfile}")
 
         with open(self.bfile, "rb") as fd:
-            self.data = fd.read()
+            data = fd.read()
 
+        symbols = {}
         with open(self.nfile) as fd:
             for line in fd:
                 line = line.replace("\n", "")
                 addr, type, name = line.split()
-                addr = int(addr, 16)
-                setattr(self, name, addr)
-        self.start = self._start
-        self.len = len(self.data)
-        self.end = self.start + self.len
+                symbols[name] = int(addr, 16)
+
+        self._set_result(data, symbols)
+
+    def _need_elf(self):
+        # Results from the cache or the encoder have no object file to look at
+        if self.elffile is None:
+            self.compile(self.source)
 
     def objdump(self):
+        self._need_elf()
         self._call(OBJDUMP, f"-rd {self.elffile}")
 
     def disassemble(self):
+        self._need_elf()
         output = self._get(OBJDUMP, f"-zd {self.elffile}")
 
         for line in output.split("\n"):
@@ -114,6 +194,75 @@ _start:
     .pool
     """
 
+    SIMPLE = {
+        "isb": 0xd5033fdf,
+        "dsb sy": 0xd5033f9f,
+        "dmb sy": 0xd5033fbf,
+        "nop": 0xd503201f,
+        "ret": 0xd65f03c0,
+    }
+
+    @staticmethod
+    def _xreg(s):
+        s = s.strip().lower()
+        if s == "xzr":
+            return 31
+        if m := re.fullmatch(r"x(\d+)", s):
+            if int(m.group(1)) <= 30:
+                return int(m.group(1))
+        raise ValueError(s)
+
+    @staticmethod
+    def _sysreg(s):
+        from .sysreg import sysreg_parse
+        s = s.strip()
+        try:
+            return sysreg_parse(s)
+        except Exception:
+            return sysreg_parse(s.upper())
+
+    def _encode_one(self, stmt):
+        if stmt in self.SIMPLE:
+            return self.SIMPLE[stmt]
+        mnem, _, args = stmt.partition(" ")
+        args = [a.strip() for a in args.split(",")]
+        if mnem == "mrs" and len(args) == 2:
+            op0, op1, crn, crm, op2 = self._sysreg(args[1])
+            rt = self._xreg(args[0])
+            base = 0xd5200000
+        elif mnem == "msr" and len(args) == 2:
+            op0, op1, crn, crm, op2 = self._sysreg(args[0])
+            rt = self._xreg(args[1])
+            base = 0xd5000000
+        elif mnem in ("sys", "sysl") and len(args) in (4, 5):
+            if mnem == "sysl":
+                rt = self._xreg(args[0])
+                args = args[1:] + ["xzr"]
+            else:
+                rt = self._xreg(args[4]) if len(args) == 5 else 31
+            op0 = 1
+            op1, op2 = int(args[0].lstrip("#"), 0), int(args[3].lstrip("#"), 0)
+            crn, crm = (int(a.lower().lstrip("c")) for a in args[1:3])
+            base = 0xd5200000 if mnem == "sysl" else 0xd5000000
+        else:
+            raise ValueError(stmt)
+        if op0 > 3 or op1 > 7 or crn > 15 or crm > 15 or op2 > 7:
+            raise ValueError(stmt)
+        return base | (op0 << 19) | (op1 << 16) | (crn << 12) | (crm << 8) | (op2 << 5) | rt
+
+    def _encode(self, source):
+        '''Encode snippets made only of MRS/MSR/SYS/SYSL/barriers/ret without the toolchain'''
+        stmts = [s.split("//")[0].strip().lower() for s in re.split(r"[;\n]", source)]
+        stmts = [" ".join(s.split()) for s in stmts if s]
+        try:
+            insns = [self._encode_one(s) for s in stmts]
+        except Exception:
+            return False
+        if not insns:
+            return False
+        self._set_result(struct.pack(f"<{len(insns)}I", *insns), {"_start": self.addr})
+        return True
+
 if __name__ == "__main__":
     import sys
     code = """
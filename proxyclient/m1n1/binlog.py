@@ -0,0 +1,74 @@
+# SPDX-License-Identifier: MIT
+import re, struct
+
+from .sysreg import CNTFRQ_EL0
+
+__all__ = ["get_binlog", "format_binlog", "print_binlog"]
+
+# struct binlog_entry in src/binlog.h
+BINLOG_MAX_ARGS = 6
+BINLOG_FMT = f"<QQQII{BINLOG_MAX_ARGS}Q"
+
+FMT_RE = re.compile(r"%([-+ #0]*)(\d*)(?:\.(\d+))?(hh|h|ll|l|z|j|t)?([diouxXcsp%])")
+
+def _read_cstr(u, addr, cache, limit=1024):
+    if addr in cache:
+        return cache[addr]
+    data = b""
+    while b"\0" not in data and len(data) < limit:
+        data += u.iface.readmem(addr + len(data), 64)
+    s = data.split(b"\0")[0].decode("ascii", "replace")
+    cache[addr] = s
+    return s
+
+def _format(u, fmt, args, cache):
+    args = list(args)
+
+    def conv(m):
+        flags, width, prec, length, spec = m.groups()
+        if spec == "%":
+            return "%"
+        v = args.pop(0) if args else 0
+        wide = length in ("l", "ll", "z", "j", "t")
+        if spec in "di":
+            bits = 64 if wide else 32
+            v &= (1 << bits) - 1
+            if v >> (bits - 1):
+                v -= 1 << bits
+        elif spec in "ouxX" and not wide:
+            v &= 0xffffffff
+        elif spec == "c":
+            v = chr(v & 0xff)
+        elif spec == "s":
+            v = _read_cstr(u, v, cache) if v else "(null)"
+        elif spec == "p":
+            spec, flags = "x", flags + "#"
+        pfmt = "%" + flags + width + ("." + prec if prec is not None else "") + spec
+        return pfmt % v
+
+    return FMT_RE.sub(conv, fmt)
+
+def get_binlog(u, reset=False, count=1024):
+    """Fetch the binary log from m1n1 as a list of (timestamp, cpu, fmt address, args) tuples"""
+    entry = struct.calcsize(BINLOG_FMT)
+    with u.heap.guarded_malloc(entry * count) as buf:
+        count = u.proxy.binlog_read(buf, entry * count, reset)
+        data = u.iface.readmem(buf, entry * count)
+
+    log = []
+    for i in range(count):
+        seq, timestamp, fmt, cpu, nargs, *args = struct.unpack_from(BINLOG_FMT, data, i * entry)
+        log.append((timestamp, cpu, fmt, args[:nargs]))
+    return log
+
+def format_binlog(u, log):
+    """Format entries from get_binlog, reading the format strings out of m1n1's memory"""
+    cache = {}
+    tps = u.mrs(CNTFRQ_EL0)
+    for timestamp, cpu, fmt, args in log:
+        text = _format(u, _read_cstr(u, fmt, cache), args, cache).rstrip("\n")
+        yield f"[{timestamp / tps:12.6f}] cpu{cpu}: {text}"
+
+def print_binlog(u, reset=True):
+    for line in format_binlog(u, get_binlog(u, reset)):
+        print(line)
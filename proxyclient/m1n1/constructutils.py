@@ -1,6 +1,6 @@
 #!/usr/bin/env python3
 # SPDX-License-Identifier: MIT
-import inspect, textwrap, json, re, sys, os
+import inspect, textwrap, json, re, sys, os, hashlib
 
 from construct import *
 from construct.core import evaluate
@@ -125,7 +125,8 @@ class Dec(Adapter):
         return obj
 
     def _emitparse(self, code):
-        return self.subcon._compileparse(code)
+        code.linkedinstances[id(self)] = self
+        return f"linkedinstances[{id(self)}]._decode({self.subcon._compileparse(code)}, this, None)"
 
     def _emitseq(self, ksy, bitwise):
         return self.subcon._compileseq(ksy, bitwise)
@@ -139,6 +140,111 @@ class Dec(Adapter):
 class ConstructClassException(Exception):
     pass
 
+# Compiled parsers for ConstructClass subcons, via construct's compiler. Anything it cannot
+# compile (our adapters, Ver, Pointer, nested classes, ...) is still called through the
+# interpreter from the compiled code, so this mostly speeds up flat runs of plain fields.
+#
+# The generated code refers to live objects and cannot itself be cached, but whether a given
+# subcon compiles into something that parses the same as the interpreter is kept on disk, keyed
+# by the generated source. The first parse with a new one is done both ways and compared.
+# Set M1N1COMPILE=0 to always use the interpreter.
+COMPILE_PARSERS = os.environ.get("M1N1COMPILE", "1") != "0"
+COMPILE_CACHE_DIR = os.path.join(os.path.expanduser("~"), ".cache", "m1n1", "construct")
+
+g_compiled = {}
+
+class CompiledParser:
+    MAX_MISMATCHES = 4
+
+    def __init__(self, subcon):
+        self.compiled = subcon.compile()
+        # Linked object ids change between sessions, the code around them does not
+        source = re.sub(r"linked(instances|parsers|builders)\[\d+\]", r"linked\1[]",
+                        self.compiled.source)
+        self.key = hashlib.sha256(source.encode()).hexdigest()
+        self.verified = self._load_state()
+        self.mismatches = 0
+
+    def _state_path(self):
+        return os.path.join(COMPILE_CACHE_DIR, self.key)
+
+    def _load_state(self):
+        try:
+            with open(self._state_path(), "r") as fd:
+                return fd.read().strip() == "ok"
+        except OSError:
+            return None
+
+    def _save_state(self, ok):
+        self.verified = ok
+        try:
+            os.makedirs(COMPILE_CACHE_DIR, exist_ok=True)
+            with open(self._state_path(), "w") as fd:
+                fd.write("ok\n" if ok else "fail\n")
+        except OSError:
+            pass
+
+    @staticmethod
+    def _same(a, b):
+        if isinstance(a, dict) and isinstance(b, dict):
+            keys = [k for k in a if not k.startswith("_")]
+            return (keys == [k for k in b if not k.startswith("_")] and
+                    all(a[k] == b[k] for k in keys))
+        return a == b
+
+    def parse(self, subcon, stream, context, path):
+        start = stream.tell()
+        if self.verified:
+            try:
+                return self.compiled._parse(stream, context, path)
+            except Exception:
+                stream.seek(start)
+                return subcon._parse(stream, context, path)
+
+        obj = subcon._parse(stream, context, path)
+        end = stream.tell()
+
+        try:
+            stream.seek(start)
+            cobj = self.compiled._parse(stream, context, path)
+            cend = stream.tell()
+        except Exception:
+            # Broken generated code, not worth trying again
+            self._save_state(False)
+        else:
+            # A mismatch could also be the memory changing under us, so only a match is final
+            if cend == end and self._same(obj, cobj):
+                self._save_state(True)
+            else:
+                self.mismatches += 1
+                if self.mismatches >= self.MAX_MISMATCHES:
+                    self.verified = False
+
+        stream.seek(end)
+        return obj
+
+def compiled_parser(subcon):
+    '''The CompiledParser for a subcon, or None if it has to stay interpreted'''
+    if not COMPILE_PARSERS or not isinstance(subcon, Struct):
+        return None
+
+    # Ver fields are compiled in or out depending on the version in effect. The subcon is kept
+    # in the entry so that its id stays unique.
+    key = id(subcon), tuple(sorted(Ver._version.items()))
+    entry = g_compiled.get(key, None)
+    if entry is None:
+        try:
+            parser = CompiledParser(subcon)
+        except Exception:
+            parser = None
+        entry = g_compiled[key] = [subcon, parser]
+
+    parser = entry[1]
+    if parser is not None and parser.verified is False:
+        entry[1] = parser = None
+
+    return parser
+
 
 # We need to inherrit Construct as a metaclass so things like If and Select will work
 class ReloadableConstructMeta(ReloadableMeta, Construct):
@@ -329,7 +435,11 @@ class ConstructClassBase(Reloadable, metaclass=ReloadableConstructMeta):
     def _parse(cls, stream, context, path):
         #print(f"parse {cls} @ {stream.tell():#x} {path}")
         addr = stream.tell()
-        obj = cls.subcon._parse(stream, context, path)
+        parser = compiled_parser(cls.subcon)
+        if parser is not None:
+            obj = parser.parse(cls.subcon, stream, context, path)
+        else:
+            obj = cls.subcon._parse(stream, context, path)
         size = stream.tell() - addr
 
         # Don't instance Selects
@@ -0,0 +1,114 @@
+# SPDX-License-Identifier: MIT
+'''Driving several m1n1 targets from one host process.
+
+Each Target owns its own UartInterface/M1N1Proxy/ProxyUtils stack, and Fleet.run() calls a
+function on every target at once from a thread pool, so transfers to different machines overlap
+(the link I/O doesn't hold the GIL). Images are read and hashed once through an ImageCache and
+shared between targets for delta uploads.
+'''
+import os, threading, traceback
+from concurrent.futures import ThreadPoolExecutor
+
+from .proxy import *
+from .proxyutils import *
+
+__all__ = ["Target", "ImageCache", "Fleet", "FleetError"]
+
+class FleetError(Exception):
+    def __init__(self, errors):
+        self.errors = errors
+        super().__init__("failed on " + ", ".join(t.name for t in errors))
+
+class ImageCache:
+    '''File contents and their delta block hashes, shared across targets.'''
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.images = {}
+        self.hashes = {}
+
+    def load(self, path):
+        path = os.fspath(path)
+        st = os.stat(path)
+        key = (path, st.st_mtime_ns, st.st_size)
+        with self.lock:
+            if key not in self.images:
+                with open(path, "rb") as fd:
+                    self.images[key] = fd.read()
+            return self.images[key]
+
+    def block_hashes(self, data, block_size=ProxyUtils.DELTA_BLOCK):
+        key = (id(data), len(data), block_size)
+        with self.lock:
+            if key not in self.hashes:
+                # Keep data alive, so its id() can't be reused for a different image
+                self.hashes[key] = (data, ProxyUtils.block_hashes(data, block_size))
+            return self.hashes[key][1]
+
+class Target:
+    '''One m1n1 instance, connected on first use.'''
+    def __init__(self, device, name=None, cache=None):
+        self.device = device
+        self.name = name or device
+        self.cache = cache or ImageCache()
+        self.iface = self.p = self.u = None
+
+    def connect(self):
+        if self.u is None:
+            self.iface = UartInterface(self.device)
+            self.p = M1N1Proxy(self.iface, debug=False)
+            bootstrap_port(self.iface, self.p)
+            self.u = ProxyUtils(self.p)
+        return self
+
+    def upload(self, dest, data, progress=None):
+        '''Delta upload data to dest, reusing hashes cached for the same image on other targets'''
+        self.connect()
+        hashes = self.cache.block_hashes(data)
+        return self.u.delta_writemem(dest, data, progress, hashes=hashes)
+
+    def log(self, msg):
+        print(f"[{self.name}] {msg}")
+
+    def __repr__(self):
+        return f"Target({self.name!r})"
+
+class Fleet:
+    def __init__(self, devices, max_workers=None):
+        self.cache = ImageCache()
+        self.targets = [d if isinstance(d, Target) else Target(d, cache=self.cache)
+                        for d in devices]
+        self.max_workers = max_workers or len(self.targets) or 1
+
+    @classmethod
+    def from_env(cls, var="M1N1DEVICES"):
+        '''Targets from a comma separated device list, e.g. /dev/ttyACM0,/dev/ttyACM2,usb:1'''
+        return cls([d for d in os.environ.get(var, "").split(",") if d])
+
+    def run(self, fn, *args, connect=True, check=True, **kwargs):
+        '''Call fn(target, *args, **kwargs) on every target in parallel
+
+        Returns {target: result}. Targets that raised are reported together as FleetError if
+        check is set, otherwise their exception is their result.'''
+        def call(t):
+            try:
+                if connect:
+                    t.connect()
+                return fn(t, *args, **kwargs)
+            except Exception as e:
+                t.log(f"failed: {e!r}")
+                traceback.print_exc()
+                return e
+
+        with ThreadPoolExecutor(max_workers=self.max_workers) as pool:
+            results = dict(zip(self.targets, pool.map(call, self.targets)))
+
+        errors = {t: r for t, r in results.items() if isinstance(r, Exception)}
+        if check and errors:
+            raise FleetError(errors)
+        return results
+
+    def __iter__(self):
+        return iter(self.targets)
+
+    def __len__(self):
+        return len(self.targets)
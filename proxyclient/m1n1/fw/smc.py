@@ -126,6 +126,84 @@ class SMCEndpoint(ASCBaseEndpoint):
         else:
             return self.asc.iface.readmem(self.shmem, ret.SIZE)
 
+    # struct smc_op and struct smc_batch in src/smc.h
+    BATCH_OP = struct.Struct("<IBBBB120s")
+    BATCH_HDR = struct.Struct("<QIIQQII")
+    BATCH_CMDS = {"r": SMC_READ_KEY, "w": SMC_WRITE_KEY, "rw": SMC_RW_KEY,
+                  "index": SMC_GET_KEY_BY_INDEX, "info": SMC_GET_KEY_INFO}
+    BATCH_MAX_SPILL = 64
+    BATCH_CHUNK = 256
+
+    def batch(self, ops):
+        '''Run a list of key operations on the device, without a round trip per key
+
+        ops are ("r", key, size), ("w", key, data), ("rw", key, data, outsize), ("index", index)
+        or ("info", key). Returns one entry per op: the data read (b"" for writes), the key name
+        for "index", (length, type, flags) for "info", or an SMCError if the SMC failed it.'''
+        u = self.asc.u
+        results = []
+
+        for base in range(0, len(ops), self.BATCH_CHUNK):
+            chunk = ops[base:base + self.BATCH_CHUNK]
+            packed = []
+            for op in chunk:
+                kind, key, *args = op
+                data, rsize = b"", 0
+                if kind == "r":
+                    rsize, = args
+                elif kind == "w":
+                    data, = args
+                elif kind == "rw":
+                    data, rsize = args
+                if len(data) > 120 or rsize > 120:
+                    raise ValueError(f"SMC batch data for {key} is too large")
+                if kind != "index":
+                    key = int.from_bytes(key.encode("ascii"), byteorder="big")
+                packed.append(self.BATCH_OP.pack(key, self.BATCH_CMDS[kind], len(data), rsize, 0, data))
+
+            assert not self.outstanding
+            ops_buf = u.malloc(len(packed) * self.BATCH_OP.size)
+            spill_buf = u.malloc(self.BATCH_MAX_SPILL * 16)
+            hdr = u.malloc(self.BATCH_HDR.size)
+            try:
+                self.asc.iface.writemem(ops_buf, b"".join(packed))
+                self.asc.iface.writemem(hdr, self.BATCH_HDR.pack(
+                    self.shmem, self.msgid, len(chunk), ops_buf, spill_buf, self.BATCH_MAX_SPILL, 0))
+                done = self.asc.p.smc_batch(hdr)
+
+                _, self.msgid, _, _, _, _, spilled = self.BATCH_HDR.unpack(
+                    self.asc.iface.readmem(hdr, self.BATCH_HDR.size))
+                spill = self.asc.iface.readmem(spill_buf, spilled * 16)
+                out = self.asc.iface.readmem(ops_buf, max(done, 0) * self.BATCH_OP.size)
+            finally:
+                u.free(hdr)
+                u.free(spill_buf)
+                u.free(ops_buf)
+
+            # Whatever else the SMC said meanwhile still goes through the normal handlers
+            for i in range(spilled):
+                msg0, msg1 = struct.unpack_from("<QI", spill, i * 16)
+                self.asc.dispatch(msg0, msg1)
+
+            if done < len(chunk):
+                raise SMCError(f"SMC batch stopped after {max(done, 0)} of {len(chunk)} ops")
+
+            for i, op in enumerate(chunk):
+                key, cmd, wsize, rsize, result, data = self.BATCH_OP.unpack_from(out, i * self.BATCH_OP.size)
+                if result:
+                    results.append(SMCError(f"SMC error {result:#x} for {op[1]}", result))
+                elif cmd == SMC_WRITE_KEY:
+                    results.append(b"")
+                elif cmd == SMC_GET_KEY_BY_INDEX:
+                    results.append(data[:4].decode("ascii"))
+                elif cmd == SMC_GET_KEY_INFO:
+                    length, type, flags = struct.unpack("B4sB", data[:6])
+                    results.append((length, type.decode("ascii"), flags))
+                else:
+                    results.append(data[:rsize])
+
+        return results
+
     def get_key_by_index(self, index):
         ret = self.cmd(SMCGetKeyByIndex(INDEX = index))
         key = ret.VALUE.to_bytes(4, byteorder="little").decode("ascii")
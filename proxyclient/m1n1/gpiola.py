@@ -6,12 +6,32 @@ from . import asm
 from .proxy import REGION_RX_EL1
 from .sysreg import *
 
+class LALane:
+    '''One sampling CPU with its share of the pins and registers'''
+    def __init__(self, cpu, cbuf, pins, regs, on_pin_change, on_reg_change):
+        self.cpu = cpu
+        self.cbuf = cbuf
+        self.pins = pins
+        self.regs = regs
+        self.on_pin_change = on_pin_change
+        self.on_reg_change = on_reg_change
+        self.dbuf = None
+        self.half_size = 0
+        self.chunks = []
+        self.next_half = 0
+        self.samples = []
+
 class GPIOLogicAnalyzer(Reloadable):
-    def __init__(self, u, node=None, pins={}, regs={}, div=1, cpu=1, on_pin_change=True, on_reg_change=True):
+    def __init__(self, u, node=None, pins={}, regs={}, div=1, cpu=1, on_pin_change=True, on_reg_change=True,
+                 cpus=None):
+        '''With cpus, the registers are split across those secondaries, each sampling its share
+        against the common CNTPCT timebase, so that watching many registers does not lower the
+        sample rate. The pins are sampled by the first one. complete() merges the traces.'''
         self.u = u
         self.p = u.proxy
         self.iface = u.iface
-        self.cpu = cpu
+        self.cpus = list(cpus) if cpus is not None else [cpu]
+        self.cpu = self.cpus[0]
         self.base = 0
         if node is not None:
             self.base = u.adt[node].get_reg(0)[0]
@@ -23,11 +43,12 @@ class GPIOLogicAnalyzer(Reloadable):
         assert len(pins) <= 32
         assert div > 0
         self.div = div
-        self.cbuf = self.u.malloc(0x1000)
-        self.dbuf = None
+        self.cbufs = [self.u.malloc(0x1000) for cpu in self.cpus]
+        self.lanes = []
         self.on_pin_change = on_pin_change
         self.on_reg_change = on_reg_change
-        self.p.mmu_init_secondary(cpu)
+        for cpu in self.cpus:
+            self.p.mmu_init_secondary(cpu)
         self.tfreq = u.mrs(CNTFRQ_EL0)
 
     def load_regmap(self, regmap, skip=set(), regs=set()):
@@ -36,24 +57,88 @@ class GPIOLogicAnalyzer(Reloadable):
             if name not in skip and (not regs or name in regs):
                 self.regs[name] = base + addr, rcls
 
-    def start(self, ticks, bufsize=0x10000):
+    # Capture buffer layout: a control block shared with the sampler, the previous register values
+    # for the compact format, then the sample data (one buffer, or two halves when streaming)
+    CTL_STOP = 0x00
+    CTL_LEN = 0x08 # u64 per half, set by the sampler when it is full, cleared once drained
+    CTL_START = 0x18
+    CTL_TOTAL = 0x20
+    CTL_OVERFLOWS = 0x28
+    CTL_STATE = 0x40
+    HDR_SIZE = 0x140
+
+    def start(self, ticks, bufsize=0x10000, compact=False, stream=False):
+        '''Start sampling on the secondary CPU, for ticks samples (0 is unlimited when streaming)
+
+        compact: store a change mask and a timestamp delta per record followed by the pins and
+        registers that changed only, and record only when something changed. This implies
+        on_pin_change/on_reg_change, and allows fewer than 32 registers.
+
+        stream: split the buffer in two halves, the sampler fills one while poll() drains the
+        other, so the capture length is no longer limited by bufsize.
+
+        With several CPUs, every one of them gets its own buffer of bufsize.'''
         self.bufsize = bufsize
-        if self.dbuf:
-            self.u.free(self.dbuf)
-        self.dbuf = self.u.malloc(bufsize)
+        self.compact = compact
+        self.stream = stream
+        self._free_lanes()
+
+        regs = list(self.regs.items())
+        per_cpu = (len(regs) + len(self.cpus) - 1) // len(self.cpus)
+        for idx, (cpu, cbuf) in enumerate(zip(self.cpus, self.cbufs)):
+            lane_regs = dict(regs[idx * per_cpu:(idx + 1) * per_cpu])
+            if idx and not lane_regs:
+                break
+            lane = LALane(cpu, cbuf, self.pins if idx == 0 else {}, lane_regs,
+                          self.on_pin_change and idx == 0, self.on_reg_change)
+            if compact:
+                assert len(lane.regs) < 32
+            lane.dbuf = self.u.malloc(bufsize)
+            self.lanes.append(lane)
+
+        for lane in self.lanes:
+            self._start_lane(lane, ticks)
+
+    def _free_lanes(self):
+        for lane in self.lanes:
+            if lane.dbuf:
+                self.u.free(lane.dbuf)
+        self.lanes = []
+
+    def _start_lane(self, lane, ticks):
+        compact = self.compact
+        stream = self.stream
+        if compact:
+            maxrec = 12 + 4 * len(lane.regs)
+        else:
+            maxrec = 8 + 4 * len(lane.regs)
+        lane.half_size = self.bufsize - self.HDR_SIZE
+        if stream:
+            lane.half_size = (lane.half_size // 2) & ~15
+        assert lane.half_size > maxrec
 
         text = f"""
         trace:
             mov x16, x2
-            add x3, x3, x2
-            add x2, x2, #4
+            add x10, x16, #{self.HDR_SIZE}
+            mov x17, x3
+            add x3, x10, x17
+            sub x3, x3, #{maxrec}
+            mov x2, x10
             mov x12, #-8
-            mov x10, x2
             mov x6, #-1
             mov x7, #0
             ldr x8, ={self.base}
             mrs x4, CNTPCT_EL0
             isb
+            str x4, [x16, #{self.CTL_START}]
+        """
+        if compact:
+            text += f"""
+                mov x12, x4
+                add x14, x16, #{self.CTL_STATE}
+            """
+        text += f"""
         1:
             ldr w15, [x16]
             cmp w15, #1
@@ -69,19 +154,109 @@ class GPIOLogicAnalyzer(Reloadable):
                 b.lo 2b
             """
 
-        for idx, pin in enumerate(self.pins.values()):
+        for idx, pin in enumerate(lane.pins.values()):
             text += f"""
             ldr w9, [x8, #{pin * 4}]
             bfi x7, x9, #{idx}, #1
             """
 
-        if self.on_pin_change:
+        if compact:
+            text += self._compact_record(lane)
+        else:
+            text += self._record(lane)
+
+        full = "swap" if stream else "done"
+        text += f"""
+            cmp x2, x3
+            b.hs {full}
+        3:
+            sub x0, x0, #1
+            cbnz x0, 1b
+        done:
+        """
+        if stream:
+            text += f"""
+                sub x9, x2, x10
+                cbz x9, 5f
+                add x15, x16, #{self.HDR_SIZE}
+                cmp x10, x15
+                add x11, x16, #{self.CTL_LEN}
+                add x13, x16, #{self.CTL_LEN + 8}
+                csel x11, x11, x13, eq
+                ldr x15, [x16, #{self.CTL_TOTAL}]
+                add x15, x15, x9
+                str x15, [x16, #{self.CTL_TOTAL}]
+                stlr x9, [x11]
+            5:
+                ldr x0, [x16, #{self.CTL_TOTAL}]
+                ret
+
+            swap:
+                sub x9, x2, x10
+                add x15, x16, #{self.HDR_SIZE}
+                cmp x10, x15
+                add x11, x16, #{self.CTL_LEN}
+                add x13, x16, #{self.CTL_LEN + 8}
+                csel x11, x11, x13, eq
+                add x13, x15, x17
+                csel x10, x13, x15, eq
+                ldr x13, [x16, #{self.CTL_TOTAL}]
+                add x13, x13, x9
+                str x13, [x16, #{self.CTL_TOTAL}]
+                stlr x9, [x11]
+                add x13, x16, #{self.CTL_LEN}
+                add x15, x16, #{self.CTL_LEN + 8}
+                csel x11, x15, x13, eq
+                mov x2, x10
+                ldar x9, [x11]
+                cbz x9, 7f
+                ldr w15, [x16, #{self.CTL_OVERFLOWS}]
+                add w15, w15, #1
+                str w15, [x16, #{self.CTL_OVERFLOWS}]
+            6:
+                ldr w15, [x16]
+                cmp w15, #1
+                b.eq done
+                ldar x9, [x11]
+                cbnz x9, 6b
+            7:
+                add x3, x10, x17
+                sub x3, x3, #{maxrec}
+            """
+            # Fixed records compare against the previous one, which is in the other half now
+            if not compact:
+                text += f"""
+                    mov x12, #-8
+                """
+            text += f"""
+                b 3b
+            """
+        else:
+            text += f"""
+                sub x0, x2, x10
+                ret
+            """
+
+        code = asm.ARMAsm(text, lane.cbuf)
+        self.iface.writemem(lane.cbuf, code.data)
+        self.p.dc_cvau(lane.cbuf, len(code.data))
+        self.p.ic_ivau(lane.cbuf, len(code.data))
+
+        # Previous register values start out as -1, which no 32-bit read can match
+        self.iface.writemem(lane.dbuf, bytes(self.CTL_STATE) + b"\xff" * (self.HDR_SIZE - self.CTL_STATE))
+
+        self.p.smp_call(lane.cpu, code.trace | REGION_RX_EL1, ticks, self.div, lane.dbuf, lane.half_size)
+
+    def _record(self, lane):
+        '''Fixed records: timestamp, pins and every register'''
+        text = ""
+        if lane.on_pin_change:
             text += f"""
                 cmp x7, x6
                 b.eq 3f
                 mov x6, x7
             """
-        if self.on_reg_change:
+        if lane.on_reg_change:
             text += f"""
                 mov x11, x2
             """
@@ -90,13 +265,13 @@ class GPIOLogicAnalyzer(Reloadable):
             str w5, [x2], #4
             str w7, [x2], #4
         """
-        if self.on_reg_change:
+        if lane.on_reg_change:
             text += f"""
                 mov x13, #0
                 add x14, x12, #8
             """
 
-        for reg in self.regs.values():
+        for reg in lane.regs.values():
             if isinstance(reg, tuple):
                 reg = reg[0]
             text += f"""
@@ -104,7 +279,7 @@ class GPIOLogicAnalyzer(Reloadable):
                 ldr w9, [x9]
                 str w9, [x2], #4
             """
-            if self.on_reg_change:
+            if lane.on_reg_change:
                 text += f"""
                     eor w15, w9, #1
                     cmp x14, #0
@@ -115,7 +290,7 @@ class GPIOLogicAnalyzer(Reloadable):
                     orr w13, w13, w15
                 """
 
-        if self.on_reg_change:
+        if lane.on_reg_change:
             text += f"""
                 cmp x13, #0
                 b.ne 4f
@@ -126,40 +301,160 @@ class GPIOLogicAnalyzer(Reloadable):
             """
         text += f"""
             mov x12, x11
-            cmp x2, x3
-            b.hs done
-        3:
-            sub x0, x0, #1
-            cbnz x0, 1b
-        done:
-            sub x0, x2, x10
-            ret
         """
-        
-        code = asm.ARMAsm(text, self.cbuf)
-        self.iface.writemem(self.cbuf, code.data)
-        self.p.dc_cvau(self.cbuf, len(code.data))
-        self.p.ic_ivau(self.cbuf, len(code.data))
+        return text
+
+    def _compact_record(self, lane):
+        '''Compact records: change mask (bit 31 for the pins), ticks since the previous record,
+        then only what changed. A record with an empty mask is emitted before the delta would
+        overflow.'''
+        text = f"""
+            mov x11, x2
+            add x2, x2, #8
+            mov x13, #0
+            cmp x7, x6
+            b.eq 4f
+            mov x6, x7
+            orr w13, w13, #0x80000000
+            str w7, [x2], #4
+        4:
+        """
+        for idx, reg in enumerate(lane.regs.values()):
+            if isinstance(reg, tuple):
+                reg = reg[0]
+            text += f"""
+                ldr x9, ={reg}
+                ldr w9, [x9]
+                ldr x15, [x14, #{idx * 8}]
+                cmp x9, x15
+                b.eq 4f
+                str x9, [x14, #{idx * 8}]
+                orr w13, w13, #{1 << idx}
+                str w9, [x2], #4
+            4:
+            """
+        text += f"""
+            sub x9, x5, x12
+            lsr x15, x9, #31
+            cbnz x15, 4f
+            cbnz w13, 4f
+            mov x2, x11
+            b 3f
+        4:
+            str w13, [x11]
+            str w9, [x11, #4]
+            mov x12, x5
+        """
+        return text
 
-        self.p.write32(self.dbuf, 0)
+    def poll(self):
+        '''Drain the halves the samplers have filled so far, returns the number of bytes read'''
+        return sum(self._poll_lane(lane) for lane in self.lanes)
+
+    def _poll_lane(self, lane):
+        got = 0
+        while True:
+            slot = lane.dbuf + self.CTL_LEN + 8 * lane.next_half
+            size = self.p.read64(slot)
+            if not size:
+                return got
+            base = lane.dbuf + self.HDR_SIZE + lane.next_half * lane.half_size
+            lane.chunks.append(self.iface.readmem(base, size))
+            self.p.write64(slot, 0)
+            lane.next_half ^= 1
+            got += size
+
+    def capture(self, seconds, interval=0.05):
+        '''Stream for the given time, draining as it goes, then stop'''
+        end = time.time() + seconds
+        while time.time() < end:
+            if not self.poll():
+                time.sleep(interval)
+        self.complete()
 
-        self.p.smp_call(self.cpu, code.trace | REGION_RX_EL1, ticks, self.div, self.dbuf, bufsize - (8 + 4 * len(self.regs)))
-    
     def complete(self):
-        self.p.write32(self.dbuf, 1)
-        wrote = self.p.smp_wait(self.cpu)
-        assert wrote <= self.bufsize
-        data = self.iface.readmem(self.dbuf + 4, wrote)
-        self.u.free(self.dbuf)
-        self.dbuf = None
-        
-        stride = 2 + len(self.regs)
-        
+        for lane in self.lanes:
+            self.p.write32(lane.dbuf + self.CTL_STOP, 1)
+
+        self.overflows = 0
+        for lane in self.lanes:
+            wrote = self.p.smp_wait(lane.cpu)
+            if self.stream:
+                self._poll_lane(lane)
+                self.overflows += self.p.read32(lane.dbuf + self.CTL_OVERFLOWS)
+                data = b"".join(lane.chunks)
+                assert len(data) == wrote
+            else:
+                assert wrote <= lane.half_size
+                data = self.iface.readmem(lane.dbuf + self.HDR_SIZE, wrote)
+            start = self.p.read64(lane.dbuf + self.CTL_START)
+
+            if self.compact:
+                lane.samples = self._decode_compact(lane, data, start)
+            else:
+                lane.samples = self._decode(lane, data, start)
+
+        if self.overflows:
+            print(f"GPIOLogicAnalyzer: sampler waited for the host {self.overflows} times")
+
+        self.data = self._merge()
+        self._free_lanes()
+
+    def _decode(self, lane, data, ts):
+        stride = 2 + len(lane.regs)
+
         #chexdump(data)
-        
-        self.data = [struct.unpack("<" + "I" * stride,
-                                   data[i:i + 4 * stride])
-                     for i in range(0, len(data), 4 * stride)]
+
+        samples = []
+        for i in range(0, len(data), 4 * stride):
+            v = struct.unpack("<" + "I" * stride, data[i:i + 4 * stride])
+            # Records only hold the low half of CNTPCT, extend it from the start time
+            ts += (v[0] - ts) & 0xffffffff
+            samples.append((ts, *v[1:]))
+        return samples
+
+    def _decode_compact(self, lane, data, ts):
+        samples = []
+        pins = 0
+        regs = [0] * len(lane.regs)
+        pos = 0
+        while pos + 8 <= len(data):
+            mask, delta = struct.unpack_from("<II", data, pos)
+            pos += 8
+            ts += delta
+            if mask & (1 << 31):
+                pins, = struct.unpack_from("<I", data, pos)
+                pos += 4
+            for i in range(len(regs)):
+                if mask & (1 << i):
+                    regs[i], = struct.unpack_from("<I", data, pos)
+                    pos += 4
+            if mask:
+                samples.append((ts, pins, *regs))
+        return samples
+
+    def _merge(self):
+        '''Interleave the per-CPU traces by time, each sample carrying the latest value of every
+        pin and register'''
+        if len(self.lanes) == 1:
+            return self.lanes[0].samples
+
+        offsets = []
+        off = 0
+        for lane in self.lanes:
+            offsets.append(off)
+            off += len(lane.regs)
+
+        events = sorted((s[0], idx, s) for idx, lane in enumerate(self.lanes) for s in lane.samples)
+        pins = 0
+        regs = [0] * off
+        data = []
+        for ts, idx, sample in events:
+            if idx == 0:
+                pins = sample[1]
+            regs[offsets[idx]:offsets[idx] + len(sample) - 2] = sample[2:]
+            data.append((ts, pins, *regs))
+        return data
 
     def vcd(self):
         off = self.data[0][0]
@@ -211,7 +506,7 @@ $dumpvars
             ts = v[0]
             val = v[1]
             regs = v[2:]
-            ts = ((ts - off) & 0xffffffff) - off2
+            ts = (ts - off) - off2
             ns = max(0, 1000000000 * ts // self.tfreq)
             vcd.append(f"#{ns}\n")
             vcd.append("\n".join(f"{(val>>i) & 1}{k}" for i, k in enumerate(keys)) + "\n")
@@ -1,10 +1,10 @@
 # SPDX-License-Identifier: MIT
-import io, sys, traceback, struct, array, bisect, os, plistlib, signal, runpy
+import io, sys, traceback, struct, array, itertools, os, plistlib, signal, runpy
 from construct import *
 
 from ..asm import ARMAsm
 from ..tgtypes import *
-from ..proxy import IODEV, START, EVENT, EXC, EXC_RET, ExcInfo
+from ..proxy import IODEV, START, EVENT, TRACE_BATCH, EXC, EXC_RET, ExcInfo
 from ..utils import *
 from ..sysreg import *
 from ..macho import MachO
@@ -13,9 +13,79 @@ from .. import xnutools, shell
 
 from .gdbserver import *
 from .types import *
+from .tracelog import *
+from .tracelog import TRACE_EVENTS
 
 __all__ = ["HV"]
 
+class ShadowRegs:
+    '''A register block whose cached words are served from a device-side shadow at EL2.
+
+    Words not (yet) cached go to the host hook like any SYNC/HOOK tracer, or straight to the
+    hardware with forward_host=False. Offsets are byte offsets into the block, 4-byte aligned.'''
+    def __init__(self, hv, start, size, forward_host=True, absorb_writes=False, hook_id=0):
+        self.hv = hv
+        self.start = start
+        self.size = size
+        self.flags = ShadowRegsFlags(FORWARD_HOST=int(forward_host),
+                                     ABSORB_WRITES=int(absorb_writes))
+        self.hook_id = hook_id
+        self.bitmap = bytearray(align_up(size // 4, 32) // 8)
+        self.shadow = hv.u.heap.memalign(64, size)
+        self.cached = hv.u.heap.memalign(64, len(self.bitmap))
+        hv.iface.writemem(self.cached, bytes(self.bitmap))
+        self.index = None
+
+    def apply(self):
+        regs = HVShadowRegs.build({
+            "start": self.start,
+            "end": self.start + self.size,
+            "shadow": self.shadow,
+            "cached": self.cached,
+            "flags": self.flags,
+            "hook_id": self.hook_id,
+        })
+        with self.hv.u.heap.guarded_malloc(len(regs)) as buf:
+            self.hv.iface.writemem(buf, regs)
+            self.index = self.hv.p.hv_add_shadow_regs(buf)
+        if self.index < 0:
+            raise Exception(f"Failed to add shadow regs at {self.start:#x}")
+
+    def update(self, values, cache=True):
+        '''Write {offset: u32} into the shadow in one go per contiguous run, then mark them cached
+
+        The values land before the cached bits, so the guest never reads a stale shadow word.'''
+        offs = sorted(values)
+        i = 0
+        while i < len(offs):
+            j = i
+            while j + 1 < len(offs) and offs[j + 1] == offs[j] + 4:
+                j += 1
+            data = struct.pack(f"<{j - i + 1}I", *(values[o] for o in offs[i:j + 1]))
+            self.hv.iface.writemem(self.shadow + offs[i], data)
+            i = j + 1
+        if cache:
+            self.set_cached(offs)
+
+    def set_cached(self, offsets, cached=True):
+        for off in offsets:
+            assert 0 <= off < self.size and not off & 3
+            word = off // 4
+            if cached:
+                self.bitmap[word // 8] |= 1 << (word % 8)
+            else:
+                self.bitmap[word // 8] &= ~(1 << (word % 8))
+        self.hv.iface.writemem(self.cached, bytes(self.bitmap))
+
+    def read(self, off, count=1):
+        '''Current shadow contents (including guest writes to cached words)'''
+        return struct.unpack(f"<{count}I", self.hv.iface.readmem(self.shadow + off, 4 * count))
+
+    def counts(self):
+        '''(accesses served from the shadow, accesses forwarded)'''
+        return (self.hv.p.hv_get_shadow_regs_count(self.index, False),
+                self.hv.p.hv_get_shadow_regs_count(self.index, True))
+
 class HV(Reloadable):
     PAC_MASK = 0xfffff00000000000
 
@@ -71,6 +141,14 @@ class HV(Reloadable):
 
     AIC_EVT_TYPE_HW = 1
     IRQTRACE_IRQ = 1
+    IRQTRACE_COUNT = 2
+    IRQTRACE_DROP = 4   # Never deliver to the guest, handled on-device
+    IRQTRACE_DELAY = 8  # Hold back for the time set with set_irq_delay()
+    IRQ_COUNTER_SLOTS = 64
+    MAX_CPUS = 20
+
+    MAP_BATCH_MAX = 512
+    VA_BUF_SIZE = 0x40000
 
     def __init__(self, iface, proxy, utils):
         self.iface = iface
@@ -83,11 +161,13 @@ class HV(Reloadable):
         self.vectors = [None]
         self._bps = [None, None, None, None, None]
         self._bp_hooks = dict()
+        self._async_bps = 0
         self._wps = [None, None, None, None]
         self._wpcs = [0, 0, 0, 0]
         self.sym_offset = 0
-        self.symbols = []
+        self.symbols = SymbolTable()
         self.symbol_dict = {}
+        self.kexts = set()
         self.sysreg = {0: {}}
         self.novm = False
         self._in_handler = False
@@ -95,14 +175,26 @@ class HV(Reloadable):
         self._in_shell = False
         self._gdbserver = None
         self.vm_hooks = [None]
+        self.shadow_regs = []
         self.interrupt_map = {}
         self.mmio_maps = DictRangeMap()
         self.dirty_maps = BoolRangeMap()
+        self.map_batch = None
+        self.map_batch_buf = None
+        self.dirty_range = None
+        self.va_buf = None
+        self.profile_flags = 0
+        self.profile_samples = {}
+        self.pmu_counters = []
+        self.pmu_samples = {}
         self.tracer_caches = {}
+        self.trace_log = None
         self.shell_locals = {}
         self.xnu_mode = False
         self._update_shell_locals()
         self.wdt_cpu = None
+        # Report guest exits slower than this (in us) from the watchdog CPU, 0 to disable
+        self.wdt_slow_usec = 0
         self.smp = True
         self.hook_exceptions = False
         self.started_cpus = set()
@@ -146,8 +238,29 @@ class HV(Reloadable):
             if self.print_tracer.log_file:
                 print("# " + s, *args, file=self.print_tracer.log_file, **kwargs)
 
+    def hv_map(self, ipa, to, size, incr):
+        if self.map_batch is not None:
+            self.map_batch.append((ipa, to, size, incr))
+        else:
+            assert self.p.hv_map(ipa, to, size, incr) >= 0
+
+    def flush_map_batch(self):
+        '''apply the queued hv_map() calls, MAP_BATCH_MAX at a time with one TLB flush each'''
+        batch, self.map_batch = self.map_batch, None
+        if not batch:
+            return
+
+        if self.map_batch_buf is None:
+            self.map_batch_buf = self.u.malloc(self.MAP_BATCH_MAX * 32)
+
+        for i in range(0, len(batch), self.MAP_BATCH_MAX):
+            chunk = batch[i:i + self.MAP_BATCH_MAX]
+            data = b"".join(struct.pack("<4Q", *desc) for desc in chunk)
+            self.iface.writemem(self.map_batch_buf, data)
+            assert self.p.hv_map_batch(self.map_batch_buf, len(chunk)) >= 0
+
     def unmap(self, ipa, size):
-        assert self.p.hv_map(ipa, 0, size, 0) >= 0
+        self.hv_map(ipa, 0, size, 0)
 
     def map_hw(self, ipa, pa, size):
         '''map IPA (Intermediate Physical Address) to actual PA'''
@@ -168,20 +281,293 @@ class HV(Reloadable):
         size_p = align_down(size)
         if size_p > 0:
             #print(f"map_hw real {ipa_p:#x} -> {pa:#x} [{size_p:#x}]")
-            assert self.p.hv_map(ipa_p, pa | self.PTE_ATTRIBUTES | self.PTE_VALID, size_p, 1) >= 0
+            self.hv_map(ipa_p, pa | self.PTE_ATTRIBUTES | self.PTE_VALID, size_p, 1)
 
         if size_p != size:
             self.map_sw(ipa_p + size_p, pa + size_p, size - size_p)
 
     def map_sw(self, ipa, pa, size):
         #print(f"map_sw {ipa:#x} -> {pa:#x} [{size:#x}]")
-        assert self.p.hv_map(ipa, pa | self.SPTE_MAP, size, 1) >= 0
+        self.hv_map(ipa, pa | self.SPTE_MAP, size, 1)
+
+    def map_hook(self, ipa, size, read=None, write=None, native=None, value=0, mask=0, **kwargs):
+        if native is not None:
+            assert read is None and write is None
+            return self.map_native_hook(ipa, size, native, value, mask)
 
-    def map_hook(self, ipa, size, read=None, write=None, **kwargs):
         index = len(self.vm_hooks)
         self.vm_hooks.append((read, write, ipa, kwargs))
         self.map_hook_idx(ipa, size, index, read is not None, write is not None)
 
+    def map_native_hook(self, ipa, size, kind, value=0, mask=0):
+        '''Map a hook that is handled by m1n1 itself, without a round trip to the host.
+
+        CONST returns value on reads and discards writes, SHADOW stores writes and returns
+        them on reads (starting at value), MASK forces the mask bits to value on writes,
+        and COUNT just passes through. All of them count accesses.'''
+        hook = HVNativeHook.build({
+            "start": ipa,
+            "end": ipa + size,
+            "type": NativeHook(kind),
+            "value": value,
+            "mask": mask,
+        })
+        with self.u.heap.guarded_malloc(len(hook)) as buf:
+            self.iface.writemem(buf, hook)
+            idx = self.p.hv_add_native_hook(buf)
+        if idx < 0:
+            raise Exception(f"Failed to add native hook at {ipa:#x}")
+        return idx
+
+    def native_hook_counts(self, idx):
+        return (self.p.hv_get_native_hook_count(idx, False),
+                self.p.hv_get_native_hook_count(idx, True))
+
+    @staticmethod
+    def _sysreg_iss(enc):
+        op0, op1, CRn, CRm, op2 = enc
+        return (op0 << 20) | (op2 << 17) | (op1 << 14) | (CRn << 10) | (CRm << 1)
+
+    def emulate_sysreg(self, reg, kind, value=0):
+        '''Handle traps of a sysreg in m1n1 instead of forwarding them here.
+
+        PASS accesses the register (or its MSR_REDIRECTS target), CONST returns value on reads
+        and discards writes, SHADOW keeps a per-CPU copy starting at value, WI passes reads
+        through and discards writes, and LOG is PASS with every access printed by m1n1.
+        Registers m1n1 already handles itself are not affected.'''
+        enc = sysreg_parse(reg)
+        emu = HVSysregEmu.build({
+            "sysreg": self._sysreg_iss(enc),
+            "target": self._sysreg_iss(self.MSR_REDIRECTS.get(enc, enc)),
+            "type": SysregEmu(kind),
+            "value": value,
+        })
+        with self.u.heap.guarded_malloc(len(emu)) as buf:
+            self.iface.writemem(buf, emu)
+            idx = self.p.hv_add_sysreg_emu(buf)
+        if idx < 0:
+            raise Exception(f"Failed to emulate {sysreg_name(enc)}")
+        return idx
+
+    def clear_sysreg_emulation(self):
+        self.p.hv_clear_sysreg_emu()
+
+    def get_stats(self, cpu, reset=False):
+        with self.u.heap.guarded_malloc(HVStats.sizeof()) as buf:
+            if self.p.hv_get_stats(cpu, buf, HVStats.sizeof(), reset) < 0:
+                raise Exception(f"Failed to get HV stats for CPU {cpu}")
+            return HVStats.parse(self.iface.readmem(buf, HVStats.sizeof()))
+
+    def stats(self, cpus=None, reset=False, top=10):
+        '''Print exit counts and latencies for the given CPUs (default: all started CPUs)'''
+        if cpus is None:
+            cpus = sorted(self.started_cpus)
+        elif isinstance(cpus, int):
+            cpus = [cpus]
+
+        tps = self.u.mrs(CNTFRQ_EL0) / 1000000
+        spte_names = ["MAP", "HOOK", "PROXY_HOOK_R", "PROXY_HOOK_W", "PROXY_HOOK_RW"]
+
+        def hist(h):
+            return " ".join(f"<{(2 << i) / tps:.3g}us:{n}" for i, n in enumerate(h) if n)
+
+        for cpu in cpus:
+            s = self.get_stats(cpu, reset)
+            exits = sum(s.sync_exits) + s.irq_exits + s.fiq_exits + s.serr_exits
+            print(f"CPU {cpu}: {exits} exits, {s.exit_ticks / tps:.0f}us in HV, "
+                  f"{s.fiq_fast_exits} fast ticks")
+            print(f"  exit latency: {hist(s.exit_hist)}")
+            print(f"  proxy: {s.proxy_calls} calls, {s.proxy_ticks / tps:.0f}us")
+            print(f"  proxy latency: {hist(s.proxy_hist)}")
+
+            sync = sorted(((n, ec) for ec, n in enumerate(s.sync_exits) if n), reverse=True)
+            for n, ec in sync[:top]:
+                try:
+                    name = ESR_EC(ec).name
+                except ValueError:
+                    name = f"EC {ec:#x}"
+                print(f"  {name:>16}: {n}")
+            print(f"  {'IRQ':>16}: {s.irq_exits}")
+            print(f"  {'FIQ':>16}: {s.fiq_exits}")
+            print(f"  {'SERROR':>16}: {s.serr_exits}")
+
+            for t, n in enumerate(s.dabort_spte):
+                if n:
+                    name = spte_names[t] if t < len(spte_names) else f"type {t}"
+                    print(f"  dabort {name:>16}: {n}")
+
+            msrs = sorted(((m.count, m.sysreg) for m in s.msr if m.count), reverse=True)
+            for n, reg in msrs[:top]:
+                iss = ESR_ISS_MSR(reg)
+                name = sysreg_name((iss.Op0, iss.Op1, iss.CRn, iss.CRm, iss.Op2))
+                print(f"  msr {name:>24}: {n}")
+            if s.msr_other:
+                print(f"  msr {'(other)':>24}: {s.msr_other}")
+
+        if cpus:
+            print(f"Stolen time: {s.stolen_ticks / tps:.0f}us")
+
+    PROFILE_LR = 1
+    PROFILE_SP = 2
+    PROFILE_FETCH_SIZE = 0x10000
+
+    def profile_start(self, rate=1000, lr=False, sp=False, size=0x40000):
+        '''Sample the guest PC on every CPU at rate Hz, into per-CPU buffers of size bytes'''
+        self.profile_flags = (self.PROFILE_LR if lr else 0) | (self.PROFILE_SP if sp else 0)
+        if self.p.hv_profile_start(rate, self.profile_flags, size) < 0:
+            raise ValueError(f"Failed to start profiling at {rate} Hz")
+        self.profile_samples = {}
+
+    def profile_stop(self):
+        self.p.hv_profile_stop()
+
+    def profile_fetch(self):
+        '''Drain the sample buffers, returns {cpu: [(pc, lr, sp), ...]} with None for the parts
+        that were not sampled. Samples also accumulate in self.profile_samples.'''
+        words = 1 + bin(self.profile_flags).count("1")
+        out = {}
+        with self.u.heap.guarded_malloc(self.PROFILE_FETCH_SIZE) as buf:
+            for cpu in sorted(self.started_cpus):
+                data = b""
+                while True:
+                    n = self.p.hv_profile_fetch(cpu, buf, self.PROFILE_FETCH_SIZE)
+                    if n <= 0:
+                        break
+                    data += self.iface.readmem(buf, n)
+                    if n < self.PROFILE_FETCH_SIZE - self.PROFILE_FETCH_SIZE % (words * 8):
+                        break
+
+                samples = []
+                for vals in struct.iter_unpack(f"<{words}Q", data):
+                    vals = list(vals)
+                    pc = vals.pop(0)
+                    lr = vals.pop(0) if self.profile_flags & self.PROFILE_LR else None
+                    sp = vals.pop(0) if self.profile_flags & self.PROFILE_SP else None
+                    samples.append((pc, lr, sp))
+                if samples:
+                    out[cpu] = samples
+                    self.profile_samples.setdefault(cpu, []).extend(samples)
+        return out
+
+    def profile_report(self, top=30, cpus=None):
+        '''Print the hottest symbols over everything fetched since profile_start()'''
+        self.profile_fetch()
+        hits = {}
+        total = 0
+        for cpu, samples in self.profile_samples.items():
+            if cpus is not None and cpu not in cpus:
+                continue
+            for pc, lr, sp in samples:
+                _, name = self.sym(pc)
+                key = name or f"{pc:#x}"
+                hits[key] = hits.get(key, 0) + 1
+                total += 1
+
+        print(f"{total} samples")
+        for key, n in sorted(hits.items(), key=lambda i: i[1], reverse=True)[:top]:
+            print(f"  {100 * n / total:5.1f}% {n:8d} {key}")
+
+    # Event numbers from the Linux Apple M1 PMU driver, PMC0 and PMC1 are fixed
+    PMU_EVENTS = {
+        "retire_uop": 0x01,
+        "cycles": 0x02,
+        "l1i_tlb_fill": 0x04,
+        "l1d_tlb_fill": 0x05,
+        "mmu_table_walk_instruction": 0x07,
+        "mmu_table_walk_data": 0x08,
+        "l2_tlb_miss_instruction": 0x0a,
+        "l2_tlb_miss_data": 0x0b,
+        "instructions": 0x8c,
+        "inst_branch": 0x8d,
+        "l1d_cache_miss_ld": 0xbf,
+        "l1d_cache_miss_st": 0xc0,
+        "l1d_tlb_miss": 0xc1,
+        "branch_mispred": 0xcb,
+        "l1i_cache_miss": 0xd3,
+        "l1i_tlb_miss": 0xd4,
+    }
+    PMU_FETCH_SIZE = 0x10000
+
+    def pmu_start(self, sample="cycles", period=1000000, events=(), el0=True, el1=True,
+                  size=0x40000):
+        '''Take over the PMU on every CPU and sample the guest PC every period counts of sample.
+
+        PMC0 counts cycles and PMC1 instructions, events (names from PMU_EVENTS or raw numbers)
+        go to PMC2 onwards in order. sample is "cycles", "instructions" or one of events.'''
+        names = ["cycles", "instructions"]
+        cfg_events = [0] * 10
+        for i, ev in enumerate(events):
+            if i + 2 >= 10:
+                raise ValueError("Too many PMU events")
+            name = ev if isinstance(ev, str) else f"event_{ev:#x}"
+            cfg_events[i + 2] = self.PMU_EVENTS[ev] if isinstance(ev, str) else ev
+            names.append(name)
+
+        if sample not in names:
+            raise ValueError(f"Sampled event {sample} is not counted")
+        periods = [0] * 10
+        periods[names.index(sample)] = period
+
+        with self.u.heap.guarded_malloc(HVPMUConfig.sizeof()) as buf:
+            self.iface.writemem(buf, HVPMUConfig.build({
+                "counters": (1 << len(names)) - 1,
+                "flags": (1 if el0 else 0) | (2 if el1 else 0),
+                "events": cfg_events,
+                "period": periods,
+                "size": size,
+            }))
+            if self.p.hv_pmu_start(buf) < 0:
+                raise ValueError("Failed to start PMU sampling")
+
+        self.pmu_counters = names
+        self.pmu_samples = {}
+
+    def pmu_stop(self):
+        self.p.hv_pmu_stop()
+
+    def pmu_fetch(self):
+        '''Drain the PMU sample buffers, returns {cpu: [(pc, overflow, {counter: value}), ...]}
+        with the raw counter values at each PMI. Samples also accumulate in self.pmu_samples.'''
+        words = 2 + len(self.pmu_counters)
+        out = {}
+        with self.u.heap.guarded_malloc(self.PMU_FETCH_SIZE) as buf:
+            for cpu in sorted(self.started_cpus):
+                data = b""
+                while True:
+                    n = self.p.hv_pmu_fetch(cpu, buf, self.PMU_FETCH_SIZE)
+                    if n <= 0:
+                        break
+                    data += self.iface.readmem(buf, n)
+                    if n < self.PMU_FETCH_SIZE - self.PMU_FETCH_SIZE % (words * 8):
+                        break
+
+                samples = []
+                for vals in struct.iter_unpack(f"<{words}Q", data):
+                    pc, overflow = vals[:2]
+                    samples.append((pc, overflow, dict(zip(self.pmu_counters, vals[2:]))))
+                if samples:
+                    out[cpu] = samples
+                    self.pmu_samples.setdefault(cpu, []).extend(samples)
+        return out
+
+    def pmu_report(self, top=30, cpus=None):
+        '''Print the symbols with the most PMIs over everything fetched since pmu_start()'''
+        self.pmu_fetch()
+        hits = {}
+        total = 0
+        for cpu, samples in self.pmu_samples.items():
+            if cpus is not None and cpu not in cpus:
+                continue
+            for pc, overflow, counters in samples:
+                _, name = self.sym(pc)
+                key = name or f"{pc:#x}"
+                hits[key] = hits.get(key, 0) + 1
+                total += 1
+
+        print(f"{total} PMIs")
+        for key, n in sorted(hits.items(), key=lambda i: i[1], reverse=True)[:top]:
+            print(f"  {100 * n / total:5.1f}% {n:8d} {key}")
+
     def map_hook_idx(self, ipa, size, index, read=False, write=False, flags=0):
         if read:
             if write:
@@ -193,50 +579,84 @@ class HV(Reloadable):
         else:
             assert False
 
-        assert self.p.hv_map(ipa, (index << 2) | flags | t, size, 0) >= 0
+        self.hv_map(ipa, (index << 2) | flags | t, size, 0)
+
+    def snapshot_start(self, base, size):
+        '''Start tracking guest writes to the IPA range [base, base + size)'''
+        if self.p.hv_dirty_start(base, size) < 0:
+            raise Exception(f"Failed to start dirty tracking for {base:#x}+{size:#x}")
+        self.dirty_range = (base, size)
+
+    def snapshot_dirty(self, rearm=True):
+        '''IPAs of the pages written since snapshot_start(), or since the last call with rearm'''
+        base, size = self.dirty_range
+        npages = size // 0x4000
+        bmsize = align_up(npages, 64) // 8
+
+        with self.u.heap.guarded_malloc(bmsize) as buf:
+            if self.p.hv_dirty_fetch(buf, bmsize, rearm) < 0:
+                raise Exception("Dirty tracking is not active")
+            bitmap = self.iface.readmem(buf, bmsize)
+
+        pages = []
+        for i, b in enumerate(bitmap):
+            for bit in range(8):
+                if b & (1 << bit):
+                    pages.append(base + (i * 8 + bit) * 0x4000)
+        return pages
+
+    def snapshot_read(self, pages=None):
+        '''Read the given (by default, the dirty) guest pages. Guest RAM is identity mapped.'''
+        if pages is None:
+            pages = self.snapshot_dirty()
+        return {ipa: self.iface.readmem(ipa, 0x4000) for ipa in pages}
+
+    def snapshot_stop(self):
+        self.p.hv_dirty_stop()
+        self.dirty_range = None
+
+    def va_buffer(self):
+        if self.va_buf is None:
+            self.va_buf = self.u.malloc(self.VA_BUF_SIZE)
+        return self.va_buf
 
     def readmem(self, va, size):
         '''read from virtual memory'''
+        # The device translates and gathers the pages, so each chunk is one op and one read
+        buf = self.va_buffer()
         with io.BytesIO() as buffer:
             while size > 0:
-                pa = self.p.hv_translate(va, False, False)
-                if pa == 0:
+                chunk = min(size, self.VA_BUF_SIZE)
+                done = self.p.hv_read_va(buf, va, chunk)
+                if done:
+                    buffer.write(self.iface.readmem(buf, done))
+                if done < chunk:
                     break
 
-                size_in_page = 4096 - (va % 4096)
-                if size < size_in_page:
-                    buffer.write(self.iface.readmem(pa, size))
-                    break
-
-                buffer.write(self.iface.readmem(pa, size_in_page))
-                va += size_in_page
-                size -= size_in_page
+                va += chunk
+                size -= chunk
 
             return buffer.getvalue()
 
     def writemem(self, va, data):
         '''write to virtual memory'''
+        buf = self.va_buffer()
         written = 0
         while written < len(data):
-            pa = self.p.hv_translate(va, False, True)
-            if pa == 0:
-                break
-
-            size_in_page = 4096 - (va % 4096)
-            if len(data) - written < size_in_page:
-                self.iface.writemem(pa, data[written:])
-                written = len(data)
+            chunk = min(len(data) - written, self.VA_BUF_SIZE)
+            self.iface.writemem(buf, data[written:written + chunk])
+            done = self.p.hv_write_va(va, buf, chunk)
+            written += done
+            if done < chunk:
                 break
 
-            self.iface.writemem(pa, data[written:written + size_in_page])
-            va += size_in_page
-            written += size_in_page
+            va += chunk
 
         return written
 
     def trace_irq(self, device, num, count, flags):
         for n in range(num, num + count):
-            if flags & self.IRQTRACE_IRQ:
+            if flags:
                 self.interrupt_map[n] = device
             else:
                 self.interrupt_map.pop(n, None)
@@ -250,6 +670,29 @@ class HV(Reloadable):
 
         assert self.p.hv_trace_irq(self.AIC_EVT_TYPE_HW, num, count, flags) > 0
 
+    def set_irq_delay(self, usec):
+        self.p.hv_set_irq_delay(usec)
+
+    def irq_counters(self, reset=False):
+        '''Print the IRQs traced with IRQTRACE_COUNT: hits, span and shortest gap between hits'''
+        size = self.IRQ_COUNTER_SLOTS * HVIRQCounter.sizeof()
+        with self.u.heap.guarded_malloc(size) as buf:
+            count = self.p.hv_irq_counters_fetch(buf, size, reset)
+            if count < 0:
+                raise Exception("Failed to fetch IRQ counters")
+            data = self.iface.readmem(buf, count * HVIRQCounter.sizeof())
+
+        tps = self.u.mrs(CNTFRQ_EL0) / 1000000
+        for i in range(count):
+            c = HVIRQCounter.parse(data[i * HVIRQCounter.sizeof():])
+            dev = self.interrupt_map.get(c.num, "?")
+            if not c.count:
+                print(f"IRQ {c.num:4d} ({dev}): no hits")
+                continue
+            span = (c.last - c.first) / tps
+            gap = f"{c.min_delta / tps:.1f}us" if c.count > 1 else "-"
+            print(f"IRQ {c.num:4d} ({dev}): {c.count} hits over {span:.1f}us, min gap {gap}")
+
     def add_tracer(self, zone, ident, mode=TraceMode.ASYNC, read=None, write=None, **kwargs):
         assert mode in (TraceMode.RESERVED, TraceMode.OFF, TraceMode.BYPASS) or read or write
         self.mmio_maps[zone, ident] = (mode, ident, read, write, kwargs)
@@ -285,6 +728,67 @@ class HV(Reloadable):
         else:
             self.del_tracer(zone, "PrintTracer")
 
+    def add_trace_filter(self, zone, read=True, write=True, offset_mask=0, offset_match=0,
+                         value_mask=0, value_match=0, on_change=False, min_interval_us=0):
+        '''Filter traced accesses in zone on the m1n1 side.
+
+        Once any filter covers an address, only accesses matching one of the covering
+        filters are traced.'''
+        filt = HVTraceFilter.build({
+            "start": zone.start,
+            "end": zone.stop,
+            "offset_mask": offset_mask,
+            "offset_match": offset_match,
+            "value_mask": value_mask,
+            "value_match": value_match,
+            "flags": TraceFilterFlags(READ=int(read), WRITE=int(write), ON_CHANGE=int(on_change)),
+            "min_interval_us": min_interval_us,
+        })
+        with self.u.heap.guarded_malloc(len(filt)) as buf:
+            self.iface.writemem(buf, filt)
+            idx = self.p.hv_add_trace_filter(buf)
+        if idx < 0:
+            raise Exception(f"Failed to add trace filter for {zone.start:#x}..{zone.stop:#x}")
+        return idx
+
+    def clear_trace_filters(self):
+        self.p.hv_clear_trace_filters()
+
+    def set_trace_budget(self, max_faults, sample_every=16, cooldown_ms=1000, hw=False):
+        '''Demote traced pages taking more than max_faults faults/s for cooldown_ms.
+
+        Demoted pages only trace every sample_every-th access (none if 0), or with hw=True get
+        mapped straight through if they are plain whole-page maps. max_faults=0 turns it off.'''
+        budget = HVTraceBudget.build({
+            "max_faults": max_faults,
+            "sample_every": sample_every,
+            "cooldown_ms": cooldown_ms,
+            "flags": TraceBudgetFlags(HW=int(hw)),
+        })
+        with self.u.heap.guarded_malloc(len(budget)) as buf:
+            self.iface.writemem(buf, budget)
+            self.p.hv_set_trace_budget(buf)
+
+    def add_shadow_regs(self, zone, values=None, forward_host=True, absorb_writes=False):
+        '''Back zone with a device-side shadow; values ({offset: u32}) start out cached.
+
+        Meant for SYNC/HOOK traced devices: reads of cached words no longer exit to the host.
+        The mapping is put back whenever pt_update() remaps any of the zone.'''
+        regs = ShadowRegs(self, zone.start, zone.stop - zone.start, forward_host, absorb_writes)
+        if values:
+            regs.update(values)
+        regs.apply()
+        self.shadow_regs.append(regs)
+        return regs
+
+    def handle_trace_demote(self, data):
+        evt = EvtTraceDemote.parse(data)
+        mode = TraceDemoteMode(evt.mode)
+        if mode == TraceDemoteMode.NONE:
+            self.log(f"Tracing of page {evt.addr:#x} restored ({evt.faults} sampled faults)")
+        else:
+            self.log(f"Page {evt.addr:#x} is hot ({evt.faults} faults/s), demoted to {mode.name}")
+
     def pt_update(self):
         if not self.dirty_maps:
             return
@@ -292,6 +796,22 @@ class HV(Reloadable):
         self.dirty_maps.compact()
         self.mmio_maps.compact()
 
+        # Queue every hv_map() and send them in a few batches, each with a single TLB flush
+        self.map_batch = []
+        try:
+            self._pt_update_zones()
+        finally:
+            self.flush_map_batch()
+
+        # Shadowed blocks sit on top of whatever tracer mapping was just redone
+        for regs in self.shadow_regs:
+            if any(z.start < regs.start + regs.size and regs.start < z.stop
+                   for z in self.dirty_maps):
+                regs.apply()
+
+        self.dirty_maps.clear()
+
+    def _pt_update_zones(self):
         top = 0
 
         for zone in self.dirty_maps:
@@ -355,9 +875,6 @@ class HV(Reloadable):
                 self.unmap(top, zone.stop - top)
                 self.log(f"PT[{top:09x}:{zone.stop:09x}] -> *UNMAPPED*")
 
-        self.u.inst(0xd50c83df) # tlbi vmalls12e1is
-        self.dirty_maps.clear()
-
     def shellwrap(self, func, description, update=None, needs_ret=False):
 
         while True:
@@ -431,9 +948,55 @@ class HV(Reloadable):
         self._gdbserver.shutdown()
         self._gdbserver = None
 
+    def capture_trace(self, path, live=False):
+        '''Write MMIO/IRQ trace events to a raw log at path, see tools/trace_replay.py.
+
+        With live=False the events are not decoded here at all, so the trace rate is only
+        limited by the link. The ADT is saved as path.adt for the replay.'''
+        if self.trace_log is not None:
+            self.stop_capture()
+
+        with open(str(path) + ".adt", "wb") as fd:
+            fd.write(self.adt.build())
+
+        self.trace_log = TraceLogWriter(path)
+        for event_id in TRACE_EVENTS:
+            write = self.trace_log.handler(event_id)
+            if live:
+                decode = self.iface.evt_handlers[event_id]
+                def handler(data, write=write, decode=decode):
+                    write(data)
+                    decode(data)
+                self.iface.set_event_handler(event_id, handler)
+            else:
+                self.iface.set_event_handler(event_id, write)
+
+    def stop_capture(self):
+        if self.trace_log is None:
+            return
+        log = self.trace_log
+        self.trace_log = None
+        self.iface.set_event_handler(EVENT.MMIOTRACE, self.handle_mmiotrace)
+        self.iface.set_event_handler(EVENT.MMIOTRACE_BATCH, self.handle_mmiotrace_batch)
+        self.iface.set_event_handler(EVENT.IRQTRACE, self.handle_irqtrace)
+        self.iface.set_event_handler(EVENT.IRQTRACE_BATCH, self.handle_irqtrace_batch)
+        log.close()
+        self.log(f"Trace capture: {log.frames} events, {log.bytes} bytes written to {log.path}")
+
     def handle_mmiotrace(self, data):
-        evt = EvtMMIOTrace.parse(data)
+        self.handle_mmiotrace_evt(EvtMMIOTrace.parse(data))
+
+    def handle_mmiotrace_batch(self, data):
+        hdr = EvtMMIOTraceBatch.parse(data)
+        if hdr.dropped:
+            self.log(f"!! MMIO trace batch overflowed, {hdr.dropped} events dropped")
 
+        off = EvtMMIOTraceBatch.sizeof()
+        size = EvtMMIOTrace.sizeof()
+        for i in range(hdr.count):
+            self.handle_mmiotrace_evt(EvtMMIOTrace.parse(data[off + i * size:off + (i + 1) * size]))
+
+    def handle_mmiotrace_evt(self, evt):
         def do_update():
             nonlocal mode, ident, read, write, kwargs
             read = lambda *args, **kwargs: None
@@ -565,6 +1128,30 @@ class HV(Reloadable):
 
         return True
 
+    def handle_pending_exits(self):
+        '''Answer MMIO hook exits that other CPUs parked while this one owned the proxy'''
+        size = self.MAX_CPUS * HVPendingExit.sizeof()
+        with self.u.heap.guarded_malloc(size) as buf:
+            count = self.p.hv_get_pending_exits(buf, size)
+            if count <= 0:
+                return
+            data = self.iface.readmem(buf, count * HVPendingExit.sizeof())
+
+        for i in range(count):
+            e = HVPendingExit.parse(data[i * HVPendingExit.sizeof():])
+            if e.reason != START.HV or e.code != HV_EVENT.HOOK_VM:
+                continue
+
+            # Anything that goes wrong here is left for that CPU to bring to the proxy itself
+            try:
+                ctx = self.iface.readstruct(e.info, ExcInfo)
+                if not self.handle_vm_hook(ctx):
+                    continue
+            except Exception:
+                continue
+
+            self.p.hv_resolve_exit(e.cpu, EXC_RET.HANDLED)
+
     def handle_vm_hook(self, ctx):
         data = self.iface.readstruct(ctx.data, VMProxyHookData)
 
@@ -588,13 +1175,38 @@ class HV(Reloadable):
 
         return True
 
-    def handle_irqtrace(self, data):
-        evt = EvtIRQTrace.parse(data)
-
+    def handle_irqtrace_evt(self, evt):
         if evt.type == self.AIC_EVT_TYPE_HW and evt.flags & self.IRQTRACE_IRQ:
             dev = self.interrupt_map[int(evt.num)]
             print(f"IRQ: {dev}: {evt.num}")
 
+    def handle_irqtrace(self, data):
+        self.handle_irqtrace_evt(EvtIRQTrace.parse(data))
+
+    def handle_irqtrace_batch(self, data):
+        hdr = EvtIRQTraceBatch.parse(data)
+        if hdr.dropped:
+            self.log(f"!! IRQ trace batch overflowed, {hdr.dropped} events dropped")
+
+        off = EvtIRQTraceBatch.sizeof()
+        size = EvtIRQTrace.sizeof()
+        for i in range(hdr.count):
+            self.handle_irqtrace_evt(EvtIRQTrace.parse(data[off + i * size:off + (i + 1) * size]))
+
+    def handle_exc_async(self, data):
+        evt = EvtExcAsync.parse(data)
+        ctx = evt.ctx
+
+        if evt.reason == START.EXCEPTION_LOWER and evt.code == EXC.SYNC and \
+           ctx.esr.EC == ESR_EC.BKPT_LOWER:
+            hook = self._bp_hooks.get(ctx.elr, None)
+            if hook is not None:
+                self.shellwrap(lambda: hook(ctx), f"Async breakpoint hook @ {ctx.elr:#x}")
+            else:
+                self.log(f"[cpu{ctx.cpu_id}] Breakpoint hit at {self.addr(ctx.elr)}")
+        else:
+            self.log(f"[cpu{ctx.cpu_id}] Async exit {evt.reason}/{evt.code} at {self.addr(ctx.elr)}")
+
     def addr(self, addr):
         unslid_addr = addr + self.sym_offset
         if self.xnu_mode and (addr < self.tba.virt_base or unslid_addr < self.macho.vmin):
@@ -616,11 +1228,7 @@ class HV(Reloadable):
         if self.xnu_mode and (addr < self.tba.virt_base or unslid_addr < self.macho.vmin):
             return None, None
 
-        idx = bisect.bisect_left(self.symbols, (unslid_addr + 1, "")) - 1
-        if idx < 0 or idx >= len(self.symbols):
-            return None, None
-
-        return self.symbols[idx]
+        return self.symbols.lookup(unslid_addr)
 
     def get_sym(self, addr):
         a, name = self.sym(addr)
@@ -983,6 +1591,7 @@ class HV(Reloadable):
         self._commit_context()
         self.ctx = None
         self.exc_orig_cpu = None
+        self.handle_pending_exits()
         self.p.exit(ret)
 
         self._in_handler = False
@@ -1054,6 +1663,65 @@ class HV(Reloadable):
         self._switch_context()
         self.p.hv_pin_cpu(0xffffffffffffffff)
 
+    def step_until(self, count=0, pc_range=None, pc_exit=False, sysreg=None, mem=None, trace=0):
+        '''Single step the current CPU inside m1n1 until a condition holds, without a round trip
+        per instruction.
+
+        pc_range=(start, end) stops once the PC is in the range (with pc_exit, once it is
+        outside of it), sysreg=(reg, mask, value) once the register matches, mem=(pa, mask,
+        value) once the u64 at that physical address matches, and count caps the number of
+        steps. Returns the stop reason, the step count and the last trace PCs stepped to.'''
+        flags = 0
+        pc_start = pc_end = 0
+        if pc_range is not None:
+            flags |= StepCond.PC_OUT if pc_exit else StepCond.PC_IN
+            pc_start, pc_end = pc_range
+
+        reg = reg_mask = reg_value = 0
+        if sysreg is not None:
+            flags |= StepCond.SYSREG
+            enc, reg_mask, reg_value = sysreg
+            enc = sysreg_parse(enc)
+            reg = self._sysreg_iss(self.MSR_REDIRECTS.get(enc, enc))
+
+        mem_addr = mem_mask = mem_value = 0
+        if mem is not None:
+            flags |= StepCond.MEM
+            mem_addr, mem_mask, mem_value = mem
+
+        with self.u.heap.guarded_malloc(HVStepCond.sizeof()) as buf, \
+             self.u.heap.guarded_malloc(max(trace, 1) * 8) as trace_buf:
+            self.iface.writemem(buf, HVStepCond.build({
+                "count": count,
+                "pc_start": pc_start,
+                "pc_end": pc_end,
+                "flags": flags,
+                "sysreg": reg,
+                "sysreg_mask": reg_mask,
+                "sysreg_value": reg_value,
+                "mem_addr": mem_addr,
+                "mem_mask": mem_mask,
+                "mem_value": mem_value,
+                "trace_buf": trace_buf,
+                "trace_size": trace,
+            }))
+            if self.p.hv_step_start(buf) < 0:
+                raise ValueError("Invalid step condition")
+
+            self.step()
+
+            self.p.hv_step_get_status(buf)
+            status = HVStepStatus.parse(self.iface.readmem(buf, HVStepStatus.sizeof()))
+
+            pcs = []
+            if trace and status.trace_count:
+                n = min(trace, status.trace_count)
+                ring = struct.unpack(f"<{trace}Q", self.iface.readmem(trace_buf, trace * 8))
+                first = status.trace_count - n
+                pcs = [ring[i % trace] for i in range(first, status.trace_count)]
+
+        return StepStop(status.stop), status.steps, pcs
+
     def _switch_context(self, exit=EXC_RET.HANDLED):
         # Flush current CPU context out to HV
         self._commit_context()
@@ -1084,7 +1752,11 @@ class HV(Reloadable):
         if self.ctx.cpu_id != cpu:
             raise Exception(f"Switching to CPU #{cpu} but ended on #{self.ctx.cpu_id}")
 
-    def add_hw_bp(self, vaddr, hook=None):
+    def add_hw_bp(self, vaddr, hook=None, sync=True):
+        '''Add a hardware breakpoint.
+
+        With sync=False the breakpoint only logs: m1n1 steps over it by itself and the hook
+        is called later with a snapshot of the context, while the guest keeps running.'''
         if None not in self._bps:
             raise ValueError("Cannot add more HW breakpoints")
 
@@ -1099,10 +1771,19 @@ class HV(Reloadable):
         self._bps[i] = vaddr
         if hook is not None:
             self._bp_hooks[vaddr] = hook
+        self._set_async_bp(i, not sync)
+
+    def _set_async_bp(self, idx, enable):
+        if enable:
+            self._async_bps |= 1 << idx
+        else:
+            self._async_bps &= ~(1 << idx)
+        self.p.hv_set_async_bps(self._async_bps)
 
     def remove_hw_bp(self, vaddr):
         idx = self._bps.index(vaddr)
         self._bps[idx] = None
+        self._set_async_bp(idx, False)
         cpu_id = self.ctx.cpu_id
         try:
             for cpu in self.cpus():
@@ -1300,7 +1981,12 @@ class HV(Reloadable):
         self.iface.set_handler(START.HV, HV_EVENT.WDT_BARK, self.handle_bark)
         self.iface.set_handler(START.HV, HV_EVENT.CPU_SWITCH, self.handle_exception)
         self.iface.set_event_handler(EVENT.MMIOTRACE, self.handle_mmiotrace)
+        self.iface.set_event_handler(EVENT.MMIOTRACE_BATCH, self.handle_mmiotrace_batch)
         self.iface.set_event_handler(EVENT.IRQTRACE, self.handle_irqtrace)
+        self.iface.set_event_handler(EVENT.IRQTRACE_BATCH, self.handle_irqtrace_batch)
+        self.iface.set_event_handler(EVENT.EXC_ASYNC, self.handle_exc_async)
+        self.iface.set_event_handler(EVENT.TRACE_DEMOTE, self.handle_trace_demote)
+        self.p.hv_set_trace_batch(TRACE_BATCH.BLOCK)
 
         # Map MMIO ranges as HW by default
         for r in self.adt["/arm-io"].ranges:
@@ -1371,6 +2057,10 @@ class HV(Reloadable):
         self.p.hv_map_vuart(base, irq, self.iodev)
         self.add_tracer(zone, "VUART", TraceMode.RESERVED)
 
+    def map_pvchan(self):
+        # Paravirtual channel for m1n1-aware guests, shares the vUART's USB pipe
+        self.p.hv_map_pvchan(self.iodev)
+
     def map_essential(self):
         # Things we always map/take over, for the hypervisor to work
         _pmgr = {}
@@ -1537,14 +2227,20 @@ class HV(Reloadable):
             self.del_tracer(irange(base, size), "RAM-HIGH")
             carveout_p += 16
 
-    def enable_time_stealing(self):
-        self.p.hv_set_time_stealing(True)
+    def enable_time_stealing(self, per_cpu=False):
+        self.p.hv_set_time_stealing(True, per_cpu=per_cpu)
 
     def disable_time_stealing(self):
         self.p.hv_set_time_stealing(False)
 
 
-    def load_raw(self, image, entryoffset=0x800, use_xnu_symbols=False, vmin=0):
+    def load_raw(self, image, entryoffset=0x800, use_xnu_symbols=False, vmin=0, loader=None,
+                 image_len=None):
+        '''Lay out and load a guest image. With a loader, image is not used: loader(dest, scratch)
+        places image_len bytes at dest itself and may use guest RAM from scratch upwards.'''
+        if loader is None:
+            image_len = len(image)
+
         sepfw_start, sepfw_length = self.u.adt["chosen"]["memory-map"].SEPFW
         tc_start, tc_size = self.u.adt["chosen"]["memory-map"].TrustCache
         if hasattr(self.u.adt["chosen"]["memory-map"], "preoslog"):
@@ -1552,7 +2248,7 @@ class HV(Reloadable):
         else:
             preoslog_size = 0
 
-        image_size = align(len(image))
+        image_size = align(image_len)
         sepfw_off = image_size
         image_size += align(sepfw_length)
         preoslog_off = image_size
@@ -1585,10 +2281,13 @@ class HV(Reloadable):
         self.add_tracer(irange(phys_base, self.u.ba.mem_size_actual - phys_base + self.ram_base), "RAM-HIGH", TraceMode.OFF)
         self.unmap_carveouts()
 
-        print(f"Loading kernel image (0x{len(image):x} bytes)...")
-        self.u.compressed_writemem(guest_base, image, True)
-        self.p.dc_cvau(guest_base, len(image))
-        self.p.ic_ivau(guest_base, len(image))
+        print(f"Loading kernel image (0x{image_len:x} bytes)...")
+        if loader is not None:
+            loader(guest_base, align(guest_base + image_size))
+        else:
+            self.u.compressed_writemem(guest_base, image, True)
+        self.p.dc_cvau(guest_base, image_len)
+        self.p.ic_ivau(guest_base, image_len)
 
         print(f"Copying SEPFW (0x{sepfw_length:x} bytes)...")
         self.p.memcpy8(guest_base + sepfw_off, sepfw_start, sepfw_length)
@@ -1630,10 +2329,9 @@ class HV(Reloadable):
 
     def _load_macho_symbols(self):
         self.symbol_dict = self.macho.symbols
-        self.symbols = [(v, k) for k, v in self.macho.symbols.items()]
-        self.symbols.sort()
+        self.symbols = SymbolTable((v, k) for k, v in self.macho.symbols.items())
 
-    def load_macho(self, data, symfile=None):
+    def load_macho(self, data, symfile=None, on_device=True):
         if isinstance(data, str):
             data = open(data, "rb")
 
@@ -1674,9 +2372,30 @@ class HV(Reloadable):
             print("Done.")
             return a.tobytes()
 
-        #image = macho.prepare_image(load_hook)
-        image = macho.prepare_image()
-        self.load_raw(image, entryoffset=(macho.entry - macho.vmin), use_xnu_symbols=self.xnu_mode, vmin=macho.vmin)
+        if not on_device:
+            #image = macho.prepare_image(load_hook)
+            image = macho.prepare_image()
+            self.load_raw(image, entryoffset=(macho.entry - macho.vmin), use_xnu_symbols=self.xnu_mode, vmin=macho.vmin)
+            return
+
+        # Send the file as-is in one compressed transfer and let m1n1 place the segments
+        image_len = macho.image_size()
+
+        def loader(dest, scratch):
+            macho.io.seek(macho.off)
+            raw = macho.io.read(macho.size)
+            mem_top = self.u.ba.phys_base + self.u.ba.mem_size
+            if scratch + len(raw) > mem_top:
+                raise Exception(f"No room to stage the Mach-O (0x{len(raw):x} bytes) on the device")
+
+            print(f"Sending Mach-O (0x{len(raw):x} bytes)...")
+            self.u.compressed_writemem(scratch, raw, True)
+            ret = self.p.macho_load(scratch, len(raw), dest, image_len)
+            if ret != image_len:
+                raise Exception(f"Device-side Mach-O load failed ({ret})")
+
+        self.load_raw(None, entryoffset=(macho.entry - macho.vmin), use_xnu_symbols=self.xnu_mode,
+                      vmin=macho.vmin, loader=loader, image_len=image_len)
 
 
     def update_pac_mask(self):
@@ -1696,23 +2415,29 @@ class HV(Reloadable):
         # Assume Linux
         self.sym_offset = 0
         self.xnu_mode = False
-        self.symbols = []
         self.symbol_dict = {}
         with open(path) as fd:
             for line in fd.readlines():
                 addr, t, name = line.split()
-                addr = int(addr, 16)
-                self.symbols.append((addr, name))
-                self.symbol_dict[name] = addr
-        self.symbols.sort()
+                self.symbol_dict[name] = int(addr, 16)
+        self.symbols = SymbolTable((v, k) for k, v in self.symbol_dict.items())
 
     def add_kext_symbols(self, kext, demangle=False):
         info_plist = plistlib.load(open(f"{kext}/Contents/Info.plist", "rb"))
         identifier = info_plist["CFBundleIdentifier"]
         name = info_plist["CFBundleName"]
         macho = MachO(open(f"{kext}/Contents/MacOS/{name}", "rb"))
+
+        # New names land at the end of the dict, so only those need to go into the index. A kext
+        # loaded again may have moved its existing names instead.
+        count = len(self.macho.symbols)
         self.macho.add_symbols(identifier, macho, demangle=demangle)
-        self._load_macho_symbols()
+        if identifier in self.kexts:
+            self._load_macho_symbols()
+        else:
+            added = itertools.islice(self.macho.symbols.items(), count, None)
+            self.symbols.add((v, k) for k, v in added)
+        self.kexts.add(identifier)
 
     def _handle_sigint(self, signal=None, stack=None):
         self._sigint_pending = True
@@ -1770,7 +2495,7 @@ class HV(Reloadable):
         set_sigquit_stackdump_handler()
 
         if self.wdt_cpu is not None:
-            self.p.hv_wdt_start(self.wdt_cpu)
+            self.p.hv_wdt_start(self.wdt_cpu, self.wdt_slow_usec)
         # Does not return
 
         self.started = True
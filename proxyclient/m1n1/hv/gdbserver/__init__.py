@@ -20,11 +20,15 @@ class GDBServer:
         "fpcr" / Int32ul,
     )
     __seperator = re.compile("[,;:]")
+    __page_size = 0x1000
 
     def __init__(self, hv, address, log):
         self.__hc = None
         self.__hg = None
         self.__hv = hv
+        self.__mem_cache = {}
+        self.__fp_cache = None
+        self.__cache_cpu = None
         self.__interrupt_eventfd = os.eventfd(0, flags=os.EFD_CLOEXEC | os.EFD_NONBLOCK)
         self.__interrupt_selector = selectors.DefaultSelector()
         self.__request = None
@@ -59,6 +63,55 @@ class GDBServer:
 
         self.__hv.cpu(cpu)
 
+    # GDB issues lots of small reads while the guest is stopped (unwinding, disassembly), so
+    # memory is cached by guest VA page and the FP control registers per CPU until it resumes.
+    def __invalidate(self):
+        self.__mem_cache = {}
+        self.__fp_cache = None
+        self.__cache_cpu = None
+
+    def __check_cache_cpu(self):
+        # Stage 1 translations differ between CPUs
+        if self.__cache_cpu != self.__hv.ctx.cpu_id:
+            self.__invalidate()
+            self.__cache_cpu = self.__hv.ctx.cpu_id
+
+    def __fp_regs(self):
+        self.__check_cache_cpu()
+        if self.__fp_cache is None:
+            self.__fp_cache = [self.__hv.u.mrs(FPSR), self.__hv.u.mrs(FPCR)]
+
+        return self.__fp_cache
+
+    def __readmem(self, addr, size):
+        self.__check_cache_cpu()
+        first = addr & ~(self.__page_size - 1)
+        last = align_up(addr + size, self.__page_size)
+        pages = range(first, last, self.__page_size)
+
+        # Fetch everything from the first missing page on in one go
+        missing = next((page for page in pages if page not in self.__mem_cache), None)
+        if missing is not None:
+            data = self.__hv.readmem(missing, last - missing)
+            for off in range(0, len(data) - self.__page_size + 1, self.__page_size):
+                self.__mem_cache[missing + off] = data[off:off + self.__page_size]
+
+        with io.BytesIO() as buffer:
+            for page in pages:
+                if page not in self.__mem_cache:
+                    break
+                buffer.write(self.__mem_cache[page])
+
+            return buffer.getvalue()[addr - first:addr - first + size]
+
+    def __writemem(self, addr, data):
+        self.__check_cache_cpu()
+        first = addr & ~(self.__page_size - 1)
+        for page in range(first, addr + len(data), self.__page_size):
+            self.__mem_cache.pop(page, None)
+
+        return self.__hv.writemem(addr, data)
+
     def __stop_reply(self):
         self.__hc = None
         self.__hg = None
@@ -115,6 +168,7 @@ class GDBServer:
                 self.__cpu(self.__hc)
                 self.__hv.ctx.elr = int(data[1:].decode(), 16)
 
+            self.__invalidate()
             self.__hv.cont()
             self.__wait_shell()
             return self.__stop_reply()
@@ -127,8 +181,7 @@ class GDBServer:
             g.pc = self.__hv.ctx.elr
             g.spsr = self.__hv.ctx.spsr.value
             g.q = self.__hv.u.q
-            g.fpsr = self.__hv.u.mrs(FPSR)
-            g.fpcr = self.__hv.u.mrs(FPCR)
+            g.fpsr, g.fpcr = self.__fp_regs()
 
             return bytes(GDBServer.__g.build(g).hex(), "utf-8")
 
@@ -149,7 +202,8 @@ class GDBServer:
             self.__hv.u.push_simd()
 
             self.__hv.u.msr(FPSR, g.fpsr, silent=True)
-            self.__hv.u.msr(FPCR, g.fpsr, silent=True)
+            self.__hv.u.msr(FPCR, g.fpcr, silent=True)
+            self.__fp_cache = [g.fpsr, g.fpcr]
 
             return b"OK"
 
@@ -179,12 +233,12 @@ class GDBServer:
         if data[0] in b"m":
             split = GDBServer.__seperator.split(data[1:].decode(), maxsplit=1)
             fields = [int(field, 16) for field in split]
-            return bytes(self.__hv.readmem(fields[0], fields[1]).hex(), "utf-8")
+            return bytes(self.__readmem(fields[0], fields[1]).hex(), "utf-8")
 
         if data[0] in b"M":
             split = GDBServer.__seperator.split(data[1:].decode(), maxsplit=2)
             mem = bytes.fromhex(split[2])[:int(split[1], 16)]
-            if self.__hv.writemem(int(split[0], 16), mem) < len(mem):
+            if self.__writemem(int(split[0], 16), mem) < len(mem):
                 return "E22"
 
             return b"OK"
@@ -203,9 +257,9 @@ class GDBServer:
             elif number < 66:
                 reg = GDBServer.__g.q.subcon.subcon.build(self.__hv.u.q[number - 34])
             elif number == 66:
-                reg = GDBServer.__g.fpsr.build(self.__hv.u.mrs(FPSR))
+                reg = GDBServer.__g.fpsr.build(self.__fp_regs()[0])
             elif number == 67:
-                reg = GDBServer.__g.fpcr.build(self.__hv.u.mrs(FPCR))
+                reg = GDBServer.__g.fpcr.build(self.__fp_regs()[1])
             else:
                 return b"E01"
 
@@ -229,8 +283,10 @@ class GDBServer:
                 self.__hv.u.push_simd()
             elif number == 66:
                 self.__hv.u.msr(FPSR, GDBServer.__g.fpsr.parse(reg), silent=True)
+                self.__fp_cache = None
             elif number == 67:
                 self.__hv.u.msr(FPCR, GDBServer.__g.fpcr.parse(reg), silent=True)
+                self.__fp_cache = None
             else:
                 return b"E01"
 
@@ -251,6 +307,7 @@ class GDBServer:
 
             if split[0] == "Rcmd":
                 self.__cpu(self.__hg)
+                self.__invalidate()
                 self.__hv.run_code(split[1])
                 return b"OK"
 
@@ -292,6 +349,7 @@ class GDBServer:
             if len(data) != 1:
                 self.__hv.ctx.elr = int(data[1:].decode(), 16)
 
+            self.__invalidate()
             self.__hv.step()
             return self.__stop_reply()
 
@@ -305,7 +363,7 @@ class GDBServer:
             partition = data[1:].partition(b":")
             split = GDBServer.__seperator.split(partition[0].decode(), maxsplit=1)
             mem = partition[2][:int(split[1], 16)]
-            if self.__hv.writemem(int(split[0], 16), mem) < len(mem):
+            if self.__writemem(int(split[0], 16), mem) < len(mem):
                 return b"E22"
 
             return b"OK"
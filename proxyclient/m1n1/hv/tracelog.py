@@ -0,0 +1,168 @@
+# SPDX-License-Identifier: MIT
+import bisect, runpy, struct, time
+
+from ..proxy import EVENT
+from ..utils import *
+from .types import *
+
+__all__ = ["TraceLogWriter", "TraceLogReader", "TraceReplayHV"]
+
+# Raw trace capture, see HV.capture_trace().
+#
+# The log is a header followed by frames, each one an event exactly as it came off the link
+# prefixed with its event ID, length and a host timestamp in ns. Every INDEX_INTERVAL frames an
+# entry (timestamp, file offset, frame number) is appended to the .idx file next to it, so a
+# reader can seek to a point in time without scanning the whole log.
+
+LOG_MAGIC = b"M1N1TRC\0"
+LOG_VERSION = 1
+LOG_HDR = struct.Struct("<8sII")
+FRAME_HDR = struct.Struct("<HHIQ")
+INDEX_ENTRY = struct.Struct("<QQQ")
+INDEX_INTERVAL = 4096
+
+TRACE_EVENTS = (EVENT.MMIOTRACE, EVENT.MMIOTRACE_BATCH, EVENT.IRQTRACE, EVENT.IRQTRACE_BATCH)
+
+class TraceLogWriter:
+    def __init__(self, path, bufsize=1 << 20):
+        self.path = path
+        self.fd = open(path, "wb", buffering=bufsize)
+        self.idx = open(str(path) + ".idx", "wb")
+        self.fd.write(LOG_HDR.pack(LOG_MAGIC, LOG_VERSION, 0))
+        self.offset = LOG_HDR.size
+        self.frames = 0
+        self.bytes = 0
+
+    def write(self, event_id, data):
+        ts = time.time_ns()
+        if self.frames % INDEX_INTERVAL == 0:
+            self.idx.write(INDEX_ENTRY.pack(ts, self.offset, self.frames))
+        self.fd.write(FRAME_HDR.pack(event_id, 0, len(data), ts))
+        self.fd.write(data)
+        self.offset += FRAME_HDR.size + len(data)
+        self.frames += 1
+        self.bytes += len(data)
+
+    def handler(self, event_id):
+        return lambda data: self.write(event_id, data)
+
+    def close(self):
+        self.fd.close()
+        self.idx.close()
+
+class TraceLogReader:
+    def __init__(self, path):
+        self.path = path
+        self.fd = open(path, "rb")
+        magic, version, _ = LOG_HDR.unpack(self.fd.read(LOG_HDR.size))
+        if magic != LOG_MAGIC or version != LOG_VERSION:
+            raise Exception(f"{path}: not a m1n1 trace log (version {LOG_VERSION})")
+
+        self.index = []
+        try:
+            with open(str(path) + ".idx", "rb") as fd:
+                self.index = [INDEX_ENTRY.unpack(e) for e in
+                              iter(lambda: fd.read(INDEX_ENTRY.size), b"")
+                              if len(e) == INDEX_ENTRY.size]
+        except FileNotFoundError:
+            pass
+
+    def seek(self, ts):
+        '''Position the reader at or shortly before the first frame at host time ts (ns)'''
+        i = bisect.bisect_right(self.index, (ts, 1 << 64)) - 1
+        self.fd.seek(self.index[i][1] if i >= 0 else LOG_HDR.size)
+
+    def frames(self, start=None, end=None):
+        '''Yield (timestamp, event_id, data) for frames in [start, end)'''
+        if start is not None:
+            self.seek(start)
+        else:
+            self.fd.seek(LOG_HDR.size)
+
+        while True:
+            hdr = self.fd.read(FRAME_HDR.size)
+            if len(hdr) < FRAME_HDR.size:
+                return
+            event_id, _, size, ts = FRAME_HDR.unpack(hdr)
+            data = self.fd.read(size)
+            if len(data) < size:
+                return # truncated by an interrupted capture
+            if start is not None and ts < start:
+                continue
+            if end is not None and ts >= end:
+                return
+            yield ts, event_id, data
+
+    def close(self):
+        self.fd.close()
+
+class TraceReplayHV(Reloadable):
+    '''Stands in for HV when replaying a capture through Tracer classes, with no device attached'''
+
+    AIC_EVT_TYPE_HW = 1
+    IRQTRACE_IRQ = 1
+
+    def __init__(self, adt=None):
+        self.adt = adt
+        self.u = None
+        self.p = None
+        self.iface = None
+        self.ctx = None
+        self.started = True
+        self.mmio_maps = DictRangeMap()
+        self.interrupt_map = {}
+        self.tracer_caches = {}
+        self.ts = None
+        self.shell_locals = {"hv": self}
+
+    def log(self, s, *args, show_cpu=True, **kwargs):
+        print(s, *args, **kwargs)
+
+    def add_tracer(self, zone, ident, mode=TraceMode.ASYNC, read=None, write=None, **kwargs):
+        self.mmio_maps[zone, ident] = (mode, ident, read, write, kwargs)
+
+    def del_tracer(self, zone, ident):
+        del self.mmio_maps[zone, ident]
+
+    def clear_tracers(self, ident):
+        for r, v in self.mmio_maps.items():
+            if ident in v:
+                v.pop(ident)
+
+    def shellwrap(self, func, description, update=None, needs_ret=False):
+        try:
+            return func()
+        except Exception:
+            print(f"Exception in {description}")
+            raise
+
+    def run_script(self, path):
+        new_locals = runpy.run_path(path, init_globals=self.shell_locals, run_name="<hv_script>")
+        self.shell_locals.clear()
+        self.shell_locals.update(new_locals)
+
+    def replay(self, reader, start=None, end=None):
+        from . import HV
+        handlers = {
+            EVENT.MMIOTRACE: HV.handle_mmiotrace,
+            EVENT.MMIOTRACE_BATCH: HV.handle_mmiotrace_batch,
+            EVENT.IRQTRACE: HV.handle_irqtrace,
+            EVENT.IRQTRACE_BATCH: HV.handle_irqtrace_batch,
+        }
+        count = 0
+        for ts, event_id, data in reader.frames(start, end):
+            handler = handlers.get(event_id, None)
+            if handler:
+                self.ts = ts
+                handler(self, data)
+                count += 1
+        return count
+
+    def handle_mmiotrace_evt(self, evt):
+        from . import HV
+        HV.handle_mmiotrace_evt(self, evt)
+
+    def handle_irqtrace_evt(self, evt):
+        if evt.type == self.AIC_EVT_TYPE_HW and evt.flags & self.IRQTRACE_IRQ:
+            dev = self.interrupt_map.get(int(evt.num), "?")
+            print(f"IRQ: {dev}: {evt.num}")
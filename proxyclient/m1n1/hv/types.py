@@ -3,10 +3,15 @@ from construct import *
 from enum import IntEnum
 
 from ..utils import *
+from ..proxy import ExcInfo
 
 __all__ = [
-    "MMIOTraceFlags", "EvtMMIOTrace", "EvtIRQTrace", "HV_EVENT",
-    "VMProxyHookData", "TraceMode",
+    "MMIOTraceFlags", "EvtMMIOTrace", "EvtMMIOTraceBatch", "EvtIRQTrace",
+    "EvtIRQTraceBatch", "HVIRQCounter", "EvtExcAsync",
+    "TraceFilterFlags", "HVTraceFilter", "TraceBudgetFlags", "HVTraceBudget", "TraceDemoteMode",
+    "EvtTraceDemote", "NativeHook", "HVNativeHook", "ShadowRegsFlags", "HVShadowRegs", "SysregEmu", "HVSysregEmu", "HVStats", "HV_EVENT",
+    "VMProxyHookData", "TraceMode", "StepCond", "StepStop", "HVStepCond", "HVStepStatus",
+    "HVPMUConfig", "HVPendingExit",
 ]
 
 class MMIOTraceFlags(Register32):
@@ -25,12 +30,198 @@ EvtMMIOTrace = Struct(
     "data" / Hex(Int64ul),
 )
 
+EvtMMIOTraceBatch = Struct(
+    "count" / Int32ul,
+    "dropped" / Int32ul,
+)
+
+class TraceFilterFlags(Register32):
+    ON_CHANGE = 2
+    WRITE = 1
+    READ = 0
+
+HVTraceFilter = Struct(
+    "start" / Hex(Int64ul),
+    "end" / Hex(Int64ul),
+    "offset_mask" / Hex(Int64ul),
+    "offset_match" / Hex(Int64ul),
+    "value_mask" / Hex(Int64ul),
+    "value_match" / Hex(Int64ul),
+    "flags" / RegAdapter(TraceFilterFlags),
+    "min_interval_us" / Int32ul,
+)
+
+class TraceBudgetFlags(Register32):
+    HW = 0
+
+HVTraceBudget = Struct(
+    "max_faults" / Int32ul,
+    "sample_every" / Int32ul,
+    "cooldown_ms" / Int32ul,
+    "flags" / RegAdapter(TraceBudgetFlags),
+)
+
+class TraceDemoteMode(IntEnum):
+    NONE = 0
+    SAMPLED = 1
+    HW = 2
+
+EvtTraceDemote = Struct(
+    "addr" / Hex(Int64ul),
+    "mode" / Int32ul,
+    "faults" / Int32ul,
+)
+
+class NativeHook(IntEnum):
+    CONST = 0
+    SHADOW = 1
+    MASK = 2
+    COUNT = 3
+
+HVNativeHook = Struct(
+    "start" / Hex(Int64ul),
+    "end" / Hex(Int64ul),
+    "type" / Int32ul,
+    "reserved" / Default(Int32ul, 0),
+    "value" / Hex(Int64ul),
+    "mask" / Hex(Int64ul),
+)
+
+class ShadowRegsFlags(Register32):
+    FORWARD_HOST = 0
+    ABSORB_WRITES = 1
+
+HVShadowRegs = Struct(
+    "start" / Hex(Int64ul),
+    "end" / Hex(Int64ul),
+    "shadow" / Hex(Int64ul),
+    "cached" / Hex(Int64ul),
+    "flags" / RegAdapter(ShadowRegsFlags),
+    "hook_id" / Int32ul,
+)
+
+class SysregEmu(IntEnum):
+    PASS = 0
+    CONST = 1
+    SHADOW = 2
+    WI = 3
+    LOG = 4
+
+HVSysregEmu = Struct(
+    "sysreg" / Hex(Int32ul),
+    "target" / Hex(Int32ul),
+    "type" / Int32ul,
+    "reserved" / Default(Int32ul, 0),
+    "value" / Hex(Int64ul),
+)
+
+class StepCond(IntEnum):
+    PC_IN = 1
+    PC_OUT = 2
+    SYSREG = 4
+    MEM = 8
+
+class StepStop(IntEnum):
+    RUNNING = 0
+    COUNT = 1
+    PC = 2
+    SYSREG = 3
+    MEM = 4
+
+HVStepCond = Struct(
+    "count" / Int64ul,
+    "pc_start" / Hex(Int64ul),
+    "pc_end" / Hex(Int64ul),
+    "flags" / Int32ul,
+    "sysreg" / Hex(Int32ul),
+    "sysreg_mask" / Hex(Int64ul),
+    "sysreg_value" / Hex(Int64ul),
+    "mem_addr" / Hex(Int64ul),
+    "mem_mask" / Hex(Int64ul),
+    "mem_value" / Hex(Int64ul),
+    "trace_buf" / Hex(Int64ul),
+    "trace_size" / Int64ul,
+)
+
+HVStepStatus = Struct(
+    "stop" / Int32ul,
+    "reserved" / Int32ul,
+    "steps" / Int64ul,
+    "trace_count" / Int64ul,
+)
+
+HVPMUConfig = Struct(
+    "counters" / Hex(Int32ul),
+    "flags" / Int32ul,
+    "events" / Array(10, Hex(Int8ul)),
+    "reserved" / Padding(6),
+    "period" / Array(10, Int64ul),
+    "size" / Int64ul,
+)
+
+HV_STATS_HIST_BUCKETS = 24
+
+HVStatsMSR = Struct(
+    "sysreg" / Int32ul,
+    "reserved" / Int32ul,
+    "count" / Int64ul,
+)
+
+HVStats = Struct(
+    "sync_exits" / Array(64, Int64ul),
+    "irq_exits" / Int64ul,
+    "fiq_exits" / Int64ul,
+    "fiq_fast_exits" / Int64ul,
+    "serr_exits" / Int64ul,
+    "exit_ticks" / Int64ul,
+    "exit_hist" / Array(HV_STATS_HIST_BUCKETS, Int64ul),
+    "dabort_spte" / Array(8, Int64ul),
+    "msr_other" / Int64ul,
+    "msr" / Array(32, HVStatsMSR),
+    "proxy_calls" / Int64ul,
+    "proxy_ticks" / Int64ul,
+    "proxy_hist" / Array(HV_STATS_HIST_BUCKETS, Int64ul),
+    "stolen_ticks" / Int64ul,
+    "profile_samples" / Int64ul,
+    "profile_dropped" / Int64ul,
+    "pmu_samples" / Int64ul,
+    "pmu_dropped" / Int64ul,
+)
+
+EvtExcAsync = Struct(
+    "reason" / Int32ul,
+    "code" / Int32ul,
+    "ctx" / ExcInfo,
+)
+
 EvtIRQTrace = Struct(
     "flags" / Int32ul,
     "type" / Hex(Int16ul),
     "num" / Int16ul,
 )
 
+EvtIRQTraceBatch = Struct(
+    "count" / Int32ul,
+    "dropped" / Int32ul,
+)
+
+HVIRQCounter = Struct(
+    "num" / Int32ul,
+    "reserved" / Int32ul,
+    "count" / Int64ul,
+    "first" / Int64ul,
+    "last" / Int64ul,
+    "min_delta" / Int64ul,
+)
+
+HVPendingExit = Struct(
+    "cpu" / Int32ul,
+    "reason" / Int32ul,
+    "code" / Int32ul,
+    "reserved" / Int32ul,
+    "info" / Int64ul,
+)
+
 class HV_EVENT(IntEnum):
     HOOK_VM = 1
     VTIMER = 2
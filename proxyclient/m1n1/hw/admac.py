@@ -1,9 +1,9 @@
 # SPDX-License-Identifier: MIT
-import sys, time
+import sys, time, struct
 from enum import IntEnum
 from ..utils import *
 
-__all__ = ["ADMACRegs", "ADMAC", "E_BUSWIDTH", "E_FRAME"]
+__all__ = ["ADMACRegs", "ADMAC", "ADMACStream", "E_BUSWIDTH", "E_FRAME"]
 
 
 class R_RING(Register32):
@@ -362,6 +362,110 @@ class ADMACChannel(Reloadable):
         return self.read_reports()
 
 
+class ADMACStream(Reloadable):
+    '''Streaming on one channel with the descriptor refill done on the device
+
+    A secondary CPU keeps the channel's descriptor ring topped up from a ring buffer in RAM,
+    which the host fills (TX) or drains (RX) in bulk, so link hiccups shorter than the buffer
+    do not underrun. On TX, silence is played when the host still falls behind.'''
+
+    # struct admac_stream in src/admac.h
+    CTL = struct.Struct("<QIIQQQQQQIIII")
+    OFF_HEAD = 40
+    OFF_COMPLETED = 56
+    OFF_UNDERRUNS = 68
+    OFF_ERRORS = 72
+
+    def __init__(self, chan, bufsize=1024*1024, desc_size=1024*32, cpu=1, silence=True):
+        admac = chan.p
+        assert admac.dart is not None
+        assert bufsize % desc_size == 0
+
+        self.chan = chan
+        self.u = admac.u
+        self.p = admac.p
+        self.iface = self.p.iface
+        self.cpu = cpu
+        self.bufsize = bufsize
+        self.desc_size = desc_size
+        self.running = False
+
+        self.buf = self.u.heap.memalign(0x4000, bufsize)
+        self.buf_iova = admac.dart.iomap(admac.dart_stream, self.buf, bufsize)
+        self.silence_iova = 0
+        if chan.tx and silence:
+            self.silence = self.u.heap.memalign(0x4000, desc_size)
+            self.p.memset8(self.silence, 0, desc_size)
+            self.silence_iova = admac.dart.iomap(admac.dart_stream, self.silence, desc_size)
+        admac.dart.invalidate_streams(1 << admac.dart_stream)
+
+        self.ctl = self.u.malloc(self.CTL.size)
+        self.head = 0
+
+    def start(self):
+        self.p.mmu_init_secondary(self.cpu)
+        self.head = 0
+        self.iface.writemem(self.ctl, self.CTL.pack(
+            self.chan.p.base, self.chan.ch, self.desc_size, self.buf_iova, self.bufsize,
+            self.silence_iova, 0, 0, 0, 0, 0, 0, 0))
+        if self.p.admac_stream_start(self.cpu, self.ctl) < 0:
+            raise Exception(f"admac: could not start streaming ch{self.chan.ch} on CPU {self.cpu}")
+        self.running = True
+
+    @property
+    def completed(self):
+        return self.p.read64(self.ctl + self.OFF_COMPLETED)
+
+    def _ring(self, start, size):
+        off = start % self.bufsize
+        first = min(size, self.bufsize - off)
+        return [(self.buf + off, first), (self.buf, size - first)]
+
+    def write(self, data):
+        '''TX: queue data, waiting for space in the ring buffer as needed'''
+        assert self.chan.tx
+        data = memoryview(data)
+        while data:
+            space = self.completed + self.bufsize - self.head
+            if not space:
+                time.sleep(0.001)
+                continue
+            n = min(space, len(data))
+            pos = 0
+            for addr, size in self._ring(self.head, n):
+                if size:
+                    self.iface.writemem(addr, bytes(data[pos:pos + size]))
+                    pos += size
+            self.head += n
+            self.p.write64(self.ctl + self.OFF_HEAD, self.head)
+            data = data[n:]
+
+    def read(self):
+        '''RX: return whatever the ADMAC has captured since the last read'''
+        assert self.chan.rx
+        avail = self.completed - self.head
+        data = bytearray()
+        for addr, size in self._ring(self.head, avail):
+            if size:
+                data.extend(self.iface.readmem(addr, size))
+        self.head += avail
+        self.p.write64(self.ctl + self.OFF_HEAD, self.head)
+        return data
+
+    def stop(self):
+        '''Stop refilling, returns the number of bytes the ADMAC completed'''
+        if not self.running:
+            return 0
+        done = self.p.admac_stream_stop(self.cpu, self.ctl)
+        self.running = False
+        self.underruns = self.p.read32(self.ctl + self.OFF_UNDERRUNS)
+        self.errors = self.p.read32(self.ctl + self.OFF_ERRORS)
+        if self.underruns or self.errors:
+            print(f"admac: ch{self.chan.ch} had {self.underruns} underruns, {self.errors} ring errors",
+                  file=sys.stderr)
+        return done
+
+
 class ADMAC(Reloadable):
     def __init__(self, u, devpath, dart=None, dart_stream=2,
                  reserved_size=4*1024*1024, debug=False):
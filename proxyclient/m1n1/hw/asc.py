@@ -1,5 +1,6 @@
 # SPDX-License-Identifier: MIT
 from ..utils import *
+from ..proxyutils import MemWatch
 import time
 
 class R_MBOX_CTRL(Register32):
@@ -90,6 +91,14 @@ class ASC:
     def has_messages(self):
         return not self.asc.OUTBOX_CTRL.reg.EMPTY
 
+    def wait_messages(self, timeout=0.1, watches=()):
+        '''Sleep on the device until the outbox is not empty or one of the extra watches fires
+
+        watches are MemWatch (addr, mask, value) entries, the outbox is the first result.'''
+        empty = R_MBOX_CTRL(EMPTY=1).value
+        watches = [(self.asc.OUTBOX_CTRL.addr, empty, empty)] + list(watches)
+        return MemWatch(self.u).wait(watches, int(timeout * 1000000))
+
     def work_pending(self):
         while self.has_messages():
             self.work()
@@ -99,6 +108,12 @@ class ASC:
             return True
 
         msg0, msg1 = self.recv()
+        return self.dispatch(msg0, msg1)
+
+    def dispatch(self, msg0, msg1):
+        '''Hand a received message to its endpoint, also for ones picked up on the device'''
+        if not isinstance(msg1, R_INBOX1):
+            msg1 = R_INBOX1(msg1)
 
         handled = False
 
@@ -117,5 +132,9 @@ class ASC:
 
     def work_for(self, timeout):
         deadline = time.time() + timeout
-        while time.time() < deadline:
-            self.work()
+        while True:
+            left = deadline - time.time()
+            if left <= 0:
+                break
+            self.wait_messages(min(left, 0.1))
+            self.work_pending()
@@ -312,6 +312,26 @@ class DART8110(Reloadable):
         if size == 0:
             return
 
+        dirty = set()
+        self._map_pages(stream, iova, addr, size, dirty)
+
+        for page in dirty:
+            self.flush_pt(page)
+
+    def iomap_sg(self, stream, entries):
+        """Map a list of (iova, addr, size) entries, writing each dirty table back once and
+        invalidating the stream's TLB once at the end."""
+        dirty = set()
+        for iova, addr, size in entries:
+            if size:
+                self._map_pages(stream, iova, addr, size, dirty)
+
+        for page in dirty:
+            self.flush_pt(page)
+
+        self.invalidate_streams(1 << stream)
+
+    def _map_pages(self, stream, iova, addr, size, dirty):
         if not (self.enabled_streams & (1 << stream)):
             self.enabled_streams |= (1 << stream)
             self.regs.ENABLE_STREAMS[stream // 32].val |= (1 << (stream % 32))
@@ -334,8 +354,6 @@ class DART8110(Reloadable):
         end = iova + size
         end_page = align_up(end, self.PAGE_SIZE)
 
-        dirty = set()
-
         for page in range(start_page, end_page, self.PAGE_SIZE):
             paddr = addr + page - start_page
 
@@ -367,9 +385,6 @@ class DART8110(Reloadable):
                 SP_START=0, SP_END=0xfff,
                 OFFSET=paddr >> self.PAGE_BITS, VALID=1).value
 
-        for page in dirty:
-            self.flush_pt(page)
-
     def iotranslate(self, stream, start, size):
         if size == 0:
             return []
@@ -1,6 +1,7 @@
 # SPDX-License-Identifier: MIT
 from ..utils import *
 from enum import IntEnum
+import time
 
 
 class R_STATUS(Register32):
@@ -332,3 +333,225 @@ class JPEGRegs(RegMap):
 
     # todo what's the format?
     RSTLOG = irange(0x2000, 1024, 4), Register32
+
+
+# Quantization tables used by experiments/jpeg.py (roughly quality 50 luma/chroma, then 95)
+ENCODE_QTBL = [
+    0xa06e64a0, 0xf0ffffff, 0x78788cbe, 0xffffffff, 0x8c82a0f0, 0xffffffff, 0x8caadcff, 0xffffffff,
+    0xb4dcffff, 0xffffffff, 0xf0ffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+    0xaab4f0ff, 0xffffffff, 0xb4d2ffff, 0xffffffff, 0xf0ffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+    0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+    0x01010201, 0x01020202, 0x02030202, 0x03030604, 0x03030303, 0x07050804, 0x0608080a, 0x0908070b,
+    0x080a0e0d, 0x0b0a0a0c, 0x0a08080b, 0x100c0c0d, 0x0f0f0f0f, 0x090b1011, 0x0f0e110d, 0x0e0e0e01,
+    0x04040405, 0x04050905, 0x05090f0a, 0x080a0f1a, 0x13090913, 0x1a1a1a1a, 0x0d1a1a1a, 0x1a1a1a1a,
+    0x1a1a1a1a, 0x1a1a1a1a, 0x1a1a1a1a, 0x1a1a1a1a, 0x1a1a1a1a, 0x1a1a1a1a, 0x1a1a1a1a, 0x1a1a1a1a,
+]
+
+# BT.601 RGB -> YCbCr, as programmed by experiments/jpeg.py
+ENCODE_MATRIX = [0x4d, 0x96, 0x1d, 0xffffffd5, 0xffffffab, 0x80, 0x80, 0xffffff95, 0xffffffeb,
+                 0x0, 0x80]
+
+class JPEGError(Exception):
+    pass
+
+class JPEGEncoder:
+    '''Encodes a 32bpp RGB surface already in device memory, 4:2:0, without copying it
+
+    The surface is mapped into the JPEG block's DART as-is (stride included), so compressing the
+    framebuffer only costs the register setup and reading back the JPEG. The register sequence is
+    the one worked out in experiments/jpeg.py.'''
+
+    MB_W, MB_H = 16, 16
+
+    def __init__(self, u, which="jpeg0", out_size=None):
+        from .dart import DART
+
+        self.u = u
+        self.p = u.proxy
+        self.iface = u.iface
+        self.p.pmgr_adt_clocks_enable(f"/arm-io/dart-{which}")
+        self.p.pmgr_adt_clocks_enable(f"/arm-io/{which}")
+        self.dart = DART.from_adt(u, f"/arm-io/dart-{which}")
+        self.dart.initialize()
+        base, _ = u.adt[f"/arm-io/{which}"].get_reg(0)
+        self.regs = JPEGRegs(u, base)
+        self.surface = None
+        self.out_size = out_size
+        self.out_phys = self.out_iova = None
+
+    def map_surface(self, phys, width, height, stride, depth=30):
+        '''Map the surface to encode; depth 30 is x2r10g10b10 (the m1n1 framebuffer), 32 xrgb8888'''
+        if depth not in (30, 32):
+            raise ValueError(f"Unsupported depth {depth}")
+        rows = align_up(height, self.MB_H)
+        # The DART maps whole pages, so pad the start down and the size up
+        start = phys & ~0x3fff
+        size = align_up(phys + stride * rows - start, 0x4000)
+        iova = self.dart.iomap(0, start, size)
+        self.surface = (iova + phys - start, width, height, stride, depth, iova + size)
+
+        out_size = self.out_size or align_up(stride * height // 2, 0x4000)
+        if self.out_phys is None or out_size > self.out_size:
+            self.out_size = out_size
+            self.out_phys = self.u.heap.memalign(0x4000, out_size)
+            self.out_iova = self.dart.iomap(0, self.out_phys, out_size)
+
+    def map_framebuffer(self):
+        v = self.u.ba.video
+        self.map_surface(v.base, v.width, v.height, v.stride, v.depth & 0xff)
+
+    def reset(self):
+        jpeg = self.regs
+        jpeg.MODE.val = 0x100
+        jpeg.MODE.val = 0x13e
+        self._default_regs()
+        jpeg.MODE.val = 0x17f
+        for _ in range(10000):
+            if jpeg.REG_0x1004.val == 0:
+                break
+        else:
+            raise JPEGError("reset (stage 1) timed out")
+
+        jpeg.RST_INTERVAL.val = 1
+        for _ in range(2500):
+            if jpeg.RST_INTERVAL.val == 1:
+                break
+        else:
+            raise JPEGError("reset (stage 2) timed out")
+        jpeg.RST_INTERVAL.val = 0
+
+        jpeg.ENABLE_RST_LOGGING.val = 0
+        for reg in (0x1a8, 0x1ac, 0x1b0, 0x1b4, 0x1bc, 0x1c0, 0x1c4, 0x1c8, 0x1cc, 0x1d0, 0x1d4):
+            getattr(jpeg, f"REG_0x{reg:x}").val = 0
+        jpeg.MODE.val = 0x143
+
+    def _default_regs(self):
+        jpeg = self.regs
+        for name, val in (
+            ("REG_0x0", 0), ("REG_0x4", 0), ("CODEC", 0), ("REG_0x2c", 0), ("REG_0x30", 0),
+            ("REG_0x34", 1), ("REG_0x38", 1), ("CHROMA_HALVE_H_TYPE1", 0),
+            ("CHROMA_HALVE_H_TYPE2", 0), ("CHROMA_HALVE_V_TYPE1", 0), ("CHROMA_HALVE_V_TYPE2", 0),
+            ("CHROMA_DOUBLE_H", 0), ("CHROMA_QUADRUPLE_H", 0), ("CHROMA_DOUBLE_V", 0),
+            ("PLANAR_CHROMA_HALVING", 0), ("PX_USE_PLANE1", 0), ("PX_TILES_W", 1),
+            ("PX_TILES_H", 1), ("PX_PLANE0_WIDTH", 1), ("PX_PLANE0_HEIGHT", 1),
+            ("PX_PLANE0_TILING_H", 1), ("PX_PLANE0_TILING_V", 1), ("PX_PLANE0_STRIDE", 1),
+            ("PX_PLANE1_WIDTH", 1), ("PX_PLANE1_HEIGHT", 1), ("PX_PLANE1_TILING_H", 1),
+            ("PX_PLANE1_TILING_V", 1), ("PX_PLANE1_STRIDE", 1), ("INPUT_START1", 0),
+            ("INPUT_START2", 0), ("REG_0x94", 1), ("REG_0x98", 1), ("INPUT_END", 0xffffffff),
+            ("OUTPUT_START1", 0), ("OUTPUT_START2", 0), ("OUTPUT_END", 0xffffffff),
+            ("ENCODE_PIXEL_FORMAT", 0), ("ENCODE_COMPONENT0_POS", 0),
+            ("ENCODE_COMPONENT1_POS", 0), ("ENCODE_COMPONENT2_POS", 0),
+            ("ENCODE_COMPONENT3_POS", 0), ("CONVERT_COLOR_SPACE", 0), ("REG_0x118", 0),
+            ("REG_0x11c", 0), ("REG_0x120", 0), ("TILING_ENABLE", 0), ("TILING_PLANE0", 0),
+            ("TILING_PLANE1", 0), ("DECODE_MACROBLOCKS_W", 0), ("DECODE_MACROBLOCKS_H", 0),
+            ("SCALE_FACTOR", 0), ("DECODE_PIXEL_FORMAT", 0), ("YUV422_ORDER", 0),
+            ("RGBA_ORDER", 0), ("RGBA_ALPHA", 0), ("RIGHT_EDGE_PIXELS", 0),
+            ("BOTTOM_EDGE_PIXELS", 0), ("RIGHT_EDGE_SAMPLES", 0), ("BOTTOM_EDGE_SAMPLES", 0),
+        ):
+            getattr(jpeg, name).val = val
+        for i in range(11):
+            jpeg.MATRIX_MULT[i].val = 0
+        for i in range(10):
+            jpeg.DITHER[i].val = 0xff
+        for reg in (0x1fc, 0x200, 0x204, 0x208, 0x214, 0x218, 0x21c, 0x220, 0x224, 0x228, 0x22c,
+                    0x230, 0x244, 0x248, 0x258, 0x25c, 0x23c, 0x240, 0x250, 0x254):
+            getattr(jpeg, f"REG_0x{reg:x}").val = 0
+        jpeg.REG_0x234.val = 0x1f40
+        jpeg.REG_0x160.val = 0
+        jpeg.TIMEOUT.val = 0
+        jpeg.REG_0x20.val = 0xff
+
+    def _setup(self):
+        jpeg = self.regs
+        iova, width, height, stride, depth, iova_end = self.surface
+
+        jpeg.MODE = 0x17f
+        jpeg.REG_0x38 = 0x1
+        jpeg.REG_0x2c = 0x1
+        jpeg.REG_0x34 = 0x0
+        jpeg.CODEC.set(CODEC=E_CODEC._420)
+
+        jpeg.PX_USE_PLANE1 = 0
+        jpeg.PX_PLANE1_WIDTH = 0xffffffff
+        jpeg.PX_PLANE1_HEIGHT = 0xffffffff
+        jpeg.PX_PLANE0_WIDTH = width * 4 - 1
+        jpeg.PX_PLANE0_HEIGHT = height - 1
+        jpeg.TIMEOUT = 266000000
+        jpeg.PX_TILES_W = (width + self.MB_W - 1) // self.MB_W
+        jpeg.PX_TILES_H = (height + self.MB_H - 1) // self.MB_H
+        jpeg.PX_PLANE0_TILING_H = 8
+        jpeg.PX_PLANE0_TILING_V = 16
+        jpeg.PX_PLANE1_TILING_H = 0
+        jpeg.PX_PLANE1_TILING_V = 0
+        jpeg.PX_PLANE0_STRIDE = stride
+        jpeg.PX_PLANE1_STRIDE = 0
+        jpeg.CHROMA_HALVE_H_TYPE1 = 1
+        jpeg.CHROMA_HALVE_V_TYPE1 = 1
+
+        jpeg.REG_0x94 = 0xc
+        jpeg.REG_0x98 = 0x2
+        jpeg.REG_0x20c = width
+        jpeg.REG_0x210 = height
+
+        jpeg.CONVERT_COLOR_SPACE = 1
+        for i, v in enumerate(ENCODE_MATRIX):
+            jpeg.MATRIX_MULT[i].val = v
+
+        # Both framebuffer formats keep blue lowest and red highest
+        if depth == 30:
+            jpeg.ENCODE_PIXEL_FORMAT.set(FORMAT=E_ENCODE_PIXEL_FORMAT.RGB101010)
+        else:
+            jpeg.ENCODE_PIXEL_FORMAT.set(FORMAT=E_ENCODE_PIXEL_FORMAT.RGB888)
+        jpeg.ENCODE_COMPONENT0_POS = 2
+        jpeg.ENCODE_COMPONENT1_POS = 1
+        jpeg.ENCODE_COMPONENT2_POS = 0
+        jpeg.ENCODE_COMPONENT3_POS = 3
+
+        jpeg.INPUT_START1 = iova
+        jpeg.INPUT_START2 = iova
+        jpeg.INPUT_END = iova_end + 7
+        jpeg.OUTPUT_START1 = self.out_iova
+        jpeg.OUTPUT_START2 = 0xdeadbeef
+        jpeg.OUTPUT_END = self.out_iova + self.out_size
+
+        jpeg.REG_0x118 = 0x1
+        jpeg.REG_0x11c = 0x0
+        jpeg.ENABLE_RST_LOGGING = 0
+
+        jpeg.MODE = 0x16f
+        jpeg.JPEG_IO_FLAGS.set(OUTPUT_8BYTE_CHUNKS_CORRECTLY=1, OUTPUT_MACROBLOCKS_UNFLIPPED_H=1,
+                               SUBSAMPLING_MODE=E_JPEG_IO_FLAGS_SUBSAMPLING._420)
+        jpeg.JPEG_WIDTH = width
+        jpeg.JPEG_HEIGHT = height
+        jpeg.RST_INTERVAL = 0
+        jpeg.JPEG_OUTPUT_FLAGS = 0
+
+        for i, v in enumerate(ENCODE_QTBL):
+            jpeg.QTBL[i].val = v
+        jpeg.HUFFMAN_TABLE.val = 0x3c
+        jpeg.QTBL_SEL.val = 0xff
+
+    def encode(self, timeout=1.0):
+        '''Encode the mapped surface once, returns the JPEG file contents'''
+        if self.surface is None:
+            raise JPEGError("no surface mapped")
+
+        self.reset()
+        self._setup()
+        self.regs.REG_0x0.val = 0x1
+        self.regs.REG_0x1004.val = 0x1
+
+        deadline = time.time() + timeout
+        while True:
+            status = self.regs.STATUS.reg
+            if status.value & 0x7e: # any error bit
+                raise JPEGError(f"encode failed: {status}")
+            if status.DONE:
+                break
+            if time.time() > deadline:
+                raise JPEGError(f"encode timed out: {status}")
+
+        size = self.regs.COMPRESSED_BYTES.val
+        if not size or size > self.out_size:
+            raise JPEGError(f"bad output size {size:#x}")
+        return self.iface.readmem(self.out_phys, size)
@@ -261,6 +261,11 @@ class UAT(Reloadable):
     IDX_BITS = 11
     Lx_SIZE = (1 << IDX_BITS)
 
+    # Translation and bulk copies are done by m1n1, these size its scratch buffers
+    UNMAPPED = (1 << 64) - 1
+    EXTENT_COUNT = 256
+    BOUNCE_SIZE = 0x100000
+
     LEVELS = [
         (L0_OFF, L0_SIZE, TTBR),
         (L1_OFF, L1_SIZE, PTE),
@@ -279,6 +284,8 @@ class UAT(Reloadable):
         self.allocator = None
         self.ttbr = None
         self.initialized = False
+        self.ext_buf = None
+        self.bounce_buf = None
         self.sgx_dev = self.u.adt["/arm-io/sgx"]
         self.shared_region = self.sgx_dev.gfx_shared_region_base
         self.gpu_region = self.sgx_dev.gpu_region_base
@@ -297,19 +304,36 @@ class UAT(Reloadable):
         print(f"[UAT] Set L0 ctx={ctx} off={off:#x} base={base:#x} asid={asid} ({ttbr})")
         self.write_pte(self.gpu_region + ctx * 16, off, 2, ttbr)
 
+    def ttbrs(self, ctx):
+        return self.gpu_region + ctx * 16
+
+    def sync_pt(self):
+        # m1n1 walks the tables in memory, so anything still only in pt_cache has to go out first
+        if self.dirty:
+            self.flush_dirty()
+
+    def get_bounce(self):
+        if self.bounce_buf is None:
+            self.bounce_buf = self.u.malloc(self.BOUNCE_SIZE)
+        return self.bounce_buf
+
     def ioread(self, ctx, base, size):
         if size == 0:
             return b""
 
-        ranges = self.iotranslate(ctx, base, size)
+        self.sync_pt()
+        bounce = self.get_bounce()
 
-        iova = base
         data = []
-        for addr, size in ranges:
-            if addr is None:
-                raise Exception(f"Unmapped page at iova {ctx}:{iova:#x}")
-            data.append(self.iface.readmem(addr, size))
-            iova += size
+        while size:
+            chunk = min(size, self.BOUNCE_SIZE)
+            done = self.p.uat_read(self.ttbrs(ctx), bounce, base, chunk)
+            if done:
+                data.append(self.iface.readmem(bounce, done))
+            if done < chunk:
+                raise Exception(f"Unmapped page at iova {ctx}:{base + done:#x}")
+            base += chunk
+            size -= chunk
 
         return b"".join(data)
 
@@ -317,16 +341,18 @@ class UAT(Reloadable):
         if len(data) == 0:
             return
 
-        ranges = self.iotranslate(ctx, base, len(data))
+        self.sync_pt()
+        bounce = self.get_bounce()
 
-        iova = base
         p = 0
-        for addr, size in ranges:
-            if addr is None:
-                raise Exception(f"Unmapped page at iova {ctx}:{iova:#x}")
-            self.iface.writemem(addr, data[p:p + size])
-            p += size
-            iova += size
+        while p < len(data):
+            chunk = data[p:p + self.BOUNCE_SIZE]
+            self.iface.writemem(bounce, chunk)
+            done = self.p.uat_write(self.ttbrs(ctx), base, bounce, len(chunk))
+            if done < len(chunk):
+                raise Exception(f"Unmapped page at iova {ctx}:{base + done:#x}")
+            base += len(chunk)
+            p += len(chunk)
 
     # A stream interface that can be used for random access by Construct
     def iostream(self, ctx, base, recurse=True):
@@ -411,6 +437,40 @@ class UAT(Reloadable):
         if size == 0:
             return []
 
+        self.sync_pt()
+        if self.ext_buf is None:
+            self.ext_buf = self.u.malloc(self.EXTENT_COUNT * 24)
+
+        ranges = []
+        while size:
+            count = self.p.uat_translate(self.ttbrs(ctx), start, size, self.ext_buf,
+                                         self.EXTENT_COUNT)
+            if count <= 0:
+                raise Exception(f"UAT translation of {ctx}:{start:#x} failed ({count})")
+
+            data = self.iface.readmem(self.ext_buf, count * 24)
+            for iova, paddr, length in struct.iter_unpack("<3Q", data):
+                paddr = None if paddr == self.UNMAPPED else paddr
+                # Only the extents either side of a batch boundary can still be merged
+                if ranges:
+                    laddr, lsize = ranges[-1]
+                    if ((paddr is None and laddr is None) or
+                        (paddr is not None and laddr is not None and paddr == laddr + lsize)):
+                        ranges[-1] = laddr, lsize + length
+                        start += length
+                        size -= length
+                        continue
+                ranges.append((paddr, length))
+                start += length
+                size -= length
+
+        return ranges
+
+    # The same translation done from the host through pt_cache, for m1n1 builds without the UAT ops
+    def iotranslate_host(self, ctx, start, size):
+        if size == 0:
+            return []
+
         start = start & self.VA_MASK
 
         start_page = align_down(start, self.PAGE_SIZE)
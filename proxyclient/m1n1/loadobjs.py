@@ -4,6 +4,8 @@ import sys, pathlib, os
 import subprocess
 import tempfile
 import bisect
+import hashlib
+import struct
 
 from .asm import NM, LD, OBJCOPY, ARMAsm
 
@@ -23,10 +25,31 @@ def run_tool(progname, *args, silent=False):
     subprocess.check_call([progname.replace("%ARCH", ARMAsm.ARCH)] + list(args),
                         stdout=subprocess.DEVNULL if silent else None)
 
+# Compiled inline C and linked images are kept here, keyed by a hash of everything that goes
+# into them. Set M1N1OBJCACHE to another directory, or to an empty string to disable this.
+OBJ_CACHE_DIR = os.environ.get("M1N1OBJCACHE",
+                               os.path.join(os.path.expanduser("~"), ".cache", "m1n1", "objs"))
+
+def cache_path(name):
+    if not OBJ_CACHE_DIR:
+        return None
+    os.makedirs(OBJ_CACHE_DIR, exist_ok=True)
+    return os.path.join(OBJ_CACHE_DIR, name)
+
+def cache_store(path, data):
+    with open(path + ".tmp", "wb") as f:
+        f.write(data)
+    os.replace(path + ".tmp", path)
+
 
 class LinkedProgram:
     SOURCE_ROOT = str(pathlib.Path(__file__).resolve().parents[2])
 
+    # Trailer at the end of each object allocation identifying the image loaded there, so an
+    # image that is still on the device from an earlier run does not have to be sent again
+    IMAGE_TAG = struct.Struct("<8sQ32s")
+    IMAGE_MAGIC = b"m1n1obj\0"
+
     def __init__(self, u, base_object=None):
         self.u = u
         self.symbols = []
@@ -63,9 +86,13 @@ class LinkedProgram:
     def _load_elf_symbols(self, relpath, offset=0,
                             objname=None, ignore=""):
         path = pathlib.Path(self.SOURCE_ROOT, relpath)
+        return self._add_symbols(relpath, tool_output_lines(NM, "-g", path), offset,
+                                 objname, ignore)
+
+    def _add_symbols(self, relpath, lines, offset=0, objname=None, ignore=""):
         symaddrs = dict()
 
-        for line in tool_output_lines(NM, "-g", path):
+        for line in lines:
             addr_str, t, name = line.split()
             addr = int(addr_str, 16) + offset
             if t in ignore:
@@ -87,6 +114,52 @@ class LinkedProgram:
             self._alloced_bases.append(base)
 
         objfile = os.path.join(self.SOURCE_ROOT, objfile)
+        with open(objfile, "rb") as f:
+            obj = f.read()
+
+        # The link depends on the object, where it goes and every symbol it can resolve against
+        h = hashlib.sha256(obj)
+        h.update(struct.pack("<Q", base))
+        for sym in self.symbols:
+            h.update(f"{sym[1]}={sym[0]:x};".encode("ascii"))
+        key = h.hexdigest()
+
+        path = cache_path(key)
+        buf = None
+        if path is not None:
+            try:
+                with open(path + ".bin", "rb") as f:
+                    buf = f.read()
+                with open(path + ".sym", "r") as f:
+                    syms = f.readlines()
+            except OSError:
+                buf = None
+
+        if buf is None:
+            buf, syms = self._link_obj(objfile, base)
+            if path is not None:
+                cache_store(path + ".sym", "".join(syms).encode("ascii"))
+                cache_store(path + ".bin", buf)
+
+        self._add_symbols(objfile, syms, ignore="A")
+
+        tag_addr = base + ALLOC_SIZE - self.IMAGE_TAG.size
+        assert len(buf) <= tag_addr - base
+        digest = hashlib.sha256(buf).digest()
+        tag = self.IMAGE_TAG.pack(self.IMAGE_MAGIC, len(buf), digest)
+
+        # Other users of the heap may have overwritten the image without touching the trailer,
+        # so a matching trailer only means it is worth reading the image back to compare
+        if (self.u.iface.readmem(tag_addr, len(tag)) == tag and
+            hashlib.sha256(self.u.iface.readmem(base, len(buf))).digest() == digest):
+            return
+
+        self.u.iface.writemem(base, buf)
+        self.u.iface.writemem(tag_addr, tag)
+        self.u.proxy.dc_cvau(base, len(buf))
+        self.u.proxy.ic_ivau(base, len(buf))
+
+    def _link_obj(self, objfile, base):
         tmp = tempfile.mkdtemp() + os.sep
         elffile = tmp + "elf"
         ld_script = tmp + "ld"
@@ -102,13 +175,9 @@ class LinkedProgram:
         run_tool(LD, "-EL", "-maarch64elf", "-T", ld_script, "-o", elffile, objfile)
         run_tool(OBJCOPY, "-O", "binary", elffile, binfile)
         #run_tool("objdump", "-d", elffile)
-        self._load_elf_symbols(elffile, ignore="A")
+        syms = list(tool_output_lines(NM, "-g", elffile))
         with open(binfile, "rb") as f:
-            buf = f.read()
-            assert len(buf) <= ALLOC_SIZE
-            self.u.iface.writemem(base, buf)
-            self.u.proxy.dc_cvau(base, len(buf))
-            self.u.proxy.ic_ivau(base, len(buf))
+            return f.read(), syms
 
     def clear_objs(self):
         for name in self._attrs_to_clear:
@@ -153,7 +222,24 @@ class LinkedProgram:
             return None, None
         return self.symbols[idx]
 
+    def _inline_c_key(self, source):
+        # Anything that can change the object: the source, the headers it may pull in from src/,
+        # the Makefile flags and the toolchain selection
+        h = hashlib.sha256(source.encode("utf-8"))
+        root = pathlib.Path(self.SOURCE_ROOT)
+        for hdr in sorted([root / "Makefile"] + list((root / "src").rglob("*.h"))):
+            h.update(str(hdr.relative_to(root)).encode("utf-8"))
+            h.update(hdr.read_bytes())
+        for var in ("ARCH", "TOOLCHAIN", "USE_CLANG", "EXTRA_CFLAGS"):
+            h.update(f"{var}={os.environ.get(var, '')};".encode("utf-8"))
+        return h.hexdigest()
+
     def load_inline_c(self, source):
+        path = cache_path(self._inline_c_key(source) + ".o")
+        if path is not None and os.path.exists(path):
+            self.load_obj(path)
+            return
+
         tmp = tempfile.mkdtemp()
         cfile = tmp + ".c"
         objfile = tmp + ".o"
@@ -161,6 +247,9 @@ class LinkedProgram:
             f.write(source)
         run_tool("make", "-C", self.SOURCE_ROOT, "invoke_cc",
                  f"OBJFILE={objfile}", f"CFILE={cfile}", silent=True)
+        if path is not None:
+            with open(objfile, "rb") as f:
+                cache_store(path, f.read())
         self.load_obj(objfile)
 
 
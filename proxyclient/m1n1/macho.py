@@ -146,6 +146,15 @@ class MachO:
             elif cmd.cmd == MachOLoadCmdType.UNIXTHREAD:
                 self.entry = cmd.args[0].data.pc
 
+    def image_size(self):
+        '''Size of the image prepare_image() builds, which is also what m1n1's macho_load() fills'''
+        memory_size = self.vmax - self.vmin
+        for cmd in self.get_cmds(MachOLoadCmdType.SEGMENT_64):
+            size = min(self.size, cmd.args.fileoff + cmd.args.filesize) - cmd.args.fileoff
+            if cmd.args.segname == "PYLD" and cmd.args.vmsize > size + 4:
+                memory_size -= cmd.args.vmsize - size - 4
+        return memory_size
+
     def prepare_image(self, load_hook=None):
         memory_size = self.vmax - self.vmin
 
@@ -1,7 +1,13 @@
 # SPDX-License-Identifier: MIT
+import struct
 from contextlib import contextmanager
 
-__all__ = ["Heap"]
+__all__ = ["Heap", "MEMSTAT_NAMES", "get_memstats", "print_memstats"]
+
+# Order of enum memstat_id in src/memstats.h
+MEMSTAT_NAMES = ["heapblock", "malloc", "pool", "dart", "hv_pt", "usb"]
+MEMSTAT_FIELDS = ["live", "peak", "reserved", "allocs", "frees"]
+MEMSTAT_FMT = "<5Q"
 
 class Heap(object):
     def __init__(self, start, end, block=64):
@@ -96,3 +102,26 @@ class Heap(object):
             yield addr
         finally:
             self.free(addr)
+
+def get_memstats(u, reset=False):
+    """Fetch the allocator counters from m1n1 as a dict of subsystem -> dict of fields"""
+    entry = struct.calcsize(MEMSTAT_FMT)
+    size = entry * len(MEMSTAT_NAMES)
+    with u.heap.guarded_malloc(size) as buf:
+        count = u.proxy.memstats(buf, size, reset)
+        data = u.iface.readmem(buf, entry * count)
+
+    stats = {}
+    for i in range(count):
+        name = MEMSTAT_NAMES[i] if i < len(MEMSTAT_NAMES) else f"#{i}"
+        values = struct.unpack_from(MEMSTAT_FMT, data, i * entry)
+        stats[name] = dict(zip(MEMSTAT_FIELDS, values))
+    return stats
+
+def print_memstats(u, reset=False):
+    """Print live/peak usage per subsystem, e.g. to track down leaks in long HV sessions"""
+    print("Memory usage:")
+    print(f" {'':10} {'live':>10} {'peak':>10} {'reserved':>10} {'allocs':>8} {'frees':>8}")
+    for name, s in get_memstats(u, reset).items():
+        print(f" {name:10} {s['live'] // 1024:>8}kB {s['peak'] // 1024:>8}kB "
+              f"{s['reserved'] // 1024:>8}kB {s['allocs']:>8} {s['frees']:>8}")
@@ -1,13 +1,14 @@
 # SPDX-License-Identifier: MIT
-import os, sys, struct, serial, time
+import os, sys, struct, serial, time, zlib
 from construct import *
 from enum import IntEnum, IntFlag
 from serial.tools.miniterm import Miniterm
 
 from .utils import *
 from .sysreg import *
+from . import accel
 
-__all__ = ["REGION_RWX_EL0", "REGION_RW_EL0", "REGION_RX_EL1"]
+__all__ = ["REGION_RWX_EL0", "REGION_RW_EL0", "REGION_RX_EL1", "REGION_NC_EL1", "RegOp"]
 
 # Hack to disable input buffer flushing
 class Serial(serial.Serial):
@@ -32,12 +33,44 @@ class UartChecksumError(UartError):
 class UartRemoteError(UartError):
     pass
 
+_CRC32C_TABLE = []
+for i in range(256):
+    v = i
+    for j in range(8):
+        v = (v >> 1) ^ (0x82F63B78 if v & 1 else 0)
+    _CRC32C_TABLE.append(v)
+
+def _crc32c_py(data, crc=0):
+    crc ^= 0xFFFFFFFF
+    table = _CRC32C_TABLE
+    for c in data:
+        crc = table[(crc ^ c) & 0xff] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
+
+try:
+    # Native implementations, if available
+    from crc32c import crc32c
+except ImportError:
+    try:
+        import google_crc32c
+        def crc32c(data, crc=0):
+            return google_crc32c.extend(crc, data)
+    except ImportError:
+        crc32c = accel.crc32c or _crc32c_py
+
 class Feature(IntFlag):
     DISABLE_DATA_CSUMS = 0x01  # Data transfers don't use checksums
+    BULK_WRITE = 0x02          # Pipelined chunked memory writes (REQ_BULKWRITE)
+    CRC32C = 0x04              # Data checksums use CRC32C instead of the legacy checksum
+    ZWRITE = 0x08              # Deflate-compressed memory writes (REQ_ZWRITE)
+    ZREAD = 0x10               # Deflate-compressed memory reads (REQ_ZREAD)
+    SPARSE_READ = 0x20         # Memory reads that skip all-zero pages (REQ_SPARSEREAD)
+    SET_BAUD = 0x40            # UART baud rate negotiation (REQ_SETBAUD)
 
     @classmethod
     def get_all(cls):
-        return cls.DISABLE_DATA_CSUMS
+        return (cls.DISABLE_DATA_CSUMS | cls.BULK_WRITE | cls.CRC32C | cls.ZWRITE | cls.ZREAD |
+                cls.SPARSE_READ | cls.SET_BAUD)
 
     def __str__(self):
         return ", ".join(feature.name for feature in self.__class__
@@ -59,6 +92,23 @@ class EXC(IntEnum):
 class EVENT(IntEnum):
     MMIOTRACE = 1
     IRQTRACE = 2
+    MMIOTRACE_BATCH = 3
+    EXC_ASYNC = 4
+    IRQTRACE_BATCH = 5
+    LINK_TEST = 6
+    ASYNC_DONE = 7
+    MEMTEST_ERROR = 8
+    TRACE_DEMOTE = 9
+
+class EVENT_POLICY(IntEnum):
+    SYNC = 0
+    DROP_NEW = 1
+    DROP_OLDEST = 2
+
+class TRACE_BATCH(IntEnum):
+    OFF = 0
+    BLOCK = 1
+    DROP = 2
 
 class EXC_RET(IntEnum):
     UNHANDLED = 1
@@ -117,9 +167,27 @@ class UartInterface(Reloadable):
     REQ_MEMWRITE = 0x03AA55FF
     REQ_BOOT = 0x04AA55FF
     REQ_EVENT = 0x05AA55FF
+    REQ_BULKWRITE = 0x06AA55FF
+    REQ_BULKACK = 0x07AA55FF
+    REQ_ZWRITE = 0x08AA55FF
+    REQ_ZREAD = 0x09AA55FF
+    REQ_SPARSEREAD = 0x0AAA55FF
+    REQ_SETBAUD = 0x0BAA55FF
 
     CHECKSUM_SENTINEL = 0xD0DECADE
     DATA_END_SENTINEL = 0xB0CACC10
+    SPARSE_PAGE_SIZE = 0x4000
+    SPARSE_MAX_PAGES = 65536
+    BULK_CHUNK_MAGIC = 0xB10CC0DE
+
+    BULK_CHUNK_SIZE = 0x10000
+    BULK_WINDOW = 8
+    BULK_RETRIES = 3
+
+    # Rates the 24MHz UART clock divides into exactly, fastest first
+    BAUD_RATES = [1500000, 750000, 500000, 375000]
+    # The device goes back to the old rate if it isn't pinged within 500ms of a REQ_SETBAUD
+    BAUD_PING_TIMEOUT = 0.5
 
     ST_OK = 0
     ST_BADCMD = -1
@@ -136,7 +204,12 @@ class UartInterface(Reloadable):
         self.devpath = None
         if device is None:
             device = os.environ.get("M1N1DEVICE", "/dev/m1n1:115200")
-        if isinstance(device, str):
+        if isinstance(device, str) and (device == "usb" or device.startswith("usb:")):
+            from .usbbulk import USBBulk
+            self.devpath = device
+            self.baudrate = 0
+            device = USBBulk(int(device[4:] or 0))
+        elif isinstance(device, str):
             baud = 115200
             if ":" in device:
                 device, baud = device.rsplit(":", 1)
@@ -161,6 +234,9 @@ class UartInterface(Reloadable):
         self.enabled_features = Feature(0)
 
     def checksum(self, data):
+        if accel.checksum is not None:
+            return accel.checksum(data)
+
         sum = 0xDEADBEEF;
         for c in data:
             sum *= 31337
@@ -173,16 +249,28 @@ class UartInterface(Reloadable):
         if self.enabled_features & Feature.DISABLE_DATA_CSUMS:
             return self.CHECKSUM_SENTINEL
 
+        if self.enabled_features & Feature.CRC32C:
+            return crc32c(data)
+
         return self.checksum(data)
 
     def readfull(self, size):
-        d = b''
-        while len(d) < size:
-            block = self.dev.read(size - len(d))
-            if not block:
-                raise UartTimeout("Expected %d bytes, got %d bytes"%(size,len(d)))
-            d += block
-        return d
+        # Fill one preallocated buffer instead of concatenating blocks, which is quadratic
+        buf = bytearray(size)
+        view = memoryview(buf)
+        got = 0
+        readinto = getattr(self.dev, "readinto", None)
+        while got < size:
+            if readinto is not None:
+                n = readinto(view[got:])
+            else:
+                block = self.dev.read(size - got)
+                n = len(block)
+                view[got:got + n] = block
+            if not n:
+                raise UartTimeout("Expected %d bytes, got %d bytes"%(size,got))
+            got += n
+        return bytes(buf)
 
     def cmd(self, cmd, payload=b""):
         if len(payload) > self.CMD_LEN:
@@ -237,6 +325,21 @@ class UartInterface(Reloadable):
         self.tty_enable = False
 
     def reply(self, cmd):
+        status, data = self.reply_status(cmd)
+        if status != self.ST_OK:
+            if status == self.ST_BADCMD:
+                raise UartRemoteError("Reply error: Bad Command")
+            elif status == self.ST_INVAL:
+                raise UartRemoteError("Reply error: Invalid argument")
+            elif status == self.ST_XFERERR:
+                raise UartRemoteError("Reply error: Data transfer failed")
+            elif status == self.ST_CSUMERR:
+                raise UartRemoteError("Reply error: Data checksum failed")
+            else:
+                raise UartRemoteError("Reply error: Unknown error (%d)"%status)
+        return data
+
+    def reply_status(self, cmd):
         reply = b''
         while True:
             if not reply or reply[-1] != 255:
@@ -287,18 +390,7 @@ class UartInterface(Reloadable):
                     reply = b''
                     continue
                 raise UartCMDError("Reply command mismatch: Expected 0x%08x, got 0x%08x"%(cmd, cmdin))
-            if status != self.ST_OK:
-                if status == self.ST_BADCMD:
-                    raise UartRemoteError("Reply error: Bad Command")
-                elif status == self.ST_INVAL:
-                    raise UartRemoteError("Reply error: Invalid argument")
-                elif status == self.ST_XFERERR:
-                    raise UartRemoteError("Reply error: Data transfer failed")
-                elif status == self.ST_CSUMERR:
-                    raise UartRemoteError("Reply error: Data checksum failed")
-                else:
-                    raise UartRemoteError("Reply error: Unknown error (%d)"%status)
-            return data
+            return status, data
 
     def handle_boot(self, data):
         reason, code, info = struct.unpack("<IIQ", data[:16])
@@ -344,8 +436,9 @@ class UartInterface(Reloadable):
     def wait_and_handle_boot(self):
         self.handle_boot(self.wait_boot())
 
-    def nop(self):
-        features = Feature.get_all()
+    def _nop(self, features=None):
+        if features is None:
+            features = Feature.get_all()
 
         # Send the supported feature flags in the NOP message (has no effect
         # if the target does not support it)
@@ -361,6 +454,73 @@ class UartInterface(Reloadable):
 
         self.enabled_features = features
 
+    def nop(self):
+        try:
+            self._nop()
+        except UartError:
+            # A previous session may have left the device at a faster rate
+            if not self.autobaud():
+                raise
+
+        if os.environ.get("M1N1BAUD_AUTO", "1") != "0":
+            self.negotiate_baud()
+
+    def _ping(self, timeout):
+        tout = self.dev.timeout
+        self.dev.timeout = timeout
+        try:
+            self.dev.reset_input_buffer()
+            self._nop()
+            return True
+        except UartError:
+            return False
+        finally:
+            self.dev.timeout = tout
+
+    def autobaud(self):
+        if self.devpath is None:
+            return False
+
+        orig = self.dev.baudrate
+        for rate in [orig] + self.BAUD_RATES:
+            self.dev.baudrate = rate
+            if self._ping(self.BAUD_PING_TIMEOUT):
+                if self.debug:
+                    print(f"Found the device at {rate} baud")
+                return True
+
+        self.dev.baudrate = orig
+        return False
+
+    def negotiate_baud(self):
+        if self.devpath is None or not (self.enabled_features & Feature.SET_BAUD):
+            return
+
+        orig = self.dev.baudrate
+        for rate in self.BAUD_RATES:
+            if rate <= orig:
+                break
+
+            self.cmd(self.REQ_SETBAUD, struct.pack("<I", rate))
+            try:
+                self.reply(self.REQ_SETBAUD)
+            except UartRemoteError:
+                continue
+
+            # The device switches once its TX FIFO has drained, then waits for a ping
+            self.dev.baudrate = rate
+            if self._ping(self.BAUD_PING_TIMEOUT):
+                print(f"UART: switched to {rate} baud")
+                return
+
+            # Let the device time out and go back to the old rate
+            self.dev.baudrate = orig
+            time.sleep(self.BAUD_PING_TIMEOUT * 1.2)
+            if not self._ping(self.BAUD_PING_TIMEOUT) and not self.autobaud():
+                raise UartTimeout("Lost the device during baud rate negotiation")
+            if self.dev.baudrate != orig:
+                return
+
     def proxyreq(self, req, reboot=False, no_reply=False, pre_reply=None):
         self.cmd(self.REQ_PROXY, req)
         if pre_reply:
@@ -373,6 +533,9 @@ class UartInterface(Reloadable):
             return self.reply(self.REQ_PROXY)
 
     def writemem(self, addr, data, progress=False):
+        if (self.enabled_features & Feature.BULK_WRITE) and len(data) > self.BULK_CHUNK_SIZE:
+            return self.bulkwritemem(addr, data, progress)
+
         checksum = self.data_checksum(data)
         size = len(data)
         req = struct.pack("<QQI", addr, size, checksum)
@@ -394,6 +557,95 @@ class UartInterface(Reloadable):
         # should automatically report a CRC failure
         self.reply(self.REQ_MEMWRITE)
 
+    def zwritemem(self, addr, data, progress=False, level=1):
+        '''Compressed memory write: data is deflated on the host and inflated by the device
+ directly into the target buffer as the stream arrives.'''
+        if not data:
+            return
+
+        c = zlib.compressobj(level, zlib.DEFLATED, -15)
+        payload = c.compress(data) + c.flush()
+
+        checksum = self.data_checksum(data)
+        req = struct.pack("<QQII", addr, len(data), checksum, len(payload))
+        self.cmd(self.REQ_ZWRITE, req)
+        if self.debug:
+            print("<< ZDATA: %d bytes compressed to %d bytes" % (len(data), len(payload)))
+        for i in range(0, len(payload), 8192):
+            self.dev.write(payload[i:i + 8192])
+            if progress:
+                sys.stdout.write(".")
+                sys.stdout.flush()
+        if progress:
+            print()
+        if self.enabled_features & Feature.DISABLE_DATA_CSUMS:
+            self.dev.write(struct.pack("<I", self.DATA_END_SENTINEL))
+
+        self.reply(self.REQ_ZWRITE)
+
+    def _bulk_send_chunk(self, data, seq, chunk_size):
+        chunk = data[seq * chunk_size:(seq + 1) * chunk_size]
+        info = struct.pack("<II", seq, len(chunk))
+        checksum = self.data_checksum(info + chunk)
+        self.dev.write(struct.pack("<I", self.BULK_CHUNK_MAGIC) + info +
+                       struct.pack("<I", checksum))
+        self.dev.write(chunk)
+        if self.enabled_features & Feature.DISABLE_DATA_CSUMS:
+            self.dev.write(struct.pack("<I", self.DATA_END_SENTINEL))
+
+    def bulkwritemem(self, addr, data, progress=False, chunk_size=None, window=None):
+        '''Pipelined memory write: the data is sent as checksummed chunks, up to `window` of
+ which are in flight at once. Chunks the device NAKs are retransmitted.'''
+        if not data:
+            return
+
+        chunk_size = chunk_size or self.BULK_CHUNK_SIZE
+        window = window or self.BULK_WINDOW
+        nchunks = (len(data) + chunk_size - 1) // chunk_size
+
+        self.cmd(self.REQ_BULKWRITE, struct.pack("<QQI", addr, len(data), chunk_size))
+        self.reply(self.REQ_BULKWRITE)
+
+        pending = list(range(nchunks))
+        pending.reverse()
+        inflight = set()
+        retries = {}
+        failed = False
+
+        while inflight or (pending and not failed):
+            while pending and not failed and len(inflight) < window:
+                seq = pending.pop()
+                self._bulk_send_chunk(data, seq, chunk_size)
+                inflight.add(seq)
+
+            status, ack = self.reply_status(self.REQ_BULKACK)
+            seq = struct.unpack("<I", ack[:4])[0]
+            inflight.discard(seq)
+            if status == self.ST_OK:
+                if progress:
+                    sys.stdout.write(".")
+                    sys.stdout.flush()
+            elif status == self.ST_CSUMERR and retries.get(seq, 0) < self.BULK_RETRIES:
+                retries[seq] = retries.get(seq, 0) + 1
+                pending.append(seq)
+            else:
+                # Stop sending, but drain the acks for chunks still in flight
+                failed = True
+        if progress:
+            print()
+
+        if failed:
+            # An out-of-range sequence number aborts the transfer on the device side
+            self.dev.write(struct.pack("<IIII", self.BULK_CHUNK_MAGIC, 0xffffffff, 0, 0))
+            try:
+                self.reply(self.REQ_BULKWRITE)
+            except UartRemoteError:
+                pass
+            raise UartChecksumError("Bulk write failed: chunk retries exhausted")
+
+        # Final reply, reports the overall transfer status
+        self.reply(self.REQ_BULKWRITE)
+
     def readmem(self, addr, size):
         if size == 0:
             return b""
@@ -419,6 +671,88 @@ class UartInterface(Reloadable):
 
         return data
 
+    def zreadmem(self, addr, size):
+        '''Compressed memory read: the device deflates the region as it sends it and it is
+ inflated here. Only for plain memory, the device reads it bytewise while compressing.'''
+        if size == 0:
+            return b""
+
+        req = struct.pack("<QQ", addr, size)
+        self.cmd(self.REQ_ZREAD, req)
+        reply = self.reply(self.REQ_ZREAD)
+        checksum = struct.unpack("<I",reply[:4])[0]
+
+        d = zlib.decompressobj(-15)
+        chunks = []
+        csize = 0
+        while True:
+            clen = struct.unpack("<I", self.readfull(4))[0]
+            if not clen:
+                break
+            chunks.append(d.decompress(self.readfull(clen)))
+            csize += clen
+        chunks.append(d.flush())
+        data = b"".join(chunks)
+        if self.debug:
+            print(">> ZDATA: %d bytes compressed to %d bytes" % (size, csize))
+        if len(data) != size or not d.eof:
+            raise UartChecksumError(f"Compressed reply size error: Expected {size:#x}, "
+                f"got {len(data):#x}")
+
+        ccsum = self.data_checksum(data)
+        if checksum != ccsum:
+            raise UartChecksumError("Reply data checksum error: Expected 0x%08x, got 0x%08x"%(checksum, ccsum))
+
+        if self.enabled_features & Feature.DISABLE_DATA_CSUMS:
+            sentinel = struct.unpack("<I", self.readfull(4))[0]
+            if sentinel != self.DATA_END_SENTINEL:
+                raise UartChecksumError(f"Reply data sentinel error: Expected "
+                    f"{self.DATA_END_SENTINEL:#x}, got {sentinel:#x}")
+
+        return data
+
+    def sparsereadmem(self, addr, size):
+        '''Zero-aware memory read: the device sends a bitmap of the 16K pages in the range that
+ are not all zeros, then only those pages. addr and size must be 8-byte aligned.'''
+        if size == 0:
+            return b""
+
+        max_size = self.SPARSE_PAGE_SIZE * self.SPARSE_MAX_PAGES
+        if size > max_size:
+            return b"".join(self.sparsereadmem(addr + off, min(max_size, size - off))
+                            for off in range(0, size, max_size))
+
+        req = struct.pack("<QQ", addr, size)
+        self.cmd(self.REQ_SPARSEREAD, req)
+        reply = self.reply(self.REQ_SPARSEREAD)
+        checksum = struct.unpack("<I",reply[:4])[0]
+
+        npages = (size + self.SPARSE_PAGE_SIZE - 1) // self.SPARSE_PAGE_SIZE
+        bitmap = self.readfull((npages + 31) // 32 * 4)
+        data = bytearray(size)
+        received = [bitmap]
+        for i in range(npages):
+            if not bitmap[i // 8] & (1 << (i % 8)):
+                continue
+            off = i * self.SPARSE_PAGE_SIZE
+            page = self.readfull(min(self.SPARSE_PAGE_SIZE, size - off))
+            data[off:off + len(page)] = page
+            received.append(page)
+        if self.debug:
+            print(">> SPARSE: %d of %d pages populated" % (len(received) - 1, npages))
+
+        ccsum = self.data_checksum(b"".join(received))
+        if checksum != ccsum:
+            raise UartChecksumError("Reply data checksum error: Expected 0x%08x, got 0x%08x"%(checksum, ccsum))
+
+        if self.enabled_features & Feature.DISABLE_DATA_CSUMS:
+            sentinel = struct.unpack("<I", self.readfull(4))[0]
+            if sentinel != self.DATA_END_SENTINEL:
+                raise UartChecksumError(f"Reply data sentinel error: Expected "
+                    f"{self.DATA_END_SENTINEL:#x}, got {sentinel:#x}")
+
+        return bytes(data)
+
     def readstruct(self, addr, stype):
         return stype.parse(self.readmem(addr, stype.sizeof()))
 
@@ -437,6 +771,41 @@ class ProxyCommandError(ProxyRemoteError):
 class AlignmentError(Exception):
     pass
 
+class ProxyFuture:
+    '''Result of a request submitted with M1N1Proxy.submit(), filled in by EVT_ASYNC_DONE'''
+    def __init__(self, proxy, tag, cpu, opcode, signed):
+        self.proxy = proxy
+        self.tag = tag
+        self.cpu = cpu
+        self.opcode = opcode
+        self.signed = signed
+        self.status = None
+        self.retval = None
+
+    def done(self):
+        return self.status is not None
+
+    def _complete(self, opcode, status, retval):
+        if self.signed and retval & (1 << 63):
+            retval -= 1 << 64
+        self.status = status
+        self.retval = retval
+
+    def result(self):
+        '''Block until the request has completed and return its result'''
+        if not self.done():
+            # The completion event is sent before the CPU goes idle, so it arrives before this
+            # reply does
+            self.proxy.request(self.proxy.P_ASYNC_WAIT, self.cpu)
+        if not self.done():
+            raise ProxyError(f"Async request {self.tag} on CPU {self.cpu} did not complete")
+        if self.status != M1N1Proxy.S_OK:
+            if self.status == M1N1Proxy.S_BADCMD:
+                raise ProxyCommandError("Reply error: Bad Command")
+            else:
+                raise ProxyRemoteError("Reply error: Unknown error (%d)"%self.status)
+        return self.retval
+
 class IODEV(IntEnum):
     UART = 0
     FB = 1
@@ -449,11 +818,35 @@ class IODEV(IntEnum):
     USB5 = 8
     USB6 = 9
     USB7 = 10
+    USB_BULK0 = 11
+    USB_BULK1 = 12
+    USB_BULK2 = 13
+    USB_BULK3 = 14
+    USB_BULK4 = 15
+    USB_BULK5 = 16
+    USB_BULK6 = 17
+    USB_BULK7 = 18
 
 class USAGE(IntFlag):
     CONSOLE = (1 << 0)
     UARTPROXY = (1 << 1)
 
+class REGOP(IntEnum):
+    READ = 0
+    WRITE = 1
+    MASK = 2
+    POLL = 3
+    DELAY = 4
+
+RegOp = Struct(
+    "op" / Int16ul,
+    "width" / Int16ul,
+    "timeout" / Int32ul,
+    "addr" / Int64ul,
+    "value" / Int64ul,
+    "mask" / Int64ul,
+)
+
 class GUARD(IntFlag):
     OFF = 0
     SKIP = 1
@@ -464,12 +857,14 @@ class GUARD(IntFlag):
 REGION_RWX_EL0 = 0x80000000000
 REGION_RW_EL0 = 0xa0000000000
 REGION_RX_EL1 = 0xc0000000000
+REGION_NC_EL1 = 0xe0000000000
 
 # Uses UartInterface.proxyreq() to send requests to M1N1 and process
 # reponses sent back.
 class M1N1Proxy(Reloadable):
     S_OK = 0
     S_BADCMD = -1
+    S_EXC = -2
 
     P_NOP = 0x000
     P_EXIT = 0x001
@@ -488,6 +883,25 @@ class M1N1Proxy(Reloadable):
     P_GET_SIMD_STATE = 0x00e
     P_PUT_SIMD_STATE = 0x00f
     P_REBOOT = 0x010
+    P_BINLOG_READ = 0x011
+    P_BINLOG_DUMP = 0x012
+    P_REBOOT_WARM = 0x013
+    P_GET_BOOT_PROFILE = 0x014
+    P_LINK_ECHO = 0x015
+    P_LINK_EVENTS = 0x016
+    P_PROXY_STATS = 0x017
+    P_ASYNC_SUBMIT = 0x018
+    P_ASYNC_WAIT = 0x019
+    P_GL1_CALL_BATCH = 0x01a
+    P_GL2_CALL_BATCH = 0x01b
+    P_EL0_CALL_BATCH = 0x01c
+    P_EL1_CALL_BATCH = 0x01d
+    P_MRS = 0x01e
+    P_MSR = 0x01f
+    P_SYSREG_DUMP = 0x020
+    P_SPINLOCK_STATS = 0x021
+    P_EVENT_POLICY = 0x022
+    P_EVENT_STATS = 0x023
 
     P_WRITE64 = 0x100
     P_WRITE32 = 0x101
@@ -513,6 +927,7 @@ class M1N1Proxy(Reloadable):
     P_WRITEREAD32 = 0x115
     P_WRITEREAD16 = 0x116
     P_WRITEREAD8 = 0x117
+    P_REGOP_BATCH = 0x118
 
     P_MEMCPY64 = 0x200
     P_MEMCPY32 = 0x201
@@ -522,6 +937,18 @@ class M1N1Proxy(Reloadable):
     P_MEMSET32 = 0x205
     P_MEMSET16 = 0x206
     P_MEMSET8 = 0x207
+    P_MEMSET_PARALLEL = 0x208
+    P_MEMCPY_BULK = 0x209
+    P_MEMDIFF32 = 0x20a
+    P_MEMWATCH32 = 0x20b
+    P_MEMPROBE = 0x20c
+    P_MEMTEST = 0x20d
+    P_MEMHASH = 0x20e
+    P_HASH = 0x20f
+
+    MEMCPY_INVAL_SRC = 1
+    MEMCPY_CLEAN_DST = 2
+    MEMCPY_NC_DST = 4
 
     P_IC_IALLUIS = 0x300
     P_IC_IALLU = 0x301
@@ -539,20 +966,28 @@ class M1N1Proxy(Reloadable):
     P_MMU_DISABLE = 0x30d
     P_MMU_RESTORE = 0x30e
     P_MMU_INIT_SECONDARY = 0x30f
+    P_MMU_GET_STATS = 0x310
 
     P_XZDEC = 0x400
     P_GZDEC = 0x401
+    P_ZSTDDEC = 0x402
+    P_LZ4DEC = 0x403
+    P_MACHO_LOAD = 0x404
 
     P_SMP_START_SECONDARIES = 0x500
     P_SMP_CALL = 0x501
     P_SMP_CALL_SYNC = 0x502
     P_SMP_WAIT = 0x503
     P_SMP_SET_WFE_MODE = 0x504
+    P_SMP_CALL_MANY = 0x505
+    P_SMP_WAIT_ALL = 0x506
+    P_SMP_START_PROXY = 0x507
 
     P_HEAPBLOCK_ALLOC = 0x600
     P_MALLOC = 0x601
     P_MEMALIGN = 0x602
-    P_FREE = 0x602
+    P_FREE = 0x603
+    P_MEMSTATS = 0x604
 
     P_KBOOT_BOOT = 0x700
     P_KBOOT_SET_CHOSEN = 0x701
@@ -580,6 +1015,7 @@ class M1N1Proxy(Reloadable):
     P_DART_SHUTDOWN = 0xb01
     P_DART_MAP = 0xb02
     P_DART_UNMAP = 0xb03
+    P_DART_MAP_SG = 0xb04
 
     P_HV_INIT = 0xc00
     P_HV_MAP = 0xc01
@@ -594,6 +1030,39 @@ class M1N1Proxy(Reloadable):
     P_HV_SET_TIME_STEALING = 0xc0a
     P_HV_PIN_CPU = 0xc0b
     P_HV_WRITE_HCR = 0xc0c
+    P_HV_SET_TRACE_BATCH = 0xc0d
+    P_HV_ADD_TRACE_FILTER = 0xc0e
+    P_HV_CLEAR_TRACE_FILTERS = 0xc0f
+    P_HV_ADD_NATIVE_HOOK = 0xc10
+    P_HV_GET_NATIVE_HOOK_COUNT = 0xc11
+    P_HV_SET_ASYNC_BPS = 0xc12
+    P_HV_GET_STATS = 0xc13
+    P_HV_ADD_SYSREG_EMU = 0xc14
+    P_HV_CLEAR_SYSREG_EMU = 0xc15
+    P_HV_MAP_BATCH = 0xc16
+    P_HV_DIRTY_START = 0xc17
+    P_HV_DIRTY_FETCH = 0xc18
+    P_HV_DIRTY_STOP = 0xc19
+    P_HV_READ_VA = 0xc1a
+    P_HV_WRITE_VA = 0xc1b
+    P_HV_STEP_START = 0xc1c
+    P_HV_STEP_GET_STATUS = 0xc1d
+    P_HV_PROFILE_START = 0xc1e
+    P_HV_PROFILE_STOP = 0xc1f
+    P_HV_PROFILE_FETCH = 0xc20
+    P_HV_PMU_START = 0xc21
+    P_HV_PMU_STOP = 0xc22
+    P_HV_PMU_FETCH = 0xc23
+    P_HV_MAP_PVCHAN = 0xc24
+    P_HV_IRQ_COUNTERS_FETCH = 0xc25
+    P_HV_SET_IRQ_DELAY = 0xc26
+    P_HV_GET_PENDING_EXITS = 0xc27
+    P_HV_RESOLVE_EXIT = 0xc28
+    P_HV_SET_VTIMER_FORWARD = 0xc29
+    P_HV_SET_TICK_IDLE_RATE = 0xc2a
+    P_HV_SET_TRACE_BUDGET = 0xc2b
+    P_HV_ADD_SHADOW_REGS = 0xc2c
+    P_HV_GET_SHADOW_REGS_COUNT = 0xc2d
 
     P_FB_INIT = 0xd00
     P_FB_SHUTDOWN = 0xd01
@@ -604,6 +1073,7 @@ class M1N1Proxy(Reloadable):
     P_FB_DISPLAY_LOGO = 0xd06
     P_FB_RESTORE_LOGO = 0xd07
     P_FB_IMPROVE_LOGO = 0xd08
+    P_FB_CONSOLE_SET_DEFERRED = 0xd09
 
     P_PCIE_INIT = 0xe00
     P_PCIE_SHUTDOWN = 0xe01
@@ -612,20 +1082,45 @@ class M1N1Proxy(Reloadable):
     P_NVME_SHUTDOWN = 0xf01
     P_NVME_READ = 0xf02
     P_NVME_FLUSH = 0xf03
+    P_NVME_READ_BLOCKS = 0xf04
+    P_NVME_WRITE_BLOCKS = 0xf05
+    P_NVME_DISCARD = 0xf06
 
     P_MCC_GET_CARVEOUTS = 0x1000
+    P_MCC_GET_CACHE_STATE = 0x1001
+    P_MCC_SET_CACHE_WAYS = 0x1002
+    P_MCC_PLANE_READ32 = 0x1003
+    P_MCC_PLANE_WRITE32 = 0x1004
 
     P_DISPLAY_INIT = 0x1100
     P_DISPLAY_CONFIGURE = 0x1101
     P_DISPLAY_SHUTDOWN = 0x1102
+    P_DISPLAY_SWAPCHAIN_INIT = 0x1103
+    P_DISPLAY_SWAPCHAIN_PRESENT = 0x1104
+    P_DISPLAY_SWAPCHAIN_SHUTDOWN = 0x1105
+    P_DISPLAY_CONSOLE_SCALED = 0x1106
 
     P_DAPF_INIT_ALL = 0x1200
     P_DAPF_INIT = 0x1201
 
+    P_UAT_TRANSLATE = 0x1300
+    P_UAT_READ = 0x1301
+    P_UAT_WRITE = 0x1302
+
+    P_ADMAC_STREAM_START = 0x1400
+    P_ADMAC_STREAM_STOP = 0x1401
+
+    P_SMC_BATCH = 0x1500
+
+    P_RTKIT_SYSLOG_DEFER = 0x1600
+    P_RTKIT_SYSLOG_DRAIN = 0x1601
+
     def __init__(self, iface, debug=False):
         self.debug = debug
         self.iface = iface
         self.heap = None
+        self.async_pending = {}
+        self.async_tag = 0
 
     def _request(self, opcode, *args, reboot=False, signed=False, no_reply=False, pre_reply=None):
         if len(args) > 6:
@@ -648,6 +1143,8 @@ class M1N1Proxy(Reloadable):
         if status != self.S_OK:
             if status == self.S_BADCMD:
                 raise ProxyCommandError("Reply error: Bad Command")
+            elif status == self.S_EXC:
+                raise ProxyRemoteError("Exception occurred")
             else:
                 raise ProxyRemoteError("Reply error: Unknown error (%d)"%status)
         return retval
@@ -673,6 +1170,38 @@ class M1N1Proxy(Reloadable):
             for i in free:
                 self.heap.free(i)
 
+    def _async_done(self, data):
+        tag, cpu, opcode, status, retval = struct.unpack("<IIQqQ", data)
+        fut = self.async_pending.pop(tag, None)
+        if fut is None:
+            print(f"Async completion for unknown tag {tag} (CPU {cpu}, op {opcode:#x})")
+            return
+        fut._complete(opcode, status, retval)
+
+    def submit(self, opcode, *args, cpu, signed=False):
+        '''Run a proxy op on secondary CPU cpu and return a ProxyFuture for its result.
+
+        The boot CPU keeps serving requests in the meantime, so transfers can overlap with long
+        running ops. Each CPU runs one request at a time, and only the first four arguments are
+        passed.'''
+        if len(args) > 4:
+            raise ValueError("Too many arguments")
+        if not all(isinstance(i, int) for i in args):
+            raise ValueError("Async requests only take integer arguments")
+        if any(f.cpu == cpu for f in self.async_pending.values()):
+            raise ProxyError(f"CPU {cpu} is busy with another async request")
+
+        self.iface.set_event_handler(EVENT.ASYNC_DONE, self._async_done)
+        tag = self.async_tag
+        self.async_tag = (tag + 1) & 0xffff
+        fut = ProxyFuture(self, tag, cpu, opcode, signed)
+        self.async_pending[tag] = fut
+        args = list(args) + [0] * (4 - len(args))
+        if self.request(self.P_ASYNC_SUBMIT, cpu | (tag << 16), opcode, *args, signed=True) < 0:
+            del self.async_pending[tag]
+            raise ProxyRemoteError(f"Async request rejected by CPU {cpu}")
+        return fut
+
     def nop(self):
         self.request(self.P_NOP)
     def exit(self, retval=0):
@@ -730,12 +1259,61 @@ class M1N1Proxy(Reloadable):
         if len(args) > 4:
             raise ValueError("Too many arguments")
         return self.request(self.P_GL2_CALL, addr, *args)
+    def el0_call_batch(self, calls, count, ticks=0):
+        '''Run count calls from the calls buffer (func, 4 args, retval) in one EL0 entry,
+        storing the elapsed ticks to ticks if given. Returns the number of calls run'''
+        return self.request(self.P_EL0_CALL_BATCH, calls, count, ticks)
+    def el1_call_batch(self, calls, count, ticks=0):
+        '''Same as el0_call_batch, at EL1'''
+        return self.request(self.P_EL1_CALL_BATCH, calls, count, ticks)
+    def gl1_call_batch(self, calls, count):
+        '''Run count GL calls from the calls buffer (func, 4 args, retval) in one GL1 entry,
+        returns the number of calls that completed'''
+        return self.request(self.P_GL1_CALL_BATCH, calls, count)
+    def gl2_call_batch(self, calls, count):
+        '''Same as gl1_call_batch, in GL2'''
+        return self.request(self.P_GL2_CALL_BATCH, calls, count)
+    def mrs(self, enc, silent=False):
+        '''Read the system register with MRS immediate encoding enc on the device'''
+        return self.request(self.P_MRS, enc, int(silent))
+    def msr(self, enc, val, silent=False):
+        '''Write val to the system register with MRS immediate encoding enc'''
+        self.request(self.P_MSR, enc, val, int(silent))
+    def sysreg_dump(self, cpu_mask, encs, count, values, silent=True):
+        '''Read count u32 encodings from encs on all CPUs in cpu_mask in parallel, into a u64
+        matrix at values with one row per CPU in the mask. Returns the mask of CPUs that ran'''
+        return self.request(self.P_SYSREG_DUMP, cpu_mask, encs, count, values, int(silent))
     def get_simd_state(self, buf):
         self.request(self.P_GET_SIMD_STATE, buf)
     def put_simd_state(self, buf):
         self.request(self.P_PUT_SIMD_STATE, buf)
     def reboot(self):
         self.request(self.P_REBOOT, no_reply=True)
+    def binlog_read(self, buf, size, reset=False):
+        return self.request(self.P_BINLOG_READ, buf, size, reset)
+    def binlog_dump(self, reset=False):
+        self.request(self.P_BINLOG_DUMP, reset)
+    def reboot_warm(self):
+        return self.request(self.P_REBOOT_WARM)
+    def get_boot_profile(self, buf, size):
+        return self.request(self.P_GET_BOOT_PROFILE, buf, size)
+    def link_echo(self, value):
+        return self.request(self.P_LINK_ECHO, value)
+    def link_events(self, count, size, buf):
+        return self.request(self.P_LINK_EVENTS, count, size, buf, signed=True)
+    def proxy_stats(self, buf, size, flags=0):
+        return self.request(self.P_PROXY_STATS, buf, size, flags, signed=True)
+    def spinlock_stats(self, buf, count, flags=0):
+        '''Copy out up to count struct spinlock_stat_entry, flags are the same as for
+        proxy_stats. Returns the number of entries'''
+        return self.request(self.P_SPINLOCK_STATS, buf, count, flags)
+    def event_policy(self, policy):
+        '''Set how HV trace events are sent (EVENT_POLICY), returns the previous policy'''
+        return EVENT_POLICY(self.request(self.P_EVENT_POLICY, policy))
+    def event_stats(self, posted=0, reset=False):
+        '''Returns the number of events dropped from the queue, the number posted goes to posted
+        (a u64 buffer) if set'''
+        return self.request(self.P_EVENT_STATS, posted, int(bool(reset)))
 
     def write64(self, addr, data):
         '''write 8 byte value to given address'''
@@ -849,6 +1427,9 @@ class M1N1Proxy(Reloadable):
         return self.request(self.P_WRITEREAD16, addr, data)
     def writeread8(self, addr, data):
         return self.request(self.P_WRITEREAD8, addr, data)
+    def regop_batch(self, ops, count, results=0):
+        '''Run count RegOps from the ops buffer, returns the number of ops that completed'''
+        return self.request(self.P_REGOP_BATCH, ops, count, results)
 
     def memcpy64(self, dst, src, size):
         if src & 7 or dst & 7:
@@ -879,6 +1460,58 @@ class M1N1Proxy(Reloadable):
         self.request(self.P_MEMSET16, dst, src, size)
     def memset8(self, dst, src, size):
         self.request(self.P_MEMSET8, dst, src, size)
+    def memset_parallel(self, dst, value, size):
+        """Fill normal memory with a 64-bit pattern on all CPUs (zero fills use DC ZVA)"""
+        if dst & 7 or size & 7:
+            raise AlignmentError()
+        self.request(self.P_MEMSET_PARALLEL, dst, value, size)
+    def memcpy_bulk(self, dst, src, size, inval_src=False, clean_dst=False, nc_dst=False):
+        """Copy normal memory on all CPUs, with optional cache maintenance for DMA buffers
+
+        nc_dst writes dst through the write-combining alias, for buffers handed to devices."""
+        flags = ((self.MEMCPY_INVAL_SRC if inval_src else 0) |
+                 (self.MEMCPY_CLEAN_DST if clean_dst else 0) |
+                 (self.MEMCPY_NC_DST if nc_dst else 0))
+        self.request(self.P_MEMCPY_BULK, dst, src, size, flags)
+    def memdiff32(self, src, shadow, size, out, max_entries):
+        """Diff src against a device-side shadow copy and update it, returns the changed word count
+
+        The first max_entries changes are written to out as (offset, value) pairs of u32s."""
+        if src & 3 or shadow & 3 or size & 3:
+            raise AlignmentError()
+        return self.request(self.P_MEMDIFF32, src, shadow, size, out, max_entries)
+    def memwatch32(self, watch, count, timeout):
+        """Wait up to timeout us for any of count (addr, mask, value) entries at watch to fire
+
+        Returns the number that fired, each entry gets the last word read and a fired flag."""
+        return self.request(self.P_MEMWATCH32, watch, count, timeout)
+    def memprobe(self, addr, count, stride, width, bitmap, values=0):
+        """Read count addresses stride bytes apart with width byte accesses, faults are skipped
+
+        Bit i of bitmap is set if address i was readable, values (if set) gets the data read packed
+        at the access width. Returns the number of readable addresses."""
+        if width not in (1, 2, 4, 8):
+            raise ValueError(f"Bad probe width {width}")
+        if addr & (width - 1) or stride & (width - 1):
+            raise AlignmentError()
+        return self.request(self.P_MEMPROBE, addr, count, stride, width, bitmap, values)
+    def memtest(self, start, end, passes=1):
+        """Pattern test [start, end) on all CPUs, clobbering it, returns the bad word count
+
+        Bad words are also sent as EVENT.MEMTEST_ERROR (addr, expected, actual) u64 triples."""
+        return self.request(self.P_MEMTEST, start, end, passes)
+    def memhash(self, addr, size, block_size, out):
+        """Hash each block_size block of [addr, addr + size) into out as u64s (see block_hashes)
+
+        Returns the number of blocks hashed."""
+        if addr & 7 or block_size & 7 or not block_size:
+            raise AlignmentError()
+        return self.request(self.P_MEMHASH, addr, size, block_size, out)
+    def hash(self, addr, size):
+        """One 64-bit hash of [addr, addr + size), computed on all CPUs (see range_hash)"""
+        if addr & 7:
+            raise AlignmentError()
+        return self.request(self.P_HASH, addr, size)
 
     def ic_ialluis(self):
         self.request(self.P_IC_IALLUIS)
@@ -912,6 +1545,8 @@ class M1N1Proxy(Reloadable):
         self.request(self.P_MMU_RESTORE, flags)
     def mmu_init_secondary(self, cpu):
         self.request(self.P_MMU_INIT_SECONDARY, cpu)
+    def mmu_get_stats(self, buf, size):
+        return self.request(self.P_MMU_GET_STATS, buf, size, signed=True)
 
 
     def xzdec(self, inbuf, insize, outbuf=0, outsize=0):
@@ -921,6 +1556,14 @@ class M1N1Proxy(Reloadable):
     def gzdec(self, inbuf, insize, outbuf, outsize):
         return self.request(self.P_GZDEC, inbuf, insize, outbuf,
                             outsize, signed=True)
+    def zstddec(self, inbuf, insize, outbuf, outsize):
+        return self.request(self.P_ZSTDDEC, inbuf, insize, outbuf,
+                            outsize, signed=True)
+    def lz4dec(self, inbuf, insize, outbuf, outsize):
+        return self.request(self.P_LZ4DEC, inbuf, insize, outbuf,
+                            outsize, signed=True)
+    def macho_load(self, image, size, dest, dest_size):
+        return self.request(self.P_MACHO_LOAD, image, size, dest, dest_size, signed=True)
 
     def smp_start_secondaries(self):
         self.request(self.P_SMP_START_SECONDARIES)
@@ -936,6 +1579,19 @@ class M1N1Proxy(Reloadable):
         return self.request(self.P_SMP_WAIT, cpu)
     def smp_set_wfe_mode(self, mode):
         return self.request(self.P_SMP_SET_WFE_MODE, mode)
+    def smp_call_many(self, cpus, addr, *args):
+        if len(args) > 4:
+            raise ValueError("Too many arguments")
+        if not isinstance(cpus, int):
+            cpus = sum(1 << cpu for cpu in cpus)
+        return self.request(self.P_SMP_CALL_MANY, cpus, addr, *args)
+    def smp_wait_all(self, cpus):
+        if not isinstance(cpus, int):
+            cpus = sum(1 << cpu for cpu in cpus)
+        self.request(self.P_SMP_WAIT_ALL, cpus)
+    def smp_start_proxy(self, cpu, iodev):
+        '''Serve the proxy on iodev from secondary CPU cpu, until P_EXIT arrives on that link'''
+        return self.request(self.P_SMP_START_PROXY, cpu, iodev, signed=True)
 
     def heapblock_alloc(self, size):
         return self.request(self.P_HEAPBLOCK_ALLOC, size)
@@ -945,6 +1601,8 @@ class M1N1Proxy(Reloadable):
         return self.request(self.P_MEMALIGN, align, size)
     def free(self, ptr):
         self.request(self.P_FREE, ptr)
+    def memstats(self, buf, size, reset=False):
+        return self.request(self.P_MEMSTATS, buf, size, reset)
 
     def kboot_boot(self, kernel):
         self.request(self.P_KBOOT_BOOT, kernel)
@@ -996,11 +1654,56 @@ class M1N1Proxy(Reloadable):
         return self.request(self.P_DART_MAP, dart, iova, bfr, len)
     def dart_unmap(self, dart, iova, len):
         return self.request(self.P_DART_UNMAP, dart, iova, len)
+    def dart_map_sg(self, dart, sg, count):
+        return self.request(self.P_DART_MAP_SG, dart, sg, count)
 
     def hv_init(self):
         return self.request(self.P_HV_INIT)
     def hv_map(self, from_, to, size, incr):
         return self.request(self.P_HV_MAP, from_, to, size, incr)
+    def hv_map_batch(self, descs, count):
+        return self.request(self.P_HV_MAP_BATCH, descs, count)
+    def hv_dirty_start(self, base, size):
+        return self.request(self.P_HV_DIRTY_START, base, size, signed=True)
+    def hv_dirty_fetch(self, buf, size, rearm=True):
+        return self.request(self.P_HV_DIRTY_FETCH, buf, size, int(bool(rearm)), signed=True)
+    def hv_dirty_stop(self):
+        return self.request(self.P_HV_DIRTY_STOP)
+    def hv_read_va(self, dst, va, size):
+        return self.request(self.P_HV_READ_VA, dst, va, size)
+    def hv_write_va(self, va, src, size):
+        return self.request(self.P_HV_WRITE_VA, va, src, size)
+    def hv_step_start(self, cond):
+        return self.request(self.P_HV_STEP_START, cond, signed=True)
+    def hv_step_get_status(self, buf, stop=True):
+        return self.request(self.P_HV_STEP_GET_STATUS, buf, int(bool(stop)))
+    def hv_profile_start(self, rate, flags, size):
+        return self.request(self.P_HV_PROFILE_START, rate, flags, size, signed=True)
+    def hv_profile_stop(self):
+        return self.request(self.P_HV_PROFILE_STOP)
+    def hv_profile_fetch(self, cpu, buf, size):
+        return self.request(self.P_HV_PROFILE_FETCH, cpu, buf, size, signed=True)
+    def hv_pmu_start(self, cfg):
+        return self.request(self.P_HV_PMU_START, cfg, signed=True)
+    def hv_pmu_stop(self):
+        return self.request(self.P_HV_PMU_STOP)
+    def hv_pmu_fetch(self, cpu, buf, size):
+        return self.request(self.P_HV_PMU_FETCH, cpu, buf, size, signed=True)
+    def hv_map_pvchan(self, iodev):
+        return self.request(self.P_HV_MAP_PVCHAN, iodev)
+    def hv_irq_counters_fetch(self, buf, size, reset=False):
+        return self.request(self.P_HV_IRQ_COUNTERS_FETCH, buf, size, int(bool(reset)), signed=True)
+    def hv_set_irq_delay(self, usec):
+        return self.request(self.P_HV_SET_IRQ_DELAY, usec)
+    def hv_get_pending_exits(self, buf, size):
+        return self.request(self.P_HV_GET_PENDING_EXITS, buf, size, signed=True)
+    def hv_resolve_exit(self, cpu, ret):
+        return self.request(self.P_HV_RESOLVE_EXIT, cpu, ret, signed=True)
+    def hv_set_vtimer_forward(self, enabled=True):
+        return self.request(self.P_HV_SET_VTIMER_FORWARD, int(enabled))
+    def hv_set_tick_idle_rate(self, rate):
+        '''Slowest HV tick rate (Hz) with no host/vuart traffic, 0 to never slow down'''
+        return self.request(self.P_HV_SET_TICK_IDLE_RATE, rate)
     def hv_start(self, entry, *args):
         return self.request(self.P_HV_START, entry, *args)
     def hv_translate(self, addr, s1=False, w=False):
@@ -1013,18 +1716,43 @@ class M1N1Proxy(Reloadable):
         return self.request(self.P_HV_MAP_VUART, base, irq, iodev)
     def hv_trace_irq(self, evt_type, num, count, flags):
         return self.request(self.P_HV_TRACE_IRQ, evt_type, num, count, flags)
-    def hv_wdt_start(self, cpu):
-        return self.request(self.P_HV_WDT_START, cpu)
+    def hv_wdt_start(self, cpu, slow_usec=0):
+        return self.request(self.P_HV_WDT_START, cpu, slow_usec)
     def hv_start_secondary(self, cpu, entry, *args):
         return self.request(self.P_HV_START_SECONDARY, cpu, entry, *args)
     def hv_switch_cpu(self, cpu):
         return self.request(self.P_HV_SWITCH_CPU, cpu)
-    def hv_set_time_stealing(self, enabled, reset):
-        return self.request(self.P_HV_SET_TIME_STEALING, int(bool(enabled)), int(bool(reset)))
+    def hv_set_time_stealing(self, enabled, reset=False, per_cpu=False):
+        return self.request(self.P_HV_SET_TIME_STEALING, int(bool(enabled)), int(bool(reset)),
+                            int(bool(per_cpu)))
     def hv_pin_cpu(self, cpu):
         return self.request(self.P_HV_PIN_CPU, cpu)
     def hv_write_hcr(self, hcr):
         return self.request(self.P_HV_WRITE_HCR, hcr)
+    def hv_set_trace_batch(self, mode):
+        return self.request(self.P_HV_SET_TRACE_BATCH, mode)
+    def hv_add_trace_filter(self, filt):
+        return self.request(self.P_HV_ADD_TRACE_FILTER, filt, signed=True)
+    def hv_clear_trace_filters(self):
+        return self.request(self.P_HV_CLEAR_TRACE_FILTERS)
+    def hv_set_trace_budget(self, budget):
+        return self.request(self.P_HV_SET_TRACE_BUDGET, budget)
+    def hv_add_shadow_regs(self, regs):
+        return self.request(self.P_HV_ADD_SHADOW_REGS, regs, signed=True)
+    def hv_get_shadow_regs_count(self, index, forwarded):
+        return self.request(self.P_HV_GET_SHADOW_REGS_COUNT, index, int(bool(forwarded)))
+    def hv_add_native_hook(self, hook):
+        return self.request(self.P_HV_ADD_NATIVE_HOOK, hook, signed=True)
+    def hv_get_native_hook_count(self, index, write):
+        return self.request(self.P_HV_GET_NATIVE_HOOK_COUNT, index, int(bool(write)))
+    def hv_set_async_bps(self, mask):
+        return self.request(self.P_HV_SET_ASYNC_BPS, mask)
+    def hv_get_stats(self, cpu, buf, size, reset=False):
+        return self.request(self.P_HV_GET_STATS, cpu, buf, size, int(bool(reset)), signed=True)
+    def hv_add_sysreg_emu(self, emu):
+        return self.request(self.P_HV_ADD_SYSREG_EMU, emu, signed=True)
+    def hv_clear_sysreg_emu(self):
+        return self.request(self.P_HV_CLEAR_SYSREG_EMU)
 
     def fb_init(self):
         return self.request(self.P_FB_INIT)
@@ -1044,6 +1772,8 @@ class M1N1Proxy(Reloadable):
         return self.request(self.P_FB_RESTORE_LOGO)
     def fb_improve_logo(self):
         return self.request(self.P_FB_IMPROVE_LOGO)
+    def fb_console_set_deferred(self, deferred=True):
+        return self.request(self.P_FB_CONSOLE_SET_DEFERRED, int(deferred))
 
     def pcie_init(self):
         return self.request(self.P_PCIE_INIT)
@@ -1058,9 +1788,26 @@ class M1N1Proxy(Reloadable):
         return self.request(self.P_NVME_READ, nsid, lba, bfr)
     def nvme_flush(self, nsid):
         return self.request(self.P_NVME_FLUSH, nsid)
+    def nvme_read_blocks(self, nsid, lba, count, bfr):
+        return self.request(self.P_NVME_READ_BLOCKS, nsid, lba, count, bfr)
+    def nvme_write_blocks(self, nsid, lba, count, bfr):
+        return self.request(self.P_NVME_WRITE_BLOCKS, nsid, lba, count, bfr)
+    def nvme_discard(self, nsid, lba, count):
+        return self.request(self.P_NVME_DISCARD, nsid, lba, count)
 
     def mcc_get_carveouts(self):
         return self.request(self.P_MCC_GET_CARVEOUTS)
+    def mcc_get_cache_state(self, buf, count):
+        '''Fill buf with up to count struct mcc_plane_state, returns how many (-1 without an MCC)'''
+        return self.request(self.P_MCC_GET_CACHE_STATE, buf, count, signed=True)
+    def mcc_set_cache_ways(self, ways, mcc=-1, plane=-1):
+        '''Limit the SLC ways used by a plane (0 = off, -1 = all MCCs/planes), 0 on success'''
+        return self.request(self.P_MCC_SET_CACHE_WAYS, mcc & 0xffffffff, plane & 0xffffffff, ways,
+                            signed=True)
+    def mcc_plane_read32(self, mcc, plane, offset):
+        return self.request(self.P_MCC_PLANE_READ32, mcc, plane, offset, signed=True)
+    def mcc_plane_write32(self, mcc, plane, offset, value):
+        return self.request(self.P_MCC_PLANE_WRITE32, mcc, plane, offset, value, signed=True)
 
     def display_init(self):
         return self.request(self.P_DISPLAY_INIT)
@@ -1068,12 +1815,42 @@ class M1N1Proxy(Reloadable):
         return self.request(self.P_DISPLAY_CONFIGURE, cfg)
     def display_shutdown(self, mode):
         return self.request(self.P_DISPLAY_SHUTDOWN, mode)
+    def display_swapchain_init(self, count=3):
+        return self.request(self.P_DISPLAY_SWAPCHAIN_INIT, count)
+    def display_swapchain_present(self):
+        return self.request(self.P_DISPLAY_SWAPCHAIN_PRESENT)
+    def display_swapchain_shutdown(self):
+        return self.request(self.P_DISPLAY_SWAPCHAIN_SHUTDOWN)
+    def display_console_scaled(self, enable=True):
+        return self.request(self.P_DISPLAY_CONSOLE_SCALED, enable, signed=True)
 
     def dapf_init_all(self):
         return self.request(self.P_DAPF_INIT_ALL)
     def dapf_init(self, path):
         return self.request(self.P_DAPF_INIT, path)
 
+    def uat_translate(self, ttbrs, iova, size, ext, count):
+        return self.request(self.P_UAT_TRANSLATE, ttbrs, iova, size, ext, count, signed=True)
+    def uat_read(self, ttbrs, dst, iova, size):
+        return self.request(self.P_UAT_READ, ttbrs, dst, iova, size)
+    def uat_write(self, ttbrs, iova, src, size):
+        return self.request(self.P_UAT_WRITE, ttbrs, iova, src, size)
+
+    def admac_stream_start(self, cpu, stream):
+        return self.request(self.P_ADMAC_STREAM_START, cpu, stream, signed=True)
+    def admac_stream_stop(self, cpu, stream):
+        return self.request(self.P_ADMAC_STREAM_STOP, cpu, stream)
+
+    def smc_batch(self, batch):
+        return self.request(self.P_SMC_BATCH, batch, signed=True)
+
+    def rtkit_syslog_defer(self, enable=True):
+        '''Queue IOP syslog messages instead of printing them inline; returns the old setting'''
+        return bool(self.request(self.P_RTKIT_SYSLOG_DEFER, int(enable)))
+    def rtkit_syslog_drain(self):
+        '''Print queued IOP syslog messages on the m1n1 console; returns how many'''
+        return self.request(self.P_RTKIT_SYSLOG_DRAIN)
+
 __all__.extend(k for k, v in globals().items()
                if (callable(v) or isinstance(v, type)) and v.__module__ == __name__)
 
@@ -1,17 +1,18 @@
 # SPDX-License-Identifier: MIT
-import serial, os, struct, sys, time, json, os.path, gzip, functools
+import serial, os, struct, sys, time, json, os.path, gzip, functools, array
 from contextlib import contextmanager
 from construct import *
 
 from .asm import ARMAsm
 from .proxy import *
+from .proxy import crc32c
 from .utils import Reloadable, chexdiff32
 from .tgtypes import *
 from .sysreg import *
 from .malloc import Heap
 from . import adt
 
-__all__ = ["ProxyUtils", "RegMonitor", "GuardedHeap", "bootstrap_port"]
+__all__ = ["ProxyUtils", "RegMonitor", "GuardedHeap", "RegOpBatch", "MemWatch", "bootstrap_port"]
 
 SIMD_B = Array(32, Array(16, Int8ul))
 SIMD_H = Array(32, Array(8, Int16ul))
@@ -30,6 +31,8 @@ VERSION_MAP = {
 
 class ProxyUtils(Reloadable):
     CODE_BUFFER_SIZE = 0x10000
+    MAX_CPUS = 20
+    SYSREG_FAULT = 0xacce5515abad1dea
     def __init__(self, p, heap_size=1024 * 1024 * 1024):
         self.iface = p.iface
         self.proxy = p
@@ -77,6 +80,8 @@ class ProxyUtils(Reloadable):
 
         self.inst_cache = {}
 
+        self._batch = None
+
         self.exec_modes = {
             None: (self.proxy.call, REGION_RX_EL1),
             "el2": (self.proxy.call, REGION_RX_EL1),
@@ -135,6 +140,8 @@ class ProxyUtils(Reloadable):
     def read(self, addr, width):
         '''do a width read from addr and return it
         width can be 8, 16, 21, 64, 128 or 256'''
+        if self._batch is not None:
+            return self._batch.read(addr, width).value
         val = self._read[width](addr)
         if self.proxy.get_exc_count():
             raise ProxyError("Exception occurred")
@@ -143,31 +150,65 @@ class ProxyUtils(Reloadable):
     def write(self, addr, data, width):
         '''do a width write of data to addr
         width can be 8, 16, 21, 64, 128 or 256'''
+        if self._batch is not None:
+            self._batch.write(addr, data, width)
+            return
         self._write[width](addr, data)
         if self.proxy.get_exc_count():
             raise ProxyError("Exception occurred")
 
+    @staticmethod
+    def _sysreg_enc(reg):
+        op0, op1, CRn, CRm, op2 = sysreg_parse(reg)
+        return (op0 << 14) | (op1 << 11) | (CRn << 7) | (CRm << 3) | op2
+
     def mrs(self, reg, *, silent=False, call=None):
         '''read system register reg'''
-        op0, op1, CRn, CRm, op2 = sysreg_parse(reg)
+        enc = self._sysreg_enc(reg)
 
-        op =  ((op0 << 19) | (op1 << 16) | (CRn << 12) |
-               (CRm << 8) | (op2 << 5) | 0xd5200000)
+        if call in (None, "el2"):
+            return self.proxy.mrs(enc, silent)
 
-        return self.exec(op, call=call, silent=silent)
+        return self.exec(0xd5200000 | (enc << 5), call=call, silent=silent)
 
     def msr(self, reg, val, *, silent=False, call=None):
         '''Write val to system register reg'''
-        op0, op1, CRn, CRm, op2 = sysreg_parse(reg)
+        enc = self._sysreg_enc(reg)
 
-        op =  ((op0 << 19) | (op1 << 16) | (CRn << 12) |
-               (CRm << 8) | (op2 << 5) | 0xd5000000)
+        if call in (None, "el2"):
+            self.proxy.msr(enc, val, silent)
+            return
 
-        self.exec(op, val, call=call, silent=silent)
+        self.exec(0xd5000000 | (enc << 5), val, call=call, silent=silent)
 
     sys = msr
     sysl = mrs
 
+    def sysreg_dump(self, regs, cpus=None):
+        '''Read regs on all CPUs (or those in cpus) at once. Returns {cpu: {reg: value}}, with
+        None for registers that faulted; CPUs that are offline or busy are left out'''
+        regs = list(regs)
+        cpus = range(self.MAX_CPUS) if cpus is None else cpus
+        mask = functools.reduce(lambda a, b: a | (1 << b), cpus, 0)
+        rows = bin(mask).count("1")
+        encs = struct.pack(f"<{len(regs)}I", *map(self._sysreg_enc, regs))
+        size = rows * len(regs) * 8
+
+        with self.heap.guarded_malloc(len(encs)) as encs_addr, \
+             self.heap.guarded_malloc(size) as values_addr:
+            self.iface.writemem(encs_addr, encs)
+            ran = self.proxy.sysreg_dump(mask, encs_addr, len(regs), values_addr)
+            values = struct.unpack(f"<{rows * len(regs)}Q", self.iface.readmem(values_addr, size))
+
+        ret = {}
+        for row, cpu in enumerate(i for i in range(self.MAX_CPUS) if mask & (1 << i)):
+            if not ran & (1 << cpu):
+                continue
+            line = values[row * len(regs):(row + 1) * len(regs)]
+            ret[cpu] = {reg: (None if v == self.SYSREG_FAULT else v) for reg, v in zip(regs, line)}
+
+        return ret
+
     def exec(self, op, r0=0, r1=0, r2=0, r3=0, *, silent=False, call=None, ignore_exceptions=False):
         if callable(call):
             region = REGION_RX_EL1
@@ -221,6 +262,10 @@ class ProxyUtils(Reloadable):
         if not len(data):
             return
 
+        if self.iface.enabled_features & Feature.ZWRITE:
+            self.iface.zwritemem(dest, data, progress)
+            return
+
         payload = gzip.compress(data, compresslevel=1)
         compressed_size = len(payload)
 
@@ -235,13 +280,166 @@ class ProxyUtils(Reloadable):
 
             assert decompressed_size == len(data)
 
+    DELTA_BLOCK = 0x4000
+
+    @staticmethod
+    def block_hashes(data, block_size):
+        '''Host side of proxy.memhash(): one u64 per block_size block of data'''
+        hashes = []
+        for off in range(0, len(data), block_size):
+            blk = bytes(data[off:off + block_size])
+            tail = len(blk) & ~7
+            words = array.array("Q", blk[:tail])
+            words.reverse()
+            rev = crc32c(words.tobytes() + blk[tail:])
+            hashes.append(crc32c(blk) | (rev << 32))
+        return hashes
+
+    HASH_BLOCK = 0x100000
+
+    @classmethod
+    def range_hash(cls, data):
+        '''Host side of proxy.hash()'''
+        hashes = cls.block_hashes(data, cls.HASH_BLOCK) + [len(data)]
+        return cls.block_hashes(struct.pack(f"<{len(hashes)}Q", *hashes), len(hashes) * 8)[0]
+
+    def verify_mem(self, addr, data):
+        '''Check that memory at addr holds data, without reading it back'''
+        return self.proxy.hash(addr, len(data)) == self.range_hash(data)
+
+    def delta_writemem(self, dest, data, progress=None, block_size=DELTA_BLOCK, hashes=None):
+        '''Like compressed_writemem(), but only sends the blocks that differ from what's at dest
+
+        Meant for re-uploading an image into the same staging buffer as last time, where most of
+        it is usually unchanged. hashes may be block_hashes(data, block_size) computed earlier.
+        Returns the number of bytes sent (before compression).'''
+        if not len(data):
+            return 0
+
+        count = (len(data) + block_size - 1) // block_size
+        with self.heap.guarded_malloc(count * 8) as hash_addr:
+            self.proxy.memhash(dest, len(data), block_size, hash_addr)
+            remote = struct.unpack(f"<{count}Q", self.iface.readmem(hash_addr, count * 8))
+
+        local = hashes if hashes is not None else self.block_hashes(data, block_size)
+        changed = [i for i in range(count) if local[i] != remote[i]]
+
+        # Past half the image, per-run overhead makes a plain upload just as fast
+        if len(changed) > count // 2:
+            self.compressed_writemem(dest, data, progress)
+            return len(data)
+
+        sent = 0
+        i = 0
+        while i < len(changed):
+            j = i
+            while j + 1 < len(changed) and changed[j + 1] == changed[j] + 1:
+                j += 1
+            start = changed[i] * block_size
+            end = min((changed[j] + 1) * block_size, len(data))
+            self.compressed_writemem(dest + start, data[start:end])
+            sent += end - start
+            i = j + 1
+
+        if progress:
+            print(f"Delta upload: sent {len(changed)}/{count} blocks ({sent} bytes)")
+        return sent
+
+    def compressed_readmem(self, src, size):
+        if self.iface.enabled_features & Feature.ZREAD:
+            return self.iface.zreadmem(src, size)
+
+        return self.iface.readmem(src, size)
+
+    def sparse_readmem(self, src, size):
+        '''Read a mostly-zero region (carveouts, page tables, sparse heaps), only transferring the
+ 16K pages that have data in them.'''
+        if self.iface.enabled_features & Feature.SPARSE_READ and not (src | size) & 7:
+            return self.iface.sparsereadmem(src, size)
+
+        return self.compressed_readmem(src, size)
+
+    def probe_range(self, start, end, stride=4, width=32, values=False, block=0x10000):
+        '''Find which addresses in [start, end) at stride can be read with width bit accesses
+
+        The range is scanned on the device with faults skipped. Returns a list of readable
+        addresses, or of (address, value) pairs if values is set.'''
+        size = width // 8
+        fmt = {1: "B", 2: "H", 4: "I", 8: "Q"}[size]
+        count = (end - start + stride - 1) // stride
+        hits = []
+
+        with GuardedHeap(self.heap) as heap:
+            bitmap = heap.malloc(block // 8)
+            valbuf = heap.malloc(block * size) if values else 0
+
+            for base in range(0, count, block):
+                n = min(block, count - base)
+                addr = start + base * stride
+                if not self.proxy.memprobe(addr, n, stride, size, bitmap, valbuf):
+                    continue
+
+                mask = int.from_bytes(self.iface.readmem(bitmap, (n + 7) // 8), "little")
+                if values:
+                    vals = struct.unpack(f"<{n}{fmt}", self.iface.readmem(valbuf, n * size))
+                for i in range(n):
+                    if mask & (1 << i):
+                        a = addr + i * stride
+                        hits.append((a, vals[i]) if values else a)
+
+        return hits
+
+    def call_batch(self, calls, mode="el1", ticks=False):
+        '''Run a list of (func, *args) in mode ("el0", "el1", "gl1" or "gl2") with a single
+        entry into it
+
+        Returns the return values of the calls that completed. In GL the batch stops short
+        after the first call that took an exception. For EL0/EL1 with ticks set, returns
+        (values, ticks) with the CNTPCT ticks the whole batch took.'''
+        batch_ops = {
+            "el0": self.proxy.el0_call_batch,
+            "el1": self.proxy.el1_call_batch,
+            "gl1": self.proxy.gl1_call_batch,
+            "gl2": self.proxy.gl2_call_batch,
+        }
+        if ticks and mode not in ("el0", "el1"):
+            raise ValueError("Batch timing is only available at EL0/EL1")
+        if not calls:
+            return ([], 0) if ticks else []
+        if any(len(c) > 5 for c in calls):
+            raise ValueError("Too many arguments")
+
+        entry = struct.Struct("<6Q")
+        data = b"".join(entry.pack(func, *(list(args) + [0] * (4 - len(args))), 0)
+                        for func, *args in calls)
+
+        with GuardedHeap(self.heap) as heap:
+            buf = heap.malloc(len(data) + 8)
+            tbuf = buf + len(data)
+            self.iface.writemem(buf, data)
+            if mode in ("el0", "el1"):
+                done = batch_ops[mode](buf, len(calls), tbuf)
+            else:
+                done = batch_ops[mode](buf, len(calls))
+            if done > len(calls):
+                raise ProxyError(f"{mode.upper()} call batch failed")
+            data = self.iface.readmem(buf, done * entry.size)
+            elapsed = self.proxy.read64(tbuf) if ticks else 0
+
+        values = [entry.unpack_from(data, i * entry.size)[5] for i in range(done)]
+        return (values, elapsed) if ticks else values
+
+    def gl_call_batch(self, calls, gl=2):
+        '''Run a list of (func, *args) in GL1 or GL2 with a single entry'''
+        return self.call_batch(calls, f"gl{gl}")
+
     def get_adt(self):
         if self.adt_data is not None:
             return self.adt_data
         adt_base = (self.ba.devtree - self.ba.virt_base + self.ba.phys_base) & 0xffffffffffffffff
         adt_size = self.ba.devtree_size
         print(f"Fetching ADT ({adt_size} bytes)...")
-        self.adt_data = self.iface.readmem(adt_base, self.ba.devtree_size)
+        self.adt_data = self.compressed_readmem(adt_base, self.ba.devtree_size)
         return self.adt_data
 
     def push_adt(self):
@@ -345,6 +543,22 @@ class ProxyUtils(Reloadable):
 
         print()
 
+    @contextmanager
+    def batch(self):
+        '''Queue register accesses made through read()/write() (and thus RegMaps) and run them
+        on the device as a single P_REGOP_BATCH. Reads flush the queue, since their value is
+        needed right away; explicit batch.read() calls return deferred results instead.'''
+        if self._batch is not None:
+            yield self._batch
+            return
+
+        self._batch = RegOpBatch(self)
+        try:
+            yield self._batch
+            self._batch.flush()
+        finally:
+            self._batch = None
+
     @contextmanager
     def mmu_disabled(self):
         flags = self.proxy.mmu_disable()
@@ -402,6 +616,170 @@ class ProxyUtils(Reloadable):
     def sfr_version(self):
         return self.get_version(self.adt["/chosen"].system_firmware_version)
 
+class RegOpResult:
+    '''Deferred result of a batched op, available once the batch has been flushed'''
+    def __init__(self, batch, width=None, count=1):
+        self._batch = batch
+        self._values = None
+        self.width = width
+        self.count = count
+
+    def _set(self, values):
+        self._values = values
+
+    @property
+    def value(self):
+        if self._values is None:
+            self._batch.flush()
+        if self.count == 1:
+            return self._values[0]
+        if self.width == 64:
+            return self._values[0] | (self._values[1] << 32)
+        return self._values
+
+class RegOpBatch:
+    '''Queue of register operations executed on the device in one P_REGOP_BATCH request'''
+    MAX_OPS = 4096
+
+    def __init__(self, utils):
+        self.u = utils
+        self.ops = []
+        self.results = []
+
+    def _queue(self, op, width, addr, value=0, mask=0, timeout=0, result=None):
+        self.ops.append((op, width, addr, value, mask, timeout))
+        self.results.append(result)
+
+    def _check_full(self):
+        if len(self.ops) >= self.MAX_OPS:
+            self.flush()
+
+    def _split(self, addr, width):
+        # Split accesses the way ProxyUtils.uread64/uwrite64 do
+        if width > 64:
+            return [(addr + i, 64) for i in range(0, width // 8, 8)]
+        if width == 64 and addr & 4:
+            return [(addr, 32), (addr + 4, 32)]
+        return [(addr, width)]
+
+    def read(self, addr, width=32):
+        parts = self._split(addr, width)
+        res = RegOpResult(self, width, len(parts))
+        for a, w in parts:
+            self._queue(REGOP.READ, w, a, result=res)
+        self._check_full()
+        return res
+
+    def write(self, addr, data, width=32):
+        parts = self._split(addr, width)
+        if width > 64:
+            values = data
+        elif len(parts) == 2:
+            values = [data & 0xffffffff, data >> 32]
+        else:
+            values = [data]
+        for (a, w), v in zip(parts, values):
+            self._queue(REGOP.WRITE, w, a, value=v)
+        self._check_full()
+
+    def mask(self, addr, clear, set, width=32):
+        res = RegOpResult(self)
+        self._queue(REGOP.MASK, width, addr, value=set, mask=clear, result=res)
+        self._check_full()
+        return res
+
+    def set(self, addr, set, width=32):
+        return self.mask(addr, 0, set, width)
+
+    def clear(self, addr, clear, width=32):
+        return self.mask(addr, clear, 0, width)
+
+    def poll(self, addr, mask, value, width=32, timeout=100000):
+        '''Wait (up to timeout us) for (*addr & mask) == value'''
+        res = RegOpResult(self)
+        self._queue(REGOP.POLL, width, addr, value=value, mask=mask, timeout=timeout, result=res)
+        self._check_full()
+        return res
+
+    def delay(self, usec):
+        self._queue(REGOP.DELAY, 0, 0, value=usec)
+        self._check_full()
+
+    def flush(self):
+        if not self.ops:
+            return
+
+        ops, results = self.ops, self.results
+        self.ops, self.results = [], []
+
+        data = b"".join(RegOp.build({"op": op, "width": width, "timeout": timeout,
+                                     "addr": addr, "value": value, "mask": mask})
+                        for op, width, addr, value, mask, timeout in ops)
+        count = len(ops)
+        want_results = any(r is not None for r in results)
+
+        heap = self.u.heap
+        ops_buf = heap.malloc(len(data))
+        res_buf = heap.malloc(8 * count) if want_results else 0
+        try:
+            self.u.iface.writemem(ops_buf, data)
+            done = self.u.proxy.regop_batch(ops_buf, count, res_buf)
+            if want_results:
+                values = struct.unpack(f"<{count}Q", self.u.iface.readmem(res_buf, 8 * count))
+        finally:
+            heap.free(ops_buf)
+            if res_buf:
+                heap.free(res_buf)
+
+        if want_results:
+            pending = {}
+            for i, res in enumerate(results[:done]):
+                if res is not None:
+                    pending.setdefault(id(res), (res, []))[1].append(values[i])
+            for res, vals in pending.values():
+                if len(vals) == res.count:
+                    res._set(vals)
+
+        if done != count:
+            op, width, addr = ops[done][:3]
+            raise ProxyError(f"Register batch failed at op {done}/{count}: "
+                             f"{REGOP(op).name} {width}-bit @ {addr:#x}")
+
+class MemWatch:
+    '''Wait on the device for any of a set of 32-bit words to change, instead of polling them
+
+    Each watch is (addr, mask, value) and fires once (*addr & mask) != value.'''
+    ENTRY = struct.Struct("<QIIII")
+
+    def __init__(self, utils):
+        self.u = utils
+
+    def wait(self, watches, timeout=100000):
+        '''Wait up to timeout us, returns a (fired, current value) pair per watch
+
+        The values are only fetched when something fired, on a timeout they are None.'''
+        if not watches:
+            return []
+
+        data = b"".join(self.ENTRY.pack(addr, mask & 0xffffffff, value & 0xffffffff, 0, 0)
+                        for addr, mask, value in watches)
+
+        heap = self.u.heap
+        buf = heap.malloc(len(data))
+        try:
+            self.u.iface.writemem(buf, data)
+            fired = self.u.proxy.memwatch32(buf, len(watches), timeout)
+            if fired:
+                data = self.u.iface.readmem(buf, len(data))
+        finally:
+            heap.free(buf)
+
+        if not fired:
+            return [(False, None)] * len(watches)
+
+        return [(bool(fired), current)
+                for addr, mask, value, current, fired in self.ENTRY.iter_unpack(data)]
+
 class LazyADT:
     def __init__(self, utils):
         self.__dict__["_utils"] = utils
@@ -433,6 +811,7 @@ class RegMonitor(Reloadable):
         self.iface = self.proxy.iface
         self.ranges = []
         self.last = []
+        self.shadows = []
         self.bufsize = bufsize
         self.ascii = ascii
         self.log = log or print
@@ -451,11 +830,32 @@ class RegMonitor(Reloadable):
             start = self.scratch
         return self.proxy.iface.readmem(start, size)
 
+    def readdiff(self, idx, start, size, last):
+        '''read a range through a shadow copy kept on the device, fetching only the changed words'''
+        shadow = self.shadows[idx]
+        if shadow is None:
+            shadow = self.shadows[idx] = self.utils.malloc(size)
+            self.proxy.memcpy32(shadow, start, size)
+            return self.iface.readmem(shadow, size)
+
+        max_entries = self.bufsize // 8
+        count = self.proxy.memdiff32(start, shadow, size, self.scratch, max_entries)
+        if last is None or count > max_entries:
+            return self.iface.readmem(shadow, size)
+        if count == 0:
+            return last
+
+        block = bytearray(last)
+        for off, val in struct.iter_unpack("<II", self.iface.readmem(self.scratch, count * 8)):
+            struct.pack_into("<I", block, off, val)
+        return bytes(block)
+
     def add(self, start, size, name=None, offset=None, readfn=None):
         if offset is None:
             offset = start
         self.ranges.append((start, size, name, offset, readfn))
         self.last.append(None)
+        self.shadows.append(None)
 
     def show_regions(self, log=print):
         for start, size, name, offset, readfn in sorted(self.ranges):
@@ -466,9 +866,13 @@ class RegMonitor(Reloadable):
         if not self.ranges:
             return
         cur = []
-        for (start, size, name, offset, readfn), last in zip(self.ranges, self.last):
+        for idx, (start, size, name, offset, readfn) in enumerate(self.ranges):
+            last = self.last[idx]
             count = size // 4
-            block = self.readmem(start, size, readfn)
+            if self.scratch and not readfn:
+                block = self.readdiff(idx, start, size, last)
+            else:
+                block = self.readmem(start, size, readfn)
             if block is None:
                 if last is not None:
                     self.log(f"# Lost: {name} ({start:#x}..{start + size - 1:#x})")
@@ -47,6 +47,52 @@ class RegCache(Reloadable):
         else:
             raise Exception("Cannot write register in asynchronous context")
 
+class RegDecoderEntry:
+    __slots__ = ("reg", "index", "rcls", "name", "attrs", "last")
+
+    def __init__(self, reg, index, rcls, prefix):
+        self.reg = reg
+        self.index = index
+        self.rcls = rcls
+        self.name = reg if index is None else f"{reg}[{index}]"
+        if prefix is not None:
+            self.attrs = (f"r_{prefix}_{reg}", f"w_{prefix}_{reg}")
+        else:
+            self.attrs = (f"r_{reg}", f"w_{reg}")
+        self.last = None
+
+    def format(self, data):
+        # Formatting a register walks all its fields, so remember the last value seen
+        last = self.last
+        if last is not None and last[0] == data:
+            return last[1]
+        s = f"{self.name} = {self.rcls(data)!s}"
+        self.last = (data, s)
+        return s
+
+class RegDecoder:
+    '''Offset to register lookup for one traced regmap, resolved once per offset'''
+
+    def __init__(self, regmap, prefix=None):
+        self.regmap = regmap
+        self.prefix = prefix
+        self.base = regmap._base
+        self.entries = {offset: RegDecoderEntry(name, None, rcls, prefix)
+                        for offset, (name, rcls) in regmap._addrmap.items()}
+
+    def lookup(self, addr):
+        offset = addr - self.base
+        try:
+            return self.entries[offset]
+        except KeyError:
+            pass
+
+        # Array registers are resolved on first use, some regmaps cover huge ranges
+        reg, index, rcls = self.regmap.lookup_offset(offset)
+        ent = RegDecoderEntry(reg, index, rcls, self.prefix) if reg is not None else None
+        self.entries[offset] = ent
+        return ent
+
 class TracerState:
     pass
 
@@ -57,6 +103,7 @@ class Tracer(Reloadable):
         self.hv = hv
         self.ident = ident or type(self).__name__
         self.regmaps = {}
+        self._decoders = {}
         self.verbose = verbose
         self.state = TracerState()
         self.init_state()
@@ -79,41 +126,42 @@ class Tracer(Reloadable):
     def hook_r(self, addr, width, **kwargs):
         return self.hv.u.read(addr, width)
 
+    def get_decoder(self, regmap, prefix=None):
+        key = (regmap._base, prefix)
+        decoder = self._decoders.get(key, None)
+        if decoder is None or decoder.regmap is not regmap:
+            decoder = self._decoders[key] = RegDecoder(regmap, prefix)
+        return decoder
+
     def evt_rw(self, evt, regmap=None, prefix=None):
         self._cache.update(evt.addr, evt.data)
-        reg = rcls = None
-        value = evt.data
-
-        t = "w" if evt.flags.WRITE else "r"
+        ent = None
 
         if regmap is not None:
-            reg, index, rcls = regmap.lookup_addr(evt.addr)
-            if rcls is not None:
-                value = rcls(evt.data)
+            ent = self.get_decoder(regmap, prefix).lookup(evt.addr)
 
-        if self.verbose >= 3 or (reg is None and self.verbose >= 1):
-            if reg is None:
-                s = f"{evt.addr:#x} = {value:#x}"
-            else:
-                s = f"{regmap.get_name(evt.addr)} = {value!s}"
-            m = "+" if evt.flags.MULTI else " "
-            self.log(f"MMIO: {t.upper()}.{1<<evt.flags.WIDTH:<2}{m} " + s)
+        if ent is None:
+            if self.verbose >= 1:
+                self.log_rw(evt, f"{evt.addr:#x} = {evt.data:#x}")
+            return
 
-        if reg is not None:
-            if prefix is not None:
-                attr = f"{t}_{prefix}_{reg}"
+        if self.verbose >= 3:
+            self.log_rw(evt, ent.format(evt.data))
+
+        handler = getattr(self, ent.attrs[1 if evt.flags.WRITE else 0], None)
+        if handler:
+            value = ent.rcls(evt.data)
+            if ent.index is not None:
+                handler(value, ent.index)
             else:
-                attr = f"{t}_{reg}"
-            handler = getattr(self, attr, None)
-            if handler:
-                if index is not None:
-                    handler(value, index)
-                else:
-                    handler(value)
-            elif self.verbose == 2:
-                s = f"{regmap.get_name(evt.addr)} = {value!s}"
-                m = "+" if evt.flags.MULTI else " "
-                self.log(f"MMIO: {t.upper()}.{1<<evt.flags.WIDTH:<2}{m} " + s)
+                handler(value)
+        elif self.verbose == 2:
+            self.log_rw(evt, ent.format(evt.data))
+
+    def log_rw(self, evt, s):
+        t = "W" if evt.flags.WRITE else "R"
+        m = "+" if evt.flags.MULTI else " "
+        self.log(f"MMIO: {t}.{1<<evt.flags.WIDTH:<2}{m} " + s)
 
     def trace(self, start, size, mode, read=True, write=True, **kwargs):
         zone = irange(start, size)
@@ -139,6 +187,7 @@ class Tracer(Reloadable):
             assert isinstance(regmap, cls)
 
         setattr(self, name, regmap)
+        self.get_decoder(regmap, prefix)
         self.trace(start, size, mode=mode, regmap=regmap, prefix=prefix)
 
     def start(self):
@@ -0,0 +1,120 @@
+# SPDX-License-Identifier: MIT
+import time
+import serial
+
+__all__ = ["USBBulk"]
+
+# Matches usb_dwc3.c
+VID = 0x1209
+PID = 0x316d
+BULK_CLASS = 0xff
+BULK_SUBCLASS = 0x4d
+BULK_PROTOCOL = 0x01
+REQ_SET_STATE = 0x01
+
+READ_CHUNK = 0x20000
+
+class USBBulk:
+    '''pyserial-like wrapper for the m1n1 vendor bulk interface, for use as a UartInterface device.
+
+    Selected with M1N1DEVICE=usb for the first m1n1 found, or usb:<n> for the n-th one. Needs
+    pyusb with a libusb backend and access to the device node.'''
+
+    def __init__(self, index=0):
+        self.index = index
+        self.timeout = None
+        self.baudrate = 0
+        self.dev = None
+        self.buf = b""
+        self.open()
+
+    def _find(self):
+        import usb.core, usb.util
+
+        devs = list(usb.core.find(find_all=True, idVendor=VID, idProduct=PID))
+        if self.index >= len(devs):
+            raise serial.SerialException(f"m1n1 USB device #{self.index} not found")
+        dev = devs[self.index]
+
+        for intf in dev.get_active_configuration():
+            if (intf.bInterfaceClass, intf.bInterfaceSubClass, intf.bInterfaceProtocol) == \
+                    (BULK_CLASS, BULK_SUBCLASS, BULK_PROTOCOL):
+                break
+        else:
+            raise serial.SerialException("m1n1 firmware has no bulk interface")
+
+        ep_in = usb.util.find_descriptor(intf, custom_match=lambda e:
+            usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_IN)
+        ep_out = usb.util.find_descriptor(intf, custom_match=lambda e:
+            usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_OUT)
+        return dev, intf, ep_in, ep_out
+
+    def open(self):
+        import usb.core, usb.util
+
+        try:
+            self.dev, self.intf, self.ep_in, self.ep_out = self._find()
+            usb.util.claim_interface(self.dev, self.intf)
+            self._set_state(1)
+        except usb.core.USBError as e:
+            self.dev = None
+            raise serial.SerialException(str(e))
+        self.buf = b""
+
+    def close(self):
+        import usb.core, usb.util
+
+        if self.dev is None:
+            return
+        try:
+            self._set_state(0)
+            usb.util.release_interface(self.dev, self.intf)
+            usb.util.dispose_resources(self.dev)
+        except usb.core.USBError:
+            pass
+        self.dev = None
+
+    def _set_state(self, state):
+        # Vendor request to the interface, like DTR for the ACMs
+        self.dev.ctrl_transfer(0x41, REQ_SET_STATE, state, self.intf.bInterfaceNumber, None)
+
+    def _timeout_ms(self):
+        # libusb treats 0 as "forever"
+        if self.timeout is None:
+            return 0
+        return max(1, int(self.timeout * 1000))
+
+    def read(self, size=1):
+        import usb.core
+
+        deadline = None if self.timeout is None else time.time() + self.timeout
+        while len(self.buf) < size:
+            try:
+                self.buf += bytes(self.ep_in.read(max(READ_CHUNK, size), self._timeout_ms()))
+            except usb.core.USBTimeoutError:
+                pass
+            if deadline is not None and time.time() >= deadline:
+                break
+
+        data, self.buf = self.buf[:size], self.buf[size:]
+        return data
+
+    def write(self, data):
+        import usb.core
+
+        try:
+            return self.ep_out.write(data, 0)
+        except usb.core.USBError as e:
+            raise serial.SerialException(str(e))
+
+    def flush(self):
+        pass
+
+    def flushInput(self):
+        self.buf = b""
+
+    def flushOutput(self):
+        pass
+
+    def reset_input_buffer(self):
+        pass
@@ -684,6 +684,57 @@ class AddrLookup(RangeMap):
     def _assert(self, expect, val=lambda a:a):
         super()._assert(expect, lambda v: [i[0] for i in v])
 
+class SymbolTable:
+    '''Sorted symbol addresses for symbolizing PCs, with the results of recent lookups cached'''
+    CACHE_SIZE = 65536
+
+    def __init__(self, symbols=()):
+        self.addrs = []
+        self.names = []
+        self.cache = {}
+        self.add(symbols)
+
+    def __len__(self):
+        return len(self.addrs)
+
+    def __iter__(self):
+        return zip(self.addrs, self.names)
+
+    def add(self, symbols):
+        '''Add (addr, name) pairs, keeping the table sorted'''
+        new = sorted(symbols)
+        if not new:
+            return
+
+        self.cache.clear()
+        if not self.addrs or new[0] >= (self.addrs[-1], self.names[-1]):
+            self.addrs.extend(a for a, n in new)
+            self.names.extend(n for a, n in new)
+        elif len(new) < len(self.addrs) // 64:
+            for a, n in new:
+                idx = bisect.bisect_right(self.addrs, a)
+                self.addrs.insert(idx, a)
+                self.names.insert(idx, n)
+        else:
+            merged = list(heapq.merge(zip(self.addrs, self.names), new))
+            self.addrs = [a for a, n in merged]
+            self.names = [n for a, n in merged]
+
+    def lookup(self, addr):
+        '''The (address, name) of the closest symbol at or below addr, or (None, None)'''
+        try:
+            return self.cache[addr]
+        except KeyError:
+            pass
+
+        idx = bisect.bisect_right(self.addrs, addr) - 1
+        ret = (self.addrs[idx], self.names[idx]) if idx >= 0 else (None, None)
+
+        if len(self.cache) >= self.CACHE_SIZE:
+            self.cache.clear()
+        self.cache[addr] = ret
+        return ret
+
 class ScalarRangeMap(RangeMap):
     def get(self, addr, default=None):
         return self.lookup(addr, default)
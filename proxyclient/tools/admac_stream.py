@@ -17,6 +17,10 @@ argparser.add_argument("-c", "--chan", "--channel", type=int, default=0,
                        help="channel no")
 argparser.add_argument("-w", "--buswidth", type=E_BUSWIDTH, default=E_BUSWIDTH.W_32BIT,
                        help="DMA device-facing bus width")
+argparser.add_argument("-r", "--ring", type=int, default=0,
+                       help="stream through a device-side ring buffer of this size, refilled from a secondary CPU")
+argparser.add_argument("--cpu", type=int, default=1,
+                       help="CPU that refills the descriptors in --ring mode")
 argparser.add_argument("-v", "--verbose", action='store_true')
 args = argparser.parse_args()
 
@@ -64,6 +68,29 @@ chan.buswidth = args.buswidth
 chan.framesize = E_FRAME.F_1_WORD
 chan.sram_carveout = (0x0, 0x1000)
 
+if args.ring:
+    stream = ADMACStream(chan, bufsize=args.ring, desc_size=args.bufsize, cpu=args.cpu)
+    stream.start()
+    chan.enable()
+    try:
+        if chan.tx:
+            while (buf := sys.stdin.buffer.read(args.ring // 2)):
+                stream.write(buf)
+            # Let the queued audio play out, a partial last descriptor is dropped
+            while stream.completed + args.bufsize <= stream.head:
+                time.sleep(0.01)
+        else:
+            while True:
+                if (buf := stream.read()):
+                    sys.stdout.buffer.write(buf)
+                else:
+                    time.sleep(0.001)
+    except KeyboardInterrupt:
+        pass
+    stream.stop()
+    chan.disable()
+    sys.exit(0)
+
 if chan.tx:
     chan.submit(bytearray(args.bufsize))
 else:
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, struct, json, argparse, gzip, lzma, random
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+parser = argparse.ArgumentParser(description='Time m1n1 primitives on the device (build with `make bench`)')
+parser.add_argument('-j', '--json', action="store_true", help="print the results as JSON")
+parser.add_argument('-s', '--size', type=lambda x: int(x, 0), default=16 << 20,
+                    help="working set size in bytes (default 16MiB)")
+parser.add_argument('--dart', type=str, help="ADT path of a DART to time dart_map() on")
+parser.add_argument('--dart-device', type=int, default=0, help="stream ID to map on that DART")
+parser.add_argument('--hv', action="store_true", help="set up the HV to time hv_map()")
+parser.add_argument('--fb', action="store_true", help="time fb_blit(), draws over the top left corner")
+args = parser.parse_args()
+
+from m1n1.setup import *
+from m1n1.loadobjs import *
+from construct import *
+
+# Shared with src/bench/bench.c
+BENCH_DART = 1 << 0
+BENCH_HV = 1 << 1
+BENCH_FB = 1 << 2
+
+BenchResult = Struct(
+    "name" / PaddedString(32, "ascii"),
+    "bytes" / Int64ul,
+    "ops" / Int64ul,
+    "ticks" / Int64ul,
+)
+
+MAX_RESULTS = 32
+HV_IPA = 0x10_0000_0000
+
+size = args.size
+raw_size = size // 2
+
+# Something that compresses about as well as a kernel: random runs of repeating text
+rng = random.Random(0)
+words = [bytes(rng.randrange(32, 127) for _ in range(rng.randrange(2, 12))) for _ in range(512)]
+raw = bytearray()
+while len(raw) < raw_size:
+    raw += rng.choice(words) * rng.randrange(1, 4)
+raw = bytes(raw[:raw_size])
+gz = gzip.compress(raw, compresslevel=9)
+xz = lzma.compress(raw, format=lzma.FORMAT_XZ, check=lzma.CHECK_CRC32)
+
+lp = LinkedProgram(u)
+lp.load_obj("build/bench/bench.o")
+
+flags = 0
+if args.dart:
+    flags |= BENCH_DART
+if args.hv:
+    p.hv_init()
+    flags |= BENCH_HV
+if args.fb:
+    flags |= BENCH_FB
+
+work = u.memalign(0x4000, 2 * size)
+gz_buf = u.malloc(len(gz))
+xz_buf = u.malloc(len(xz))
+iface.writemem(gz_buf, gz)
+iface.writemem(xz_buf, xz)
+iface.writemem(work, raw[:min(len(raw), 0x100000)])
+
+dart_path = 0
+if args.dart:
+    dart_path = u.malloc(len(args.dart) + 1)
+    iface.writemem(dart_path, args.dart.encode("ascii") + b"\0")
+
+bench_args = struct.pack("<11Q", flags, work, size, gz_buf, len(gz), xz_buf, len(xz), raw_size,
+                         dart_path, args.dart_device, HV_IPA)
+res_size = MAX_RESULTS * BenchResult.sizeof()
+
+with u.heap.guarded_malloc(len(bench_args)) as args_buf, u.heap.guarded_malloc(res_size) as res_buf:
+    iface.writemem(args_buf, bench_args)
+    count = lp.bench_run(args_buf, res_buf, MAX_RESULTS)
+    data = iface.readmem(res_buf, count * BenchResult.sizeof())
+
+for buf in (work, gz_buf, xz_buf) + ((dart_path,) if dart_path else ()):
+    u.free(buf)
+
+freq = u.mrs(CNTFRQ_EL0)
+results = []
+for i in range(count):
+    r = BenchResult.parse(data[i * BenchResult.sizeof():])
+    ns = r.ticks * 1000000000 // freq
+    entry = {"name": r.name, "bytes": r.bytes, "ops": r.ops, "ticks": r.ticks, "ns": ns}
+    if r.bytes:
+        entry["mbps"] = round(r.bytes * freq / r.ticks / 1000000, 1)
+    results.append(entry)
+
+chip_id = u.adt["/chosen"].chip_id
+if args.json:
+    print(json.dumps({"chip": f"t{chip_id:x}", "freq": freq, "size": size, "results": results}))
+else:
+    print(f"chip t{chip_id:x}, timer {freq} Hz, working set {size} bytes")
+    for r in results:
+        rate = f"{r['mbps']:>10} MB/s" if "mbps" in r else f"{r['ns'] // r['ops']:>10} ns/op"
+        print(f"{r['name']:16} {r['bytes']:>10} {r['ops']:>6} {r['ticks']:>12} {r['ns']:>12} ns {rate}")
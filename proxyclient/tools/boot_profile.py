@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, struct, json, argparse
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+parser = argparse.ArgumentParser(description='Fetch the boot stage timestamps recorded by m1n1')
+parser.add_argument('-j', '--json', action="store_true", help="print the profile as JSON")
+args = parser.parse_args()
+
+from m1n1.setup import *
+
+# Order of enum bootprof_stage in src/bootprof.h
+STAGES = [
+    "start", "main", "mmu", "coproc", "display", "init", "payload-load", "payload-place", "smp",
+    "dt-open", "dt-chosen", "dt-serial", "dt-memory", "dt-cpus", "dt-mac", "dt-wifi",
+    "dt-bluetooth", "dt-uboot", "dt-atc", "dt-display", "dt-gpu", "dt-disable", "dt-pack", "usb",
+    "pcie", "kboot",
+]
+
+size = 8 * len(STAGES)
+with u.heap.guarded_malloc(size) as buf:
+    count = p.get_boot_profile(buf, size)
+    ticks = struct.unpack(f"<{count}Q", iface.readmem(buf, 8 * count))
+
+freq = u.mrs(CNTFRQ_EL0)
+start = ticks[0]
+profile = {}
+for i, t in enumerate(ticks):
+    if not t:
+        continue
+    name = STAGES[i] if i < len(STAGES) else f"#{i}"
+    profile[name] = (t - start) * 1000000 // freq
+
+if args.json:
+    print(json.dumps(profile))
+else:
+    prev = 0
+    for name, us in profile.items():
+        print(f"{name:14} {us:>10} us (+{us - prev})")
+        prev = us
@@ -12,6 +12,8 @@ parser.add_argument('-c', '--call', action="store_true", help="Use call mode")
 parser.add_argument('-r', '--raw', action="store_true", help="Image is raw")
 parser.add_argument('-E', '--entry-point', action="store", type=int, help="Entry point for the raw image", default=0x800)
 parser.add_argument('-x', '--xnu', action="store_true", help="Set up for chainloading XNU")
+parser.add_argument('-d', '--delta', action="store_true",
+                    help="Only send the parts of the image that changed since the last upload")
 parser.add_argument('payload', type=pathlib.Path)
 parser.add_argument('boot_args', default=[], nargs="*")
 args = parser.parse_args()
@@ -54,7 +56,10 @@ print(f"Total region size: 0x{image_size:x} bytes")
 image_addr = u.malloc(image_size)
 
 print(f"Loading kernel image (0x{len(image):x} bytes)...")
-u.compressed_writemem(image_addr, image, True)
+if args.delta:
+    u.delta_writemem(image_addr, image, True)
+else:
+    u.compressed_writemem(image_addr, image, True)
 p.dc_cvau(image_addr, len(image))
 
 if not args.no_sepfw:
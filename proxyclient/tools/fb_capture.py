@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+import argparse, time
+
+parser = argparse.ArgumentParser(description='Capture the framebuffer as JPEG using the hardware encoder')
+parser.add_argument('-n', '--count', type=int, default=1, help="Number of frames (0 = forever)")
+parser.add_argument('-i', '--interval', type=float, default=0, help="Seconds between frames")
+parser.add_argument('-j', '--jpeg', type=str, default="jpeg0", help="JPEG instance to use")
+parser.add_argument('-m', '--mjpeg', action="store_true",
+                    help="Write all frames concatenated to output as an MJPEG stream")
+parser.add_argument('output', type=str, help="Output file; with several frames, a format like frame%%04d.jpg")
+args = parser.parse_args()
+
+from m1n1.setup import *
+from m1n1.hw.jpeg import JPEGEncoder
+
+enc = JPEGEncoder(u, args.jpeg)
+enc.map_framebuffer()
+v = u.ba.video
+raw_size = v.stride * v.height
+
+if args.mjpeg:
+    stream = open(args.output, "wb")
+
+frame = 0
+while not args.count or frame < args.count:
+    t = time.time()
+    data = enc.encode()
+    dt = time.time() - t
+
+    if args.mjpeg:
+        stream.write(data)
+        stream.flush()
+    else:
+        name = args.output % frame if "%" in args.output else args.output
+        with open(name, "wb") as fd:
+            fd.write(data)
+
+    print(f"frame {frame}: {len(data)} bytes ({raw_size / len(data):.1f}x smaller) in {dt*1000:.0f} ms")
+    frame += 1
+    if args.interval:
+        time.sleep(max(0, args.interval - dt))
@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+import argparse, os, subprocess, threading
+
+parser = argparse.ArgumentParser(description='Run a proxyclient tool against several m1n1 targets at once')
+parser.add_argument('-t', '--target', action='append', default=[],
+                    help="M1N1DEVICE for one target (repeat, or set M1N1DEVICES=dev1,dev2,...)")
+parser.add_argument('-j', '--jobs', type=int, default=0, help="Maximum targets to run at once")
+parser.add_argument('tool', type=pathlib.Path)
+parser.add_argument('tool_args', nargs=argparse.REMAINDER)
+args = parser.parse_args()
+
+targets = args.target or [d for d in os.environ.get("M1N1DEVICES", "").split(",") if d]
+if not targets:
+    parser.error("no targets given")
+
+tool = args.tool
+if not tool.exists() and (pathlib.Path(__file__).parent / tool).exists():
+    tool = pathlib.Path(__file__).parent / tool
+
+jobs = threading.Semaphore(args.jobs or len(targets))
+print_lock = threading.Lock()
+results = {}
+
+def run(target):
+    env = dict(os.environ, M1N1DEVICE=target)
+    with jobs:
+        proc = subprocess.Popen([sys.executable, "-u", str(tool)] + args.tool_args, env=env,
+                                stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+                                stderr=subprocess.STDOUT)
+        for line in proc.stdout:
+            with print_lock:
+                sys.stdout.write(f"[{target}] " + line.decode("utf-8", "replace"))
+                sys.stdout.flush()
+        results[target] = proc.wait()
+
+threads = [threading.Thread(target=run, args=(t,)) for t in targets]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+
+failed = [t for t in targets if results.get(t)]
+for t in targets:
+    print(f"{t}: {'FAILED (%d)' % results[t] if results.get(t) else 'ok'}")
+sys.exit(1 if failed else 0)
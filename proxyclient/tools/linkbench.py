@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, json, argparse, os, time, statistics
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+parser = argparse.ArgumentParser(description='Measure proxy link latency and throughput')
+parser.add_argument('-j', '--json', action="store_true", help="print the results as JSON")
+parser.add_argument('-n', '--count', type=int, default=200, help="round trips per latency test")
+parser.add_argument('-s', '--max-size', type=lambda x: int(x, 0), default=4 << 20,
+                    help="largest readmem/writemem transfer (default 4MiB)")
+parser.add_argument('-q', '--quick', action="store_true", help="only test the default features")
+args = parser.parse_args()
+
+from m1n1.setup import *
+from m1n1.proxy import Feature, EVENT
+
+# Checksum and transfer modes to compare; the device drops what it doesn't support on this link
+DEFAULT = Feature.get_all() & ~Feature.SET_BAUD
+MODES = {
+    "default": DEFAULT,
+    "crc32c": DEFAULT & ~Feature.DISABLE_DATA_CSUMS,
+    "legacy-csum": DEFAULT & ~(Feature.DISABLE_DATA_CSUMS | Feature.CRC32C),
+    "no-bulk": DEFAULT & ~(Feature.BULK_WRITE | Feature.ZWRITE | Feature.ZREAD |
+                           Feature.SPARSE_READ),
+}
+
+EVENT_SIZES = [16, 256, 4096]
+EVENT_COUNT = 256
+
+def latency(fn):
+    times = []
+    for i in range(args.count):
+        t = time.perf_counter()
+        fn(i)
+        times.append(time.perf_counter() - t)
+    return {
+        "median_us": round(statistics.median(times) * 1e6, 1),
+        "min_us": round(min(times) * 1e6, 1),
+        "max_us": round(max(times) * 1e6, 1),
+    }
+
+def throughput(fn, size):
+    # Enough repetitions for at least ~8MB or 8 rounds, whichever is fewer transfers
+    reps = max(1, min(8, (8 << 20) // size))
+    t = time.perf_counter()
+    for i in range(reps):
+        fn(size)
+    dt = time.perf_counter() - t
+    return round(size * reps / dt / 1e6, 3)
+
+def run_mode(features, buf):
+    iface._nop(features)
+    enabled = iface.enabled_features
+
+    result = {"features": str(enabled) or "none", "latency": {}, "read_mbps": {}, "write_mbps": {}}
+
+    result["latency"]["nop"] = latency(lambda i: p.nop())
+    result["latency"]["echo"] = latency(lambda i: p.link_echo(i))
+    result["latency"]["read32"] = latency(lambda i: p.read32(buf))
+
+    # Random data, so compressed transfers can't cheat
+    data = os.urandom(args.max_size)
+    iface.writemem(buf, data)
+
+    size = 256
+    while size <= args.max_size:
+        result["write_mbps"][size] = throughput(lambda n: iface.writemem(buf, data[:n]), size)
+        result["read_mbps"][size] = throughput(lambda n: iface.readmem(buf, n), size)
+        size *= 16 if size < 65536 else 4
+
+    events = {"count": 0, "bytes": 0}
+    def on_event(data):
+        events["count"] += 1
+        events["bytes"] += len(data)
+    iface.set_event_handler(EVENT.LINK_TEST, on_event)
+
+    result["events"] = {}
+    for evsize in EVENT_SIZES:
+        events["count"] = events["bytes"] = 0
+        t = time.perf_counter()
+        p.link_events(EVENT_COUNT, evsize, buf)
+        dt = time.perf_counter() - t
+        assert events["count"] == EVENT_COUNT
+        result["events"][evsize] = {
+            "per_sec": round(EVENT_COUNT / dt),
+            "mbps": round(events["bytes"] / dt / 1e6, 3),
+        }
+
+    return result
+
+buf = u.memalign(0x4000, args.max_size)
+link = iface.devpath or "socket"
+baud = getattr(iface.dev, "baudrate", None)
+
+results = {}
+try:
+    for name, features in MODES.items():
+        if args.quick and name != "default":
+            continue
+        results[name] = run_mode(features, buf)
+finally:
+    # Back to the normal feature set for whatever runs next
+    iface._nop()
+    u.free(buf)
+
+if args.json:
+    print(json.dumps({"link": link, "baud": baud, "modes": results}))
+    sys.exit(0)
+
+print(f"Link: {link}" + (f" at {baud} baud" if baud else ""))
+for name, r in results.items():
+    print(f"\n[{name}] features: {r['features']}")
+    for op, l in r["latency"].items():
+        print(f"  {op:8} median {l['median_us']:>9} us  min {l['min_us']:>9} us  max {l['max_us']:>9} us")
+    print(f"  {'size':>10} {'write MB/s':>12} {'read MB/s':>12}")
+    for size in r["write_mbps"]:
+        print(f"  {size:>10} {r['write_mbps'][size]:>12} {r['read_mbps'][size]:>12}")
+    for evsize, e in r["events"].items():
+        print(f"  events of {evsize:>5} bytes: {e['per_sec']:>8}/s {e['mbps']:>10} MB/s")
@@ -10,10 +10,12 @@ parser = argparse.ArgumentParser(description='(Linux) kernel loader for m1n1')
 parser.add_argument('payload', type=pathlib.Path)
 parser.add_argument('dtb', type=pathlib.Path)
 parser.add_argument('initramfs', nargs='?', type=pathlib.Path)
-parser.add_argument('--compression', choices=['auto', 'none', 'gz', 'xz'], default='auto')
+parser.add_argument('--compression', choices=['auto', 'none', 'gz', 'xz', 'zst', 'lz4'], default='auto')
 parser.add_argument('-b', '--bootargs', type=str, metavar='"boot arguments"')
 parser.add_argument('-t', '--tty', type=str)
 parser.add_argument('-u', '--u-boot', type=pathlib.Path, help="load u-boot before linux")
+parser.add_argument('-d', '--delta', action="store_true",
+                    help="Only send the parts of each image that changed since the last upload")
 args = parser.parse_args()
 
 from m1n1.setup import *
@@ -24,6 +26,10 @@ if args.compression == 'auto':
         args.compression = 'gz'
     elif suffix == '.xz':
         args.compression = 'xz'
+    elif suffix == '.zst':
+        args.compression = 'zst'
+    elif suffix == '.lz4':
+        args.compression = 'lz4'
     else:
         raise ValueError('unknown compression for {}'.format(args.payload))
 
@@ -43,6 +49,12 @@ else:
     initramfs = None
     initramfs_size = 0
 
+def upload(addr, data):
+    if args.delta:
+        u.delta_writemem(addr, data, True)
+    else:
+        iface.writemem(addr, data, True)
+
 if args.bootargs is not None:
     print('Setting boot args: "{}"'.format(args.bootargs))
     p.kboot_set_chosen("bootargs", args.bootargs)
@@ -52,7 +64,7 @@ if args.compression != 'none':
     compressed_addr = u.malloc(compressed_size)
 
     print("Loading %d bytes to 0x%x..0x%x..." % (compressed_size, compressed_addr, compressed_addr + compressed_size))
-    iface.writemem(compressed_addr, payload, True)
+    upload(compressed_addr, payload)
 
 dtb_addr = u.malloc(len(dtb))
 print("Loading DTB to 0x%x..." % dtb_addr)
@@ -70,7 +82,7 @@ assert not (kernel_base & 0xffff)
 if initramfs is not None:
     initramfs_base = u.memalign(65536, initramfs_size)
     print("Loading %d initramfs bytes to 0x%x..." % (initramfs_size, initramfs_base))
-    iface.writemem(initramfs_base, initramfs, True)
+    upload(initramfs_base, initramfs)
     p.kboot_set_initrd(initramfs_base, initramfs_size)
 
 
@@ -104,7 +116,10 @@ if args.u_boot:
         raise Exception("New bootenv cannot be larger than original bootenv")
     uboot[bootenv_start:bootenv_start+bootenv_len] = bootenv_new
 
-    u.compressed_writemem(uboot_addr, uboot, True)
+    if args.delta:
+        u.delta_writemem(uboot_addr, uboot, True)
+    else:
+        u.compressed_writemem(uboot_addr, uboot, True)
     p.dc_cvau(uboot_addr, uboot_size)
     p.ic_ivau(uboot_addr, uboot_size)
 
@@ -121,13 +136,19 @@ iface.dev.timeout = 40
 if args.compression == 'none':
     kernel_size = len(payload)
     print("Loading %d bytes to 0x%x..0x%x..." % (kernel_size, kernel_base, kernel_base + kernel_size))
-    iface.writemem(kernel_base, payload, True)
+    upload(kernel_base, payload)
 elif args.compression == 'gz':
     print("Uncompressing gz ...")
     kernel_size = p.gzdec(compressed_addr, compressed_size, kernel_base, kernel_size)
 elif args.compression == 'xz':
     print("Uncompressing xz ...")
     kernel_size = p.xzdec(compressed_addr, compressed_size, kernel_base, kernel_size)
+elif args.compression == 'zst':
+    print("Uncompressing zstd ...")
+    kernel_size = p.zstddec(compressed_addr, compressed_size, kernel_base, kernel_size)
+elif args.compression == 'lz4':
+    print("Uncompressing lz4 ...")
+    kernel_size = p.lz4dec(compressed_addr, compressed_size, kernel_base, kernel_size)
 else:
     raise ValueError('unsupported compression {}'.format(args.compression))
 
@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, struct, time, argparse
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+parser = argparse.ArgumentParser(description='Show and change the MCC system level cache setup')
+parser.add_argument('-w', '--ways', type=int, help="set the number of SLC ways (0 = off)")
+parser.add_argument('-m', '--mcc', type=int, default=-1, help="MCC instance for --ways (default all)")
+parser.add_argument('-p', '--plane', type=int, default=-1, help="plane for --ways (default all)")
+parser.add_argument('-s', '--sample', type=lambda x: int(x, 0), action="append", default=[],
+                    help="plane register offset to sample on every plane (repeatable)")
+parser.add_argument('-i', '--interval', type=float, default=1.0,
+                    help="seconds between the two --sample reads")
+args = parser.parse_args()
+
+from m1n1.setup import *
+
+# struct mcc_plane_state in src/mcc.h
+ENTRY = "<8I"
+MAX_PLANES = 64
+
+if args.ways is not None:
+    if p.mcc_set_cache_ways(args.ways, args.mcc, args.plane):
+        print("Failed to set SLC ways (bad arguments, or a plane didn't follow)")
+
+with u.heap.guarded_malloc(MAX_PLANES * struct.calcsize(ENTRY)) as buf:
+    count = p.mcc_get_cache_state(buf, MAX_PLANES)
+    if count < 0:
+        print("MCC not initialized")
+        sys.exit(1)
+    data = iface.readmem(buf, count * struct.calcsize(ENTRY))
+
+planes = []
+print(f"{'mcc':>3} {'plane':>5} {'enable':>10} {'status':>10} {'data':>5} {'tag':>5} {'max':>5}")
+for i in range(count):
+    mcc, plane, enable, status, data_ways, tag_ways, max_ways, _ = \
+        struct.unpack_from(ENTRY, data, i * struct.calcsize(ENTRY))
+    planes.append((mcc, plane))
+    print(f"{mcc:>3} {plane:>5} {enable:#10x} {status:#10x} {data_ways:>5} {tag_ways:>5} {max_ways:>5}")
+
+# Rates of raw plane registers, for narrowing down which ones are counters
+if args.sample:
+    before = {(m, pl, off): p.mcc_plane_read32(m, pl, off)
+              for m, pl in planes for off in args.sample}
+    time.sleep(args.interval)
+    after = {k: p.mcc_plane_read32(*k) for k in before}
+    for (m, pl, off), v0 in before.items():
+        v1 = after[m, pl, off]
+        if v0 < 0 or v1 < 0:
+            print(f"MCC {m} plane {pl} +{off:#x}: not readable")
+            continue
+        delta = (v1 - v0) & 0xffffffff
+        print(f"MCC {m} plane {pl} +{off:#x}: {v0:#010x} -> {v1:#010x} "
+              f"({delta / args.interval:.0f}/s)")
@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, struct, json, argparse
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+parser = argparse.ArgumentParser(description='Measure memory bandwidth and latency on the device (build with `make bench`)')
+parser.add_argument('-j', '--json', action="store_true", help="print the results as JSON")
+parser.add_argument('-s', '--size', type=lambda x: int(x, 0), default=64 << 20,
+                    help="working set size per CPU in bytes (default 64MiB)")
+parser.add_argument('-c', '--cpus', type=lambda x: [int(i) for i in x.split(",")], default=None,
+                    help="comma separated CPUs to use (default all)")
+parser.add_argument('--loads', type=int, default=1 << 20, help="loads per pointer chase")
+parser.add_argument('--no-nc', action="store_true", help="skip the Normal-NC alias tests")
+args = parser.parse_args()
+
+from m1n1.setup import *
+from m1n1.loadobjs import *
+
+# Shared with src/bench/membench.c
+MEMBENCH_READ = 0
+MEMBENCH_WRITE = 1
+MEMBENCH_COPY = 2
+MEMBENCH_CHASE = 3
+
+MEMBENCH_NC = 1 << 0
+
+MAX_CPUS = 20
+MembenchArgs = struct.Struct(f"<10Q{MAX_CPUS}Q")
+
+STREAM_OPS = (("read", MEMBENCH_READ), ("write", MEMBENCH_WRITE), ("copy", MEMBENCH_COPY))
+PROBE_STRIDES = (64, 128, 256, 4096, 16384)
+
+lp = LinkedProgram(u)
+lp.load_obj("build/bench/membench.o")
+
+cpus = args.cpus if args.cpus is not None else list(range(len(u.adt["cpus"])))
+p.smp_start_secondaries()
+for cpu in cpus:
+    if cpu:
+        p.mmu_init_secondary(cpu)
+
+size = args.size
+freq = u.mrs(CNTFRQ_EL0)
+buf = u.memalign(0x4000, 2 * size * len(cpus))
+args_buf = u.malloc(MembenchArgs.size)
+
+def run(name, op, cpus, size, stride=8, iters=1, flags=0):
+    '''Run one test on all of cpus at once, returns a result entry or None if it failed'''
+    data = MembenchArgs.pack(op, flags, buf, size, stride, iters, len(cpus), 0, 0,
+                             *([0] * MAX_CPUS))
+    iface.writemem(args_buf, data)
+
+    if op == MEMBENCH_CHASE and lp.membench_chase_init(args_buf):
+        return None
+
+    secondaries = [cpu for cpu in cpus if cpu]
+    started = 0
+    if secondaries:
+        started = lp.membench_run(args_buf, call=lambda addr, *a: p.smp_call_many(secondaries, addr, *a))
+        missing = len(secondaries) - bin(started).count("1")
+        if missing:
+            # Don't leave the ones that did start waiting at the barrier
+            p.write64(args_buf + 6 * 8, len(cpus) - missing)
+    if 0 in cpus:
+        lp.membench_run(args_buf)
+    if secondaries:
+        p.smp_wait_all(secondaries)
+
+    fields = MembenchArgs.unpack(iface.readmem(args_buf, MembenchArgs.size))
+    ticks = [t for t in fields[9:9 + len(cpus)] if t]
+    if not ticks:
+        return None
+
+    ticks = max(ticks)
+    ns = ticks * 1000000000 // freq
+    entry = {"name": name, "cpus": len(ticks), "size": size, "ticks": ticks, "ns": ns}
+    if op == MEMBENCH_CHASE:
+        entry["ns_per_load"] = round(ns / iters, 2)
+    else:
+        accesses = size // stride if op != MEMBENCH_COPY else size
+        moved = accesses * (8 if op != MEMBENCH_COPY else 1) * iters * len(ticks)
+        entry["mbps"] = round(moved * freq / ticks / 1000000, 1)
+    return entry
+
+results = []
+def add(entry):
+    if entry is not None:
+        results.append(entry)
+        if not args.json:
+            rate = f"{entry['mbps']:>10} MB/s" if "mbps" in entry else f"{entry['ns_per_load']:>10} ns/load"
+            print(f"{entry['name']:24} {entry['cpus']:>3} {entry['size']:>10} {entry['ns']:>12} ns {rate}")
+
+chip_id = u.adt["/chosen"].chip_id
+if not args.json:
+    print(f"chip t{chip_id:x}, timer {freq} Hz, working set {size} bytes per CPU")
+
+# Streaming bandwidth, each core alone and then all of them together
+for cpu in cpus:
+    for name, op in STREAM_OPS:
+        add(run(f"{name}/cpu{cpu}", op, [cpu], size))
+for name, op in STREAM_OPS:
+    add(run(f"{name}/all", op, cpus, size))
+
+# Latency from L1 out to DRAM, the knee past the L2 size is the SLC
+chase = 0x4000
+while chase <= size:
+    add(run(f"chase/{chase >> 10}K", MEMBENCH_CHASE, [cpus[0]], chase, 64, args.loads))
+    chase *= 2
+
+# Strided reads, lines and pages that land on the same SLC and DRAM resources
+for stride in PROBE_STRIDES:
+    add(run(f"read/stride{stride}", MEMBENCH_READ, [cpus[0]], size, stride))
+
+if not args.no_nc:
+    for name, op in STREAM_OPS:
+        add(run(f"{name}/nc", op, [cpus[0]], size, flags=MEMBENCH_NC))
+    add(run("chase/nc", MEMBENCH_CHASE, [cpus[0]], size, 64, args.loads, flags=MEMBENCH_NC))
+
+u.free(args_buf)
+u.free(buf)
+
+if args.json:
+    print(json.dumps({"chip": f"t{chip_id:x}", "freq": freq, "size": size, "results": results}))
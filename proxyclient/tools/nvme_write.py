@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, time
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+import argparse, zlib
+
+argparser = argparse.ArgumentParser(description="Write an image to the internal NVMe")
+argparser.add_argument("image", type=pathlib.Path)
+argparser.add_argument("-l", "--lba", type=lambda s: int(s, 0), required=True,
+                       help="first 4K block to write")
+argparser.add_argument("-n", "--nsid", type=int, default=1)
+argparser.add_argument("-c", "--chunk", type=lambda s: int(s, 0), default=16 << 20,
+                       help="bytes uploaded and written per NVMe call")
+argparser.add_argument("-d", "--discard", type=lambda s: int(s, 0), default=0,
+                       help="discard this many blocks starting at --lba first")
+argparser.add_argument("-v", "--verify", action="store_true",
+                       help="read the image back and compare CRCs")
+args = argparser.parse_args()
+
+from m1n1.setup import *
+
+BLOCK = 4096
+
+data = args.image.read_bytes()
+if len(data) % BLOCK:
+    data += bytes(BLOCK - len(data) % BLOCK)
+chunk = args.chunk - args.chunk % BLOCK
+
+if not p.nvme_init():
+    raise Exception("NVMe init failed")
+
+try:
+    if args.discard and not p.nvme_discard(args.nsid, args.lba, args.discard):
+        raise Exception("Discard failed")
+
+    buf = u.heap.memalign(BLOCK, chunk)
+    t = time.time()
+    for off in range(0, len(data), chunk):
+        part = data[off:off + chunk]
+        u.compressed_writemem(buf, part)
+        if not p.nvme_write_blocks(args.nsid, args.lba + off // BLOCK, len(part) // BLOCK, buf):
+            raise Exception(f"Write failed at block {args.lba + off // BLOCK:#x}")
+        print(f"\r{(off + len(part)) >> 20}/{len(data) >> 20} MiB", end="")
+    if not p.nvme_flush(args.nsid):
+        raise Exception("Flush failed")
+    dt = time.time() - t
+    print(f"\nWrote {len(data)} bytes in {dt:.2f}s ({len(data) / dt / 1e6:.1f} MB/s)")
+
+    if args.verify:
+        crc = 0
+        for off in range(0, len(data), chunk):
+            size = min(chunk, len(data) - off)
+            if not p.nvme_read_blocks(args.nsid, args.lba + off // BLOCK, size // BLOCK, buf):
+                raise Exception(f"Read failed at block {args.lba + off // BLOCK:#x}")
+            crc = zlib.crc32(iface.readmem(buf, size), crc)
+        if crc != zlib.crc32(data):
+            raise Exception("Verify failed")
+        print("Verified")
+
+    u.heap.free(buf)
+finally:
+    p.nvme_shutdown()
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, struct, json, argparse
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+parser = argparse.ArgumentParser(description='Show where m1n1 spends its proxy time')
+parser.add_argument('-e', '--enable', action="store_true", help="start collecting")
+parser.add_argument('-d', '--disable', action="store_true", help="stop collecting")
+parser.add_argument('-r', '--reset', action="store_true", help="clear the counters after reading")
+parser.add_argument('-j', '--json', action="store_true", help="print the counters as JSON")
+args = parser.parse_args()
+
+from m1n1.setup import *
+from m1n1.proxy import M1N1Proxy
+
+# struct proxy_stats and struct proxy_op_stat in src/proxy.h
+HDR = "<6Q"
+OP = "<IIQQ"
+MAX_OPS = 128
+
+OPNAMES = {v: k[2:].lower() for k, v in vars(M1N1Proxy).items()
+           if k.startswith("P_") and isinstance(v, int)}
+
+flags = (1 if args.enable else 0) | (2 if args.disable else 0) | (4 if args.reset else 0)
+
+size = struct.calcsize(HDR) + MAX_OPS * struct.calcsize(OP)
+with u.heap.guarded_malloc(size) as buf:
+    count = p.proxy_stats(buf, size, flags)
+    data = iface.readmem(buf, struct.calcsize(HDR) + count * struct.calcsize(OP))
+
+enabled, requests, idle, rx, tx, _ = struct.unpack_from(HDR, data)
+ops = []
+for i in range(count):
+    opcode, _, calls, ticks = struct.unpack_from(OP, data, struct.calcsize(HDR) +
+                                                 i * struct.calcsize(OP))
+    ops.append((opcode, calls, ticks))
+ops.sort(key=lambda o: -o[2])
+
+freq = u.mrs(CNTFRQ_EL0)
+us = lambda t: t * 1000000 // freq
+
+# The request above is counted after it returns, so it never shows up in its own numbers
+stats = {
+    "enabled": bool(enabled),
+    "requests": requests,
+    "idle_us": us(idle),
+    "rx_us": us(rx),
+    "tx_us": us(tx),
+    "ops": {OPNAMES.get(op, f"{op:#x}"): {"calls": calls, "us": us(ticks)}
+            for op, calls, ticks in ops},
+}
+
+if args.json:
+    print(json.dumps(stats))
+else:
+    print(f"Collection {'enabled' if enabled else 'disabled'}, {requests} link requests")
+    print(f"  waiting for host {us(idle):>12} us")
+    print(f"  receiving        {us(rx):>12} us")
+    print(f"  sending          {us(tx):>12} us")
+    print(f"  executing ops    {us(sum(o[2] for o in ops)):>12} us")
+    if ops:
+        print()
+        print(f"{'op':28} {'calls':>10} {'total us':>12} {'avg us':>10}")
+        for op, calls, ticks in ops:
+            name = OPNAMES.get(op, f"{op:#x}")
+            print(f"{name:28} {calls:>10} {us(ticks):>12} {us(ticks) / calls:>10.1f}")
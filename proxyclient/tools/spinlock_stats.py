@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, struct, json, argparse
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+parser = argparse.ArgumentParser(description='Show m1n1 spinlock contention')
+parser.add_argument('-e', '--enable', action="store_true", help="start collecting")
+parser.add_argument('-d', '--disable', action="store_true", help="stop collecting")
+parser.add_argument('-r', '--reset', action="store_true", help="clear the counters after reading")
+parser.add_argument('-j', '--json', action="store_true", help="print the counters as JSON")
+args = parser.parse_args()
+
+from m1n1.setup import *
+
+# struct spinlock_stat_entry in src/utils.h
+ENTRY = "<Q24s6Q"
+MAX_LOCKS = 64
+
+flags = (1 if args.enable else 0) | (2 if args.disable else 0) | (4 if args.reset else 0)
+
+size = MAX_LOCKS * struct.calcsize(ENTRY)
+with u.heap.guarded_malloc(size) as buf:
+    count = p.spinlock_stats(buf, MAX_LOCKS, flags)
+    data = iface.readmem(buf, count * struct.calcsize(ENTRY))
+
+freq = u.mrs(CNTFRQ_EL0)
+us = lambda t: t * 1000000 // freq
+
+locks = []
+for i in range(count):
+    addr, name, acquired, contended, wait, hold, max_wait, max_hold = \
+        struct.unpack_from(ENTRY, data, i * struct.calcsize(ENTRY))
+    locks.append({
+        "name": name.rstrip(b"\0").decode() or f"{addr:#x}",
+        "acquired": acquired,
+        "contended": contended,
+        "wait_us": us(wait),
+        "hold_us": us(hold),
+        "max_wait_us": us(max_wait),
+        "max_hold_us": us(max_hold),
+    })
+locks.sort(key=lambda l: -l["wait_us"])
+
+if args.json:
+    print(json.dumps(locks))
+else:
+    print(f"{'lock':24} {'acquired':>10} {'contended':>10} {'wait us':>10} {'max wait':>10} "
+          f"{'hold us':>10} {'max hold':>10}")
+    for l in locks:
+        print(f"{l['name']:24} {l['acquired']:>10} {l['contended']:>10} {l['wait_us']:>10} "
+              f"{l['max_wait_us']:>10} {l['hold_us']:>10} {l['max_hold_us']:>10}")
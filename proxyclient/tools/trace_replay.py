@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+import sys, pathlib, traceback
+sys.path.append(str(pathlib.Path(__file__).resolve().parents[1]))
+
+import argparse
+
+parser = argparse.ArgumentParser(description='Replay a trace captured with hv.capture_trace()')
+parser.add_argument('-m', '--script', type=pathlib.Path, action='append', default=[],
+                    help="hypervisor script setting up the tracers, as for run_guest.py")
+parser.add_argument('-c', '--command', action="append", default=[])
+parser.add_argument('-s', '--start', type=float, default=None,
+                    help="skip events before this many seconds into the capture")
+parser.add_argument('-d', '--duration', type=float, default=None,
+                    help="stop after this many seconds of events")
+parser.add_argument('-S', '--shell', action="store_true", help="open a shell after replaying")
+parser.add_argument('log', type=pathlib.Path)
+args = parser.parse_args()
+
+from m1n1.adt import load_adt
+from m1n1.hv.tracelog import TraceLogReader, TraceReplayHV
+from m1n1.shell import run_shell
+
+adt = None
+adt_path = pathlib.Path(str(args.log) + ".adt")
+if adt_path.exists():
+    adt = load_adt(adt_path.read_bytes())
+
+hv = TraceReplayHV(adt)
+hv.shell_locals.update({"adt": adt})
+
+for i in args.script:
+    hv.run_script(i)
+
+for i in args.command:
+    exec(i, hv.shell_locals)
+
+reader = TraceLogReader(args.log)
+start = end = None
+if args.start is not None or args.duration is not None:
+    first = next(reader.frames(), None)
+    if first is not None:
+        start = first[0] + int((args.start or 0) * 1e9)
+        if args.duration is not None:
+            end = start + int(args.duration * 1e9)
+
+try:
+    count = hv.replay(reader, start, end)
+    print(f"Replayed {count} trace events")
+except Exception:
+    traceback.print_exc()
+    args.shell = True
+
+if args.shell:
+    run_shell(hv.shell_locals, "Entering replay shell")
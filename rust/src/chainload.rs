@@ -4,11 +4,10 @@
 use crate::gpt;
 use crate::nvme;
 use crate::println;
-use alloc::vec::Vec;
 use core::ffi::c_void;
 use cstr_core::CStr;
 use cty::*;
-use fatfs::{FileSystem, FsOptions, Read, Seek, SeekFrom};
+use fatfs::{DateTime, FileSystem, FsOptions, Read, Seek, SeekFrom};
 use uuid::Uuid;
 
 #[derive(Debug)]
@@ -17,6 +16,8 @@ pub enum Error {
     GPTError(gpt::Error<nvme::Error>),
     BadArgs,
     PartitionNotFound,
+    FileNotFound,
+    NoBuffer,
     Unknown,
 }
 
@@ -32,7 +33,27 @@ impl From<gpt::Error<nvme::Error>> for Error {
     }
 }
 
-fn load_image(spec: &str) -> Result<Vec<u8>, Error> {
+/// What the caller gets to see of the file before anything is read, see chainload.c.
+#[repr(C)]
+pub struct ImageInfo {
+    size: u64,
+    mtime: u64,
+    cached: c_int,
+}
+
+/// Asked for a buffer once the file size is known, so the caller decides where the image goes.
+/// If the caller already has the image, it fills the buffer itself and sets `cached`.
+pub type PlaceFn = unsafe extern "C" fn(info: *mut ImageInfo, arg: *mut c_void) -> *mut c_void;
+
+fn file_mtime(dt: DateTime) -> u64 {
+    let (d, t) = (dt.date, dt.time);
+    let days = (d.year as u64 * 13 + d.month as u64) * 32 + d.day as u64;
+    let secs = ((days * 24 + t.hour as u64) * 60 + t.min as u64) * 60 + t.sec as u64;
+
+    secs * 1000 + t.millis as u64
+}
+
+fn load_image(spec: &str, place: PlaceFn, arg: *mut c_void) -> Result<&'static mut [u8], Error> {
     println!("Chainloading {}", spec);
 
     let mut args = spec.split(';');
@@ -59,14 +80,56 @@ fn load_image(spec: &str) -> Result<Vec<u8>, Error> {
     let opts = FsOptions::new().update_accessed_date(false);
 
     let fs = FileSystem::new(storage, opts)?;
-    let mut file = fs.root_dir().open_file(path)?;
+
+    // Look up the directory entry ourselves, the cache is keyed by its mtime
+    let path = path.trim_start_matches('/');
+    let (dir_path, name) = match path.rfind('/') {
+        Some(i) => (&path[..i], &path[i + 1..]),
+        None => ("", path),
+    };
+
+    let root = fs.root_dir();
+    let dir = if dir_path.is_empty() {
+        root
+    } else {
+        root.open_dir(dir_path)?
+    };
+
+    let mut found = None;
+    for entry in dir.iter() {
+        let entry = entry?;
+        if entry.is_file() && entry.file_name().eq_ignore_ascii_case(name) {
+            found = Some(entry);
+            break;
+        }
+    }
+    let entry = found.ok_or(Error::FileNotFound)?;
+
+    let mtime = file_mtime(entry.modified());
+    let mut file = entry.to_file();
 
     let size = file.seek(SeekFrom::End(0))? as usize;
     file.seek(SeekFrom::Start(0))?;
 
     println!("File size: {}", size);
 
-    let mut buf: Vec<u8> = vec![0; size];
+    let mut info = ImageInfo {
+        size: size as u64,
+        mtime,
+        cached: 0,
+    };
+
+    let ptr = unsafe { place(&mut info, arg) } as *mut u8;
+    if ptr.is_null() {
+        return Err(Error::NoBuffer);
+    }
+
+    // SAFETY: the place callback hands us size bytes that nothing else uses
+    let buf = unsafe { core::slice::from_raw_parts_mut(ptr, size) };
+    if info.cached != 0 {
+        return Ok(buf);
+    }
+
     let mut slice = &mut buf[..];
     while !slice.is_empty() {
         let read = file.read(slice)?;
@@ -80,16 +143,18 @@ fn load_image(spec: &str) -> Result<Vec<u8>, Error> {
 #[no_mangle]
 pub unsafe extern "C" fn rust_load_image(
     raw_spec: *const c_char,
+    place: PlaceFn,
+    arg: *mut c_void,
     image: *mut *mut c_void,
     size: *mut size_t,
 ) -> c_int {
     let spec = unsafe { CStr::from_ptr(raw_spec).to_str().unwrap() };
 
-    match load_image(spec) {
+    match load_image(spec, place, arg) {
         Ok(buf) => {
             unsafe {
                 *size = buf.len();
-                *image = buf.leak().as_mut_ptr() as *mut c_void;
+                *image = buf.as_mut_ptr() as *mut c_void;
             }
             0
         }
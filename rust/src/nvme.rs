@@ -1,32 +1,122 @@
 // SPDX-License-Identifier: MIT
 use crate::println;
 use alloc::boxed::Box;
+use alloc::collections::BTreeMap;
+use alloc::vec::Vec;
 use core::cmp::min;
 use core::ffi::c_void;
 use fatfs::SeekFrom;
 
 extern "C" {
-    fn nvme_read(nsid: u32, lba: u64, buffer: *mut c_void) -> bool;
+    fn nvme_read_blocks(nsid: u32, lba: u64, count: u64, buffer: *mut c_void) -> bool;
+    fn nvme_write_blocks(nsid: u32, lba: u64, count: u64, buffer: *const c_void) -> bool;
+    fn nvme_flush(nsid: u32) -> bool;
 }
 
 const SECTOR_SIZE: usize = 4096;
 
+/// Maximum number of sectors staged per read-ahead; nvme_read_blocks splits this across tags
+const BUFFER_SECTORS: usize = 256;
+/// Read-ahead used for non-sequential misses, doubled on every sequential one
+const READAHEAD_MIN: usize = 8;
+/// Number of recently used (metadata) sectors kept around
+const CACHE_SECTORS: usize = 64;
+
 pub type Error = ();
 
 #[repr(C, align(4096))]
 struct SectorBuffer([u8; SECTOR_SIZE]);
 
-fn alloc_sector_buf() -> Box<SectorBuffer> {
-    let p: Box<SectorBuffer> = unsafe { Box::new_zeroed().assume_init() };
-    debug_assert_eq!(0, p.0.as_ptr().align_offset(4096));
+fn alloc_sector_buf(count: usize) -> Box<[SectorBuffer]> {
+    let p: Box<[SectorBuffer]> = unsafe { Box::new_zeroed_slice(count).assume_init() };
+    debug_assert_eq!(0, p.as_ptr().align_offset(4096));
     p
 }
 
+fn read_sectors(nsid: u32, lba: u64, count: usize, buf: *mut u8) -> Result<(), Error> {
+    if !unsafe { nvme_read_blocks(nsid, lba, count as u64, buf as *mut c_void) } {
+        println!("nvme_read_blocks({}, {}, {}) failed", nsid, lba, count);
+        return Err(());
+    }
+    Ok(())
+}
+
+fn write_sectors(nsid: u32, lba: u64, count: usize, buf: *const u8) -> Result<(), Error> {
+    if !unsafe { nvme_write_blocks(nsid, lba, count as u64, buf as *const c_void) } {
+        println!("nvme_write_blocks({}, {}, {}) failed", nsid, lba, count);
+        return Err(());
+    }
+    Ok(())
+}
+
+/// Small LRU cache of individual sectors, used for the FAT, directory and GPT sectors that the
+/// filesystem code keeps coming back to.
+struct SectorCache {
+    sectors: Box<[SectorBuffer]>,
+    lbas: Vec<Option<u64>>,
+    stamps: Vec<u64>,
+    map: BTreeMap<u64, usize>,
+    clock: u64,
+}
+
+impl SectorCache {
+    fn new(count: usize) -> SectorCache {
+        SectorCache {
+            sectors: alloc_sector_buf(count),
+            lbas: vec![None; count],
+            stamps: vec![0; count],
+            map: BTreeMap::new(),
+            clock: 0,
+        }
+    }
+
+    fn get(&mut self, lba: u64) -> Option<&[u8]> {
+        let slot = *self.map.get(&lba)?;
+        self.clock += 1;
+        self.stamps[slot] = self.clock;
+        Some(&self.sectors[slot].0)
+    }
+
+    fn insert(&mut self, lba: u64, data: &[u8]) {
+        if self.map.contains_key(&lba) {
+            return;
+        }
+
+        let slot = (0..self.stamps.len())
+            .min_by_key(|&i| self.stamps[i])
+            .unwrap();
+        if let Some(old) = self.lbas[slot].take() {
+            self.map.remove(&old);
+        }
+
+        self.sectors[slot].0.copy_from_slice(data);
+        self.clock += 1;
+        self.stamps[slot] = self.clock;
+        self.lbas[slot] = Some(lba);
+        self.map.insert(lba, slot);
+    }
+
+    /// Keep a cached copy of lba in sync with what was just written
+    fn update(&mut self, lba: u64, data: &[u8]) {
+        if let Some(&slot) = self.map.get(&lba) {
+            self.sectors[slot].0.copy_from_slice(data);
+        }
+    }
+}
+
 pub struct NVMEStorage {
     nsid: u32,
     offset: u64,
-    lba: Option<u64>,
-    buf: Box<SectorBuffer>,
+    /// First sector and number of sectors currently held in the read-ahead buffer
+    lba: u64,
+    count: usize,
+    buf: Box<[SectorBuffer]>,
+    /// Current read-ahead size, and where the next sequential miss would start
+    readahead: usize,
+    next_lba: u64,
+    cache: SectorCache,
+    /// Staging sector for writes that do not cover whole, aligned sectors
+    bounce: Box<[SectorBuffer]>,
     pos: u64,
 }
 
@@ -35,11 +125,60 @@ impl NVMEStorage {
         NVMEStorage {
             nsid: nsid,
             offset: offset,
-            lba: None,
-            buf: alloc_sector_buf(),
+            lba: 0,
+            count: 0,
+            buf: alloc_sector_buf(BUFFER_SECTORS),
+            readahead: READAHEAD_MIN,
+            next_lba: u64::MAX,
+            cache: SectorCache::new(CACHE_SECTORS),
+            bounce: alloc_sector_buf(1),
             pos: 0,
         }
     }
+
+    fn buffered(&self, lba: u64) -> bool {
+        lba >= self.lba && lba < self.lba + self.count as u64
+    }
+
+    /// Refill the read-ahead buffer starting at lba, covering at least `needed` sectors
+    fn fill(&mut self, lba: u64, needed: usize) -> Result<(), Error> {
+        self.readahead = match lba == self.next_lba {
+            true => min(self.readahead * 2, self.buf.len()),
+            false => READAHEAD_MIN,
+        };
+        let needed = min(needed, self.buf.len());
+        let count = min(needed.max(self.readahead), self.buf.len());
+        let buf = self.buf.as_mut_ptr() as *mut u8;
+
+        self.count = 0;
+        let result = read_sectors(self.nsid, lba + self.offset, count, buf);
+        let count = match result {
+            Ok(()) => count,
+            // Reading ahead might have run past the end of the device, retry without it
+            Err(()) if count > needed => {
+                read_sectors(self.nsid, lba + self.offset, needed, buf)?;
+                needed
+            }
+            Err(()) => return Err(()),
+        };
+
+        self.lba = lba;
+        self.count = count;
+        self.next_lba = lba + count as u64;
+        Ok(())
+    }
+
+    /// Propagate count freshly written sectors at lba into the read-ahead buffer and cache
+    fn written(&mut self, lba: u64, count: usize, data: &[u8]) {
+        for i in 0..count {
+            let sector = &data[i * SECTOR_SIZE..(i + 1) * SECTOR_SIZE];
+            let lba = lba + i as u64;
+            if self.buffered(lba) {
+                self.buf[(lba - self.lba) as usize].0.copy_from_slice(sector);
+            }
+            self.cache.update(lba, sector);
+        }
+    }
 }
 
 impl fatfs::IoBase for NVMEStorage {
@@ -53,17 +192,39 @@ impl fatfs::Read for NVMEStorage {
         while !buf.is_empty() {
             let lba = self.pos / SECTOR_SIZE as u64;
             let off = self.pos as usize % SECTOR_SIZE;
+            let copy_len = min(SECTOR_SIZE - off, buf.len());
 
-            if Some(lba) != self.lba {
-                self.lba = Some(lba);
-                let lba = lba + self.offset;
-                if !unsafe { nvme_read(self.nsid, lba, self.buf.0.as_mut_ptr() as *mut c_void) } {
-                    println!("nvme_read({}, {}) failed", self.nsid, lba);
-                    return Err(());
+            if let Some(sector) = self.cache.get(lba) {
+                buf[..copy_len].copy_from_slice(&sector[off..off + copy_len]);
+            } else {
+                // Whole, suitably aligned sectors go straight into the caller's buffer
+                let direct = buf.len() / SECTOR_SIZE;
+                if off == 0
+                    && direct > 0
+                    && buf.as_ptr().align_offset(SECTOR_SIZE) == 0
+                    && !self.buffered(lba)
+                {
+                    read_sectors(self.nsid, lba + self.offset, direct, buf.as_mut_ptr())?;
+                    let len = direct * SECTOR_SIZE;
+                    buf = &mut buf[len..];
+                    read += len;
+                    self.pos += len as u64;
+                    continue;
+                }
+
+                if !self.buffered(lba) {
+                    self.fill(lba, (off + buf.len() + SECTOR_SIZE - 1) / SECTOR_SIZE)?;
+                }
+
+                let sector = &self.buf[(lba - self.lba) as usize].0;
+                buf[..copy_len].copy_from_slice(&sector[off..off + copy_len]);
+
+                // Partial sector reads are metadata accesses, keep those around
+                if copy_len < SECTOR_SIZE {
+                    self.cache.insert(lba, sector);
                 }
             }
-            let copy_len = min(SECTOR_SIZE - off, buf.len());
-            buf[..copy_len].copy_from_slice(&self.buf.0[off..off + copy_len]);
+
             buf = &mut buf[copy_len..];
             read += copy_len;
             self.pos += copy_len as u64;
@@ -73,11 +234,60 @@ impl fatfs::Read for NVMEStorage {
 }
 
 impl fatfs::Write for NVMEStorage {
-    fn write(&mut self, _buf: &[u8]) -> Result<usize, Self::Error> {
-        Err(())
+    fn write(&mut self, mut buf: &[u8]) -> Result<usize, Self::Error> {
+        let mut written = 0;
+
+        while !buf.is_empty() {
+            let lba = self.pos / SECTOR_SIZE as u64;
+            let off = self.pos as usize % SECTOR_SIZE;
+            let direct = buf.len() / SECTOR_SIZE;
+
+            let len = if off == 0 && direct > 0 && buf.as_ptr().align_offset(SECTOR_SIZE) == 0 {
+                write_sectors(self.nsid, lba + self.offset, direct, buf.as_ptr())?;
+                self.written(lba, direct, buf);
+                direct * SECTOR_SIZE
+            } else {
+                // Read-modify-write a single sector through the bounce buffer
+                let copy_len = min(SECTOR_SIZE - off, buf.len());
+                let bounce = self.bounce.as_mut_ptr() as *mut u8;
+
+                if copy_len < SECTOR_SIZE {
+                    if let Some(sector) = self.cache.get(lba) {
+                        self.bounce[0].0.copy_from_slice(sector);
+                    } else if self.buffered(lba) {
+                        let sector = &self.buf[(lba - self.lba) as usize].0;
+                        self.bounce[0].0.copy_from_slice(sector);
+                    } else {
+                        read_sectors(self.nsid, lba + self.offset, 1, bounce)?;
+                    }
+                }
+                self.bounce[0].0[off..off + copy_len].copy_from_slice(&buf[..copy_len]);
+                write_sectors(self.nsid, lba + self.offset, 1, bounce)?;
+
+                let sector = &self.bounce[0].0;
+                if lba >= self.lba && lba < self.lba + self.count as u64 {
+                    self.buf[(lba - self.lba) as usize].0.copy_from_slice(sector);
+                }
+                self.cache.update(lba, sector);
+                // Partial sector writes are metadata updates, keep those around
+                if copy_len < SECTOR_SIZE {
+                    self.cache.insert(lba, sector);
+                }
+                copy_len
+            };
+
+            buf = &buf[len..];
+            written += len;
+            self.pos += len as u64;
+        }
+        Ok(written)
     }
+
     fn flush(&mut self) -> Result<(), Self::Error> {
-        Err(())
+        match unsafe { nvme_flush(self.nsid) } {
+            true => Ok(()),
+            false => Err(()),
+        }
     }
 }
 
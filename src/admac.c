@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "admac.h"
+#include "memory.h"
+#include "smp.h"
+#include "utils.h"
+
+#define ADMAC_CHAN_STATUS(ch)      (0x8010 + (ch) * 0x200)
+#define ADMAC_CHAN_DESC_RING(ch)   (0x8070 + (ch) * 0x200)
+#define ADMAC_CHAN_REPORT_RING(ch) (0x8074 + (ch) * 0x200)
+#define ADMAC_TX_DESC_WRITE(ch)    (0x10000 + ((ch) >> 1) * 4)
+#define ADMAC_TX_REPORT_READ(ch)   (0x10100 + ((ch) >> 1) * 4)
+#define ADMAC_RX_DESC_WRITE(ch)    (0x14000 + ((ch) >> 1) * 4)
+#define ADMAC_RX_REPORT_READ(ch)   (0x14100 + ((ch) >> 1) * 4)
+
+#define RING_EMPTY BIT(8)
+#define RING_FULL  BIT(9)
+#define RING_ERR   BIT(10)
+
+#define CHAN_STATUS_DESC_DONE BIT(0)
+#define CHAN_STATUS_RING_ERR  BIT(6)
+
+#define DESC_NOTIFY     BIT(16)
+#define DESC_ID         GENMASK(7, 0)
+#define DESC_ID_SILENCE BIT(7)
+
+// Keep this many descriptors queued, silence included, so the hardware never runs dry
+#define ADMAC_STREAM_MIN_QUEUED 2
+
+static bool admac_is_tx(struct admac_stream *s)
+{
+    return !(s->channel & 1);
+}
+
+static void admac_submit(struct admac_stream *s, u64 iova, u32 id)
+{
+    u64 reg = s->base + (admac_is_tx(s) ? ADMAC_TX_DESC_WRITE(s->channel)
+                                        : ADMAC_RX_DESC_WRITE(s->channel));
+
+    write32(reg, iova);
+    write32(reg, iova >> 32);
+    write32(reg, s->desc_size);
+    write32(reg, DESC_NOTIFY | FIELD_PREP(DESC_ID, id));
+}
+
+static u32 admac_read_report(struct admac_stream *s)
+{
+    u64 reg = s->base + (admac_is_tx(s) ? ADMAC_TX_REPORT_READ(s->channel)
+                                        : ADMAC_RX_REPORT_READ(s->channel));
+    u32 flags = 0;
+
+    for (int i = 0; i < 4; i++)
+        flags = read32(reg);
+
+    return FIELD_GET(DESC_ID, flags);
+}
+
+/*
+ * Runs on a secondary with its MMU enabled until the host sets stop. Returns the number of bytes
+ * the ADMAC completed.
+ */
+u64 admac_stream_run(struct admac_stream *s)
+{
+    u64 desc_ring = s->base + ADMAC_CHAN_DESC_RING(s->channel);
+    u64 report_ring = s->base + ADMAC_CHAN_REPORT_RING(s->channel);
+    u64 status = s->base + ADMAC_CHAN_STATUS(s->channel);
+    bool tx = admac_is_tx(s);
+    u32 queued = 0, id = 0;
+
+    while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+        u64 head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+
+        while (!(read32(desc_ring) & RING_FULL)) {
+            bool have_space = tx ? s->submitted + s->desc_size <= head
+                                 : s->submitted + s->desc_size <= head + s->buf_size;
+
+            if (have_space) {
+                admac_submit(s, s->buf_iova + s->submitted % s->buf_size, id);
+                id = (id + 1) & (DESC_ID_SILENCE - 1);
+                s->submitted += s->desc_size;
+            } else if (tx && s->silence_iova && queued < ADMAC_STREAM_MIN_QUEUED) {
+                admac_submit(s, s->silence_iova, DESC_ID_SILENCE);
+                s->underruns++;
+            } else {
+                break;
+            }
+            queued++;
+        }
+
+        while (!(read32(report_ring) & RING_EMPTY)) {
+            u32 done = admac_read_report(s);
+
+            if (queued)
+                queued--;
+            if (!(done & DESC_ID_SILENCE))
+                __atomic_store_n(&s->completed, s->completed + s->desc_size, __ATOMIC_RELEASE);
+        }
+
+        u32 sts = read32(status);
+        if (sts & CHAN_STATUS_RING_ERR) {
+            set32(desc_ring, RING_ERR);
+            set32(report_ring, RING_ERR);
+            s->errors++;
+        }
+        if (sts & CHAN_STATUS_DESC_DONE)
+            write32(status, CHAN_STATUS_DESC_DONE);
+    }
+
+    return s->completed;
+}
+
+int admac_stream_start(int cpu, struct admac_stream *s)
+{
+    if (cpu <= 0 || cpu >= MAX_CPUS || !smp_is_alive(cpu) || smp_is_busy(cpu))
+        return -1;
+    if (!s->desc_size || !s->buf_size || s->buf_size % s->desc_size)
+        return -1;
+
+    s->stop = 0;
+    s->submitted = 0;
+    s->completed = 0;
+    s->underruns = 0;
+    s->errors = 0;
+    dma_wmb();
+
+    smp_call1(cpu, admac_stream_run, (u64)s);
+    return 0;
+}
+
+u64 admac_stream_stop(int cpu, struct admac_stream *s)
+{
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+    return smp_wait(cpu);
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef ADMAC_H
+#define ADMAC_H
+
+#include "types.h"
+
+/*
+ * Shared with proxyclient/m1n1/hw/admac.py. The host fills (TX) or drains (RX) a ring buffer in
+ * RAM and moves head, the streaming CPU keeps the channel's descriptor ring topped up from it.
+ */
+struct admac_stream {
+    u64 base;
+    u32 channel;
+    u32 desc_size;    // bytes per descriptor, buf_size must be a multiple of it
+    u64 buf_iova;     // ring buffer as seen by the ADMAC
+    u64 buf_size;
+    u64 silence_iova; // TX: desc_size of silence played when the host falls behind, or 0
+    u64 head;         // TX: bytes written by the host, RX: bytes read by the host
+    u64 submitted;    // bytes handed to the ADMAC
+    u64 completed;    // bytes the ADMAC has reported done
+    u32 stop;
+    u32 underruns;
+    u32 errors;
+    u32 pad;
+};
+
+u64 admac_stream_run(struct admac_stream *s);
+int admac_stream_start(int cpu, struct admac_stream *s);
+u64 admac_stream_stop(int cpu, struct admac_stream *s);
+
+#endif
@@ -1,7 +1,11 @@
 /* SPDX-License-Identifier: (GPL-2.0-or-later OR BSD-2-Clause) */
 
+//#define DEBUG
+
 #include "adt.h"
+#include "malloc.h"
 #include "string.h"
+#include "utils.h"
 
 /* This API is designed to match libfdt's read-only API */
 
@@ -12,17 +16,6 @@
             return err;                                                                            \
     }
 
-//#define DEBUG
-
-#ifdef DEBUG
-#include "utils.h"
-#define dprintf printf
-#else
-#define dprintf(...)                                                                               \
-    do {                                                                                           \
-    } while (0)
-#endif
-
 int _adt_check_node_offset(const void *adt, int offset)
 {
     if ((offset < 0) || (offset % ADT_ALIGN))
@@ -73,11 +66,133 @@ static int _adt_nodename_eq(const char *a, const char *b, size_t len)
         return 0;
 }
 
+/*
+ * Lookup index for the boot ADT, built once by adt_index_init(). Offsets into the ADT never move
+ * (adt_setprop only rewrites values in place), so we can hash them:
+ *  - props:    (node offset, property name) -> property offset
+ *  - children: (parent offset, node name) -> child offset, inserted under both the full name and
+ *              the name up to '@', first sibling wins, matching adt_subnode_offset()
+ *  - siblings: node offset -> next sibling offset, which otherwise needs a subtree walk
+ *  - phandles: AAPL,phandle -> node offset
+ *  - regs:     (reg property offset, index) -> translated address and size, filled in by
+ *              adt_get_reg() as entries are first resolved and dropped whenever a property is set
+ * Lookups against any other ADT pointer (or before the index is built) walk the tree as usual.
+ */
+
+#define ADT_INDEX_EMPTY 0xffffffff
+
+struct adt_index_ent {
+    u32 hash;
+    u32 key;
+    u32 val;
+};
+
+struct adt_index_table {
+    struct adt_index_ent *ents;
+    u32 mask;
+};
+
+struct adt_reg_ent {
+    u32 poff;
+    u32 idx;
+    u64 addr;
+    u64 size;
+};
+
+static struct {
+    const void *adt;
+    struct adt_index_table props, children, siblings, phandles;
+    struct adt_reg_ent *regs;
+    u32 regs_mask, regs_used;
+} adt_index;
+
+static u32 _adt_index_hash(u32 key, const char *name, size_t len)
+{
+    u32 h = 2166136261; // FNV-1a
+
+    for (int i = 0; i < 4; i++, key >>= 8)
+        h = (h ^ (key & 0xff)) * 16777619;
+    while (len--)
+        h = (h ^ (u8)*name++) * 16777619;
+
+    return h;
+}
+
+static inline bool _adt_indexed(const void *adt)
+{
+    return adt && adt == adt_index.adt;
+}
+
+#define ADT_INDEX_FOREACH(table, h, ent)                                                           \
+    for (u32 _i = (h) & (table)->mask; (ent = &(table)->ents[_i])->val != ADT_INDEX_EMPTY;       \
+         _i = (_i + 1) & (table)->mask)
+
+static void _adt_index_put(struct adt_index_table *table, u32 hash, u32 key, u32 val)
+{
+    u32 i = hash & table->mask;
+
+    while (table->ents[i].val != ADT_INDEX_EMPTY)
+        i = (i + 1) & table->mask;
+
+    struct adt_index_ent *ent = &table->ents[i];
+    ent->hash = hash;
+    ent->key = key;
+    ent->val = val;
+}
+
+static const struct adt_property *_adt_index_prop(const void *adt, int offset, const char *name,
+                                                  size_t namelen)
+{
+    u32 hash = _adt_index_hash(offset, name, namelen);
+    struct adt_index_ent *ent;
+
+    ADT_INDEX_FOREACH(&adt_index.props, hash, ent)
+    {
+        if (ent->hash == hash && ent->key == (u32)offset &&
+            _adt_string_eq(ADT_PROP(adt, ent->val)->name, name, namelen))
+            return ADT_PROP(adt, ent->val);
+    }
+
+    return NULL;
+}
+
+static int _adt_index_child(const void *adt, int offset, const char *name, size_t namelen)
+{
+    u32 hash = _adt_index_hash(offset, name, namelen);
+    struct adt_index_ent *ent;
+
+    ADT_INDEX_FOREACH(&adt_index.children, hash, ent)
+    {
+        if (ent->hash == hash && ent->key == (u32)offset &&
+            _adt_nodename_eq(adt_get_name(adt, ent->val), name, namelen))
+            return ent->val;
+    }
+
+    return -ADT_ERR_NOTFOUND;
+}
+
+static int _adt_index_lookup(struct adt_index_table *table, u32 key)
+{
+    u32 hash = _adt_index_hash(key, NULL, 0);
+    struct adt_index_ent *ent;
+
+    ADT_INDEX_FOREACH(table, hash, ent)
+    {
+        if (ent->key == key)
+            return ent->val;
+    }
+
+    return -ADT_ERR_NOTFOUND;
+}
+
 const struct adt_property *adt_get_property_namelen(const void *adt, int offset, const char *name,
                                                     size_t namelen)
 {
     dprintf("adt_get_property_namelen(%p, %d, \"%s\", %u)\n", adt, offset, name, namelen);
 
+    if (_adt_indexed(adt))
+        return _adt_index_prop(adt, offset, name, namelen);
+
     ADT_FOREACH_PROPERTY(adt, offset, prop)
     {
         dprintf(" off=0x%x name=\"%s\"\n", offset, prop->name);
@@ -140,6 +255,13 @@ int adt_setprop(void *adt, int nodeoffset, const char *name, void *value, size_t
         return -ADT_ERR_BADLENGTH;
 
     memcpy(prop, value, len);
+
+    // Any reg or ranges may have changed under the cached translations
+    if (_adt_indexed(adt) && adt_index.regs_used) {
+        memset(adt_index.regs, 0xff, (adt_index.regs_mask + 1) * sizeof(*adt_index.regs));
+        adt_index.regs_used = 0;
+    }
+
     return len;
 }
 
@@ -175,6 +297,12 @@ int adt_first_child_offset(const void *adt, int offset)
 
 int adt_next_sibling_offset(const void *adt, int offset)
 {
+    if (_adt_indexed(adt)) {
+        int next = _adt_index_lookup(&adt_index.siblings, offset);
+        if (next >= 0)
+            return next;
+    }
+
     const struct adt_node_hdr *node = ADT_NODE(adt, offset);
 
     u32 cnt = node->child_count;
@@ -191,6 +319,9 @@ int adt_subnode_offset_namelen(const void *adt, int offset, const char *name, si
 {
     ADT_CHECK_HEADER(adt);
 
+    if (_adt_indexed(adt))
+        return _adt_index_child(adt, offset, name, namelen);
+
     ADT_FOREACH_CHILD(adt, offset)
     {
         const char *cname = adt_get_name(adt, offset);
@@ -252,6 +383,43 @@ const char *adt_get_name(const void *adt, int nodeoffset)
     return adt_getprop(adt, nodeoffset, "name", NULL);
 }
 
+int adt_phandle_offset(const void *adt, u32 phandle)
+{
+    ADT_CHECK_HEADER(adt);
+
+    if (_adt_indexed(adt))
+        return _adt_index_lookup(&adt_index.phandles, phandle);
+
+    int offset = 0;
+    int depth = 0;
+    int remaining[32];
+
+    // Iterative preorder walk, so this stays linear without the sibling index
+    while (true) {
+        u32 ph;
+        if (ADT_GETPROP(adt, offset, "AAPL,phandle", &ph) >= 0 && ph == phandle)
+            return offset;
+
+        int children = adt_get_child_count(adt, offset);
+        int next = adt_first_property_offset(adt, offset);
+        for (int i = adt_get_property_count(adt, offset); i; i--)
+            next = adt_next_property_offset(adt, next);
+
+        if (children) {
+            if (depth == (int)ARRAY_SIZE(remaining))
+                return -ADT_ERR_BADOFFSET;
+            remaining[depth++] = children;
+        } else {
+            while (depth && !--remaining[depth - 1])
+                depth--;
+            if (!depth)
+                return -ADT_ERR_NOTFOUND;
+        }
+
+        offset = next;
+    }
+}
+
 static void get_cells(u64 *dst, const u32 **src, int cells)
 {
     *dst = 0;
@@ -259,7 +427,8 @@ static void get_cells(u64 *dst, const u32 **src, int cells)
         *dst |= ((u64) * ((*src)++)) << (32 * i);
 }
 
-int adt_get_reg(const void *adt, int *path, const char *prop, int idx, u64 *paddr, u64 *psize)
+static int _adt_get_reg(const void *adt, int *path, const char *prop, int idx, u64 *paddr,
+                        u64 *psize)
 {
     int cur = 0;
 
@@ -356,6 +525,67 @@ int adt_get_reg(const void *adt, int *path, const char *prop, int idx, u64 *padd
     return 0;
 }
 
+static struct adt_reg_ent *_adt_index_reg(u32 poff, int idx)
+{
+    u32 i = _adt_index_hash(poff, NULL, 0) + idx;
+    struct adt_reg_ent *ent;
+
+    // Returns the matching entry, or the empty slot it would go in
+    for (;; i++) {
+        ent = &adt_index.regs[i & adt_index.regs_mask];
+        if (ent->poff == ADT_INDEX_EMPTY || (ent->poff == poff && ent->idx == (u32)idx))
+            return ent;
+    }
+}
+
+int adt_get_reg(const void *adt, int *path, const char *prop, int idx, u64 *paddr, u64 *psize)
+{
+    struct adt_reg_ent *ent = NULL;
+    u32 poff = 0;
+
+    if (_adt_indexed(adt) && adt_index.regs && *path && idx >= 0) {
+        int cur = 0;
+        while (path[cur + 1])
+            cur++;
+
+        const struct adt_property *p = adt_get_property(adt, path[cur], prop);
+        if (p) {
+            poff = (const u8 *)p - (const u8 *)adt;
+            ent = _adt_index_reg(poff, idx);
+            if (ent->poff != ADT_INDEX_EMPTY) {
+                if (paddr)
+                    *paddr = ent->addr;
+                if (psize)
+                    *psize = ent->size;
+                return 0;
+            }
+            // Keep the load factor at or below 1/2
+            if (2 * (adt_index.regs_used + 1) > adt_index.regs_mask + 1)
+                ent = NULL;
+        }
+    }
+
+    u64 addr, size;
+    int ret = _adt_get_reg(adt, path, prop, idx, &addr, &size);
+    if (ret)
+        return ret;
+
+    if (ent) {
+        ent->poff = poff;
+        ent->idx = idx;
+        ent->addr = addr;
+        ent->size = size;
+        adt_index.regs_used++;
+    }
+
+    if (paddr)
+        *paddr = addr;
+    if (psize)
+        *psize = size;
+
+    return 0;
+}
+
 bool adt_is_compatible(const void *adt, int nodeoffset, const char *compat)
 {
     u32 len;
@@ -373,3 +603,135 @@ bool adt_is_compatible(const void *adt, int nodeoffset, const char *compat)
 
     return false;
 }
+
+static int adt_index_walk(const void *adt, int offset, u32 *nodes, u32 *props)
+{
+    const struct adt_node_hdr *node = ADT_NODE(adt, offset);
+    bool fill = adt_index.props.ents;
+
+    if (_adt_check_node_offset(adt, offset) < 0)
+        return -ADT_ERR_BADOFFSET;
+
+    (*nodes)++;
+    int poff = adt_first_property_offset(adt, offset);
+    for (u32 i = 0; i < node->property_count; i++, poff = adt_next_property_offset(adt, poff)) {
+        const struct adt_property *prop = ADT_PROP(adt, poff);
+
+        if (_adt_check_prop_offset(adt, poff) < 0)
+            return -ADT_ERR_BADOFFSET;
+
+        (*props)++;
+        if (!fill)
+            continue;
+
+        size_t len = strnlen(prop->name, sizeof(prop->name));
+        // Duplicate names resolve to the first one, like the linear search
+        if (!_adt_index_prop(adt, offset, prop->name, len))
+            _adt_index_put(&adt_index.props, _adt_index_hash(offset, prop->name, len), offset,
+                           poff);
+
+        if (!strcmp(prop->name, "AAPL,phandle") && prop->size == 4) {
+            u32 ph = *(const u32 *)prop->value;
+            if (_adt_index_lookup(&adt_index.phandles, ph) < 0)
+                _adt_index_put(&adt_index.phandles, _adt_index_hash(ph, NULL, 0), ph, offset);
+        }
+    }
+
+    int child = poff;
+    for (u32 i = 0; i < node->child_count; i++) {
+        int next = adt_index_walk(adt, child, nodes, props);
+        if (next < 0)
+            return next;
+
+        if (fill) {
+            _adt_index_put(&adt_index.siblings, _adt_index_hash(child, NULL, 0), child, next);
+
+            const char *name = adt_get_name(adt, child);
+            if (name) {
+                size_t len = strlen(name);
+                const char *at = memchr(name, '@', len);
+
+                if (_adt_index_child(adt, offset, name, len) < 0)
+                    _adt_index_put(&adt_index.children, _adt_index_hash(offset, name, len),
+                                   offset, child);
+                if (at && _adt_index_child(adt, offset, name, at - name) < 0)
+                    _adt_index_put(&adt_index.children, _adt_index_hash(offset, name, at - name),
+                                   offset, child);
+            }
+        }
+
+        child = next;
+    }
+
+    return child;
+}
+
+static bool adt_index_alloc(struct adt_index_table *table, u32 count)
+{
+    u32 size = 16;
+
+    // Keep the load factor at or below 1/2
+    while (size < 2 * count)
+        size <<= 1;
+
+    table->ents = malloc(size * sizeof(*table->ents));
+    if (!table->ents)
+        return false;
+
+    memset(table->ents, 0xff, size * sizeof(*table->ents));
+    table->mask = size - 1;
+    return true;
+}
+
+static void adt_index_free(void)
+{
+    free(adt_index.props.ents);
+    free(adt_index.children.ents);
+    free(adt_index.siblings.ents);
+    free(adt_index.phandles.ents);
+    free(adt_index.regs);
+    memset(&adt_index, 0, sizeof(adt_index));
+}
+
+int adt_index_init(const void *adt)
+{
+    u32 nodes = 0, props = 0;
+
+    adt_index_free();
+    ADT_CHECK_HEADER(adt);
+
+    // First pass sizes the tables, the second fills them
+    int ret = adt_index_walk(adt, 0, &nodes, &props);
+    if (ret < 0)
+        return ret;
+
+    if (!adt_index_alloc(&adt_index.props, props) ||
+        !adt_index_alloc(&adt_index.children, 2 * nodes) ||
+        !adt_index_alloc(&adt_index.siblings, nodes) ||
+        !adt_index_alloc(&adt_index.phandles, nodes)) {
+        printf("ADT: out of memory for index\n");
+        adt_index_free();
+        return -1;
+    }
+
+    // Room for about one reg entry per node; lookups past that just aren't cached
+    u32 regs = 16;
+    while (regs < 2 * nodes)
+        regs <<= 1;
+    adt_index.regs = malloc(regs * sizeof(*adt_index.regs));
+    if (adt_index.regs) {
+        memset(adt_index.regs, 0xff, regs * sizeof(*adt_index.regs));
+        adt_index.regs_mask = regs - 1;
+    }
+
+    nodes = props = 0;
+    ret = adt_index_walk(adt, 0, &nodes, &props);
+    if (ret < 0) {
+        adt_index_free();
+        return ret;
+    }
+
+    adt_index.adt = adt;
+    printf("ADT: indexed %u nodes, %u properties\n", nodes, props);
+    return 0;
+}
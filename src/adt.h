@@ -75,6 +75,7 @@ int adt_path_offset(const void *adt, const char *path);
 int adt_path_offset_trace(const void *adt, const char *path, int *offsets);
 
 const char *adt_get_name(const void *adt, int nodeoffset);
+int adt_phandle_offset(const void *adt, u32 phandle);
 const struct adt_property *adt_get_property_namelen(const void *adt, int nodeoffset,
                                                     const char *name, size_t namelen);
 const struct adt_property *adt_get_property(const void *adt, int nodeoffset, const char *name);
@@ -91,6 +92,9 @@ int adt_getprop_copy(const void *adt, int nodeoffset, const char *name, void *ou
 #define ADT_GETPROP_ARRAY(adt, nodeoffset, name, arr)                                              \
     adt_getprop_copy(adt, nodeoffset, name, (arr), sizeof(arr))
 
+/* Build the lookup index for this ADT; later lookups on the same pointer use it */
+int adt_index_init(const void *adt);
+
 int adt_get_reg(const void *adt, int *path, const char *prop, int idx, u64 *addr, u64 *size);
 bool adt_is_compatible(const void *adt, int nodeoffset, const char *compat);
 
@@ -16,10 +16,17 @@ struct afk_rb_hdr {
     u32 _pad3[15];
 };
 
+/*
+ * For the RX ring, rptr is our private read position: entries are consumed from it and it is only
+ * published to the shared header by afk_epic_rx_commit(), so a batch of messages costs a single
+ * header write. For the TX ring, wptr is the end of the entry reserved by afk_epic_tx_reserve()
+ * until afk_epic_tx_commit() hands it to the IOP.
+ */
 struct afk_rb {
     bool ready;
     struct afk_rb_hdr *hdr;
     u32 rptr;
+    u32 wptr;
     void *buf;
     size_t bufsz;
 };
@@ -139,6 +146,8 @@ bool afk_rb_init(afk_epic_ep_t *epic, struct afk_rb *rb, u64 base, u64 size)
 
     rb->buf = rb->hdr + 1;
     rb->bufsz = rb->hdr->bufsz;
+    rb->rptr = rb->hdr->rptr;
+    rb->wptr = rb->hdr->wptr;
     rb->ready = true;
 
     return true;
@@ -231,14 +240,32 @@ static int afk_epic_poll(afk_epic_ep_t *epic)
     return 0;
 }
 
+/* Publish everything consumed with afk_epic_rx_ack() so far */
+static void afk_epic_rx_commit(afk_epic_ep_t *epic)
+{
+    struct afk_rb *rb = &epic->rx;
+
+    if (rb->hdr->rptr == rb->rptr)
+        return;
+
+    dma_mb();
+    rb->hdr->rptr = rb->rptr;
+}
+
+/*
+ * Returns a pointer to the next RX entry, straight out of the ring. It stays valid until the entry
+ * is acked and the ack is committed.
+ */
 static int afk_epic_rx(afk_epic_ep_t *epic, struct afk_qe **qe)
 {
     int ret;
     struct afk_rb *rb = &epic->rx;
 
-    u32 rptr = rb->hdr->rptr;
+    u32 rptr = rb->rptr;
 
     while (rptr == rb->hdr->wptr) {
+        // Give the IOP back the space we are done with before waiting for more
+        afk_epic_rx_commit(epic);
         do {
             ret = afk_epic_poll(epic);
             if (ret < 0)
@@ -261,7 +288,7 @@ static int afk_epic_rx(afk_epic_ep_t *epic, struct afk_qe **qe)
             printf("EPIC: bad queue entry magic!\n");
             return -1;
         }
-        rb->hdr->rptr = rptr;
+        rb->rptr = rptr;
     }
 
     *qe = hdr;
@@ -269,7 +296,11 @@ static int afk_epic_rx(afk_epic_ep_t *epic, struct afk_qe **qe)
     return 1;
 }
 
-static int afk_epic_tx(afk_epic_ep_t *epic, u32 channel, u32 type, void *data, size_t size)
+/*
+ * Reserves room for a size byte entry in the TX ring and returns a pointer to its payload, which
+ * the caller fills in place before calling afk_epic_tx_commit().
+ */
+static void *afk_epic_tx_reserve(afk_epic_ep_t *epic, u32 channel, u32 type, size_t size)
 {
     struct afk_rb *rb = &epic->tx;
 
@@ -279,7 +310,7 @@ static int afk_epic_tx(afk_epic_ep_t *epic, u32 channel, u32 type, void *data, s
 
     if (wptr < rptr && (wptr + sizeof(struct afk_qe) > rptr)) {
         printf("EPIC: TX ring buffer is full\n");
-        return -1;
+        return NULL;
     }
 
     hdr->magic = QE_MAGIC;
@@ -292,7 +323,7 @@ static int afk_epic_tx(afk_epic_ep_t *epic, u32 channel, u32 type, void *data, s
     if (size > rb->bufsz - wptr) {
         if (rptr < sizeof(struct afk_qe)) {
             printf("EPIC: TX ring buffer is full\n");
-            return -1;
+            return NULL;
         }
         *(struct afk_qe *)rb->buf = *hdr;
         hdr = rb->buf;
@@ -301,21 +332,26 @@ static int afk_epic_tx(afk_epic_ep_t *epic, u32 channel, u32 type, void *data, s
 
     if (wptr < rptr && (wptr + size > rptr)) {
         printf("EPIC: TX ring buffer is full\n");
-        return -1;
+        return NULL;
     }
 
     wptr += size;
-    wptr = ALIGN_UP(wptr, 1 << BLOCK_SHIFT);
+    rb->wptr = ALIGN_UP(wptr, 1 << BLOCK_SHIFT);
+
+    return hdr + 1;
+}
 
-    memcpy(hdr + 1, data, size);
+static int afk_epic_tx_commit(afk_epic_ep_t *epic)
+{
+    struct afk_rb *rb = &epic->tx;
 
     dma_mb();
-    rb->hdr->wptr = wptr;
+    rb->hdr->wptr = rb->wptr;
     dma_wmb();
 
     struct rtkit_message msg = {
         epic->ep,
-        FIELD_PREP(RBEP_TYPE, RBEP_SEND) | FIELD_PREP(SEND_WPTR, wptr),
+        FIELD_PREP(RBEP_TYPE, RBEP_SEND) | FIELD_PREP(SEND_WPTR, rb->wptr),
     };
 
     if (!rtkit_send(epic->rtk, &msg)) {
@@ -326,23 +362,32 @@ static int afk_epic_tx(afk_epic_ep_t *epic, u32 channel, u32 type, void *data, s
     return 1;
 }
 
+/* Consume the entry returned by afk_epic_rx(), the IOP only sees it on afk_epic_rx_commit() */
 static void afk_epic_rx_ack(afk_epic_ep_t *epic)
 {
     struct afk_rb *rb = &epic->rx;
-    u32 rptr = rb->hdr->rptr;
+    u32 rptr = rb->rptr;
     struct afk_qe *hdr = rb->buf + rptr;
 
     if (hdr->magic != QE_MAGIC) {
         printf("EPIC: bad queue entry magic!\n");
     }
 
-    dma_mb();
-
     rptr = ALIGN_UP(rptr + sizeof(*hdr) + hdr->size, 1 << BLOCK_SHIFT);
-    assert(rptr < rb->bufsz);
+    assert(rptr <= rb->bufsz);
     if (rptr == rb->bufsz)
         rptr = 0;
-    rb->hdr->rptr = rptr;
+    rb->rptr = rptr;
+}
+
+void *afk_epic_txbuf(afk_epic_ep_t *epic)
+{
+    return epic->txbuf.bfr;
+}
+
+void *afk_epic_rxbuf(afk_epic_ep_t *epic)
+{
+    return epic->rxbuf.bfr;
 }
 
 int afk_epic_command(afk_epic_ep_t *epic, int channel, u16 code, void *txbuf, size_t txsize,
@@ -352,28 +397,36 @@ int afk_epic_command(afk_epic_ep_t *epic, int channel, u16 code, void *txbuf, si
         struct epic_hdr hdr;
         struct epic_sub_hdr sub;
         struct epic_cmd cmd;
-    } PACKED msg;
+    } PACKED *msg;
 
     assert(txsize <= epic->txbuf.sz);
     assert(!rxsize || *rxsize <= epic->rxbuf.sz);
 
-    memset(&msg, 0, sizeof(msg));
-
-    msg.hdr.version = 2;
-    msg.hdr.seq = 0;
-    msg.sub.length = sizeof(msg.cmd);
-    msg.sub.version = 3;
-    msg.sub.category = CAT_COMMAND;
-    msg.sub.code = code;
-    msg.sub.seq = 0;
-    msg.cmd.txbuf = epic->txbuf.dva;
-    msg.cmd.txlen = txsize;
-    msg.cmd.rxbuf = epic->rxbuf.dva;
-    msg.cmd.rxlen = rxsize ? *rxsize : 0;
+    // Callers that built the request in afk_epic_txbuf() already put it where the IOP wants it
+    if (txbuf != epic->txbuf.bfr)
+        memcpy(epic->txbuf.bfr, txbuf, txsize);
 
-    memcpy(epic->txbuf.bfr, txbuf, txsize);
+    msg = afk_epic_tx_reserve(epic, channel, TYPE_COMMAND, sizeof(*msg));
+    if (!msg) {
+        printf("EPIC: failed to transmit command\n");
+        return -1;
+    }
 
-    int ret = afk_epic_tx(epic, channel, TYPE_COMMAND, &msg, sizeof msg);
+    memset(msg, 0, sizeof(*msg));
+
+    msg->hdr.version = 2;
+    msg->hdr.seq = 0;
+    msg->sub.length = sizeof(msg->cmd);
+    msg->sub.version = 3;
+    msg->sub.category = CAT_COMMAND;
+    msg->sub.code = code;
+    msg->sub.seq = 0;
+    msg->cmd.txbuf = epic->txbuf.dva;
+    msg->cmd.txlen = txsize;
+    msg->cmd.rxbuf = epic->rxbuf.dva;
+    msg->cmd.rxlen = rxsize ? *rxsize : 0;
+
+    int ret = afk_epic_tx_commit(epic);
     if (ret < 0) {
         printf("EPIC: failed to transmit command\n");
         return ret;
@@ -408,18 +461,21 @@ int afk_epic_command(afk_epic_ep_t *epic, int channel, u16 code, void *txbuf, si
     }
 
     if (rcmd->retcode != 0) {
-        printf("EPIC: IOP returned 0x%x\n", rcmd->retcode);
+        ret = rcmd->retcode; // should be negative already
+        printf("EPIC: IOP returned 0x%x\n", ret);
         afk_epic_rx_ack(epic);
-        return rcmd->retcode; // should be negative already
+        afk_epic_rx_commit(epic);
+        return ret;
     }
 
     assert(*rxsize >= rcmd->rxlen);
     *rxsize = rcmd->rxlen;
 
-    if (rxsize && *rxsize && rcmd->rxbuf)
+    if (rxsize && *rxsize && rcmd->rxbuf && rxbuf != epic->rxbuf.bfr)
         memcpy(rxbuf, epic->rxbuf.bfr, *rxsize);
 
     afk_epic_rx_ack(epic);
+    afk_epic_rx_commit(epic);
 
     return 0;
 }
@@ -524,6 +580,7 @@ int afk_epic_start_interface(afk_epic_ep_t *epic, char *name, size_t txsize, siz
 
     if (channel == -1) {
         printf("EPIC: too many unexpected messages, giving up\n");
+        afk_epic_rx_commit(epic);
         return -1;
     }
 
@@ -540,6 +597,7 @@ int afk_epic_start_interface(afk_epic_ep_t *epic, char *name, size_t txsize, siz
     printf("EPIC: started interface %d (%s)\n", msg->channel, announce->name);
 
     afk_epic_rx_ack(epic);
+    afk_epic_rx_commit(epic);
 
     return channel;
 }
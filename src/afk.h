@@ -11,6 +11,14 @@ afk_epic_ep_t *afk_epic_init(rtkit_dev_t *rtkit, int endpoint);
 int afk_epic_shutdown(afk_epic_ep_t *epic);
 
 int afk_epic_start_interface(afk_epic_ep_t *epic, char *name, size_t insize, size_t outsize);
+
+/*
+ * The shared command buffers of the started interface. Requests built directly in the TX buffer and
+ * replies read directly from the RX buffer skip afk_epic_command()'s copies.
+ */
+void *afk_epic_txbuf(afk_epic_ep_t *epic);
+void *afk_epic_rxbuf(afk_epic_ep_t *epic);
+
 int afk_epic_command(afk_epic_ep_t *epic, int channel, u16 code, void *txbuf, size_t txsize,
                      void *rxbuf, size_t *rxsize);
 
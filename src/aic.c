@@ -9,6 +9,9 @@
 #define MASK_REG(x) (4 * ((x) >> 5))
 #define MASK_BIT(x) BIT((x)&GENMASK(4, 0))
 
+#define AIC_MAX_HANDLERS 16
+#define AIC_MAX_DISPATCH 32
+
 static struct aic aic1 = {
     .version = 1,
     .nr_die = 1,
@@ -35,6 +38,13 @@ static struct aic aic2 = {
 
 struct aic *aic;
 
+static struct {
+    int irq;
+    aic_irq_handler_t handler;
+    void *priv;
+    bool disabled;
+} aic_handlers[AIC_MAX_HANDLERS];
+
 static int aic2_init(int node)
 {
     int ret = ADT_GETPROP(adt, node, "aic-iack-offset", &aic->regs.event);
@@ -151,3 +161,160 @@ uint32_t aic_ack(void)
 {
     return read32(aic->base + aic->regs.event);
 }
+
+void aic_set_mask(int irq, bool masked)
+{
+    u32 die = irq / aic->max_irq;
+    irq = irq % aic->max_irq;
+    if (masked)
+        write32(aic->base + aic->regs.mask_set + die * aic->die_stride + MASK_REG(irq),
+                MASK_BIT(irq));
+    else
+        write32(aic->base + aic->regs.mask_clr + die * aic->die_stride + MASK_REG(irq),
+                MASK_BIT(irq));
+}
+
+int aic_register_irq(int irq, aic_irq_handler_t handler, void *priv)
+{
+    if (!aic || irq < 0 || (u32)irq >= aic->max_irq * aic->nr_die)
+        return -1;
+
+    for (int i = 0; i < AIC_MAX_HANDLERS; i++) {
+        if (aic_handlers[i].handler)
+            continue;
+
+        aic_handlers[i].irq = irq;
+        aic_handlers[i].priv = priv;
+        aic_handlers[i].disabled = false;
+        aic_handlers[i].handler = handler;
+
+        /* AIC1 needs an explicit target, deliver to the boot CPU */
+        if (aic->version == 1)
+            write32(aic->base + aic->regs.tgt_cpu + 4 * irq, BIT(0));
+
+        aic_set_mask(irq, false);
+        return 0;
+    }
+
+    printf("AIC: no free handler slots for IRQ %d\n", irq);
+    return -1;
+}
+
+void aic_unregister_irq(int irq)
+{
+    if (!aic)
+        return;
+
+    for (int i = 0; i < AIC_MAX_HANDLERS; i++) {
+        if (!aic_handlers[i].handler || aic_handlers[i].irq != irq)
+            continue;
+
+        aic_set_mask(irq, true);
+        aic_handlers[i].handler = NULL;
+    }
+}
+
+static int aic_find_handler(int irq)
+{
+    for (int i = 0; i < AIC_MAX_HANDLERS; i++)
+        if (aic_handlers[i].handler && aic_handlers[i].irq == irq)
+            return i;
+
+    return -1;
+}
+
+/*
+ * Masks a registered IRQ until aic_enable_irq(), unlike aic_set_mask() this sticks across
+ * dispatch. Safe to call from the IRQ's own handler, e.g. to defer work to a poll loop.
+ */
+void aic_disable_irq(int irq)
+{
+    int i = aic ? aic_find_handler(irq) : -1;
+
+    if (i < 0)
+        return;
+
+    aic_handlers[i].disabled = true;
+    aic_set_mask(irq, true);
+}
+
+void aic_enable_irq(int irq)
+{
+    int i = aic ? aic_find_handler(irq) : -1;
+
+    if (i < 0)
+        return;
+
+    aic_handlers[i].disabled = false;
+    aic_set_mask(irq, false);
+}
+
+/*
+ * Routes an IRQ. On AIC1 target is a mask of CPU numbers, AIC2 only has the 4-bit IRQ_CFG target
+ * (a delivery group rather than a CPU) and picks the CPU in that group by itself.
+ */
+int aic_set_irq_target(int irq, uint32_t target)
+{
+    if (!aic || irq < 0 || (u32)irq >= aic->max_irq * aic->nr_die)
+        return -1;
+
+    if (aic->version == 1) {
+        if (!target)
+            return -1;
+        write32(aic->base + aic->regs.tgt_cpu + 4 * irq, target);
+    } else {
+        u32 die = irq / aic->max_irq;
+
+        if (target != FIELD_GET(AIC2_IRQ_CFG_TARGET, target))
+            return -1;
+        mask32(aic->base + aic->regs.config + die * aic->die_stride + 4 * (irq % aic->max_irq),
+               AIC2_IRQ_CFG_TARGET, FIELD_PREP(AIC2_IRQ_CFG_TARGET, target));
+    }
+
+    return 0;
+}
+
+/*
+ * Dispatch an acked event to a registered handler. Hardware IRQs are masked by the AIC when
+ * they are acked, so they get unmasked again once the handler has dealt with the source.
+ */
+bool aic_handle_irq(uint32_t event)
+{
+    if (FIELD_GET(AIC_EVENT_TYPE, event) != AIC_EVENT_TYPE_HW)
+        return false;
+
+    int irq = aic_irq_num(FIELD_GET(AIC_EVENT_DIE, event), FIELD_GET(AIC_EVENT_NUM, event));
+    int i = aic_find_handler(irq);
+
+    if (i < 0)
+        return false;
+
+    aic_handlers[i].handler(aic_handlers[i].priv);
+    if (!aic_handlers[i].disabled && aic_handlers[i].handler)
+        aic_set_mask(irq, false);
+
+    return true;
+}
+
+/*
+ * Acks and dispatches pending events until the AIC has none left for this CPU, so back-to-back
+ * IRQs don't each need their own exception. Returns the first event no handler claimed, or 0.
+ */
+uint32_t aic_dispatch(void)
+{
+    u32 unhandled = 0;
+
+    if (!aic)
+        return 0;
+
+    for (int n = 0; n < AIC_MAX_DISPATCH; n++) {
+        u32 event = aic_ack();
+
+        if (!event)
+            break;
+        if (!aic_handle_irq(event) && !unhandled)
+            unhandled = event;
+    }
+
+    return unhandled;
+}
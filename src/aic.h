@@ -33,8 +33,25 @@ struct aic {
 
 extern struct aic *aic;
 
+typedef void (*aic_irq_handler_t)(void *priv);
+
+/* Flat IRQ number as used by everything below, from an AIC2 die and per-die number */
+static inline int aic_irq_num(uint32_t die, uint32_t num)
+{
+    return die * aic->max_irq + num;
+}
+
 void aic_init(void);
 void aic_set_sw(int irq, bool active);
+void aic_set_mask(int irq, bool masked);
 uint32_t aic_ack(void);
 
+int aic_register_irq(int irq, aic_irq_handler_t handler, void *priv);
+void aic_unregister_irq(int irq);
+void aic_enable_irq(int irq);
+void aic_disable_irq(int irq);
+int aic_set_irq_target(int irq, uint32_t target);
+bool aic_handle_irq(uint32_t event);
+uint32_t aic_dispatch(void);
+
 #endif
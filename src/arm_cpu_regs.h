@@ -83,6 +83,8 @@
 #define ESR_ISS_DABORT_WnR   BIT(6)
 #define ESR_ISS_DABORT_DFSC  GENMASK(5, 0)
 
+#define HPFAR_FIPA GENMASK(43, 4)
+
 #define SAS_8B  0
 #define SAS_16B 1
 #define SAS_32B 2
@@ -29,7 +29,7 @@ struct asc_dev {
     int iop_node;
 };
 
-asc_dev_t *asc_init(const char *path)
+static asc_dev_t *asc_lookup(const char *path)
 {
     int asc_path[8];
     int node = adt_path_offset_trace(adt, path, asc_path);
@@ -52,10 +52,24 @@ asc_dev_t *asc_init(const char *path)
     asc->cpu_base = base;
     asc->base = base + 0x8000;
 
-    clear32(base + ASC_CPU_CONTROL, ASC_CPU_CONTROL_START);
     return asc;
 }
 
+asc_dev_t *asc_init(const char *path)
+{
+    asc_dev_t *asc = asc_lookup(path);
+
+    if (asc)
+        clear32(asc->cpu_base + ASC_CPU_CONTROL, ASC_CPU_CONTROL_START);
+    return asc;
+}
+
+/* Like asc_init(), but leaves the IOP running, for talking to one that is already up */
+asc_dev_t *asc_attach(const char *path)
+{
+    return asc_lookup(path);
+}
+
 void asc_free(asc_dev_t *asc)
 {
     free(asc);
@@ -13,6 +13,7 @@ struct asc_message {
 typedef struct asc_dev asc_dev_t;
 
 asc_dev_t *asc_init(const char *path);
+asc_dev_t *asc_attach(const char *path);
 void asc_free(asc_dev_t *asc);
 
 int asc_get_iop_node(asc_dev_t *asc);
@@ -0,0 +1,235 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Microbenchmarks for m1n1's core primitives. This is not linked into m1n1: `make bench` builds
+ * build/bench/bench.o, which proxyclient/tools/bench.py loads with LinkedProgram and runs through
+ * bench_run(). Every benchmark is run a few times and the fastest run is reported in CNTPCT
+ * ticks, the host turns that into the report.
+ */
+
+#include "../adt.h"
+#include "../dart.h"
+#include "../fb.h"
+#include "../hv.h"
+#include "../ringbuffer.h"
+#include "../uartproxy.h"
+#include "../utils.h"
+#include "string.h"
+
+#include "../minilzlib/minlzma.h"
+#include "../tinf/tinf.h"
+
+#define BENCH_RUNS 5
+
+#define BENCH_DART BIT(0) // set up the DART at dart_path and map at a free IOVA
+#define BENCH_HV   BIT(1) // the HV is initialized, map at hv_ipa
+#define BENCH_FB   BIT(2) // the framebuffer is up
+
+// Shared with proxyclient/tools/bench.py
+struct bench_args {
+    u64 flags;
+    u8 *work; // scratch buffer, at least 2 * work_size bytes
+    u64 work_size;
+    u8 *gz;
+    u64 gz_size;
+    u8 *xz;
+    u64 xz_size;
+    u64 raw_size; // decompressed size of gz and xz
+    const char *dart_path;
+    u64 dart_device;
+    u64 hv_ipa;
+};
+
+struct bench_result {
+    char name[32];
+    u64 bytes; // per run, 0 for operation counts
+    u64 ops;   // per run
+    u64 ticks; // fastest run
+};
+
+struct bench_state {
+    const struct bench_args *args;
+    dart_dev_t *dart;
+    u64 dart_iova;
+    struct bench_result *res;
+    u32 count;
+    u32 max;
+};
+
+typedef bool(bench_fn)(struct bench_state *st);
+
+static void bench_one(struct bench_state *st, const char *name, u64 bytes, u64 ops, bench_fn *fn)
+{
+    u64 best = ~0UL;
+
+    if (st->count >= st->max)
+        return;
+
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        u64 start = mrs(CNTPCT_EL0);
+        if (!fn(st)) {
+            printf("bench: %s failed\n", name);
+            return;
+        }
+        best = min(best, mrs(CNTPCT_EL0) - start);
+    }
+
+    struct bench_result *r = &st->res[st->count++];
+    memset(r, 0, sizeof(*r));
+    strncpy(r->name, name, sizeof(r->name) - 1);
+    r->bytes = bytes;
+    r->ops = ops;
+    r->ticks = best;
+}
+
+static bool bench_memcpy(struct bench_state *st)
+{
+    const struct bench_args *a = st->args;
+
+    memcpy(a->work + a->work_size, a->work, a->work_size);
+    return true;
+}
+
+static bool bench_memset(struct bench_state *st)
+{
+    const struct bench_args *a = st->args;
+
+    memset(a->work, 0x5a, a->work_size);
+    return true;
+}
+
+static bool bench_checksum(struct bench_state *st)
+{
+    const struct bench_args *a = st->args;
+
+    checksum_block(a->work, a->work_size, 0);
+    return true;
+}
+
+#define RING_SIZE  0x10000
+#define RING_CHUNK 4096
+
+static bool bench_ringbuffer(struct bench_state *st)
+{
+    const struct bench_args *a = st->args;
+
+    ringbuffer_t *rb = ringbuffer_alloc(RING_SIZE);
+    if (!rb)
+        return false;
+
+    for (u64 off = 0; off < a->work_size; off += RING_CHUNK) {
+        ringbuffer_write(a->work + off, RING_CHUNK, rb);
+        ringbuffer_read(a->work + a->work_size + off, RING_CHUNK, rb);
+    }
+
+    ringbuffer_free(rb);
+    return true;
+}
+
+static bool bench_gunzip(struct bench_state *st)
+{
+    const struct bench_args *a = st->args;
+
+    unsigned int dest_len = a->work_size, source_len = a->gz_size;
+
+    return tinf_gzip_uncompress(a->work, &dest_len, a->gz, &source_len) == TINF_OK &&
+           dest_len == a->raw_size;
+}
+
+static bool bench_unxz(struct bench_state *st)
+{
+    const struct bench_args *a = st->args;
+
+    uint32_t dest_len = a->work_size, source_len = a->xz_size;
+
+    return XzDecode(a->xz, &source_len, a->work, &dest_len) && dest_len == a->raw_size;
+}
+
+#define ADT_LOOKUPS 1000
+
+static bool bench_adt(struct bench_state *st)
+{
+    UNUSED(st);
+
+    for (int i = 0; i < ADT_LOOKUPS; i++)
+        if (adt_path_offset(adt, "/arm-io/uart0") < 0)
+            return false;
+    return true;
+}
+
+static bool bench_dart_map(struct bench_state *st)
+{
+    const struct bench_args *a = st->args;
+
+    if (dart_map(st->dart, st->dart_iova, a->work, a->work_size) < 0)
+        return false;
+    dart_unmap(st->dart, st->dart_iova, a->work_size);
+    return true;
+}
+
+/*
+ * Uses the page tables the DART already has, so the device keeps working. It is not shut down
+ * again for the same reason.
+ */
+static bool bench_dart_setup(struct bench_state *st)
+{
+    const struct bench_args *a = st->args;
+
+    st->dart = dart_init_adt(a->dart_path, 0, a->dart_device, true);
+    if (!st->dart)
+        return false;
+
+    st->dart_iova = dart_find_iova(st->dart, SZ_16K, a->work_size);
+    return (s64)st->dart_iova >= 0;
+}
+
+static bool bench_hv_map(struct bench_state *st)
+{
+    const struct bench_args *a = st->args;
+
+    // Map the scratch buffer at hv_ipa, then unmap it again
+    return hv_map_hw(a->hv_ipa, (u64)a->work, a->work_size) >= 0 &&
+           hv_map(a->hv_ipa, 0, a->work_size, 0) >= 0;
+}
+
+#define BLIT_W 512
+#define BLIT_H 512
+
+static bool bench_fb_blit(struct bench_state *st)
+{
+    const struct bench_args *a = st->args;
+
+    fb_blit(0, 0, BLIT_W, BLIT_H, a->work, BLIT_W, PIX_FMT_XRGB);
+    return true;
+}
+
+int bench_run(const struct bench_args *args, struct bench_result *res, u32 max)
+{
+    struct bench_state st = {
+        .args = args,
+        .res = res,
+        .max = max,
+    };
+    u64 size = args->work_size;
+
+    bench_one(&st, "memcpy", size, 1, bench_memcpy);
+    bench_one(&st, "memset", size, 1, bench_memset);
+    bench_one(&st, "checksum_block", size, 1, bench_checksum);
+    bench_one(&st, "ringbuffer", size, size / RING_CHUNK, bench_ringbuffer);
+
+    if (args->gz && args->raw_size <= size)
+        bench_one(&st, "tinf_gzip", args->raw_size, 1, bench_gunzip);
+    if (args->xz && args->raw_size <= size)
+        bench_one(&st, "minilzlib_xz", args->raw_size, 1, bench_unxz);
+
+    bench_one(&st, "adt_path_offset", 0, ADT_LOOKUPS, bench_adt);
+
+    if ((args->flags & BENCH_DART) && bench_dart_setup(&st))
+        bench_one(&st, "dart_map", size, 1, bench_dart_map);
+    if (args->flags & BENCH_HV)
+        bench_one(&st, "hv_map", size, 1, bench_hv_map);
+    if ((args->flags & BENCH_FB) && size >= BLIT_W * BLIT_H * 4)
+        bench_one(&st, "fb_blit", BLIT_W * BLIT_H * 4, 1, bench_fb_blit);
+
+    return st.count;
+}
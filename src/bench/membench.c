@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Memory bandwidth and latency tests. Like bench.c this is not linked into m1n1: `make bench`
+ * builds build/bench/membench.o, which proxyclient/tools/membench.py loads with LinkedProgram.
+ *
+ * membench_run() runs one test on the calling CPU. For all-core runs the host starts it on the
+ * secondaries with smp_call_many() and then on the boot CPU; every participant takes a slot
+ * and a slice of the buffer, and they all wait at a barrier so that the timed part overlaps.
+ * Secondaries need their MMU enabled (mmu_init_secondary()), otherwise they would be timing
+ * Device memory.
+ */
+
+#include "../memory.h"
+#include "../smp.h"
+#include "../utils.h"
+#include "string.h"
+
+// Shared with proxyclient/tools/membench.py
+#define MEMBENCH_READ  0
+#define MEMBENCH_WRITE 1
+#define MEMBENCH_COPY  2 // the slice is 2 * size, copied from the first half to the second
+#define MEMBENCH_CHASE 3 // follow the pointers set up by membench_chase_init()
+
+#define MEMBENCH_NC BIT(0) // go through the Normal-NC alias
+
+struct membench_args {
+    u64 op;
+    u64 flags;
+    u8 *buf;
+    u64 size;   // bytes per slot
+    u64 stride; // distance between accesses (READ, WRITE) or chase nodes
+    u64 iters;  // passes over the slice, or loads for CHASE
+    u64 slots;  // participants to wait for at the barrier
+    u64 arrived;
+    u64 sink;
+    u64 ticks[MAX_CPUS]; // per slot, written back
+};
+
+static u64 membench_slice_size(struct membench_args *a)
+{
+    return a->op == MEMBENCH_COPY ? 2 * a->size : a->size;
+}
+
+static u8 *membench_slice(struct membench_args *a, u64 slot)
+{
+    u8 *p = a->buf + slot * membench_slice_size(a);
+
+    if (a->flags & MEMBENCH_NC)
+        return mmu_nc_alias(p, membench_slice_size(a));
+
+    return p;
+}
+
+static u64 membench_read(struct membench_args *a, const u8 *p)
+{
+    u64 sum = 0;
+
+    for (u64 it = 0; it < a->iters; it++)
+        for (u64 off = 0; off < a->size; off += a->stride)
+            sum += *(const volatile u64 *)(p + off);
+
+    return sum;
+}
+
+static void membench_write(struct membench_args *a, u8 *p)
+{
+    for (u64 it = 0; it < a->iters; it++)
+        for (u64 off = 0; off < a->size; off += a->stride)
+            *(volatile u64 *)(p + off) = it;
+}
+
+static void membench_copy(struct membench_args *a, u8 *p)
+{
+    for (u64 it = 0; it < a->iters; it++)
+        memcpy(p + a->size, p, a->size);
+}
+
+static u64 membench_chase(struct membench_args *a, u8 *p)
+{
+    u64 *node = (u64 *)p;
+
+    for (u64 it = 0; it < a->iters; it++)
+        node = *(u64 *volatile *)node;
+
+    return (u64)node;
+}
+
+static u64 membench_rand(u64 *state)
+{
+    u64 x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * Link the nodes of every slot's slice into one random cycle (Sattolo's shuffle), so that each
+ * load depends on the previous one and the prefetchers have nothing to go on. The pointers are
+ * for the alias that will be chased, the slices are cleaned so the NC alias sees them.
+ */
+int membench_chase_init(struct membench_args *a)
+{
+    u64 nodes = a->size / a->stride;
+    u64 seed = 0x6d316e31;
+
+    if (a->stride < sizeof(u64) || a->stride & 7 || nodes < 2)
+        return -1;
+
+    for (u64 slot = 0; slot < a->slots; slot++) {
+        u8 *p = a->buf + slot * a->size;
+        u8 *alias = membench_slice(a, slot);
+
+        if (!alias)
+            return -1;
+
+        for (u64 i = 0; i < nodes; i++)
+            *(u64 *)(p + i * a->stride) = i;
+
+        for (u64 i = nodes - 1; i > 0; i--) {
+            u64 j = membench_rand(&seed) % i;
+            u64 *ni = (u64 *)(p + i * a->stride);
+            u64 *nj = (u64 *)(p + j * a->stride);
+            u64 t = *ni;
+
+            *ni = *nj;
+            *nj = t;
+        }
+
+        for (u64 i = 0; i < nodes; i++) {
+            u64 *n = (u64 *)(p + i * a->stride);
+            *n = (u64)(alias + *n * a->stride);
+        }
+
+        dc_civac_range(p, a->size);
+    }
+
+    return 0;
+}
+
+u64 membench_run(struct membench_args *a)
+{
+    u64 slot = __atomic_fetch_add(&a->arrived, 1, __ATOMIC_ACQ_REL);
+
+    if (slot >= a->slots || slot >= MAX_CPUS)
+        return 0;
+
+    u8 *p = membench_slice(a, slot);
+
+    // The host lowers slots if some CPUs could not be started
+    while (__atomic_load_n(&a->arrived, __ATOMIC_ACQUIRE) <
+           __atomic_load_n(&a->slots, __ATOMIC_ACQUIRE))
+        ;
+
+    if (!p) {
+        a->ticks[slot] = 0;
+        return 0;
+    }
+
+    u64 start = mrs(CNTPCT_EL0);
+    switch (a->op) {
+        case MEMBENCH_READ:
+            a->sink += membench_read(a, p);
+            break;
+        case MEMBENCH_WRITE:
+            membench_write(a, p);
+            break;
+        case MEMBENCH_COPY:
+            membench_copy(a, p);
+            break;
+        case MEMBENCH_CHASE:
+            a->sink += membench_chase(a, p);
+            break;
+    }
+    sysop("dsb sy");
+    u64 ticks = mrs(CNTPCT_EL0) - start;
+
+    a->ticks[slot] = ticks;
+    return ticks;
+}
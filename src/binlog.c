@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "binlog.h"
+#include "smp.h"
+#include "string.h"
+#include "utils.h"
+
+#define BINLOG_ENTRIES 1024
+
+/*
+ * Flight recorder: writers claim a slot with a single atomic increment and overwrite whatever was
+ * there, publishing it by storing its sequence number last. Readers only trust entries whose
+ * sequence number matches the slot they expect, before and after copying them.
+ */
+static struct binlog_entry binlog_ring[BINLOG_ENTRIES];
+static u64 binlog_head;
+static u64 binlog_tail;
+
+void binlog_write(const char *fmt, u32 nargs, const u64 *args)
+{
+    u64 idx = __atomic_fetch_add(&binlog_head, 1, __ATOMIC_RELAXED);
+    struct binlog_entry *e = &binlog_ring[idx % BINLOG_ENTRIES];
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    e->timestamp = mrs(CNTPCT_EL0);
+    e->fmt = fmt;
+    e->cpu = smp_id();
+    e->nargs = min(nargs, (u32)BINLOG_MAX_ARGS);
+    for (u32 i = 0; i < e->nargs; i++)
+        e->args[i] = args[i];
+
+    __atomic_store_n(&e->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+static bool binlog_get(u64 idx, struct binlog_entry *out)
+{
+    struct binlog_entry *e = &binlog_ring[idx % BINLOG_ENTRIES];
+
+    if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != idx + 1)
+        return false;
+
+    memcpy(out, e, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == idx + 1;
+}
+
+/*
+ * Copy out up to size bytes of entries, oldest first, skipping any still being written or
+ * already overwritten. Returns the number of entries. If reset is set, they are consumed.
+ */
+int binlog_read(struct binlog_entry *out, size_t size, bool reset)
+{
+    u64 head = __atomic_load_n(&binlog_head, __ATOMIC_ACQUIRE);
+    u64 idx = max(binlog_tail, head > BINLOG_ENTRIES ? head - BINLOG_ENTRIES : 0);
+    size_t count = 0;
+
+    for (; idx < head && count < size / sizeof(*out); idx++)
+        if (binlog_get(idx, &out[count]))
+            count++;
+
+    if (reset)
+        binlog_tail = idx;
+
+    return count;
+}
+
+void binlog_dump(bool reset)
+{
+    u64 head = __atomic_load_n(&binlog_head, __ATOMIC_ACQUIRE);
+    u64 idx = max(binlog_tail, head > BINLOG_ENTRIES ? head - BINLOG_ENTRIES : 0);
+    struct binlog_entry e;
+    char buf[256];
+
+    if (idx > binlog_tail)
+        printf("binlog: %ld entries lost\n", idx - binlog_tail);
+
+    for (; idx < head; idx++) {
+        if (!binlog_get(idx, &e))
+            continue;
+
+        u64 a[BINLOG_MAX_ARGS] = {0};
+        memcpy(a, e.args, e.nargs * sizeof(u64));
+
+        // Every vararg slot is 64 bits wide, so narrower conversions just see the low bits
+        int len = snprintf(buf, sizeof(buf), e.fmt, a[0], a[1], a[2], a[3], a[4], a[5]);
+        u64 us = ticks_to_usecs(e.timestamp);
+
+        printf("[%ld.%06ld] cpu%d: %s", us / 1000000, us % 1000000, e.cpu, buf);
+        if (len <= 0 || buf[min(len, (int)sizeof(buf) - 1) - 1] != '\n')
+            printf("\n");
+    }
+
+    if (reset)
+        binlog_tail = idx;
+}
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include "types.h"
+
+#define BINLOG_MAX_ARGS 6
+
+/*
+ * One deferred log record. Only the format pointer and the raw argument words are stored, so
+ * %s arguments must point to strings that are still around when the log is read (literals,
+ * static tables), and floating point conversions are not supported.
+ */
+struct binlog_entry {
+    u64 seq; // index + 1 once the entry is complete
+    u64 timestamp;
+    const char *fmt;
+    u32 cpu;
+    u32 nargs;
+    u64 args[BINLOG_MAX_ARGS];
+};
+
+void binlog_write(const char *fmt, u32 nargs, const u64 *args);
+int binlog_read(struct binlog_entry *out, size_t size, bool reset);
+void binlog_dump(bool reset);
+
+#define _BINLOG_NARGS(_0, _1, _2, _3, _4, _5, _6, n, ...) n
+
+#define BINLOG_NARGS(...) _BINLOG_NARGS(0, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+
+#define _BINLOG_ARGS0()
+#define _BINLOG_ARGS1(a)      (u64)(a)
+#define _BINLOG_ARGS2(a, ...) (u64)(a), _BINLOG_ARGS1(__VA_ARGS__)
+#define _BINLOG_ARGS3(a, ...) (u64)(a), _BINLOG_ARGS2(__VA_ARGS__)
+#define _BINLOG_ARGS4(a, ...) (u64)(a), _BINLOG_ARGS3(__VA_ARGS__)
+#define _BINLOG_ARGS5(a, ...) (u64)(a), _BINLOG_ARGS4(__VA_ARGS__)
+#define _BINLOG_ARGS6(a, ...) (u64)(a), _BINLOG_ARGS5(__VA_ARGS__)
+
+#define _BINLOG_ARGS_N(n, ...) _BINLOG_ARGS##n(__VA_ARGS__)
+#define _BINLOG_ARGS(n, ...)   _BINLOG_ARGS_N(n, ##__VA_ARGS__)
+
+/*
+ * printf-style logging that costs a handful of stores: formatting happens when the log is read,
+ * either by binlog_dump() or on the host (m1n1.binlog).
+ */
+#define binlog(fmt, ...)                                                                           \
+    do {                                                                                           \
+        u64 _binlog_args[BINLOG_NARGS(__VA_ARGS__) + 1] = {                                        \
+            _BINLOG_ARGS(BINLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)};                               \
+        binlog_write(fmt, BINLOG_NARGS(__VA_ARGS__), _binlog_args);                                \
+    } while (0)
+
+#endif
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "bootprof.h"
+#include "string.h"
+#include "utils.h"
+
+#include "libfdt/libfdt.h"
+
+/*
+ * The profile is exported to the kernel in /chosen, as raw CNTPCT values in enum order in
+ * m1n1,boot-profile with the stage names in m1n1,boot-profile-stages. Only the boot CPU marks
+ * stages, so the table needs no locking.
+ */
+static const char *const bootprof_names[BOOTPROF_COUNT] = {
+    [BOOTPROF_START] = "start",
+    [BOOTPROF_MAIN] = "main",
+    [BOOTPROF_MMU] = "mmu",
+    [BOOTPROF_COPROC] = "coproc",
+    [BOOTPROF_DISPLAY] = "display",
+    [BOOTPROF_INIT] = "init",
+    [BOOTPROF_PAYLOAD_LOAD] = "payload-load",
+    [BOOTPROF_PAYLOAD_PLACE] = "payload-place",
+    [BOOTPROF_SMP] = "smp",
+    [BOOTPROF_DT_OPEN] = "dt-open",
+    [BOOTPROF_DT_CHOSEN] = "dt-chosen",
+    [BOOTPROF_DT_SERIAL] = "dt-serial",
+    [BOOTPROF_DT_MEMORY] = "dt-memory",
+    [BOOTPROF_DT_CPUS] = "dt-cpus",
+    [BOOTPROF_DT_MAC] = "dt-mac",
+    [BOOTPROF_DT_WIFI] = "dt-wifi",
+    [BOOTPROF_DT_BLUETOOTH] = "dt-bluetooth",
+    [BOOTPROF_DT_UBOOT] = "dt-uboot",
+    [BOOTPROF_DT_ATC] = "dt-atc",
+    [BOOTPROF_DT_DISPLAY] = "dt-display",
+    [BOOTPROF_DT_GPU] = "dt-gpu",
+    [BOOTPROF_DT_DISABLE] = "dt-disable",
+    [BOOTPROF_DT_PACK] = "dt-pack",
+    [BOOTPROF_USB] = "usb",
+    [BOOTPROF_PCIE] = "pcie",
+    [BOOTPROF_KBOOT] = "kboot",
+};
+
+static u64 bootprof[BOOTPROF_COUNT];
+
+void bootprof_mark(enum bootprof_stage stage)
+{
+    bootprof[stage] = get_ticks();
+}
+
+void bootprof_print(void)
+{
+    u64 prev = bootprof[BOOTPROF_START];
+
+    printf("Boot profile (us since start):\n");
+    for (int i = 0; i < BOOTPROF_COUNT; i++) {
+        if (!bootprof[i])
+            continue;
+
+        printf("  %-14s %8lu (+%lu)\n", bootprof_names[i],
+               ticks_to_usecs(bootprof[i] - bootprof[BOOTPROF_START]),
+               ticks_to_usecs(bootprof[i] - prev));
+        prev = bootprof[i];
+    }
+}
+
+/*
+ * Add the profile to /chosen. With update set, refresh the values of a profile added before, in
+ * place, so the stages after the FDT was finished still make it to the kernel.
+ */
+int bootprof_set_fdt(void *dt, bool update)
+{
+    fdt64_t values[BOOTPROF_COUNT];
+
+    int node = fdt_path_offset(dt, "/chosen");
+    if (node < 0)
+        return node;
+
+    for (int i = 0; i < BOOTPROF_COUNT; i++)
+        values[i] = cpu_to_fdt64(bootprof[i]);
+
+    if (update)
+        return fdt_setprop_inplace(dt, node, "m1n1,boot-profile", values, sizeof(values));
+
+    int ret = fdt_setprop(dt, node, "m1n1,boot-profile", values, sizeof(values));
+    if (ret)
+        return ret;
+
+    char names[BOOTPROF_COUNT * 16];
+    size_t len = 0;
+
+    for (int i = 0; i < BOOTPROF_COUNT; i++) {
+        size_t n = strlen(bootprof_names[i]) + 1;
+
+        if (len + n > sizeof(names))
+            break;
+
+        memcpy(names + len, bootprof_names[i], n);
+        len += n;
+    }
+
+    return fdt_setprop(dt, node, "m1n1,boot-profile-stages", names, len);
+}
+
+/* Copy out up to size bytes of the raw CNTPCT table. Returns the number of entries. */
+int bootprof_get(u64 *out, size_t size)
+{
+    int count = min(size / sizeof(*out), (size_t)BOOTPROF_COUNT);
+
+    memcpy(out, bootprof, count * sizeof(*out));
+
+    return count;
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef BOOTPROF_H
+#define BOOTPROF_H
+
+#include "types.h"
+
+// Each stage records CNTPCT when it completes, 0 if it hasn't (yet)
+enum bootprof_stage {
+    BOOTPROF_START,         // _start_c, right after clearing BSS
+    BOOTPROF_MAIN,          // boot CPU init done, entering m1n1_main
+    BOOTPROF_MMU,           // mmu_init
+    BOOTPROF_COPROC,        // early coprocessor boot
+    BOOTPROF_DISPLAY,       // display_init
+    BOOTPROF_INIT,          // initialization complete
+    BOOTPROF_PAYLOAD_LOAD,  // payloads loaded and checked
+    BOOTPROF_PAYLOAD_PLACE, // kernel and FDT placed
+    BOOTPROF_SMP,           // secondaries started
+    BOOTPROF_DT_OPEN,       // FDT opened into its buffer
+    BOOTPROF_DT_CHOSEN,
+    BOOTPROF_DT_SERIAL,
+    BOOTPROF_DT_MEMORY,
+    BOOTPROF_DT_CPUS,
+    BOOTPROF_DT_MAC,
+    BOOTPROF_DT_WIFI,
+    BOOTPROF_DT_BLUETOOTH,
+    BOOTPROF_DT_UBOOT,
+    BOOTPROF_DT_ATC,
+    BOOTPROF_DT_DISPLAY,
+    BOOTPROF_DT_GPU,
+    BOOTPROF_DT_DISABLE,
+    BOOTPROF_DT_PACK, // FDT ready
+    BOOTPROF_USB,     // usb_init at kernel handoff
+    BOOTPROF_PCIE,    // pcie_init at kernel handoff
+    BOOTPROF_KBOOT,   // ready to jump to the kernel
+    BOOTPROF_COUNT,
+};
+
+void bootprof_mark(enum bootprof_stage stage);
+void bootprof_print(void);
+int bootprof_set_fdt(void *dt, bool update);
+
+int bootprof_get(u64 *out, size_t size);
+
+#endif
@@ -4,27 +4,228 @@
 
 #include "chainload.h"
 #include "adt.h"
+#include "heapblock.h"
 #include "malloc.h"
 #include "memory.h"
 #include "nvme.h"
+#include "smp.h"
 #include "string.h"
+#include "tinf/tinf.h"
 #include "types.h"
 #include "utils.h"
 #include "xnuboot.h"
 
+/* Filled in by the Rust loader from the FAT directory entry, cached is set by the place callback */
+struct chainload_image_info {
+    u64 size;
+    u64 mtime;
+    int cached;
+};
+
 #ifdef CHAINLOADING
-int rust_load_image(const char *spec, void **image, size_t *size);
+int rust_load_image(const char *spec, void *(*place)(struct chainload_image_info *info, void *arg),
+                    void *arg, void **image, size_t *size);
 #endif
 
 extern u8 _chainload_stub_start[];
 extern u8 _chainload_stub_end[];
 
-int chainload_image(void *image, size_t size, char **vars, size_t var_cnt)
+extern char _start[];
+extern char _data_start[];
+extern char _file_end[];
+
+#define WARMBOOT_MAGIC 0x544f4f424d524157 // "WARMBOOT"
+#define CLCACHE_MAGIC  0x45484341434c4443 // "CDLCACHE"
+
+#define CLCACHE_SPEC_MAX 256
+
+/*
+ * Pristine state for chainload_restart(), kept right above the top_of_kernel_data iBoot gave us: a
+ * header page, m1n1's initialized data as it was right after relocation (relocating again at the
+ * same base rewrites the same values, so this is as good as the image on disk), then the ADT. The
+ * boot args saved here start the heap past the region, and a marker at its very end lets the
+ * restarted m1n1 find it again instead of taking a new copy.
+ */
+struct warmboot_hdr {
+    u64 magic;
+    u64 end;
+    u64 data_size;
+    u64 adt_size;
+    u64 restarts;
+    u64 cache;
+    struct boot_args boot_args;
+};
+
+struct warmboot_tail {
+    u64 magic;
+    u64 base;
+};
+
+/*
+ * Optional copy of the last chainloaded image, handed to the next stage as part of its staged image
+ * and covered by its top_of_kernel_data so it survives. A tail at the very end lets the next m1n1
+ * find it, and it is only used if the spec, the file's size and mtime and the checksum still match,
+ * in which case the file is not read from storage at all.
+ */
+struct clcache_hdr {
+    u64 magic;
+    u64 end;
+    char spec[CLCACHE_SPEC_MAX];
+    u64 size;
+    u64 mtime;
+    u32 crc;
+    u32 reserved;
+};
+
+static struct warmboot_hdr *warmboot;
+static struct clcache_hdr *clcache;
+static bool clcache_enabled = false;
+
+static struct clcache_hdr *chainload_find_cache(u64 top)
+{
+    struct warmboot_tail *tail = (void *)(top - sizeof(*tail));
+    struct clcache_hdr *hdr = (void *)tail->base;
+
+    if (tail->magic != CLCACHE_MAGIC || tail->base >= top || hdr->magic != CLCACHE_MAGIC ||
+        hdr->end != top || hdr->size > top - tail->base)
+        return NULL;
+
+    return hdr;
+}
+
+/* Called from _start_c before anything touches .data, the UART is not even up yet */
+void chainload_snapshot(void)
+{
+    u64 top = cur_boot_args.top_of_kernel_data;
+    struct warmboot_tail *tail = (void *)(top - sizeof(*tail));
+    struct warmboot_hdr *hdr = (void *)tail->base;
+
+    if (tail->magic == WARMBOOT_MAGIC && tail->base < top && hdr->magic == WARMBOOT_MAGIC &&
+        hdr->end == top) {
+        hdr->restarts++;
+        warmboot = hdr;
+        clcache = (void *)hdr->cache;
+        return;
+    }
+
+    clcache = chainload_find_cache(top);
+
+    u64 base = ALIGN_UP(top, SZ_16K);
+    size_t data_size = _file_end - _data_start;
+    size_t adt_size = cur_boot_args.devtree_size;
+    u64 end = ALIGN_UP(base + SZ_16K + data_size + adt_size + sizeof(*tail), SZ_16K);
+
+    hdr = (void *)base;
+    hdr->magic = WARMBOOT_MAGIC;
+    hdr->end = end;
+    hdr->data_size = data_size;
+    hdr->adt_size = adt_size;
+    hdr->restarts = 0;
+    hdr->cache = (u64)clcache;
+    hdr->boot_args = cur_boot_args;
+    hdr->boot_args.top_of_kernel_data = end;
+
+    memcpy((void *)base + SZ_16K, _data_start, data_size);
+    memcpy((void *)base + SZ_16K + data_size, adt, adt_size);
+
+    tail = (void *)(end - sizeof(*tail));
+    tail->magic = WARMBOOT_MAGIC;
+    tail->base = base;
+
+    cur_boot_args.top_of_kernel_data = end;
+    warmboot = hdr;
+}
+
+/*
+ * Sets up the next stage to start this m1n1 over from the snapshot, without going through iBoot.
+ * Devices get quiesced by the usual next stage path; the boot args and ADT are put back here, and
+ * the chainload stub copies the pristine .data back in place before jumping to _start.
+ */
+int chainload_restart(void)
+{
+    if (!warmboot) {
+        printf("chainload: no pristine copy of m1n1 to restart from\n");
+        return -1;
+    }
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (i != smp_id() && smp_is_alive(i)) {
+            printf("chainload: secondary CPUs are running, can't restart in place\n");
+            return -1;
+        }
+    }
+
+    printf("chainload: restarting m1n1 in place (restart #%ld)\n", warmboot->restarts + 1);
+
+    memcpy((void *)boot_args_addr, &warmboot->boot_args, sizeof(warmboot->boot_args));
+    memcpy(adt, (void *)warmboot + SZ_16K + warmboot->data_size, warmboot->adt_size);
+
+    // The stub runs from .text, which is left as is
+    next_stage.entry = (generic_func *)_chainload_stub_start;
+    next_stage.args[0] = boot_args_addr;
+    next_stage.args[1] = (u64)warmboot + SZ_16K;
+    next_stage.args[2] = (u64)_data_start;
+    next_stage.args[3] = warmboot->data_size;
+    next_stage.args[4] = (u64)_start;
+    next_stage.restore_logo = false;
+
+    return 0;
+}
+
+/*
+ * Layout of the next m1n1, as offsets from _base: the image, the vars and a terminator, SEPFW, then
+ * the boot args. It is put together in a staging buffer that the stub moves to _base in one go, so
+ * the image can be read straight to offset 0 of it. SEPFW is left out of the move if it already
+ * sits somewhere that survives it.
+ */
+static struct {
+    void *staging;
+    size_t size;
+    size_t image_size;
+    size_t vars_off;
+    size_t sepfw_off; // 0 if SEPFW stays in place
+    size_t bootargs_off;
+    size_t cache_off; // 0 if no cache is passed on
+    size_t cache_size;
+    const char *spec;
+    u64 mtime;
+    u64 sepfw[2];
+    u64 top;
+    int anode;
+} layout;
+
+static bool chainload_sepfw_in_place(u64 moved_size)
+{
+    u64 base = (u64)_base;
+    u64 start = layout.sepfw[0];
+    u64 end = start + layout.sepfw[1];
+
+    if (end > cur_boot_args.top_of_kernel_data)
+        return false;
+
+    // The cache tail has to stay at the very top, so SEPFW can't be left above the image then
+    if (layout.cache_size)
+        return end <= base;
+
+    // It is still covered by our kernel data and is not written by the move
+    return end <= base || start >= base + moved_size;
+}
+
+static int chainload_plan(size_t size, char **vars, size_t var_cnt, const char *spec, u64 mtime)
 {
     u64 new_base = (u64)_base;
-    size_t image_size = size;
 
-    printf("chainload: Preparing image...\n");
+    memset(&layout, 0, sizeof(layout));
+    layout.size = size;
+    layout.vars_off = size;
+
+    if (spec && clcache_enabled && strlen(spec) < CLCACHE_SPEC_MAX) {
+        layout.spec = spec;
+        layout.mtime = mtime;
+        layout.cache_size = SZ_16K + ALIGN_UP(size + sizeof(struct warmboot_tail), SZ_16K);
+    }
+
+    size_t image_size = size;
 
     // m1n1 variables
     for (size_t i = 0; i < var_cnt; i++)
@@ -34,39 +235,91 @@ int chainload_image(void *image, size_t size, char **vars, size_t var_cnt)
     image_size += 4;
     image_size = ALIGN_UP(image_size, SZ_16K);
 
-    // SEPFW
-    size_t sepfw_off = image_size;
-
-    int anode = adt_path_offset(adt, "/chosen/memory-map");
-    if (anode < 0) {
+    layout.anode = adt_path_offset(adt, "/chosen/memory-map");
+    if (layout.anode < 0) {
         printf("chainload: /chosen/memory-map not found\n");
         return -1;
     }
-    u64 sepfw[2];
-    if (ADT_GETPROP_ARRAY(adt, anode, "SEPFW", sepfw) < 0) {
+    if (ADT_GETPROP_ARRAY(adt, layout.anode, "SEPFW", layout.sepfw) < 0) {
         printf("chainload: Failed to find SEPFW\n");
         return -1;
     }
 
-    image_size += sepfw[1];
-    image_size = ALIGN_UP(image_size, SZ_16K);
+    const size_t bootargs_size = SZ_16K;
+
+    if (chainload_sepfw_in_place(image_size + bootargs_size + layout.cache_size)) {
+        printf("chainload: Leaving SEPFW in place at 0x%lx\n", layout.sepfw[0]);
+    } else {
+        layout.sepfw_off = image_size;
+        image_size += layout.sepfw[1];
+        image_size = ALIGN_UP(image_size, SZ_16K);
+    }
 
     // Bootargs
-    size_t bootargs_off = image_size;
-    const size_t bootargs_size = SZ_16K;
+    layout.bootargs_off = image_size;
     image_size += bootargs_size;
 
+    // Cache, right at the top so the next stage can find it
+    if (layout.cache_size) {
+        layout.cache_off = image_size;
+        image_size += layout.cache_size;
+    }
+
+    layout.image_size = image_size;
+
+    layout.top = new_base + image_size;
+    if (!layout.sepfw_off)
+        layout.top = max(layout.top, ALIGN_UP(layout.sepfw[0] + layout.sepfw[1], SZ_16K));
+
     printf("chainload: Total image size: 0x%lx\n", image_size);
 
     size_t stub_size = _chainload_stub_end - _chainload_stub_start;
 
-    void *new_image = malloc(image_size + stub_size);
+    layout.staging = memalign(SZ_16K, image_size + stub_size);
+    if (!layout.staging) {
+        printf("chainload: Failed to allocate 0x%lx bytes\n", image_size + stub_size);
+        return -1;
+    }
+
+    return 0;
+}
+
+int chainload_image(void *image, size_t size, char **vars, size_t var_cnt)
+{
+    u64 new_base = (u64)_base;
+
+    printf("chainload: Preparing image...\n");
 
-    // Copy m1n1
-    memcpy(new_image, image, size);
+    // Images read through chainload_place() are already where they need to be
+    if (!layout.staging || image != layout.staging || size != layout.size) {
+        if (chainload_plan(size, vars, var_cnt, NULL, 0) < 0)
+            return -1;
+        memcpy(layout.staging, image, size);
+    }
+
+    void *new_image = layout.staging;
+
+    if (layout.cache_off) {
+        struct clcache_hdr *hdr = new_image + layout.cache_off;
+        u64 base = new_base + layout.cache_off;
+        u64 end = base + layout.cache_size;
+        struct warmboot_tail *tail = (void *)hdr + layout.cache_size - sizeof(*tail);
+
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->magic = CLCACHE_MAGIC;
+        hdr->end = end;
+        strcpy(hdr->spec, layout.spec);
+        hdr->size = size;
+        hdr->mtime = layout.mtime;
+        hdr->crc = tinf_crc32(new_image, size);
+        memcpy((void *)hdr + SZ_16K, new_image, size);
+
+        tail->magic = CLCACHE_MAGIC;
+        tail->base = base;
+    }
 
     // Add vars
-    u8 *p = new_image + size;
+    u8 *p = new_image + layout.vars_off;
     for (size_t i = 0; i < var_cnt; i++) {
         size_t len = strlen(vars[i]);
 
@@ -78,44 +331,97 @@ int chainload_image(void *image, size_t size, char **vars, size_t var_cnt)
     // Add end padding
     memset(p, 0, 4);
 
-    // Copy SEPFW
-    memcpy(new_image + sepfw_off, (void *)sepfw[0], sepfw[1]);
-
-    // Adjust ADT SEPFW address
-    sepfw[0] = new_base + sepfw_off;
-    if (adt_setprop(adt, anode, "SEPFW", &sepfw, sizeof(sepfw)) < 0) {
-        printf("chainload: Failed to set SEPFW prop\n");
-        free(new_image);
-        return -1;
+    if (layout.sepfw_off) {
+        // Copy SEPFW
+        memcpy(new_image + layout.sepfw_off, (void *)layout.sepfw[0], layout.sepfw[1]);
+
+        // Adjust ADT SEPFW address
+        layout.sepfw[0] = new_base + layout.sepfw_off;
+        if (adt_setprop(adt, layout.anode, "SEPFW", &layout.sepfw, sizeof(layout.sepfw)) < 0) {
+            printf("chainload: Failed to set SEPFW prop\n");
+            free(new_image);
+            layout.staging = NULL;
+            return -1;
+        }
     }
 
     // Copy bootargs
-    struct boot_args *new_boot_args = new_image + bootargs_off;
+    struct boot_args *new_boot_args = new_image + layout.bootargs_off;
     *new_boot_args = cur_boot_args;
-    new_boot_args->top_of_kernel_data = new_base + image_size;
+    new_boot_args->top_of_kernel_data = layout.top;
 
     // Copy chainload stub
-    void *stub = new_image + image_size;
+    size_t stub_size = _chainload_stub_end - _chainload_stub_start;
+    void *stub = new_image + layout.image_size;
     memcpy(stub, _chainload_stub_start, stub_size);
     dc_cvau_range(stub, stub_size);
     ic_ivau_range(stub, stub_size);
 
     // Set up next stage
     next_stage.entry = stub;
-    next_stage.args[0] = new_base + bootargs_off;
+    next_stage.args[0] = new_base + layout.bootargs_off;
     next_stage.args[1] = (u64)new_image;
     next_stage.args[2] = new_base;
-    next_stage.args[3] = image_size;
+    next_stage.args[3] = layout.image_size;
     next_stage.args[4] = new_base + 0x800; // m1n1 entrypoint
     next_stage.restore_logo = false;
 
     return 0;
 }
 
+void chainload_set_cache(bool enabled)
+{
+    clcache_enabled = enabled;
+}
+
 #ifdef CHAINLOADING
 
+struct chainload_vars {
+    const char *spec;
+    char **vars;
+    size_t var_cnt;
+};
+
+static bool chainload_cache_lookup(const char *spec, struct chainload_image_info *info, void *dest)
+{
+    if (!clcache || !clcache_enabled)
+        return false;
+
+    if (strcmp(clcache->spec, spec) || clcache->size != info->size ||
+        clcache->mtime != info->mtime) {
+        printf("chainload: cached image is stale\n");
+        return false;
+    }
+
+    void *data = (void *)clcache + SZ_16K;
+    if (tinf_crc32(data, clcache->size) != clcache->crc) {
+        printf("chainload: cached image is corrupted\n");
+        return false;
+    }
+
+    printf("chainload: using the cached image (0x%lx bytes)\n", clcache->size);
+    memcpy(dest, data, clcache->size);
+    return true;
+}
+
+/*
+ * Called by the Rust loader once it knows the file size: the image goes straight to staging, and
+ * doesn't need to be read at all if the cache has it.
+ */
+static void *chainload_place(struct chainload_image_info *info, void *arg)
+{
+    struct chainload_vars *v = arg;
+
+    if (chainload_plan(info->size, v->vars, v->var_cnt, v->spec, info->mtime) < 0)
+        return NULL;
+
+    info->cached = chainload_cache_lookup(v->spec, info, layout.staging);
+    return layout.staging;
+}
+
 int chainload_load(const char *spec, char **vars, size_t var_cnt)
 {
+    struct chainload_vars v = {spec, vars, var_cnt};
     void *image;
     size_t size;
     int ret;
@@ -125,7 +431,7 @@ int chainload_load(const char *spec, char **vars, size_t var_cnt)
         return -1;
     }
 
-    ret = rust_load_image(spec, &image, &size);
+    ret = rust_load_image(spec, chainload_place, &v, &image, &size);
     nvme_shutdown();
     if (ret < 0)
         return ret;
@@ -133,6 +439,22 @@ int chainload_load(const char *spec, char **vars, size_t var_cnt)
     return chainload_image(image, size, vars, var_cnt);
 }
 
+static void *chainload_place_heap(struct chainload_image_info *info, void *arg)
+{
+    size_t *align = arg;
+
+    return heapblock_alloc_aligned(info->size, *align);
+}
+
+/*
+ * Reads a whole file (same "partuuid;path" spec as chainload=) into a new heapblock allocation
+ * with the given alignment. The caller brings up and shuts down NVMe.
+ */
+int chainload_read_file(const char *spec, size_t align, void **data, size_t *size)
+{
+    return rust_load_image(spec, chainload_place_heap, &align, data, size);
+}
+
 #else
 
 int chainload_load(const char *spec, char **vars, size_t var_cnt)
@@ -145,4 +467,15 @@ int chainload_load(const char *spec, char **vars, size_t var_cnt)
     return -1;
 }
 
+int chainload_read_file(const char *spec, size_t align, void **data, size_t *size)
+{
+    UNUSED(spec);
+    UNUSED(align);
+    UNUSED(data);
+    UNUSED(size);
+
+    printf("Loading files not supported in this build!\n");
+    return -1;
+}
+
 #endif
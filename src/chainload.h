@@ -7,5 +7,10 @@
 
 int chainload_image(void *base, size_t size, char **vars, size_t var_cnt);
 int chainload_load(const char *spec, char **vars, size_t var_cnt);
+void chainload_set_cache(bool enabled);
+int chainload_read_file(const char *spec, size_t align, void **data, size_t *size);
+
+void chainload_snapshot(void);
+int chainload_restart(void);
 
 #endif
@@ -47,7 +47,8 @@ const char *init_cpu(void)
     int part = FIELD_GET(MIDR_PART, midr);
     int rev = (FIELD_GET(MIDR_REV_HIGH, midr) << 4) | FIELD_GET(MIDR_REV_LOW, midr);
 
-    printf("  CPU part: 0x%x rev: 0x%x\n", part, rev);
+    if (is_primary_core())
+        printf("  CPU part: 0x%x rev: 0x%x\n", part, rev);
 
     switch (part) {
         case MIDR_PART_T8103_FIRESTORM:
@@ -91,7 +92,8 @@ const char *init_cpu(void)
             break;
 
         default:
-            uart_puts("  Unknown CPU type");
+            if (is_primary_core())
+                uart_puts("  Unknown CPU type");
             break;
     }
 
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "coro.h"
+#include "malloc.h"
+#include "utils.h"
+
+/*
+ * Cooperative coroutines for overlapping slow device bring-up on one core.
+ *
+ * Each coroutine gets its own stack and runs until it yields, either directly or through
+ * yield_until(). coro_run() round-robins over all of them until every one has returned. There is
+ * no preemption and no locking, so this must only ever be driven from a single CPU, and nothing
+ * can be waited on across a coro_run() call that doesn't yield.
+ */
+
+#define CORO_MAX 16
+
+struct coro_ctx {
+    u64 regs[12]; // x19-x30
+    u64 sp;
+    u64 fpregs[8]; // d8-d15
+};
+
+struct coro {
+    struct coro_ctx ctx;
+    const char *name;
+    coro_fn fn;
+    void *arg;
+    void *stack;
+    bool done;
+};
+
+void coro_switch(struct coro_ctx *from, struct coro_ctx *to);
+void coro_trampoline(void);
+void coro_entry(struct coro *co);
+
+static struct coro *coros[CORO_MAX];
+static int coro_count;
+static struct coro *coro_current;
+static struct coro_ctx coro_main;
+
+int coro_spawn(const char *name, coro_fn fn, void *arg)
+{
+    if (coro_count >= CORO_MAX) {
+        printf("coro: too many coroutines, can't start %s\n", name);
+        return -1;
+    }
+
+    struct coro *co = calloc(1, sizeof(*co));
+    if (!co)
+        return -1;
+
+    co->stack = memalign(0x4000, CORO_STACK_SIZE);
+    if (!co->stack) {
+        free(co);
+        return -1;
+    }
+
+    co->name = name;
+    co->fn = fn;
+    co->arg = arg;
+    co->ctx.regs[0] = (u64)co;               // x19
+    co->ctx.regs[11] = (u64)coro_trampoline; // x30
+    co->ctx.sp = (u64)co->stack + CORO_STACK_SIZE;
+
+    coros[coro_count++] = co;
+    return 0;
+}
+
+void coro_entry(struct coro *co)
+{
+    co->fn(co->arg);
+    co->done = true;
+    coro_switch(&co->ctx, &coro_main);
+}
+
+/* Give the other coroutines a turn, a no-op outside of coro_run() */
+void coro_yield(void)
+{
+    struct coro *co = coro_current;
+
+    if (co)
+        coro_switch(&co->ctx, &coro_main);
+}
+
+bool coro_active(void)
+{
+    return coro_current;
+}
+
+/* Run every spawned coroutine (including ones spawned along the way) until all have returned */
+void coro_run(void)
+{
+    if (coro_current) {
+        printf("coro: coro_run() called from %s\n", coro_current->name);
+        return;
+    }
+
+    while (coro_count) {
+        for (int i = 0; i < coro_count;) {
+            struct coro *co = coros[i];
+
+            coro_current = co;
+            coro_switch(&coro_main, &co->ctx);
+            coro_current = NULL;
+
+            if (!co->done) {
+                i++;
+                continue;
+            }
+
+            free(co->stack);
+            free(co);
+            coros[i] = coros[--coro_count];
+        }
+    }
+}
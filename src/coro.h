@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef CORO_H
+#define CORO_H
+
+#include "types.h"
+#include "utils.h"
+
+#define CORO_STACK_SIZE 0x10000
+
+typedef void (*coro_fn)(void *arg);
+
+int coro_spawn(const char *name, coro_fn fn, void *arg);
+void coro_yield(void);
+bool coro_active(void);
+void coro_run(void);
+
+/*
+ * Wait up to usec for cond to become true, letting the other coroutines run in between. Outside
+ * of a coroutine this is a plain timeout loop. Evaluates to the final value of cond.
+ */
+#define yield_until(cond, usec)                                                                    \
+    ({                                                                                             \
+        u64 _timeout = timeout_calculate(usec);                                                    \
+        while (!(cond) && !timeout_expired(_timeout))                                              \
+            coro_yield();                                                                          \
+        !!(cond);                                                                                  \
+    })
+
+#endif
@@ -162,7 +162,10 @@
 #define PMCR0_PMI_SHIFT   12
 #define PMCR0_CNT_MASK    (PMCR0_CNT_EN_MASK | (PMCR0_CNT_EN_MASK << PMCR0_PMI_SHIFT))
 
-#define SYS_IMP_APL_PMCR1 sys_reg(3, 1, 15, 1, 0)
+#define SYS_IMP_APL_PMCR1   sys_reg(3, 1, 15, 1, 0)
+#define PMCR1_A64_EL0_SHIFT 8
+#define PMCR1_A64_EL1_SHIFT 16
+
 #define SYS_IMP_APL_PMCR2 sys_reg(3, 1, 15, 2, 0)
 #define SYS_IMP_APL_PMCR3 sys_reg(3, 1, 15, 3, 0)
 #define SYS_IMP_APL_PMCR4 sys_reg(3, 1, 15, 4, 0)
@@ -24,9 +24,17 @@ struct cluster_t {
     u64 base;
     bool dvmr;
     uint32_t boot_pstate;
+    uint32_t perf_pstate;
 };
 
-int cpufreq_init_cluster(const struct cluster_t *cluster)
+static const struct cluster_t *cpufreq_clusters;
+static cpufreq_phase_t cpufreq_phase = CPUFREQ_PHASE_BOOT;
+static cpufreq_policy_t cpufreq_policy[CPUFREQ_PHASE_COUNT] = {
+    [CPUFREQ_PHASE_BOOT] = CPUFREQ_POLICY_PERFORMANCE,
+    [CPUFREQ_PHASE_HANDOFF] = CPUFREQ_POLICY_BOOT,
+};
+
+static void cpufreq_init_cluster(const struct cluster_t *cluster)
 {
     u64 enable = CLUSTER_CONFIG_ENABLE;
     if (cluster->dvmr)
@@ -37,52 +45,109 @@ int cpufreq_init_cluster(const struct cluster_t *cluster)
         printf("cpufreq: Configuring cluster %s (dvmr: %d)\n", cluster->name, cluster->dvmr);
         write64(cluster->base + CLUSTER_CONFIG, val | enable);
     }
+}
 
-    val = read64(cluster->base + CLUSTER_PSTATE);
-
-    if (FIELD_GET(CLUSTER_PSTATE_DESIRED1, val) != cluster->boot_pstate) {
-        val &= CLUSTER_PSTATE_DESIRED1 | CLUSTER_PSTATE_DESIRED2;
-        val |= CLUSTER_PSTATE_SET | FIELD_PREP(CLUSTER_PSTATE_DESIRED1, cluster->boot_pstate) |
-               FIELD_PREP(CLUSTER_PSTATE_DESIRED2, cluster->boot_pstate);
-        printf("cpufreq: Switching cluster %s to P-State %d\n", cluster->name,
-               cluster->boot_pstate);
-        write64(cluster->base + CLUSTER_PSTATE, val);
-        if (poll32(cluster->base + CLUSTER_PSTATE, CLUSTER_PSTATE_BUSY, 0, CLUSTER_SWITCH_TIMEOUT) <
-            0) {
-            printf("cpufreq: Timed out waiting for cluster %s P-State switch\n", cluster->name);
-            return -1;
-        }
+/* Returns true if a switch was started, which then has to be waited for */
+static bool cpufreq_start_switch(const struct cluster_t *cluster, uint32_t pstate)
+{
+    u64 val = read64(cluster->base + CLUSTER_PSTATE);
+
+    if (FIELD_GET(CLUSTER_PSTATE_DESIRED1, val) == pstate)
+        return false;
+
+    val &= CLUSTER_PSTATE_DESIRED1 | CLUSTER_PSTATE_DESIRED2;
+    val |= CLUSTER_PSTATE_SET | FIELD_PREP(CLUSTER_PSTATE_DESIRED1, pstate) |
+           FIELD_PREP(CLUSTER_PSTATE_DESIRED2, pstate);
+    printf("cpufreq: Switching cluster %s to P-State %d\n", cluster->name, pstate);
+    write64(cluster->base + CLUSTER_PSTATE, val);
+
+    return true;
+}
+
+static int cpufreq_wait_switch(const struct cluster_t *cluster)
+{
+    if (poll32(cluster->base + CLUSTER_PSTATE, CLUSTER_PSTATE_BUSY, 0, CLUSTER_SWITCH_TIMEOUT) <
+        0) {
+        printf("cpufreq: Timed out waiting for cluster %s P-State switch\n", cluster->name);
+        return -1;
     }
 
     return 0;
 }
 
+/*
+ * Moves every cluster to the P-state the policy for this phase asks for. All the switches are
+ * kicked off before waiting on any of them, so the clusters transition in parallel.
+ */
+int cpufreq_set_phase(cpufreq_phase_t phase)
+{
+    if (phase >= CPUFREQ_PHASE_COUNT)
+        return -1;
+
+    cpufreq_phase = phase;
+    if (!cpufreq_clusters)
+        return -1;
+
+    bool perf = cpufreq_policy[phase] == CPUFREQ_POLICY_PERFORMANCE;
+    u32 pending = 0;
+
+    for (int i = 0; cpufreq_clusters[i].base; i++) {
+        const struct cluster_t *cluster = &cpufreq_clusters[i];
+        if (cpufreq_start_switch(cluster, perf ? cluster->perf_pstate : cluster->boot_pstate))
+            pending |= BIT(i);
+    }
+
+    bool err = false;
+    for (int i = 0; cpufreq_clusters[i].base; i++)
+        if (pending & BIT(i))
+            err |= cpufreq_wait_switch(&cpufreq_clusters[i]) < 0;
+
+    return err ? -1 : 0;
+}
+
+/* Takes effect right away if phase is the current one */
+int cpufreq_set_policy(cpufreq_phase_t phase, cpufreq_policy_t policy)
+{
+    if (phase >= CPUFREQ_PHASE_COUNT)
+        return -1;
+
+    cpufreq_policy[phase] = policy;
+    if (phase == cpufreq_phase && cpufreq_clusters)
+        return cpufreq_set_phase(phase);
+
+    return 0;
+}
+
+/*
+ * perf_pstate is the top of each cluster's range, except on t8112 where the P-cluster's upper
+ * states don't fit the 4-bit fields used here and it stays at its boot state.
+ */
 static const struct cluster_t t8103_clusters[] = {
-    {"ECPU", 0x210e20000, false, 5},
-    {"PCPU", 0x211e20000, true, 7},
+    {"ECPU", 0x210e20000, false, 5, 5},
+    {"PCPU", 0x211e20000, true, 7, 15},
     {},
 };
 
 static const struct cluster_t t6000_clusters[] = {
-    {"ECPU0", 0x210e20000, false, 5},
-    {"PCPU0", 0x211e20000, false, 7},
-    {"PCPU1", 0x212e20000, false, 7},
+    {"ECPU0", 0x210e20000, false, 5, 5},
+    {"PCPU0", 0x211e20000, false, 7, 15},
+    {"PCPU1", 0x212e20000, false, 7, 15},
     {},
 };
 
 static const struct cluster_t t6002_clusters[] = {
-    {"ECPU0", 0x0210e20000, false, 5},
-    {"PCPU0", 0x0211e20000, false, 7},
-    {"PCPU1", 0x0212e20000, false, 7},
-    {"ECPU1", 0x2210e20000, false, 5},
-    {"PCPU2", 0x2211e20000, false, 7},
-    {"PCPU3", 0x2212e20000, false, 7},
+    {"ECPU0", 0x0210e20000, false, 5, 5},
+    {"PCPU0", 0x0211e20000, false, 7, 15},
+    {"PCPU1", 0x0212e20000, false, 7, 15},
+    {"ECPU1", 0x2210e20000, false, 5, 5},
+    {"PCPU2", 0x2211e20000, false, 7, 15},
+    {"PCPU3", 0x2212e20000, false, 7, 15},
     {},
 };
 
 static const struct cluster_t t8112_clusters[] = {
-    {"ECPU", 0x210e20000, false, 7},
-    {"PCPU", 0x211e20000, true, 6},
+    {"ECPU", 0x210e20000, false, 7, 7},
+    {"PCPU", 0x211e20000, true, 6, 6},
     {},
 };
 
@@ -111,10 +176,9 @@ int cpufreq_init(void)
             return -1;
     }
 
-    bool err = false;
-    while (cluster->base) {
-        err |= cpufreq_init_cluster(cluster++);
-    }
+    for (int i = 0; cluster[i].base; i++)
+        cpufreq_init_cluster(&cluster[i]);
 
-    return err ? -1 : 0;
+    cpufreq_clusters = cluster;
+    return cpufreq_set_phase(cpufreq_phase);
 }
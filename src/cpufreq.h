@@ -3,6 +3,19 @@
 #ifndef CPUFREQ_H
 #define CPUFREQ_H
 
+typedef enum {
+    CPUFREQ_PHASE_BOOT,    // everything m1n1 does itself: payloads, DT preparation, the proxy
+    CPUFREQ_PHASE_HANDOFF, // right before kboot_boot() hands off to the kernel
+    CPUFREQ_PHASE_COUNT,
+} cpufreq_phase_t;
+
+typedef enum {
+    CPUFREQ_POLICY_BOOT,        // the P-states iBoot hands to kernels
+    CPUFREQ_POLICY_PERFORMANCE, // the highest sustainable P-states
+} cpufreq_policy_t;
+
 int cpufreq_init(void);
+int cpufreq_set_phase(cpufreq_phase_t phase);
+int cpufreq_set_policy(cpufreq_phase_t phase, cpufreq_policy_t policy);
 
 #endif
@@ -6,7 +6,10 @@
 #include "devicetree.h"
 #include "malloc.h"
 #include "memory.h"
+#include "memstats.h"
+#include "pool.h"
 #include "string.h"
+#include "task.h"
 #include "utils.h"
 
 #include "libfdt/libfdt.h"
@@ -86,6 +89,10 @@
 
 #define DART_MAX_TTBR_COUNT 4
 
+// Reverse map entries: physical page number above the page number of the IOVA that maps it
+#define DART_RMAP_IOVA_BITS 24
+#define DART_RMAP_IOVA      GENMASK(DART_RMAP_IOVA_BITS - 1, 0)
+
 #define DART_TCR(dart) (dart->regs + dart->params->tcr_off + 4 * dart->device)
 #define DART_TTBR(dart, idx)                                                                       \
     (dart->regs + dart->params->ttbr_off + 4 * dart->params->ttbr_count * dart->device + 4 * idx)
@@ -118,6 +125,14 @@ struct dart_dev {
     const struct dart_params *params;
 
     u64 *l1[DART_MAX_TTBR_COUNT];
+
+    // Sorted paddr -> iova map for dart_search(), dropped whenever the mappings change
+    u64 *rmap;
+    u32 rmap_count;
+
+    // See dart_defer_flush()
+    u32 flush_deferred;
+    bool tlb_dirty;
 };
 
 static void dart_t8020_tlb_invalidate(dart_dev_t *dart)
@@ -140,10 +155,41 @@ static void dart_t8110_tlb_invalidate(dart_dev_t *dart)
             FIELD_PREP(DART_T8110_TLB_CMD_OP, DART_T8110_TLB_CMD_OP_FLUSH_SID) |
                 FIELD_PREP(DART_T8110_TLB_CMD_STREAM, dart->device));
 
-    if (poll32(dart->regs + DART_T8110_TLB_CMD_OP, DART_T8110_TLB_CMD_BUSY, 0, 100))
+    if (poll32(dart->regs + DART_T8110_TLB_CMD, DART_T8110_TLB_CMD_BUSY, 0, 100))
         printf("dart: DART_T8110_TLB_CMD_BUSY did not clear.\n");
 }
 
+/* The invalidate commands of all DART types only target dart->device's stream */
+static void dart_tlb_changed(dart_dev_t *dart)
+{
+    if (dart->flush_deferred) {
+        dart->tlb_dirty = true;
+        return;
+    }
+
+    dart->params->tlb_invalidate(dart);
+    dart->tlb_dirty = false;
+}
+
+/*
+ * Batch TLB invalidation: until the matching dart_flush(), dart_map*() and dart_unmap() only mark
+ * the TLB dirty, and dart_flush() then invalidates it once. The device must not be kicked (or,
+ * after unmaps, be using the old mappings) before the flush. Calls nest.
+ */
+void dart_defer_flush(dart_dev_t *dart)
+{
+    dart->flush_deferred++;
+}
+
+void dart_flush(dart_dev_t *dart)
+{
+    if (dart->flush_deferred && --dart->flush_deferred)
+        return;
+
+    if (dart->tlb_dirty)
+        dart_tlb_changed(dart);
+}
+
 const struct dart_params dart_t8020 = {
     .sid_count = 32,
     .pte_flags = FIELD_PREP(DART_PTE_SP_END, 0xfff) | FIELD_PREP(DART_PTE_SP_START, 0) |
@@ -192,6 +238,22 @@ const struct dart_params dart_t8110 = {
     .tlb_invalidate = dart_t8110_tlb_invalidate,
 };
 
+static u64 *dart_alloc_table(void)
+{
+    u64 *tbl = pool_alloc_pages(SZ_16K);
+
+    if (tbl)
+        memstat_alloc(MEMSTAT_DART, SZ_16K);
+
+    return tbl;
+}
+
+static void dart_free_table(u64 *tbl)
+{
+    memstat_free(MEMSTAT_DART, SZ_16K);
+    pool_free_pages(tbl, SZ_16K);
+}
+
 dart_dev_t *dart_init(uintptr_t base, u8 device, bool keep_pts, enum dart_type_t type)
 {
     dart_dev_t *dart = malloc(sizeof(*dart));
@@ -250,7 +312,7 @@ dart_dev_t *dart_init(uintptr_t base, u8 device, bool keep_pts, enum dart_type_t
         if (dart->l1[i])
             continue;
 
-        dart->l1[i] = memalign(SZ_16K, SZ_16K);
+        dart->l1[i] = dart_alloc_table();
         if (!dart->l1[i])
             goto error;
         memset(dart->l1[i], 0, SZ_16K);
@@ -448,6 +510,123 @@ int dart_setup_pt_region(dart_dev_t *dart, const char *path, int device)
     return 0;
 }
 
+static void dart_rmap_invalidate(dart_dev_t *dart)
+{
+    free(dart->rmap);
+    dart->rmap = NULL;
+    dart->rmap_count = 0;
+}
+
+static void dart_rmap_sift(u64 *a, u32 root, u32 n)
+{
+    u64 v = a[root];
+
+    while (2 * root + 1 < n) {
+        u32 child = 2 * root + 1;
+
+        if (child + 1 < n && a[child + 1] > a[child])
+            child++;
+        if (a[child] <= v)
+            break;
+
+        a[root] = a[child];
+        root = child;
+    }
+
+    a[root] = v;
+}
+
+// Heapsort, the tables can hold a lot of pages and this needs no extra memory
+static void dart_rmap_sort(u64 *a, u32 n)
+{
+    for (u32 i = n / 2; i-- > 0;)
+        dart_rmap_sift(a, i, n);
+
+    while (n > 1) {
+        u64 v = a[0];
+        a[0] = a[--n];
+        a[n] = v;
+        dart_rmap_sift(a, 0, n);
+    }
+}
+
+// Room for every PTE in every L2 table, so the walk itself never needs to allocate
+static int dart_rmap_alloc(dart_dev_t *dart)
+{
+    u32 tables = 0;
+
+    dart_rmap_invalidate(dart);
+
+    for (int ttbr = 0; ttbr < dart->params->ttbr_count; ++ttbr) {
+        if (!dart->l1[ttbr])
+            continue;
+        for (u32 l1_index = 0; l1_index < 0x800; l1_index++)
+            if (dart->l1[ttbr][l1_index] & DART_PTE_VALID)
+                tables++;
+    }
+
+    dart->rmap = malloc(max(tables, 1) * 2048 * sizeof(*dart->rmap));
+    return dart->rmap ? 0 : -1;
+}
+
+static void dart_rmap_fill(u64 dart_ptr, u64 a1, u64 a2)
+{
+    dart_dev_t *dart = (dart_dev_t *)dart_ptr;
+    u32 count = 0;
+
+    UNUSED(a1);
+    UNUSED(a2);
+
+    for (int ttbr = 0; ttbr < dart->params->ttbr_count; ++ttbr) {
+        if (!dart->l1[ttbr])
+            continue;
+        for (u32 l1_index = 0; l1_index < 0x800; l1_index++) {
+            if (!(dart->l1[ttbr][l1_index] & DART_PTE_VALID))
+                continue;
+
+            u64 *l2 = (u64 *)(FIELD_GET(dart->params->offset_mask, dart->l1[ttbr][l1_index])
+                              << DART_PTE_OFFSET_SHIFT);
+            for (u32 l2_index = 0; l2_index < 0x800; l2_index++) {
+                if (!(l2[l2_index] & DART_PTE_VALID))
+                    continue;
+
+                u64 pfn = FIELD_GET(dart->params->offset_mask, l2[l2_index]);
+                u64 iova_pfn = (ttbr << 22) | (l1_index << 11) | l2_index;
+                dart->rmap[count++] = (pfn << DART_RMAP_IOVA_BITS) | iova_pfn;
+            }
+        }
+    }
+
+    dart_rmap_sort(dart->rmap, count);
+    dart->rmap_count = count;
+}
+
+/*
+ * Index what the DARTs map so dart_search() is a binary search instead of a walk of the whole
+ * page tables. The memory is allocated here and each DART is then walked and sorted on its own
+ * CPU. Mapping or unmapping anything drops the index again, and dart_search() rebuilds it.
+ */
+int dart_build_rmap(dart_dev_t **darts, size_t count)
+{
+    struct task_group group = TASK_GROUP_INIT;
+    int ret = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (dart_rmap_alloc(darts[i]) < 0) {
+            ret = -1;
+            continue;
+        }
+
+        if (count == 1)
+            dart_rmap_fill((u64)darts[i], 0, 0);
+        else
+            task_spawn(&group, dart_rmap_fill, (u64)darts[i], 0, 0);
+    }
+
+    task_join(&group);
+    return ret;
+}
+
 static u64 *dart_get_l2(dart_dev_t *dart, u32 idx)
 {
     int ttbr = idx >> 11;
@@ -459,7 +638,7 @@ static u64 *dart_get_l2(dart_dev_t *dart, u32 idx)
         return (u64 *)off;
     }
 
-    u64 *tbl = memalign(SZ_16K, SZ_16K);
+    u64 *tbl = dart_alloc_table();
     if (!tbl)
         return NULL;
 
@@ -472,54 +651,84 @@ static u64 *dart_get_l2(dart_dev_t *dart, u32 idx)
     return tbl;
 }
 
-static int dart_map_page(dart_dev_t *dart, uintptr_t iova, uintptr_t paddr)
+/*
+ * L2 tables can be shared between DARTs that map the same memory at the same IOVAs (see
+ * dart_map_shared()). Shared tables are tracked here with the number of DARTs using them; whoever
+ * wants to change one gets a private copy first, and the last user frees it.
+ */
+#define DART_SHARED_L2_MAX 64
+
+static struct {
+    u64 *tbl;
+    u32 refs;
+} dart_shared_l2[DART_SHARED_L2_MAX];
+
+static int dart_l2_shared(u64 *tbl, bool alloc)
 {
-    u32 l1_index = (iova >> 25) & 0x1fff;
-    u32 l2_index = (iova >> 14) & 0x7ff;
+    int free_slot = -1;
 
-    u64 *l2 = dart_get_l2(dart, l1_index);
-    if (!l2) {
-        printf("dart: couldn't create l2 for iova %lx\n", iova);
-        return -1;
+    for (int i = 0; i < DART_SHARED_L2_MAX; i++) {
+        if (dart_shared_l2[i].tbl == tbl)
+            return i;
+        if (!dart_shared_l2[i].tbl && free_slot < 0)
+            free_slot = i;
     }
 
-    if (l2[l2_index] & DART_PTE_VALID) {
-        printf("dart: iova %lx already has a valid PTE: %lx\n", iova, l2[l2_index]);
-        return -1;
-    }
+    return alloc ? free_slot : -1;
+}
 
-    u64 offset = FIELD_PREP(dart->params->offset_mask, paddr >> DART_PTE_OFFSET_SHIFT);
+static void dart_ref_l2(u64 *tbl)
+{
+    int i = dart_l2_shared(tbl, true);
+
+    assert(i >= 0);
+    if (dart_shared_l2[i].tbl) {
+        dart_shared_l2[i].refs++;
+    } else {
+        dart_shared_l2[i].tbl = tbl;
+        dart_shared_l2[i].refs = 2;
+    }
+}
 
-    l2[l2_index] = offset | dart->params->pte_flags;
+static void dart_put_l2(u64 *tbl)
+{
+    int i = dart_l2_shared(tbl, false);
 
-    return 0;
+    if (i < 0)
+        dart_free_table(tbl);
+    else if (--dart_shared_l2[i].refs == 1)
+        dart_shared_l2[i].tbl = NULL;
 }
 
-int dart_map(dart_dev_t *dart, uintptr_t iova, void *bfr, size_t len)
+static u64 *dart_peek_l2(dart_dev_t *dart, u32 idx)
 {
-    uintptr_t paddr = (uintptr_t)bfr;
-    u64 offset = 0;
+    u64 pte = dart->l1[idx >> 11][idx & 0x7ff];
 
-    if (len % SZ_16K)
-        return -1;
-    if (paddr % SZ_16K)
-        return -1;
-    if (iova % SZ_16K)
-        return -1;
+    if (!(pte & DART_PTE_VALID))
+        return NULL;
 
-    while (offset < len) {
-        int ret = dart_map_page(dart, iova + offset, paddr + offset);
+    return (u64 *)(FIELD_GET(dart->params->offset_mask, pte) << DART_PTE_OFFSET_SHIFT);
+}
 
-        if (ret) {
-            dart_unmap(dart, iova, offset);
-            return ret;
-        }
+/* Like dart_get_l2(), but for changing the PTEs: breaks sharing of the table */
+static u64 *dart_get_l2_rw(dart_dev_t *dart, u32 idx)
+{
+    u64 *tbl = dart_get_l2(dart, idx);
 
-        offset += SZ_16K;
-    }
+    if (!tbl || dart_l2_shared(tbl, false) < 0)
+        return tbl;
 
-    dart->params->tlb_invalidate(dart);
-    return 0;
+    u64 *copy = dart_alloc_table();
+    if (!copy)
+        return NULL;
+
+    memcpy(copy, tbl, SZ_16K);
+    dart->l1[idx >> 11][idx & 0x7ff] =
+        FIELD_PREP(dart->params->offset_mask, ((u64)copy) >> DART_PTE_OFFSET_SHIFT) |
+        DART_PTE_VALID;
+    dart_put_l2(tbl);
+
+    return copy;
 }
 
 static void dart_unmap_page(dart_dev_t *dart, uintptr_t iova)
@@ -531,25 +740,193 @@ static void dart_unmap_page(dart_dev_t *dart, uintptr_t iova)
     if (!(dart->l1[ttbr][l1_index] & DART_PTE_VALID))
         return;
 
-    u64 *l2 = dart_get_l2(dart, l1_index);
+    u64 *l2 = dart_get_l2_rw(dart, l1_index);
+    if (!l2) {
+        printf("dart: out of memory unsharing l2 for iova %lx\n", iova);
+        return;
+    }
     l2[l2_index] = 0;
 }
 
-void dart_unmap(dart_dev_t *dart, uintptr_t iova, size_t len)
+static void dart_clear_range(dart_dev_t *dart, uintptr_t iova, size_t len)
 {
-    if (len % SZ_16K)
-        return;
-    if (iova % SZ_16K)
-        return;
-
     while (len) {
         dart_unmap_page(dart, iova);
 
         len -= SZ_16K;
         iova += SZ_16K;
     }
+}
+
+/*
+ * Map one range whose L2 tables already exist, one L2 table at a time. Returns the number of bytes
+ * mapped, which is short of len if an existing mapping is in the way.
+ */
+static size_t dart_map_range(dart_dev_t *dart, uintptr_t iova, uintptr_t paddr, size_t len)
+{
+    u64 pte = FIELD_PREP(dart->params->offset_mask, paddr >> DART_PTE_OFFSET_SHIFT) |
+              dart->params->pte_flags;
+    u64 step = FIELD_PREP(dart->params->offset_mask, 1);
+    size_t done = 0;
+
+    while (done < len) {
+        u64 *l2 = dart_get_l2_rw(dart, (iova >> 25) & 0x1fff);
+        u32 l2_index = (iova >> 14) & 0x7ff;
+        u32 count = min(2048 - l2_index, (len - done) / SZ_16K);
+
+        for (u32 i = 0; i < count; i++) {
+            if (l2[l2_index + i] & DART_PTE_VALID) {
+                printf("dart: iova %lx already has a valid PTE: %lx\n", iova + i * SZ_16K,
+                       l2[l2_index + i]);
+                return done;
+            }
+        }
+
+        for (u32 i = 0; i < count; i++, pte += step)
+            l2[l2_index + i] = pte;
+
+        iova += count * SZ_16K;
+        done += count * SZ_16K;
+    }
 
-    dart->params->tlb_invalidate(dart);
+    return done;
+}
+
+int dart_map_sg(dart_dev_t *dart, const struct dart_sg_entry *sg, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if ((sg[i].iova | sg[i].paddr | sg[i].len) % SZ_16K)
+            return -1;
+    }
+
+    /*
+     * Install every L2 table the batch needs before touching any PTE, so running out of memory
+     * never leaves a half-mapped batch behind. One table covers 32MB of IOVA space.
+     */
+    for (size_t i = 0; i < count; i++) {
+        if (!sg[i].len)
+            continue;
+
+        for (u64 l1 = sg[i].iova >> 25; l1 <= (sg[i].iova + sg[i].len - 1) >> 25; l1++) {
+            if (!dart_get_l2_rw(dart, l1 & 0x1fff)) {
+                printf("dart: couldn't create l2 for iova %lx\n", l1 << 25);
+                return -1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t done = dart_map_range(dart, sg[i].iova, sg[i].paddr, sg[i].len);
+
+        if (done != sg[i].len) {
+            dart_clear_range(dart, sg[i].iova, done);
+            while (i--)
+                dart_clear_range(dart, sg[i].iova, sg[i].len);
+            dart_tlb_changed(dart);
+            return -1;
+        }
+    }
+
+    dart_rmap_invalidate(dart);
+    dart_tlb_changed(dart);
+    return 0;
+}
+
+int dart_map(dart_dev_t *dart, uintptr_t iova, void *bfr, size_t len)
+{
+    struct dart_sg_entry sg = {
+        .iova = iova,
+        .paddr = (uintptr_t)bfr,
+        .len = len,
+    };
+
+    return dart_map_sg(dart, &sg, 1);
+}
+
+/*
+ * Map into dart what src maps in [iova, iova + len), e.g. a framebuffer both display DARTs need
+ * at the same address. L2 tables the range covers entirely are shared rather than duplicated, so
+ * this costs neither page-table memory nor PTE writes for them; the partial tables at either end
+ * get the PTEs copied. The DARTs must be of the same type, src must map the whole range and dart
+ * none of it. Nothing is changed on failure, except for empty L2 tables that may be left behind.
+ */
+int dart_map_shared(dart_dev_t *dart, dart_dev_t *src, uintptr_t iova, size_t len)
+{
+    if (dart->params != src->params || !len || (iova | len) % SZ_16K)
+        return -1;
+
+    u64 first = iova >> 25, last = (iova + len - 1) >> 25;
+    u32 first_pte = (iova >> 14) & 0x7ff, last_pte = ((iova + len - 1) >> 14) & 0x7ff;
+    int slots = 0;
+
+    for (int i = 0; i < DART_SHARED_L2_MAX; i++)
+        if (!dart_shared_l2[i].tbl)
+            slots++;
+
+    for (u64 l1 = first; l1 <= last; l1++) {
+        u32 start = l1 == first ? first_pte : 0;
+        u32 end = l1 == last ? last_pte + 1 : 2048;
+        u64 *s = dart_peek_l2(src, l1 & 0x1fff);
+        u64 *d = dart_peek_l2(dart, l1 & 0x1fff);
+
+        for (u32 i = start; i < end; i++) {
+            if (!s || !(s[i] & DART_PTE_VALID)) {
+                printf("dart: iova %lx is not mapped in the source DART\n",
+                       (l1 << 25) + i * SZ_16K);
+                return -1;
+            }
+            if (d && d[i] & DART_PTE_VALID) {
+                printf("dart: iova %lx already has a valid PTE: %lx\n", (l1 << 25) + i * SZ_16K,
+                       d[i]);
+                return -1;
+            }
+        }
+
+        if (start == 0 && end == 2048) {
+            if (!is_heap(s) || (dart_l2_shared(s, false) < 0 && --slots < 0))
+                return -1;
+        }
+    }
+
+    // Only the tables at either end can be partial
+    if (first_pte && !dart_get_l2_rw(dart, first & 0x1fff))
+        return -1;
+    if (last_pte != 0x7ff && !dart_get_l2_rw(dart, last & 0x1fff))
+        return -1;
+
+    for (u64 l1 = first; l1 <= last; l1++) {
+        u32 start = l1 == first ? first_pte : 0;
+        u32 end = l1 == last ? last_pte + 1 : 2048;
+        u32 ttbr = (l1 >> 11) & 0x3, idx = l1 & 0x7ff;
+        u64 *s = dart_peek_l2(src, l1 & 0x1fff);
+        u64 *d = dart_peek_l2(dart, l1 & 0x1fff);
+
+        if (start == 0 && end == 2048) {
+            // Whatever table dart had here was checked to be empty
+            if (d)
+                dart_put_l2(d);
+            dart_ref_l2(s);
+            dart->l1[ttbr][idx] = src->l1[ttbr][idx];
+        } else {
+            memcpy(&d[start], &s[start], (end - start) * sizeof(*d));
+        }
+    }
+
+    dart_rmap_invalidate(dart);
+    dart_tlb_changed(dart);
+    return 0;
+}
+
+void dart_unmap(dart_dev_t *dart, uintptr_t iova, size_t len)
+{
+    if (len % SZ_16K)
+        return;
+    if (iova % SZ_16K)
+        return;
+
+    dart_clear_range(dart, iova, len);
+    dart_rmap_invalidate(dart);
+    dart_tlb_changed(dart);
 }
 
 void dart_free_l2(dart_dev_t *dart, uintptr_t iova)
@@ -574,7 +951,8 @@ void dart_free_l2(dart_dev_t *dart, uintptr_t iova)
         }
     }
     dart->l1[ttbr][l1_index] = 0;
-    free(l2);
+    dart_put_l2(l2);
+    dart_rmap_invalidate(dart);
 }
 
 static void *dart_translate_internal(dart_dev_t *dart, uintptr_t iova, int silent)
@@ -610,29 +988,32 @@ void *dart_translate(dart_dev_t *dart, uintptr_t iova)
     return dart_translate_internal(dart, iova, 0);
 }
 
+// Returns the lowest IOVA mapping the page at paddr
 u64 dart_search(dart_dev_t *dart, void *paddr)
 {
-    for (int ttbr = 0; ttbr < dart->params->ttbr_count; ++ttbr) {
-        if (!dart->l1[ttbr])
-            continue;
-        for (u32 l1_index = 0; l1_index < 0x7ff; l1_index++) {
-            if (!(dart->l1[ttbr][l1_index] & DART_PTE_VALID))
-                continue;
+    if ((u64)paddr & (SZ_16K - 1))
+        return DART_PTR_ERR;
 
-            u64 *l2 = (u64 *)(FIELD_GET(dart->params->offset_mask, dart->l1[ttbr][l1_index])
-                              << DART_PTE_OFFSET_SHIFT);
-            for (u32 l2_index = 0; l2_index < 0x7ff; l2_index++) {
-                if (!(l2[l2_index] & DART_PTE_VALID))
-                    continue;
-                u64 *dst = (u64 *)(FIELD_GET(dart->params->offset_mask, l2[l2_index])
-                                   << DART_PTE_OFFSET_SHIFT);
-                if (dst == paddr)
-                    return ((u64)ttbr << 36) | ((u64)l1_index << 25) | (l2_index << 14);
-            }
-        }
+    if (!dart->rmap && dart_build_rmap(&dart, 1) < 0)
+        return DART_PTR_ERR;
+
+    u64 pfn = (u64)paddr >> DART_PTE_OFFSET_SHIFT;
+    u64 key = pfn << DART_RMAP_IOVA_BITS;
+    u32 lo = 0, hi = dart->rmap_count;
+
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+
+        if (dart->rmap[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    return DART_PTR_ERR;
+    if (lo == dart->rmap_count || (dart->rmap[lo] >> DART_RMAP_IOVA_BITS) != pfn)
+        return DART_PTR_ERR;
+
+    return (dart->rmap[lo] & DART_RMAP_IOVA) << DART_PTE_OFFSET_SHIFT;
 }
 
 u64 dart_find_iova(dart_dev_t *dart, s64 start, size_t len)
@@ -678,7 +1059,7 @@ void dart_shutdown(dart_dev_t *dart)
             if (dart->l1[ttbr][i] & DART_PTE_VALID) {
                 void *l2 = dart_get_l2(dart, i);
                 if (is_heap(l2)) {
-                    free(l2);
+                    dart_put_l2(l2);
                     dart->l1[ttbr][i] = 0;
                 }
             }
@@ -689,6 +1070,7 @@ void dart_shutdown(dart_dev_t *dart)
 
     for (int i = 0; i < dart->params->ttbr_count; ++i)
         if (is_heap(dart->l1[i]))
-            free(dart->l1[i]);
+            dart_free_table(dart->l1[i]);
+    dart_rmap_invalidate(dart);
     free(dart);
 }
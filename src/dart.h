@@ -10,6 +10,12 @@
 
 typedef struct dart_dev dart_dev_t;
 
+struct dart_sg_entry {
+    u64 iova;
+    u64 paddr;
+    u64 len;
+};
+
 enum dart_type_t {
     DART_T8020,
     DART_T8110,
@@ -22,10 +28,15 @@ void dart_lock_adt(const char *path, int instance);
 dart_dev_t *dart_init_fdt(void *dt, u32 phandle, int device, bool keep_pts);
 int dart_setup_pt_region(dart_dev_t *dart, const char *path, int device);
 int dart_map(dart_dev_t *dart, uintptr_t iova, void *bfr, size_t len);
+int dart_map_sg(dart_dev_t *dart, const struct dart_sg_entry *sg, size_t count);
+int dart_map_shared(dart_dev_t *dart, dart_dev_t *src, uintptr_t iova, size_t len);
 void dart_unmap(dart_dev_t *dart, uintptr_t iova, size_t len);
+void dart_defer_flush(dart_dev_t *dart);
+void dart_flush(dart_dev_t *dart);
 void dart_free_l2(dart_dev_t *dart, uintptr_t iova);
 void *dart_translate(dart_dev_t *dart, uintptr_t iova);
 u64 dart_search(dart_dev_t *dart, void *paddr);
+int dart_build_rmap(dart_dev_t **darts, size_t count);
 u64 dart_find_iova(dart_dev_t *dart, s64 start, size_t len);
 void dart_shutdown(dart_dev_t *dart);
 
@@ -7,7 +7,16 @@
 #include "rtkit.h"
 #include "utils.h"
 
-dcp_dev_t *dcp_init(const char *dcp_path, const char *dcp_dart_path, const char *disp_dart_path)
+static void dcp_free(dcp_dev_t *dcp)
+{
+    rtkit_free(dcp->rtkit);
+    dart_shutdown(dcp->dart_disp);
+    iovad_shutdown(dcp->iovad_dcp, dcp->dart_dcp);
+    dart_shutdown(dcp->dart_dcp);
+    free(dcp);
+}
+
+dcp_dev_t *dcp_start(const char *dcp_path, const char *dcp_dart_path, const char *disp_dart_path)
 {
     dcp_dev_t *dcp = malloc(sizeof(dcp_dev_t));
     if (!dcp)
@@ -41,15 +50,14 @@ dcp_dev_t *dcp_init(const char *dcp_path, const char *dcp_dart_path, const char
         goto out_iovad;
     }
 
-    if (!rtkit_boot(dcp->rtkit)) {
-        printf("dcp: failed to boot RTKit\n");
+    if (!rtkit_boot_start(dcp->rtkit)) {
+        printf("dcp: failed to start RTKit\n");
+        rtkit_free(dcp->rtkit);
         goto out_iovad;
     }
 
     return dcp;
 
-    rtkit_quiesce(dcp->rtkit);
-    rtkit_free(dcp->rtkit);
 out_iovad:
     iovad_shutdown(dcp->iovad_dcp, dcp->dart_dcp);
     dart_shutdown(dcp->dart_disp);
@@ -60,6 +68,27 @@ out_free:
     return NULL;
 }
 
+bool dcp_wait_boot(dcp_dev_t *dcp)
+{
+    if (!rtkit_boot(dcp->rtkit)) {
+        printf("dcp: failed to boot RTKit\n");
+        dcp_free(dcp);
+        return false;
+    }
+
+    return true;
+}
+
+dcp_dev_t *dcp_init(const char *dcp_path, const char *dcp_dart_path, const char *disp_dart_path)
+{
+    dcp_dev_t *dcp = dcp_start(dcp_path, dcp_dart_path, disp_dart_path);
+
+    if (!dcp || !dcp_wait_boot(dcp))
+        return NULL;
+
+    return dcp;
+}
+
 int dcp_shutdown(dcp_dev_t *dcp, bool sleep)
 {
     if (sleep) {
@@ -68,11 +97,7 @@ int dcp_shutdown(dcp_dev_t *dcp, bool sleep)
     } else {
         rtkit_quiesce(dcp->rtkit);
     }
-    rtkit_free(dcp->rtkit);
-    dart_shutdown(dcp->dart_disp);
-    iovad_shutdown(dcp->iovad_dcp, dcp->dart_dcp);
-    dart_shutdown(dcp->dart_dcp);
-    free(dcp);
+    dcp_free(dcp);
 
     return 0;
 }
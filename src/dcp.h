@@ -16,6 +16,9 @@ typedef struct {
 } dcp_dev_t;
 
 dcp_dev_t *dcp_init(const char *dcp_path, const char *dcp_dart_path, const char *disp_dart_path);
+/* dcp_init() in two halves, so the RTKit boot can overlap with other work */
+dcp_dev_t *dcp_start(const char *dcp_path, const char *dcp_dart_path, const char *disp_dart_path);
+bool dcp_wait_boot(dcp_dev_t *dcp);
 
 int dcp_shutdown(dcp_dev_t *dcp, bool sleep);
 
@@ -31,15 +31,9 @@ struct dcp_iboot_if {
     afk_epic_ep_t *epic;
     int channel;
 
-    union {
-        u8 txbuf[TXBUF_LEN];
-        struct txcmd txcmd;
-    };
-
-    union {
-        u8 rxbuf[RXBUF_LEN];
-        struct rxcmd rxcmd;
-    };
+    // Both point into the EPIC shared buffers, so commands are never copied
+    struct txcmd *txcmd;
+    struct rxcmd *rxcmd;
 };
 
 enum IBootCmd {
@@ -105,6 +99,9 @@ dcp_iboot_if_t *dcp_ib_init(dcp_dev_t *dcp)
         goto err_shutdown;
     }
 
+    iboot->txcmd = afk_epic_txbuf(iboot->epic);
+    iboot->rxcmd = afk_epic_rxbuf(iboot->epic);
+
     return iboot;
 
 err_shutdown:
@@ -127,16 +124,16 @@ static int dcp_ib_cmd(dcp_iboot_if_t *iboot, int op, size_t in_size)
     size_t rxsize = RXBUF_LEN;
     assert(in_size <= TXBUF_LEN - sizeof(struct txcmd));
 
-    iboot->txcmd.op = op;
-    iboot->txcmd.len = sizeof(struct txcmd) + in_size;
+    iboot->txcmd->op = op;
+    iboot->txcmd->len = sizeof(struct txcmd) + in_size;
 
-    return afk_epic_command(iboot->epic, iboot->channel, 0xc0, iboot->txbuf,
-                            sizeof(struct txcmd) + in_size, iboot->rxbuf, &rxsize);
+    return afk_epic_command(iboot->epic, iboot->channel, 0xc0, iboot->txcmd,
+                            sizeof(struct txcmd) + in_size, iboot->rxcmd, &rxsize);
 }
 
 int dcp_ib_set_power(dcp_iboot_if_t *iboot, bool power)
 {
-    u32 *pwr = (void *)iboot->txcmd.payload;
+    u32 *pwr = (void *)iboot->txcmd->payload;
     *pwr = power;
 
     return dcp_ib_cmd(iboot, IBOOT_SET_POWER, 1);
@@ -144,7 +141,7 @@ int dcp_ib_set_power(dcp_iboot_if_t *iboot, bool power)
 
 int dcp_ib_get_hpd(dcp_iboot_if_t *iboot, int *timing_cnt, int *color_cnt)
 {
-    struct get_hpd_resp *resp = (void *)iboot->rxcmd.payload;
+    struct get_hpd_resp *resp = (void *)iboot->rxcmd->payload;
     int ret = dcp_ib_cmd(iboot, IBOOT_GET_HPD, 0);
 
     if (ret < 0)
@@ -160,7 +157,7 @@ int dcp_ib_get_hpd(dcp_iboot_if_t *iboot, int *timing_cnt, int *color_cnt)
 
 int dcp_ib_get_timing_modes(dcp_iboot_if_t *iboot, dcp_timing_mode_t **modes)
 {
-    struct get_tmode_resp *resp = (void *)iboot->rxcmd.payload;
+    struct get_tmode_resp *resp = (void *)iboot->rxcmd->payload;
     int ret = dcp_ib_cmd(iboot, IBOOT_GET_TIMING_MODES, 0);
 
     if (ret < 0)
@@ -172,7 +169,7 @@ int dcp_ib_get_timing_modes(dcp_iboot_if_t *iboot, dcp_timing_mode_t **modes)
 
 int dcp_ib_get_color_modes(dcp_iboot_if_t *iboot, dcp_color_mode_t **modes)
 {
-    struct get_cmode_resp *resp = (void *)iboot->rxcmd.payload;
+    struct get_cmode_resp *resp = (void *)iboot->rxcmd->payload;
     int ret = dcp_ib_cmd(iboot, IBOOT_GET_COLOR_MODES, 0);
 
     if (ret < 0)
@@ -187,7 +184,7 @@ int dcp_ib_set_mode(dcp_iboot_if_t *iboot, dcp_timing_mode_t *tmode, dcp_color_m
     struct {
         dcp_timing_mode_t tmode;
         dcp_color_mode_t cmode;
-    } *cmd = (void *)iboot->txcmd.payload;
+    } *cmd = (void *)iboot->txcmd->payload;
 
     cmd->tmode = *tmode;
     cmd->cmode = *cmode;
@@ -196,7 +193,7 @@ int dcp_ib_set_mode(dcp_iboot_if_t *iboot, dcp_timing_mode_t *tmode, dcp_color_m
 
 int dcp_ib_swap_begin(dcp_iboot_if_t *iboot)
 {
-    struct swap_start_resp *resp = (void *)iboot->rxcmd.payload;
+    struct swap_start_resp *resp = (void *)iboot->rxcmd->payload;
     int ret = dcp_ib_cmd(iboot, IBOOT_SWAP_BEGIN, 0);
     if (ret < 0)
         return ret;
@@ -207,7 +204,7 @@ int dcp_ib_swap_begin(dcp_iboot_if_t *iboot)
 int dcp_ib_swap_set_layer(dcp_iboot_if_t *iboot, int layer_id, dcp_layer_t *layer,
                           dcp_rect_t *src_rect, dcp_rect_t *dst_rect)
 {
-    struct swap_set_layer_cmd *cmd = (void *)iboot->txcmd.payload;
+    struct swap_set_layer_cmd *cmd = (void *)iboot->txcmd->payload;
     memset(cmd, 0, sizeof(*cmd));
     cmd->layer_id = layer_id;
     cmd->layer = *layer;
@@ -219,6 +216,6 @@ int dcp_ib_swap_set_layer(dcp_iboot_if_t *iboot, int layer_id, dcp_layer_t *laye
 
 int dcp_ib_swap_end(dcp_iboot_if_t *iboot)
 {
-    memset(iboot->txcmd.payload, 0, 12);
+    memset(iboot->txcmd->payload, 0, 12);
     return dcp_ib_cmd(iboot, IBOOT_SWAP_END, 12);
 }
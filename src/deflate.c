@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "deflate.h"
+#include "string.h"
+#include "utils.h"
+
+/*
+ * A deliberately simple encoder: greedy LZ77 matching through a single-entry hash of 4-byte
+ * sequences, coded with the fixed Huffman tables so no code lengths have to be computed or sent.
+ * It compresses worse than zlib, but it is fast, and the zero-filled or repetitive memory it is
+ * meant for shrinks by orders of magnitude regardless.
+ */
+
+#define DEFLATE_WINDOW    32768
+#define DEFLATE_MIN_MATCH 4
+#define DEFLATE_MAX_MATCH 258
+
+static const u16 len_base[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const u8 len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const u16 dist_base[30] = {1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+                                  33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+                                  1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const u8 dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                  6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static inline void put_bits(struct deflate_stream *s, u32 value, u32 count)
+{
+    s->bits |= (u64)value << s->nbits;
+    s->nbits += count;
+    while (s->nbits >= 8) {
+        *s->out++ = s->bits;
+        s->bits >>= 8;
+        s->nbits -= 8;
+    }
+}
+
+// Huffman codes are packed starting from their most significant bit
+static inline void put_code(struct deflate_stream *s, u32 code, u32 count)
+{
+    u32 rev = 0;
+
+    for (u32 i = 0; i < count; i++)
+        rev |= ((code >> i) & 1) << (count - 1 - i);
+
+    put_bits(s, rev, count);
+}
+
+static inline void put_symbol(struct deflate_stream *s, u32 sym)
+{
+    if (sym < 144)
+        put_code(s, 0x30 + sym, 8);
+    else if (sym < 256)
+        put_code(s, 0x190 + sym - 144, 9);
+    else if (sym < 280)
+        put_code(s, sym - 256, 7);
+    else
+        put_code(s, 0xc0 + sym - 280, 8);
+}
+
+static void put_match(struct deflate_stream *s, u32 len, u32 dist)
+{
+    int i = ARRAY_SIZE(len_base) - 1;
+    while (len_base[i] > len)
+        i--;
+    put_symbol(s, 257 + i);
+    put_bits(s, len - len_base[i], len_extra[i]);
+
+    i = ARRAY_SIZE(dist_base) - 1;
+    while (dist_base[i] > dist)
+        i--;
+    put_code(s, i, 5);
+    put_bits(s, dist - dist_base[i], dist_extra[i]);
+}
+
+static inline u32 hash4(const u8 *p)
+{
+    u32 v = p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+
+    return (v * 2654435761U) >> (32 - DEFLATE_HASH_BITS);
+}
+
+void deflate_init(struct deflate_stream *s)
+{
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+ * Compress src[pos, pos + len) as one fixed Huffman block, with src[0, pos) available for back
+ * references. out needs room for DEFLATE_BOUND(len) bytes; the number of bytes written is
+ * returned. Positions are kept as u32, so the whole input must be smaller than 4GiB.
+ */
+size_t deflate_block(struct deflate_stream *s, const u8 *src, size_t pos, size_t len, bool final,
+                     u8 *out)
+{
+    size_t end = pos + len;
+
+    s->out = out;
+    put_bits(s, final ? 1 : 0, 1);
+    put_bits(s, 1, 2); // BTYPE 01: fixed Huffman codes
+
+    while (pos < end) {
+        u32 match = 0;
+        u32 dist = 0;
+
+        if (end - pos >= DEFLATE_MIN_MATCH) {
+            u32 h = hash4(src + pos);
+            u32 cand = s->head[h]; // stored as position + 1, 0 is empty
+
+            s->head[h] = pos + 1;
+            if (cand && pos - (cand - 1) <= DEFLATE_WINDOW) {
+                const u8 *a = src + cand - 1;
+                const u8 *b = src + pos;
+                u32 max = min(end - pos, DEFLATE_MAX_MATCH);
+
+                while (match < max && a[match] == b[match])
+                    match++;
+                dist = b - a;
+            }
+        }
+
+        if (match >= DEFLATE_MIN_MATCH) {
+            put_match(s, match, dist);
+            pos += match;
+        } else {
+            put_symbol(s, src[pos++]);
+        }
+    }
+
+    put_symbol(s, 256);
+
+    if (final && s->nbits) {
+        *s->out++ = s->bits;
+        s->bits = 0;
+        s->nbits = 0;
+    }
+
+    return s->out - out;
+}
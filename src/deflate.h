@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include "types.h"
+
+#define DEFLATE_HASH_BITS 12
+
+/* Worst case output of deflate_block(): every byte a 9-bit literal, plus the block framing */
+#define DEFLATE_BOUND(len) ((len) + (len) / 8 + 16)
+
+/*
+ * Raw deflate (RFC 1951) encoder state. The input is one contiguous buffer compressed in pieces,
+ * so back references may reach into data compressed by earlier blocks. Bits that do not make up a
+ * full byte yet are carried over to the next block.
+ */
+struct deflate_stream {
+    u64 bits;
+    u32 nbits;
+    u8 *out;
+    u32 head[1 << DEFLATE_HASH_BITS];
+};
+
+void deflate_init(struct deflate_stream *s);
+size_t deflate_block(struct deflate_stream *s, const u8 *src, size_t pos, size_t len, bool final,
+                     u8 *out);
+
+#endif
@@ -1,9 +1,30 @@
 /* SPDX-License-Identifier: MIT */
 
 #include "devicetree.h"
+#include "string.h"
 
 #include "libfdt/libfdt.h"
 
+/*
+ * Parsed "ranges" of every bus in the tree, recorded by path when dt_cache_ranges() is called
+ * (dt_cache_ranges(NULL) drops them).
+ * Paths, unlike node offsets, survive the edits kboot makes, and the buses themselves are never
+ * edited, so one pass over the tree serves every address translation until the next one.
+ */
+#define DT_MAX_BUSES 16
+#define DT_MAX_DEPTH 16
+#define DT_MAX_PATH  128
+
+struct dt_bus {
+    char path[DT_MAX_PATH];
+    size_t len;
+    struct dt_ranges_tbl ranges[DT_MAX_RANGES];
+};
+
+static void *dt_bus_tree;
+static struct dt_bus dt_buses[DT_MAX_BUSES];
+static int dt_bus_count;
+
 void dt_parse_ranges(void *dt, int node, struct dt_ranges_tbl *ranges)
 {
     int len;
@@ -42,8 +63,93 @@ u64 dt_translate(struct dt_ranges_tbl *ranges, const fdt64_t *reg)
     return addr;
 }
 
+void dt_cache_ranges(void *dt)
+{
+    char path[DT_MAX_PATH];
+    size_t lens[DT_MAX_DEPTH];
+    int depth = 0;
+
+    dt_bus_tree = NULL;
+    dt_bus_count = 0;
+
+    if (!dt)
+        return;
+
+    for (int node = 0; node >= 0 && depth >= 0; node = fdt_next_node(dt, node, &depth)) {
+        int namelen;
+        const char *name = fdt_get_name(dt, node, &namelen);
+        size_t len;
+
+        if (!name || depth >= DT_MAX_DEPTH)
+            return;
+
+        if (!depth) {
+            path[0] = '/';
+            len = 1;
+        } else {
+            size_t base = lens[depth - 1];
+            size_t sep = base > 1; // the root path already ends in '/'
+
+            if (base + sep + namelen >= DT_MAX_PATH)
+                return;
+
+            path[base] = '/';
+            memcpy(&path[base + sep], name, namelen);
+            len = base + sep + namelen;
+        }
+        path[len] = 0;
+        lens[depth] = len;
+
+        if (!fdt_getprop(dt, node, "ranges", NULL))
+            continue;
+
+        if (dt_bus_count == DT_MAX_BUSES)
+            return;
+
+        struct dt_bus *bus = &dt_buses[dt_bus_count++];
+        memcpy(bus->path, path, len + 1);
+        bus->len = len;
+        memset(bus->ranges, 0, sizeof(bus->ranges));
+        dt_parse_ranges(dt, node, bus->ranges);
+    }
+
+    // Only use the cache if the whole tree made it in
+    dt_bus_tree = dt;
+}
+
+/* The cached bus nearest above node, or NULL if the cache can't tell */
+static struct dt_bus *dt_find_bus(void *dt, int node)
+{
+    char path[DT_MAX_PATH];
+    struct dt_bus *best = NULL;
+
+    if (dt != dt_bus_tree || fdt_get_path(dt, node, path, sizeof(path)) < 0)
+        return NULL;
+
+    for (int i = 0; i < dt_bus_count; i++) {
+        struct dt_bus *bus = &dt_buses[i];
+
+        if (strncmp(path, bus->path, bus->len) ||
+            (bus->len > 1 && path[bus->len] != '/') || !path[bus->len])
+            continue;
+        if (!best || bus->len > best->len)
+            best = bus;
+    }
+
+    return best;
+}
+
 u64 dt_get_address(void *dt, int node)
 {
+    struct dt_bus *bus = dt_find_bus(dt, node);
+    if (bus) {
+        const fdt64_t *reg = fdt_getprop(dt, node, "reg", NULL);
+        if (!reg)
+            return 0;
+
+        return dt_translate(bus->ranges, reg);
+    }
+
     int parent = fdt_parent_offset(dt, node);
 
     // find parent with "ranges" property
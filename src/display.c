@@ -6,6 +6,7 @@
 #include "dcp.h"
 #include "dcp_iboot.h"
 #include "fb.h"
+#include "malloc.h"
 #include "memory.h"
 #include "string.h"
 #include "utils.h"
@@ -14,6 +15,11 @@
 #define DISPLAY_STATUS_DELAY   100
 #define DISPLAY_STATUS_RETRIES 20
 
+#define DISPLAY_CACHE_TIMING_MODES 128
+#define DISPLAY_CACHE_COLOR_MODES  32
+
+#define DISPLAY_SWAPCHAIN_MAX 3
+
 #define COMPARE(a, b)                                                                              \
     if ((a) > (b)) {                                                                               \
         *best = modes[i];                                                                          \
@@ -23,11 +29,61 @@
     }
 
 static dcp_dev_t *dcp;
+static dcp_dev_t *dcp_early;
 static dcp_iboot_if_t *iboot;
 static u64 fb_dva;
 static u64 fb_size;
 bool display_is_external;
 
+/*
+ * Mode lists from the last enumeration, which DCP keeps reporting unchanged for as long as the
+ * display stays connected, and the modes currently being scanned out.
+ */
+static struct {
+    bool valid;
+    bool set;
+    int timing_cnt;
+    int color_cnt;
+    dcp_timing_mode_t timing[DISPLAY_CACHE_TIMING_MODES];
+    dcp_color_mode_t color[DISPLAY_CACHE_COLOR_MODES];
+    dcp_timing_mode_t cur_timing;
+    dcp_color_mode_t cur_color;
+} display_modes;
+
+/*
+ * Surfaces the CPU renders into while DCP scans out another one. The iBoot interface reports no
+ * swap completion, so a surface counts as released one refresh (plus a millisecond of slack) after
+ * the swap that replaced it was submitted.
+ */
+static struct {
+    int count;
+    int next;
+    int shown; // -1 while the boot framebuffer is on screen
+    u32 stride;
+    u32 width;
+    u32 height;
+    size_t size;
+    u32 frame_usec;
+    struct {
+        void *ptr;
+        u64 dva;
+        u64 release;
+    } buf[DISPLAY_SWAPCHAIN_MAX];
+} swapchain;
+
+/*
+ * Half resolution surface the framebuffer console draws into while DCP scales it up to the full
+ * mode on scanout, see display_console_scaled().
+ */
+static struct {
+    void *ptr;
+    u64 dva;
+    size_t size;
+    u32 stride;
+    u32 width;
+    u32 height;
+} console_surface;
+
 #define abs(x) ((x) >= 0 ? (x) : -(x))
 
 u64 display_mode_fb_size(dcp_timing_mode_t *mode)
@@ -148,7 +204,10 @@ static uintptr_t display_map_fb(uintptr_t iova, u64 paddr, u64 size)
         return DART_PTR_ERR;
     }
 
-    ret = dart_map(dcp->dart_dcp, iova, (void *)paddr, size);
+    // Shares the disp0 page tables where possible
+    ret = dart_map_shared(dcp->dart_dcp, dcp->dart_disp, iova, size);
+    if (ret < 0)
+        ret = dart_map(dcp->dart_dcp, iova, (void *)paddr, size);
     if (ret < 0) {
         printf("display: failed to map fb to dart-dcp\n");
         dart_unmap(dcp->dart_disp, iova, size);
@@ -163,7 +222,12 @@ int display_start_dcp(void)
     if (iboot)
         return 0;
 
-    dcp = dcp_init("/arm-io/dcp", "/arm-io/dart-dcp", "/arm-io/dart-disp0");
+    if (dcp_early) {
+        dcp = dcp_wait_boot(dcp_early) ? dcp_early : NULL;
+        dcp_early = NULL;
+    } else {
+        dcp = dcp_init("/arm-io/dcp", "/arm-io/dart-dcp", "/arm-io/dart-disp0");
+    }
     if (!dcp) {
         printf("display: failed to initialize DCP\n");
         return -1;
@@ -203,6 +267,7 @@ int display_start_dcp(void)
 
 struct display_options {
     bool retina;
+    bool scaled;
 };
 
 int display_parse_mode(const char *config, dcp_timing_mode_t *mode, struct display_options *opts)
@@ -236,6 +301,8 @@ int display_parse_mode(const char *config, dcp_timing_mode_t *mode, struct displ
     while (option && opts) {
         if (!strncmp(option + 1, "retina", 6))
             opts->retina = true;
+        if (!strncmp(option + 1, "scaled", 6))
+            opts->scaled = true;
         option = strchr(option + 1, ',');
     }
 
@@ -245,7 +312,80 @@ int display_parse_mode(const char *config, dcp_timing_mode_t *mode, struct displ
     return mode->valid;
 }
 
-static int display_swap(u64 iova, u32 stride, u32 width, u32 height)
+/*
+ * Checks whether the framebuffer already shows what display_configure() would set up: either we
+ * did the modeset ourselves and the cached mode list still resolves to the same mode, or an earlier
+ * m1n1 stage did it and the geometry matches what was asked for.
+ */
+static bool display_mode_is_current(dcp_timing_mode_t *want, struct display_options *opts)
+{
+    u64 depth = cur_boot_args.video.depth;
+
+    if (!(depth & FB_DEPTH_FLAG_MODESET) || (depth & FB_DEPTH_MASK) != 30)
+        return false;
+    if (!!(depth & FB_DEPTH_FLAG_RETINA) != opts->retina)
+        return false;
+
+    if (display_modes.set) {
+        dcp_timing_mode_t tbest;
+
+        display_choose_timing_mode(display_modes.timing, display_modes.timing_cnt, &tbest, want);
+        return !memcmp(&tbest, &display_modes.cur_timing, sizeof(tbest)) &&
+               cur_boot_args.video.width == tbest.width &&
+               cur_boot_args.video.height == tbest.height;
+    }
+
+    if (!want->valid)
+        return true;
+
+    // The refresh rate is not recorded anywhere, so only a request without one can match
+    return !want->fps && cur_boot_args.video.width == want->width &&
+           cur_boot_args.video.height == want->height;
+}
+
+static int display_get_modes(int timing_cnt, int color_cnt, dcp_timing_mode_t **tmodes,
+                             dcp_color_mode_t **cmodes)
+{
+    int ret;
+
+    if (display_modes.valid && display_modes.timing_cnt == timing_cnt &&
+        display_modes.color_cnt == color_cnt) {
+        *tmodes = display_modes.timing;
+        *cmodes = display_modes.color;
+        return 0;
+    }
+
+    if ((ret = dcp_ib_get_timing_modes(iboot, tmodes)) < 0) {
+        printf("display: failed to get timing modes\n");
+        return -1;
+    }
+    assert(ret == timing_cnt);
+
+    if ((ret = dcp_ib_get_color_modes(iboot, cmodes)) < 0) {
+        printf("display: failed to get color modes\n");
+        return -1;
+    }
+    assert(ret == color_cnt);
+
+    // Both lists point into the shared EPIC reply buffer, so take the copy before the next command
+    display_modes.valid = false;
+    display_modes.set = false;
+    if (timing_cnt <= DISPLAY_CACHE_TIMING_MODES && color_cnt <= DISPLAY_CACHE_COLOR_MODES) {
+        memcpy(display_modes.timing, *tmodes, timing_cnt * sizeof(**tmodes));
+        memcpy(display_modes.color, *cmodes, color_cnt * sizeof(**cmodes));
+        display_modes.timing_cnt = timing_cnt;
+        display_modes.color_cnt = color_cnt;
+        display_modes.valid = true;
+        *tmodes = display_modes.timing;
+        *cmodes = display_modes.color;
+    }
+
+    return 0;
+}
+
+/* Scans out a width x height surface stretched to out_width x out_height */
+static int display_swap_scaled(u64 iova, u32 stride, u32 width, u32 height, u32 out_width,
+                               u32 out_height)
 {
     int ret;
     int swap_id = ret = dcp_ib_swap_begin(iboot);
@@ -269,9 +409,10 @@ static int display_swap(u64 iova, u32 stride, u32 width, u32 height)
         .transform = XFRM_NONE,
     };
 
-    dcp_rect_t rect = {width, height, 0, 0};
+    dcp_rect_t src_rect = {width, height, 0, 0};
+    dcp_rect_t dst_rect = {out_width, out_height, 0, 0};
 
-    if ((ret = dcp_ib_swap_set_layer(iboot, 0, &layer, &rect, &rect)) < 0) {
+    if ((ret = dcp_ib_swap_set_layer(iboot, 0, &layer, &src_rect, &dst_rect)) < 0) {
         printf("display: failed to set layer\n");
         return -1;
     }
@@ -284,6 +425,260 @@ static int display_swap(u64 iova, u32 stride, u32 width, u32 height)
     return swap_id;
 }
 
+static int display_swap(u64 iova, u32 stride, u32 width, u32 height)
+{
+    return display_swap_scaled(iova, stride, width, height, width, height);
+}
+
+static u32 display_frame_usec(void)
+{
+    u32 fps = display_modes.set ? display_modes.cur_timing.fps : 60 << 16;
+
+    return ((1000000UL << 16) + fps - 1) / fps;
+}
+
+/*
+ * Puts the boot framebuffer back on screen and frees the swap chain surfaces. If DCP does not take
+ * the swap back, the surfaces may still be scanned out and are left alone.
+ */
+void display_swapchain_shutdown(void)
+{
+    if (!swapchain.count)
+        return;
+
+    if (swapchain.shown >= 0) {
+        if (!iboot || display_swap(fb_dva, cur_boot_args.video.stride, cur_boot_args.video.width,
+                                   cur_boot_args.video.height) < 0) {
+            printf("display: failed to swap back to the framebuffer\n");
+            return;
+        }
+        udelay(swapchain.frame_usec + 1000);
+    }
+
+    for (int i = 0; i < swapchain.count; i++) {
+        dart_unmap(dcp->dart_disp, swapchain.buf[i].dva, swapchain.size);
+        dart_unmap(dcp->dart_dcp, swapchain.buf[i].dva, swapchain.size);
+        iova_free(dcp->iovad_dcp, swapchain.buf[i].dva, swapchain.size);
+        // Drop stale lines left behind by the writes through the NC alias
+        dc_ivac_range(swapchain.buf[i].ptr, swapchain.size);
+        free(swapchain.buf[i].ptr);
+    }
+
+    memset(&swapchain, 0, sizeof(swapchain));
+}
+
+/*
+ * Sets up count surfaces with the geometry of the current mode. Frames drawn into the shadow
+ * framebuffer (fb_blit() and friends) are then shown with display_swapchain_present().
+ */
+int display_swapchain_init(int count)
+{
+    int ret;
+
+    if (count < 2 || count > DISPLAY_SWAPCHAIN_MAX) {
+        printf("display: unsupported swap chain length %d\n", count);
+        return -1;
+    }
+
+    display_swapchain_shutdown();
+    if (swapchain.count)
+        return -1;
+
+    // Frames are copied from the console's shadow framebuffer, which has to match the surfaces
+    if (console_surface.ptr) {
+        printf("display: swap chain needs the console at full resolution\n");
+        return -1;
+    }
+
+    if ((ret = display_start_dcp()) < 0)
+        return ret;
+
+    if ((ret = dcp_ib_set_power(iboot, true)) < 0) {
+        printf("display: failed to set power\n");
+        return ret;
+    }
+
+    swapchain.stride = cur_boot_args.video.stride;
+    swapchain.width = cur_boot_args.video.width;
+    swapchain.height = cur_boot_args.video.height;
+    swapchain.size = ALIGN_UP(swapchain.stride * swapchain.height, SZ_16K);
+    swapchain.frame_usec = display_frame_usec();
+    swapchain.shown = -1;
+    swapchain.next = 0;
+
+    for (int i = 0; i < count; i++) {
+        void *ptr = memalign(SZ_16K, swapchain.size);
+        if (!ptr) {
+            printf("display: failed to allocate swap chain surface\n");
+            goto err;
+        }
+
+        u64 dva = iova_alloc(dcp->iovad_dcp, swapchain.size);
+        if (!dva || DART_IS_ERR(display_map_fb(dva, (u64)ptr, swapchain.size))) {
+            printf("display: failed to map swap chain surface\n");
+            if (dva)
+                iova_free(dcp->iovad_dcp, dva, swapchain.size);
+            free(ptr);
+            goto err;
+        }
+
+        dc_civac_range_auto(ptr, swapchain.size);
+        swapchain.buf[i].ptr = ptr;
+        swapchain.buf[i].dva = dva;
+        swapchain.buf[i].release = 0;
+        swapchain.count = i + 1;
+    }
+
+    printf("display: swap chain of %d %dx%d surfaces\n", count, swapchain.width, swapchain.height);
+    return 0;
+
+err:
+    display_swapchain_shutdown();
+    return -1;
+}
+
+/*
+ * Copies the shadow framebuffer into the next free surface and queues it for scanout. Only waits
+ * if that surface is still being released, so with three surfaces the CPU can draw the next frame
+ * while DCP shows this one. Returns the swap ID.
+ */
+int display_swapchain_present(void)
+{
+    if (!swapchain.count || !iboot)
+        return -1;
+
+    int i = swapchain.next;
+
+    while (swapchain.buf[i].release && !timeout_expired(swapchain.buf[i].release))
+        ;
+
+    // Surfaces were cleaned when allocated and are only ever written through the NC alias
+    void *nc = mmu_nc_alias(swapchain.buf[i].ptr, swapchain.size);
+    fb_copy(nc ?: swapchain.buf[i].ptr);
+    if (nc)
+        sysop("dsb sy");
+    else
+        dc_cvac_range(swapchain.buf[i].ptr, swapchain.size);
+
+    int ret = display_swap(swapchain.buf[i].dva, swapchain.stride, swapchain.width,
+                           swapchain.height);
+    if (ret < 0)
+        return ret;
+
+    if (swapchain.shown >= 0)
+        swapchain.buf[swapchain.shown].release = timeout_calculate(swapchain.frame_usec + 1000);
+
+    swapchain.buf[i].release = 0;
+    swapchain.shown = i;
+    swapchain.next = (i + 1) % swapchain.count;
+
+    return ret;
+}
+
+static void display_console_surface_free(void)
+{
+    dart_unmap(dcp->dart_disp, console_surface.dva, console_surface.size);
+    dart_unmap(dcp->dart_dcp, console_surface.dva, console_surface.size);
+    iova_free(dcp->iovad_dcp, console_surface.dva, console_surface.size);
+    dc_ivac_range(console_surface.ptr, console_surface.size);
+    free(console_surface.ptr);
+    memset(&console_surface, 0, sizeof(console_surface));
+}
+
+/*
+ * Moves the framebuffer console to a surface at half the width and height of the current mode,
+ * which DCP scales back up on scanout, so drawing text and the logo takes a quarter of the pixel
+ * writes. Only done on HiDPI modes, where the low resolution font scaled 2x is what the retina
+ * one looks like anyway. The boot framebuffer is left showing the logo for the next stage and
+ * goes back on screen when this is disabled, on a modeset, and on display_shutdown().
+ */
+int display_console_scaled(bool enable)
+{
+    int ret;
+
+    if (!enable) {
+        if (!console_surface.ptr)
+            return 0;
+
+        if (!iboot || display_swap(fb_dva, cur_boot_args.video.stride, cur_boot_args.video.width,
+                                   cur_boot_args.video.height) < 0) {
+            printf("display: failed to swap back to the framebuffer\n");
+            return -1;
+        }
+
+        fb_set_surface(NULL, 0, 0, 0);
+        udelay(display_frame_usec() + 1000);
+        display_console_surface_free();
+        return 0;
+    }
+
+    if (console_surface.ptr)
+        return 0;
+
+    if (!(cur_boot_args.video.depth & FB_DEPTH_FLAG_RETINA)) {
+        printf("display: scaled console needs a retina mode\n");
+        return -1;
+    }
+
+    if (swapchain.count) {
+        printf("display: scaled console conflicts with the swap chain\n");
+        return -1;
+    }
+
+    if ((ret = display_start_dcp()) < 0)
+        return ret;
+
+    if ((ret = dcp_ib_set_power(iboot, true)) < 0) {
+        printf("display: failed to set power\n");
+        return ret;
+    }
+
+    console_surface.width = cur_boot_args.video.width / 2;
+    console_surface.height = cur_boot_args.video.height / 2;
+    console_surface.stride = ALIGN_UP(console_surface.width * 4, 64);
+    console_surface.size = ALIGN_UP(console_surface.stride * console_surface.height, SZ_16K);
+
+    console_surface.ptr = memalign(SZ_16K, console_surface.size);
+    if (!console_surface.ptr) {
+        printf("display: failed to allocate console surface\n");
+        return -1;
+    }
+
+    // The console writes through the NC alias, like it does for the boot framebuffer
+    void *nc = mmu_nc_alias(console_surface.ptr, console_surface.size);
+    u64 dva = iova_alloc(dcp->iovad_dcp, console_surface.size);
+    if (!nc || !dva ||
+        DART_IS_ERR(display_map_fb(dva, (u64)console_surface.ptr, console_surface.size))) {
+        printf("display: failed to map console surface\n");
+        if (dva)
+            iova_free(dcp->iovad_dcp, dva, console_surface.size);
+        free(console_surface.ptr);
+        memset(&console_surface, 0, sizeof(console_surface));
+        return -1;
+    }
+    console_surface.dva = dva;
+
+    memset(console_surface.ptr, 0, console_surface.size);
+    dc_civac_range_auto(console_surface.ptr, console_surface.size);
+
+    // Draw the first frame before it goes on screen
+    fb_set_surface(nc, console_surface.stride / 4, console_surface.width,
+                   console_surface.height);
+
+    ret = display_swap_scaled(console_surface.dva, console_surface.stride, console_surface.width,
+                              console_surface.height, cur_boot_args.video.width,
+                              cur_boot_args.video.height);
+    if (ret < 0) {
+        fb_set_surface(NULL, 0, 0, 0);
+        display_console_surface_free();
+        return ret;
+    }
+
+    printf("display: console at %dx%d, scaled by DCP\n", console_surface.width,
+           console_surface.height);
+    return 0;
+}
+
 int display_configure(const char *config)
 {
     dcp_timing_mode_t want;
@@ -291,8 +686,20 @@ int display_configure(const char *config)
 
     display_parse_mode(config, &want, &opts);
 
+    if (display_mode_is_current(&want, &opts)) {
+        printf("display: requested mode is already set up (%ldx%ld), skipping modeset\n",
+               cur_boot_args.video.width, cur_boot_args.video.height);
+        display_console_scaled(opts.scaled);
+        return 1;
+    }
+
     u64 start_time = get_ticks();
 
+    // The surfaces are sized for the current mode
+    display_swapchain_shutdown();
+    if (display_console_scaled(false) < 0)
+        return -1;
+
     int ret = display_start_dcp();
     if (ret < 0)
         return ret;
@@ -332,22 +739,15 @@ int display_configure(const char *config)
 
     // Find best modes
     dcp_timing_mode_t *tmodes, tbest;
-    if ((ret = dcp_ib_get_timing_modes(iboot, &tmodes)) < 0) {
-        printf("display: failed to get timing modes\n");
-        return -1;
-    }
-    assert(ret == timing_cnt);
-    display_choose_timing_mode(tmodes, timing_cnt, &tbest, &want);
-
     dcp_color_mode_t *cmodes, cbest;
-    if ((ret = dcp_ib_get_color_modes(iboot, &cmodes)) < 0) {
-        printf("display: failed to get color modes\n");
+    if (display_get_modes(timing_cnt, color_cnt, &tmodes, &cmodes) < 0)
         return -1;
-    }
-    assert(ret == color_cnt);
+
+    display_choose_timing_mode(tmodes, timing_cnt, &tbest, &want);
     display_choose_color_mode(cmodes, color_cnt, &cbest);
 
     // Set mode
+    display_modes.set = false;
     if ((ret = dcp_ib_set_mode(iboot, &tbest, &cbest)) < 0) {
         printf("display: failed to set mode\n");
         return -1;
@@ -432,15 +832,22 @@ int display_configure(const char *config)
 
     printf("display: swapped! (swap_id=%d)\n", ret);
 
+    display_modes.cur_timing = tbest;
+    display_modes.cur_color = cbest;
+    display_modes.set = display_modes.valid;
+
+    u64 depth = 30 | FB_DEPTH_FLAG_MODESET | (opts.retina ? FB_DEPTH_FLAG_RETINA : 0);
     if (fb_pa != cur_boot_args.video.base || cur_boot_args.video.stride != stride ||
         cur_boot_args.video.width != tbest.width || cur_boot_args.video.height != tbest.height ||
-        cur_boot_args.video.depth != 30) {
+        (cur_boot_args.video.depth & ~FB_DEPTH_FLAG_MODESET) != (depth & ~FB_DEPTH_FLAG_MODESET)) {
         cur_boot_args.video.base = fb_pa;
         cur_boot_args.video.stride = stride;
         cur_boot_args.video.width = tbest.width;
         cur_boot_args.video.height = tbest.height;
-        cur_boot_args.video.depth = 30 | (opts.retina ? FB_DEPTH_FLAG_RETINA : 0);
+        cur_boot_args.video.depth = depth;
         fb_reinit();
+    } else {
+        cur_boot_args.video.depth = depth;
     }
 
     /* Update for python / subsequent stages */
@@ -456,9 +863,35 @@ int display_configure(const char *config)
     u64 msecs = ticks_to_msecs(get_ticks() - start_time);
     printf("display: Modeset took %ld ms\n", msecs);
 
+    if (opts.scaled)
+        display_console_scaled(true);
+
     return 1;
 }
 
+static bool display_is_dummy(void)
+{
+    return cur_boot_args.video.width == 640 && cur_boot_args.video.height == 1136;
+}
+
+/*
+ * If display_init() is going to have to bring up DCP, start booting it now so the firmware
+ * handshake can overlap with other work. Returns the RTKit instance to wait on, or NULL.
+ */
+rtkit_dev_t *display_start_early(void)
+{
+    int node = adt_path_offset(adt, "/arm-io/disp0");
+
+    if (node < 0 || iboot || dcp_early)
+        return NULL;
+
+    if (!display_is_dummy() && !adt_getprop(adt, node, "external", NULL))
+        return NULL;
+
+    dcp_early = dcp_start("/arm-io/dcp", "/arm-io/dart-dcp", "/arm-io/dart-disp0");
+    return dcp_early ? dcp_early->rtkit : NULL;
+}
+
 int display_init(void)
 {
     int node = adt_path_offset(adt, "/arm-io/disp0");
@@ -474,7 +907,7 @@ int display_init(void)
     else
         printf("display: Display is internal\n");
 
-    if (cur_boot_args.video.width == 640 && cur_boot_args.video.height == 1136) {
+    if (display_is_dummy()) {
         printf("display: Dummy framebuffer found, initializing display\n");
         return display_configure(NULL);
     } else if (display_is_external) {
@@ -489,6 +922,9 @@ int display_init(void)
 
 void display_shutdown(dcp_shutdown_mode mode)
 {
+    display_swapchain_shutdown();
+    display_console_scaled(false);
+
     if (iboot) {
         dcp_ib_shutdown(iboot);
         switch (mode) {
@@ -3,6 +3,7 @@
 #ifndef DISPLAY_H
 #define DISPLAY_H
 
+#include "rtkit.h"
 #include "types.h"
 
 typedef enum _dcp_shutdown_mode {
@@ -14,8 +15,13 @@ typedef enum _dcp_shutdown_mode {
 extern bool display_is_external;
 
 int display_init(void);
+rtkit_dev_t *display_start_early(void);
 int display_start_dcp(void);
 int display_configure(const char *config);
+int display_swapchain_init(int count);
+int display_swapchain_present(void);
+void display_swapchain_shutdown(void);
+int display_console_scaled(bool enable);
 void display_shutdown(dcp_shutdown_mode mode);
 
 #endif
@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: MIT */
+
+#include <errno.h>
+#include <malloc.h>
+
+#include "../heapblock.h"
+#include "../memory.h"
+#include "../smp.h"
+#include "../utils.h"
+
+/*
+ * Per-CPU malloc arenas.
+ *
+ * The boot CPU allocates from the global dlmalloc state as before. Every secondary gets its own
+ * mspace on its first allocation, seeded with ARENA_SIZE from heapblock and grown from there like
+ * the global one, so code running in parallel only shares a lock when it frees memory another CPU
+ * allocated. Until the MMU (and with it spinlocks) is up, or if an arena can't be set up,
+ * everything falls back to the global state.
+ */
+
+#define ARENA_SIZE SZ_1M
+
+typedef void *mspace;
+
+mspace create_mspace_with_base(void *base, size_t capacity, int locked);
+void *mspace_malloc(mspace msp, size_t bytes);
+void *mspace_calloc(mspace msp, size_t n_elements, size_t elem_size);
+void *mspace_memalign(mspace msp, size_t alignment, size_t bytes);
+size_t mspace_footprint(mspace msp);
+size_t mspace_max_footprint(mspace msp);
+struct mallinfo mspace_mallinfo(mspace msp);
+
+void *dlmalloc(size_t);
+void dlfree(void *);
+void *dlcalloc(size_t, size_t);
+void *dlrealloc(void *, size_t);
+void *dlrealloc_in_place(void *, size_t);
+void *dlmemalign(size_t, size_t);
+int dlposix_memalign(void **, size_t, size_t);
+struct mallinfo dlmallinfo(void);
+size_t dlmalloc_footprint(void);
+size_t dlmalloc_max_footprint(void);
+
+static mspace arenas[MAX_CPUS];
+static bool arena_failed[MAX_CPUS];
+
+static mspace arena_get(void)
+{
+    int cpu = smp_id();
+
+    if (!cpu || !mmu_active())
+        return NULL;
+
+    if (arenas[cpu] || arena_failed[cpu])
+        return arenas[cpu];
+
+    void *base = heapblock_alloc_aligned(ARENA_SIZE, SZ_16K);
+    mspace msp = create_mspace_with_base(base, ARENA_SIZE, 1);
+
+    if (!msp) {
+        printf("malloc: no arena for CPU %d, using the global heap\n", cpu);
+        arena_failed[cpu] = true;
+        return NULL;
+    }
+
+    __atomic_store_n(&arenas[cpu], msp, __ATOMIC_RELEASE);
+    return msp;
+}
+
+void *malloc(size_t size)
+{
+    mspace msp = arena_get();
+
+    return msp ? mspace_malloc(msp, size) : dlmalloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    mspace msp = arena_get();
+
+    return msp ? mspace_calloc(msp, count, size) : dlcalloc(count, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    mspace msp = arena_get();
+
+    return msp ? mspace_memalign(msp, align, size) : dlmemalign(align, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+    mspace msp = arena_get();
+
+    if (!msp)
+        return dlposix_memalign(ptr, align, size);
+
+    if (align % sizeof(void *) || (align & (align - 1)))
+        return EINVAL;
+
+    void *p = mspace_memalign(msp, align, size);
+    if (!p)
+        return ENOMEM;
+
+    *ptr = p;
+    return 0;
+}
+
+// These go to whichever state the chunk came from
+void free(void *ptr)
+{
+    dlfree(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    // Growing a NULL pointer is an allocation, keep it on this CPU's arena
+    if (!ptr)
+        return malloc(size);
+
+    return dlrealloc(ptr, size);
+}
+
+void *realloc_in_place(void *ptr, size_t size)
+{
+    return dlrealloc_in_place(ptr, size);
+}
+
+struct mallinfo mallinfo(void)
+{
+    struct mallinfo mi = dlmallinfo();
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        mspace msp = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+        if (!msp)
+            continue;
+
+        struct mallinfo ai = mspace_mallinfo(msp);
+        mi.arena += ai.arena;
+        mi.ordblks += ai.ordblks;
+        mi.hblkhd += ai.hblkhd;
+        mi.usmblks += ai.usmblks;
+        mi.uordblks += ai.uordblks;
+        mi.fordblks += ai.fordblks;
+        mi.keepcost += ai.keepcost;
+    }
+
+    return mi;
+}
+
+size_t malloc_footprint(void)
+{
+    size_t total = dlmalloc_footprint();
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        mspace msp = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+        if (msp)
+            total += mspace_footprint(msp);
+    }
+
+    return total;
+}
+
+// Sum of the per-arena peaks, which may not all have happened at the same time
+size_t malloc_max_footprint(void)
+{
+    size_t total = dlmalloc_max_footprint();
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        mspace msp = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+        if (msp)
+            total += mspace_max_footprint(msp);
+    }
+
+    return total;
+}
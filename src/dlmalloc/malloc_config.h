@@ -1,8 +1,10 @@
 /* SPDX-License-Identifier: MIT */
 
+#include <malloc.h>
 #include <string.h>
 
 #include "../heapblock.h"
+#include "../memory.h"
 #include "../utils.h"
 
 #define HAVE_MORECORE 1
@@ -13,7 +15,7 @@
 #define MORECORE_CONTIGUOUS   1
 #define MALLOC_ALIGNMENT      16
 #define ABORT                 panic("dlmalloc: internal error\n")
-#define NO_MALLINFO           1
+#define NO_MALLINFO           0
 #define NO_MALLOC_STATS       1
 #define malloc_getpagesize    16384
 #define LACKS_FCNTL_H         1
@@ -28,6 +30,42 @@
 #define LACKS_UNISTD_H        1
 #define MALLOC_FAILURE_ACTION panic("dlmalloc: out of memory\n");
 
+// The public entry points live in arena.c, which hands secondaries their own mspace. FOOTERS tags
+// every chunk with its mspace, so free() and realloc() find the right one from any CPU.
+#define USE_DL_PREFIX 1
+#define MSPACES       1
+#define FOOTERS       1
+
+// USB bring-up can run on a secondary while the boot CPU allocates. Before the MMU is up only the
+// boot CPU runs, and the exclusives in spin_lock() need cacheable memory anyway.
+#define USE_LOCKS        2
+#define MLOCK_T          spinlock_t
+#define INITIAL_LOCK(lk) (spin_init(lk), 0)
+#define DESTROY_LOCK(lk) (0)
+#define ACQUIRE_LOCK(lk) malloc_lock(lk)
+#define RELEASE_LOCK(lk) malloc_unlock(lk)
+#define TRY_LOCK(lk)     malloc_trylock(lk)
+
+static MLOCK_T malloc_global_mutex = SPINLOCK_INIT_NAMED("malloc_global_mutex");
+
+static inline int malloc_lock(spinlock_t *lock)
+{
+    if (mmu_active())
+        spin_lock(lock);
+    return 0;
+}
+
+static inline void malloc_unlock(spinlock_t *lock)
+{
+    if (mmu_active())
+        spin_unlock(lock);
+}
+
+static inline bool malloc_trylock(spinlock_t *lock)
+{
+    return mmu_active() ? spin_trylock(lock) : true;
+}
+
 static void *sbrk(intptr_t inc)
 {
     if (inc < 0)
@@ -306,7 +306,10 @@ void exc_sync(u64 *regs)
 
 void exc_irq(u64 *regs)
 {
-    u32 reason = aic_ack();
+    u32 reason = aic_dispatch();
+
+    if (!reason)
+        return;
 
     printf("Exception: IRQ (from %s) die: %lu type: %lu num: %lu mpidr: %lx\n",
            get_exception_source(0), FIELD_GET(AIC_EVENT_DIE, reason),
@@ -386,3 +389,44 @@ void exc_serr(u64 *regs)
     sysop("dsb sy");
     sysop("isb");
 }
+
+/*
+ * Runs at the target EL: calls every entry in order and stores its return value. For EL0 both
+ * the entries and the functions they point to are accessed through the EL0 aliases.
+ */
+static u64 el_call_run(struct el_call *calls, u64 count, u64 func_alias)
+{
+    for (u64 i = 0; i < count; i++) {
+        struct el_call *call = &calls[i];
+        uint64_t (*func)(u64, u64, u64, u64) = (void *)(call->func | func_alias);
+
+        call->retval = func(call->args[0], call->args[1], call->args[2], call->args[3]);
+    }
+
+    return count;
+}
+
+/*
+ * Batched versions of el0_call()/el1_call(): the whole list runs in a single transition to the
+ * target EL and back. If ticks is not NULL it receives the CNTPCT ticks spent in the batch,
+ * transitions included, which makes timing short functions at EL0/EL1 practical.
+ */
+u64 el0_call_batch(struct el_call *calls, u64 count, u64 *ticks)
+{
+    u64 start = mrs(CNTPCT_EL0);
+    u64 ret = el0_call(el_call_run, (u64)calls | REGION_RW_EL0, count, REGION_RWX_EL0, 0);
+
+    if (ticks)
+        *ticks = mrs(CNTPCT_EL0) - start;
+    return ret;
+}
+
+u64 el1_call_batch(struct el_call *calls, u64 count, u64 *ticks)
+{
+    u64 start = mrs(CNTPCT_EL0);
+    u64 ret = el1_call(el_call_run, (u64)calls, count, 0, 0);
+
+    if (ticks)
+        *ticks = mrs(CNTPCT_EL0) - start;
+    return ret;
+}
@@ -5,6 +5,9 @@
 
 #define SIZEOF_EXC_INFO (64 * 8)
 
+// Guard mode handled directly in the exception vectors, see _v_sp0_sync
+#define EXC_GUARD_FAST 0x101
+
 #ifndef __ASSEMBLER__
 
 #include <assert.h>
@@ -38,6 +41,7 @@ struct exc_info {
 };
 static_assert(sizeof(struct exc_info) <= SIZEOF_EXC_INFO, "Please increase SIZEOF_EXC_INFO");
 static_assert((sizeof(struct exc_info) & 15) == 0, "SIZEOF_EXC_INFO must be a multiple of 16");
+static_assert(EXC_GUARD_FAST == (GUARD_SKIP | GUARD_SILENT), "EXC_GUARD_FAST mismatch");
 
 extern volatile enum exc_guard_t exc_guard;
 extern volatile int exc_count;
@@ -50,6 +54,15 @@ void print_regs(u64 *regs, int el12);
 uint64_t el0_call(void *func, uint64_t a, uint64_t b, uint64_t c, uint64_t d);
 uint64_t el1_call(void *func, uint64_t a, uint64_t b, uint64_t c, uint64_t d);
 
+struct el_call {
+    u64 func;
+    u64 args[4];
+    u64 retval;
+};
+
+u64 el0_call_batch(struct el_call *calls, u64 count, u64 *ticks);
+u64 el1_call_batch(struct el_call *calls, u64 count, u64 *ticks);
+
 #endif
 
 #endif
@@ -10,10 +10,30 @@
 #include "utils.h"
 #include "xnuboot.h"
 
-#define FB_DEPTH_MASK 0xff
+#define FB_DAMAGE_MAX 8
+
+#define FB_FONT_FIRST 0x20
+#define FB_FONT_COUNT (0x7f - FB_FONT_FIRST)
+
+#define FB_CONSOLE_TEXT_SIZE   32768
+#define FB_CONSOLE_RENDER_USEC 20000
 
 fb_t fb;
 
+struct fb_rect {
+    u32 x0, y0, x1, y1;
+};
+
+/*
+ * Regions of the shadow framebuffer that differ from the real one. Touching or overlapping
+ * rectangles are merged as they come in; once the list is full, a new rectangle is folded into
+ * whichever existing one grows the least.
+ */
+static struct {
+    u32 count;
+    struct fb_rect rect[FB_DAMAGE_MAX];
+} damage;
+
 struct image {
     u32 *ptr;
     u32 width;
@@ -23,6 +43,7 @@ struct image {
 static struct {
     struct {
         u8 *ptr;
+        u32 *glyphs;
         u32 width;
         u32 height;
     } font;
@@ -42,8 +63,20 @@ static struct {
 
     bool initialized;
     bool active;
+    bool deferred;
 } console;
 
+/*
+ * Text written to the console in deferred mode but not yet drawn. Lines that would scroll off the
+ * screen before the next render are never drawn at all.
+ */
+static struct {
+    char buf[FB_CONSOLE_TEXT_SIZE];
+    size_t rp;
+    size_t wp;
+    u64 next_render;
+} pending;
+
 extern u8 _binary_build_bootlogo_128_bin_start[];
 extern u8 _binary_build_bootlogo_256_bin_start[];
 
@@ -65,9 +98,108 @@ const struct image logo_256 = {
 const struct image *logo;
 struct image orig_logo;
 
+/* Where fb_set_surface() moved the console, instead of the boot framebuffer */
+static struct {
+    u32 *ptr;
+    u32 stride;
+    u32 width;
+    u32 height;
+} surface;
+
+static inline u64 fb_rect_area(const struct fb_rect *r)
+{
+    return (u64)(r->x1 - r->x0) * (r->y1 - r->y0);
+}
+
+static inline void fb_rect_union(struct fb_rect *a, const struct fb_rect *b)
+{
+    a->x0 = min(a->x0, b->x0);
+    a->y0 = min(a->y0, b->y0);
+    a->x1 = max(a->x1, b->x1);
+    a->y1 = max(a->y1, b->y1);
+}
+
+static void fb_damage(u32 x, u32 y, u32 w, u32 h)
+{
+    struct fb_rect r = {
+        .x0 = min(x, fb.width),
+        .y0 = min(y, fb.height),
+        .x1 = min(x + w, fb.width),
+        .y1 = min(y + h, fb.height),
+    };
+
+    if (r.x0 >= r.x1 || r.y0 >= r.y1)
+        return;
+
+    // Keep absorbing rectangles that touch the new one until none are left
+    for (u32 i = 0; i < damage.count;) {
+        struct fb_rect *d = &damage.rect[i];
+
+        if (d->x0 <= r.x1 && r.x0 <= d->x1 && d->y0 <= r.y1 && r.y0 <= d->y1) {
+            fb_rect_union(&r, d);
+            damage.rect[i] = damage.rect[--damage.count];
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    if (damage.count < FB_DAMAGE_MAX) {
+        damage.rect[damage.count++] = r;
+        return;
+    }
+
+    u32 best = 0;
+    u64 best_growth = ~0UL;
+    for (u32 i = 0; i < damage.count; i++) {
+        struct fb_rect u = damage.rect[i];
+        fb_rect_union(&u, &r);
+
+        u64 growth = fb_rect_area(&u) - fb_rect_area(&damage.rect[i]);
+        if (growth < best_growth) {
+            best = i;
+            best_growth = growth;
+        }
+    }
+
+    fb_rect_union(&damage.rect[best], &r);
+}
+
+static void fb_damage_all(void)
+{
+    damage.count = 0;
+    fb_damage(0, 0, fb.width, fb.height);
+}
+
 void fb_update(void)
 {
-    memcpy128(fb.hwptr, fb.ptr, fb.size);
+    for (u32 i = 0; i < damage.count; i++) {
+        const struct fb_rect *r = &damage.rect[i];
+
+        if (r->x0 == 0 && r->x1 == fb.width) {
+            // Full rows are contiguous, including the padding at the end of each one
+            u32 start = r->y0 * fb.stride;
+            memcpy128(fb.hwptr + start, fb.ptr + start, (r->y1 - r->y0) * fb.stride * 4);
+            continue;
+        }
+
+        // memcpy128 moves 16 bytes at a time, so round the span out to 4 pixels
+        u32 x0 = ALIGN_DOWN(r->x0, 4);
+        u32 x1 = min(ALIGN_UP(r->x1, 4), fb.stride);
+        for (u32 y = r->y0; y < r->y1; y++)
+            memcpy128(fb.hwptr + y * fb.stride + x0, fb.ptr + y * fb.stride + x0, (x1 - x0) * 4);
+    }
+
+    damage.count = 0;
+}
+
+/* Copy the whole shadow framebuffer to dst, which must have the same layout as the real one */
+void fb_copy(void *dst)
+{
+    if (!console.initialized)
+        return;
+
+    memcpy128(dst, fb.ptr, fb.size);
 }
 
 static void fb_clear_font_row(u32 row)
@@ -77,6 +209,9 @@ static void fb_clear_font_row(u32 row)
 
     for (u32 y = 0; y < console.font.height; ++y)
         memset32(fb.ptr + ystart + y * fb.stride, 0, row_size);
+
+    fb_damage(0, (console.margin.rows + row) * console.font.height, row_size / 4,
+              console.font.height);
 }
 
 static void fb_move_font_row(u32 dst, u32 src)
@@ -91,6 +226,8 @@ static void fb_move_font_row(u32 dst, u32 src)
     for (u32 y = 0; y < console.font.height; ++y)
         memcpy32(fb.ptr + ydst + y * fb.stride, fb.ptr + ysrc + y * fb.stride, row_size);
 
+    fb_damage(0, (console.margin.rows + dst) * console.font.height, row_size / 4,
+              console.font.height);
     fb_clear_font_row(src);
 }
 
@@ -109,48 +246,110 @@ static inline void fb_set_pixel(u32 x, u32 y, rgb_t c)
     fb.ptr[x + y * fb.stride] = rgb2pixel_30(c);
 }
 
-static inline rgb_t fb_get_pixel(u32 x, u32 y)
+/*
+ * Row converters from 8-bit little-endian XRGB (bytes R, G, B, X) and XBGR (bytes B, G, R, X) to
+ * the 30-bit framebuffer format, converting whole source words with shifts and masks. Two pixels
+ * go per 64-bit load and store when both rows are 8-byte aligned.
+ */
+#define FB_CHAN_X2 0x000000ff000000ffUL
+
+static inline u64 fb_to_30_x2(u64 v, bool bgr)
 {
-    return pixel2rgb_30(fb.ptr[x + y * fb.stride]);
+    u64 r = bgr ? (v >> 16) & FB_CHAN_X2 : v & FB_CHAN_X2;
+    u64 g = (v >> 8) & FB_CHAN_X2;
+    u64 b = bgr ? v & FB_CHAN_X2 : (v >> 16) & FB_CHAN_X2;
+
+    return (r << 22) | (g << 12) | (b << 2);
 }
 
-void fb_blit(u32 x, u32 y, u32 w, u32 h, void *data, u32 stride, pix_fmt_t pix_fmt)
+static inline void fb_convert_row(u32 *dst, const u8 *src, u32 w, bool bgr)
 {
-    u8 *p = data;
+    u32 j = 0;
 
-    for (u32 i = 0; i < h; i++) {
-        for (u32 j = 0; j < w; j++) {
-            rgb_t color;
-            switch (pix_fmt) {
-                default:
-                case PIX_FMT_XRGB:
-                    color.r = p[(j + i * stride) * 4];
-                    color.g = p[(j + i * stride) * 4 + 1];
-                    color.b = p[(j + i * stride) * 4 + 2];
-                    break;
-                case PIX_FMT_XBGR:
-                    color.r = p[(j + i * stride) * 4 + 2];
-                    color.g = p[(j + i * stride) * 4 + 1];
-                    color.b = p[(j + i * stride) * 4];
-                    break;
-            }
-            fb_set_pixel(x + j, y + i, color);
+    if (!(((uintptr_t)dst | (uintptr_t)src) & 7)) {
+        const u64 *s = (const u64 *)src;
+        u64 *d = (u64 *)dst;
+
+        for (; j + 2 <= w; j += 2)
+            *d++ = fb_to_30_x2(*s++, bgr);
+    }
+
+    if (!((uintptr_t)src & 3)) {
+        for (; j < w; j++)
+            dst[j] = fb_to_30_x2(((const u32 *)src)[j], bgr);
+    } else {
+        for (; j < w; j++) {
+            const u8 *p = &src[j * 4];
+            dst[j] = fb_to_30_x2(p[0] | (p[1] << 8) | (p[2] << 16), bgr);
         }
     }
+}
+
+static void fb_convert_row_xrgb(u32 *dst, const u8 *src, u32 w)
+{
+    fb_convert_row(dst, src, w, false);
+}
+
+static void fb_convert_row_xbgr(u32 *dst, const u8 *src, u32 w)
+{
+    fb_convert_row(dst, src, w, true);
+}
+
+typedef void (*fb_row_converter_t)(u32 *dst, const u8 *src, u32 w);
+
+static void fb_convert_row_neon_xrgb(u32 *dst, const u8 *src, u32 w)
+{
+    fb_convert_row_neon(dst, src, w, PIX_FMT_XRGB);
+}
+
+static void fb_convert_row_neon_xbgr(u32 *dst, const u8 *src, u32 w)
+{
+    fb_convert_row_neon(dst, src, w, PIX_FMT_XBGR);
+}
+
+static void fb_blit_rows(u32 x, u32 y, u32 w, u32 h, const u8 *p, u32 stride,
+                         fb_row_converter_t convert)
+{
+    for (u32 i = 0; i < h; i++)
+        convert(&fb.ptr[x + (y + i) * fb.stride], &p[i * stride * 4], w);
+    fb_damage(x, y, w, h);
     fb_update();
 }
 
+void fb_blit(u32 x, u32 y, u32 w, u32 h, void *data, u32 stride, pix_fmt_t pix_fmt)
+{
+    fb_blit_rows(x, y, w, h, data, stride,
+                 pix_fmt == PIX_FMT_XBGR ? fb_convert_row_xbgr : fb_convert_row_xrgb);
+}
+
+void fb_blit_simd(u32 x, u32 y, u32 w, u32 h, void *data, u32 stride, pix_fmt_t pix_fmt)
+{
+    fb_blit_rows(x, y, w, h, data, stride,
+                 pix_fmt == PIX_FMT_XBGR ? fb_convert_row_neon_xbgr : fb_convert_row_neon_xrgb);
+}
+
 void fb_unblit(u32 x, u32 y, u32 w, u32 h, void *data, u32 stride)
 {
     u8 *p = data;
 
     for (u32 i = 0; i < h; i++) {
-        for (u32 j = 0; j < w; j++) {
-            rgb_t color = fb_get_pixel(x + j, y + i);
-            p[(j + i * stride) * 4] = color.r;
-            p[(j + i * stride) * 4 + 1] = color.g;
-            p[(j + i * stride) * 4 + 2] = color.b;
-            p[(j + i * stride) * 4 + 3] = 0xff;
+        const u32 *row = &fb.ptr[x + (y + i) * fb.stride];
+        u8 *out = &p[i * stride * 4];
+
+        if (!((uintptr_t)out & 3)) {
+            for (u32 j = 0; j < w; j++) {
+                u32 c = row[j];
+                ((u32 *)out)[j] = ((c >> 22) & 0xff) | (((c >> 12) & 0xff) << 8) |
+                                  (((c >> 2) & 0xff) << 16) | 0xff000000;
+            }
+        } else {
+            for (u32 j = 0; j < w; j++) {
+                rgb_t color = pixel2rgb_30(row[j]);
+                out[j * 4] = color.r;
+                out[j * 4 + 1] = color.g;
+                out[j * 4 + 2] = color.b;
+                out[j * 4 + 3] = 0xff;
+            }
         }
     }
 }
@@ -160,6 +359,7 @@ void fb_fill(u32 x, u32 y, u32 w, u32 h, rgb_t color)
     u32 c = rgb2pixel_30(color);
     for (u32 i = 0; i < h; i++)
         memset32(&fb.ptr[x + (y + i) * fb.stride], c, w * 4);
+    fb_damage(x, y, w, h);
     fb_update();
 }
 
@@ -167,6 +367,7 @@ void fb_clear(rgb_t color)
 {
     u32 c = rgb2pixel_30(color);
     memset32(fb.ptr, c, fb.stride * fb.height * 4);
+    fb_damage_all();
     fb_update();
 }
 
@@ -215,7 +416,7 @@ void fb_improve_logo(void)
 
 static inline rgb_t font_get_pixel(u8 c, u32 x, u32 y)
 {
-    c -= 0x20;
+    c -= FB_FONT_FIRST;
     u8 v =
         console.font.ptr[c * console.font.width * console.font.height + y * console.font.width + x];
 
@@ -223,14 +424,67 @@ static inline rgb_t font_get_pixel(u8 c, u32 x, u32 y)
     return col;
 }
 
+/* Pre-render every glyph in the framebuffer's pixel format, so drawing one is just row copies */
+static void fb_render_glyphs(void)
+{
+    const u32 glyph_size = console.font.width * console.font.height;
+
+    free(console.font.glyphs);
+    console.font.glyphs = malloc(FB_FONT_COUNT * glyph_size * 4);
+    if (!console.font.glyphs)
+        return;
+
+    for (u32 c = 0; c < FB_FONT_COUNT; c++) {
+        u32 *glyph = &console.font.glyphs[c * glyph_size];
+
+        for (u32 y = 0; y < console.font.height; y++)
+            for (u32 x = 0; x < console.font.width; x++)
+                glyph[y * console.font.width + x] =
+                    rgb2pixel_30(font_get_pixel(c + FB_FONT_FIRST, x, y));
+    }
+}
+
 static void fb_putbyte(u8 c)
 {
     u32 x = (console.margin.cols + console.cursor.col) * console.font.width;
     u32 y = (console.margin.rows + console.cursor.row) * console.font.height;
 
-    for (u32 i = 0; i < console.font.height; i++)
-        for (u32 j = 0; j < console.font.width; j++)
-            fb_set_pixel(x + j, y + i, font_get_pixel(c, j, i));
+    if (console.font.glyphs) {
+        const u32 *glyph =
+            &console.font.glyphs[(c - FB_FONT_FIRST) * console.font.width * console.font.height];
+        u32 *dst = &fb.ptr[x + y * fb.stride];
+
+        for (u32 i = 0; i < console.font.height; i++) {
+            memcpy(dst, glyph, console.font.width * 4);
+            glyph += console.font.width;
+            dst += fb.stride;
+        }
+    } else {
+        for (u32 i = 0; i < console.font.height; i++)
+            for (u32 j = 0; j < console.font.width; j++)
+                fb_set_pixel(x + j, y + i, font_get_pixel(c, j, i));
+    }
+
+    fb_damage(x, y, console.font.width, console.font.height);
+}
+
+/* Advance a column position past c the same way fb_putchar does, returns true on a new row */
+static bool fb_console_advance(u32 *col, u8 c)
+{
+    if (c == '\r') {
+        *col = 0;
+        return false;
+    } else if (c == '\n') {
+        *col = 0;
+        return true;
+    }
+
+    if (++*col == console.cursor.max_col) {
+        *col = 0;
+        return true;
+    }
+
+    return false;
 }
 
 static void fb_putchar(u8 c)
@@ -268,8 +522,86 @@ void fb_console_scroll(u32 n)
     console.cursor.row -= n;
 }
 
+static inline u8 fb_pending_char(size_t p)
+{
+    return pending.buf[p % FB_CONSOLE_TEXT_SIZE];
+}
+
+static void fb_console_render(void)
+{
+    size_t p = pending.rp;
+    u32 rows = 0;
+    u32 col = console.cursor.col;
+
+    if (pending.rp == pending.wp)
+        return;
+
+    for (size_t i = p; i < pending.wp; i++)
+        rows += fb_console_advance(&col, fb_pending_char(i));
+
+    if (rows >= console.cursor.max_row) {
+        // Nothing currently on screen survives, start drawing at the first row that will
+        u32 skip = rows - (console.cursor.max_row - 1);
+
+        col = console.cursor.col;
+        while (skip)
+            skip -= fb_console_advance(&col, fb_pending_char(p++));
+
+        for (u32 row = 0; row < console.cursor.max_row; ++row)
+            fb_clear_font_row(row);
+        console.cursor.row = 0;
+        console.cursor.col = 0;
+    } else if (console.cursor.row + rows >= console.cursor.max_row) {
+        fb_console_scroll(console.cursor.row + rows - (console.cursor.max_row - 1));
+    }
+
+    for (; p < pending.wp; p++)
+        fb_putchar(fb_pending_char(p));
+
+    pending.rp = pending.wp;
+    pending.next_render = timeout_calculate(FB_CONSOLE_RENDER_USEC);
+    fb_update();
+}
+
+static void fb_console_defer(const char *bfr, size_t len)
+{
+    if (len > FB_CONSOLE_TEXT_SIZE) {
+        bfr += len - FB_CONSOLE_TEXT_SIZE;
+        len = FB_CONSOLE_TEXT_SIZE;
+    }
+
+    while (len) {
+        size_t wp = pending.wp % FB_CONSOLE_TEXT_SIZE;
+        size_t block = min(len, FB_CONSOLE_TEXT_SIZE - wp);
+
+        memcpy(&pending.buf[wp], bfr, block);
+        bfr += block;
+        len -= block;
+        pending.wp += block;
+    }
+
+    if (pending.wp - pending.rp > FB_CONSOLE_TEXT_SIZE)
+        pending.rp = pending.wp - FB_CONSOLE_TEXT_SIZE;
+}
+
+void fb_console_set_deferred(bool deferred)
+{
+    if (!deferred)
+        fb_console_render();
+
+    console.deferred = deferred;
+}
+
+void fb_console_flush(void)
+{
+    if (console.initialized)
+        fb_console_render();
+}
+
 void fb_console_reserve_lines(u32 n)
 {
+    fb_console_flush();
+
     if ((console.cursor.max_row - console.cursor.row) <= n)
         fb_console_scroll(1 + n - (console.cursor.max_row - console.cursor.row));
     fb_update();
@@ -282,6 +614,13 @@ ssize_t fb_console_write(const char *bfr, size_t len)
     if (!console.initialized || !console.active)
         return 0;
 
+    if (console.deferred) {
+        fb_console_defer(bfr, len);
+        if (timeout_expired(pending.next_render))
+            fb_console_render();
+        return len;
+    }
+
     while (len--) {
         fb_putchar(*bfr++);
         wrote++;
@@ -304,15 +643,23 @@ static ssize_t fb_console_iodev_write(void *opaque, const void *buf, size_t len)
     return fb_console_write(buf, len);
 }
 
+static void fb_console_iodev_flush(void *opaque)
+{
+    UNUSED(opaque);
+    fb_console_flush();
+}
+
 const struct iodev_ops iodev_fb_ops = {
     .can_write = fb_console_iodev_can_write,
     .write = fb_console_iodev_write,
+    .flush = fb_console_iodev_flush,
+    .handle_events = fb_console_iodev_flush,
 };
 
 struct iodev iodev_fb = {
     .ops = &iodev_fb_ops,
     .usage = USAGE_CONSOLE,
-    .lock = SPINLOCK_INIT,
+    .lock = SPINLOCK_INIT_NAMED("iodev_fb"),
 };
 
 static void fb_clear_console(void)
@@ -322,26 +669,47 @@ static void fb_clear_console(void)
 
     console.cursor.col = 0;
     console.cursor.row = 0;
+    pending.rp = pending.wp;
     fb_update();
 }
 
 void fb_init(bool clear)
 {
-    fb.hwptr = (void *)cur_boot_args.video.base;
-    fb.stride = cur_boot_args.video.stride / 4;
-    fb.width = cur_boot_args.video.width;
-    fb.height = cur_boot_args.video.height;
+    bool retina = cur_boot_args.video.depth & FB_DEPTH_FLAG_RETINA;
+
+    if (surface.ptr) {
+        // Already uncached, and at the low resolution the small font is the right one
+        fb.hwptr = surface.ptr;
+        fb.stride = surface.stride;
+        fb.width = surface.width;
+        fb.height = surface.height;
+        fb.size = surface.stride * 4 * surface.height;
+        retina = false;
+    } else {
+        fb.hwptr = (void *)cur_boot_args.video.base;
+        fb.stride = cur_boot_args.video.stride / 4;
+        fb.width = cur_boot_args.video.width;
+        fb.height = cur_boot_args.video.height;
+        fb.size = cur_boot_args.video.stride * cur_boot_args.video.height;
+    }
     fb.depth = cur_boot_args.video.depth & FB_DEPTH_MASK;
-    fb.size = cur_boot_args.video.stride * cur_boot_args.video.height;
     printf("fb init: %dx%d (%d) [s=%d] @%p\n", fb.width, fb.height, fb.depth, fb.stride, fb.hwptr);
 
-    mmu_add_mapping(cur_boot_args.video.base, cur_boot_args.video.base, ALIGN_UP(fb.size, 0x4000),
-                    MAIR_IDX_NORMAL_NC, PERM_RW);
+    // Write through the NC alias if it covers the framebuffer, otherwise remap it in place
+    void *nc = surface.ptr ? NULL : mmu_nc_alias(fb.hwptr, fb.size);
+    if (nc) {
+        dc_civac_range_auto(fb.hwptr, fb.size);
+        fb.hwptr = nc;
+    } else if (!surface.ptr) {
+        mmu_add_mapping(cur_boot_args.video.base, cur_boot_args.video.base,
+                        ALIGN_UP(fb.size, 0x4000), MAIR_IDX_NORMAL_NC, PERM_RW);
+    }
 
     fb.ptr = malloc(fb.size);
     memcpy(fb.ptr, fb.hwptr, fb.size);
+    damage.count = 0;
 
-    if (cur_boot_args.video.depth & FB_DEPTH_FLAG_RETINA) {
+    if (retina) {
         logo = &logo_256;
         console.font.ptr = _binary_build_font_retina_bin_start;
         console.font.width = 16;
@@ -352,16 +720,20 @@ void fb_init(bool clear)
         console.font.width = 8;
         console.font.height = 16;
     }
+    fb_render_glyphs();
 
-    if (!orig_logo.ptr) {
+    // Only the boot framebuffer has the logo the next stage expects to see
+    if (!orig_logo.ptr && !surface.ptr) {
         orig_logo = *logo;
         orig_logo.ptr = malloc(orig_logo.width * orig_logo.height * 4);
         fb_unblit_image((fb.width - orig_logo.width) / 2, (fb.height - orig_logo.height) / 2,
                         &orig_logo);
     }
 
-    if (clear)
+    if (clear) {
         memset32(fb.ptr, 0, fb.size);
+        fb_damage_all();
+    }
 
     console.margin.rows = 2;
     console.margin.cols = 4;
@@ -401,9 +773,38 @@ void fb_shutdown(bool restore_logo)
         free(orig_logo.ptr);
         orig_logo.ptr = NULL;
     }
+    free(console.font.glyphs);
+    console.font.glyphs = NULL;
     free(fb.ptr);
 }
 
+void fb_set_surface(void *ptr, u32 stride, u32 width, u32 height)
+{
+    bool initialized = console.initialized;
+    bool active = console.active;
+
+    if (initialized) {
+        fb_console_flush();
+        // Leave the boot framebuffer the way fb_shutdown(true) would for whoever shows it next
+        if (!surface.ptr) {
+            fb_clear_console();
+            fb_restore_logo();
+        }
+        fb_shutdown(false);
+    }
+
+    surface.ptr = ptr;
+    surface.stride = stride;
+    surface.width = width;
+    surface.height = height;
+
+    if (initialized) {
+        fb_init(true);
+        fb_display_logo();
+        fb_set_active(active);
+    }
+}
+
 void fb_reinit(void)
 {
     if (!console.initialized)
@@ -5,7 +5,10 @@
 
 #include "types.h"
 
+#define FB_DEPTH_MASK        0xff
 #define FB_DEPTH_FLAG_RETINA 0x10000
+// Set by display_configure(), tells later stages that the current mode is one m1n1 picked
+#define FB_DEPTH_FLAG_MODESET 0x8000
 
 typedef struct {
     u32 *ptr;   /* pointer to the start of the framebuffer */
@@ -38,10 +41,24 @@ static inline rgb_t int2rgb(u32 c)
 void fb_init(bool clear);
 void fb_shutdown(bool restore_logo);
 void fb_reinit(void);
+/*
+ * Moves the console to a surface other than the boot framebuffer, in the same pixel format and
+ * already mapped uncached, such as one DCP scales up on scanout. NULL goes back to the boot
+ * framebuffer. Whatever was on the console is cleared either way.
+ */
+void fb_set_surface(void *ptr, u32 stride, u32 width, u32 height);
 void fb_update(void);
+void fb_copy(void *dst);
 void fb_set_active(bool active);
 
 void fb_blit(u32 x, u32 y, u32 w, u32 h, void *data, u32 stride, pix_fmt_t format);
+/*
+ * Same as fb_blit, but converts with NEON. This clobbers SIMD registers, so only use it from
+ * contexts that own them (not from exception or hypervisor handlers, where they belong to
+ * whatever was interrupted).
+ */
+void fb_blit_simd(u32 x, u32 y, u32 w, u32 h, void *data, u32 stride, pix_fmt_t format);
+void fb_convert_row_neon(u32 *dst, const u8 *src, u32 w, pix_fmt_t format);
 void fb_unblit(u32 x, u32 y, u32 w, u32 h, void *data, u32 stride);
 void fb_fill(u32 x, u32 y, u32 w, u32 h, rgb_t color);
 void fb_clear(rgb_t color);
@@ -53,5 +70,11 @@ void fb_improve_logo(void);
 void fb_console_scroll(u32 n);
 void fb_console_reserve_lines(u32 n);
 ssize_t fb_console_write(const char *bfr, size_t len);
+/*
+ * In deferred mode, console writes are only buffered and get drawn in batches: at most every
+ * 20ms on write, and whenever the console is flushed or polled while idle.
+ */
+void fb_console_set_deferred(bool deferred);
+void fb_console_flush(void);
 
 #endif
@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: MIT */
+
+#include <arm_neon.h>
+
+#include "fb.h"
+
+static inline uint32x4_t pack_30(uint16x4_t r, uint16x4_t g, uint16x4_t b)
+{
+    uint32x4_t v = vshlq_n_u32(vmovl_u16(r), 22);
+    v = vorrq_u32(v, vshlq_n_u32(vmovl_u16(g), 12));
+    return vorrq_u32(v, vshlq_n_u32(vmovl_u16(b), 2));
+}
+
+void fb_convert_row_neon(u32 *dst, const u8 *src, u32 w, pix_fmt_t format)
+{
+    bool bgr = format == PIX_FMT_XBGR;
+    u32 j = 0;
+
+    for (; j + 16 <= w; j += 16, src += 64, dst += 16) {
+        uint8x16x4_t px = vld4q_u8(src);
+        uint8x16_t r8 = bgr ? px.val[2] : px.val[0];
+        uint8x16_t b8 = bgr ? px.val[0] : px.val[2];
+
+        uint16x8_t r_lo = vmovl_u8(vget_low_u8(r8)), r_hi = vmovl_high_u8(r8);
+        uint16x8_t g_lo = vmovl_u8(vget_low_u8(px.val[1])), g_hi = vmovl_high_u8(px.val[1]);
+        uint16x8_t b_lo = vmovl_u8(vget_low_u8(b8)), b_hi = vmovl_high_u8(b8);
+
+        vst1q_u32(dst, pack_30(vget_low_u16(r_lo), vget_low_u16(g_lo), vget_low_u16(b_lo)));
+        vst1q_u32(dst + 4,
+                  pack_30(vget_high_u16(r_lo), vget_high_u16(g_lo), vget_high_u16(b_lo)));
+        vst1q_u32(dst + 8, pack_30(vget_low_u16(r_hi), vget_low_u16(g_hi), vget_low_u16(b_hi)));
+        vst1q_u32(dst + 12,
+                  pack_30(vget_high_u16(r_hi), vget_high_u16(g_hi), vget_high_u16(b_hi)));
+    }
+
+    for (; j < w; j++, src += 4, dst++) {
+        u8 r = bgr ? src[2] : src[0];
+        u8 b = bgr ? src[0] : src[2];
+        *dst = (b << 2) | (src[1] << 12) | (r << 22);
+    }
+}
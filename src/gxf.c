@@ -112,3 +112,36 @@ uint64_t gl1_call(void *func, uint64_t a, uint64_t b, uint64_t c, uint64_t d)
 
     return ret;
 }
+
+/*
+ * Runs in GL: calls every entry in order and stores its return value, stopping after the first
+ * one that took an exception. Returns the number of calls that completed.
+ */
+static u64 gl_call_run(struct gl_call *calls, u64 count)
+{
+    for (u64 i = 0; i < count; i++) {
+        struct gl_call *call = &calls[i];
+        uint64_t (*func)(u64, u64, u64, u64) = (void *)call->func;
+        int exc_start = exc_count;
+
+        call->retval = func(call->args[0], call->args[1], call->args[2], call->args[3]);
+        if (exc_count != exc_start)
+            return i;
+    }
+
+    return count;
+}
+
+/*
+ * Batched versions of gl1_call()/gl2_call(): SPRR/GXF are set up and GL entered once for the
+ * whole list instead of once per call, which is what dominates short calls.
+ */
+u64 gl1_call_batch(struct gl_call *calls, u64 count)
+{
+    return gl1_call(gl_call_run, (u64)calls, count, 0, 0);
+}
+
+u64 gl2_call_batch(struct gl_call *calls, u64 count)
+{
+    return gl2_call(gl_call_run, (u64)calls, count, 0, 0);
+}
@@ -17,6 +17,15 @@ void gxf_init(void);
 uint64_t gl1_call(void *func, uint64_t a, uint64_t b, uint64_t c, uint64_t d);
 uint64_t gl2_call(void *func, uint64_t a, uint64_t b, uint64_t c, uint64_t d);
 
+struct gl_call {
+    u64 func;
+    u64 args[4];
+    u64 retval;
+};
+
+u64 gl1_call_batch(struct gl_call *calls, u64 count);
+u64 gl2_call_batch(struct gl_call *calls, u64 count);
+
 #endif
 
 #endif
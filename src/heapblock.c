@@ -2,6 +2,8 @@
 
 #include "heapblock.h"
 #include "assert.h"
+#include "memory.h"
+#include "memstats.h"
 #include "types.h"
 #include "utils.h"
 #include "xnuboot.h"
@@ -13,9 +15,26 @@
  * available at the returned pointer as long as no other malloc/heapblock calls occur, which is
  * useful as a buffer for unknown-length uncompressed data. A subsequent call with a size will then
  * actually reserve the block.
+ *
+ * Other CPUs may allocate at the same time once the MMU is up, so anyone relying on the top of the
+ * heap staying put holds it with heapblock_claim_top()/heapblock_release_top(). The lock is per
+ * CPU recursive: the holder can still allocate, everyone else waits.
  */
 
 static void *heap_base;
+static DECLARE_SPINLOCK(heap_lock);
+
+static void heap_lock_take(void)
+{
+    if (mmu_active())
+        spin_lock(&heap_lock);
+}
+
+static void heap_lock_drop(void)
+{
+    if (mmu_active())
+        spin_unlock(&heap_lock);
+}
 
 void heapblock_init(void)
 {
@@ -37,8 +56,34 @@ void *heapblock_alloc_aligned(size_t size, size_t align)
     assert((align & (align - 1)) == 0);
     assert(heap_base);
 
+    heap_lock_take();
     uintptr_t block = (((uintptr_t)heap_base) + align - 1) & ~(align - 1);
+    if (size)
+        memstat_alloc(MEMSTAT_HEAPBLOCK, block + size - (uintptr_t)heap_base);
     heap_base = (void *)(block + size);
+    heap_lock_drop();
 
     return (void *)block;
 }
+
+void *heapblock_claim_top(size_t align)
+{
+    heap_lock_take();
+    return heapblock_alloc_aligned(0, align);
+}
+
+void heapblock_release_top(void)
+{
+    heap_lock_drop();
+}
+
+bool heapblock_extend(void *end, size_t size)
+{
+    heap_lock_take();
+    bool ret = end == heap_base;
+    if (ret)
+        heapblock_alloc_aligned(size, 1);
+    heap_lock_drop();
+
+    return ret;
+}
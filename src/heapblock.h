@@ -10,4 +10,8 @@ void heapblock_init(void);
 void *heapblock_alloc(size_t size);
 void *heapblock_alloc_aligned(size_t size, size_t align);
 
+void *heapblock_claim_top(size_t align);
+void heapblock_release_top(void);
+bool heapblock_extend(void *end, size_t size);
+
 #endif
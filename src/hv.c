@@ -12,7 +12,8 @@
 #include "usb.h"
 #include "utils.h"
 
-#define HV_TICK_RATE 1000
+#define HV_TICK_RATE      1000
+#define HV_TICK_IDLE_RATE 100
 
 DECLARE_SPINLOCK(bhl);
 
@@ -23,6 +24,16 @@ extern char _hv_vectors_start[0];
 
 u64 hv_tick_interval;
 
+/*
+ * The interruptible CPU ticks at hv_tick_interval while there is host or vuart traffic, and
+ * doubles its period on every idle tick up to hv_tick_idle_interval. The other CPUs don't poll
+ * anything and always tick at hv_tick_interval.
+ */
+static u32 hv_tick_idle_rate = HV_TICK_IDLE_RATE;
+static u64 hv_tick_idle_interval;
+static u64 hv_tick_cur;
+static bool hv_tick_fixed;
+
 int hv_pinned_cpu;
 int hv_want_cpu;
 
@@ -56,6 +67,8 @@ void hv_init(void)
         display_shutdown(DCP_QUIESCED);
     // reenable hpm interrupts for the guest for unused iodevs
     usb_hpm_restore_irqs(0);
+    // IRQs belong to the guest from now on, go back to polling for USB events
+    usb_iodev_set_irq_mode(false);
     smp_start_secondaries();
     smp_set_wfe_mode(true);
     hv_wdt_init();
@@ -78,7 +91,7 @@ void hv_init(void)
     msr(VBAR_EL12, 0);
 
     // Compute tick interval
-    hv_tick_interval = mrs(CNTFRQ_EL0) / HV_TICK_RATE;
+    hv_set_tick_rate(0);
 
     sysop("dsb ishst");
     sysop("tlbi alle1is");
@@ -304,12 +317,60 @@ void hv_set_elr(u64 val)
         return msr(ELR_EL2, val);
 }
 
+static int hv_interruptible_cpu(void)
+{
+    return hv_pinned_cpu == -1 ? 0 : hv_pinned_cpu;
+}
+
 void hv_arm_tick(void)
 {
-    msr(CNTP_TVAL_EL0, hv_tick_interval);
+    u64 interval = hv_tick_interval;
+
+    if (smp_id() == hv_interruptible_cpu())
+        interval = hv_tick_cur;
+
+    msr(CNTP_TVAL_EL0, interval);
     msr(CNTP_CTL_EL0, CNTx_CTL_ENABLE);
 }
 
+static void hv_tick_update_idle(void)
+{
+    if (hv_tick_fixed || !hv_tick_idle_rate)
+        hv_tick_idle_interval = hv_tick_interval;
+    else
+        hv_tick_idle_interval = max(mrs(CNTFRQ_EL0) / hv_tick_idle_rate, hv_tick_interval);
+
+    hv_tick_cur = hv_tick_interval;
+}
+
+/*
+ * Ticks never get slower than HV_TICK_RATE, 0 goes back to the default. Any explicit rate (as
+ * used for profiling) also turns off the idle backoff, so ticks stay evenly spaced.
+ */
+void hv_set_tick_rate(u32 rate)
+{
+    hv_tick_interval = mrs(CNTFRQ_EL0) / max(rate, HV_TICK_RATE);
+    hv_tick_fixed = rate != 0;
+    hv_tick_update_idle();
+}
+
+/* Slowest rate the interruptible CPU backs off to when idle, 0 means never back off */
+void hv_set_tick_idle_rate(u32 rate)
+{
+    hv_tick_idle_rate = rate;
+    hv_tick_update_idle();
+}
+
+/* Something is going on, go back to the fast tick (right away if this is the CPU that polls) */
+void hv_tick_kick(void)
+{
+    hv_tick_cur = hv_tick_interval;
+
+    if (smp_id() == hv_interruptible_cpu() && (mrs(CNTP_CTL_EL0) & CNTx_CTL_ENABLE) &&
+        (s32)mrs(CNTP_TVAL_EL0) > (s64)hv_tick_interval)
+        msr(CNTP_TVAL_EL0, hv_tick_interval);
+}
+
 void hv_maybe_exit(void)
 {
     if (hv_should_exit) {
@@ -319,11 +380,23 @@ void hv_maybe_exit(void)
 
 void hv_tick(struct exc_info *ctx)
 {
+    bool busy = false;
+
     hv_wdt_pet();
     iodev_handle_events(uartproxy_iodev);
     if (iodev_can_read(uartproxy_iodev)) {
+        busy = true;
         if (hv_pinned_cpu == -1 || hv_pinned_cpu == smp_id())
             hv_exc_proxy(ctx, START_HV, HV_USER_INTERRUPT, NULL);
     }
-    hv_vuart_poll();
+    busy |= hv_vuart_poll();
+    busy |= hv_pvchan_poll();
+    busy |= hv_aic_poll();
+    hv_trace_budget_poll();
+    busy |= !uartproxy_flush_events(false);
+
+    if (busy)
+        hv_tick_cur = hv_tick_interval;
+    else
+        hv_tick_cur = min(hv_tick_cur * 2, hv_tick_idle_interval);
 }
@@ -25,12 +25,262 @@ struct hv_evt_mmiotrace {
     u64 data;
 };
 
+/* EVT_MMIOTRACE_BATCH: header followed by count struct hv_evt_mmiotrace records */
+struct hv_evt_mmiotrace_batch {
+    u32 count;
+    u32 dropped;
+};
+
+typedef enum _hv_trace_batch_mode {
+    HV_TRACE_BATCH_OFF = 0, // one event per record, as before
+    HV_TRACE_BATCH_BLOCK,   // flush the batch when full, stalling the guest
+    HV_TRACE_BATCH_DROP,    // drop records when full, until the next flush
+} hv_trace_batch_mode;
+
+#define HV_TRACE_FILTER_READ      BIT(0)
+#define HV_TRACE_FILTER_WRITE     BIT(1)
+#define HV_TRACE_FILTER_ON_CHANGE BIT(2)
+
+/*
+ * Narrows down which traced accesses in [start, end) are emitted. An access matches if
+ * ((ipa - start) & offset_mask) == offset_match and (data & value_mask) == value_match.
+ * ON_CHANGE keeps a single last value per filter, so it is meant for filters matching one
+ * register.
+ */
+struct hv_trace_filter {
+    u64 start;
+    u64 end;
+    u64 offset_mask;
+    u64 offset_match;
+    u64 value_mask;
+    u64 value_match;
+    u32 flags;
+    u32 min_interval_us;
+};
+
+#define HV_TRACE_BUDGET_HW BIT(0)
+
+/*
+ * Per-page fault budget for traced pages. A page taking more than max_faults traced faults in a
+ * second is demoted for cooldown_ms: only every sample_every-th access is traced (none if 0), or
+ * with HV_TRACE_BUDGET_HW a page mapped as a whole is handed straight to the hardware instead.
+ */
+struct hv_trace_budget {
+    u32 max_faults;
+    u32 sample_every;
+    u32 cooldown_ms;
+    u32 flags;
+};
+
+typedef enum _hv_trace_demote_mode {
+    HV_TRACE_DEMOTE_NONE = 0,
+    HV_TRACE_DEMOTE_SAMPLED,
+    HV_TRACE_DEMOTE_HW,
+} hv_trace_demote_mode;
+
+/* EVT_TRACE_DEMOTE: faults is the count that tripped the budget, or the ones seen while sampled */
+struct hv_evt_trace_demote {
+    u64 addr;
+    u32 mode;
+    u32 faults;
+};
+
+typedef enum _hv_native_hook_type {
+    HV_NATIVE_HOOK_CONST = 0, // reads return value, writes are discarded
+    HV_NATIVE_HOOK_SHADOW,    // reads return the last value written (initially value)
+    HV_NATIVE_HOOK_MASK,      // bits in mask are forced to value on write, reads pass through
+    HV_NATIVE_HOOK_COUNT,     // pass through, only count accesses
+} hv_native_hook_type;
+
+/* Simple MMIO hooks handled entirely at EL2, covering the guest IPA range [start, end) */
+struct hv_native_hook {
+    u64 start;
+    u64 end;
+    u32 type;
+    u32 reserved;
+    u64 value;
+    u64 mask;
+};
+
+#define HV_SHADOW_FORWARD_HOST  BIT(0) // uncached accesses go to the host as proxy hook hook_id
+#define HV_SHADOW_ABSORB_WRITES BIT(1) // writes to cached words only update the shadow
+
+/*
+ * Shadowed register block for the guest IPA range [start, end). cached is a bitmap with one bit
+ * per 32-bit word; reads covering only cached words are served from the shadow buffer, and writes
+ * to them update it. Everything else goes to the hardware at the same address, or to the host.
+ * Both buffers belong to the host, which updates them directly.
+ */
+struct hv_shadow_regs {
+    u64 start;
+    u64 end;
+    u64 shadow;
+    u64 cached;
+    u32 flags;
+    u32 hook_id;
+};
+
+typedef enum _hv_sysreg_emu_type {
+    HV_SYSREG_PASS = 0, // access target
+    HV_SYSREG_CONST,    // reads return value, writes are discarded
+    HV_SYSREG_SHADOW,   // per-CPU shadow register, initially value
+    HV_SYSREG_WI,       // reads come from target, writes are discarded
+    HV_SYSREG_LOG,      // like PASS, but print every access
+} hv_sysreg_emu_type;
+
+/*
+ * Trapped sysreg emulated at EL2 instead of in the host. Registers are given as their ESR ISS
+ * encoding with Rt and direction masked off; target 0 means the trapped register itself.
+ */
+struct hv_sysreg_emu {
+    u32 sysreg;
+    u32 target;
+    u32 type;
+    u32 reserved;
+    u64 value;
+};
+
+/* EVT_EXC_ASYNC: snapshot of an exit the host only observes, the guest has already resumed */
+struct hv_evt_exc_async {
+    u32 reason;
+    u32 type;
+    struct exc_info ctx;
+};
+
+#define HV_STATS_EC_COUNT     64
+#define HV_STATS_SPTE_TYPES   8
+#define HV_STATS_MSR_SLOTS    32
+#define HV_STATS_HIST_BUCKETS 24
+
+struct hv_stats_msr {
+    u32 sysreg; // ESR ISS encoding, Rt and direction masked off
+    u32 reserved;
+    u64 count;
+};
+
+/*
+ * Per-CPU exit statistics. Times are in CNTPCT ticks; histogram bucket n counts events that took
+ * [2^n, 2^(n+1)) ticks, with the last bucket catching everything longer.
+ */
+struct hv_stats {
+    u64 sync_exits[HV_STATS_EC_COUNT]; // by ESR EC
+    u64 irq_exits;
+    u64 fiq_exits;
+    u64 fiq_fast_exits; // ticks handled without a full exit
+    u64 serr_exits;
+    u64 exit_ticks;
+    u64 exit_hist[HV_STATS_HIST_BUCKETS];
+    u64 dabort_spte[HV_STATS_SPTE_TYPES]; // by SPTE type
+    u64 msr_other;                        // traps that didn't fit in msr[]
+    struct hv_stats_msr msr[HV_STATS_MSR_SLOTS];
+    u64 proxy_calls;
+    u64 proxy_ticks; // time spent in uartproxy_run
+    u64 proxy_hist[HV_STATS_HIST_BUCKETS];
+    u64 stolen_ticks; // global plus this CPU's, from hv_set_time_stealing
+    u64 profile_samples;
+    u64 profile_dropped; // profiler ring buffer was full
+    u64 pmu_samples;
+    u64 pmu_dropped; // PMU sample ring buffer was full
+};
+
+#define HV_PROFILE_LR       BIT(0)
+#define HV_PROFILE_SP       BIT(1)
+#define HV_PROFILE_MAX_RATE 20000
+
+#define HV_PMU_COUNTERS   10
+#define HV_PMU_EL0        BIT(0)
+#define HV_PMU_EL1        BIT(1)
+#define HV_PMU_MAX_PERIOD (BIT(47) - 1) // the PMI fires when a counter carries into bit 47
+
+/*
+ * PMU sampling: m1n1 takes the core PMCs away from the guest (which then reads them as zero)
+ * and counts guest EL0 and/or EL1 execution. PMC0 always counts cycles and PMC1 instructions,
+ * events[n] selects the event for PMCn from PMC2 up. Counters with a nonzero period raise a PMI
+ * every period events, which stores the guest PC, the PMSR overflow mask and the raw value of
+ * every enabled counter (lowest first) into a per-CPU ring buffer of size bytes.
+ */
+struct hv_pmu_config {
+    u32 counters; // bit n enables PMCn
+    u32 flags;
+    u8 events[HV_PMU_COUNTERS];
+    u8 reserved[6];
+    u64 period[HV_PMU_COUNTERS]; // 0: count only
+    u64 size;
+};
+
+#define HV_STEP_PC_IN  BIT(0) // stop when the PC is inside [pc_start, pc_end)
+#define HV_STEP_PC_OUT BIT(1) // stop when the PC is outside [pc_start, pc_end)
+#define HV_STEP_SYSREG BIT(2) // stop when (sysreg & sysreg_mask) == sysreg_value
+#define HV_STEP_MEM    BIT(3) // stop when (*(u64 *)mem_addr & mem_mask) == mem_value
+
+typedef enum _hv_step_stop {
+    HV_STEP_RUNNING = 0,
+    HV_STEP_STOP_COUNT,
+    HV_STEP_STOP_PC,
+    HV_STEP_STOP_SYSREG,
+    HV_STEP_STOP_MEM,
+} hv_step_stop;
+
+/*
+ * Single stepping handled in m1n1: the guest is stepped until one of the flags conditions holds
+ * (checked after every instruction) or count steps were taken, and only then does the step
+ * exception go to the host. sysreg is an ESR ISS encoding read as is at EL2, so EL1 registers
+ * need their _EL12 encoding; mem_addr is physical. If trace_size is nonzero, every PC stepped to
+ * is stored in the ring of trace_size u64 entries at trace_buf.
+ */
+struct hv_step_cond {
+    u64 count; // 0: no limit
+    u64 pc_start;
+    u64 pc_end;
+    u32 flags;
+    u32 sysreg;
+    u64 sysreg_mask;
+    u64 sysreg_value;
+    u64 mem_addr;
+    u64 mem_mask;
+    u64 mem_value;
+    u64 trace_buf;
+    u64 trace_size;
+};
+
+struct hv_step_status {
+    u32 stop; // hv_step_stop
+    u32 reserved;
+    u64 steps;
+    u64 trace_count; // total PCs traced, the ring holds the last trace_size of them
+};
+
+/* An exit parked while another CPU owns the proxy, info points to its struct exc_info */
+struct hv_pending_exit {
+    u32 cpu;
+    u32 reason;
+    u32 code;
+    u32 reserved;
+    u64 info;
+};
+
 struct hv_evt_irqtrace {
     u32 flags;
     u16 type;
     u16 num;
 };
 
+/* EVT_IRQTRACE_BATCH: header followed by count struct hv_evt_irqtrace records */
+struct hv_evt_irqtrace_batch {
+    u32 count;
+    u32 dropped;
+};
+
+/* One IRQ traced in counting mode, times are in CNTPCT ticks */
+struct hv_irq_counter {
+    u32 num;
+    u32 reserved;
+    u64 count;
+    u64 first;
+    u64 last;
+    u64 min_delta;
+};
+
 #define HV_MAX_RW_SIZE  64
 #define HV_MAX_RW_WORDS (HV_MAX_RW_SIZE >> 3)
 
@@ -49,37 +299,94 @@ typedef enum _hv_entry_type {
     HV_CPU_SWITCH,
 } hv_entry_type;
 
+/* One hv_map() call, as passed to hv_map_batch() */
+struct hv_map_desc {
+    u64 from;
+    u64 to;
+    u64 size;
+    u64 incr;
+};
+
 /* VM */
 void hv_pt_init(void);
 int hv_map(u64 from, u64 to, u64 size, u64 incr);
+int hv_map_batch(const struct hv_map_desc *descs, size_t count);
 int hv_unmap(u64 from, u64 size);
 int hv_map_hw(u64 from, u64 to, u64 size);
 int hv_map_sw(u64 from, u64 to, u64 size);
 int hv_map_hook(u64 from, hv_hook_t *hook, u64 size);
 u64 hv_translate(u64 addr, bool s1only, bool w, u64 *par_out);
+u64 hv_translate_ipa(u64 ipa);
+size_t hv_copy_va(void *buf, u64 va, size_t size, bool write);
 u64 hv_pt_walk(u64 addr);
+int hv_dirty_start(u64 base, u64 size);
+s64 hv_dirty_fetch(void *dst, size_t size, bool rearm);
+void hv_dirty_stop(void);
 bool hv_handle_dabort(struct exc_info *ctx);
 bool hv_pa_write(struct exc_info *ctx, u64 addr, u64 *val, int width);
 bool hv_pa_read(struct exc_info *ctx, u64 addr, u64 *val, int width);
 bool hv_pa_rw(struct exc_info *ctx, u64 addr, u64 *val, bool write, int width);
+void hv_set_trace_batch(hv_trace_batch_mode mode);
+void hv_trace_flush(void);
+void hv_xlate_invalidate(void);
+int hv_add_trace_filter(const struct hv_trace_filter *filter);
+void hv_clear_trace_filters(void);
+void hv_set_trace_budget(const struct hv_trace_budget *budget);
+void hv_trace_budget_poll(void);
 
 /* AIC events through tracing the MMIO event address */
 bool hv_trace_irq(u32 type, u32 num, u32 count, u32 flags);
+void hv_irqtrace_flush(void);
+bool hv_aic_poll(void);
+void hv_set_irq_delay(u64 usec);
+void hv_irqtrace_set_batch(hv_trace_batch_mode mode);
+s64 hv_irq_counters_fetch(void *buf, size_t size, bool reset);
 
 /* Virtual peripherals */
-void hv_vuart_poll(void);
+bool hv_vuart_poll(void);
 void hv_map_vuart(u64 base, int irq, iodev_id_t iodev);
+bool hv_pvchan_hvc(struct exc_info *ctx);
+bool hv_pvchan_poll(void);
+void hv_map_pvchan(iodev_id_t iodev);
+
+/* Native hooks */
+int hv_add_native_hook(const struct hv_native_hook *hook);
+u64 hv_get_native_hook_count(int index, bool write);
+int hv_add_shadow_regs(const struct hv_shadow_regs *regs);
+u64 hv_get_shadow_regs_count(int index, bool forwarded);
+
+/* Sysreg emulation */
+int hv_add_sysreg_emu(const struct hv_sysreg_emu *emu);
+void hv_clear_sysreg_emu(void);
+bool hv_sysreg_emulate(struct exc_info *ctx, u32 reg, u64 rt, bool is_read);
+bool hv_sysreg_watch_init(u32 reg);
+u64 hv_sysreg_watch_read(void);
 
 /* Exceptions */
 void hv_exc_proxy(struct exc_info *ctx, uartproxy_boot_reason_t reason, u32 type, void *extra);
-void hv_set_time_stealing(bool enabled, bool reset);
+void hv_exc_proxy_async(struct exc_info *ctx, uartproxy_boot_reason_t reason, u32 type);
+void hv_set_async_bps(u32 mask);
+int hv_step_start(const struct hv_step_cond *cond);
+int hv_step_get_status(struct hv_step_status *out, bool stop);
+int hv_profile_start(u32 rate, u32 flags, size_t size);
+void hv_profile_stop(void);
+ssize_t hv_profile_fetch(int cpu, void *dst, size_t size);
+int hv_pmu_start(const struct hv_pmu_config *cfg);
+void hv_pmu_stop(void);
+ssize_t hv_pmu_fetch(int cpu, void *dst, size_t size);
+void hv_set_time_stealing(bool enabled, bool reset, bool per_cpu);
+void hv_set_vtimer_forward(bool enabled);
+int hv_get_stats(int cpu, struct hv_stats *out, size_t size, bool reset);
+int hv_get_pending_exits(struct hv_pending_exit *out, size_t size);
+int hv_resolve_exit(int cpu, int ret);
+void hv_stats_dabort(u32 spte_type);
 
 /* WDT */
 void hv_wdt_pet(void);
 void hv_wdt_suspend(void);
 void hv_wdt_resume(void);
 void hv_wdt_init(void);
-void hv_wdt_start(int cpu);
+void hv_wdt_start(int cpu, u64 slow_usec);
 void hv_wdt_stop(void);
 void hv_wdt_breadcrumb(char c);
 
@@ -101,6 +408,9 @@ void hv_rendezvous(void);
 bool hv_switch_cpu(int cpu);
 void hv_pin_cpu(int cpu);
 void hv_arm_tick(void);
+void hv_set_tick_rate(u32 rate);
+void hv_set_tick_idle_rate(u32 rate);
+void hv_tick_kick(void);
 void hv_rearm(void);
 void hv_maybe_exit(void);
 void hv_tick(struct exc_info *ctx);
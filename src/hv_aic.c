@@ -3,14 +3,92 @@
 #include "adt.h"
 #include "aic.h"
 #include "aic_regs.h"
+#include "assert.h"
 #include "hv.h"
+#include "smp.h"
 #include "uartproxy.h"
 #include "utils.h"
 
-#define IRQTRACE_IRQ BIT(0)
+#define IRQTRACE_IRQ   BIT(0)
+#define IRQTRACE_COUNT BIT(1)
+#define IRQTRACE_DROP  BIT(2)
+#define IRQTRACE_DELAY BIT(3)
 
 static u32 trace_hw_num[AIC_MAX_DIES][AIC_MAX_HW_NUM / 32];
 
+/*
+ * Delivery policy, applied on-device by the AIC hook. Reading the event register masks the IRQ in
+ * hardware, so an IRQ the guest shouldn't see yet is simply kept from it and stays masked:
+ * dropped IRQs for good (guest unmasks are filtered), delayed ones until their deadline, when
+ * they are unmasked again and let through on the next hit.
+ */
+#define IRQ_DELAY_SLOTS 32
+
+struct irq_delayed {
+    u16 die;
+    u16 num;
+    u64 deadline;
+};
+
+static u32 drop_hw_num[AIC_MAX_DIES][AIC_MAX_HW_NUM / 32];
+static u32 delay_hw_num[AIC_MAX_DIES][AIC_MAX_HW_NUM / 32];
+static u32 released_hw_num[AIC_MAX_DIES][AIC_MAX_HW_NUM / 32];
+static u32 held_hw_num[AIC_MAX_DIES][AIC_MAX_HW_NUM / 32];
+
+static struct irq_delayed irq_delayed[IRQ_DELAY_SLOTS];
+static int irq_delayed_count;
+static u64 irq_delay_usec = 1000;
+
+#define IRQ_TEST(map, die, num)  ((map)[die][(num) / 32] & BIT((num)&31))
+#define IRQ_SET(map, die, num)   ((map)[die][(num) / 32] |= BIT((num)&31))
+#define IRQ_CLEAR(map, die, num) ((map)[die][(num) / 32] &= ~BIT((num)&31))
+
+/* Same as the MMIO trace batches, one event carries up to this many records */
+#define IRQTRACE_BATCH_RECORDS 256
+
+struct irqtrace_batch {
+    struct hv_evt_irqtrace_batch hdr;
+    struct hv_evt_irqtrace records[IRQTRACE_BATCH_RECORDS];
+};
+
+static_assert(sizeof(struct irqtrace_batch) <= 0xffff, "irqtrace batch too large");
+
+static struct irqtrace_batch irqtrace_batch[MAX_CPUS];
+static hv_trace_batch_mode irqtrace_batch_mode = HV_TRACE_BATCH_OFF;
+
+/*
+ * Counting mode: IRQs traced with IRQTRACE_COUNT only bump a counter and a few CNTPCT timestamps,
+ * which the host fetches whenever it likes. Slots are handed out on demand, irq_counter_slot
+ * holds the slot number + 1 for every counted IRQ.
+ */
+#define IRQ_COUNTER_SLOTS 64
+
+static struct hv_irq_counter irq_counters[IRQ_COUNTER_SLOTS];
+static u64 irq_counters_used;
+static u8 irq_counter_slot[AIC_MAX_DIES][AIC_MAX_HW_NUM];
+
+void hv_irqtrace_flush(void)
+{
+    struct irqtrace_batch *batch = &irqtrace_batch[smp_id()];
+
+    if (!batch->hdr.count && !batch->hdr.dropped)
+        return;
+
+    hv_wdt_suspend();
+    uartproxy_post_event(EVT_IRQTRACE_BATCH, batch,
+                         sizeof(batch->hdr) + batch->hdr.count * sizeof(batch->records[0]));
+    hv_wdt_resume();
+
+    batch->hdr.count = 0;
+    batch->hdr.dropped = 0;
+}
+
+void hv_irqtrace_set_batch(hv_trace_batch_mode mode)
+{
+    hv_irqtrace_flush();
+    irqtrace_batch_mode = mode;
+}
+
 static void emit_irqtrace(u16 die, u16 type, u16 num)
 {
     struct hv_evt_irqtrace evt = {
@@ -19,41 +97,215 @@ static void emit_irqtrace(u16 die, u16 type, u16 num)
         .num = die * aic->max_irq + num,
     };
 
-    hv_wdt_suspend();
-    uartproxy_send_event(EVT_IRQTRACE, &evt, sizeof(evt));
-    hv_wdt_resume();
+    if (irqtrace_batch_mode == HV_TRACE_BATCH_OFF) {
+        hv_wdt_suspend();
+        uartproxy_post_event(EVT_IRQTRACE, &evt, sizeof(evt));
+        hv_wdt_resume();
+        return;
+    }
+
+    struct irqtrace_batch *batch = &irqtrace_batch[smp_id()];
+
+    if (batch->hdr.count == IRQTRACE_BATCH_RECORDS) {
+        if (irqtrace_batch_mode == HV_TRACE_BATCH_DROP) {
+            batch->hdr.dropped++;
+            return;
+        }
+        hv_irqtrace_flush();
+    }
+
+    batch->records[batch->hdr.count++] = evt;
 }
 
-static bool trace_aic_event(struct exc_info *ctx, u64 addr, u64 *val, bool write, int width)
+static void count_irq(u16 die, u16 num)
 {
-    if (!hv_pa_rw(ctx, addr, val, write, width))
-        return false;
+    struct hv_irq_counter *c = &irq_counters[irq_counter_slot[die][num] - 1];
+    u64 now = mrs(CNTPCT_EL0);
 
-    if (addr != (aic->base + aic->regs.event) || write || width != 2) {
+    if (c->count++)
+        c->min_delta = min(c->min_delta, now - c->last);
+    else
+        c->first = now;
+
+    c->last = now;
+}
+
+static bool irq_counter_add(u32 die, u32 num)
+{
+    if (irq_counter_slot[die][num])
         return true;
+
+    if (irq_counters_used == ~0UL)
+        return false;
+
+    int slot = __builtin_ctzl(~irq_counters_used);
+
+    irq_counters_used |= BIT(slot);
+    irq_counters[slot] = (struct hv_irq_counter){
+        .num = die * aic->max_irq + num,
+        .min_delta = ~0UL,
+    };
+    irq_counter_slot[die][num] = slot + 1;
+
+    return true;
+}
+
+static void irq_counter_del(u32 die, u32 num)
+{
+    if (!irq_counter_slot[die][num])
+        return;
+
+    irq_counters_used &= ~BIT(irq_counter_slot[die][num] - 1);
+    irq_counter_slot[die][num] = 0;
+}
+
+s64 hv_irq_counters_fetch(void *buf, size_t size, bool reset)
+{
+    struct hv_irq_counter *out = buf;
+    size_t count = 0;
+
+    for (int slot = 0; slot < IRQ_COUNTER_SLOTS; slot++) {
+        struct hv_irq_counter *c = &irq_counters[slot];
+
+        if (!(irq_counters_used & BIT(slot)))
+            continue;
+        if ((count + 1) * sizeof(*out) > size)
+            return -1;
+
+        out[count++] = *c;
+        if (reset) {
+            c->count = c->first = c->last = 0;
+            c->min_delta = ~0UL;
+        }
+    }
+
+    return count;
+}
+
+static void irq_delayed_remove(int i)
+{
+    IRQ_CLEAR(held_hw_num, irq_delayed[i].die, irq_delayed[i].num);
+    irq_delayed[i] = irq_delayed[--irq_delayed_count];
+}
+
+/* Unmask delayed IRQs whose time has come, the next hit goes through to the guest */
+/* Returns true while there are delayed IRQs left to release */
+bool hv_aic_poll(void)
+{
+    for (int i = 0; i < irq_delayed_count;) {
+        struct irq_delayed *d = &irq_delayed[i];
+
+        if (!timeout_expired(d->deadline)) {
+            i++;
+            continue;
+        }
+
+        IRQ_SET(released_hw_num, d->die, d->num);
+        aic_set_mask(d->die * aic->max_irq + d->num, false);
+        irq_delayed_remove(i);
     }
 
-    u16 die = FIELD_GET(AIC_EVENT_DIE, *val);
-    u16 type = FIELD_GET(AIC_EVENT_TYPE, *val);
-    u16 num = FIELD_GET(AIC_EVENT_NUM, *val);
+    return irq_delayed_count != 0;
+}
 
-    if (die > AIC_MAX_DIES)
+/* Returns true if the guest gets to see this HW IRQ now */
+static bool aic_deliver(u16 die, u16 num)
+{
+    if (irq_counter_slot[die][num])
+        count_irq(die, num);
+    if (IRQ_TEST(trace_hw_num, die, num))
+        emit_irqtrace(die, AIC_EVENT_TYPE_HW, num);
+
+    if (IRQ_TEST(drop_hw_num, die, num)) {
+        IRQ_SET(held_hw_num, die, num);
+        return false;
+    }
+
+    if (!IRQ_TEST(delay_hw_num, die, num))
+        return true;
+
+    if (IRQ_TEST(released_hw_num, die, num)) {
+        IRQ_CLEAR(released_hw_num, die, num);
         return true;
+    }
+
+    // Out of slots, deliver it rather than lose it
+    if (irq_delayed_count == IRQ_DELAY_SLOTS)
+        return true;
+
+    irq_delayed[irq_delayed_count++] = (struct irq_delayed){
+        .die = die,
+        .num = num,
+        .deadline = timeout_calculate(irq_delay_usec),
+    };
+    IRQ_SET(held_hw_num, die, num);
+
+    return false;
+}
+
+/* Guest writes to MASK_SET/MASK_CLR: keep held IRQs masked, forget delays the guest masks itself */
+static void filter_aic_mask(u64 addr, u64 *val)
+{
+    u64 off = addr - aic->base;
+
+    for (u32 die = 0; die < aic->nr_die && die < AIC_MAX_DIES; die++) {
+        u64 clr = aic->regs.mask_clr + die * aic->die_stride;
+        u64 set = aic->regs.mask_set + die * aic->die_stride;
+        u32 word;
 
-    switch (type) {
-        case AIC_EVENT_TYPE_HW:
-            if (trace_hw_num[die][num / 32] & BIT(num & 31)) {
-                emit_irqtrace(die, type, num);
+        if (off >= clr && off < clr + aic->max_irq / 8) {
+            word = (off - clr) / 4;
+            *val &= ~(u64)held_hw_num[die][word];
+            return;
+        }
+
+        if (off >= set && off < set + aic->max_irq / 8) {
+            word = (off - set) / 4;
+            for (int i = 0; i < irq_delayed_count;) {
+                if (irq_delayed[i].die == die && irq_delayed[i].num / 32 == word &&
+                    (*val & BIT(irq_delayed[i].num & 31)))
+                    irq_delayed_remove(i);
+                else
+                    i++;
             }
-            break;
-        default:
-            // ignore
-            break;
+            return;
+        }
     }
+}
+
+static bool trace_aic_event(struct exc_info *ctx, u64 addr, u64 *val, bool write, int width)
+{
+    if (addr != (aic->base + aic->regs.event) || write || width != 2) {
+        if (write && width == 2)
+            filter_aic_mask(addr, val);
+        return hv_pa_rw(ctx, addr, val, write, width);
+    }
+
+    hv_aic_poll();
 
+    // Keep reading until there's an event the guest may see (or none at all)
+    for (int tries = 0; tries < 16; tries++) {
+        if (!hv_pa_rw(ctx, addr, val, write, width))
+            return false;
+
+        u16 die = FIELD_GET(AIC_EVENT_DIE, *val);
+        u16 type = FIELD_GET(AIC_EVENT_TYPE, *val);
+        u16 num = FIELD_GET(AIC_EVENT_NUM, *val);
+
+        if (type != AIC_EVENT_TYPE_HW || die >= AIC_MAX_DIES || num >= AIC_MAX_HW_NUM ||
+            aic_deliver(die, num))
+            return true;
+    }
+
+    *val = 0;
     return true;
 }
 
+void hv_set_irq_delay(u64 usec)
+{
+    irq_delay_usec = usec;
+}
+
 bool hv_trace_irq(u32 type, u32 num, u32 count, u32 flags)
 {
     dprintf("HV: hv_trace_irq type: %u start: %u num: %u flags: 0x%x\n", type, num, count, flags);
@@ -65,13 +317,38 @@ bool hv_trace_irq(u32 type, u32 num, u32 count, u32 flags)
             return false;
         }
         for (u32 n = num; n < num + count; n++) {
-            switch (flags) {
-                case IRQTRACE_IRQ:
-                    trace_hw_num[die][n / 32] |= BIT(n & 31);
-                    break;
-                default:
-                    trace_hw_num[die][n / 32] &= ~(BIT(n & 31));
-                    break;
+            if (flags & IRQTRACE_IRQ)
+                IRQ_SET(trace_hw_num, die, n);
+            else
+                IRQ_CLEAR(trace_hw_num, die, n);
+
+            if (flags & IRQTRACE_DROP)
+                IRQ_SET(drop_hw_num, die, n);
+            else
+                IRQ_CLEAR(drop_hw_num, die, n);
+
+            if (flags & IRQTRACE_DELAY)
+                IRQ_SET(delay_hw_num, die, n);
+            else
+                IRQ_CLEAR(delay_hw_num, die, n);
+
+            // Hand back anything we were holding once it's no longer dropped or delayed
+            if (!(flags & (IRQTRACE_DROP | IRQTRACE_DELAY)) && IRQ_TEST(held_hw_num, die, n)) {
+                for (int i = 0; i < irq_delayed_count; i++) {
+                    if (irq_delayed[i].die == die && irq_delayed[i].num == n) {
+                        irq_delayed_remove(i);
+                        break;
+                    }
+                }
+                IRQ_CLEAR(held_hw_num, die, n);
+                aic_set_mask(die * aic->max_irq + n, false);
+            }
+
+            if (!(flags & IRQTRACE_COUNT)) {
+                irq_counter_del(die, n);
+            } else if (!irq_counter_add(die, n)) {
+                printf("HV: out of IRQ counters at %u\n", n);
+                return false;
             }
         }
     } else {
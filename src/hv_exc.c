@@ -4,6 +4,7 @@
 #include "assert.h"
 #include "cpu_regs.h"
 #include "exception.h"
+#include "ringbuffer.h"
 #include "smp.h"
 #include "string.h"
 #include "uart.h"
@@ -21,12 +22,39 @@ extern spinlock_t bhl;
 
 #define PERCPU(x) pcpu[mrs(TPIDR_EL2)].x
 
+#define ASYNC_EXC_RING 8
+#define NUM_HW_BPS     5
+
+#define MDSCR_SS  BIT(0)
+#define MDSCR_MDE BIT(15)
+
 struct hv_pcpu_data {
     u32 ipi_queued;
     u32 ipi_pending;
     u32 pmc_pending;
     u64 pmc_irq_mode;
     u64 exc_entry_pmcr0_cnt;
+    u64 exc_entry_time;
+    bool bhl_held;
+    bool async_bp_step;
+    u64 async_bp_mdscr;
+    u64 async_bp_bcr[NUM_HW_BPS];
+    bool step_active;
+    struct hv_step_cond step_cond;
+    struct hv_step_status step_status;
+    ringbuffer_t *profile_rb;
+    u64 profile_next;
+    ringbuffer_t *pmu_rb;
+    u32 pmu_gen;
+    bool pmu_owned;
+    u32 async_exc_count;
+    u32 async_exc_dropped;
+    struct hv_evt_exc_async async_exc[ASYNC_EXC_RING];
+    struct hv_stats stats;
+    bool exit_parked;
+    struct uartproxy_msg_start parked_start;
+    int parked_ret;
+    u64 stolen_time; // per-CPU time stealing only
 } ALIGNED(64);
 
 struct hv_pcpu_data pcpu[MAX_CPUS];
@@ -34,34 +62,639 @@ struct hv_pcpu_data pcpu[MAX_CPUS];
 void hv_exit_guest(void) __attribute__((noreturn));
 
 static u64 stolen_time = 0;
-static u64 exc_entry_time;
+
+/* Set while a CPU is in the proxy with everyone rendezvoused, holds off returns to the guest */
+static u32 hv_proxy_active = 0;
 
 extern u32 hv_cpus_in_guest;
 extern int hv_pinned_cpu;
 extern int hv_want_cpu;
 
 static bool time_stealing = true;
+static bool time_stealing_per_cpu = false;
+static bool vtimer_forward = false;
+static u32 async_bp_mask = 0;
 
-static void _hv_exc_proxy(struct exc_info *ctx, uartproxy_boot_reason_t reason, u32 type,
-                          void *extra)
+static bool profile_active = false;
+static u32 profile_flags;
+static u64 profile_period;
+
+static bool pmu_active = false;
+static u32 pmu_gen = 0;
+static struct hv_pmu_config pmu_cfg;
+
+static void hv_stats_hist(u64 *hist, u64 ticks)
+{
+    int bucket = ticks ? 63 - __builtin_clzl(ticks) : 0;
+
+    hist[min(bucket, HV_STATS_HIST_BUCKETS - 1)]++;
+}
+
+static void hv_stats_msr(u64 reg)
+{
+    struct hv_stats *stats = &PERCPU(stats);
+    u32 slot = (reg ^ (reg >> 10)) % HV_STATS_MSR_SLOTS;
+
+    for (int i = 0; i < HV_STATS_MSR_SLOTS; i++) {
+        struct hv_stats_msr *msr = &stats->msr[(slot + i) % HV_STATS_MSR_SLOTS];
+
+        if (!msr->count)
+            msr->sysreg = reg;
+        if (msr->sysreg == reg) {
+            msr->count++;
+            return;
+        }
+    }
+
+    stats->msr_other++;
+}
+
+void hv_stats_dabort(u32 spte_type)
+{
+    PERCPU(stats).dabort_spte[min(spte_type, HV_STATS_SPTE_TYPES - 1)]++;
+}
+
+/*
+ * Counters are updated by their own CPU without locking, so a snapshot of a CPU that is running
+ * the guest may be slightly inconsistent.
+ */
+int hv_get_stats(int cpu, struct hv_stats *out, size_t size, bool reset)
+{
+    if (cpu < 0 || cpu >= MAX_CPUS || size < sizeof(*out))
+        return -1;
+
+    memcpy(out, &pcpu[cpu].stats, sizeof(*out));
+    out->stolen_ticks = stolen_time + pcpu[cpu].stolen_time;
+
+    if (reset)
+        memset(&pcpu[cpu].stats, 0, sizeof(*out));
+
+    return sizeof(*out);
+}
+
+/*
+ * Queue an exit for the host to look at later, without stopping the guest. The snapshot goes
+ * out with the next batch of events (tick or proxy entry), after any MMIO traces before it.
+ */
+void hv_exc_proxy_async(struct exc_info *ctx, uartproxy_boot_reason_t reason, u32 type)
+{
+    u32 idx = PERCPU(async_exc_count);
+
+    if (idx >= ASYNC_EXC_RING) {
+        PERCPU(async_exc_dropped)++;
+        return;
+    }
+
+    struct hv_evt_exc_async *evt = &PERCPU(async_exc)[idx];
+
+    evt->reason = reason;
+    evt->type = type;
+    evt->ctx = *ctx;
+    evt->ctx.elr_phys = hv_translate(ctx->elr, false, false, NULL);
+    evt->ctx.extra = NULL;
+
+    PERCPU(async_exc_count) = idx + 1;
+}
+
+static void hv_async_flush(void)
+{
+    u32 count = PERCPU(async_exc_count);
+
+    if (!count && !PERCPU(async_exc_dropped))
+        return;
+
+    hv_wdt_suspend();
+    for (u32 i = 0; i < count; i++)
+        uartproxy_send_event(EVT_EXC_ASYNC, &PERCPU(async_exc)[i], sizeof(struct hv_evt_exc_async));
+    hv_wdt_resume();
+
+    if (PERCPU(async_exc_dropped))
+        printf("HV: CPU %d dropped %d async exits\n", smp_id(), PERCPU(async_exc_dropped));
+
+    PERCPU(async_exc_count) = 0;
+    PERCPU(async_exc_dropped) = 0;
+}
+
+/* Push out everything the guest generated in the background: MMIO traces and async exits */
+static void hv_flush_events(void)
+{
+    hv_trace_flush();
+    hv_irqtrace_flush();
+    hv_async_flush();
+}
+
+void hv_set_async_bps(u32 mask)
+{
+    async_bp_mask = mask & MASK(NUM_HW_BPS);
+}
+
+#define BP_SAVE(n)                                                                                 \
+    do {                                                                                           \
+        PERCPU(async_bp_bcr)[n] = mrs(DBGBCR##n##_EL1);                                            \
+        msr(DBGBCR##n##_EL1, 0);                                                                   \
+    } while (0)
+
+#define BP_MATCH(n)                                                                                \
+    ((async_bp_mask & BIT(n)) && (mrs(DBGBCR##n##_EL1) & 1) && mrs(DBGBVR##n##_EL1) == ctx->elr)
+
+/*
+ * Log-only breakpoints: report the hit asynchronously, then step over the instruction with all
+ * breakpoints disabled and put them back, all without leaving EL2. This mirrors what the host
+ * does in handle_break/handle_step for regular breakpoints.
+ */
+static bool hv_handle_async_bp(struct exc_info *ctx, u32 ec)
+{
+    if (ec == ESR_EC_SSTEP_LOWER) {
+        if (!PERCPU(async_bp_step))
+            return false;
+
+        msr(DBGBCR0_EL1, PERCPU(async_bp_bcr)[0]);
+        msr(DBGBCR1_EL1, PERCPU(async_bp_bcr)[1]);
+        msr(DBGBCR2_EL1, PERCPU(async_bp_bcr)[2]);
+        msr(DBGBCR3_EL1, PERCPU(async_bp_bcr)[3]);
+        msr(DBGBCR4_EL1, PERCPU(async_bp_bcr)[4]);
+        msr(MDSCR_EL1, PERCPU(async_bp_mdscr));
+        ctx->spsr &= ~SPSR_SS;
+        PERCPU(async_bp_step) = false;
+        return true;
+    }
+
+    if (!async_bp_mask || !(BP_MATCH(0) || BP_MATCH(1) || BP_MATCH(2) || BP_MATCH(3) ||
+                            BP_MATCH(4)))
+        return false;
+
+    hv_exc_proxy_async(ctx, START_EXCEPTION_LOWER, EXC_SYNC);
+
+    BP_SAVE(0);
+    BP_SAVE(1);
+    BP_SAVE(2);
+    BP_SAVE(3);
+    BP_SAVE(4);
+    PERCPU(async_bp_mdscr) = mrs(MDSCR_EL1);
+    msr(MDSCR_EL1, MDSCR_SS | MDSCR_MDE);
+    ctx->spsr |= SPSR_SS;
+    PERCPU(async_bp_step) = true;
+    return true;
+}
+
+/*
+ * Arms the stepping engine on this CPU. The host still starts stepping the usual way (MDSCR.SS
+ * and SPSR.SS); from then on every step exception is handled here until a condition hits, and the
+ * host only sees the last one.
+ */
+int hv_step_start(const struct hv_step_cond *cond)
+{
+    if (cond->flags & HV_STEP_SYSREG && !hv_sysreg_watch_init(cond->sysreg))
+        return -1;
+
+    if (!cond->count && !(cond->flags & (HV_STEP_PC_IN | HV_STEP_PC_OUT | HV_STEP_SYSREG |
+                                         HV_STEP_MEM)))
+        return -1;
+
+    PERCPU(step_cond) = *cond;
+    memset(&PERCPU(step_status), 0, sizeof(struct hv_step_status));
+    PERCPU(step_active) = true;
+
+    return 0;
+}
+
+/* Returns whether stepping was still active, which it is if some other exit got in the way */
+int hv_step_get_status(struct hv_step_status *out, bool stop)
+{
+    bool active = PERCPU(step_active);
+
+    *out = PERCPU(step_status);
+    if (stop)
+        PERCPU(step_active) = false;
+
+    return active;
+}
+
+static u32 hv_step_check(const struct hv_step_cond *cond, u64 pc, u64 steps)
+{
+    bool in_range = pc >= cond->pc_start && pc < cond->pc_end;
+
+    if ((cond->flags & HV_STEP_PC_IN && in_range) || (cond->flags & HV_STEP_PC_OUT && !in_range))
+        return HV_STEP_STOP_PC;
+
+    if (cond->flags & HV_STEP_SYSREG &&
+        (hv_sysreg_watch_read() & cond->sysreg_mask) == cond->sysreg_value)
+        return HV_STEP_STOP_SYSREG;
+
+    if (cond->flags & HV_STEP_MEM && (read64(cond->mem_addr) & cond->mem_mask) == cond->mem_value)
+        return HV_STEP_STOP_MEM;
+
+    if (cond->count && steps >= cond->count)
+        return HV_STEP_STOP_COUNT;
+
+    return HV_STEP_RUNNING;
+}
+
+static bool hv_handle_step(struct exc_info *ctx)
+{
+    const struct hv_step_cond *cond = &PERCPU(step_cond);
+    struct hv_step_status *status = &PERCPU(step_status);
+
+    if (!PERCPU(step_active))
+        return false;
+
+    status->steps++;
+
+    if (cond->trace_size)
+        ((u64 *)cond->trace_buf)[status->trace_count++ % cond->trace_size] = ctx->elr;
+
+    status->stop = hv_step_check(cond, ctx->elr, status->steps);
+    if (status->stop != HV_STEP_RUNNING) {
+        // Done, this step exception goes to the host like any other
+        PERCPU(step_active) = false;
+        return false;
+    }
+
+    ctx->spsr |= SPSR_SS;
+    return true;
+}
+
+/*
+ * Statistical profiler: every CPU samples the guest PC (plus LR and/or SP, per the flags) from
+ * its timer tick at roughly rate Hz, into its own ring buffer of size bytes that the host drains
+ * with hv_profile_fetch(). Each sample is one to three u64s. The buffers are only replaced on the
+ * next start, so whatever was sampled can still be fetched after stopping.
+ */
+int hv_profile_start(u32 rate, u32 flags, size_t size)
+{
+    if (!rate || rate > HV_PROFILE_MAX_RATE || flags & ~(HV_PROFILE_LR | HV_PROFILE_SP))
+        return -1;
+
+    hv_profile_stop();
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (pcpu[cpu].profile_rb)
+            ringbuffer_free(pcpu[cpu].profile_rb);
+        pcpu[cpu].profile_rb = ringbuffer_alloc(size);
+        pcpu[cpu].profile_next = 0;
+        if (!pcpu[cpu].profile_rb)
+            return -1;
+    }
+
+    profile_flags = flags;
+    profile_period = mrs(CNTFRQ_EL0) / rate;
+    hv_set_tick_rate(rate);
+    __atomic_store_n(&profile_active, true, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void hv_profile_stop(void)
+{
+    __atomic_store_n(&profile_active, false, __ATOMIC_RELEASE);
+    hv_set_tick_rate(0);
+}
+
+/* Returns the number of bytes copied, always whole samples */
+ssize_t hv_profile_fetch(int cpu, void *dst, size_t size)
+{
+    size_t sample = sizeof(u64) * (1 + __builtin_popcount(profile_flags));
+
+    if (cpu < 0 || cpu >= MAX_CPUS || !pcpu[cpu].profile_rb)
+        return -1;
+
+    return ringbuffer_read(dst, size - size % sample, pcpu[cpu].profile_rb);
+}
+
+static void hv_profile_sample(struct exc_info *ctx)
+{
+    ringbuffer_t *rb = PERCPU(profile_rb);
+    u64 now = mrs(CNTPCT_EL0);
+    u64 sample[3];
+    int n = 0;
+
+    if (!__atomic_load_n(&profile_active, __ATOMIC_ACQUIRE) || now < PERCPU(profile_next))
+        return;
+
+    PERCPU(profile_next) = now + profile_period;
+
+    // This runs before hv_exc_entry() on the fast path, so go to the registers directly
+    sample[n++] = hv_get_elr();
+    if (profile_flags & HV_PROFILE_LR)
+        sample[n++] = ctx->regs[30];
+    if (profile_flags & HV_PROFILE_SP) // M[0] selects SP_EL1 for EL1h
+        sample[n++] = (hv_get_spsr() & BIT(0)) ? mrs(SP_EL1) : mrs(SP_EL0);
+
+    if (ringbuffer_get_free(rb) < n * sizeof(u64)) {
+        PERCPU(stats).profile_dropped++;
+        return;
+    }
+
+    ringbuffer_write((u8 *)sample, n * sizeof(u64), rb);
+    PERCPU(stats).profile_samples++;
+}
+
+#define PMU_PMC_ACCESS(n)                                                                          \
+    case n:                                                                                        \
+        if (write)                                                                                 \
+            msr(SYS_IMP_APL_PMC##n, val);                                                          \
+        else                                                                                       \
+            val = mrs(SYS_IMP_APL_PMC##n);                                                         \
+        break;
+
+static u64 hv_pmu_access(int n, bool write, u64 val)
+{
+    switch (n) {
+        PMU_PMC_ACCESS(0)
+        PMU_PMC_ACCESS(1)
+        PMU_PMC_ACCESS(2)
+        PMU_PMC_ACCESS(3)
+        PMU_PMC_ACCESS(4)
+        PMU_PMC_ACCESS(5)
+        PMU_PMC_ACCESS(6)
+        PMU_PMC_ACCESS(7)
+        PMU_PMC_ACCESS(8)
+        PMU_PMC_ACCESS(9)
+    }
+
+    return val;
+}
+
+/* PMCR0/PMCR1 keep the enables for PMC0-7 in bits 0-7 and those for PMC8-9 in bits 32-33 */
+static u64 hv_pmu_cnt_bits(u32 mask)
+{
+    return (mask & 0xff) | ((u64)(mask & 0x300) << 24);
+}
+
+static void hv_pmu_reload(int n)
+{
+    u64 period = pmu_cfg.period[n];
+
+    hv_pmu_access(n, true, period ? BIT(47) - period : 0);
+}
+
+/*
+ * PMU sampling is configured globally but the PMCs are per CPU, so every CPU picks up a new
+ * configuration on its next exit to the guest (PMU and tick FIQs take the slow path until it
+ * has). The counters are stopped while in the HV, hv_exc_exit() enables them.
+ */
+int hv_pmu_start(const struct hv_pmu_config *cfg)
+{
+    if (!cfg->counters || cfg->counters & ~MASK(HV_PMU_COUNTERS) ||
+        cfg->flags & ~(HV_PMU_EL0 | HV_PMU_EL1) || !cfg->size)
+        return -1;
+
+    for (int i = 0; i < HV_PMU_COUNTERS; i++)
+        if (cfg->period[i] > HV_PMU_MAX_PERIOD ||
+            (cfg->period[i] && !(cfg->counters & BIT(i))))
+            return -1;
+
+    hv_pmu_stop();
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (pcpu[cpu].pmu_rb)
+            ringbuffer_free(pcpu[cpu].pmu_rb);
+        pcpu[cpu].pmu_rb = ringbuffer_alloc(cfg->size);
+        if (!pcpu[cpu].pmu_rb)
+            return -1;
+    }
+
+    memcpy(&pmu_cfg, cfg, sizeof(pmu_cfg));
+    __atomic_store_n(&pmu_active, true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&pmu_gen, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Hands the PMCs back to the guest, which has to program them again */
+void hv_pmu_stop(void)
+{
+    __atomic_store_n(&pmu_active, false, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&pmu_gen, 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the number of bytes copied, always whole samples */
+ssize_t hv_pmu_fetch(int cpu, void *dst, size_t size)
+{
+    size_t sample = sizeof(u64) * (2 + __builtin_popcount(pmu_cfg.counters));
+
+    if (cpu < 0 || cpu >= MAX_CPUS || !pcpu[cpu].pmu_rb)
+        return -1;
+
+    return ringbuffer_read(dst, size - size % sample, pcpu[cpu].pmu_rb);
+}
+
+static void hv_pmu_sync(void)
+{
+    u32 gen = __atomic_load_n(&pmu_gen, __ATOMIC_ACQUIRE);
+
+    if (PERCPU(pmu_gen) == gen)
+        return;
+
+    PERCPU(pmu_gen) = gen;
+    PERCPU(pmu_owned) = __atomic_load_n(&pmu_active, __ATOMIC_ACQUIRE);
+
+    u64 pmcr0 = mrs(SYS_IMP_APL_PMCR0) & ~(PMCR0_IMODE_MASK | PMCR0_IACT | PMCR0_CNT_MASK);
+
+    if (!PERCPU(pmu_owned)) {
+        msr(SYS_IMP_APL_PMCR0, pmcr0);
+        msr(SYS_IMP_APL_PMCR1, 0);
+        PERCPU(exc_entry_pmcr0_cnt) = 0;
+        return;
+    }
+
+    u64 pmesr[2] = {0, 0};
+    u32 pmi = 0;
+
+    for (int i = 0; i < HV_PMU_COUNTERS; i++) {
+        if (!(pmu_cfg.counters & BIT(i)))
+            continue;
+        if (i >= 2)
+            pmesr[(i - 2) / 4] |= (u64)pmu_cfg.events[i] << (8 * ((i - 2) % 4));
+        if (pmu_cfg.period[i])
+            pmi |= BIT(i);
+        hv_pmu_reload(i);
+    }
+
+    u64 cnt = hv_pmu_cnt_bits(pmu_cfg.counters);
+    u64 pmcr1 = 0;
+    if (pmu_cfg.flags & HV_PMU_EL0)
+        pmcr1 |= cnt << PMCR1_A64_EL0_SHIFT;
+    if (pmu_cfg.flags & HV_PMU_EL1)
+        pmcr1 |= cnt << PMCR1_A64_EL1_SHIFT;
+
+    msr(SYS_IMP_APL_PMESR0, pmesr[0]);
+    msr(SYS_IMP_APL_PMESR1, pmesr[1]);
+    msr(SYS_IMP_APL_PMCR1, pmcr1);
+    msr(SYS_IMP_APL_PMCR0, pmcr0 | PMCR0_IMODE_FIQ);
+    PERCPU(exc_entry_pmcr0_cnt) = cnt | (hv_pmu_cnt_bits(pmi) << PMCR0_PMI_SHIFT);
+}
+
+static void hv_pmu_sample(struct exc_info *ctx)
+{
+    ringbuffer_t *rb = PERCPU(pmu_rb);
+    u64 overflow = mrs(SYS_IMP_APL_PMSR) & MASK(HV_PMU_COUNTERS);
+    u64 sample[2 + HV_PMU_COUNTERS];
+    int n = 0;
+
+    sample[n++] = ctx->elr;
+    sample[n++] = overflow;
+    for (int i = 0; i < HV_PMU_COUNTERS; i++) {
+        if (!(pmu_cfg.counters & BIT(i)))
+            continue;
+        sample[n++] = hv_pmu_access(i, false, 0);
+        if ((overflow & BIT(i)) && pmu_cfg.period[i])
+            hv_pmu_reload(i);
+    }
+
+    if (ringbuffer_get_free(rb) < n * sizeof(u64)) {
+        PERCPU(stats).pmu_dropped++;
+        return;
+    }
+
+    ringbuffer_write((u8 *)sample, n * sizeof(u64), rb);
+    PERCPU(stats).pmu_samples++;
+}
+
+/* While m1n1 owns the PMU the guest's PMU registers read as zero and ignore writes */
+static bool hv_pmu_guest_access(u64 reg, u64 *val, bool is_read)
+{
+    if (!PERCPU(pmu_owned))
+        return false;
+
+    switch (reg) {
+        case SYSREG_ISS(SYS_IMP_APL_PMCR0):
+        case SYSREG_ISS(SYS_IMP_APL_PMCR1):
+        case SYSREG_ISS(SYS_IMP_APL_PMCR2):
+        case SYSREG_ISS(SYS_IMP_APL_PMCR3):
+        case SYSREG_ISS(SYS_IMP_APL_PMCR4):
+        case SYSREG_ISS(SYS_IMP_APL_PMESR0):
+        case SYSREG_ISS(SYS_IMP_APL_PMESR1):
+        case SYSREG_ISS(SYS_IMP_APL_PMSR):
+        case SYSREG_ISS(SYS_IMP_APL_PMC0):
+        case SYSREG_ISS(SYS_IMP_APL_PMC1):
+        case SYSREG_ISS(SYS_IMP_APL_PMC2):
+        case SYSREG_ISS(SYS_IMP_APL_PMC3):
+        case SYSREG_ISS(SYS_IMP_APL_PMC4):
+        case SYSREG_ISS(SYS_IMP_APL_PMC5):
+        case SYSREG_ISS(SYS_IMP_APL_PMC6):
+        case SYSREG_ISS(SYS_IMP_APL_PMC7):
+        case SYSREG_ISS(SYS_IMP_APL_PMC8):
+        case SYSREG_ISS(SYS_IMP_APL_PMC9):
+            if (is_read)
+                *val = 0;
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Exits that can be handled entirely on the local CPU (sysreg traps, IPIs, PMU and timer ticks
+ * on non-interruptible CPUs) run without the big HV lock. Everything that touches shared state
+ * or the proxy takes it through here first, and it is dropped again on exit to the guest.
+ */
+static void hv_exc_lock(void)
+{
+    if (PERCPU(bhl_held))
+        return;
+
+    spin_lock(&bhl);
+    PERCPU(bhl_held) = true;
+}
+
+static void hv_exc_unlock(void)
+{
+    if (!PERCPU(bhl_held))
+        return;
+
+    PERCPU(bhl_held) = false;
+    spin_unlock(&bhl);
+}
+
+static void hv_exc_prepare_ctx(struct exc_info *ctx, void *extra)
 {
     int from_el = FIELD_GET(SPSR_M, ctx->spsr) >> 2;
 
+    ctx->elr_phys = hv_translate(ctx->elr, false, false, NULL);
+    ctx->far_phys = hv_translate(ctx->far, false, false, NULL);
+    ctx->sp_phys = hv_translate(from_el == 0 ? ctx->sp[0] : ctx->sp[1], false, false, NULL);
+    ctx->extra = extra;
+}
+
+/*
+ * Exits that have to wait for the proxy while another CPU owns it (pinned, or being switched to)
+ * are parked here. The host can list them through the CPU it is talking to and answer them in
+ * any order; a parked exit that nobody answers just gets the proxy to itself once it is free.
+ */
+int hv_get_pending_exits(struct hv_pending_exit *out, size_t size)
+{
+    int count = 0;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!__atomic_load_n(&pcpu[cpu].exit_parked, __ATOMIC_ACQUIRE) || pcpu[cpu].parked_ret)
+            continue;
+        if ((count + 1) * sizeof(*out) > size)
+            return -1;
+
+        out[count++] = (struct hv_pending_exit){
+            .cpu = cpu,
+            .reason = pcpu[cpu].parked_start.reason,
+            .code = pcpu[cpu].parked_start.code,
+            .info = (u64)pcpu[cpu].parked_start.info,
+        };
+    }
+
+    return count;
+}
+
+int hv_resolve_exit(int cpu, int ret)
+{
+    if (cpu < 0 || cpu >= MAX_CPUS || ret != EXC_RET_HANDLED)
+        return -1;
+    if (!__atomic_load_n(&pcpu[cpu].exit_parked, __ATOMIC_ACQUIRE) || pcpu[cpu].parked_ret)
+        return -1;
+
+    __atomic_store_n(&pcpu[cpu].parked_ret, ret, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void hv_exc_park(struct exc_info *ctx, uartproxy_boot_reason_t reason, u32 type,
+                        void *extra)
+{
+    hv_exc_prepare_ctx(ctx, extra);
+    PERCPU(parked_start) = (struct uartproxy_msg_start){
+        .reason = reason,
+        .code = type,
+        .info = ctx,
+    };
+    PERCPU(parked_ret) = 0;
+    __atomic_store_n(&PERCPU(exit_parked), true, __ATOMIC_RELEASE);
+}
+
+/* Returns the host's answer if it resolved the parked exit, 0 if it's still ours to handle */
+static int hv_exc_unpark(void)
+{
+    __atomic_store_n(&PERCPU(exit_parked), false, __ATOMIC_RELEASE);
+    return __atomic_load_n(&PERCPU(parked_ret), __ATOMIC_ACQUIRE);
+}
+
+static void _hv_exc_proxy(struct exc_info *ctx, uartproxy_boot_reason_t reason, u32 type,
+                          void *extra)
+{
     hv_wdt_breadcrumb('P');
 
+    // Deliver any batched traces and async exits before the host sees this exception
+    hv_flush_events();
+
     /*
      * Get all the CPUs into the HV before running the proxy, to make sure they all exit to
-     * the guest with a consistent time offset.
+     * the guest with a consistent time offset. With per-CPU offsets only this CPU's counter
+     * stops, so the others keep running.
      */
-    if (time_stealing)
+    if (time_stealing && !time_stealing_per_cpu) {
+        __atomic_store_n(&hv_proxy_active, 1, __ATOMIC_SEQ_CST);
         hv_rendezvous();
+    }
 
     u64 entry_time = mrs(CNTPCT_EL0);
 
-    ctx->elr_phys = hv_translate(ctx->elr, false, false, NULL);
-    ctx->far_phys = hv_translate(ctx->far, false, false, NULL);
-    ctx->sp_phys = hv_translate(from_el == 0 ? ctx->sp[0] : ctx->sp[1], false, false, NULL);
-    ctx->extra = extra;
+    hv_exc_prepare_ctx(ctx, extra);
 
     struct uartproxy_msg_start start = {
         .reason = reason,
@@ -70,20 +703,36 @@ static void _hv_exc_proxy(struct exc_info *ctx, uartproxy_boot_reason_t reason,
     };
 
     hv_wdt_suspend();
+    u64 proxy_start = mrs(CNTPCT_EL0);
     int ret = uartproxy_run(&start);
+    u64 proxy_ticks = mrs(CNTPCT_EL0) - proxy_start;
     hv_wdt_resume();
 
+    PERCPU(stats).proxy_calls++;
+    PERCPU(stats).proxy_ticks += proxy_ticks;
+    hv_stats_hist(PERCPU(stats).proxy_hist, proxy_ticks);
+
+    // The host may have changed guest memory or page tables behind our back
+    hv_xlate_invalidate();
+    // and is likely to have more to say soon
+    hv_tick_kick();
+
+    __atomic_store_n(&hv_proxy_active, 0, __ATOMIC_SEQ_CST);
+
     switch (ret) {
         case EXC_RET_HANDLED:
             hv_wdt_breadcrumb('p');
             if (time_stealing) {
                 u64 lost = mrs(CNTPCT_EL0) - entry_time;
-                stolen_time += lost;
+                if (time_stealing_per_cpu)
+                    PERCPU(stolen_time) += lost;
+                else
+                    stolen_time += lost;
             }
             break;
         case EXC_EXIT_GUEST:
             hv_rendezvous();
-            spin_unlock(&bhl);
+            hv_exc_unlock();
             hv_exit_guest(); // does not return
         default:
             printf("Guest exception not handled, rebooting.\n");
@@ -111,6 +760,8 @@ static void hv_maybe_switch_cpu(struct exc_info *ctx, uartproxy_boot_reason_t re
 
 void hv_exc_proxy(struct exc_info *ctx, uartproxy_boot_reason_t reason, u32 type, void *extra)
 {
+    hv_exc_lock();
+
     /*
      * Wait while another CPU is pinned or being switched to.
      * If a CPU switch is requested, handle it before actually handling the
@@ -121,11 +772,26 @@ void hv_exc_proxy(struct exc_info *ctx, uartproxy_boot_reason_t reason, u32 type
             hv_want_cpu = -1;
             _hv_exc_proxy(ctx, reason, type, extra);
         } else {
+            hv_exc_park(ctx, reason, type, extra);
+            u64 wait_start = mrs(CNTPCT_EL0);
+
             // Unlock the HV so the target CPU can get into the proxy
             spin_unlock(&bhl);
-            while ((hv_pinned_cpu != -1 && hv_pinned_cpu != smp_id()) || hv_want_cpu != -1)
+            while (((hv_pinned_cpu != -1 && hv_pinned_cpu != smp_id()) || hv_want_cpu != -1) &&
+                   !__atomic_load_n(&PERCPU(parked_ret), __ATOMIC_ACQUIRE))
                 sysop("dmb sy");
             spin_lock(&bhl);
+
+            // Nobody rendezvouses us in this mode, so waiting for the proxy is ours to account
+            if (time_stealing && time_stealing_per_cpu)
+                PERCPU(stolen_time) += mrs(CNTPCT_EL0) - wait_start;
+
+            if (hv_exc_unpark() == EXC_RET_HANDLED) {
+                // Answered by the host through another CPU's session
+                hv_wdt_breadcrumb('p');
+                hv_xlate_invalidate();
+                return;
+            }
         }
     }
 
@@ -139,11 +805,30 @@ void hv_exc_proxy(struct exc_info *ctx, uartproxy_boot_reason_t reason, u32 type
     hv_maybe_switch_cpu(ctx, reason, type, extra);
 }
 
-void hv_set_time_stealing(bool enabled, bool reset)
+/*
+ * By default every proxied exception stops all CPUs and the stolen time is subtracted from all of
+ * their virtual counters alike. With per_cpu, each CPU only subtracts the time it lost itself,
+ * which avoids the rendezvous but lets the virtual counters of different CPUs drift apart.
+ */
+void hv_set_time_stealing(bool enabled, bool reset, bool per_cpu)
 {
     time_stealing = enabled;
-    if (reset)
+    time_stealing_per_cpu = per_cpu;
+    if (reset) {
         stolen_time = 0;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+            pcpu[cpu].stolen_time = 0;
+    }
+}
+
+/*
+ * The guest's own timers never reach the host: hv_update_fiq() turns them into a vFIQ. The HV's
+ * virtual timer (CNTV at EL2) is only there for the host to break into the guest with, so its
+ * expiry is only forwarded after hv_set_vtimer_forward(true) and is otherwise just masked.
+ */
+void hv_set_vtimer_forward(bool enabled)
+{
+    vtimer_forward = enabled;
 }
 
 static void hv_update_fiq(void)
@@ -201,8 +886,13 @@ static bool hv_handle_msr(struct exc_info *ctx, u64 iss)
 
     u64 *regs = ctx->regs;
 
+    hv_stats_msr(reg);
+
     regs[31] = 0;
 
+    if (hv_pmu_guest_access(reg, &regs[rt], is_read))
+        return true;
+
     switch (reg) {
         /* Some kind of timer */
         SYSREG_PASS(sys_reg(3, 7, 15, 1, 1));
@@ -287,7 +977,7 @@ static bool hv_handle_msr(struct exc_info *ctx, u64 iss)
             msr(SYS_IMP_APL_IPI_RR_LOCAL_EL1, regs[rt]);
             for (int i = 0; i < MAX_CPUS; i++)
                 if (mpidr == smp_get_mpidr(i))
-                    pcpu[i].ipi_queued = true;
+                    __atomic_store_n(&pcpu[i].ipi_queued, true, __ATOMIC_RELEASE);
             return true;
         }
         case SYSREG_ISS(SYS_IMP_APL_IPI_RR_GLOBAL_EL1):
@@ -296,7 +986,7 @@ static bool hv_handle_msr(struct exc_info *ctx, u64 iss)
             msr(SYS_IMP_APL_IPI_RR_GLOBAL_EL1, regs[rt]);
             for (int i = 0; i < MAX_CPUS; i++) {
                 if (mpidr == (smp_get_mpidr(i) & 0xffff))
-                    pcpu[i].ipi_queued = true;
+                    __atomic_store_n(&pcpu[i].ipi_queued, true, __ATOMIC_RELEASE);
             }
             return true;
         case SYSREG_ISS(SYS_IMP_APL_IPI_SR_EL1):
@@ -336,7 +1026,8 @@ static bool hv_handle_msr(struct exc_info *ctx, u64 iss)
             return true;
     }
 
-    return false;
+    // Anything not handled above can be emulated as configured by the host
+    return hv_sysreg_emulate(ctx, reg, rt, is_read);
 }
 
 static void hv_exc_entry(struct exc_info *ctx)
@@ -359,9 +1050,8 @@ static void hv_exc_entry(struct exc_info *ctx)
         sysop("msr daifclr, 4");
 
     __atomic_sub_fetch(&hv_cpus_in_guest, 1, __ATOMIC_ACQUIRE);
-    spin_lock(&bhl);
     hv_wdt_breadcrumb('X');
-    exc_entry_time = mrs(CNTPCT_EL0);
+    PERCPU(exc_entry_time) = mrs(CNTPCT_EL0);
     /* disable PMU counters in the hypervisor */
     u64 pmcr0 = mrs(SYS_IMP_APL_PMCR0);
     PERCPU(exc_entry_pmcr0_cnt) = pmcr0 & PMCR0_CNT_MASK;
@@ -372,11 +1062,30 @@ static void hv_exc_exit(struct exc_info *ctx)
 {
     hv_wdt_breadcrumb('x');
     hv_update_fiq();
+    hv_pmu_sync();
     /* reenable PMU counters */
     reg_set(SYS_IMP_APL_PMCR0, PERCPU(exc_entry_pmcr0_cnt));
-    msr(CNTVOFF_EL2, stolen_time);
-    spin_unlock(&bhl);
-    __atomic_add_fetch(&hv_cpus_in_guest, 1, __ATOMIC_ACQUIRE);
+    hv_exc_unlock();
+
+    /*
+     * Don't slip back into the guest while another CPU has everyone rendezvoused for the proxy.
+     * Announce ourselves first and back off if it turns out one is in progress, so either the
+     * proxy CPU waits for us or we wait for it.
+     */
+    while (true) {
+        __atomic_add_fetch(&hv_cpus_in_guest, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&hv_proxy_active, __ATOMIC_SEQ_CST))
+            break;
+        __atomic_sub_fetch(&hv_cpus_in_guest, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&hv_proxy_active, __ATOMIC_ACQUIRE))
+            sysop("dmb sy");
+    }
+
+    msr(CNTVOFF_EL2, stolen_time + PERCPU(stolen_time));
+
+    u64 ticks = mrs(CNTPCT_EL0) - PERCPU(exc_entry_time);
+    PERCPU(stats).exit_ticks += ticks;
+    hv_stats_hist(PERCPU(stats).exit_hist, ticks);
 
     hv_set_spsr(ctx->spsr);
     hv_set_elr(ctx->elr);
@@ -389,13 +1098,30 @@ void hv_exc_sync(struct exc_info *ctx)
     hv_wdt_breadcrumb('S');
     hv_exc_entry(ctx);
     bool handled = false;
+    bool resume = false;
     u32 ec = FIELD_GET(ESR_EC, ctx->esr);
 
+    PERCPU(stats).sync_exits[ec]++;
+
     switch (ec) {
+        case ESR_EC_BKPT_LOWER:
+            resume = hv_handle_async_bp(ctx, ec);
+            break;
+        case ESR_EC_SSTEP_LOWER:
+            resume = hv_handle_async_bp(ctx, ec) || hv_handle_step(ctx);
+            break;
         case ESR_EC_DABORT_LOWER:
             hv_wdt_breadcrumb('D');
+            // MMIO emulation touches page tables, hook state and the exception guard
+            hv_exc_lock();
             handled = hv_handle_dabort(ctx);
             break;
+        case ESR_EC_HVC:
+            hv_wdt_breadcrumb('H');
+            // ELR already points past the hvc, so this resumes rather than skipping it
+            hv_exc_lock();
+            resume = hv_pvchan_hvc(ctx);
+            break;
         case ESR_EC_MSR:
             hv_wdt_breadcrumb('M');
             handled = hv_handle_msr(ctx, FIELD_GET(ESR_ISS, ctx->esr));
@@ -410,7 +1136,9 @@ void hv_exc_sync(struct exc_info *ctx)
             break;
     }
 
-    if (handled) {
+    if (resume) {
+        hv_wdt_breadcrumb('=');
+    } else if (handled) {
         hv_wdt_breadcrumb('+');
         ctx->elr += 4;
     } else {
@@ -430,6 +1158,7 @@ void hv_exc_irq(struct exc_info *ctx)
 {
     hv_wdt_breadcrumb('I');
     hv_exc_entry(ctx);
+    PERCPU(stats).irq_exits++;
     hv_exc_proxy(ctx, START_EXCEPTION_LOWER, EXC_IRQ, NULL);
     hv_exc_exit(ctx);
     hv_wdt_breadcrumb('i');
@@ -444,37 +1173,51 @@ void hv_exc_fiq(struct exc_info *ctx)
     if (mrs(CNTP_CTL_EL0) == (CNTx_CTL_ISTATUS | CNTx_CTL_ENABLE)) {
         msr(CNTP_CTL_EL0, CNTx_CTL_ISTATUS | CNTx_CTL_IMASK | CNTx_CTL_ENABLE);
         tick = true;
+        hv_profile_sample(ctx);
     }
 
     int interruptible_cpu = hv_pinned_cpu;
     if (interruptible_cpu == -1)
         interruptible_cpu = 0;
 
-    if (smp_id() != interruptible_cpu && !(mrs(ISR_EL1) & 0x40) && hv_want_cpu == -1) {
+    if (smp_id() != interruptible_cpu && !(mrs(ISR_EL1) & 0x40) && hv_want_cpu == -1 &&
+        PERCPU(pmu_gen) == __atomic_load_n(&pmu_gen, __ATOMIC_ACQUIRE)) {
         // Non-interruptible CPU and it was just a timer tick (or spurious), so just update FIQs
+        if (tick)
+            hv_flush_events();
+        PERCPU(stats).fiq_fast_exits++;
         hv_update_fiq();
         hv_arm_tick();
         return;
     }
 
-    // Slow (single threaded) path
+    // Slow path, only takes the HV lock for work that needs it
     hv_wdt_breadcrumb('F');
     hv_exc_entry(ctx);
+    PERCPU(stats).fiq_exits++;
 
     // Only poll for HV events in the interruptible CPU
     if (tick) {
-        if (smp_id() == interruptible_cpu)
+        hv_flush_events();
+        if (smp_id() == interruptible_cpu) {
+            hv_exc_lock();
             hv_tick(ctx);
+        }
         hv_arm_tick();
     }
 
     if (mrs(CNTV_CTL_EL0) == (CNTx_CTL_ISTATUS | CNTx_CTL_ENABLE)) {
         msr(CNTV_CTL_EL0, CNTx_CTL_ISTATUS | CNTx_CTL_IMASK | CNTx_CTL_ENABLE);
-        hv_exc_proxy(ctx, START_HV, HV_VTIMER, NULL);
+        if (vtimer_forward)
+            hv_exc_proxy(ctx, START_HV, HV_VTIMER, NULL);
     }
 
     u64 reg = mrs(SYS_IMP_APL_PMCR0);
-    if ((reg & (PMCR0_IMODE_MASK | PMCR0_IACT)) == (PMCR0_IMODE_FIQ | PMCR0_IACT)) {
+    if ((reg & (PMCR0_IMODE_MASK | PMCR0_IACT)) == (PMCR0_IMODE_FIQ | PMCR0_IACT) &&
+        PERCPU(pmu_owned)) {
+        hv_pmu_sample(ctx);
+        reg_clr(SYS_IMP_APL_PMCR0, PMCR0_IACT);
+    } else if ((reg & (PMCR0_IMODE_MASK | PMCR0_IACT)) == (PMCR0_IMODE_FIQ | PMCR0_IACT)) {
 #ifdef DEBUG_PMU_IRQ
         printf("[FIQ] PMC IRQ, masking and delivering to the guest\n");
 #endif
@@ -490,15 +1233,17 @@ void hv_exc_fiq(struct exc_info *ctx)
     }
 
     if (mrs(SYS_IMP_APL_IPI_SR_EL1) & IPI_SR_PENDING) {
-        if (PERCPU(ipi_queued)) {
+        // Other CPUs queue IPIs for us without holding the HV lock
+        if (__atomic_exchange_n(&PERCPU(ipi_queued), false, __ATOMIC_ACQUIRE))
             PERCPU(ipi_pending) = true;
-            PERCPU(ipi_queued) = false;
-        }
         msr(SYS_IMP_APL_IPI_SR_EL1, IPI_SR_PENDING);
         sysop("isb");
     }
 
-    hv_maybe_switch_cpu(ctx, START_HV, HV_CPU_SWITCH, NULL);
+    if (hv_want_cpu != -1) {
+        hv_exc_lock();
+        hv_maybe_switch_cpu(ctx, START_HV, HV_CPU_SWITCH, NULL);
+    }
 
     // Handles guest timers
     hv_exc_exit(ctx);
@@ -509,6 +1254,7 @@ void hv_exc_serr(struct exc_info *ctx)
 {
     hv_wdt_breadcrumb('E');
     hv_exc_entry(ctx);
+    PERCPU(stats).serr_exits++;
     hv_exc_proxy(ctx, START_EXCEPTION_LOWER, EXC_SERROR, NULL);
     hv_exc_exit(ctx);
     hv_wdt_breadcrumb('e');
@@ -0,0 +1,247 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "hv.h"
+#include "assert.h"
+#include "string.h"
+#include "utils.h"
+
+#define MAX_NATIVE_HOOKS 64
+#define MAX_SHADOW_REGS  16
+
+struct native_hook {
+    struct hv_native_hook cfg;
+    u64 shadow;
+    u64 reads;
+    u64 writes;
+};
+
+static struct native_hook native_hooks[MAX_NATIVE_HOOKS];
+static int native_hook_count = 0;
+
+struct shadow_regs {
+    struct hv_shadow_regs cfg;
+    u64 hits;
+    u64 forwarded;
+};
+
+static struct shadow_regs shadow_regs[MAX_SHADOW_REGS];
+static int shadow_regs_count = 0;
+
+static struct native_hook *find_hook(u64 addr)
+{
+    for (int i = 0; i < native_hook_count; i++) {
+        struct native_hook *h = &native_hooks[i];
+        if (addr >= h->cfg.start && addr < h->cfg.end)
+            return h;
+    }
+
+    return NULL;
+}
+
+static void fill(u64 *val, int width, u64 value)
+{
+    if (width < 3) {
+        val[0] = value & MASK(8 << width);
+        return;
+    }
+
+    for (int i = 0; i < (1 << width) / 8; i++)
+        val[i] = value;
+}
+
+static bool handle_native_hook(struct exc_info *ctx, u64 addr, u64 *val, bool write, int width)
+{
+    struct native_hook *h = find_hook(addr);
+
+    if (!h) {
+        printf("HV: native hook: no entry for 0x%lx\n", addr);
+        return false;
+    }
+
+    if (write)
+        h->writes++;
+    else
+        h->reads++;
+
+    switch (h->cfg.type) {
+        case HV_NATIVE_HOOK_CONST:
+            if (!write)
+                fill(val, width, h->cfg.value);
+            return true;
+
+        case HV_NATIVE_HOOK_SHADOW:
+            if (write)
+                h->shadow = val[0];
+            else
+                fill(val, width, h->shadow);
+            return true;
+
+        case HV_NATIVE_HOOK_MASK:
+            if (write)
+                val[0] = (val[0] & ~h->cfg.mask) | (h->cfg.value & h->cfg.mask);
+            return hv_pa_rw(ctx, addr, val, write, width);
+
+        case HV_NATIVE_HOOK_COUNT:
+            return hv_pa_rw(ctx, addr, val, write, width);
+
+        default:
+            printf("HV: native hook: bad type %d for 0x%lx\n", h->cfg.type, addr);
+            return false;
+    }
+}
+
+int hv_add_native_hook(const struct hv_native_hook *hook)
+{
+    if (hook->start >= hook->end)
+        return -1;
+
+    // Page table entries can't be any finer than this
+    if ((hook->start | hook->end) & 3)
+        return -1;
+
+    // Reconfiguring an existing range reuses its slot, partial overlaps are not allowed
+    struct native_hook *h = NULL;
+    for (int i = 0; i < native_hook_count; i++) {
+        struct native_hook *p = &native_hooks[i];
+        if (hook->start >= p->cfg.end || hook->end <= p->cfg.start)
+            continue;
+        if (hook->start != p->cfg.start || hook->end != p->cfg.end)
+            return -1;
+        h = p;
+    }
+
+    if (!h) {
+        if (native_hook_count >= MAX_NATIVE_HOOKS)
+            return -1;
+        h = &native_hooks[native_hook_count++];
+    }
+
+    h->cfg = *hook;
+    h->shadow = hook->value;
+    h->reads = h->writes = 0;
+
+    hv_map_hook(hook->start, handle_native_hook, hook->end - hook->start);
+
+    return h - native_hooks;
+}
+
+u64 hv_get_native_hook_count(int index, bool write)
+{
+    if (index < 0 || index >= native_hook_count)
+        return 0;
+
+    return write ? native_hooks[index].writes : native_hooks[index].reads;
+}
+
+static struct shadow_regs *find_shadow(u64 addr)
+{
+    for (int i = 0; i < shadow_regs_count; i++) {
+        struct shadow_regs *s = &shadow_regs[i];
+        if (addr >= s->cfg.start && addr < s->cfg.end)
+            return s;
+    }
+
+    return NULL;
+}
+
+static bool shadow_is_cached(struct shadow_regs *s, u64 off, int width)
+{
+    const u32 *bitmap = (const u32 *)s->cfg.cached;
+    u64 first = off / 4;
+    u64 last = (off + (1 << width) - 1) / 4;
+
+    for (u64 w = first; w <= last; w++)
+        if (!(bitmap[w / 32] & BIT(w % 32)))
+            return false;
+
+    return true;
+}
+
+static bool handle_shadow_regs(struct exc_info *ctx, u64 addr, u64 *val, bool write, int width)
+{
+    struct shadow_regs *s = find_shadow(addr);
+
+    if (!s) {
+        printf("HV: shadow regs: no entry for 0x%lx\n", addr);
+        return false;
+    }
+
+    u64 off = addr - s->cfg.start;
+    u8 *shadow = (u8 *)s->cfg.shadow + off;
+    bool cached = (off + (1 << width)) <= (s->cfg.end - s->cfg.start) &&
+                  shadow_is_cached(s, off, width);
+
+    if (cached) {
+        s->hits++;
+        if (!write) {
+            memcpy(val, shadow, 1 << width);
+            return true;
+        }
+        memcpy(shadow, val, 1 << width);
+        if (s->cfg.flags & HV_SHADOW_ABSORB_WRITES)
+            return true;
+    } else {
+        s->forwarded++;
+    }
+
+    if (!(s->cfg.flags & HV_SHADOW_FORWARD_HOST))
+        return hv_pa_rw(ctx, addr, val, write, width);
+
+    struct hv_vm_proxy_hook_data hook = {
+        .flags = FIELD_PREP(MMIO_EVT_WIDTH, width) | (write ? MMIO_EVT_WRITE : 0),
+        .id = s->cfg.hook_id,
+        .addr = addr,
+    };
+
+    if (write)
+        memcpy(hook.data, val, 1 << width);
+    hv_exc_proxy(ctx, START_HV, HV_HOOK_VM, &hook);
+    if (!write)
+        memcpy(val, hook.data, 1 << width);
+
+    return true;
+}
+
+/*
+ * Map a shadowed register block, or reconfigure one already covering exactly the same range.
+ * Reconfiguring also maps it again, for when the host has changed the page tables under it.
+ */
+int hv_add_shadow_regs(const struct hv_shadow_regs *regs)
+{
+    if (regs->start >= regs->end || ((regs->start | regs->end) & 3))
+        return -1;
+
+    if (!regs->shadow || !regs->cached)
+        return -1;
+
+    struct shadow_regs *s = NULL;
+    for (int i = 0; i < shadow_regs_count; i++) {
+        struct shadow_regs *p = &shadow_regs[i];
+        if (regs->start >= p->cfg.end || regs->end <= p->cfg.start)
+            continue;
+        if (regs->start != p->cfg.start || regs->end != p->cfg.end)
+            return -1;
+        s = p;
+    }
+
+    if (!s) {
+        if (shadow_regs_count >= MAX_SHADOW_REGS)
+            return -1;
+        s = &shadow_regs[shadow_regs_count++];
+        s->hits = s->forwarded = 0;
+    }
+
+    s->cfg = *regs;
+
+    hv_map_hook(regs->start, handle_shadow_regs, regs->end - regs->start);
+
+    return s - shadow_regs;
+}
+
+u64 hv_get_shadow_regs_count(int index, bool forwarded)
+{
+    if (index < 0 || index >= shadow_regs_count)
+        return 0;
+
+    return forwarded ? shadow_regs[index].forwarded : shadow_regs[index].hits;
+}
@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "hv.h"
+#include "cpu_regs.h"
+#include "iodev.h"
+#include "string.h"
+#include "usb.h"
+
+/*
+ * Paravirtual channel for guests that know they run under m1n1. The guest provides a region of
+ * its own memory holding a struct hv_pvchan_ring followed by the TX and RX data areas (size bytes
+ * each) and registers it with HV_PVCHAN_OP_SETUP. Data moves between the rings and the iodev on
+ * HV_PVCHAN_OP_KICK and on every HV tick, so the guest only traps when it wants data to go out
+ * right away.
+ *
+ * Calls are "hvc #HV_PVCHAN_HVC" with the op in x0 and arguments in x1..., the result comes back in
+ * x0. The ring indices are free-running, each side only ever writes its own two.
+ */
+#define HV_PVCHAN_HVC   0x4d31
+#define HV_PVCHAN_MAGIC 0x48435650 // 'PVCH'
+
+enum hv_pvchan_op {
+    HV_PVCHAN_OP_SETUP = 0, // x1 = IPA of the region, x2 = its size
+    HV_PVCHAN_OP_KICK = 1,
+};
+
+struct hv_pvchan_ring {
+    u32 magic;
+    u32 size;
+    u32 tx_head; // guest
+    u32 tx_tail; // HV
+    u32 rx_head; // HV
+    u32 rx_tail; // guest
+    u32 pad[2];
+};
+
+static bool pvchan_active = false;
+static iodev_id_t pvchan_iodev;
+
+static struct hv_pvchan_ring *pvchan_ring;
+static u8 *pvchan_tx;
+static u8 *pvchan_rx;
+static u32 pvchan_size;
+
+static s64 hv_pvchan_setup(u64 ipa, u64 size)
+{
+    pvchan_ring = NULL;
+
+    if (ipa & (SZ_16K - 1) || size <= sizeof(struct hv_pvchan_ring) || size > SZ_32M)
+        return -1;
+
+    u64 pa = hv_translate_ipa(ipa);
+    if (!pa)
+        return -1;
+
+    // m1n1 accesses the ring through its own mapping, so it has to be physically contiguous
+    for (u64 off = SZ_16K; off < size; off += SZ_16K)
+        if (hv_translate_ipa(ipa + off) != pa + off)
+            return -1;
+
+    struct hv_pvchan_ring *ring = (void *)pa;
+    u32 data_size = ring->size;
+
+    if (ring->magic != HV_PVCHAN_MAGIC || !data_size || (data_size & (data_size - 1)) ||
+        sizeof(*ring) + 2 * (u64)data_size > size)
+        return -1;
+
+    ring->tx_tail = ring->tx_head;
+    ring->rx_head = ring->rx_tail;
+
+    pvchan_size = data_size;
+    pvchan_tx = (u8 *)(ring + 1);
+    pvchan_rx = pvchan_tx + data_size;
+    __atomic_store_n(&pvchan_ring, ring, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static bool hv_pvchan_drain_tx(void)
+{
+    u32 head = __atomic_load_n(&pvchan_ring->tx_head, __ATOMIC_ACQUIRE);
+    u32 tail = pvchan_ring->tx_tail;
+
+    u32 old_tail = tail;
+
+    if (head - tail > pvchan_size)
+        return false;
+
+    // Leave the data in the ring until someone is listening, the guest sees it fill up
+    while (head != tail && iodev_can_write(pvchan_iodev)) {
+        u32 off = tail & (pvchan_size - 1);
+        u32 chunk = min(head - tail, pvchan_size - off);
+
+        iodev_write(pvchan_iodev, &pvchan_tx[off], chunk);
+        tail += chunk;
+    }
+
+    __atomic_store_n(&pvchan_ring->tx_tail, tail, __ATOMIC_RELEASE);
+    return tail != old_tail;
+}
+
+static bool hv_pvchan_fill_rx(void)
+{
+    u32 head = pvchan_ring->rx_head;
+    u32 old_head = head;
+    u32 tail = __atomic_load_n(&pvchan_ring->rx_tail, __ATOMIC_ACQUIRE);
+
+    iodev_handle_events(pvchan_iodev);
+
+    while (head - tail < pvchan_size) {
+        u32 off = head & (pvchan_size - 1);
+        u32 space = min(pvchan_size - (head - tail), pvchan_size - off);
+        ssize_t queued = iodev_can_read(pvchan_iodev);
+
+        if (queued <= 0)
+            break;
+
+        ssize_t ret = iodev_read(pvchan_iodev, &pvchan_rx[off], min((u32)queued, space));
+        if (ret <= 0)
+            break;
+
+        head += ret;
+    }
+
+    __atomic_store_n(&pvchan_ring->rx_head, head, __ATOMIC_RELEASE);
+    return head != old_head;
+}
+
+static bool hv_pvchan_xfer(void)
+{
+    if (!pvchan_ring)
+        return false;
+
+    bool busy = hv_pvchan_drain_tx();
+    busy |= hv_pvchan_fill_rx();
+    return busy;
+}
+
+bool hv_pvchan_hvc(struct exc_info *ctx)
+{
+    if (!pvchan_active || FIELD_GET(ESR_ISS, ctx->esr) != HV_PVCHAN_HVC)
+        return false;
+
+    switch (ctx->regs[0]) {
+        case HV_PVCHAN_OP_SETUP:
+            ctx->regs[0] = hv_pvchan_setup(ctx->regs[1], ctx->regs[2]);
+            break;
+        case HV_PVCHAN_OP_KICK:
+            if (pvchan_ring) {
+                hv_pvchan_xfer();
+                hv_tick_kick();
+                ctx->regs[0] = 0;
+            } else {
+                ctx->regs[0] = -1;
+            }
+            break;
+        default:
+            ctx->regs[0] = -1;
+            break;
+    }
+
+    return true;
+}
+
+/* Returns true if any data moved */
+bool hv_pvchan_poll(void)
+{
+    if (!pvchan_active)
+        return false;
+
+    return hv_pvchan_xfer();
+}
+
+/*
+ * The channel is carried over the same secondary USB pipe as the vUART, for guests that use it
+ * instead of the emulated UART.
+ */
+void hv_map_pvchan(iodev_id_t iodev)
+{
+    usb_iodev_vuart_setup(iodev);
+    pvchan_iodev = IODEV_USB_VUART;
+    pvchan_ring = NULL;
+    pvchan_active = true;
+}
@@ -0,0 +1,161 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "hv.h"
+#include "cpu_regs.h"
+#include "memory.h"
+#include "smp.h"
+#include "utils.h"
+
+#define MAX_SYSREG_EMU 64
+
+#define ISS_OP0(iss) (((iss) >> ESR_ISS_MSR_OP0_SHIFT) & 3)
+#define ISS_OP1(iss) (((iss) >> ESR_ISS_MSR_OP1_SHIFT) & 7)
+#define ISS_CRn(iss) (((iss) >> ESR_ISS_MSR_CRn_SHIFT) & 0xf)
+#define ISS_CRm(iss) (((iss) >> ESR_ISS_MSR_CRm_SHIFT) & 0xf)
+#define ISS_OP2(iss) (((iss) >> ESR_ISS_MSR_OP2_SHIFT) & 7)
+
+#define STUB_CALL(type, p) ((type *)((u64)(p) | REGION_RX_EL1))
+
+#define ISS_SYSREG_MASK                                                                            \
+    (ESR_ISS_MSR_OP0 | ESR_ISS_MSR_OP2 | ESR_ISS_MSR_OP1 | ESR_ISS_MSR_CRn | ESR_ISS_MSR_CRm)
+
+typedef u64(sysreg_read_t)(void);
+typedef void(sysreg_write_t)(u64 val);
+
+/*
+ * mrs x0, <reg>; ret / msr <reg>, x0; ret, generated for whatever the host asks for. With SPRR
+ * the identity mapping is not executable, so these are called through the RX alias.
+ */
+struct sysreg_stub {
+    u32 read[2];
+    u32 write[2];
+} ALIGNED(16);
+
+static struct hv_sysreg_emu sysreg_emu[MAX_SYSREG_EMU];
+static struct sysreg_stub sysreg_stubs[MAX_SYSREG_EMU];
+static struct sysreg_stub watch_stubs[MAX_CPUS];
+static u64 sysreg_shadow[MAX_CPUS][MAX_SYSREG_EMU];
+static int sysreg_emu_count = 0;
+
+static u32 sysreg_insn(u32 iss, bool read)
+{
+    return (read ? 0xd5200000 : 0xd5000000) | (ISS_OP0(iss) << 19) | (ISS_OP1(iss) << 16) |
+           (ISS_CRn(iss) << 12) | (ISS_CRm(iss) << 8) | (ISS_OP2(iss) << 5);
+}
+
+static void sysreg_stub_init(struct sysreg_stub *stub, u32 target)
+{
+    stub->read[0] = sysreg_insn(target, true);
+    stub->read[1] = 0xd65f03c0; // ret
+    stub->write[0] = sysreg_insn(target, false);
+    stub->write[1] = 0xd65f03c0; // ret
+    dc_cvau_range(stub, sizeof(*stub));
+    sysop("dsb ish");
+    ic_ivau_range(stub, sizeof(*stub));
+    sysop("dsb ish");
+    sysop("isb");
+}
+
+int hv_add_sysreg_emu(const struct hv_sysreg_emu *emu)
+{
+    if (emu->sysreg & ~ISS_SYSREG_MASK || emu->target & ~ISS_SYSREG_MASK)
+        return -1;
+
+    if (emu->type > HV_SYSREG_LOG)
+        return -1;
+
+    int idx;
+    for (idx = 0; idx < sysreg_emu_count; idx++)
+        if (sysreg_emu[idx].sysreg == emu->sysreg)
+            break;
+
+    if (idx >= MAX_SYSREG_EMU)
+        return -1;
+
+    u32 target = emu->target ? emu->target : emu->sysreg;
+    struct sysreg_stub *stub = &sysreg_stubs[idx];
+
+    sysreg_stub_init(stub, target);
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+        sysreg_shadow[cpu][idx] = emu->value;
+
+    sysreg_emu[idx] = *emu;
+    sysreg_emu[idx].target = target;
+
+    if (idx == sysreg_emu_count)
+        __atomic_store_n(&sysreg_emu_count, idx + 1, __ATOMIC_RELEASE);
+
+    return idx;
+}
+
+void hv_clear_sysreg_emu(void)
+{
+    __atomic_store_n(&sysreg_emu_count, 0, __ATOMIC_RELEASE);
+}
+
+/* Per-CPU register read by the stepping engine's HV_STEP_SYSREG condition */
+bool hv_sysreg_watch_init(u32 reg)
+{
+    if (reg & ~ISS_SYSREG_MASK)
+        return false;
+
+    sysreg_stub_init(&watch_stubs[smp_id()], reg);
+    return true;
+}
+
+u64 hv_sysreg_watch_read(void)
+{
+    return STUB_CALL(sysreg_read_t, watch_stubs[smp_id()].read)();
+}
+
+bool hv_sysreg_emulate(struct exc_info *ctx, u32 reg, u64 rt, bool is_read)
+{
+    int count = __atomic_load_n(&sysreg_emu_count, __ATOMIC_ACQUIRE);
+    u64 *regs = ctx->regs;
+    int idx;
+
+    for (idx = 0; idx < count; idx++)
+        if (sysreg_emu[idx].sysreg == reg)
+            break;
+
+    if (idx >= count)
+        return false;
+
+    struct hv_sysreg_emu *emu = &sysreg_emu[idx];
+    struct sysreg_stub *stub = &sysreg_stubs[idx];
+
+    switch (emu->type) {
+        case HV_SYSREG_CONST:
+            if (is_read)
+                regs[rt] = emu->value;
+            break;
+
+        case HV_SYSREG_SHADOW:
+            if (is_read)
+                regs[rt] = sysreg_shadow[smp_id()][idx];
+            else
+                sysreg_shadow[smp_id()][idx] = regs[rt];
+            break;
+
+        case HV_SYSREG_WI:
+            if (is_read)
+                regs[rt] = STUB_CALL(sysreg_read_t, stub->read)();
+            break;
+
+        case HV_SYSREG_LOG:
+        case HV_SYSREG_PASS:
+            if (is_read)
+                regs[rt] = STUB_CALL(sysreg_read_t, stub->read)();
+            else
+                STUB_CALL(sysreg_write_t, stub->write)(regs[rt]);
+
+            if (emu->type == HV_SYSREG_LOG)
+                printf("HV: CPU %d: %s s%d_%d_c%d_c%d_%d = 0x%lx\n", smp_id(),
+                       is_read ? "mrs" : "msr", ISS_OP0(reg), ISS_OP1(reg), ISS_CRn(reg),
+                       ISS_CRm(reg), ISS_OP2(reg), regs[rt]);
+            break;
+    }
+
+    return true;
+}
@@ -4,10 +4,13 @@
 
 #include "hv.h"
 #include "assert.h"
+#include "binlog.h"
 #include "cpu_regs.h"
 #include "exception.h"
+#include "gxf.h"
 #include "iodev.h"
 #include "malloc.h"
+#include "memstats.h"
 #include "smp.h"
 #include "string.h"
 #include "types.h"
@@ -21,6 +24,7 @@
 #define PTE_ACCESS            BIT(10)
 #define PTE_SH_NS             (0b11L << 8)
 #define PTE_S2AP_RW           (0b11L << 6)
+#define PTE_S2AP_W            BIT(7)
 #define PTE_MEMATTR_UNCHANGED (0b1111L << 2)
 
 #define PTE_ATTRIBUTES (PTE_ACCESS | PTE_SH_NS | PTE_S2AP_RW | PTE_MEMATTR_UNCHANGED)
@@ -33,6 +37,8 @@
 #define PTE_TABLE 1
 #define PTE_PAGE  1
 
+#define PTE_DIRTY_WP BIT(55) // software bit: write protected for dirty tracking
+
 #define VADDR_L4_INDEX_BITS 12
 #define VADDR_L3_INDEX_BITS 11
 #define VADDR_L2_INDEX_BITS 11
@@ -112,6 +118,70 @@ uint64_t vaddr_bits;
 
 static u64 *hv_Ltop;
 
+/*
+ * Page table pages come from a dedicated pool instead of going back and forth through
+ * malloc. Remapping large ranges frees and reallocates lots of tables, and this keeps that
+ * cheap and the heap unfragmented. There is one free list per table size (16K for L2/L3 and
+ * 32K for L4), refilled a chunk at a time.
+ */
+#define PT_POOL_CHUNK      SZ_1M
+#define PT_TABLE_SIZE      (ENTRIES_PER_L3_TABLE * sizeof(u64))
+#define PT_L4_TABLE_SIZE   (ENTRIES_PER_L4_TABLE * sizeof(u64))
+#define TLBI_RANGE_MAX_IPA (64 * PAGE_SIZE)
+
+struct pt_free_page {
+    struct pt_free_page *next;
+};
+
+static struct pt_free_page *pt_pool[2];
+
+static u64 *hv_pt_alloc(size_t size)
+{
+    int cls = size == PT_L4_TABLE_SIZE;
+
+    if (!pt_pool[cls]) {
+        u8 *chunk = memalign(PAGE_SIZE, PT_POOL_CHUNK);
+        assert(chunk);
+        memstat_reserve(MEMSTAT_HV_PT, PT_POOL_CHUNK);
+        for (size_t off = 0; off < PT_POOL_CHUNK; off += size) {
+            struct pt_free_page *page = (struct pt_free_page *)(chunk + off);
+            page->next = pt_pool[cls];
+            pt_pool[cls] = page;
+        }
+    }
+
+    struct pt_free_page *page = pt_pool[cls];
+    pt_pool[cls] = page->next;
+    memstat_alloc(MEMSTAT_HV_PT, size);
+    return (u64 *)page;
+}
+
+static void hv_pt_free(u64 *table, size_t size)
+{
+    struct pt_free_page *page = (struct pt_free_page *)table;
+    int cls = size == PT_L4_TABLE_SIZE;
+
+    page->next = pt_pool[cls];
+    pt_pool[cls] = page;
+    memstat_free(MEMSTAT_HV_PT, size);
+}
+
+static void hv_pt_flush_tlb(u64 from, u64 size)
+{
+    sysop("dsb ishst");
+    if (size <= TLBI_RANGE_MAX_IPA) {
+        for (u64 ipa = ALIGN_DOWN(from, PAGE_SIZE); ipa < from + size; ipa += PAGE_SIZE)
+            __asm__ volatile("tlbi ipas2e1is, %0" : : "r"(ipa >> 12));
+        sysop("dsb ish");
+        // Combined stage 1+2 entries are tagged by VA only, so those have to go too
+        sysop("tlbi vmalle1is");
+    } else {
+        sysop("tlbi vmalls12e1is");
+    }
+    sysop("dsb ish");
+    sysop("isb");
+}
+
 void hv_pt_init(void)
 {
     const uint64_t pa_bits[] = {32, 36, 40, 42, 44, 48, 52};
@@ -151,7 +221,7 @@ static u64 *hv_pt_get_l2(u64 from)
     if (L1_IS_TABLE(l1d))
         return (u64 *)(l1d & PTE_TARGET_MASK);
 
-    u64 *l2 = (u64 *)memalign(PAGE_SIZE, ENTRIES_PER_L2_TABLE * sizeof(u64));
+    u64 *l2 = hv_pt_alloc(PT_TABLE_SIZE);
     memset64(l2, 0, ENTRIES_PER_L2_TABLE * sizeof(u64));
 
     l1d = ((u64)l2) | FIELD_PREP(PTE_TYPE, PTE_TABLE) | PTE_VALID;
@@ -166,8 +236,8 @@ static void hv_pt_free_l3(u64 *l3)
 
     for (u64 idx = 0; idx < ENTRIES_PER_L3_TABLE; idx++)
         if (IS_SW(l3[idx]) && FIELD_GET(PTE_TYPE, l3[idx]) == PTE_TABLE)
-            free((void *)(l3[idx] & PTE_TARGET_MASK));
-    free(l3);
+            hv_pt_free((u64 *)(l3[idx] & PTE_TARGET_MASK), PT_L4_TABLE_SIZE);
+    hv_pt_free(l3, PT_TABLE_SIZE);
 }
 
 static void hv_pt_map_l2(u64 from, u64 to, u64 size, u64 incr)
@@ -200,7 +270,7 @@ static u64 *hv_pt_get_l3(u64 from)
     if (L2_IS_TABLE(l2d))
         return (u64 *)(l2d & PTE_TARGET_MASK);
 
-    u64 *l3 = (u64 *)memalign(PAGE_SIZE, ENTRIES_PER_L3_TABLE * sizeof(u64));
+    u64 *l3 = hv_pt_alloc(PT_TABLE_SIZE);
     if (l2d) {
         u64 incr = 0;
         u64 l3d = l2d;
@@ -222,6 +292,52 @@ static u64 *hv_pt_get_l3(u64 from)
     return l3;
 }
 
+/*
+ * Fold an L3 table back into a single L2 block if all of its entries describe one contiguous
+ * (or, for hooks, identical) 32MB mapping. This keeps the stage 2 tables, and the TLB footprint,
+ * small after large map_hw calls that were built up page by page.
+ */
+static void hv_pt_coalesce_l3(u64 from)
+{
+    u64 *l2 = hv_pt_get_l2(from);
+    u64 l2idx = (from >> VADDR_L2_OFFSET_BITS) & MASK(VADDR_L2_INDEX_BITS);
+    u64 l2d = l2[l2idx];
+
+    if (!L2_IS_TABLE(l2d))
+        return;
+
+    u64 *l3 = (u64 *)(l2d & PTE_TARGET_MASK);
+    u64 l3d = l3[0];
+    u64 block = l3d;
+    u64 incr = 0;
+
+    if (L3_IS_TABLE(l3d))
+        return;
+
+    if (IS_HW(l3d)) {
+        if (l3d & PTE_TARGET_MASK & MASK(VADDR_L2_OFFSET_BITS))
+            return;
+        block &= ~PTE_TYPE;
+        block |= FIELD_PREP(PTE_TYPE, PTE_BLOCK);
+        incr = BIT(VADDR_L3_OFFSET_BITS);
+    } else if (IS_SW(l3d) && FIELD_GET(SPTE_TYPE, l3d) == SPTE_MAP) {
+        incr = BIT(VADDR_L3_OFFSET_BITS);
+    }
+
+    for (u64 idx = 1; idx < ENTRIES_PER_L3_TABLE; idx++)
+        if (l3[idx] != l3d + idx * incr)
+            return;
+
+    // Break before make, the guest may have TLB entries from the old table
+    if (IS_HW(block)) {
+        l2[l2idx] = 0;
+        hv_pt_flush_tlb(ALIGN_DOWN(from, BIT(VADDR_L2_OFFSET_BITS)), BIT(VADDR_L2_OFFSET_BITS));
+    }
+
+    l2[l2idx] = block;
+    hv_pt_free(l3, PT_TABLE_SIZE);
+}
+
 static void hv_pt_map_l3(u64 from, u64 to, u64 size, u64 incr)
 {
     assert((from & MASK(VADDR_L3_OFFSET_BITS)) == 0);
@@ -238,9 +354,14 @@ static void hv_pt_map_l3(u64 from, u64 to, u64 size, u64 incr)
         u64 *l3 = hv_pt_get_l3(from);
 
         if (L3_IS_TABLE(l3[idx]))
-            free((void *)(l3[idx] & PTE_TARGET_MASK));
+            hv_pt_free((u64 *)(l3[idx] & PTE_TARGET_MASK), PT_L4_TABLE_SIZE);
 
         l3[idx] = to;
+
+        // Done with this L3 table, see if it can become a block again
+        if (idx == ENTRIES_PER_L3_TABLE - 1 || size == BIT(VADDR_L3_OFFSET_BITS))
+            hv_pt_coalesce_l3(from);
+
         from += BIT(VADDR_L3_OFFSET_BITS);
         to += incr * BIT(VADDR_L3_OFFSET_BITS);
     }
@@ -262,7 +383,7 @@ static u64 *hv_pt_get_l4(u64 from)
         l3d |= FIELD_PREP(PTE_TYPE, PTE_BLOCK) | FIELD_PREP(SPTE_TYPE, SPTE_MAP);
     }
 
-    u64 *l4 = (u64 *)memalign(PAGE_SIZE, ENTRIES_PER_L4_TABLE * sizeof(u64));
+    u64 *l4 = hv_pt_alloc(PT_L4_TABLE_SIZE);
     if (l3d) {
         u64 incr = 0;
         u64 l4d = l3d;
@@ -281,6 +402,34 @@ static u64 *hv_pt_get_l4(u64 from)
     return l4;
 }
 
+/* Same as above, folding an all-software L4 table back into one L3 entry */
+static void hv_pt_coalesce_l4(u64 from)
+{
+    u64 *l3 = hv_pt_get_l3(from);
+    u64 l3idx = (from >> VADDR_L3_OFFSET_BITS) & MASK(VADDR_L3_INDEX_BITS);
+    u64 l3d = l3[l3idx];
+
+    if (!L3_IS_TABLE(l3d))
+        return;
+
+    u64 *l4 = (u64 *)(l3d & PTE_TARGET_MASK);
+    u64 l4d = l4[0];
+    u64 incr = 0;
+
+    if (l4d && FIELD_GET(SPTE_TYPE, l4d) == SPTE_MAP)
+        incr = BIT(VADDR_L4_OFFSET_BITS);
+
+    for (u64 idx = 1; idx < ENTRIES_PER_L4_TABLE; idx++)
+        if (l4[idx] != l4d + idx * incr)
+            return;
+
+    // Software entries are never seen by the hardware, so no break-before-make here
+    l3[l3idx] = l4d ? (l4d & ~PTE_TYPE) | FIELD_PREP(PTE_TYPE, PTE_BLOCK) : 0;
+    hv_pt_free(l4, PT_L4_TABLE_SIZE);
+
+    hv_pt_coalesce_l3(from);
+}
+
 static void hv_pt_map_l4(u64 from, u64 to, u64 size, u64 incr)
 {
     assert((from & MASK(VADDR_L4_OFFSET_BITS)) == 0);
@@ -291,6 +440,8 @@ static void hv_pt_map_l4(u64 from, u64 to, u64 size, u64 incr)
     if (IS_SW(to))
         to |= FIELD_PREP(PTE_TYPE, PTE_PAGE);
 
+    u64 start = from;
+
     for (; size; size -= BIT(VADDR_L4_OFFSET_BITS)) {
         u64 idx = (from >> VADDR_L4_OFFSET_BITS) & MASK(VADDR_L4_INDEX_BITS);
         u64 *l4 = hv_pt_get_l4(from);
@@ -299,9 +450,12 @@ static void hv_pt_map_l4(u64 from, u64 to, u64 size, u64 incr)
         from += BIT(VADDR_L4_OFFSET_BITS);
         to += incr * BIT(VADDR_L4_OFFSET_BITS);
     }
+
+    // hv_map never passes ranges crossing an L3 boundary here
+    hv_pt_coalesce_l4(start);
 }
 
-int hv_map(u64 from, u64 to, u64 size, u64 incr)
+static int hv_map_range(u64 from, u64 to, u64 size, u64 incr)
 {
     u64 chunk;
     bool hw = IS_HW(to);
@@ -361,6 +515,48 @@ int hv_map(u64 from, u64 to, u64 size, u64 incr)
     return 0;
 }
 
+int hv_map(u64 from, u64 to, u64 size, u64 incr)
+{
+    if (hv_map_range(from, to, size, incr) < 0)
+        return -1;
+
+    hv_pt_flush_tlb(from, size);
+    hv_xlate_invalidate();
+
+    return 0;
+}
+
+/*
+ * Applies a list of hv_map() calls with a single TLB invalidation covering all of them. Stops at
+ * the first bad descriptor, but still flushes whatever was mapped before it.
+ */
+int hv_map_batch(const struct hv_map_desc *descs, size_t count)
+{
+    u64 lo = ~0UL, hi = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct hv_map_desc *d = &descs[i];
+
+        if (hv_map_range(d->from, d->to, d->size, d->incr) < 0) {
+            printf("HV: bad map descriptor %ld (0x%lx -> 0x%lx, 0x%lx)\n", i, d->from, d->to,
+                   d->size);
+            ret = -1;
+            break;
+        }
+
+        lo = min(lo, d->from);
+        hi = max(hi, d->from + d->size);
+    }
+
+    if (hi > lo) {
+        hv_pt_flush_tlb(lo, hi - lo);
+        hv_xlate_invalidate();
+    }
+
+    return ret;
+}
+
 int hv_unmap(u64 from, u64 size)
 {
     return hv_map(from, 0, size, 0);
@@ -381,6 +577,146 @@ int hv_map_hook(u64 from, hv_hook_t *hook, u64 size)
     return hv_map(from, ((u64)hook) | FIELD_PREP(SPTE_TYPE, SPTE_HOOK), size, 0);
 }
 
+/*
+ * Dirty page tracking for guest memory snapshots. While it is active, every HW mapped page in the
+ * tracked range is write protected at stage 2 and tagged with PTE_DIRTY_WP. The first write to
+ * one of them faults, sets its bit in the bitmap and gives the page its write permission back, so
+ * tracking costs one exception per page per snapshot interval. Mappings made after tracking was
+ * started (or rearmed) are not tracked.
+ */
+static struct {
+    u64 base;
+    u64 end;
+    u64 *bitmap;
+} dirty;
+
+static inline u64 hv_dirty_pages(void)
+{
+    return (dirty.end - dirty.base) >> VADDR_L3_OFFSET_BITS;
+}
+
+static u64 *hv_dirty_l3e(u64 ipa)
+{
+    return &hv_pt_get_l3(ipa)[(ipa >> VADDR_L3_OFFSET_BITS) & MASK(VADDR_L3_INDEX_BITS)];
+}
+
+static void hv_dirty_protect(u64 ipa)
+{
+    // Software mappings trap anyway, and L2 blocks get split up by hv_pt_get_l3()
+    if (!IS_HW(hv_pt_walk(ipa)))
+        return;
+
+    u64 *l3e = hv_dirty_l3e(ipa);
+    *l3e = (*l3e & ~PTE_S2AP_W) | PTE_DIRTY_WP;
+}
+
+static bool hv_dirty_fault(u64 ipa)
+{
+    if (!dirty.bitmap || ipa < dirty.base || ipa >= dirty.end)
+        return false;
+
+    u64 *l3e = hv_dirty_l3e(ipa);
+    if (!(*l3e & PTE_DIRTY_WP))
+        return false;
+
+    *l3e = (*l3e | PTE_S2AP_W) & ~PTE_DIRTY_WP;
+
+    u64 page = (ipa - dirty.base) >> VADDR_L3_OFFSET_BITS;
+    dirty.bitmap[page / 64] |= BIT(page % 64);
+
+    hv_pt_flush_tlb(ALIGN_DOWN(ipa, PAGE_SIZE), PAGE_SIZE);
+    hv_xlate_invalidate();
+
+    return true;
+}
+
+int hv_dirty_start(u64 base, u64 size)
+{
+    if (dirty.bitmap)
+        hv_dirty_stop();
+
+    if (!size || (base | size) & MASK(VADDR_L3_OFFSET_BITS) || base + size > BIT(vaddr_bits))
+        return -1;
+
+    dirty.base = base;
+    dirty.end = base + size;
+    dirty.bitmap = calloc(ALIGN_UP(hv_dirty_pages(), 64) / 64, sizeof(u64));
+    if (!dirty.bitmap)
+        return -1;
+
+    for (u64 ipa = base; ipa < dirty.end; ipa += PAGE_SIZE)
+        hv_dirty_protect(ipa);
+
+    hv_pt_flush_tlb(base, size);
+    hv_xlate_invalidate();
+
+    return 0;
+}
+
+/*
+ * Copies up to size bytes of the dirty bitmap (one bit per page, LSB first) to dst and returns
+ * the number of dirty pages. With rearm, the dirty pages are write protected again and the
+ * bitmap cleared, so the next call only reports pages written after this one.
+ */
+s64 hv_dirty_fetch(void *dst, size_t size, bool rearm)
+{
+    if (!dirty.bitmap)
+        return -1;
+
+    u64 words = ALIGN_UP(hv_dirty_pages(), 64) / 64;
+    s64 count = 0;
+
+    memcpy(dst, dirty.bitmap, min(size, words * sizeof(u64)));
+
+    for (u64 i = 0; i < words; i++) {
+        u64 w = dirty.bitmap[i];
+
+        count += __builtin_popcountl(w);
+        if (!rearm)
+            continue;
+
+        for (; w; w &= w - 1)
+            hv_dirty_protect(dirty.base + (i * 64 + __builtin_ctzl(w)) * PAGE_SIZE);
+        dirty.bitmap[i] = 0;
+    }
+
+    if (rearm && count) {
+        hv_pt_flush_tlb(dirty.base, dirty.end - dirty.base);
+        hv_xlate_invalidate();
+    }
+
+    return count;
+}
+
+void hv_dirty_stop(void)
+{
+    bool restored = false;
+
+    if (!dirty.bitmap)
+        return;
+
+    for (u64 ipa = dirty.base; ipa < dirty.end; ipa += PAGE_SIZE) {
+        if (hv_pt_walk(ipa) & PTE_DIRTY_WP) {
+            u64 *l3e = hv_dirty_l3e(ipa);
+            *l3e = (*l3e | PTE_S2AP_W) & ~PTE_DIRTY_WP;
+            restored = true;
+        }
+
+        // Put back the L2 blocks that hv_dirty_protect() had to split
+        if (restored && (ipa + PAGE_SIZE == dirty.end ||
+                         !((ipa + PAGE_SIZE) & MASK(VADDR_L2_OFFSET_BITS)))) {
+            hv_pt_coalesce_l3(ipa);
+            restored = false;
+        }
+    }
+
+    hv_pt_flush_tlb(dirty.base, dirty.end - dirty.base);
+    hv_xlate_invalidate();
+
+    free(dirty.bitmap);
+    dirty.bitmap = NULL;
+}
+
 u64 hv_translate(u64 addr, bool s1, bool w, u64 *par_out)
 {
     if (!(mrs(SCTLR_EL12) & SCTLR_M))
@@ -428,6 +764,112 @@ u64 hv_translate(u64 addr, bool s1, bool w, u64 *par_out)
     }
 }
 
+/* Returns the PA behind an IPA that maps straight to memory, or 0 if it's unmapped or hooked */
+u64 hv_translate_ipa(u64 ipa)
+{
+    u64 pte = hv_pt_walk(ipa & ~MASK(VADDR_L3_OFFSET_BITS));
+
+    if (!IS_HW(pte))
+        return 0;
+
+    return (pte & PTE_TARGET_MASK) | (ipa & MASK(VADDR_L3_OFFSET_BITS));
+}
+
+/*
+ * Copies guest virtual memory to (or, with write, from) buf, translating through both stages a
+ * 4K page at a time. Stops at the first page that does not translate and returns the number of
+ * bytes copied, so the host gets any amount of guest memory in a single request.
+ */
+size_t hv_copy_va(void *buf, u64 va, size_t size, bool write)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        u64 pa = hv_translate(va + done, false, write, NULL);
+        if (!pa)
+            break;
+
+        size_t chunk = min(size - done, 0x1000 - ((va + done) & 0xfff));
+        if (write)
+            memcpy((void *)pa, buf + done, chunk);
+        else
+            memcpy(buf + done, (void *)pa, chunk);
+        done += chunk;
+    }
+
+    return done;
+}
+
+/*
+ * Per-CPU caches for the data abort path. Guest code translations (ELR -> PA) are keyed by the
+ * 4K VA page and the stage 1 context (TTBR with ASID, EL, MMU enable), SPTE lookups by IPA.
+ * Both are dropped wholesale by bumping the generation, on every hv_map() and whenever the host
+ * has had control, since it may have rewritten guest memory or page tables.
+ */
+#define XLATE_CACHE_ENTRIES 64
+
+struct xlate_cache_entry {
+    u64 gen;
+    u64 key;
+    u64 ctx;
+    u64 value;
+};
+
+struct xlate_cache {
+    struct xlate_cache_entry code[XLATE_CACHE_ENTRIES];
+    struct xlate_cache_entry spte[XLATE_CACHE_ENTRIES];
+};
+
+static struct xlate_cache xlate_cache[MAX_CPUS];
+static u64 xlate_gen = 1;
+
+void hv_xlate_invalidate(void)
+{
+    __atomic_add_fetch(&xlate_gen, 1, __ATOMIC_RELEASE);
+}
+
+static u64 hv_translate_code(u64 addr)
+{
+    u64 gen = __atomic_load_n(&xlate_gen, __ATOMIC_ACQUIRE);
+    u64 el = FIELD_GET(SPSR_M, hv_get_spsr()) >> 2;
+    u64 ttbr = (addr & BIT(55)) ? mrs(TTBR1_EL12) : mrs(TTBR0_EL12);
+    u64 key = (addr & ~0xfffUL) | (el << 1) | (mrs(SCTLR_EL12) & SCTLR_M);
+    struct xlate_cache_entry *e = &xlate_cache[smp_id()].code[(addr >> 12) % XLATE_CACHE_ENTRIES];
+
+    if (e->gen == gen && e->key == key && e->ctx == ttbr)
+        return e->value | (addr & 0xfff);
+
+    u64 pa = hv_translate(addr, false, false, NULL);
+    if (pa) {
+        e->gen = gen;
+        e->key = key;
+        e->ctx = ttbr;
+        e->value = pa & ~0xfffUL;
+    }
+
+    return pa;
+}
+
+static u64 hv_pt_walk_cached(u64 addr)
+{
+    u64 gen = __atomic_load_n(&xlate_gen, __ATOMIC_ACQUIRE);
+    u64 idx = ((addr >> VADDR_L4_OFFSET_BITS) ^ (addr >> VADDR_L3_OFFSET_BITS)) %
+              XLATE_CACHE_ENTRIES;
+    struct xlate_cache_entry *e = &xlate_cache[smp_id()].spte[idx];
+
+    if (e->gen == gen && e->key == addr)
+        return e->value;
+
+    u64 pte = hv_pt_walk(addr);
+    if (pte) {
+        e->gen = gen;
+        e->key = addr;
+        e->value = pte;
+    }
+
+    return pte;
+}
+
 u64 hv_pt_walk(u64 addr)
 {
     dprintf("hv_pt_walk(0x%lx)\n", addr);
@@ -505,6 +947,101 @@ union simd_reg {
     u8 b[16];
 };
 
+/*
+ * Load/store decoding is a first-match search through these pattern tables. The result only
+ * depends on the instruction word, so it is cached per CPU keyed by the word itself: the word is
+ * refetched from guest memory on every abort, so rewritten guest code simply misses.
+ */
+#define DECODE_CACHE_ENTRIES 64
+
+struct insn_pattern {
+    u32 mask;
+    u32 value;
+};
+
+struct decode_cache_entry {
+    u32 insn;
+    u16 op;
+    u16 valid;
+};
+
+struct decode_cache {
+    struct decode_cache_entry load[DECODE_CACHE_ENTRIES];
+    struct decode_cache_entry store[DECODE_CACHE_ENTRIES];
+};
+
+static struct decode_cache decode_cache[MAX_CPUS];
+
+static int decode_insn(const struct insn_pattern *pats, int count, struct decode_cache_entry *cache,
+                       u32 insn)
+{
+    struct decode_cache_entry *e =
+        &cache[(insn ^ (insn >> 10) ^ (insn >> 20)) % DECODE_CACHE_ENTRIES];
+
+    if (e->valid && e->insn == insn)
+        return e->op;
+
+    int op;
+    for (op = 0; op < count; op++)
+        if ((insn & pats[op].mask) == pats[op].value)
+            break;
+
+    e->insn = insn;
+    e->op = op;
+    e->valid = 1;
+
+    return op;
+}
+
+enum load_op {
+    OP_LD_IMM_PREPOST,
+    OP_LD_IMM_UOFF,
+    OP_LDS_IMM_PREPOST,
+    OP_LDS_IMM_UOFF,
+    OP_LD_REG,
+    OP_LDS_REG,
+    OP_LDUR,
+    OP_LDURS,
+    OP_LDP_32,
+    OP_LDP_64,
+    OP_LDP_64_PREPOST,
+    OP_LDP_SIMD_128,
+    OP_LD_SIMD_IMM_UOFF,
+    OP_LD_SIMD_IMM_UOFF_128,
+    OP_LDUR_SIMD_128,
+    OP_LD_SIMD_IMM_PREPOST,
+    OP_LD_SIMD_IMM_PREPOST_128,
+    OP_LD_SIMD_REG,
+    OP_LD_SIMD_REG_128,
+    OP_LD1_64,
+    OP_LDAR,
+    LD_OP_COUNT,
+};
+
+static const struct insn_pattern load_ops[LD_OP_COUNT] = {
+    [OP_LD_IMM_PREPOST] = {0x3fe00400, 0x38400400},
+    [OP_LD_IMM_UOFF] = {0x3fc00000, 0x39400000},
+    [OP_LDS_IMM_PREPOST] = {0x3fa00400, 0x38800400},
+    [OP_LDS_IMM_UOFF] = {0x3fa00000, 0x39800000},
+    [OP_LD_REG] = {0x3fe04c00, 0x38604800},
+    [OP_LDS_REG] = {0x3fa04c00, 0x38a04800},
+    [OP_LDUR] = {0x3fe00c00, 0x38400000},
+    [OP_LDURS] = {0x3fa00c00, 0x38a00000},
+    [OP_LDP_32] = {0xffc00000, 0x29400000},
+    [OP_LDP_64] = {0xffc00000, 0xa9400000},
+    [OP_LDP_64_PREPOST] = {0xfec00000, 0xa8c00000},
+    [OP_LDP_SIMD_128] = {0xfec00000, 0xac400000},
+    [OP_LD_SIMD_IMM_UOFF] = {0x3fc00000, 0x3d400000},
+    [OP_LD_SIMD_IMM_UOFF_128] = {0xffc00000, 0x3dc00000},
+    [OP_LDUR_SIMD_128] = {0xffe00c00, 0x3cc00000},
+    [OP_LD_SIMD_IMM_PREPOST] = {0x3fe00400, 0x3c400400},
+    [OP_LD_SIMD_IMM_PREPOST_128] = {0xffe00400, 0x3cc00400},
+    [OP_LD_SIMD_REG] = {0x3fe04c00, 0x3c604800},
+    [OP_LD_SIMD_REG_128] = {0xffe04c00, 0x3ce04800},
+    [OP_LD1_64] = {0xbffffc00, 0x0d408400},
+    [OP_LDAR] = {0x3ffffc00, 0x08dffc00},
+};
+
 static bool emulate_load(struct exc_info *ctx, u32 insn, u64 *val, u64 *width, u64 *vaddr)
 {
     u64 Rt = insn & 0x1f;
@@ -521,165 +1058,253 @@ static bool emulate_load(struct exc_info *ctx, u32 insn, u64 *val, u64 *width, u
     if (val)
         dprintf("emulate_load(%p, 0x%08x, 0x%08lx, %ld\n", regs, insn, *val, *width);
 
-    if ((insn & 0x3fe00400) == 0x38400400) {
-        // LDRx (immediate) Pre/Post-index
-        CHECK_RN;
-        DECODE_OK;
-        regs[Rn] += imm9;
-        regs[Rt] = *val;
-    } else if ((insn & 0x3fc00000) == 0x39400000) {
-        // LDRx (immediate) Unsigned offset
-        DECODE_OK;
-        regs[Rt] = *val;
-    } else if ((insn & 0x3fa00400) == 0x38800400) {
-        // LDRSx (immediate) Pre/Post-index
-        CHECK_RN;
-        DECODE_OK;
-        regs[Rn] += imm9;
-        regs[Rt] = (s64)EXT(*val, 8 << *width);
-        if (insn & (1 << 22))
-            regs[Rt] &= 0xffffffff;
-    } else if ((insn & 0x3fa00000) == 0x39800000) {
-        // LDRSx (immediate) Unsigned offset
-        DECODE_OK;
-        regs[Rt] = (s64)EXT(*val, 8 << *width);
-        if (insn & (1 << 22))
-            regs[Rt] &= 0xffffffff;
-    } else if ((insn & 0x3fe04c00) == 0x38604800) {
-        // LDRx (register)
-        DECODE_OK;
-        regs[Rt] = *val;
-    } else if ((insn & 0x3fa04c00) == 0x38a04800) {
-        // LDRSx (register)
-        DECODE_OK;
-        regs[Rt] = (s64)EXT(*val, 8 << *width);
-        if (insn & (1 << 22))
-            regs[Rt] &= 0xffffffff;
-    } else if ((insn & 0x3fe00c00) == 0x38400000) {
-        // LDURx (unscaled)
-        DECODE_OK;
-        regs[Rt] = *val;
-    } else if ((insn & 0x3fa00c00) == 0x38a00000) {
-        // LDURSx (unscaled)
-        DECODE_OK;
-        regs[Rt] = (s64)EXT(*val, (8 << *width));
-        if (insn & (1 << 22))
-            regs[Rt] &= 0xffffffff;
-    } else if ((insn & 0xffc00000) == 0x29400000) {
-        // LDP (Signed offset, 32-bit)
-        *width = 3;
-        *vaddr = regs[Rn] + (imm7 * 4);
-        DECODE_OK;
-        u64 Rt2 = (insn >> 10) & 0x1f;
-        regs[Rt] = val[0] & 0xffffffff;
-        regs[Rt2] = val[0] >> 32;
-    } else if ((insn & 0xffc00000) == 0xa9400000) {
-        // LDP (Signed offset, 64-bit)
-        *width = 4;
-        *vaddr = regs[Rn] + (imm7 * 8);
-        DECODE_OK;
-        u64 Rt2 = (insn >> 10) & 0x1f;
-        regs[Rt] = val[0];
-        regs[Rt2] = val[1];
-    } else if ((insn & 0xfec00000) == 0xa8c00000) {
-        // LDP (pre/post-increment, 64-bit)
-        *width = 4;
-        *vaddr = regs[Rn] + ((insn & BIT(24)) ? (imm7 * 8) : 0);
-        DECODE_OK;
-        regs[Rn] += imm7 * 8;
-        u64 Rt2 = (insn >> 10) & 0x1f;
-        regs[Rt] = val[0];
-        regs[Rt2] = val[1];
-    } else if ((insn & 0xfec00000) == 0xac400000) {
-        // LD[N]P (SIMD&FP, 128-bit) Signed offset
-        *width = 5;
-        *vaddr = regs[Rn] + (imm7 * 16);
-        DECODE_OK;
-        u64 Rt2 = (insn >> 10) & 0x1f;
-        get_simd_state(simd);
-        simd[Rt].d[0] = val[0];
-        simd[Rt].d[1] = val[1];
-        simd[Rt2].d[0] = val[2];
-        simd[Rt2].d[1] = val[3];
-        put_simd_state(simd);
-    } else if ((insn & 0x3fc00000) == 0x3d400000) {
-        // LDR (immediate, SIMD&FP) Unsigned offset
-        *vaddr = regs[Rn] + (imm12 << *width);
-        DECODE_OK;
-        get_simd_state(simd);
-        simd[Rt].d[0] = val[0];
-        simd[Rt].d[1] = 0;
-        put_simd_state(simd);
-    } else if ((insn & 0xffc00000) == 0x3dc00000) {
-        // LDR (immediate, SIMD&FP) Unsigned offset, 128-bit
-        *width = 4;
-        *vaddr = regs[Rn] + (imm12 << *width);
-        DECODE_OK;
-        get_simd_state(simd);
-        simd[Rt].d[0] = val[0];
-        simd[Rt].d[1] = val[1];
-        put_simd_state(simd);
-    } else if ((insn & 0xffe00c00) == 0x3cc00000) {
-        // LDURx (unscaled, SIMD&FP, 128-bit)
-        *width = 4;
-        *vaddr = regs[Rn] + (imm9 << *width);
-        DECODE_OK;
-        get_simd_state(simd);
-        simd[Rt].d[0] = val[0];
-        simd[Rt].d[1] = val[1];
-        put_simd_state(simd);
-    } else if ((insn & 0x3fe00400) == 0x3c400400) {
-        // LDR (immediate, SIMD&FP) Pre/Post-index
-        CHECK_RN;
-        DECODE_OK;
-        regs[Rn] += imm9;
-        get_simd_state(simd);
-        simd[Rt].d[0] = val[0];
-        simd[Rt].d[1] = 0;
-        put_simd_state(simd);
-    } else if ((insn & 0xffe00400) == 0x3cc00400) {
-        // LDR (immediate, SIMD&FP) Pre/Post-index, 128-bit
-        *width = 4;
-        CHECK_RN;
-        DECODE_OK;
-        regs[Rn] += imm9;
-        get_simd_state(simd);
-        simd[Rt].d[0] = val[0];
-        simd[Rt].d[1] = val[1];
-        put_simd_state(simd);
-    } else if ((insn & 0x3fe04c00) == 0x3c604800) {
-        // LDR (register, SIMD&FP)
-        DECODE_OK;
-        get_simd_state(simd);
-        simd[Rt].d[0] = val[0];
-        simd[Rt].d[1] = 0;
-        put_simd_state(simd);
-    } else if ((insn & 0xffe04c00) == 0x3ce04800) {
-        // LDR (register, SIMD&FP), 128-bit
-        *width = 4;
-        DECODE_OK;
-        get_simd_state(simd);
-        simd[Rt].d[0] = val[0];
-        simd[Rt].d[1] = val[1];
-        put_simd_state(simd);
-    } else if ((insn & 0xbffffc00) == 0x0d408400) {
-        // LD1 (single structure) No offset, 64-bit
-        *width = 3;
-        DECODE_OK;
-        u64 index = (insn >> 30) & 1;
-        get_simd_state(simd);
-        simd[Rt].d[index] = val[0];
-        put_simd_state(simd);
-    } else if ((insn & 0x3ffffc00) == 0x08dffc00) {
-        // LDAR*
-        DECODE_OK;
-        regs[Rt] = *val;
-    } else {
-        return false;
+    int op = decode_insn(load_ops, LD_OP_COUNT, decode_cache[smp_id()].load, insn);
+
+    switch (op) {
+        case OP_LD_IMM_PREPOST: {
+            // LDRx (immediate) Pre/Post-index
+            CHECK_RN;
+            DECODE_OK;
+            regs[Rn] += imm9;
+            regs[Rt] = *val;
+            break;
+        }
+        case OP_LD_IMM_UOFF: {
+            // LDRx (immediate) Unsigned offset
+            DECODE_OK;
+            regs[Rt] = *val;
+            break;
+        }
+        case OP_LDS_IMM_PREPOST: {
+            // LDRSx (immediate) Pre/Post-index
+            CHECK_RN;
+            DECODE_OK;
+            regs[Rn] += imm9;
+            regs[Rt] = (s64)EXT(*val, 8 << *width);
+            if (insn & (1 << 22))
+                regs[Rt] &= 0xffffffff;
+            break;
+        }
+        case OP_LDS_IMM_UOFF: {
+            // LDRSx (immediate) Unsigned offset
+            DECODE_OK;
+            regs[Rt] = (s64)EXT(*val, 8 << *width);
+            if (insn & (1 << 22))
+                regs[Rt] &= 0xffffffff;
+            break;
+        }
+        case OP_LD_REG: {
+            // LDRx (register)
+            DECODE_OK;
+            regs[Rt] = *val;
+            break;
+        }
+        case OP_LDS_REG: {
+            // LDRSx (register)
+            DECODE_OK;
+            regs[Rt] = (s64)EXT(*val, 8 << *width);
+            if (insn & (1 << 22))
+                regs[Rt] &= 0xffffffff;
+            break;
+        }
+        case OP_LDUR: {
+            // LDURx (unscaled)
+            DECODE_OK;
+            regs[Rt] = *val;
+            break;
+        }
+        case OP_LDURS: {
+            // LDURSx (unscaled)
+            DECODE_OK;
+            regs[Rt] = (s64)EXT(*val, (8 << *width));
+            if (insn & (1 << 22))
+                regs[Rt] &= 0xffffffff;
+            break;
+        }
+        case OP_LDP_32: {
+            // LDP (Signed offset, 32-bit)
+            *width = 3;
+            *vaddr = regs[Rn] + (imm7 * 4);
+            DECODE_OK;
+            u64 Rt2 = (insn >> 10) & 0x1f;
+            regs[Rt] = val[0] & 0xffffffff;
+            regs[Rt2] = val[0] >> 32;
+            break;
+        }
+        case OP_LDP_64: {
+            // LDP (Signed offset, 64-bit)
+            *width = 4;
+            *vaddr = regs[Rn] + (imm7 * 8);
+            DECODE_OK;
+            u64 Rt2 = (insn >> 10) & 0x1f;
+            regs[Rt] = val[0];
+            regs[Rt2] = val[1];
+            break;
+        }
+        case OP_LDP_64_PREPOST: {
+            // LDP (pre/post-increment, 64-bit)
+            *width = 4;
+            *vaddr = regs[Rn] + ((insn & BIT(24)) ? (imm7 * 8) : 0);
+            DECODE_OK;
+            regs[Rn] += imm7 * 8;
+            u64 Rt2 = (insn >> 10) & 0x1f;
+            regs[Rt] = val[0];
+            regs[Rt2] = val[1];
+            break;
+        }
+        case OP_LDP_SIMD_128: {
+            // LD[N]P (SIMD&FP, 128-bit) Signed offset
+            *width = 5;
+            *vaddr = regs[Rn] + (imm7 * 16);
+            DECODE_OK;
+            u64 Rt2 = (insn >> 10) & 0x1f;
+            get_simd_state(simd);
+            simd[Rt].d[0] = val[0];
+            simd[Rt].d[1] = val[1];
+            simd[Rt2].d[0] = val[2];
+            simd[Rt2].d[1] = val[3];
+            put_simd_state(simd);
+            break;
+        }
+        case OP_LD_SIMD_IMM_UOFF: {
+            // LDR (immediate, SIMD&FP) Unsigned offset
+            *vaddr = regs[Rn] + (imm12 << *width);
+            DECODE_OK;
+            get_simd_state(simd);
+            simd[Rt].d[0] = val[0];
+            simd[Rt].d[1] = 0;
+            put_simd_state(simd);
+            break;
+        }
+        case OP_LD_SIMD_IMM_UOFF_128: {
+            // LDR (immediate, SIMD&FP) Unsigned offset, 128-bit
+            *width = 4;
+            *vaddr = regs[Rn] + (imm12 << *width);
+            DECODE_OK;
+            get_simd_state(simd);
+            simd[Rt].d[0] = val[0];
+            simd[Rt].d[1] = val[1];
+            put_simd_state(simd);
+            break;
+        }
+        case OP_LDUR_SIMD_128: {
+            // LDURx (unscaled, SIMD&FP, 128-bit)
+            *width = 4;
+            *vaddr = regs[Rn] + (imm9 << *width);
+            DECODE_OK;
+            get_simd_state(simd);
+            simd[Rt].d[0] = val[0];
+            simd[Rt].d[1] = val[1];
+            put_simd_state(simd);
+            break;
+        }
+        case OP_LD_SIMD_IMM_PREPOST: {
+            // LDR (immediate, SIMD&FP) Pre/Post-index
+            CHECK_RN;
+            DECODE_OK;
+            regs[Rn] += imm9;
+            get_simd_state(simd);
+            simd[Rt].d[0] = val[0];
+            simd[Rt].d[1] = 0;
+            put_simd_state(simd);
+            break;
+        }
+        case OP_LD_SIMD_IMM_PREPOST_128: {
+            // LDR (immediate, SIMD&FP) Pre/Post-index, 128-bit
+            *width = 4;
+            CHECK_RN;
+            DECODE_OK;
+            regs[Rn] += imm9;
+            get_simd_state(simd);
+            simd[Rt].d[0] = val[0];
+            simd[Rt].d[1] = val[1];
+            put_simd_state(simd);
+            break;
+        }
+        case OP_LD_SIMD_REG: {
+            // LDR (register, SIMD&FP)
+            DECODE_OK;
+            get_simd_state(simd);
+            simd[Rt].d[0] = val[0];
+            simd[Rt].d[1] = 0;
+            put_simd_state(simd);
+            break;
+        }
+        case OP_LD_SIMD_REG_128: {
+            // LDR (register, SIMD&FP), 128-bit
+            *width = 4;
+            DECODE_OK;
+            get_simd_state(simd);
+            simd[Rt].d[0] = val[0];
+            simd[Rt].d[1] = val[1];
+            put_simd_state(simd);
+            break;
+        }
+        case OP_LD1_64: {
+            // LD1 (single structure) No offset, 64-bit
+            *width = 3;
+            DECODE_OK;
+            u64 index = (insn >> 30) & 1;
+            get_simd_state(simd);
+            simd[Rt].d[index] = val[0];
+            put_simd_state(simd);
+            break;
+        }
+        case OP_LDAR: {
+            // LDAR*
+            DECODE_OK;
+            regs[Rt] = *val;
+            break;
+        }
+        default:
+            return false;
     }
     return true;
 }
 
+enum store_op {
+    OP_STR_IMM_PREPOST,
+    OP_STR_IMM_UOFF,
+    OP_STR_REG,
+    OP_STP_32,
+    OP_STP_64,
+    OP_STP_64_PREPOST,
+    OP_STR_SIMD_IMM_UOFF,
+    OP_STR_SIMD_REG,
+    OP_STR_SIMD_REG_128,
+    OP_STR_SIMD_IMM_UOFF_128,
+    OP_STUR_SIMD_32,
+    OP_STUR_SIMD_64,
+    OP_STUR_SIMD_128,
+    OP_STP_SIMD_32,
+    OP_STP_SIMD_128,
+    OP_STUR,
+    OP_DC_ZVA,
+    OP_STLR,
+    ST_OP_COUNT,
+};
+
+static const struct insn_pattern store_ops[ST_OP_COUNT] = {
+    [OP_STR_IMM_PREPOST] = {0x3fe00400, 0x38000400},
+    [OP_STR_IMM_UOFF] = {0x3fc00000, 0x39000000},
+    [OP_STR_REG] = {0x3fe04c00, 0x38204800},
+    [OP_STP_32] = {0xfec00000, 0x28000000},
+    [OP_STP_64] = {0xfec00000, 0xa8000000},
+    [OP_STP_64_PREPOST] = {0xfec00000, 0xa8800000},
+    [OP_STR_SIMD_IMM_UOFF] = {0x3fc00000, 0x3d000000},
+    [OP_STR_SIMD_REG] = {0x3fe04c00, 0x3c204800},
+    [OP_STR_SIMD_REG_128] = {0xffe04c00, 0x3ca04800},
+    [OP_STR_SIMD_IMM_UOFF_128] = {0xffc00000, 0x3d800000},
+    [OP_STUR_SIMD_32] = {0xffe00000, 0xbc000000},
+    [OP_STUR_SIMD_64] = {0xffe00000, 0xfc000000},
+    [OP_STUR_SIMD_128] = {0xffe00000, 0x3c800000},
+    [OP_STP_SIMD_32] = {0xffc00000, 0x2d000000},
+    [OP_STP_SIMD_128] = {0xffc00000, 0xad000000},
+    [OP_STUR] = {0x3fe00c00, 0x38000000},
+    [OP_DC_ZVA] = {0xffffffe0, 0xd50b7420},
+    [OP_STLR] = {0x3ffffc00, 0x089ffc00},
+};
+
 static bool emulate_store(struct exc_info *ctx, u32 insn, u64 *val, u64 *width, u64 *vaddr)
 {
     u64 Rt = insn & 0x1f;
@@ -701,105 +1326,144 @@ static bool emulate_store(struct exc_info *ctx, u32 insn, u64 *val, u64 *width,
     if (*width < 3)
         mask = (1UL << (8 << *width)) - 1;
 
-    if ((insn & 0x3fe00400) == 0x38000400) {
-        // STRx (immediate) Pre/Post-index
-        CHECK_RN;
-        regs[Rn] += imm9;
-        *val = regs[Rt] & mask;
-    } else if ((insn & 0x3fc00000) == 0x39000000) {
-        // STRx (immediate) Unsigned offset
-        *val = regs[Rt] & mask;
-    } else if ((insn & 0x3fe04c00) == 0x38204800) {
-        // STRx (register)
-        *val = regs[Rt] & mask;
-    } else if ((insn & 0xfec00000) == 0x28000000) {
-        // ST[N]P (Signed offset, 32-bit)
-        *vaddr = regs[Rn] + (imm7 * 4);
-        u64 Rt2 = (insn >> 10) & 0x1f;
-        val[0] = (regs[Rt] & 0xffffffff) | (regs[Rt2] << 32);
-        *width = 3;
-    } else if ((insn & 0xfec00000) == 0xa8000000) {
-        // ST[N]P (Signed offset, 64-bit)
-        *vaddr = regs[Rn] + (imm7 * 8);
-        u64 Rt2 = (insn >> 10) & 0x1f;
-        val[0] = regs[Rt];
-        val[1] = regs[Rt2];
-        *width = 4;
-    } else if ((insn & 0xfec00000) == 0xa8800000) {
-        // ST[N]P (immediate, 64-bit, pre/post-index)
-        CHECK_RN;
-        *vaddr = regs[Rn] + ((insn & BIT(24)) ? (imm7 * 8) : 0);
-        regs[Rn] += (imm7 * 8);
-        u64 Rt2 = (insn >> 10) & 0x1f;
-        val[0] = regs[Rt];
-        val[1] = regs[Rt2];
-        *width = 4;
-    } else if ((insn & 0x3fc00000) == 0x3d000000) {
-        // STR (immediate, SIMD&FP) Unsigned offset, 8..64-bit
-        get_simd_state(simd);
-        *val = simd[Rt].d[0];
-    } else if ((insn & 0x3fe04c00) == 0x3c204800) {
-        // STR (register, SIMD&FP) 8..64-bit
-        get_simd_state(simd);
-        *val = simd[Rt].d[0];
-    } else if ((insn & 0xffe04c00) == 0x3ca04800) {
-        // STR (register, SIMD&FP) 128-bit
-        get_simd_state(simd);
-        val[0] = simd[Rt].d[0];
-        val[1] = simd[Rt].d[1];
-        *width = 4;
-    } else if ((insn & 0xffc00000) == 0x3d800000) {
-        // STR (immediate, SIMD&FP) Unsigned offset, 128-bit
-        get_simd_state(simd);
-        val[0] = simd[Rt].d[0];
-        val[1] = simd[Rt].d[1];
-        *width = 4;
-    } else if ((insn & 0xffe00000) == 0xbc000000) {
-        // STUR (immediate, SIMD&FP) 32-bit
-        get_simd_state(simd);
-        val[0] = simd[Rt].s[0];
-        *width = 2;
-    } else if ((insn & 0xffe00000) == 0xfc000000) {
-        // STUR (immediate, SIMD&FP) 64-bit
-        get_simd_state(simd);
-        val[0] = simd[Rt].d[0];
-        *width = 3;
-    } else if ((insn & 0xffe00000) == 0x3c800000) {
-        // STUR (immediate, SIMD&FP) 128-bit
-        get_simd_state(simd);
-        val[0] = simd[Rt].d[0];
-        val[1] = simd[Rt].d[1];
-        *width = 4;
-    } else if ((insn & 0xffc00000) == 0x2d000000) {
-        // STP (SIMD&FP, 128-bit) Signed offset
-        *vaddr = regs[Rn] + (imm7 * 4);
-        u64 Rt2 = (insn >> 10) & 0x1f;
-        get_simd_state(simd);
-        val[0] = simd[Rt].s[0] | (((u64)simd[Rt2].s[0]) << 32);
-        *width = 3;
-    } else if ((insn & 0xffc00000) == 0xad000000) {
-        // STP (SIMD&FP, 128-bit) Signed offset
-        *vaddr = regs[Rn] + (imm7 * 16);
-        u64 Rt2 = (insn >> 10) & 0x1f;
-        get_simd_state(simd);
-        val[0] = simd[Rt].d[0];
-        val[1] = simd[Rt].d[1];
-        val[2] = simd[Rt2].d[0];
-        val[3] = simd[Rt2].d[1];
-        *width = 5;
-    } else if ((insn & 0x3fe00c00) == 0x38000000) {
-        // STURx (unscaled)
-        *val = regs[Rt] & mask;
-    } else if ((insn & 0xffffffe0) == 0xd50b7420) {
-        // DC ZVA
-        *vaddr = regs[Rt];
-        memset(val, 0, CACHE_LINE_SIZE);
-        *width = CACHE_LINE_LOG2;
-    } else if ((insn & 0x3ffffc00) == 0x089ffc00) {
-        // STL  qR*
-        *val = regs[Rt] & mask;
-    } else {
-        return false;
+    int op = decode_insn(store_ops, ST_OP_COUNT, decode_cache[smp_id()].store, insn);
+
+    switch (op) {
+        case OP_STR_IMM_PREPOST: {
+            // STRx (immediate) Pre/Post-index
+            CHECK_RN;
+            regs[Rn] += imm9;
+            *val = regs[Rt] & mask;
+            break;
+        }
+        case OP_STR_IMM_UOFF: {
+            // STRx (immediate) Unsigned offset
+            *val = regs[Rt] & mask;
+            break;
+        }
+        case OP_STR_REG: {
+            // STRx (register)
+            *val = regs[Rt] & mask;
+            break;
+        }
+        case OP_STP_32: {
+            // ST[N]P (Signed offset, 32-bit)
+            *vaddr = regs[Rn] + (imm7 * 4);
+            u64 Rt2 = (insn >> 10) & 0x1f;
+            val[0] = (regs[Rt] & 0xffffffff) | (regs[Rt2] << 32);
+            *width = 3;
+            break;
+        }
+        case OP_STP_64: {
+            // ST[N]P (Signed offset, 64-bit)
+            *vaddr = regs[Rn] + (imm7 * 8);
+            u64 Rt2 = (insn >> 10) & 0x1f;
+            val[0] = regs[Rt];
+            val[1] = regs[Rt2];
+            *width = 4;
+            break;
+        }
+        case OP_STP_64_PREPOST: {
+            // ST[N]P (immediate, 64-bit, pre/post-index)
+            CHECK_RN;
+            *vaddr = regs[Rn] + ((insn & BIT(24)) ? (imm7 * 8) : 0);
+            regs[Rn] += (imm7 * 8);
+            u64 Rt2 = (insn >> 10) & 0x1f;
+            val[0] = regs[Rt];
+            val[1] = regs[Rt2];
+            *width = 4;
+            break;
+        }
+        case OP_STR_SIMD_IMM_UOFF: {
+            // STR (immediate, SIMD&FP) Unsigned offset, 8..64-bit
+            get_simd_state(simd);
+            *val = simd[Rt].d[0];
+            break;
+        }
+        case OP_STR_SIMD_REG: {
+            // STR (register, SIMD&FP) 8..64-bit
+            get_simd_state(simd);
+            *val = simd[Rt].d[0];
+            break;
+        }
+        case OP_STR_SIMD_REG_128: {
+            // STR (register, SIMD&FP) 128-bit
+            get_simd_state(simd);
+            val[0] = simd[Rt].d[0];
+            val[1] = simd[Rt].d[1];
+            *width = 4;
+            break;
+        }
+        case OP_STR_SIMD_IMM_UOFF_128: {
+            // STR (immediate, SIMD&FP) Unsigned offset, 128-bit
+            get_simd_state(simd);
+            val[0] = simd[Rt].d[0];
+            val[1] = simd[Rt].d[1];
+            *width = 4;
+            break;
+        }
+        case OP_STUR_SIMD_32: {
+            // STUR (immediate, SIMD&FP) 32-bit
+            get_simd_state(simd);
+            val[0] = simd[Rt].s[0];
+            *width = 2;
+            break;
+        }
+        case OP_STUR_SIMD_64: {
+            // STUR (immediate, SIMD&FP) 64-bit
+            get_simd_state(simd);
+            val[0] = simd[Rt].d[0];
+            *width = 3;
+            break;
+        }
+        case OP_STUR_SIMD_128: {
+            // STUR (immediate, SIMD&FP) 128-bit
+            get_simd_state(simd);
+            val[0] = simd[Rt].d[0];
+            val[1] = simd[Rt].d[1];
+            *width = 4;
+            break;
+        }
+        case OP_STP_SIMD_32: {
+            // STP (SIMD&FP, 128-bit) Signed offset
+            *vaddr = regs[Rn] + (imm7 * 4);
+            u64 Rt2 = (insn >> 10) & 0x1f;
+            get_simd_state(simd);
+            val[0] = simd[Rt].s[0] | (((u64)simd[Rt2].s[0]) << 32);
+            *width = 3;
+            break;
+        }
+        case OP_STP_SIMD_128: {
+            // STP (SIMD&FP, 128-bit) Signed offset
+            *vaddr = regs[Rn] + (imm7 * 16);
+            u64 Rt2 = (insn >> 10) & 0x1f;
+            get_simd_state(simd);
+            val[0] = simd[Rt].d[0];
+            val[1] = simd[Rt].d[1];
+            val[2] = simd[Rt2].d[0];
+            val[3] = simd[Rt2].d[1];
+            *width = 5;
+            break;
+        }
+        case OP_STUR: {
+            // STURx (unscaled)
+            *val = regs[Rt] & mask;
+            break;
+        }
+        case OP_DC_ZVA: {
+            // DC ZVA
+            *vaddr = regs[Rt];
+            memset(val, 0, CACHE_LINE_SIZE);
+            *width = CACHE_LINE_LOG2;
+            break;
+        }
+        case OP_STLR: {
+            // STL  qR*
+            *val = regs[Rt] & mask;
+            break;
+        }
+        default:
+            return false;
     }
 
     dprintf("0x%lx\n", *width);
@@ -807,6 +1471,278 @@ static bool emulate_store(struct exc_info *ctx, u32 insn, u64 *val, u64 *width,
     return true;
 }
 
+/* Keep a batch within a single event (u16 length) and reasonably sized for the link */
+#define MMIOTRACE_BATCH_RECORDS 128
+
+struct mmiotrace_batch {
+    struct hv_evt_mmiotrace_batch hdr;
+    struct hv_evt_mmiotrace records[MMIOTRACE_BATCH_RECORDS];
+};
+
+static_assert(sizeof(struct mmiotrace_batch) <= 0xffff, "mmiotrace batch too large");
+
+static struct mmiotrace_batch mmiotrace_batch[MAX_CPUS];
+static hv_trace_batch_mode mmiotrace_batch_mode = HV_TRACE_BATCH_OFF;
+
+/* Ship the current CPU's pending trace records (and drop count) to the host */
+void hv_trace_flush(void)
+{
+    struct mmiotrace_batch *batch = &mmiotrace_batch[smp_id()];
+
+    if (!batch->hdr.count && !batch->hdr.dropped)
+        return;
+
+    hv_wdt_suspend();
+    uartproxy_post_event(EVT_MMIOTRACE_BATCH, batch,
+                         sizeof(batch->hdr) + batch->hdr.count * sizeof(batch->records[0]));
+    hv_wdt_resume();
+
+    batch->hdr.count = 0;
+    batch->hdr.dropped = 0;
+}
+
+void hv_set_trace_batch(hv_trace_batch_mode mode)
+{
+    hv_trace_flush();
+    mmiotrace_batch_mode = mode;
+    hv_irqtrace_set_batch(mode);
+}
+
+static void mmiotrace_batch_add(struct hv_evt_mmiotrace *evt)
+{
+    struct mmiotrace_batch *batch = &mmiotrace_batch[smp_id()];
+
+    if (batch->hdr.count == MMIOTRACE_BATCH_RECORDS) {
+        if (mmiotrace_batch_mode == HV_TRACE_BATCH_DROP) {
+            batch->hdr.dropped++;
+            return;
+        }
+        hv_trace_flush();
+    }
+
+    batch->records[batch->hdr.count++] = *evt;
+}
+
+#define MAX_TRACE_FILTERS 32
+
+struct trace_filter_state {
+    struct hv_trace_filter filter;
+    u64 min_interval;
+    u64 last_emit;
+    u64 last_value;
+    bool have_value;
+};
+
+static struct trace_filter_state trace_filters[MAX_TRACE_FILTERS];
+static int trace_filter_count = 0;
+
+int hv_add_trace_filter(const struct hv_trace_filter *filter)
+{
+    if (trace_filter_count >= MAX_TRACE_FILTERS || filter->start >= filter->end)
+        return -1;
+
+    struct trace_filter_state *s = &trace_filters[trace_filter_count];
+
+    memset(s, 0, sizeof(*s));
+    s->filter = *filter;
+    s->min_interval = mrs(CNTFRQ_EL0) * filter->min_interval_us / 1000000;
+
+    return trace_filter_count++;
+}
+
+void hv_clear_trace_filters(void)
+{
+    trace_filter_count = 0;
+}
+
+/*
+ * Decide whether a traced access should be emitted. Accesses not covered by any filter are
+ * always emitted, otherwise at least one covering filter has to match and let it through.
+ */
+static bool trace_filter_pass(u64 ipa, u64 *data, bool is_write)
+{
+    bool covered = false;
+    u32 dir = is_write ? HV_TRACE_FILTER_WRITE : HV_TRACE_FILTER_READ;
+
+    for (int i = 0; i < trace_filter_count; i++) {
+        struct trace_filter_state *s = &trace_filters[i];
+        struct hv_trace_filter *f = &s->filter;
+
+        if (ipa < f->start || ipa >= f->end)
+            continue;
+
+        covered = true;
+
+        if (!(f->flags & dir))
+            continue;
+        if (((ipa - f->start) & f->offset_mask) != f->offset_match)
+            continue;
+        if ((data[0] & f->value_mask) != f->value_match)
+            continue;
+
+        if (f->flags & HV_TRACE_FILTER_ON_CHANGE) {
+            if (s->have_value && s->last_value == data[0])
+                continue;
+            s->last_value = data[0];
+            s->have_value = true;
+        }
+
+        if (s->min_interval) {
+            u64 now = get_ticks();
+            if (s->last_emit && (now - s->last_emit) < s->min_interval)
+                continue;
+            s->last_emit = now;
+        }
+
+        return true;
+    }
+
+    return !covered;
+}
+
+#define TRACE_BUDGET_PAGES 64
+
+struct trace_budget_page {
+    u64 page;   // IPA, 0 if the slot is free
+    u64 window; // start of the current one second window
+    u64 until;  // end of the demotion
+    u64 l3e;    // original L3 entry while mapped as HW
+    u32 faults;
+    u32 mode;
+    u32 seen;
+};
+
+static struct hv_trace_budget trace_budget;
+static u64 trace_budget_cooldown;
+static struct trace_budget_page trace_budget_pages[TRACE_BUDGET_PAGES];
+
+static void trace_budget_report(struct trace_budget_page *p)
+{
+    struct hv_evt_trace_demote evt = {
+        .addr = p->page,
+        .mode = p->mode,
+        .faults = p->faults,
+    };
+
+    // Whatever was traced before the change goes out first
+    hv_trace_flush();
+    hv_wdt_suspend();
+    uartproxy_post_event(EVT_TRACE_DEMOTE, &evt, sizeof(evt));
+    hv_wdt_resume();
+}
+
+static u64 *trace_budget_l3e(u64 ipa)
+{
+    return &hv_pt_get_l3(ipa)[(ipa >> VADDR_L3_OFFSET_BITS) & MASK(VADDR_L3_INDEX_BITS)];
+}
+
+static void trace_budget_demote(struct trace_budget_page *p, u64 pte)
+{
+    p->mode = HV_TRACE_DEMOTE_SAMPLED;
+    p->until = get_ticks() + trace_budget_cooldown;
+    p->seen = 0;
+
+    // Only whole-page maps can be handed to the hardware, not hooks or L4 (sub-page) mappings
+    if ((trace_budget.flags & HV_TRACE_BUDGET_HW) && FIELD_GET(SPTE_TYPE, pte) == SPTE_MAP) {
+        u64 *l3e = trace_budget_l3e(p->page);
+
+        if (L3_IS_SW_BLOCK(*l3e)) {
+            p->l3e = *l3e;
+            *l3e = (p->l3e & PTE_TARGET_MASK) | PTE_ATTRIBUTES | PTE_VALID |
+                   FIELD_PREP(PTE_TYPE, PTE_PAGE);
+            hv_pt_flush_tlb(p->page, PAGE_SIZE);
+            hv_xlate_invalidate();
+            p->mode = HV_TRACE_DEMOTE_HW;
+        }
+    }
+
+    trace_budget_report(p);
+}
+
+static void trace_budget_restore(struct trace_budget_page *p)
+{
+    if (p->mode == HV_TRACE_DEMOTE_HW) {
+        u64 *l3e = trace_budget_l3e(p->page);
+
+        // Leave it alone if the host remapped the page in the meantime
+        if (IS_HW(*l3e) && (*l3e & PTE_TARGET_MASK) == (p->l3e & PTE_TARGET_MASK)) {
+            *l3e = p->l3e;
+            hv_pt_flush_tlb(p->page, PAGE_SIZE);
+            hv_xlate_invalidate();
+        }
+    }
+
+    p->mode = HV_TRACE_DEMOTE_NONE;
+    p->faults = p->seen;
+    trace_budget_report(p);
+
+    p->page = 0;
+}
+
+/* Restores all demoted pages and starts counting from scratch, max_faults = 0 disables it */
+void hv_set_trace_budget(const struct hv_trace_budget *budget)
+{
+    for (int i = 0; i < TRACE_BUDGET_PAGES; i++)
+        if (trace_budget_pages[i].page && trace_budget_pages[i].mode != HV_TRACE_DEMOTE_NONE)
+            trace_budget_restore(&trace_budget_pages[i]);
+
+    memset(trace_budget_pages, 0, sizeof(trace_budget_pages));
+    trace_budget = *budget;
+    trace_budget_cooldown = mrs(CNTFRQ_EL0) * budget->cooldown_ms / 1000;
+}
+
+/* Ends demotions whose cooldown is over, called from the HV tick */
+void hv_trace_budget_poll(void)
+{
+    if (!trace_budget.max_faults)
+        return;
+
+    u64 now = get_ticks();
+
+    for (int i = 0; i < TRACE_BUDGET_PAGES; i++) {
+        struct trace_budget_page *p = &trace_budget_pages[i];
+
+        if (p->page && p->mode != HV_TRACE_DEMOTE_NONE && now >= p->until)
+            trace_budget_restore(p);
+    }
+}
+
+/*
+ * Accounts one fault on a traced page and returns false if this access should go untraced. The
+ * table is direct mapped, a page colliding with a demoted one just isn't accounted for.
+ */
+static bool trace_budget_fault(u64 ipa, u64 pte)
+{
+    u64 page = ipa & ~MASK(VADDR_L3_OFFSET_BITS);
+    struct trace_budget_page *p =
+        &trace_budget_pages[(page >> VADDR_L3_OFFSET_BITS) % TRACE_BUDGET_PAGES];
+    u64 now = get_ticks();
+
+    if (p->page != page) {
+        if (p->page && p->mode != HV_TRACE_DEMOTE_NONE)
+            return true;
+
+        memset(p, 0, sizeof(*p));
+        p->page = page;
+        p->window = now;
+    }
+
+    if (p->mode == HV_TRACE_DEMOTE_SAMPLED) {
+        u32 every = trace_budget.sample_every;
+        return every && !(p->seen++ % every);
+    }
+
+    if (now - p->window >= mrs(CNTFRQ_EL0)) {
+        p->window = now;
+        p->faults = 0;
+    }
+
+    if (++p->faults > trace_budget.max_faults)
+        trace_budget_demote(p, pte);
+
+    return true;
+}
+
 static void emit_mmiotrace(u64 pc, u64 addr, u64 *data, u64 width, u64 flags, bool sync)
 {
     struct hv_evt_mmiotrace evt = {
@@ -820,12 +1756,26 @@ static void emit_mmiotrace(u64 pc, u64 addr, u64 *data, u64 width, u64 flags, bo
     else
         evt.flags |= FIELD_PREP(MMIO_EVT_WIDTH, width);
 
+    bool batch = mmiotrace_batch_mode != HV_TRACE_BATCH_OFF;
+
+    // Unbuffered traces must not overtake anything still sitting in the batch
+    if (batch && sync)
+        hv_trace_flush();
+
     for (int i = 0; i < (1 << width); i += 8) {
         evt.data = *data++;
+        if (batch && !sync) {
+            mmiotrace_batch_add(&evt);
+            evt.addr += 8;
+            continue;
+        }
         hv_wdt_suspend();
-        uartproxy_send_event(EVT_MMIOTRACE, &evt, sizeof(evt));
+        // Unbuffered traces are sent right away, after anything still queued
         if (sync) {
+            uartproxy_send_event(EVT_MMIOTRACE, &evt, sizeof(evt));
             iodev_flush(uartproxy_iodev);
+        } else {
+            uartproxy_post_event(EVT_MMIOTRACE, &evt, sizeof(evt));
         }
         hv_wdt_resume();
         evt.addr += 8;
@@ -947,7 +1897,7 @@ static bool hv_emulate_rw_aligned(struct exc_info *ctx, u64 pte, u64 vaddr, u64
         // Write
         hv_wdt_breadcrumb('3');
 
-        if (pte & SPTE_TRACE_WRITE)
+        if ((pte & SPTE_TRACE_WRITE) && trace_filter_pass(ipa, val, true))
             emit_mmiotrace(elr, ipa, val, width, flags | MMIO_EVT_WRITE, pte & SPTE_TRACE_UNBUF);
 
         hv_wdt_breadcrumb('4');
@@ -1029,7 +1979,7 @@ static bool hv_emulate_rw_aligned(struct exc_info *ctx, u64 pte, u64 vaddr, u64
         }
 
         hv_wdt_breadcrumb('7');
-        if (pte & SPTE_TRACE_READ)
+        if ((pte & SPTE_TRACE_READ) && trace_filter_pass(ipa, val, false))
             emit_mmiotrace(elr, ipa, val, width, flags, pte & SPTE_TRACE_UNBUF);
     }
 
@@ -1114,10 +2064,21 @@ bool hv_handle_dabort(struct exc_info *ctx)
     bool is_write = esr & ESR_ISS_DABORT_WnR;
 
     u64 far = hv_get_far();
-    u64 par;
-    u64 ipa = hv_translate(far, true, is_write, &par);
+    u64 dfsc = FIELD_GET(ESR_ISS_DABORT_DFSC, esr);
+    u64 par = 0;
+    bool have_par = false;
+    u64 ipa;
+
+    // Stage 2 translation and permission faults report the IPA in HPFAR, which saves a stage 1 AT
+    if (!in_gl12() && ((dfsc & 0x3c) == 0x04 || (dfsc & 0x3c) == 0x0c) &&
+        !(esr & (ESR_ISS_DABORT_S1PTR | ESR_ISS_DABORT_FnV))) {
+        ipa = (FIELD_GET(HPFAR_FIPA, mrs(HPFAR_EL2)) << 12) | (far & 0xfff);
+    } else {
+        ipa = hv_translate(far, true, is_write, &par);
+        have_par = true;
+    }
 
-    dprintf("hv_handle_abort(): stage 1 0x%0lx -> 0x%lx\n", far, ipa);
+    binlog("hv_handle_abort(): stage 1 0x%0lx -> 0x%lx\n", far, ipa);
 
     if (!ipa) {
         printf("HV: stage 1 translation failed at VA 0x%0lx\n", far);
@@ -1129,7 +2090,7 @@ bool hv_handle_dabort(struct exc_info *ctx)
         return false;
     }
 
-    u64 pte = hv_pt_walk(ipa);
+    u64 pte = hv_pt_walk_cached(ipa);
 
     if (!pte) {
         printf("HV: Unmapped IPA 0x%lx\n", ipa);
@@ -1137,6 +2098,11 @@ bool hv_handle_dabort(struct exc_info *ctx)
     }
 
     if (IS_HW(pte)) {
+        if (is_write && (pte & PTE_DIRTY_WP) && hv_dirty_fault(ipa)) {
+            ctx->elr -= 4;
+            return true;
+        }
+
         printf("HV: Data abort on mapped page (0x%lx -> 0x%lx)\n", far, pte);
         // Try again, this is usually a race
         ctx->elr -= 4;
@@ -1147,8 +2113,14 @@ bool hv_handle_dabort(struct exc_info *ctx)
 
     assert(IS_SW(pte));
 
+    hv_stats_dabort(FIELD_GET(SPTE_TYPE, pte));
+
+    if (trace_budget.max_faults && (pte & (SPTE_TRACE_READ | SPTE_TRACE_WRITE)) &&
+        !trace_budget_fault(ipa, pte))
+        pte &= ~(SPTE_TRACE_READ | SPTE_TRACE_WRITE);
+
     u64 elr = ctx->elr;
-    u64 elr_pa = hv_translate(elr, false, false, NULL);
+    u64 elr_pa = hv_translate_code(elr);
     if (!elr_pa) {
         printf("HV: Failed to fetch instruction for data abort at 0x%lx\n", elr);
         return false;
@@ -1189,6 +2161,11 @@ bool hv_handle_dabort(struct exc_info *ctx)
     u64 vaddrp0 = vaddr & ~MASK(VADDR_L3_OFFSET_BITS);
     u64 vaddrp1 = (vaddr + bytes - 1) & ~MASK(VADDR_L3_OFFSET_BITS);
 
+    // The stage 1 attributes are only reported to the host, so only look them up when needed
+    if (!have_par && (vaddrp0 != vaddrp1 || (pte & (SPTE_TRACE_READ | SPTE_TRACE_WRITE)) ||
+                      FIELD_GET(SPTE_TYPE, pte) >= SPTE_PROXY_HOOK_R))
+        hv_translate(far, true, is_write, &par);
+
     if (vaddrp0 == vaddrp1) {
         // Easy case, no page straddle
         if (far != vaddr) {
@@ -1233,7 +2210,7 @@ bool hv_handle_dabort(struct exc_info *ctx)
             return false;
         }
 
-        u64 pte2 = hv_pt_walk(ipa2);
+        u64 pte2 = hv_pt_walk_cached(ipa2);
         if (!pte2) {
             printf("HV: Unmapped %s half IPA 0x%lx\n", other, ipa2);
             return false;
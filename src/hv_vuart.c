@@ -15,17 +15,65 @@ u32 ufstat = 0;
 
 int vuart_irq = 0;
 
-static void update_irq(void)
+/*
+ * The guest still traps on every register access, but data only moves to and from the iodev in
+ * chunks: TX bytes collect here until the buffer fills up or the next HV tick, and RX is refilled
+ * from the iodev on each tick. The TX side always looks drained to the guest, so it never waits on
+ * us to flush.
+ */
+#define VUART_FIFO_SIZE 512
+
+static u8 tx_buf[VUART_FIFO_SIZE];
+static size_t tx_len;
+
+static u8 rx_buf[VUART_FIFO_SIZE];
+static size_t rx_head, rx_tail;
+
+static bool vuart_flush_tx(void)
 {
-    ssize_t rx_queued;
+    if (!tx_len)
+        return false;
+
+    if (iodev_can_write(IODEV_USB_VUART))
+        iodev_write(IODEV_USB_VUART, tx_buf, tx_len);
+
+    tx_len = 0;
+    return true;
+}
+
+static bool vuart_fill_rx(void)
+{
+    size_t old_head = rx_head;
 
     iodev_handle_events(IODEV_USB_VUART);
 
+    while (rx_head - rx_tail < VUART_FIFO_SIZE) {
+        size_t off = rx_head % VUART_FIFO_SIZE;
+        size_t space = min(VUART_FIFO_SIZE - off, VUART_FIFO_SIZE - (rx_head - rx_tail));
+        ssize_t queued = iodev_can_read(IODEV_USB_VUART);
+
+        if (queued <= 0)
+            break;
+
+        ssize_t ret = iodev_read(IODEV_USB_VUART, &rx_buf[off], min((size_t)queued, space));
+        if (ret <= 0)
+            break;
+
+        rx_head += ret;
+    }
+
+    return rx_head != old_head;
+}
+
+static void update_irq(void)
+{
+    size_t rx_queued;
+
     utrstat |= UTRSTAT_TXBE | UTRSTAT_TXE;
     utrstat &= ~UTRSTAT_RXD;
 
     ufstat = 0;
-    if ((rx_queued = iodev_can_read(IODEV_USB_VUART))) {
+    if ((rx_queued = rx_head - rx_tail)) {
         utrstat |= UTRSTAT_RXD;
         if (rx_queued > 15)
             ufstat = FIELD_PREP(UFSTAT_RXCNT, 15) | UFSTAT_RXFULL;
@@ -68,12 +116,13 @@ static bool handle_vuart(struct exc_info *ctx, u64 addr, u64 *val, bool write, i
             case UCON:
                 ucon = *val;
                 break;
-            case UTXH: {
-                uint8_t b = *val;
-                if (iodev_can_write(IODEV_USB_VUART))
-                    iodev_write(IODEV_USB_VUART, &b, 1);
+            case UTXH:
+                if (!tx_len)
+                    hv_tick_kick();
+                tx_buf[tx_len++] = *val;
+                if (tx_len == VUART_FIFO_SIZE)
+                    vuart_flush_tx();
                 break;
-            }
             case UTRSTAT:
                 utrstat &= ~(*val & (UTRSTAT_TXTHRESH | UTRSTAT_RXTHRESH | UTRSTAT_RXTO));
                 break;
@@ -84,10 +133,9 @@ static bool handle_vuart(struct exc_info *ctx, u64 addr, u64 *val, bool write, i
                 *val = ucon;
                 break;
             case URXH:
-                if (iodev_can_read(IODEV_USB_VUART)) {
-                    uint8_t c;
-                    iodev_read(IODEV_USB_VUART, &c, 1);
-                    *val = c;
+                if (rx_head != rx_tail) {
+                    *val = rx_buf[rx_tail++ % VUART_FIFO_SIZE];
+                    update_irq();
                 } else {
                     *val = 0;
                 }
@@ -108,12 +156,17 @@ static bool handle_vuart(struct exc_info *ctx, u64 addr, u64 *val, bool write, i
     return true;
 }
 
-void hv_vuart_poll(void)
+/* Returns true if any data moved */
+bool hv_vuart_poll(void)
 {
     if (!active)
-        return;
+        return false;
 
+    bool busy = vuart_flush_tx();
+    busy |= vuart_fill_rx();
     update_irq();
+
+    return busy;
 }
 
 void hv_map_vuart(u64 base, int irq, iodev_id_t iodev)
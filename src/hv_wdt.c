@@ -3,33 +3,110 @@
 #include "hv.h"
 #include "adt.h"
 #include "smp.h"
+#include "string.h"
 #include "uart.h"
 #include "utils.h"
 
 #define WDT_TIMEOUT 1
 
 static bool hv_wdt_active = false;
-static bool hv_wdt_enabled = false;
+static int hv_wdt_suspended = 0;
 static volatile u64 hv_wdt_timestamp = 0;
 static u64 hv_wdt_timeout = 0;
-static volatile u64 hv_wdt_breadcrumbs;
+static u64 hv_wdt_slow = 0;
 
 static int hv_wdt_cpu;
 
 static u64 cpu_dbg_base = 0;
 
+/*
+ * Every CPU logs its breadcrumbs with a CNTPCT timestamp (packed as timestamp << 8 | id) into its
+ * own ring. The watchdog CPU follows the rings, and on top of barking on hangs it reports guest
+ * exits (from the S/F/I/E crumb up to its lowercase counterpart) that took longer than the slow
+ * threshold, with the trail of crumbs in between. Exits that went to the proxy ('P') are expected
+ * to be slow and are not reported.
+ */
+#define WDT_RING_SIZE 64
+
+struct wdt_ring {
+    u64 entries[WDT_RING_SIZE];
+    u64 head;
+};
+
+struct wdt_scan {
+    u64 seen;
+    u64 start;
+    char exit;
+    bool proxied;
+};
+
+static struct wdt_ring hv_wdt_rings[MAX_CPUS];
+static struct wdt_scan hv_wdt_scans[MAX_CPUS];
+
+#define CRUMB_ID(e)   ((char)((e)&0xff))
+#define CRUMB_TIME(e) ((e) >> 8)
+
+static void hv_wdt_print_trail(struct wdt_ring *ring, u64 from, u64 to)
+{
+    u64 t0 = CRUMB_TIME(ring->entries[from % WDT_RING_SIZE]);
+    u64 tps = mrs(CNTFRQ_EL0) / 1000000;
+
+    for (u64 i = from; i < to; i++) {
+        u64 e = ring->entries[i % WDT_RING_SIZE];
+        uart_printf(" %c+%ld", CRUMB_ID(e), (CRUMB_TIME(e) - t0) / tps);
+    }
+    uart_putchar('\n');
+}
+
+static void hv_wdt_scan(int cpu)
+{
+    struct wdt_ring *ring = &hv_wdt_rings[cpu];
+    struct wdt_scan *scan = &hv_wdt_scans[cpu];
+    u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    // Fell behind by more than a ring, the exit in progress can't be traced anymore
+    if (head - scan->seen > WDT_RING_SIZE) {
+        scan->seen = head - WDT_RING_SIZE;
+        scan->exit = 0;
+    }
+
+    for (; scan->seen < head; scan->seen++) {
+        u64 e = ring->entries[scan->seen % WDT_RING_SIZE];
+        char c = CRUMB_ID(e);
+
+        if (c == 'S' || c == 'F' || c == 'I' || c == 'E') {
+            scan->exit = c;
+            scan->start = scan->seen;
+            scan->proxied = false;
+        } else if (c == 'P') {
+            scan->proxied = true;
+        } else if (scan->exit && c == scan->exit - 'A' + 'a') {
+            u64 t0 = CRUMB_TIME(ring->entries[scan->start % WDT_RING_SIZE]);
+
+            if (!scan->proxied && CRUMB_TIME(e) - t0 > hv_wdt_slow) {
+                uart_printf("HV watchdog: CPU %d slow exit (%ld us):", cpu,
+                            (CRUMB_TIME(e) - t0) / (mrs(CNTFRQ_EL0) / 1000000));
+                hv_wdt_print_trail(ring, scan->start, scan->seen + 1);
+            }
+            scan->exit = 0;
+        }
+    }
+}
+
 void hv_wdt_bark(void)
 {
-    u64 tmp = hv_wdt_breadcrumbs;
     uart_puts("HV watchdog: bark!");
 
-    uart_printf("Breadcrumbs: ");
-    for (int i = 56; i >= 0; i -= 8) {
-        char c = (tmp >> i) & 0xff;
-        if (c)
-            uart_putchar(c);
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct wdt_ring *ring = &hv_wdt_rings[cpu];
+        u64 head = ring->head;
+
+        if (!head)
+            continue;
+
+        uart_printf("Breadcrumbs CPU %d:", cpu);
+        hv_wdt_print_trail(ring, head > 8 ? head - 8 : 0, head);
     }
-    uart_putchar('\n');
 
     uart_puts("Attempting to enter proxy");
 
@@ -45,7 +122,7 @@ void hv_wdt_bark(void)
 void hv_wdt_main(void)
 {
     while (hv_wdt_active) {
-        if (hv_wdt_enabled) {
+        if (!__atomic_load_n(&hv_wdt_suspended, __ATOMIC_RELAXED)) {
             sysop("dmb ish");
             u64 timestamp = hv_wdt_timestamp;
             sysop("isb");
@@ -55,6 +132,10 @@ void hv_wdt_main(void)
                 hv_wdt_bark();
         }
 
+        if (hv_wdt_slow)
+            for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+                hv_wdt_scan(cpu);
+
         udelay(1000);
 
         sysop("dmb ish");
@@ -67,26 +148,27 @@ void hv_wdt_pet(void)
     sysop("dmb ish");
 }
 
+/* Suspensions nest, since several CPUs may be talking to the host at once */
 void hv_wdt_suspend(void)
 {
-    hv_wdt_enabled = false;
+    __atomic_add_fetch(&hv_wdt_suspended, 1, __ATOMIC_RELAXED);
     sysop("dsb ish");
 }
 
 void hv_wdt_resume(void)
 {
     hv_wdt_pet();
-    hv_wdt_enabled = true;
+    __atomic_sub_fetch(&hv_wdt_suspended, 1, __ATOMIC_RELAXED);
     sysop("dsb ish");
 }
 
 void hv_wdt_breadcrumb(char c)
 {
-    u64 tmp = hv_wdt_breadcrumbs;
-    tmp <<= 8;
-    tmp |= c;
-    hv_wdt_breadcrumbs = tmp;
-    sysop("dmb ish");
+    struct wdt_ring *ring = &hv_wdt_rings[smp_id()];
+    u64 head = ring->head;
+
+    ring->entries[head % WDT_RING_SIZE] = (mrs(CNTPCT_EL0) << 8) | (u8)c;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 }
 
 void hv_wdt_init(void)
@@ -106,17 +188,18 @@ void hv_wdt_init(void)
     cpu_dbg_base = reg[0];
 }
 
-void hv_wdt_start(int cpu)
+void hv_wdt_start(int cpu, u64 slow_usec)
 {
     if (hv_wdt_active)
         return;
 
     hv_wdt_cpu = cpu;
-    hv_wdt_breadcrumbs = 0;
+    memset(hv_wdt_rings, 0, sizeof(hv_wdt_rings));
+    memset(hv_wdt_scans, 0, sizeof(hv_wdt_scans));
     hv_wdt_timeout = mrs(CNTFRQ_EL0) * WDT_TIMEOUT;
+    hv_wdt_slow = mrs(CNTFRQ_EL0) / 1000000 * slow_usec;
     hv_wdt_pet();
     hv_wdt_active = true;
-    hv_wdt_enabled = true;
     smp_call4(hv_wdt_cpu, hv_wdt_main, 0, 0, 0, 0);
 }
 
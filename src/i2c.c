@@ -1,9 +1,11 @@
 /* SPDX-License-Identifier: MIT */
 
 #include "adt.h"
+#include "aic.h"
 #include "i2c.h"
 #include "malloc.h"
 #include "pmgr.h"
+#include "string.h"
 #include "types.h"
 #include "utils.h"
 
@@ -18,13 +20,33 @@
 #define PASEMI_STATUS            0x14
 #define PASEMI_STATUS_XFER_BUSY  BIT(28)
 #define PASEMI_STATUS_XFER_ENDED BIT(27)
+#define PASEMI_STATUS_NACK       BIT(21)
+
+#define PASEMI_IMASK 0x18
 
 #define PASEMI_CONTROL          0x1c
 #define PASEMI_CONTROL_CLEAR_RX BIT(10)
 #define PASEMI_CONTROL_CLEAR_TX BIT(9)
 
+// How long to wait for the next byte to show up in the RX FIFO
+#define I2C_RX_TIMEOUT_US 50000
+
+// IRQ mode: how long a transfer may take, and after how long the waiter starts polling itself
+#define I2C_XFER_TIMEOUT_US 100000
+#define I2C_IRQ_GRACE_US    2000
+
+#define I2C_QUEUE_LEN 8
+
+#define DAIF_I BIT(7)
+
 struct i2c_dev {
     uintptr_t base;
+    int node;
+    int irq;
+
+    spinlock_t lock;
+    struct i2c_xfer *queue[I2C_QUEUE_LEN];
+    u32 head, tail; // free-running, the transfer at tail is the one on the bus
 };
 
 i2c_dev_t *i2c_init(const char *adt_node)
@@ -48,16 +70,24 @@ i2c_dev_t *i2c_init(const char *adt_node)
         return NULL;
     }
 
-    i2c_dev_t *dev = malloc(sizeof(*dev));
+    i2c_dev_t *dev = memalign(SPINLOCK_ALIGN, sizeof(*dev));
     if (!dev)
         return NULL;
 
+    memset(dev, 0, sizeof(*dev));
     dev->base = base;
+    dev->node = adt_offset;
+    dev->irq = -1;
+    spin_init(&dev->lock);
     return dev;
 }
 
 void i2c_shutdown(i2c_dev_t *dev)
 {
+    if (dev->irq >= 0) {
+        write32(dev->base + PASEMI_IMASK, 0);
+        aic_unregister_irq(dev->irq);
+    }
     free(dev);
 }
 
@@ -77,25 +107,30 @@ static void i2c_xfer_start_read(i2c_dev_t *dev, u8 addr, size_t len)
     write32(dev->base + PASEMI_FIFO_TX, PASEMI_TX_FLAG_READ | PASEMI_TX_FLAG_STOP | len);
 }
 
+/*
+ * Bytes arrive at bus speed, a few tens of us apart, so drain the FIFO as fast as it fills
+ * instead of sleeping a fixed time whenever it runs empty.
+ */
 static size_t i2c_xfer_read(i2c_dev_t *dev, u8 *bfr, size_t len)
 {
-    for (size_t i = 0; i < len; ++i) {
-        u32 timeout = 5000;
-        u32 val;
+    size_t i = 0;
+    u64 timeout = 0;
+
+    while (i < len) {
+        u32 val = read32(dev->base + PASEMI_FIFO_RX);
 
-        do {
-            val = read32(dev->base + PASEMI_FIFO_RX);
-            if (!(val & PASEMI_RX_FLAG_EMPTY))
-                break;
-            udelay(10);
-        } while (--timeout);
+        if (!(val & PASEMI_RX_FLAG_EMPTY)) {
+            bfr[i++] = val;
+            timeout = 0;
+            continue;
+        }
 
-        if (val & PASEMI_RX_FLAG_EMPTY) {
+        if (!timeout) {
+            timeout = timeout_calculate(I2C_RX_TIMEOUT_US);
+        } else if (timeout_expired(timeout)) {
             printf("i2c: timeout while reading (got %lu, expected %lu bytes)\n", i, len);
             return i;
         }
-
-        bfr[i] = val;
     }
 
     return len;
@@ -126,10 +161,205 @@ static int i2c_xfer_write(i2c_dev_t *dev, u8 addr, u32 start, u32 stop, const u8
     return 0;
 }
 
+/*
+ * Interrupt driven mode. Transfers are queued per controller and the whole SMBus transaction is
+ * loaded into the TX FIFO in one go. The controller raises its IRQ when the transaction has ended
+ * (or was NACKed), and the handler collects the result and starts the next queued transfer, so
+ * every bus makes progress on its own while the CPU does other things.
+ *
+ * Waiters do not depend on the IRQ reaching them: m1n1 only takes IRQs on the boot CPU, and
+ * callers may have them masked, so after a grace period they service the controller themselves.
+ */
+
+static inline u64 i2c_lock(i2c_dev_t *dev)
+{
+    u64 daif = mrs(DAIF);
+    msr(DAIF, daif | DAIF_I);
+    spin_lock(&dev->lock);
+    return daif;
+}
+
+static inline void i2c_unlock(i2c_dev_t *dev, u64 daif)
+{
+    spin_unlock(&dev->lock);
+    msr(DAIF, daif);
+}
+
+static void i2c_xfer_load(i2c_dev_t *dev, struct i2c_xfer *xfer)
+{
+    i2c_clear_fifos(dev);
+    i2c_clear_status(dev);
+
+    u8 hdr[2] = {xfer->reg, xfer->len};
+    if (xfer->read) {
+        i2c_xfer_write(dev, xfer->addr, 1, 0, hdr, 1);
+        i2c_xfer_start_read(dev, xfer->addr, xfer->len + 1);
+    } else {
+        i2c_xfer_write(dev, xfer->addr, 1, 0, hdr, 2);
+        // Queue the data without waiting for the bus, the IRQ tells us when it is done
+        const u8 *bfr = xfer->buf;
+        for (size_t i = 0; i < xfer->len; i++)
+            write32(dev->base + PASEMI_FIFO_TX,
+                    bfr[i] | (i == xfer->len - 1 ? PASEMI_TX_FLAG_STOP : 0));
+    }
+
+    xfer->state = I2C_XFER_ACTIVE;
+    if (dev->irq >= 0)
+        write32(dev->base + PASEMI_IMASK, PASEMI_STATUS_XFER_ENDED | PASEMI_STATUS_NACK);
+}
+
+static int i2c_xfer_collect(i2c_dev_t *dev, struct i2c_xfer *xfer, u32 status)
+{
+    if (status & PASEMI_STATUS_NACK)
+        return -1;
+
+    if (!xfer->read)
+        return xfer->len;
+
+    // Everything has been received by now, so the FIFO only has to be unloaded
+    u8 len_reply;
+    if (i2c_xfer_read(dev, &len_reply, 1) != 1)
+        return -1;
+
+    if (len_reply != xfer->len)
+        printf("i2c: want to read %ld bytes from addr %d but device has %d\n", xfer->len,
+               xfer->addr, len_reply);
+
+    return i2c_xfer_read(dev, xfer->buf, min(xfer->len, len_reply));
+}
+
+static void i2c_finish(i2c_dev_t *dev, struct i2c_xfer *xfer, int result)
+{
+    write32(dev->base + PASEMI_IMASK, 0);
+
+    xfer->result = result;
+    dev->tail++;
+    sysop("dmb sy");
+    xfer->state = result < 0 ? I2C_XFER_ERROR : I2C_XFER_DONE;
+
+    if (dev->head != dev->tail)
+        i2c_xfer_load(dev, dev->queue[dev->tail % I2C_QUEUE_LEN]);
+}
+
+// Called with the lock held
+static void i2c_service(i2c_dev_t *dev)
+{
+    if (dev->head == dev->tail)
+        return;
+
+    struct i2c_xfer *xfer = dev->queue[dev->tail % I2C_QUEUE_LEN];
+    u32 status = read32(dev->base + PASEMI_STATUS);
+
+    if (!(status & (PASEMI_STATUS_XFER_ENDED | PASEMI_STATUS_NACK)))
+        return;
+
+    i2c_finish(dev, xfer, i2c_xfer_collect(dev, xfer, status));
+}
+
+static void i2c_irq(void *priv)
+{
+    i2c_dev_t *dev = priv;
+
+    spin_lock(&dev->lock);
+    i2c_service(dev);
+    spin_unlock(&dev->lock);
+}
+
+int i2c_enable_irq(i2c_dev_t *dev)
+{
+    u32 len;
+
+    if (dev->irq >= 0)
+        return 0;
+
+    const u32 *irqs = adt_getprop(adt, dev->node, "interrupts", &len);
+    if (!irqs || len < sizeof(*irqs))
+        return -1;
+
+    write32(dev->base + PASEMI_IMASK, 0);
+    if (aic_register_irq(irqs[0], i2c_irq, dev) < 0)
+        return -1;
+
+    dev->irq = irqs[0];
+    return 0;
+}
+
+int i2c_submit(i2c_dev_t *dev, struct i2c_xfer *xfer)
+{
+    u64 daif = i2c_lock(dev);
+
+    if (dev->head - dev->tail >= I2C_QUEUE_LEN) {
+        i2c_unlock(dev, daif);
+        return -1;
+    }
+
+    xfer->state = I2C_XFER_QUEUED;
+    xfer->result = -1;
+    dev->queue[dev->head++ % I2C_QUEUE_LEN] = xfer;
+    if (dev->head - dev->tail == 1)
+        i2c_xfer_load(dev, xfer);
+
+    i2c_unlock(dev, daif);
+    return 0;
+}
+
+int i2c_wait(i2c_dev_t *dev, struct i2c_xfer *xfer)
+{
+    u64 start = 0;
+
+    while (true) {
+        int state = __atomic_load_n(&xfer->state, __ATOMIC_ACQUIRE);
+
+        if (state == I2C_XFER_DONE || state == I2C_XFER_ERROR)
+            return xfer->result;
+
+        // The timeout only runs while the transfer is the one on the bus
+        if (state != I2C_XFER_ACTIVE) {
+            start = 0;
+            continue;
+        }
+        if (!start)
+            start = get_ticks();
+
+        u64 elapsed = ticks_to_usecs(get_ticks() - start);
+        if (dev->irq < 0 || elapsed >= I2C_IRQ_GRACE_US) {
+            u64 daif = i2c_lock(dev);
+            if (xfer->state == I2C_XFER_ACTIVE) {
+                i2c_service(dev);
+                if (xfer->state == I2C_XFER_ACTIVE && elapsed >= I2C_XFER_TIMEOUT_US) {
+                    printf("i2c: timeout on transfer to addr %d reg 0x%x\n", xfer->addr,
+                           xfer->reg);
+                    i2c_finish(dev, xfer, -1);
+                }
+            }
+            i2c_unlock(dev, daif);
+        }
+    }
+}
+
+static int i2c_smbus_xfer(i2c_dev_t *dev, u8 addr, u8 reg, bool read, void *bfr, size_t len)
+{
+    struct i2c_xfer xfer = {
+        .addr = addr,
+        .reg = reg,
+        .read = read,
+        .buf = bfr,
+        .len = len,
+    };
+
+    if (i2c_submit(dev, &xfer))
+        return -1;
+
+    return i2c_wait(dev, &xfer);
+}
+
 int i2c_smbus_read(i2c_dev_t *dev, u8 addr, u8 reg, u8 *bfr, size_t len)
 {
     int ret = -1;
 
+    if (dev->irq >= 0)
+        return i2c_smbus_xfer(dev, addr, reg, true, bfr, len);
+
     i2c_clear_fifos(dev);
     i2c_clear_status(dev);
 
@@ -161,19 +391,20 @@ err:
 
 int i2c_smbus_write(i2c_dev_t *dev, u8 addr, u8 reg, const u8 *bfr, size_t len)
 {
+    if (dev->irq >= 0)
+        return i2c_smbus_xfer(dev, addr, reg, false, (void *)bfr, len);
+
     i2c_clear_fifos(dev);
     i2c_clear_status(dev);
 
-    if (i2c_xfer_write(dev, addr, 1, 0, &reg, 1))
-        return -1;
-
-    u8 len_send = len;
-    if (i2c_xfer_write(dev, addr, 0, 0, &len_send, 1))
+    // Register, count and data all go into the TX FIFO back to back as one transaction
+    u8 hdr[2] = {reg, len};
+    if (i2c_xfer_write(dev, addr, 1, 0, hdr, sizeof(hdr)))
         return -1;
     if (i2c_xfer_write(dev, addr, 0, 1, bfr, len))
         return -1;
 
-    return len_send;
+    return hdr[1];
 }
 
 int i2c_smbus_read32(i2c_dev_t *dev, u8 addr, u8 reg, u32 *val)
@@ -7,9 +7,32 @@
 
 typedef struct i2c_dev i2c_dev_t;
 
+enum i2c_xfer_state {
+    I2C_XFER_QUEUED,
+    I2C_XFER_ACTIVE,
+    I2C_XFER_DONE,
+    I2C_XFER_ERROR,
+};
+
+// One SMBus block read or write, owned by the controller from i2c_submit() until it is done
+struct i2c_xfer {
+    u8 addr;
+    u8 reg;
+    bool read;
+    void *buf;
+    size_t len;
+
+    int state;
+    int result; // bytes transferred, or -1
+};
+
 i2c_dev_t *i2c_init(const char *adt_node);
 void i2c_shutdown(i2c_dev_t *dev);
 
+int i2c_enable_irq(i2c_dev_t *dev);
+int i2c_submit(i2c_dev_t *dev, struct i2c_xfer *xfer);
+int i2c_wait(i2c_dev_t *dev, struct i2c_xfer *xfer);
+
 int i2c_smbus_read(i2c_dev_t *dev, u8 addr, u8 reg, u8 *bfr, size_t len);
 int i2c_smbus_write(i2c_dev_t *dev, u8 addr, u8 reg, const u8 *bfr, size_t len);
 
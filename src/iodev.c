@@ -4,6 +4,7 @@
 
 #include "iodev.h"
 #include "memory.h"
+#include "smp.h"
 #include "string.h"
 
 #ifdef DEBUG_IODEV
@@ -14,7 +15,8 @@
     } while (0)
 #endif
 
-#define CONSOLE_BUFFER_SIZE 8192
+#define CONSOLE_BUFFER_SIZE 32768
+#define CONSOLE_RING_SIZE   4096
 
 extern struct iodev iodev_uart;
 extern struct iodev iodev_fb;
@@ -112,6 +114,48 @@ ssize_t iodev_queue(iodev_id_t id, const void *buf, size_t length)
     return ret;
 }
 
+ssize_t iodev_try_write(iodev_id_t id, const void *buf, size_t length)
+{
+    if (!iodevs[id] || !iodevs[id]->ops->try_write)
+        return iodev_write(id, buf, length);
+
+    if (mmu_active())
+        spin_lock(&iodevs[id]->lock);
+    ssize_t ret = iodevs[id]->ops->try_write(iodevs[id]->opaque, buf, length);
+    if (mmu_active())
+        spin_unlock(&iodevs[id]->lock);
+    return ret;
+}
+
+ssize_t iodev_writev(iodev_id_t id, const struct iodev_iov *iov, int count)
+{
+    if (!iodevs[id] || !iodevs[id]->ops->write)
+        return -1;
+
+    const struct iodev_ops *ops = iodevs[id]->ops;
+    void *opaque = iodevs[id]->opaque;
+    ssize_t ret = 0;
+
+    if (mmu_active())
+        spin_lock(&iodevs[id]->lock);
+
+    if (ops->writev) {
+        ret = ops->writev(opaque, iov, count);
+    } else {
+        // Queue everything and kick once, or write segment by segment if the device can't queue
+        for (int i = 0; i < count && ret >= 0; i++) {
+            ssize_t wrote = (ops->queue ? ops->queue : ops->write)(opaque, iov[i].base, iov[i].len);
+            ret = wrote < 0 ? wrote : ret + wrote;
+        }
+        if (ops->queue)
+            ops->write(opaque, NULL, 0);
+    }
+
+    if (mmu_active())
+        spin_unlock(&iodevs[id]->lock);
+    return ret;
+}
+
 void iodev_flush(iodev_id_t id)
 {
     if (!iodevs[id] || !iodevs[id]->ops->flush)
@@ -146,84 +190,77 @@ int in_iodev = 0;
 
 static DECLARE_SPINLOCK(console_lock);
 
-void iodev_console_write(const void *buf, size_t length)
-{
-    bool do_lock = mmu_active();
+/*
+ * With the MMU on, every CPU logs into its own ring without taking any lock. Each entry is
+ * a header followed by the text, padded to the header size. Only the owning CPU moves wp and only
+ * the console_lock holder moves rp, and the holder merges the rings into con_buf by timestamp.
+ */
+struct console_entry {
+    u64 timestamp;
+    u16 cpu;
+    u16 pad;
+    u32 length;
+};
 
-    if (!do_lock && !is_primary_core()) {
-        if (length && iodevs[IODEV_UART]->usage & USAGE_CONSOLE) {
-            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, "*", 1);
-            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, buf, length);
-        }
+struct console_ring {
+    u8 buf[CONSOLE_RING_SIZE];
+    size_t wp;
+    size_t rp;
+    u32 dropped;
+    u32 reported;
+    bool busy;
+} ALIGNED(64);
+
+static struct console_ring console_rings[MAX_CPUS];
+
+/*
+ * Console output only goes into con_buf here; every console device then drains it from its own
+ * read pointer. Writers never wait on a sink: devices are fed whatever they accept without
+ * blocking, and one that falls more than a buffer behind skips ahead to the next full line.
+ * iodev_console_flush() is the only place that waits for every device to catch up.
+ */
+static void iodev_console_drain(iodev_id_t id, bool wait)
+{
+    if (!(iodevs[id]->usage & USAGE_CONSOLE)) {
+        /* Drop buffer */
+        con_rp[id] = con_wp;
         return;
     }
 
-    if (do_lock)
-        spin_lock(&console_lock);
-
-    if (in_iodev) {
-        if (length && iodevs[IODEV_UART]->usage & USAGE_CONSOLE) {
-            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, "+", 1);
-            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, buf, length);
-        }
-        if (do_lock)
-            spin_unlock(&console_lock);
+    if (!iodev_can_write(id))
         return;
-    }
-    in_iodev++;
-
-    dprintf("  iodev_console_write() wp=%d\n", con_wp);
-    for (iodev_id_t id = 0; id < IODEV_MAX; id++) {
-        if (!iodevs[id])
-            continue;
-
-        if (!(iodevs[id]->usage & USAGE_CONSOLE)) {
-            /* Drop buffer */
-            con_rp[id] = con_wp + length;
-            continue;
-        }
 
-        if (!iodev_can_write(id))
-            continue;
-
-        if (con_wp > CONSOLE_BUFFER_SIZE)
-            con_rp[id] = max(con_wp - CONSOLE_BUFFER_SIZE, con_rp[id]);
-
-        dprintf("  rp=%d\n", con_rp[id]);
-        // Flush existing buffer to device if possible
-        while (con_rp[id] < con_wp) {
-            size_t buf_rp = con_rp[id] % CONSOLE_BUFFER_SIZE;
-            size_t block = min(con_wp - con_rp[id], CONSOLE_BUFFER_SIZE - buf_rp);
-
-            dprintf("  write buf %d\n", block);
-            ssize_t ret = iodev_write(id, &con_buf[buf_rp], block);
-
-            if (ret <= 0)
-                goto next_dev;
-
-            con_rp[id] += ret;
-        }
-
-        const u8 *p = buf;
-        size_t wrote = 0;
+    if (con_wp - con_rp[id] > CONSOLE_BUFFER_SIZE) {
+        con_rp[id] = con_wp - CONSOLE_BUFFER_SIZE;
+        while (con_rp[id] < con_wp && con_buf[con_rp[id]++ % CONSOLE_BUFFER_SIZE] != '\n')
+            ;
+    }
 
-        // Write the current buffer
-        while (wrote < length) {
-            ssize_t ret = iodev_write(id, p, length - wrote);
+    dprintf("  rp=%d\n", con_rp[id]);
+    while (con_rp[id] < con_wp) {
+        size_t buf_rp = con_rp[id] % CONSOLE_BUFFER_SIZE;
+        size_t block = min(con_wp - con_rp[id], CONSOLE_BUFFER_SIZE - buf_rp);
 
-            if (ret <= 0)
-                goto next_dev;
+        dprintf("  write buf %d\n", block);
+        ssize_t ret = wait ? iodev_write(id, &con_buf[buf_rp], block)
+                           : iodev_try_write(id, &con_buf[buf_rp], block);
 
-            con_rp[id] += ret;
-            wrote += ret;
-            p += ret;
-        }
+        if (ret <= 0)
+            return;
 
-    next_dev:;
+        con_rp[id] += ret;
     }
+}
 
-    // Update console buffer
+static void iodev_console_drain_all(bool wait)
+{
+    for (iodev_id_t id = 0; id < IODEV_MAX; id++)
+        if (iodevs[id])
+            iodev_console_drain(id, wait);
+}
 
+static void iodev_console_append(const void *buf, size_t length)
+{
     if (length > CONSOLE_BUFFER_SIZE) {
         buf += (length - CONSOLE_BUFFER_SIZE);
         con_wp += (length - CONSOLE_BUFFER_SIZE);
@@ -238,10 +275,158 @@ void iodev_console_write(const void *buf, size_t length)
         con_wp += block;
         length -= block;
     }
+}
+
+static void iodev_console_ring_write(struct console_ring *ring, size_t pos, const u8 *src,
+                                     size_t length)
+{
+    size_t off = pos % CONSOLE_RING_SIZE;
+    size_t block = min(length, CONSOLE_RING_SIZE - off);
+
+    memcpy(&ring->buf[off], src, block);
+    memcpy(ring->buf, src + block, length - block);
+}
+
+/* Record a message in this CPU's ring, returns false if we interrupted ourselves doing so */
+static bool iodev_console_log(const void *buf, size_t length)
+{
+    int cpu = smp_id();
+    struct console_ring *ring = &console_rings[cpu];
+    struct console_entry entry = {
+        .timestamp = mrs(CNTPCT_EL0),
+        .cpu = cpu,
+        .length = length,
+    };
+    size_t need = sizeof(entry) + ALIGN_UP(length, sizeof(entry));
+
+    if (__atomic_exchange_n(&ring->busy, true, __ATOMIC_ACQUIRE))
+        return false;
+
+    size_t rp = __atomic_load_n(&ring->rp, __ATOMIC_ACQUIRE);
+    if (need > CONSOLE_RING_SIZE - (ring->wp - rp)) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    } else {
+        memcpy(&ring->buf[ring->wp % CONSOLE_RING_SIZE], &entry, sizeof(entry));
+        iodev_console_ring_write(ring, ring->wp + sizeof(entry), buf, length);
+        __atomic_store_n(&ring->wp, ring->wp + need, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&ring->busy, false, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool iodev_console_pending(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+        if (__atomic_load_n(&console_rings[cpu].wp, __ATOMIC_ACQUIRE) != console_rings[cpu].rp)
+            return true;
+
+    return false;
+}
+
+/* Move everything logged so far into con_buf, oldest first. Called under console_lock. */
+static void iodev_console_collect(void)
+{
+    char msg[64];
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct console_ring *ring = &console_rings[cpu];
+        u32 dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+        if (dropped != ring->reported) {
+            int len = snprintf(msg, sizeof(msg), "\n[console: dropped %u messages from CPU %d]\n",
+                               dropped - ring->reported, cpu);
+            iodev_console_append(msg, min(len, (int)sizeof(msg) - 1));
+            ring->reported = dropped;
+        }
+    }
+
+    while (true) {
+        struct console_ring *next = NULL;
+        struct console_entry entry = {0};
+
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            struct console_ring *ring = &console_rings[cpu];
+            struct console_entry *head = (void *)&ring->buf[ring->rp % CONSOLE_RING_SIZE];
+
+            if (__atomic_load_n(&ring->wp, __ATOMIC_ACQUIRE) == ring->rp)
+                continue;
+            if (!next || head->timestamp < entry.timestamp) {
+                next = ring;
+                entry = *head;
+            }
+        }
+
+        if (!next)
+            break;
+
+        dprintf("  cpu%d @%ld: %d bytes\n", entry.cpu, entry.timestamp, entry.length);
+
+        size_t pos = next->rp + sizeof(entry);
+        size_t off = pos % CONSOLE_RING_SIZE;
+        size_t block = min((size_t)entry.length, CONSOLE_RING_SIZE - off);
+
+        iodev_console_append(&next->buf[off], block);
+        iodev_console_append(next->buf, entry.length - block);
+
+        pos += ALIGN_UP(entry.length, sizeof(entry));
+        __atomic_store_n(&next->rp, pos, __ATOMIC_RELEASE);
+    }
+}
+
+void iodev_console_write(const void *buf, size_t length)
+{
+    bool do_lock = mmu_active();
+
+    if (!do_lock && !is_primary_core()) {
+        if (length && iodevs[IODEV_UART]->usage & USAGE_CONSOLE) {
+            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, "*", 1);
+            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, buf, length);
+        }
+        return;
+    }
+
+    // Either re-entered while already writing, or interrupted ourselves while logging
+    bool nested = do_lock ? length && !iodev_console_log(buf, length) : in_iodev;
+
+    if (nested) {
+        if (length && iodevs[IODEV_UART]->usage & USAGE_CONSOLE) {
+            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, "+", 1);
+            iodevs[IODEV_UART]->ops->write(iodevs[IODEV_UART]->opaque, buf, length);
+        }
+        return;
+    }
+
+    dprintf("  iodev_console_write() wp=%d\n", con_wp);
+
+    if (!do_lock) {
+        // Only the primary core runs without the MMU, so there is nobody to race with
+        in_iodev++;
+        iodev_console_append(buf, length);
+        iodev_console_drain_all(false);
+        in_iodev--;
+        return;
+    }
+
+    /*
+     * Whoever holds console_lock drains every ring before letting go, and checks again after, so
+     * if we can't get it our message still goes out without us waiting.
+     */
+    do {
+        if (!spin_trylock(&console_lock))
+            return;
+
+        if (!in_iodev) {
+            in_iodev++;
+            iodev_console_collect();
+            iodev_console_drain_all(false);
+            in_iodev--;
+        }
 
-    in_iodev--;
-    if (do_lock)
         spin_unlock(&console_lock);
+    } while (!in_iodev && iodev_console_pending());
 }
 
 void iodev_handle_events(iodev_id_t id)
@@ -269,6 +454,9 @@ void iodev_handle_events(iodev_id_t id)
 
     if (do_lock)
         spin_unlock(&console_lock);
+
+    if (do_lock && iodev_console_pending())
+        iodev_console_write(NULL, 0);
 }
 
 void iodev_console_kick(void)
@@ -287,6 +475,24 @@ void iodev_console_kick(void)
 
 void iodev_console_flush(void)
 {
+    bool do_lock = mmu_active();
+
+    if (do_lock)
+        spin_lock(&console_lock);
+
+    if (!in_iodev) {
+        in_iodev++;
+        iodev_console_collect();
+        iodev_console_drain_all(true);
+        in_iodev--;
+    }
+
+    if (do_lock)
+        spin_unlock(&console_lock);
+
+    if (do_lock && iodev_console_pending())
+        iodev_console_write(NULL, 0);
+
     for (iodev_id_t id = 0; id < IODEV_MAX; id++) {
         if (!iodevs[id])
             continue;
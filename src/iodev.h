@@ -13,7 +13,8 @@ typedef enum _iodev_id_t {
     IODEV_FB,
     IODEV_USB_VUART,
     IODEV_USB0,
-    IODEV_MAX = IODEV_USB0 + USB_IODEV_COUNT,
+    IODEV_USB_BULK0 = IODEV_USB0 + USB_IODEV_COUNT,
+    IODEV_MAX = IODEV_USB_BULK0 + USB_IODEV_COUNT,
 } iodev_id_t;
 
 typedef enum _iodev_usage_t {
@@ -21,12 +22,21 @@ typedef enum _iodev_usage_t {
     USAGE_UARTPROXY = BIT(1),
 } iodev_usage_t;
 
+struct iodev_iov {
+    const void *base;
+    size_t len;
+};
+
 struct iodev_ops {
     ssize_t (*can_read)(void *opaque);
     bool (*can_write)(void *opaque);
     ssize_t (*read)(void *opaque, void *buf, size_t length);
     ssize_t (*write)(void *opaque, const void *buf, size_t length);
     ssize_t (*queue)(void *opaque, const void *buf, size_t length);
+    /* Like write, but only takes what the device can accept right now */
+    ssize_t (*try_write)(void *opaque, const void *buf, size_t length);
+    /* Write all segments as one message, starting the transfer once at the end */
+    ssize_t (*writev)(void *opaque, const struct iodev_iov *iov, int count);
     void (*flush)(void *opaque);
     void (*handle_events)(void *opaque);
 };
@@ -47,6 +57,8 @@ bool iodev_can_write(iodev_id_t id);
 ssize_t iodev_read(iodev_id_t id, void *buf, size_t length);
 ssize_t iodev_write(iodev_id_t id, const void *buf, size_t length);
 ssize_t iodev_queue(iodev_id_t id, const void *buf, size_t length);
+ssize_t iodev_try_write(iodev_id_t id, const void *buf, size_t length);
+ssize_t iodev_writev(iodev_id_t id, const struct iodev_iov *iov, int count);
 void iodev_flush(iodev_id_t id);
 void iodev_handle_events(iodev_id_t id);
 void iodev_lock(iodev_id_t id);
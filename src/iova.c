@@ -5,18 +5,161 @@
 #include "string.h"
 #include "utils.h"
 
-struct iova_block {
-    u64 iova;
-    size_t sz;
-    struct iova_block *next;
+/*
+ * Free space is tracked as a bitmap of 16K pages (1 = free), with a segment tree on top of it. Each
+ * tree node covers a power-of-two run of bitmap words and records the longest free run inside it
+ * and the free runs touching either end, which is enough to find the first fit for any size in
+ * O(log n) and to update a range in O(log n + words touched). Everything lives in the single
+ * allocation made by iovad_init().
+ */
+
+#define IOVA_WORD_PAGES 64
+
+struct iova_node {
+    u32 longest;
+    u32 prefix;
+    u32 suffix;
 };
 
 struct iova_domain {
     u64 base;
     u64 limit;
-    struct iova_block *free_list;
+    u32 pages;
+    u32 leaves;
+    u64 *bitmap;
+    struct iova_node *tree;
 };
 
+static u32 iova_word_longest(u64 w)
+{
+    u32 n = 0;
+
+    while (w) {
+        w &= w << 1;
+        n++;
+    }
+
+    return n;
+}
+
+static void iova_update_leaf(iova_domain_t *iovad, u32 word)
+{
+    struct iova_node *node = &iovad->tree[iovad->leaves + word];
+    u64 w = iovad->bitmap[word];
+
+    if (w == ~0UL) {
+        node->longest = node->prefix = node->suffix = IOVA_WORD_PAGES;
+        return;
+    }
+
+    node->prefix = __builtin_ctzl(~w);
+    node->suffix = __builtin_clzl(~w);
+    node->longest = iova_word_longest(w);
+}
+
+static void iova_update_node(iova_domain_t *iovad, u32 idx, u32 child_pages)
+{
+    struct iova_node *node = &iovad->tree[idx];
+    const struct iova_node *l = &iovad->tree[2 * idx];
+    const struct iova_node *r = &iovad->tree[2 * idx + 1];
+
+    node->prefix = l->prefix == child_pages ? child_pages + r->prefix : l->prefix;
+    node->suffix = r->suffix == child_pages ? child_pages + l->suffix : r->suffix;
+    node->longest = max(max(l->longest, r->longest), l->suffix + r->prefix);
+}
+
+/* Recompute the leaves for words [first, last] and everything above them */
+static void iova_update(iova_domain_t *iovad, u32 first, u32 last)
+{
+    u32 child_pages = IOVA_WORD_PAGES;
+
+    for (u32 i = first; i <= last; i++)
+        iova_update_leaf(iovad, i);
+
+    first += iovad->leaves;
+    last += iovad->leaves;
+
+    while (first > 1) {
+        first >>= 1;
+        last >>= 1;
+        for (u32 i = first; i <= last; i++)
+            iova_update_node(iovad, i, child_pages);
+        child_pages <<= 1;
+    }
+}
+
+static u64 iova_range_mask(u32 page, u32 end, u32 word)
+{
+    u32 lo = max(page, word * IOVA_WORD_PAGES) - word * IOVA_WORD_PAGES;
+    u32 hi = min(end, (word + 1) * IOVA_WORD_PAGES) - word * IOVA_WORD_PAGES;
+
+    return (hi == IOVA_WORD_PAGES ? ~0UL : BIT(hi) - 1) & ~(BIT(lo) - 1);
+}
+
+/* Check that pages [page, page + count) are all free (or all in use) */
+static bool iova_range_is(iova_domain_t *iovad, u32 page, u32 count, bool free)
+{
+    u32 end = page + count;
+
+    for (u32 word = page / IOVA_WORD_PAGES; word <= (end - 1) / IOVA_WORD_PAGES; word++) {
+        u64 mask = iova_range_mask(page, end, word);
+        if ((iovad->bitmap[word] & mask) != (free ? mask : 0))
+            return false;
+    }
+
+    return true;
+}
+
+static void iova_range_set(iova_domain_t *iovad, u32 page, u32 count, bool free)
+{
+    u32 end = page + count;
+    u32 first = page / IOVA_WORD_PAGES;
+    u32 last = (end - 1) / IOVA_WORD_PAGES;
+
+    for (u32 word = first; word <= last; word++) {
+        u64 mask = iova_range_mask(page, end, word);
+        if (free)
+            iovad->bitmap[word] |= mask;
+        else
+            iovad->bitmap[word] &= ~mask;
+    }
+
+    iova_update(iovad, first, last);
+}
+
+/* Find the first free run of at least count pages, returns its first page or -1 */
+static s64 iova_find(iova_domain_t *iovad, u32 count)
+{
+    u32 idx = 1;
+    u32 page = 0;
+    u32 pages = iovad->leaves * IOVA_WORD_PAGES;
+
+    if (iovad->tree[1].longest < count)
+        return -1;
+
+    while (idx < iovad->leaves) {
+        const struct iova_node *l = &iovad->tree[2 * idx];
+        const struct iova_node *r = &iovad->tree[2 * idx + 1];
+
+        pages >>= 1;
+        if (l->longest >= count) {
+            idx = 2 * idx;
+        } else if (l->suffix + r->prefix >= count) {
+            return page + pages - l->suffix;
+        } else {
+            idx = 2 * idx + 1;
+            page += pages;
+        }
+    }
+
+    // The run is inside this word: keep the bits that start count free pages in a row
+    u64 w = iovad->bitmap[idx - iovad->leaves];
+    for (u32 i = 1; i < count; i++)
+        w &= w >> 1;
+
+    return page + __builtin_ctzl(w);
+}
+
 iova_domain_t *iovad_init(u64 base, u64 limit)
 {
     if (base != ALIGN_UP(base, SZ_32M)) {
@@ -24,40 +167,46 @@ iova_domain_t *iovad_init(u64 base, u64 limit)
         return NULL;
     }
 
-    iova_domain_t *iovad = malloc(sizeof(*iovad));
-    if (!iovad)
+    if (limit <= base || (limit - base) / SZ_16K >= BIT(31)) {
+        printf("iovad_init: bad range [%lx, %lx)\n", base, limit);
         return NULL;
+    }
 
-    memset(iovad, 0, sizeof(*iovad));
+    u32 pages = (limit - base) / SZ_16K;
+    u32 words = (pages + IOVA_WORD_PAGES - 1) / IOVA_WORD_PAGES;
+    u32 leaves = 1;
 
-    struct iova_block *blk = malloc(sizeof(*blk));
-    if (!blk) {
-        free(iovad);
+    while (leaves < words)
+        leaves <<= 1;
+
+    size_t size =
+        sizeof(iova_domain_t) + leaves * sizeof(u64) + 2 * leaves * sizeof(struct iova_node);
+
+    iova_domain_t *iovad = malloc(size);
+    if (!iovad)
         return NULL;
-    }
 
-    /* don't hand out NULL pointers */
-    blk->iova = base;
-    blk->sz = limit - SZ_16K;
-    blk->next = NULL;
+    memset(iovad, 0, size);
+
     iovad->base = base;
     iovad->limit = limit;
-    iovad->free_list = blk;
+    iovad->pages = pages;
+    iovad->leaves = leaves;
+    iovad->bitmap = (u64 *)(iovad + 1);
+    iovad->tree = (struct iova_node *)(iovad->bitmap + leaves);
+
+    // Pages past the end of the domain stay marked as used
+    iova_range_set(iovad, 0, pages, true);
+
+    /* don't hand out NULL pointers */
+    if (!base)
+        iova_range_set(iovad, 0, 1, false);
 
     return iovad;
 }
 
 void iovad_shutdown(iova_domain_t *iovad, dart_dev_t *dart)
 {
-    struct iova_block *blk = iovad->free_list;
-
-    while (blk != NULL) {
-        struct iova_block *blk_free = blk;
-        blk = blk->next;
-
-        free(blk_free);
-    }
-
     if (dart)
         for (u64 addr = iovad->base; addr < iovad->limit; addr += SZ_32M)
             dart_free_l2(dart, addr);
@@ -77,157 +226,82 @@ bool iova_reserve(iova_domain_t *iovad, u64 iova, size_t sz)
     if (sz == 0)
         return true;
 
-    if (!iovad->free_list) {
-        printf("iova_reserve: trying to reserve iova range but empty free list\n");
+    if (iova < iovad->base || iova + sz > iovad->limit) {
+        printf("iova_reserve: tried to reserve [%lx; +%lx] outside of the domain [%lx; %lx)\n",
+               iova, sz, iovad->base, iovad->limit);
         return false;
     }
 
-    struct iova_block *blk = iovad->free_list;
-    struct iova_block *blk_prev = NULL;
-    while (blk != NULL) {
-        if (iova >= blk->iova && iova < (blk->iova + blk->sz)) {
-            if (iova + sz >= (blk->iova + blk->sz)) {
-                printf("iova_reserve: tried to reserve [%lx; +%lx] but block in free list has "
-                       "range [%lx; +%lx]\n",
-                       iova, sz, blk->iova, blk->sz);
-                return false;
-            }
-
-            if (iova == blk->iova && sz == blk->sz) {
-                /* if the to-be-reserved range is present as a single block in the free list we just
-                 * need to remove it */
-                if (blk_prev)
-                    blk_prev->next = blk->next;
-                else
-                    iovad->free_list = NULL;
-
-                free(blk);
-                return true;
-            } else if (iova == blk->iova) {
-                /* cut off the reserved range from the beginning */
-                blk->iova += sz;
-                blk->sz -= sz;
-                return true;
-            } else if (iova + sz == blk->iova + blk->sz) {
-                /* cut off the reserved range from the end */
-                blk->sz -= sz;
-                return true;
-            } else {
-                /* the to-be-reserved range is in the middle and we'll have to split this block */
-                struct iova_block *blk_new = malloc(sizeof(*blk_new));
-                if (!blk_new) {
-                    printf("iova_reserve: out of memory.\n");
-                    return false;
-                }
-
-                blk_new->iova = iova + sz;
-                blk_new->sz = blk->iova + blk->sz - blk_new->iova;
-                blk_new->next = blk->next;
-                blk->next = blk_new;
-                blk->sz = iova - blk->iova;
-                return true;
-            }
-        }
+    u32 page = (iova - iovad->base) / SZ_16K;
+    u32 count = sz / SZ_16K;
 
-        blk_prev = blk;
-        blk = blk->next;
+    if (!iova_range_is(iovad, page, count, true)) {
+        printf("iova_reserve: tried to reserve [%lx; +%lx] but range is already used.\n", iova,
+               sz);
+        return false;
     }
 
-    printf("iova_reserve: tried to reserve [%lx; +%lx] but range is already used.\n", iova, sz);
-    return false;
+    iova_range_set(iovad, page, count, false);
+    return true;
 }
 
-u64 iova_alloc(iova_domain_t *iovad, size_t sz)
+u64 iova_alloc_aligned(iova_domain_t *iovad, size_t sz, size_t align)
 {
     sz = ALIGN_UP(sz, SZ_16K);
+    align = max(align, SZ_16K);
 
-    struct iova_block *blk_prev = NULL;
-    struct iova_block *blk = iovad->free_list;
-    while (blk != NULL) {
-        if (blk->sz == sz) {
-            u64 iova = blk->iova;
+    if (!sz || sz / SZ_16K > iovad->pages || (align & (align - 1)))
+        return 0;
 
-            if (blk_prev)
-                blk_prev->next = blk->next;
-            else
-                iovad->free_list = blk->next;
+    u32 count = sz / SZ_16K;
+    u32 slack = align / SZ_16K - 1;
 
-            free(blk);
-            return iova;
-        } else if (blk->sz > sz) {
-            u64 iova = blk->iova;
+    /*
+     * A run with room for the worst-case misalignment always fits; only when that fails do we
+     * need to look for a tighter run that happens to start at the right place.
+     */
+    s64 page = iova_find(iovad, count + slack);
+    if (page >= 0) {
+        u64 iova = ALIGN_UP(iovad->base + page * SZ_16K, align);
+
+        iova_range_set(iovad, (iova - iovad->base) / SZ_16K, count, false);
+        return iova;
+    }
 
-            blk->iova += sz;
-            blk->sz -= sz;
+    if (!slack)
+        return 0;
 
+    for (u64 iova = ALIGN_UP(iovad->base, align); iova + sz <= iovad->limit; iova += align) {
+        page = (iova - iovad->base) / SZ_16K;
+        if (iova_range_is(iovad, page, count, true)) {
+            iova_range_set(iovad, page, count, false);
             return iova;
         }
-
-        blk_prev = blk;
-        blk = blk->next;
     }
 
     return 0;
 }
 
+u64 iova_alloc(iova_domain_t *iovad, size_t sz)
+{
+    return iova_alloc_aligned(iovad, sz, SZ_16K);
+}
+
 void iova_free(iova_domain_t *iovad, u64 iova, size_t sz)
 {
     sz = ALIGN_UP(sz, SZ_16K);
 
-    struct iova_block *blk_prev = NULL;
-    struct iova_block *blk = iovad->free_list;
-
-    /* create a new free list if it's empty */
-    if (!blk) {
-        blk = malloc(sizeof(*blk));
-        if (!blk)
-            panic("out of memory in iovad_free");
-        blk->iova = iova;
-        blk->sz = sz;
-        blk->next = NULL;
-        iovad->free_list = blk;
+    if (!sz)
         return;
-    }
 
-    while (blk != NULL) {
-        if ((iova + sz) == blk->iova) {
-            /* extend the block at the beginning */
-            blk->iova -= sz;
-            blk->sz += sz;
-
-            /* if we have just extended the start of the free list we're already done */
-            if (!blk_prev)
-                return;
-
-            /* check if we can merge two blocks otherwise */
-            if ((blk_prev->iova + blk_prev->sz) == blk->iova) {
-                blk_prev->sz += blk->sz;
-                blk_prev->next = blk->next;
-                free(blk);
-            }
-
-            return;
-        } else if ((iova + sz) < blk->iova) {
-            /* create a new block */
-            struct iova_block *blk_new = malloc(sizeof(*blk_new));
-            if (!blk_new)
-                panic("iova_free: out of memory\n");
-
-            blk_new->iova = iova;
-            blk_new->sz = sz;
-            blk_new->next = blk;
-
-            if (blk_prev)
-                blk_prev->next = blk_new;
-            else
-                iovad->free_list = blk_new;
-
-            return;
-        }
+    if (iova < iovad->base || iova + sz > iovad->limit || iova % SZ_16K)
+        panic("iova_free: [%lx; +%lx] is outside of the domain\n", iova, sz);
 
-        blk_prev = blk;
-        blk = blk->next;
-    }
+    u32 page = (iova - iovad->base) / SZ_16K;
+    u32 count = sz / SZ_16K;
+
+    if (!iova_range_is(iovad, page, count, false))
+        panic("iova_free: [%lx; +%lx] is not fully allocated\n", iova, sz);
 
-    panic("iovad_free: corruption detected, unable to insert freed range\n");
+    iova_range_set(iovad, page, count, true);
 }
@@ -5,6 +5,8 @@
 #include "kboot.h"
 #include "adt.h"
 #include "assert.h"
+#include "bootprof.h"
+#include "cpufreq.h"
 #include "dapf.h"
 #include "devicetree.h"
 #include "exception.h"
@@ -15,6 +17,7 @@
 #include "pmgr.h"
 #include "sep.h"
 #include "smp.h"
+#include "tunables.h"
 #include "types.h"
 #include "usb.h"
 #include "utils.h"
@@ -29,16 +32,19 @@
 #define MAX_DISP_MAPPINGS 8
 
 static void *dt = NULL;
+static bool dt_allocated = false;
 static int dt_bufsize = 0;
 static void *initrd_start = NULL;
 static size_t initrd_size = 0;
 static char *chosen_params[MAX_CHOSEN_PARAMS][2];
+static bool handoff_usb = true;
+static bool handoff_pcie = true;
 
 extern const char *const m1n1_version;
 
 int dt_set_gpu(void *dt);
 
-#define DT_ALIGN 16384
+#define DT_ALIGN KBOOT_DT_ALIGN
 
 #define bail(...)                                                                                  \
     do {                                                                                           \
@@ -53,6 +59,174 @@ int dt_set_gpu(void *dt);
         goto err;                                                                                  \
     } while (0)
 
+/*
+ * libfdt resolves every path, alias and phandle by walking the structure block from the start,
+ * and kboot looks the same nodes up over and over, so remember where they were. An edit that
+ * grows or shrinks the tree moves every node after it: an entry is only used while the structure
+ * block has the size it had when the entry was made and the node found there still has the same
+ * name (or phandle), otherwise the node is looked up again.
+ */
+#define DT_PATH_CACHE_SIZE 32
+#define DT_PATH_MAX        64
+
+struct dt_path_entry {
+    char path[DT_PATH_MAX];
+    char name[DT_PATH_MAX];
+    int offset;
+    u32 stamp;
+};
+
+struct dt_phandle_entry {
+    u32 phandle;
+    int offset;
+};
+
+static struct dt_path_entry dt_path_cache[DT_PATH_CACHE_SIZE];
+static int dt_path_next = 0;
+static struct dt_phandle_entry *dt_phandles = NULL;
+static u32 dt_phandles_mask = 0;
+static u32 dt_phandles_stamp = 0;
+
+static void dt_index_reset(void)
+{
+    memset(dt_path_cache, 0, sizeof(dt_path_cache));
+    dt_path_next = 0;
+
+    free(dt_phandles);
+    dt_phandles = NULL;
+    dt_phandles_mask = 0;
+}
+
+static int dt_path_offset(const char *path)
+{
+    if (!path[0] || strlen(path) >= DT_PATH_MAX)
+        return fdt_path_offset(dt, path);
+
+    u32 stamp = fdt_size_dt_struct(dt);
+    struct dt_path_entry *entry = NULL;
+
+    for (int i = 0; i < DT_PATH_CACHE_SIZE; i++) {
+        if (!strcmp(dt_path_cache[i].path, path)) {
+            entry = &dt_path_cache[i];
+            break;
+        }
+    }
+
+    if (entry && entry->stamp == stamp) {
+        const char *name = fdt_get_name(dt, entry->offset, NULL);
+
+        if (name && !strcmp(name, entry->name))
+            return entry->offset;
+    }
+
+    int offset = fdt_path_offset(dt, path);
+    if (offset < 0)
+        return offset;
+
+    const char *name = fdt_get_name(dt, offset, NULL);
+    if (!name || strlen(name) >= DT_PATH_MAX)
+        return offset;
+
+    if (!entry) {
+        entry = &dt_path_cache[dt_path_next];
+        dt_path_next = (dt_path_next + 1) % DT_PATH_CACHE_SIZE;
+        strcpy(entry->path, path);
+    }
+
+    strcpy(entry->name, name);
+    entry->offset = offset;
+    entry->stamp = stamp;
+
+    return offset;
+}
+
+static const char *dt_get_alias(const char *alias)
+{
+    int aliases = dt_path_offset("/aliases");
+    if (aliases < 0)
+        return NULL;
+
+    return fdt_getprop(dt, aliases, alias, NULL);
+}
+
+// Hash every phandle in the tree to its node, in a single walk
+static int dt_index_phandles(void)
+{
+    u32 count = 0;
+    int node;
+
+    free(dt_phandles);
+    dt_phandles = NULL;
+
+    for (node = fdt_next_node(dt, -1, NULL); node >= 0; node = fdt_next_node(dt, node, NULL))
+        if (fdt_get_phandle(dt, node))
+            count++;
+    if (node != -FDT_ERR_NOTFOUND)
+        return node;
+
+    // At most half full, so a probe always ends on an empty slot
+    u32 slots = 1;
+    while (slots < 2 * count)
+        slots <<= 1;
+
+    dt_phandles = malloc(slots * sizeof(*dt_phandles));
+    if (!dt_phandles)
+        return -FDT_ERR_NOSPACE;
+
+    memset(dt_phandles, 0, slots * sizeof(*dt_phandles));
+    dt_phandles_mask = slots - 1;
+    dt_phandles_stamp = fdt_size_dt_struct(dt);
+
+    for (node = fdt_next_node(dt, -1, NULL); node >= 0; node = fdt_next_node(dt, node, NULL)) {
+        u32 phandle = fdt_get_phandle(dt, node);
+        if (!phandle)
+            continue;
+
+        u32 i = phandle & dt_phandles_mask;
+        while (dt_phandles[i].phandle)
+            i = (i + 1) & dt_phandles_mask;
+
+        dt_phandles[i].phandle = phandle;
+        dt_phandles[i].offset = node;
+    }
+
+    return 0;
+}
+
+static int dt_phandle_lookup(u32 phandle)
+{
+    if (!dt_phandles || dt_phandles_stamp != fdt_size_dt_struct(dt))
+        return -FDT_ERR_NOTFOUND;
+
+    for (u32 i = phandle & dt_phandles_mask;; i = (i + 1) & dt_phandles_mask) {
+        const struct dt_phandle_entry *entry = &dt_phandles[i];
+
+        if (!entry->phandle)
+            return -FDT_ERR_NOTFOUND;
+        if (entry->phandle != phandle)
+            continue;
+        if (fdt_get_phandle(dt, entry->offset) != phandle)
+            return -FDT_ERR_NOTFOUND;
+
+        return entry->offset;
+    }
+}
+
+static int dt_node_by_phandle(u32 phandle)
+{
+    if (!phandle || phandle == ~0U)
+        return -FDT_ERR_BADPHANDLE;
+
+    int offset = dt_phandle_lookup(phandle);
+    if (offset >= 0)
+        return offset;
+
+    if (dt_index_phandles() < 0)
+        return fdt_node_offset_by_phandle(dt, phandle);
+
+    return dt_phandle_lookup(phandle);
+}
+
 void get_notchless_fb(u64 *fb_base, u64 *fb_height)
 {
     *fb_base = cur_boot_args.video.base;
@@ -91,21 +265,24 @@ void get_notchless_fb(u64 *fb_base, u64 *fb_height)
 
 static int dt_set_rng_seed_sep(int node)
 {
-    u64 kaslr_seed;
-    uint8_t rng_seed[128]; // same size used by Linux for kexec
+    struct {
+        u64 kaslr_seed;
+        uint8_t rng_seed[256];
+    } seeds;
 
-    if (sep_get_random(&kaslr_seed, sizeof(kaslr_seed)) != sizeof(kaslr_seed))
-        bail("SEP: couldn't get enough random bytes for KASLR seed");
-    if (sep_get_random(rng_seed, sizeof(rng_seed)) != sizeof(rng_seed))
-        bail("SEP: couldn't get enough random bytes for RNG seed");
+    // One call, so both come out of a single batch of SEP requests
+    if (sep_get_random(&seeds, sizeof(seeds)) != sizeof(seeds))
+        bail("SEP: couldn't get enough random bytes for KASLR and RNG seeds");
 
-    if (fdt_setprop_u64(dt, node, "kaslr-seed", kaslr_seed))
+    if (fdt_setprop_u64(dt, node, "kaslr-seed", seeds.kaslr_seed))
         bail("FDT: couldn't set kaslr-seed\n");
-    if (fdt_setprop(dt, node, "rng-seed", rng_seed, sizeof(rng_seed)))
+    if (fdt_setprop(dt, node, "rng-seed", seeds.rng_seed, sizeof(seeds.rng_seed)))
         bail("FDT: couldn't set rng-seed\n");
 
     printf("FDT: Passing %ld bytes of KASLR seed and %ld bytes of random seed\n",
-           sizeof(kaslr_seed), sizeof(rng_seed));
+           sizeof(seeds.kaslr_seed), sizeof(seeds.rng_seed));
+
+    memset(&seeds, 0, sizeof(seeds));
 
     return 0;
 }
@@ -164,7 +341,7 @@ static int dt_set_rng_seed_adt(int node)
 static int dt_set_chosen(void)
 {
 
-    int node = fdt_path_offset(dt, "/chosen");
+    int node = dt_path_offset("/chosen");
     if (node < 0)
         bail("FDT: /chosen node not found in devtree\n");
 
@@ -194,7 +371,7 @@ static int dt_set_chosen(void)
     }
 
     if (cur_boot_args.video.base) {
-        int fb = fdt_path_offset(dt, "/chosen/framebuffer");
+        int fb = dt_path_offset("/chosen/framebuffer");
         if (fb < 0)
             bail("FDT: /chosen node not found in devtree\n");
 
@@ -250,14 +427,14 @@ static int dt_set_chosen(void)
 
         // save notch height in the dcp node if present
         if (cur_boot_args.video.height - fb_height) {
-            int dcp = fdt_path_offset(dt, "dcp");
+            int dcp = dt_path_offset("dcp");
             if (dcp >= 0)
                 if (fdt_appendprop_u32(dt, dcp, "apple,notch-height",
                                        cur_boot_args.video.height - fb_height))
                     printf("FDT: couldn't set apple,notch-height\n");
         }
     }
-    node = fdt_path_offset(dt, "/chosen");
+    node = dt_path_offset("/chosen");
     if (node < 0)
         bail("FDT: /chosen node not found in devtree\n");
 
@@ -329,7 +506,7 @@ static int dt_set_memory(void)
 
     u64 memreg[2] = {cpu_to_fdt64(dram_min), cpu_to_fdt64(dram_max - dram_min)};
 
-    int node = fdt_path_offset(dt, "/memory");
+    int node = dt_path_offset("/memory");
     if (node < 0)
         bail("FDT: /memory node not found in devtree\n");
 
@@ -342,7 +519,7 @@ static int dt_set_memory(void)
 static int dt_set_serial_number(void)
 {
 
-    int fdt_root = fdt_path_offset(dt, "/");
+    int fdt_root = dt_path_offset("/");
     int adt_root = adt_path_offset(adt, "/");
 
     if (fdt_root < 0)
@@ -363,7 +540,7 @@ static int dt_set_cpus(void)
 {
     int ret = 0;
 
-    int cpus = fdt_path_offset(dt, "/cpus");
+    int cpus = dt_path_offset("/cpus");
     if (cpus < 0)
         bail("FDT: /cpus node not found in devtree\n");
 
@@ -476,7 +653,7 @@ static int dt_set_cpus(void)
     }
 
     /* Prune CPU-map */
-    int cpu_map = fdt_path_offset(dt, "/cpus/cpu-map");
+    int cpu_map = dt_path_offset("/cpus/cpu-map");
     if (cpu_map < 0) {
         printf("FDT: /cpus/cpu-map node not found in devtree, ignoring...\n");
         free(pruned_phandles);
@@ -605,11 +782,11 @@ static int dt_set_mac_addresses(void)
             }
         }
 
-        const char *path = fdt_get_alias(dt, mac_address_devices[i].alias);
+        const char *path = dt_get_alias(mac_address_devices[i].alias);
         if (path == NULL)
             continue;
 
-        int node = fdt_path_offset(dt, path);
+        int node = dt_path_offset(path);
         if (node < 0)
             continue;
 
@@ -639,11 +816,11 @@ static int dt_set_bluetooth(void)
     if (anode < 0)
         bail("ADT: /arm-io/bluetooth not found\n");
 
-    const char *path = fdt_get_alias(dt, "bluetooth0");
+    const char *path = dt_get_alias("bluetooth0");
     if (path == NULL)
         return 0;
 
-    int node = fdt_path_offset(dt, path);
+    int node = dt_path_offset(path);
     if (node < 0)
         return 0;
 
@@ -670,11 +847,11 @@ static int dt_set_wifi(void)
     if (ADT_GETPROP_ARRAY(adt, anode, "wifi-antenna-sku-info", info) < 0)
         bail("ADT: Failed to get wifi-antenna-sku-info");
 
-    const char *path = fdt_get_alias(dt, "wifi0");
+    const char *path = dt_get_alias("wifi0");
     if (path == NULL)
         return 0;
 
-    int node = fdt_path_offset(dt, path);
+    int node = dt_path_offset(path);
     if (node < 0)
         return 0;
 
@@ -712,13 +889,13 @@ static void dt_set_uboot_dm_preloc(int node)
     memcpy(phandles, pds, pds_size);
 
     for (int i = 0; i < pds_size / 4; i++) {
-        node = fdt_node_offset_by_phandle(dt, fdt32_ld(&phandles[i]));
+        node = dt_node_by_phandle(fdt32_ld(&phandles[i]));
         if (node < 0)
             continue;
         dt_set_uboot_dm_preloc(node);
 
         // restore node offset after DT update
-        node = fdt_node_offset_by_phandle(dt, fdt32_ld(&phandles[i]));
+        node = dt_node_by_phandle(fdt32_ld(&phandles[i]));
         if (node < 0)
             continue;
 
@@ -739,11 +916,11 @@ static int dt_set_uboot(void)
     // power domains it depends on with a "u-boot,dm-pre-reloc"
     // property.
 
-    const char *path = fdt_get_alias(dt, "serial0");
+    const char *path = dt_get_alias("serial0");
     if (path == NULL)
         return 0;
 
-    int node = fdt_path_offset(dt, path);
+    int node = dt_path_offset(path);
     if (node < 0)
         return 0;
 
@@ -751,14 +928,6 @@ static int dt_set_uboot(void)
     return 0;
 }
 
-struct atc_tunable {
-    u32 offset : 24;
-    u32 size : 8;
-    u32 mask;
-    u32 value;
-} PACKED;
-static_assert(sizeof(struct atc_tunable) == 12, "Invalid atc_tunable size");
-
 struct atc_tunable_info {
     const char *adt_name;
     const char *fdt_name;
@@ -800,14 +969,14 @@ static const struct atc_tunable_info atc_tunables[] = {
     {"tunable_CIO_LN1_AUSPMA_TX_TOP", "apple,tunable-lane1-cio", 0x13000, 0x1000, true},
 };
 
-static int dt_append_atc_tunable(int adt_node, int fdt_node,
-                                 const struct atc_tunable_info *tunable_info)
+// Compile an ATC tunable from the ADT, *set stays NULL if it is optional and missing
+static int dt_compile_atc_tunable(const char *adt_path, int adt_node,
+                                  const struct atc_tunable_info *tunable_info,
+                                  const struct tunable_set **set)
 {
-    u32 tunables_len;
-    const struct atc_tunable *tunable_adt =
-        adt_getprop(adt, adt_node, tunable_info->adt_name, &tunables_len);
+    *set = NULL;
 
-    if (!tunable_adt) {
+    if (!adt_getprop(adt, adt_node, tunable_info->adt_name, NULL)) {
         printf("ADT: tunable %s not found\n", tunable_info->adt_name);
 
         if (tunable_info->required)
@@ -816,42 +985,89 @@ static int dt_append_atc_tunable(int adt_node, int fdt_node,
             return 0;
     }
 
-    if (tunables_len % sizeof(*tunable_adt)) {
-        printf("ADT: tunable %s with invalid length %d\n", tunable_info->adt_name, tunables_len);
+    // Offsets in the compiled list are relative to the start of the PHY's register range
+    *set = tunables_compile_atc(adt_path, tunable_info->adt_name, tunable_info->reg_offset);
+    if (!*set)
         return -1;
-    }
 
-    u32 n_tunables = tunables_len / sizeof(*tunable_adt);
-    for (size_t j = 0; j < n_tunables; j++) {
-        const struct atc_tunable *tunable = &tunable_adt[j];
+    return 0;
+}
+
+static int dt_fill_atc_tunable(const struct tunable_set *set,
+                               const struct atc_tunable_info *tunable_info, fdt32_t *cells)
+{
+    for (size_t j = 0; j < set->count; j++) {
+        const struct tunable *tunable = &set->entries[j];
+        u64 offset = tunable->addr - tunable_info->reg_offset;
 
-        if (tunable->size != 32) {
-            printf("kboot: ATC tunable has invalid size %d\n", tunable->size);
+        if (tunable->width != 4) {
+            printf("kboot: ATC tunable has invalid size %d\n", tunable->width * 8);
             return -1;
         }
 
-        if (tunable->offset % (tunable->size / 8)) {
-            printf("kboot: ATC tunable has unaligned offset %x\n", tunable->offset);
+        if (offset % tunable->width) {
+            printf("kboot: ATC tunable has unaligned offset %lx\n", offset);
             return -1;
         }
 
-        if (tunable->offset + (tunable->size / 8) > tunable_info->reg_size) {
-            printf("kboot: ATC tunable has invalid offset %x\n", tunable->offset);
+        if (offset + tunable->width > tunable_info->reg_size) {
+            printf("kboot: ATC tunable has invalid offset %lx\n", offset);
             return -1;
         }
 
-        if (fdt_appendprop_u32(dt, fdt_node, tunable_info->fdt_name,
-                               tunable->offset + tunable_info->reg_offset) < 0)
-            return -1;
-        if (fdt_appendprop_u32(dt, fdt_node, tunable_info->fdt_name, tunable->mask) < 0)
-            return -1;
-        if (fdt_appendprop_u32(dt, fdt_node, tunable_info->fdt_name, tunable->value) < 0)
-            return -1;
+        cells[3 * j] = cpu_to_fdt32(tunable->addr);
+        cells[3 * j + 1] = cpu_to_fdt32(tunable->mask);
+        cells[3 * j + 2] = cpu_to_fdt32(tunable->value);
     }
 
     return 0;
 }
 
+/*
+ * Build all of a property from the ADT tunables that go into it, atc_tunables[first] up to
+ * *next, and add it with a single fdt_appendprop(): every call that grows the tree moves all of
+ * it that comes after the property.
+ */
+static int dt_append_atc_tunables(int fdt_node, const struct tunable_set **sets, size_t first,
+                                  size_t *next)
+{
+    const char *fdt_name = atc_tunables[first].fdt_name;
+    size_t count = 0;
+    size_t end;
+
+    for (end = first; end < ARRAY_SIZE(atc_tunables); end++) {
+        if (strcmp(atc_tunables[end].fdt_name, fdt_name))
+            break;
+        if (sets[end])
+            count += sets[end]->count;
+    }
+
+    *next = end;
+
+    if (!count)
+        return 0;
+
+    fdt32_t *cells = malloc(count * 3 * sizeof(*cells));
+    if (!cells)
+        return -1;
+
+    int ret = 0;
+    fdt32_t *p = cells;
+    for (size_t i = first; i < end && !ret; i++) {
+        if (!sets[i])
+            continue;
+
+        ret = dt_fill_atc_tunable(sets[i], &atc_tunables[i], p);
+        p += sets[i]->count * 3;
+    }
+
+    if (!ret && fdt_appendprop(dt, fdt_node, fdt_name, cells, count * 3 * sizeof(*cells)) < 0)
+        ret = -1;
+
+    free(cells);
+    return ret;
+}
+
 static void dt_copy_atc_tunables(const char *adt_path, const char *dt_alias)
 {
     int ret;
@@ -860,20 +1076,28 @@ static void dt_copy_atc_tunables(const char *adt_path, const char *dt_alias)
     if (adt_node < 0)
         return;
 
-    const char *fdt_path = fdt_get_alias(dt, dt_alias);
+    const char *fdt_path = dt_get_alias(dt_alias);
     if (fdt_path == NULL) {
         printf("FDT: Unable to find alias %s\n", dt_alias);
         return;
     }
 
-    int fdt_node = fdt_path_offset(dt, fdt_path);
+    int fdt_node = dt_path_offset(fdt_path);
     if (fdt_node < 0) {
         printf("FDT: Unable to find path %s for alias %s\n", fdt_path, dt_alias);
         return;
     }
 
-    for (size_t i = 0; i < sizeof(atc_tunables) / sizeof(*atc_tunables); ++i) {
-        ret = dt_append_atc_tunable(adt_node, fdt_node, &atc_tunables[i]);
+    const struct tunable_set *sets[ARRAY_SIZE(atc_tunables)];
+
+    for (size_t i = 0; i < ARRAY_SIZE(atc_tunables); ++i) {
+        ret = dt_compile_atc_tunable(adt_path, adt_node, &atc_tunables[i], &sets[i]);
+        if (ret)
+            goto cleanup;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(atc_tunables);) {
+        ret = dt_append_atc_tunables(fdt_node, sets, i, &i);
         if (ret)
             goto cleanup;
     }
@@ -923,7 +1147,7 @@ static int dt_get_iommu_node(int node, u32 num)
     const fdt32_t *iommus = prop;
     uint32_t phandle = fdt32_ld(&iommus[num * 2]);
 
-    return fdt_node_offset_by_phandle(dt, phandle);
+    return dt_node_by_phandle(phandle);
 }
 
 static dart_dev_t *dt_init_dart_by_node(int node, u32 num)
@@ -971,17 +1195,13 @@ static int dt_device_set_reserved_mem(int node, dart_dev_t *dart, const char *na
     if (DART_IS_ERR(iova))
         bail("ADT: no mapping found for '%s' 0x%012lx iova:0x%08lx)\n", name, paddr, iova);
 
-    ret = fdt_appendprop_u32(dt, node, "iommu-addresses", phandle);
-    if (ret != 0)
-        bail("DT: could not append phandle '%s.compatible' property: %d\n", name, ret);
-
-    ret = fdt_appendprop_u64(dt, node, "iommu-addresses", iova);
-    if (ret != 0)
-        bail("DT: could not append iova to '%s.iommu-addresses' property: %d\n", name, ret);
+    // One append for the whole <phandle iova size> entry, as each one moves the rest of the tree
+    fdt32_t entry[5] = {cpu_to_fdt32(phandle), cpu_to_fdt32(iova >> 32), cpu_to_fdt32(iova),
+                        cpu_to_fdt32(size >> 32), cpu_to_fdt32(size)};
 
-    ret = fdt_appendprop_u64(dt, node, "iommu-addresses", size);
+    ret = fdt_appendprop(dt, node, "iommu-addresses", entry, sizeof(entry));
     if (ret != 0)
-        bail("DT: could not append size to '%s.iommu-addresses' property: %d\n", name, ret);
+        bail("DT: could not append to '%s.iommu-addresses' property: %d\n", name, ret);
 
     return 0;
 }
@@ -989,7 +1209,7 @@ static int dt_device_set_reserved_mem(int node, dart_dev_t *dart, const char *na
 static int dt_get_or_add_reserved_mem(const char *node_name, u64 paddr, size_t size)
 {
     int ret;
-    int resv_node = fdt_path_offset(dt, "/reserved-memory");
+    int resv_node = dt_path_offset("/reserved-memory");
     if (resv_node < 0)
         bail("DT: '/reserved-memory' not found\n");
 
@@ -1028,12 +1248,12 @@ static int dt_get_or_add_reserved_mem(const char *node_name, u64 paddr, size_t s
 
 static int dt_set_dcp_firmware(const char *alias)
 {
-    const char *path = fdt_get_alias(dt, alias);
+    const char *path = dt_get_alias(alias);
 
     if (!path)
         return 0;
 
-    int node = fdt_path_offset(dt, path);
+    int node = dt_path_offset(path);
     if (node < 0)
         return 0;
 
@@ -1082,7 +1302,7 @@ static int dt_carveout_reserved_regions(const char *dcp_alias, const char *disp_
     assert(num_maps <= MAX_DISP_MAPPINGS);
 
     // return early if dcp_alias does not exists
-    if (!fdt_get_alias(dt, dcp_alias))
+    if (!dt_get_alias(dcp_alias))
         return 0;
 
     ret = dt_set_dcp_firmware(dcp_alias);
@@ -1117,7 +1337,7 @@ static int dt_carveout_reserved_regions(const char *dcp_alias, const char *disp_
      * Otherwise init each dart and retrieve the node's phandle.
      */
     if (dcp_alias) {
-        int dcp_node = fdt_path_offset(dt, dcp_alias);
+        int dcp_node = dt_path_offset(dcp_alias);
         if (dcp_node < 0) {
             printf("DT: could not resolve '%s' alias\n", dcp_alias);
             goto err; // cleanup
@@ -1129,7 +1349,7 @@ static int dt_carveout_reserved_regions(const char *dcp_alias, const char *disp_
     }
 
     if (disp_alias) {
-        int disp_node = fdt_path_offset(dt, disp_alias);
+        int disp_node = dt_path_offset(disp_alias);
         if (disp_node < 0) {
             printf("DT: could not resolve '%s' alias\n", disp_alias);
             goto err; // cleanup
@@ -1141,7 +1361,7 @@ static int dt_carveout_reserved_regions(const char *dcp_alias, const char *disp_
     }
 
     if (piodma_alias) {
-        int piodma_node = fdt_path_offset(dt, piodma_alias);
+        int piodma_node = dt_path_offset(piodma_alias);
         if (piodma_node < 0) {
             printf("DT: could not resolve '%s' alias\n", piodma_alias);
             goto err; // cleanup
@@ -1153,6 +1373,19 @@ static int dt_carveout_reserved_regions(const char *dcp_alias, const char *disp_
         piodma_phandle = fdt_get_phandle(dt, piodma_node);
     }
 
+    // Index all the DARTs at once, each on its own CPU, so the searches below are cheap
+    dart_dev_t *darts[3];
+    size_t num_darts = 0;
+
+    if (dart_dcp)
+        darts[num_darts++] = dart_dcp;
+    if (dart_disp)
+        darts[num_darts++] = dart_disp;
+    if (dart_piodma)
+        darts[num_darts++] = dart_piodma;
+
+    dart_build_rmap(darts, num_darts);
+
     for (unsigned i = 0; i < num_maps; i++) {
         const char *name = maps[i].mem_fdt;
         char node_name[64];
@@ -1186,7 +1419,7 @@ static int dt_carveout_reserved_regions(const char *dcp_alias, const char *disp_
         /* modify device nodes after filling /reserved-memory to avoid
          * reloading mem_node's offset */
         if (maps[i].map_dcp && dcp_alias) {
-            int dev_node = fdt_path_offset(dt, dcp_alias);
+            int dev_node = dt_path_offset(dcp_alias);
             if (dev_node < 0)
                 bail_cleanup("DT: failed to get node for alias '%s'\n", dcp_alias);
             ret = fdt_appendprop_u32(dt, dev_node, "memory-region", mem_phandle);
@@ -1194,7 +1427,7 @@ static int dt_carveout_reserved_regions(const char *dcp_alias, const char *disp_
                 bail_cleanup("DT: failed to append to 'memory-region' property\n");
         }
         if (maps[i].map_disp && disp_alias) {
-            int dev_node = fdt_path_offset(dt, disp_alias);
+            int dev_node = dt_path_offset(disp_alias);
             if (dev_node < 0)
                 bail_cleanup("DT: failed to get node for alias '%s'\n", disp_alias);
             ret = fdt_appendprop_u32(dt, dev_node, "memory-region", mem_phandle);
@@ -1202,7 +1435,7 @@ static int dt_carveout_reserved_regions(const char *dcp_alias, const char *disp_
                 bail_cleanup("DT: failed to append to 'memory-region' property\n");
         }
         if (maps[i].map_piodma && piodma_alias) {
-            int dev_node = fdt_path_offset(dt, piodma_alias);
+            int dev_node = dt_path_offset(piodma_alias);
             if (dev_node < 0)
                 bail_cleanup("DT: failed to get node for alias '%s\n", piodma_alias);
             ret = fdt_appendprop_u32(dt, dev_node, "memory-region", mem_phandle);
@@ -1216,7 +1449,7 @@ static int dt_carveout_reserved_regions(const char *dcp_alias, const char *disp_
      * does not lock dart-disp0.
      */
     if (disp_alias) {
-        int disp_node = fdt_path_offset(dt, disp_alias);
+        int disp_node = dt_path_offset(disp_alias);
 
         int dart_disp0 = dt_get_iommu_node(disp_node, 0);
         if (dart_disp0 < 0)
@@ -1376,16 +1609,103 @@ static int dt_set_display(void)
     return ret;
 }
 
-static int dt_disable_missing_devs(const char *adt_prefix, const char *dt_prefix, int max_devs)
+/* Device classes whose DT nodes get disabled when the ADT has no matching device */
+static const struct {
+    const char *adt_prefix;
+    const char *dt_prefix;
+} dt_prune_classes[] = {
+    {"usb-drd", "usb@"},
+    {"i2c", "i2c@"},
+};
+
+#define DT_PRUNE_SET_SIZE 512 // power of two, kept at most half full
+
+/* Open addressing set of nonzero keys: class tagged register addresses, or phandles */
+struct dt_prune_set {
+    u64 keys[DT_PRUNE_SET_SIZE];
+    int count;
+};
+
+static u32 dt_prune_hash(u64 key)
 {
-    int ret = -1;
-    int adt_prefix_len = strlen(adt_prefix);
-    int dt_prefix_len = strlen(dt_prefix);
+    return (key * 0x9e3779b97f4a7c15UL) >> 55;
+}
+
+static bool dt_prune_set_add(struct dt_prune_set *set, u64 key)
+{
+    u32 i = dt_prune_hash(key);
+
+    while (set->keys[i] && set->keys[i] != key)
+        i = (i + 1) & (DT_PRUNE_SET_SIZE - 1);
+
+    if (!set->keys[i]) {
+        if (set->count >= DT_PRUNE_SET_SIZE / 2)
+            return false;
+        set->keys[i] = key;
+        set->count++;
+    }
+
+    return true;
+}
+
+static bool dt_prune_set_has(const struct dt_prune_set *set, u64 key)
+{
+    for (u32 i = dt_prune_hash(key); set->keys[i]; i = (i + 1) & (DT_PRUNE_SET_SIZE - 1))
+        if (set->keys[i] == key)
+            return true;
+
+    return false;
+}
+
+static int dt_prune_class(const char *name, bool fdt)
+{
+    for (int i = 0; i < (int)ARRAY_SIZE(dt_prune_classes); i++) {
+        const char *prefix = fdt ? dt_prune_classes[i].dt_prefix : dt_prune_classes[i].adt_prefix;
+        if (!strncmp(name, prefix, strlen(prefix)))
+            return i;
+    }
+
+    return -1;
+}
+
+static u64 dt_prune_key(int cls, u64 addr)
+{
+    return addr | ((u64)(cls + 1) << 56);
+}
+
+static int dt_disable_phandles(const char *path, int node, const char *prop,
+                               struct dt_prune_set *phandles)
+{
+    int size;
+    const fdt32_t *val = fdt_getprop(dt, node, prop, &size);
+
+    if (!val)
+        return 0;
+
+    if (size & 7 || size > 4 * 8) {
+        printf("FDT: bad %s property for %s/%s\n", prop, path, fdt_get_name(dt, node, NULL));
+        return 0;
+    }
+
+    for (int i = 0; i < size / 8; i++)
+        if (!dt_prune_set_add(phandles, fdt32_ld(&val[i * 2])))
+            return -1;
+
+    return 0;
+}
 
-    int acnt = 0, phcnt = 0;
-    u64 *addrs = malloc(max_devs * sizeof(u64));
-    u32 *phandles = malloc(max_devs * sizeof(u32) * 4); // Allow up to 4 extra nodes per device
-    if (!addrs || !phandles)
+/*
+ * Disable the DT nodes of devices in dt_prune_classes that the ADT doesn't have, along with the
+ * IOMMUs and PHYs they reference. The ADT is scanned once into a set of present devices, and
+ * every soc node's children are walked twice, so this stays linear in the size of both trees
+ * however many classes are handled.
+ */
+static int dt_disable_missing_devs(void)
+{
+    int ret = -1;
+    struct dt_prune_set *present = calloc(1, sizeof(*present));
+    struct dt_prune_set *phandles = calloc(1, sizeof(*phandles));
+    if (!present || !phandles)
         bail_cleanup("FDT: out of memory\n");
 
     int path[8];
@@ -1411,12 +1731,16 @@ static int dt_disable_missing_devs(const char *adt_prefix, const char *dt_prefix
     ADT_FOREACH_CHILD(adt, node)
     {
         const char *name = adt_get_name(adt, node);
-        if (strncmp(name, adt_prefix, adt_prefix_len))
+        int cls = dt_prune_class(name, false);
+        if (cls < 0)
             continue;
 
+        u64 addr;
         path[pp] = node;
-        if (adt_get_reg(adt, path, "reg", 0, &addrs[acnt++], NULL) < 0)
+        if (adt_get_reg(adt, path, "reg", 0, &addr, NULL) < 0)
             bail_cleanup("Error getting /arm-io/%s regs\n", name);
+        if (!dt_prune_set_add(present, dt_prune_key(cls, addr)))
+            bail_cleanup("ADT: too many devices to prune, increase DT_PRUNE_SET_SIZE\n");
     }
 
     for (u32 die = 0; die < die_count; ++die) {
@@ -1426,7 +1750,7 @@ static int dt_disable_missing_devs(const char *adt_prefix, const char *dt_prefix
             // pre-linux submission multi-die path
             // can probably removed the next time someone read this comment.
             snprintf(path, sizeof(path), "/soc/die%u", die);
-            int die_node = fdt_path_offset(dt, path);
+            int die_node = dt_path_offset(path);
             if (die_node < 0) {
                 /* this should use aliases for the soc nodes */
                 u64 die_unit_addr = die * PMGR_DIE_OFFSET + 0x200000000;
@@ -1434,9 +1758,9 @@ static int dt_disable_missing_devs(const char *adt_prefix, const char *dt_prefix
             }
         }
 
-        int soc = fdt_path_offset(dt, path);
+        int soc = dt_path_offset(path);
         if (soc < 0)
-            bail("FDT: %s node not found in devtree\n", path);
+            bail_cleanup("FDT: %s node not found in devtree\n", path);
 
         // parse ranges for address translation
         struct dt_ranges_tbl ranges[DT_MAX_RANGES] = {0};
@@ -1446,43 +1770,20 @@ static int dt_disable_missing_devs(const char *adt_prefix, const char *dt_prefix
         fdt_for_each_subnode(node, dt, soc)
         {
             const char *name = fdt_get_name(dt, node, NULL);
-            if (strncmp(name, dt_prefix, dt_prefix_len))
+            int cls = dt_prune_class(name, true);
+            if (cls < 0)
                 continue;
 
             const fdt64_t *reg = fdt_getprop(dt, node, "reg", NULL);
             if (!reg)
                 bail_cleanup("FDT: failed to get reg property of %s\n", name);
 
-            u64 addr = dt_translate(ranges, reg);
-
-            int i;
-            for (i = 0; i < acnt; i++)
-                if (addrs[i] == addr)
-                    break;
-            if (i < acnt)
+            if (dt_prune_set_has(present, dt_prune_key(cls, dt_translate(ranges, reg))))
                 continue;
 
-            int iommus_size;
-            const fdt32_t *iommus = fdt_getprop(dt, node, "iommus", &iommus_size);
-            if (iommus) {
-                if (iommus_size & 7 || iommus_size > 4 * 8) {
-                    printf("FDT: bad iommus property for %s/%s\n", path, name);
-                } else {
-                    for (int i = 0; i < iommus_size / 8; i++)
-                        phandles[phcnt++] = fdt32_ld(&iommus[i * 2]);
-                }
-            }
-
-            int phys_size;
-            const fdt32_t *phys = fdt_getprop(dt, node, "phys", &phys_size);
-            if (phys) {
-                if (phys_size & 7 || phys_size > 4 * 8) {
-                    printf("FDT: bad phys property for %s/%s\n", path, name);
-                } else {
-                    for (int i = 0; i < phys_size / 8; i++)
-                        phandles[phcnt++] = fdt32_ld(&phys[i * 2]);
-                }
-            }
+            if (dt_disable_phandles(path, node, "iommus", phandles) ||
+                dt_disable_phandles(path, node, "phys", phandles))
+                bail_cleanup("FDT: too many secondary devices, increase DT_PRUNE_SET_SIZE\n");
 
             const char *status = fdt_getprop(dt, node, "status", NULL);
             if (!status || strcmp(status, "disabled")) {
@@ -1493,33 +1794,32 @@ static int dt_disable_missing_devs(const char *adt_prefix, const char *dt_prefix
             }
         }
 
+        if (!phandles->count)
+            continue;
+
         /* Disable secondary devices */
         fdt_for_each_subnode(node, dt, soc)
         {
-            const char *name = fdt_get_name(dt, node, NULL);
             u32 phandle = fdt_get_phandle(dt, node);
+            if (!phandle || !dt_prune_set_has(phandles, phandle))
+                continue;
 
-            for (int i = 0; i < phcnt; i++) {
-                if (phandles[i] != phandle)
-                    continue;
-
-                const char *status = fdt_getprop(dt, node, "status", NULL);
-                if (status && !strcmp(status, "disabled"))
-                    continue;
+            const char *status = fdt_getprop(dt, node, "status", NULL);
+            if (status && !strcmp(status, "disabled"))
+                continue;
 
-                printf("FDT: Disabling secondary device %s/%s\n", path, name);
+            const char *name = fdt_get_name(dt, node, NULL);
+            printf("FDT: Disabling secondary device %s/%s\n", path, name);
 
-                if (fdt_setprop_string(dt, node, "status", "disabled") < 0)
-                    bail_cleanup("FDT: failed to set status property of %s/%s\n", path, name);
-                break;
-            }
+            if (fdt_setprop_string(dt, node, "status", "disabled") < 0)
+                bail_cleanup("FDT: failed to set status property of %s/%s\n", path, name);
         }
     }
 
     ret = 0;
 err:
     free(phandles);
-    free(addrs);
+    free(present);
 
     return ret;
 }
@@ -1562,54 +1862,75 @@ int kboot_set_chosen(const char *name, const char *value)
     return i;
 }
 
-int kboot_prepare_dt(void *fdt)
+static void dt_release(void)
 {
-    if (dt) {
+    if (dt && dt_allocated)
         free(dt);
-        dt = NULL;
-    }
 
-    dt_bufsize = fdt_totalsize(fdt);
-    assert(dt_bufsize);
+    dt = NULL;
+    dt_allocated = false;
 
-    dt_bufsize += 64 * 1024; // Add 64K of buffer for modifications
-    dt = memalign(DT_ALIGN, dt_bufsize);
+    dt_index_reset();
+    dt_cache_ranges(NULL);
+}
 
+static int dt_prepare(void *fdt)
+{
     if (fdt_open_into(fdt, dt, dt_bufsize) < 0)
         bail("FDT: fdt_open_into() failed\n");
 
+    dt_index_reset();
+    dt_cache_ranges(dt);
+
     if (fdt_add_mem_rsv(dt, (u64)dt, dt_bufsize))
         bail("FDT: couldn't add reservation for the devtree\n");
 
     if (fdt_add_mem_rsv(dt, (u64)_base, ((u64)_end) - ((u64)_base)))
         bail("FDT: couldn't add reservation for m1n1\n");
 
+    bootprof_mark(BOOTPROF_DT_OPEN);
+
     if (dt_set_chosen())
         return -1;
+    bootprof_mark(BOOTPROF_DT_CHOSEN);
     if (dt_set_serial_number())
         return -1;
+    bootprof_mark(BOOTPROF_DT_SERIAL);
     if (dt_set_memory())
         return -1;
+    bootprof_mark(BOOTPROF_DT_MEMORY);
     if (dt_set_cpus())
         return -1;
+    bootprof_mark(BOOTPROF_DT_CPUS);
     if (dt_set_mac_addresses())
         return -1;
+    bootprof_mark(BOOTPROF_DT_MAC);
     if (dt_set_wifi())
         return -1;
+    bootprof_mark(BOOTPROF_DT_WIFI);
     if (dt_set_bluetooth())
         return -1;
+    bootprof_mark(BOOTPROF_DT_BLUETOOTH);
     if (dt_set_uboot())
         return -1;
+    bootprof_mark(BOOTPROF_DT_UBOOT);
     if (dt_set_atc_tunables())
         return -1;
+    bootprof_mark(BOOTPROF_DT_ATC);
     if (dt_set_display())
         return -1;
+    bootprof_mark(BOOTPROF_DT_DISPLAY);
     if (dt_set_gpu(dt))
         return -1;
-    if (dt_disable_missing_devs("usb-drd", "usb@", 8))
-        return -1;
-    if (dt_disable_missing_devs("i2c", "i2c@", 8))
+    bootprof_mark(BOOTPROF_DT_GPU);
+    if (dt_disable_missing_devs())
         return -1;
+    bootprof_mark(BOOTPROF_DT_DISABLE);
+
+    // Added with the stages so far, the rest are filled in by kboot_boot()
+    bootprof_mark(BOOTPROF_DT_PACK);
+    if (bootprof_set_fdt(dt, false))
+        bail("FDT: couldn't add the boot profile\n");
 
     if (fdt_pack(dt))
         bail("FDT: fdt_pack() failed\n");
@@ -1619,14 +1940,143 @@ int kboot_prepare_dt(void *fdt)
     return 0;
 }
 
+/*
+ * Work out up front how big the FDT can get: KBOOT_DT_SLACK covers the edits of a fixed size, and
+ * the ones that scale with the machine or the chosen params are measured here.
+ */
+size_t kboot_dt_budget(void *fdt)
+{
+    size_t size = fdt_totalsize(fdt) + KBOOT_DT_SLACK;
+
+    // Property header, name and padding on top of the payload
+    const size_t prop_overhead = 3 * sizeof(fdt32_t) + 32 + sizeof(fdt32_t);
+
+    for (int i = 0; i < MAX_CHOSEN_PARAMS && chosen_params[i][0]; i++)
+        if (chosen_params[i][1])
+            size += strlen(chosen_params[i][1]) + 1 + prop_overhead;
+
+    // Each 12-byte ADT ATC tunable becomes one <addr mask value> triplet in the FDT
+    for (int i = 0; i < MAX_ATC_DEVS; i++) {
+        char adt_path[32];
+
+        snprintf(adt_path, sizeof(adt_path), "/arm-io/atc-phy%d", i);
+        int adt_node = adt_path_offset(adt, adt_path);
+        if (adt_node < 0)
+            continue;
+
+        for (size_t j = 0; j < ARRAY_SIZE(atc_tunables); j++) {
+            u32 len;
+
+            if (adt_getprop(adt, adt_node, atc_tunables[j].adt_name, &len))
+                size += len + prop_overhead;
+        }
+    }
+
+    return ALIGN_UP(size, sizeof(fdt64_t));
+}
+
+int kboot_prepare_dt(void *fdt)
+{
+    dt_release();
+
+    assert(fdt_totalsize(fdt));
+
+    dt_bufsize = kboot_dt_budget(fdt);
+    dt = memalign(DT_ALIGN, dt_bufsize);
+    dt_allocated = true;
+
+    return dt_prepare(fdt);
+}
+
+/*
+ * Edit the FDT where it is, for callers that already placed it suitably aligned in a buffer of at
+ * least kboot_dt_budget() bytes. This saves a copy of the whole tree.
+ */
+int kboot_prepare_dt_inplace(void *fdt, size_t bufsize)
+{
+    dt_release();
+
+    if (((u64)fdt) & (DT_ALIGN - 1) || bufsize < kboot_dt_budget(fdt)) {
+        printf("FDT: %p (0x%lx bytes) is not usable in place\n", fdt, bufsize);
+        return -1;
+    }
+
+    dt = fdt;
+    dt_bufsize = bufsize;
+
+    return dt_prepare(fdt);
+}
+
+/*
+ * Choose what kboot_boot() brings up for the kernel, from a comma separated list of "usb",
+ * "nousb", "pcie" and "nopcie". Both default to on. USB is only needed by kernels that expect
+ * m1n1 to have brought up the PHYs, and PCIe by kernels that don't set up the root ports
+ * themselves, which covers WiFi on most machines. The DAPF setup is always done.
+ */
+int kboot_set_handoff(const char *spec)
+{
+    int ret = 0;
+
+    while (spec && *spec) {
+        const char *end = strchr(spec, ',');
+        size_t len = end ? (size_t)(end - spec) : strlen(spec);
+        bool enable = true;
+        const char *opt = spec;
+
+        if (len > 2 && !strncmp(opt, "no", 2)) {
+            enable = false;
+            opt += 2;
+            len -= 2;
+        }
+
+        if (len == 3 && !strncmp(opt, "usb", 3)) {
+            handoff_usb = enable;
+        } else if (len == 4 && !strncmp(opt, "pcie", 4)) {
+            handoff_pcie = enable;
+        } else {
+            printf("kboot: unknown handoff option '%.*s'\n", (int)(opt - spec + len), spec);
+            ret = -1;
+        }
+
+        spec = end ? end + 1 : NULL;
+    }
+
+    printf("kboot: handoff will %sinit USB and %sinit PCIe\n", handoff_usb ? "" : "not ",
+           handoff_pcie ? "" : "not ");
+
+    return ret;
+}
+
 int kboot_boot(void *kernel)
 {
-    usb_init();
-    pcie_init();
+    if (handoff_usb) {
+        usb_init();
+        bootprof_mark(BOOTPROF_USB);
+    }
+    if (handoff_pcie) {
+        pcie_init();
+        bootprof_mark(BOOTPROF_PCIE);
+    }
     dapf_init_all();
 
+    // The kernel starts with its caches off, so it has to find everything in memory, whichever
+    // CPU wrote it
+    struct kernel_header *hdr = kernel;
+    dc_cvac_range_auto(kernel, hdr->image_size);
+    if (dt)
+        dc_cvac_range_auto(dt, fdt_totalsize(dt));
+    if (initrd_start && initrd_size)
+        dc_cvac_range_auto(initrd_start, initrd_size);
+
     printf("Setting SMP mode to WFE...\n");
     smp_set_wfe_mode(true);
+    cpufreq_set_phase(CPUFREQ_PHASE_HANDOFF);
+
+    bootprof_mark(BOOTPROF_KBOOT);
+    bootprof_print();
+    if (dt && bootprof_set_fdt(dt, true))
+        printf("FDT: couldn't update the boot profile\n");
+
     printf("Preparing to boot kernel at %p with fdt at %p\n", kernel, dt);
 
     next_stage.entry = kernel;
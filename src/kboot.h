@@ -17,9 +17,16 @@ struct kernel_header {
     u32 res5;        /* reserved (used for PE COFF offset) */
 };
 
+// Alignment of the FDT and room it needs past its end for kboot's fixed-size modifications
+#define KBOOT_DT_ALIGN 16384
+#define KBOOT_DT_SLACK (32 * 1024)
+
 void kboot_set_initrd(void *start, size_t size);
 int kboot_set_chosen(const char *name, const char *value);
+size_t kboot_dt_budget(void *fdt);
+int kboot_set_handoff(const char *spec);
 int kboot_prepare_dt(void *fdt);
+int kboot_prepare_dt_inplace(void *fdt, size_t bufsize);
 int kboot_boot(void *kernel);
 
 #endif
@@ -84,6 +84,57 @@ static void load_fuses(float *out, u32 count, u64 base, u32 start, u32 width, fl
 
 static u32 t8103_pwr_scale[] = {0, 63, 80, 108, 150, 198, 210};
 
+/*
+ * The t600x power model is a pile of expf() per perf state and cluster, but only depends on the
+ * (fused, core count adjusted) leakage values and the ADT perf states. Keep the last result for
+ * repeated kboot runs in the same session.
+ */
+static struct {
+    bool valid;
+    u32 chip_id;
+    u32 count;
+    u32 table_count;
+    float core_leak[MAX_CLUSTERS];
+    float sram_leak[MAX_CLUSTERS];
+    struct perf_state core[MAX_PSTATES * MAX_CLUSTERS];
+    struct perf_state sram[MAX_PSTATES * MAX_CLUSTERS];
+    u32 max_pwr[MAX_PSTATES];
+} power_cache;
+
+static bool power_cache_lookup(u32 count, u32 table_count, const struct perf_state *core,
+                               const struct perf_state *sram, const float *core_leak,
+                               const float *sram_leak, u32 *max_pwr)
+{
+    size_t states = sizeof(*core) * count * table_count;
+
+    if (!power_cache.valid || power_cache.chip_id != chip_id || power_cache.count != count ||
+        power_cache.table_count != table_count ||
+        memcmp(power_cache.core_leak, core_leak, sizeof(float) * table_count) ||
+        memcmp(power_cache.sram_leak, sram_leak, sizeof(float) * table_count) ||
+        memcmp(power_cache.core, core, states) || memcmp(power_cache.sram, sram, states))
+        return false;
+
+    memcpy(max_pwr, power_cache.max_pwr, sizeof(*max_pwr) * count);
+    return true;
+}
+
+static void power_cache_store(u32 count, u32 table_count, const struct perf_state *core,
+                              const struct perf_state *sram, const float *core_leak,
+                              const float *sram_leak, const u32 *max_pwr)
+{
+    size_t states = sizeof(*core) * count * table_count;
+
+    power_cache.chip_id = chip_id;
+    power_cache.count = count;
+    power_cache.table_count = table_count;
+    memcpy(power_cache.core_leak, core_leak, sizeof(float) * table_count);
+    memcpy(power_cache.sram_leak, sram_leak, sizeof(float) * table_count);
+    memcpy(power_cache.core, core, states);
+    memcpy(power_cache.sram, sram, states);
+    memcpy(power_cache.max_pwr, max_pwr, sizeof(*max_pwr) * count);
+    power_cache.valid = true;
+}
+
 static int calc_power_t8103(u32 count, u32 table_count, const struct perf_state *core,
                             const struct perf_state *sram, u32 *max_pwr, float *core_leak,
                             float *sram_leak)
@@ -206,6 +257,14 @@ static int calc_power_t600x(u32 count, u32 table_count, const struct perf_state
     if (table_count != nclusters)
         bail("ADT: GPU: expected %d perf state tables but got %d\n", nclusters, table_count);
 
+    if (!sram)
+        bail("ADT: GPU: missing perf-states-sram\n");
+
+    if (power_cache_lookup(count, table_count, core, sram, core_leak, sram_leak, max_pwr)) {
+        printf("FDT: GPU: Using cached power table\n");
+        return 0;
+    }
+
     max_pwr[0] = 0;
 
     for (u32 i = 1; i < count; i++) {
@@ -248,6 +307,7 @@ static int calc_power_t600x(u32 count, u32 table_count, const struct perf_state
         max_pwr[i] = total_mw * 1000;
     }
 
+    power_cache_store(count, table_count, core, sram, core_leak, sram_leak, max_pwr);
     return 0;
 }
 
@@ -0,0 +1,331 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * LZ4 frame decoder, for decompressing into a flat output buffer.
+ *
+ * Supports the standard frame format (without dictionaries) and the legacy format produced by
+ * `lz4 -l`, which is what the Linux kernel uses for Image.lz4. Since the whole output is
+ * addressable, linked blocks need no separate window.
+ */
+
+#include "lz4dec.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_MAGIC        0x184d2204
+#define LZ4_LEGACY_MAGIC 0x184c2102
+
+#define LZ4_LEGACY_BLOCK (8 << 20)
+// LZ4_compressBound() for a legacy block
+#define LZ4_LEGACY_BOUND (LZ4_LEGACY_BLOCK + LZ4_LEGACY_BLOCK / 255 + 16)
+
+#define FLG_VERSION_MASK 0xc0
+#define FLG_VERSION      0x40
+#define FLG_B_INDEP      0x20
+#define FLG_B_CHECKSUM   0x10
+#define FLG_C_SIZE       0x08
+#define FLG_C_CHECKSUM   0x04
+#define FLG_RESERVED     0x02
+#define FLG_DICT_ID      0x01
+
+#define BD_BLOCK_MAX(bd) (((bd) >> 4) & 7)
+#define BD_RESERVED      0x8f
+
+#define BLOCK_UNCOMPRESSED 0x80000000
+
+#define PRIME32_1 0x9e3779b1U
+#define PRIME32_2 0x85ebca77U
+#define PRIME32_3 0xc2b2ae3dU
+#define PRIME32_4 0x27d4eb2fU
+#define PRIME32_5 0x165667b1U
+
+struct lz4_in {
+    const uint8_t *src;
+    size_t len;
+    size_t pos;
+};
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool in_avail(const struct lz4_in *in, size_t n)
+{
+    return in->len - in->pos >= n;
+}
+
+static uint32_t rotl32(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t xxh32_round(uint32_t acc, uint32_t input)
+{
+    return rotl32(acc + input * PRIME32_2, 13) * PRIME32_1;
+}
+
+static uint32_t xxh32(const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+    uint32_t h;
+
+    if (len >= 16) {
+        uint32_t v1 = PRIME32_1 + PRIME32_2;
+        uint32_t v2 = PRIME32_2;
+        uint32_t v3 = 0;
+        uint32_t v4 = -PRIME32_1;
+
+        for (; end - p >= 16; p += 16) {
+            v1 = xxh32_round(v1, get_le32(p));
+            v2 = xxh32_round(v2, get_le32(p + 4));
+            v3 = xxh32_round(v3, get_le32(p + 8));
+            v4 = xxh32_round(v4, get_le32(p + 12));
+        }
+
+        h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+    } else {
+        h = PRIME32_5;
+    }
+
+    h += len;
+
+    for (; end - p >= 4; p += 4)
+        h = rotl32(h + get_le32(p) * PRIME32_3, 17) * PRIME32_4;
+    for (; p < end; p++)
+        h = rotl32(h + *p * PRIME32_5, 11) * PRIME32_1;
+
+    h ^= h >> 15;
+    h *= PRIME32_2;
+    h ^= h >> 13;
+    h *= PRIME32_3;
+    h ^= h >> 16;
+
+    return h;
+}
+
+/* Copy an LZ4 match, which may overlap its own output */
+static void copy_match(uint8_t *d, size_t off, size_t len)
+{
+    const uint8_t *s = d - off;
+
+    if (off >= len) {
+        memcpy(d, s, len);
+        return;
+    }
+
+    // Everything from s onwards repeats with a period of off, so keep doubling the chunk size
+    while (len) {
+        size_t n = d - s;
+        if (n > len)
+            n = len;
+        memcpy(d, s, n);
+        d += n;
+        len -= n;
+    }
+}
+
+static int read_length(const uint8_t *src, size_t len, size_t *ip, size_t *val)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= len)
+            return LZ4_DATA_ERROR;
+        b = src[(*ip)++];
+        *val += b;
+    } while (b == 255);
+
+    return LZ4_OK;
+}
+
+/* Decode one block; matches may reach back as far as base */
+static int lz4_block(uint8_t *dst, size_t base, size_t *pos, size_t cap, const uint8_t *src,
+                     size_t len)
+{
+    size_t ip = 0, op = *pos;
+    int ret;
+
+    while (true) {
+        if (ip >= len)
+            return LZ4_DATA_ERROR;
+
+        uint8_t token = src[ip++];
+        size_t lit = token >> 4;
+
+        if (lit == 15 && (ret = read_length(src, len, &ip, &lit)))
+            return ret;
+        if (len - ip < lit)
+            return LZ4_DATA_ERROR;
+        if (cap - op < lit)
+            return LZ4_BUF_ERROR;
+
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+
+        // The last sequence is literals only
+        if (ip == len)
+            break;
+
+        if (len - ip < 2)
+            return LZ4_DATA_ERROR;
+
+        size_t off = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (!off || off > op - base)
+            return LZ4_DATA_ERROR;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && (ret = read_length(src, len, &ip, &mlen)))
+            return ret;
+        mlen += 4;
+
+        if (cap - op < mlen)
+            return LZ4_BUF_ERROR;
+
+        copy_match(dst + op, off, mlen);
+        op += mlen;
+    }
+
+    *pos = op;
+    return LZ4_OK;
+}
+
+static int lz4_legacy(uint8_t *dst, size_t *dest_len, struct lz4_in *in)
+{
+    size_t op = 0;
+    int ret;
+
+    // Blocks are always 8MiB except for the last one, which is how we find the end
+    while (in_avail(in, 4)) {
+        uint32_t size = get_le32(in->src + in->pos);
+
+        if (size == LZ4_LEGACY_MAGIC) {
+            in->pos += 4;
+            continue;
+        }
+        if (!size || size > LZ4_LEGACY_BOUND || !in_avail(in, 4 + size))
+            break;
+
+        in->pos += 4;
+        size_t start = op;
+        if ((ret = lz4_block(dst, start, &op, *dest_len, in->src + in->pos, size)))
+            return ret;
+        in->pos += size;
+
+        if (op - start < LZ4_LEGACY_BLOCK)
+            break;
+    }
+
+    *dest_len = op;
+    return LZ4_OK;
+}
+
+int lz4_decompress(void *dest, size_t *dest_len, const void *src, size_t *src_len)
+{
+    struct lz4_in in = {
+        .src = src,
+        .len = *src_len ? *src_len : SIZE_MAX - (uintptr_t)src,
+        .pos = 0,
+    };
+    uint8_t *dst = dest;
+    size_t op = 0;
+    int ret;
+
+    if (!in_avail(&in, 7))
+        return LZ4_DATA_ERROR;
+
+    uint32_t magic = get_le32(in.src);
+    in.pos += 4;
+
+    if (magic == LZ4_LEGACY_MAGIC) {
+        ret = lz4_legacy(dst, dest_len, &in);
+        *src_len = in.pos;
+        return ret;
+    }
+
+    if (magic != LZ4_MAGIC)
+        return LZ4_DATA_ERROR;
+
+    const uint8_t *desc = in.src + in.pos;
+    uint8_t flg = desc[0];
+    uint8_t bd = desc[1];
+    size_t desc_len = 2;
+
+    if ((flg & FLG_VERSION_MASK) != FLG_VERSION || (flg & FLG_RESERVED) || (bd & BD_RESERVED))
+        return LZ4_DATA_ERROR;
+    if (BD_BLOCK_MAX(bd) < 4)
+        return LZ4_DATA_ERROR;
+    if (flg & FLG_DICT_ID)
+        return LZ4_UNSUPPORTED;
+
+    uint64_t content_size = 0;
+    if (flg & FLG_C_SIZE) {
+        if (!in_avail(&in, desc_len + 8 + 1))
+            return LZ4_DATA_ERROR;
+        content_size = get_le32(desc + 2) | ((uint64_t)get_le32(desc + 6) << 32);
+        desc_len += 8;
+    }
+
+    if (((xxh32(desc, desc_len) >> 8) & 0xff) != desc[desc_len])
+        return LZ4_DATA_ERROR;
+    in.pos += desc_len + 1;
+
+    size_t block_max = 1 << (2 * BD_BLOCK_MAX(bd) + 8);
+
+    while (true) {
+        if (!in_avail(&in, 4))
+            return LZ4_DATA_ERROR;
+
+        uint32_t size = get_le32(in.src + in.pos);
+        in.pos += 4;
+
+        // EndMark
+        if (!size)
+            break;
+
+        bool raw = size & BLOCK_UNCOMPRESSED;
+        size &= ~BLOCK_UNCOMPRESSED;
+
+        if (size > block_max || !in_avail(&in, size))
+            return LZ4_DATA_ERROR;
+
+        const uint8_t *block = in.src + in.pos;
+        if (raw) {
+            if (*dest_len - op < size)
+                return LZ4_BUF_ERROR;
+            memcpy(dst + op, block, size);
+            op += size;
+        } else {
+            size_t base = (flg & FLG_B_INDEP) ? op : 0;
+            if ((ret = lz4_block(dst, base, &op, *dest_len, block, size)))
+                return ret;
+        }
+        in.pos += size;
+
+        // Block checksums are redundant with the content checksum, just skip them
+        if (flg & FLG_B_CHECKSUM) {
+            if (!in_avail(&in, 4))
+                return LZ4_DATA_ERROR;
+            in.pos += 4;
+        }
+    }
+
+    if (flg & FLG_C_CHECKSUM) {
+        if (!in_avail(&in, 4))
+            return LZ4_DATA_ERROR;
+        if (xxh32(dst, op) != get_le32(in.src + in.pos))
+            return LZ4_DATA_ERROR;
+        in.pos += 4;
+    }
+
+    if ((flg & FLG_C_SIZE) && content_size != op)
+        return LZ4_DATA_ERROR;
+
+    *dest_len = op;
+    *src_len = in.pos;
+    return LZ4_OK;
+}
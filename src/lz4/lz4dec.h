@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef LZ4DEC_H
+#define LZ4DEC_H
+
+#include <stddef.h>
+
+#define LZ4_OK          0
+#define LZ4_DATA_ERROR  -1 // corrupt input or checksum mismatch
+#define LZ4_UNSUPPORTED -2 // dictionaries
+#define LZ4_BUF_ERROR   -3 // output does not fit
+
+/*
+ * Decompress one LZ4 frame from src into dest.
+ *
+ * *src_len is the size of the input on entry (0 if unknown, the frame is self-delimiting) and is
+ * set to the number of bytes consumed. *dest_len is the size of dest on entry and is set to the
+ * decompressed size.
+ */
+int lz4_decompress(void *dest, size_t *dest_len, const void *src, size_t *src_len);
+
+#endif
@@ -0,0 +1,209 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "macho.h"
+#include "string.h"
+#include "utils.h"
+
+/*
+ * Loads a Mach-O image (typically a kernelcache) that is already in memory, the same way
+ * MachO.prepare_image() in the proxyclient does: every LC_SEGMENT_64 goes to dest at its offset
+ * from the lowest vmaddr, with the rest of its vmsize zeroed. For filesets the segments of the
+ * LC_FILESET_ENTRY images are placed as well. Their file offsets are relative to the whole fileset
+ * and they have to fall within the top-level segments, which define the image.
+ */
+
+// The arm64 thread state in LC_UNIXTHREAD: flavor, count, x0-x28, fp, lr, sp, then pc
+#define ARM_THREAD_STATE64 6
+#define THREAD_STATE_PC    (8 + 32 * 8)
+
+// The payload segment is not zeroed past its file data, only a 4 byte end marker is left
+#define PYLD_MARKER 4
+
+typedef int(macho_cmd_fn)(const struct load_command *lc, void *arg);
+
+static const struct mach_header_64 *macho_header(const u8 *image, size_t size, u64 off)
+{
+    const struct mach_header_64 *hdr = (const void *)(image + off);
+
+    if (off > size || size - off < sizeof(*hdr) || hdr->magic != MH_MAGIC_64 ||
+        hdr->sizeofcmds > size - off - sizeof(*hdr))
+        return NULL;
+
+    return hdr;
+}
+
+static int macho_for_each_cmd(const u8 *image, size_t size, u64 off, macho_cmd_fn *fn, void *arg)
+{
+    const struct mach_header_64 *hdr = macho_header(image, size, off);
+    if (!hdr)
+        return -1;
+
+    const u8 *cmds = (const u8 *)(hdr + 1);
+    u32 pos = 0;
+
+    for (u32 i = 0; i < hdr->ncmds; i++) {
+        const struct load_command *lc = (const void *)(cmds + pos);
+
+        if (hdr->sizeofcmds - pos < sizeof(*lc) || lc->cmdsize < sizeof(*lc) ||
+            lc->cmdsize > hdr->sizeofcmds - pos)
+            return -1;
+
+        if (fn(lc, arg))
+            return -1;
+
+        pos += lc->cmdsize;
+    }
+
+    return 0;
+}
+
+static const struct segment_command_64 *macho_seg(const struct load_command *lc)
+{
+    if (lc->cmd != LC_SEGMENT_64 || lc->cmdsize < sizeof(struct segment_command_64))
+        return NULL;
+
+    return (const void *)lc;
+}
+
+/* How much of the segment's file data is present, matching what the proxyclient reads */
+static u64 macho_seg_filesize(const struct segment_command_64 *seg, size_t size)
+{
+    if (seg->fileoff >= size)
+        return 0;
+
+    return min(min(seg->filesize, size - seg->fileoff), seg->vmsize);
+}
+
+struct macho_parse_state {
+    size_t size;
+    struct macho_info *info;
+    u64 pyld_skip;
+};
+
+static int macho_parse_cmd(const struct load_command *lc, void *arg)
+{
+    struct macho_parse_state *st = arg;
+    struct macho_info *info = st->info;
+    const struct segment_command_64 *seg = macho_seg(lc);
+
+    if (lc->cmd == LC_UNIXTHREAD && lc->cmdsize >= sizeof(*lc) + THREAD_STATE_PC + 8) {
+        const u8 *state = (const u8 *)(lc + 1);
+        u32 flavor;
+
+        memcpy(&flavor, state, sizeof(flavor));
+        if (flavor == ARM_THREAD_STATE64)
+            memcpy(&info->entry, state + THREAD_STATE_PC, sizeof(info->entry));
+    }
+
+    if (!seg || !seg->vmsize)
+        return 0;
+
+    if (seg->vmaddr + seg->vmsize < seg->vmaddr)
+        return -1;
+
+    info->vmin = min(info->vmin, seg->vmaddr);
+    info->vmax = max(info->vmax, seg->vmaddr + seg->vmsize);
+
+    u64 clear = seg->vmsize - macho_seg_filesize(seg, st->size);
+    if (!strncmp(seg->segname, "PYLD", sizeof(seg->segname)) && clear > PYLD_MARKER)
+        st->pyld_skip += clear - PYLD_MARKER;
+
+    return 0;
+}
+
+int macho_parse(const void *image, size_t size, struct macho_info *info)
+{
+    struct macho_parse_state st = {
+        .size = size,
+        .info = info,
+    };
+
+    info->vmin = (u64)-1;
+    info->vmax = 0;
+    info->entry = 0;
+
+    if (macho_for_each_cmd(image, size, 0, macho_parse_cmd, &st) || info->vmax <= info->vmin)
+        return -1;
+
+    info->size = info->vmax - info->vmin - st.pyld_skip;
+
+    return 0;
+}
+
+struct macho_load_state {
+    const u8 *image;
+    size_t size;
+    u8 *dest;
+    struct macho_info info;
+    bool nested;
+};
+
+static int macho_load_cmd(const struct load_command *lc, void *arg)
+{
+    struct macho_load_state *st = arg;
+    const struct segment_command_64 *seg = macho_seg(lc);
+
+    if (lc->cmd == LC_FILESET_ENTRY && !st->nested) {
+        const struct fileset_entry_command *fe = (const void *)lc;
+
+        if (lc->cmdsize < sizeof(*fe))
+            return -1;
+
+        st->nested = true;
+        int ret = macho_for_each_cmd(st->image, st->size, fe->fileoff, macho_load_cmd, st);
+        st->nested = false;
+
+        if (ret)
+            printf("MachO: bad fileset entry at 0x%lx\n", fe->fileoff);
+        return ret;
+    }
+
+    if (!seg || !seg->vmsize)
+        return 0;
+
+    if (seg->vmaddr < st->info.vmin || seg->vmaddr + seg->vmsize > st->info.vmax ||
+        seg->vmaddr + seg->vmsize < seg->vmaddr) {
+        printf("MachO: segment %.16s at 0x%lx is outside the image\n", seg->segname, seg->vmaddr);
+        return -1;
+    }
+
+    // A payload segment is cut short, past that nothing may be written
+    u64 off = seg->vmaddr - st->info.vmin;
+    u64 filesize = macho_seg_filesize(seg, st->size);
+    u64 end = min(off + seg->vmsize, st->info.size);
+
+    filesize = min(filesize, end - min(off, end));
+    memcpy(st->dest + off, st->image + seg->fileoff, filesize);
+    if (off + filesize < end)
+        memset(st->dest + off + filesize, 0, end - off - filesize);
+
+    return 0;
+}
+
+/*
+ * Returns the number of bytes filled in at dest (info.size from macho_parse()), or -1 if the image
+ * is malformed or does not fit. dest must not overlap the image.
+ */
+s64 macho_load(const void *image, size_t size, void *dest, size_t dest_size)
+{
+    struct macho_load_state st = {
+        .image = image,
+        .size = size,
+        .dest = dest,
+    };
+
+    if (macho_parse(image, size, &st.info)) {
+        printf("MachO: invalid image at %p\n", image);
+        return -1;
+    }
+
+    if (st.info.size > dest_size) {
+        printf("MachO: image needs 0x%lx bytes, only 0x%lx available\n", st.info.size, dest_size);
+        return -1;
+    }
+
+    if (macho_for_each_cmd(image, size, 0, macho_load_cmd, &st))
+        return -1;
+
+    return st.info.size;
+}
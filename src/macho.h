@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef MACHO_H
+#define MACHO_H
+
+#include "types.h"
+
+#define MH_MAGIC_64 0xfeedfacf
+#define MH_FILESET  0xc
+
+#define LC_UNIXTHREAD    0x5
+#define LC_SEGMENT_64    0x19
+#define LC_FILESET_ENTRY 0x80000035
+
+struct mach_header_64 {
+    u32 magic;
+    u32 cputype;
+    u32 cpusubtype;
+    u32 filetype;
+    u32 ncmds;
+    u32 sizeofcmds;
+    u32 flags;
+    u32 reserved;
+};
+
+struct load_command {
+    u32 cmd;
+    u32 cmdsize;
+};
+
+struct segment_command_64 {
+    u32 cmd;
+    u32 cmdsize;
+    char segname[16];
+    u64 vmaddr;
+    u64 vmsize;
+    u64 fileoff;
+    u64 filesize;
+    u32 maxprot;
+    u32 initprot;
+    u32 nsects;
+    u32 flags;
+};
+
+struct fileset_entry_command {
+    u32 cmd;
+    u32 cmdsize;
+    u64 vmaddr;
+    u64 fileoff;
+    u32 entry_id; // offset of the name from the start of the command
+    u32 reserved;
+};
+
+struct macho_info {
+    u64 vmin;
+    u64 vmax;
+    u64 entry; // pc from LC_UNIXTHREAD, 0 if there is none
+    u64 size;  // bytes macho_load() fills in at dest
+};
+
+int macho_parse(const void *image, size_t size, struct macho_info *info);
+s64 macho_load(const void *image, size_t size, void *dest, size_t dest_size);
+
+#endif
@@ -7,6 +7,7 @@
 
 #include "adt.h"
 #include "aic.h"
+#include "bootprof.h"
 #include "clk.h"
 #include "cpufreq.h"
 #include "display.h"
@@ -21,6 +22,7 @@
 #include "payload.h"
 #include "pcie.h"
 #include "pmgr.h"
+#include "rtkit.h"
 #include "sep.h"
 #include "smp.h"
 #include "string.h"
@@ -93,7 +95,8 @@ void run_actions(void)
 
                 usb_iodev_vuart_setup(iodev);
                 iodev_handle_events(iodev);
-                if (iodev_can_write(iodev) || iodev_can_write(IODEV_USB_VUART)) {
+                if (iodev_can_write(iodev) || iodev_can_write(IODEV_USB_VUART) ||
+                    iodev_can_write(IODEV_USB_BULK0 + j)) {
                     printf(" Connected!\n");
                     uartproxy_run(NULL);
                     return;
@@ -132,8 +135,40 @@ void run_actions(void)
     uartproxy_run(NULL);
 }
 
+/*
+ * Start the RTKit coprocessors we are going to need and service all their mailboxes from one loop
+ * until they are up, instead of waiting on each firmware handshake in turn. The drivers pick the
+ * booted instances up when they get initialized later.
+ */
+static void boot_coprocessors(void)
+{
+    rtkit_dev_t *rtks[2];
+    int count = 0;
+
+#ifdef USE_FB
+    rtks[count] = display_start_early();
+    if (rtks[count])
+        count++;
+#endif
+#ifdef CHAINLOADING
+    rtks[count] = nvme_start();
+    if (rtks[count])
+        count++;
+#endif
+
+    if (!count)
+        return;
+
+    u64 start = get_ticks();
+    if (!rtkit_boot_all(rtks, count))
+        printf("Some coprocessors failed to boot\n");
+    printf("Booted %d coprocessors in %ld ms\n", count, ticks_to_msecs(get_ticks() - start));
+}
+
 void m1n1_main(void)
 {
+    bootprof_mark(BOOTPROF_MAIN);
+
     printf("\n\nm1n1 %s\n", m1n1_version);
     printf("Copyright The Asahi Linux Contributors\n");
     printf("Licensed under the MIT license\n\n");
@@ -144,20 +179,31 @@ void m1n1_main(void)
     firmware_init();
 
     heapblock_init();
+    adt_index_init(adt);
 
 #ifndef BRINGUP
     gxf_init();
     mcc_init();
     mmu_init();
+    bootprof_mark(BOOTPROF_MMU);
     aic_init();
 #endif
     wdt_disable();
 #ifndef BRINGUP
     pmgr_init();
+    // As early as possible, the boot CPU's frequency sets how long everything after this takes
+    cpufreq_init();
     tunables_apply_static();
+#ifndef CHAINLOADING
+    // Chainloading needs the secondaries left alone for the next stage
+    usb_init_async();
+#endif
+    boot_coprocessors();
+    bootprof_mark(BOOTPROF_COPROC);
 
 #ifdef USE_FB
     display_init();
+    bootprof_mark(BOOTPROF_DISPLAY);
     // Kick DCP to sleep, so dodgy monitors which cause reconnect cycles don't cause us to lose the
     // framebuffer.
     display_shutdown(DCP_SLEEP_IF_EXTERNAL);
@@ -171,11 +217,11 @@ void m1n1_main(void)
 #endif
 
     clk_init();
-    cpufreq_init();
     sep_init();
 #endif
 
     printf("Initialization complete.\n");
+    bootprof_mark(BOOTPROF_INIT);
 
     run_actions();
 
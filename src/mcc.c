@@ -79,6 +79,8 @@ struct mcc_regs {
     int cache_ways;
     u32 cache_status_mask;
     u32 cache_status_val;
+    u32 cache_status_data;
+    u32 cache_status_tag;
 };
 
 static int mcc_count;
@@ -116,6 +118,90 @@ static void mcc_enable_cache(void)
     }
 }
 
+int mcc_get_cache_state(struct mcc_plane_state *out, int max)
+{
+    int count = 0;
+
+    if (!mcc_initialized)
+        return -1;
+
+    for (int mcc = 0; mcc < mcc_count; mcc++) {
+        struct mcc_regs *r = &mcc_regs[mcc];
+        for (int plane = 0; plane < r->plane_count && count < max; plane++) {
+            u32 status = plane_read32(mcc, plane, PLANE_CACHE_STATUS);
+            out[count++] = (struct mcc_plane_state){
+                .mcc = mcc,
+                .plane = plane,
+                .cache_enable = plane_read32(mcc, plane, PLANE_CACHE_ENABLE),
+                .cache_status = status,
+                .data_ways = FIELD_GET(r->cache_status_data, status),
+                .tag_ways = FIELD_GET(r->cache_status_tag, status),
+                .max_ways = r->cache_ways,
+            };
+        }
+    }
+
+    return count;
+}
+
+static int mcc_set_plane_ways(int mcc, int plane, int ways)
+{
+    struct mcc_regs *r = &mcc_regs[mcc];
+    u32 target = FIELD_PREP(r->cache_status_data, ways) | FIELD_PREP(r->cache_status_tag, ways);
+
+    plane_write32(mcc, plane, PLANE_CACHE_ENABLE, ways);
+    if (plane_poll32(mcc, plane, PLANE_CACHE_STATUS, r->cache_status_mask, target,
+                     CACHE_ENABLE_TIMEOUT)) {
+        printf("MCC: timeout while setting %d ways for MCC %d plane %d: 0x%x\n", ways, mcc, plane,
+               plane_read32(mcc, plane, PLANE_CACHE_STATUS));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Set how many SLC ways a plane may use, 0 turning its share of the cache off. mcc and plane
+ * may be -1 for all of them. Returns -1 on bad arguments or if any plane didn't follow.
+ */
+int mcc_set_cache_ways(int mcc, int plane, int ways)
+{
+    int ret = 0;
+
+    if (!mcc_initialized || mcc >= mcc_count || mcc < -1 || plane < -1)
+        return -1;
+
+    for (int m = 0; m < mcc_count; m++) {
+        if (mcc != -1 && m != mcc)
+            continue;
+        if (ways < 0 || ways > mcc_regs[m].cache_ways || plane >= mcc_regs[m].plane_count)
+            return -1;
+        for (int p = 0; p < mcc_regs[m].plane_count; p++) {
+            if (plane != -1 && p != plane)
+                continue;
+            if (mcc_set_plane_ways(m, p, ways))
+                ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/* Raw plane register access, for poking at the (undocumented) performance counters */
+int mcc_plane_rw32(int mcc, int plane, u64 offset, u32 *val, bool write)
+{
+    if (!mcc_initialized || mcc < 0 || mcc >= mcc_count || plane < 0 ||
+        plane >= mcc_regs[mcc].plane_count || offset >= mcc_regs[mcc].plane_stride || (offset & 3))
+        return -1;
+
+    if (write)
+        plane_write32(mcc, plane, offset, *val);
+    else
+        *val = plane_read32(mcc, plane, offset);
+
+    return 0;
+}
+
 int mcc_unmap_carveouts(void)
 {
     if (!mcc_initialized)
@@ -145,6 +231,7 @@ int mcc_unmap_carveouts(void)
             mmu_rm_mapping(start | REGION_RWX_EL0, end - start);
             mmu_rm_mapping(start | REGION_RW_EL0, end - start);
             mmu_rm_mapping(start | REGION_RX_EL1, end - start);
+            mmu_rm_mapping(start | REGION_NC_EL1, end - start);
             mcc_carveouts[mcc_carveout_count].base = start;
             mcc_carveouts[mcc_carveout_count].size = end - start;
             mcc_carveout_count++;
@@ -188,6 +275,8 @@ int mcc_init_t8103(int node, int *path)
     mcc_regs[0].cache_ways = T8103_CACHE_WAYS;
     mcc_regs[0].cache_status_mask = T8103_CACHE_STATUS_MASK;
     mcc_regs[0].cache_status_val = T8103_CACHE_STATUS_VAL;
+    mcc_regs[0].cache_status_data = T8103_CACHE_STATUS_DATA_COUNT;
+    mcc_regs[0].cache_status_tag = T8103_CACHE_STATUS_TAG_COUNT;
 
     mcc_enable_cache();
 
@@ -236,6 +325,8 @@ int mcc_init_t6000(int node, int *path)
         mcc_regs[i].cache_ways = T6000_CACHE_WAYS;
         mcc_regs[i].cache_status_mask = T6000_CACHE_STATUS_MASK;
         mcc_regs[i].cache_status_val = T6000_CACHE_STATUS_VAL;
+        mcc_regs[i].cache_status_data = T6000_CACHE_STATUS_DATA_COUNT;
+        mcc_regs[i].cache_status_tag = T6000_CACHE_STATUS_TAG_COUNT;
     }
 
     mcc_enable_cache();
@@ -10,10 +10,24 @@ struct mcc_carveout {
     u64 size;
 };
 
+struct mcc_plane_state {
+    u32 mcc;
+    u32 plane;
+    u32 cache_enable;
+    u32 cache_status;
+    u32 data_ways;
+    u32 tag_ways;
+    u32 max_ways;
+    u32 reserved;
+};
+
 extern size_t mcc_carveout_count;
 extern struct mcc_carveout mcc_carveouts[];
 
 int mcc_init(void);
 int mcc_unmap_carveouts(void);
+int mcc_get_cache_state(struct mcc_plane_state *out, int max);
+int mcc_set_cache_ways(int mcc, int plane, int ways);
+int mcc_plane_rw32(int mcc, int plane, u64 offset, u32 *val, bool write);
 
 #endif
@@ -1,15 +1,19 @@
 /* SPDX-License-Identifier: MIT */
 
+#include "../build/build_cfg.h"
+
 #include "memory.h"
 #include "adt.h"
 #include "assert.h"
 #include "cpu_regs.h"
+#include "exception.h"
 #include "fb.h"
 #include "gxf.h"
 #include "malloc.h"
 #include "mcc.h"
 #include "smp.h"
 #include "string.h"
+#include "task.h"
 #include "utils.h"
 #include "xnuboot.h"
 
@@ -34,6 +38,404 @@ CACHE_RANGE_OP(dc_cvac_range, "dc cvac")
 CACHE_RANGE_OP(dc_cvau_range, "dc cvau")
 CACHE_RANGE_OP(dc_civac_range, "dc civac")
 
+/*
+ * Cache maintenance for ranges big and small. By VA the cost grows with the range, by set/way it
+ * is fixed at roughly the size of the caches but has to run on every CPU, since each one only
+ * reaches its own L1 and its cluster's L2. So: one CPU by VA for small ranges, all idle CPUs
+ * each taking a slice by VA (which is broadcast) for bigger ones, and set/way on every CPU
+ * once the range dwarfs the caches. Set/way is only safe if no CPU is busy with something else,
+ * and the secondaries address RAM by PA, so the parallel paths need an identity mapped range.
+ */
+#define DC_PARALLEL_MIN (8 * SZ_1M)
+#define DC_SETWAY_MIN   (256 * SZ_1M)
+
+static u64 mmu_nc_alias_size;
+
+static u64 dc_range_secondary(u64 clean_only, u64 start, u64 size)
+{
+    if (clean_only)
+        dc_cvac_range((void *)start, size);
+    else
+        dc_civac_range((void *)start, size);
+    sysop("dsb sy");
+    return 0;
+}
+
+static u64 dc_setway_secondary(u64 clean_only)
+{
+    dcsw_op_all(clean_only ? DCSW_OP_DCCSW : DCSW_OP_DCCISW);
+    return 0;
+}
+
+static void dc_range_auto(bool clean_only, void *addr, size_t size)
+{
+    u64 start = ALIGN_DOWN((u64)addr, CACHE_LINE_SIZE);
+    u64 end = ALIGN_UP((u64)addr + size, CACHE_LINE_SIZE);
+    u64 cpus = 0;
+    bool busy = false;
+
+    if (size >= DC_PARALLEL_MIN && smp_id() == 0 && start >= ram_base &&
+        end <= ram_base + mmu_nc_alias_size) {
+        for (int cpu = 1; cpu < MAX_CPUS; cpu++) {
+            if (!smp_is_alive(cpu))
+                continue;
+            if (smp_is_busy(cpu))
+                busy = true;
+            else
+                cpus |= BIT(cpu);
+        }
+    }
+
+    if (!cpus) {
+        dc_range_secondary(clean_only, start, end - start);
+        return;
+    }
+
+    if (size >= DC_SETWAY_MIN && !busy) {
+        for (int cpu = 1; cpu < MAX_CPUS; cpu++)
+            if (cpus & BIT(cpu))
+                smp_call1(cpu, dc_setway_secondary, clean_only);
+        dc_setway_secondary(clean_only);
+    } else {
+        u64 slice = ALIGN_UP((end - start) / (__builtin_popcountl(cpus) + 1), CACHE_LINE_SIZE);
+        u64 p = start;
+
+        for (int cpu = 1; cpu < MAX_CPUS && p < end; cpu++) {
+            if (!(cpus & BIT(cpu)))
+                continue;
+
+            smp_call3(cpu, dc_range_secondary, clean_only, p, min(slice, end - p));
+            p += min(slice, end - p);
+        }
+        if (p < end)
+            dc_range_secondary(clean_only, p, end - p);
+    }
+
+    for (int cpu = 1; cpu < MAX_CPUS; cpu++)
+        if (cpus & BIT(cpu))
+            smp_wait(cpu);
+}
+
+// Clean [addr, addr + size) to the PoC, picking the cheapest way for the size
+void dc_cvac_range_auto(void *addr, size_t size)
+{
+    dc_range_auto(true, addr, size);
+}
+
+// Clean and invalidate [addr, addr + size), picking the cheapest way for the size
+void dc_civac_range_auto(void *addr, size_t size)
+{
+    dc_range_auto(false, addr, size);
+}
+
+// Chunks need to be big enough to amortize the scheduling, but plentiful enough to balance
+#define MEMSET_PARALLEL_MIN_GRAIN SZ_1M
+#define MEMSET_PARALLEL_CHUNKS    (4 * MAX_CPUS)
+
+struct memcpy_bulk_args {
+    u8 *dst;
+    const u8 *src;
+    u64 dst_alias; // added to dst for the writes
+    u32 flags;
+};
+
+static void memset64_chunk(u64 value, u64 start, u64 end)
+{
+    // Zeroing goes through memset, which uses DC ZVA for big aligned spans
+    if (!value)
+        memset((void *)start, 0, end - start);
+    else
+        memfill64((void *)start, value, end - start);
+}
+
+/*
+ * Fill a large range of normal memory with a 64-bit pattern, using all CPUs. dst and size must
+ * be 8-byte aligned. Returns once every chunk is done.
+ */
+void memset64_parallel(void *dst, u64 value, size_t size)
+{
+    u64 grain = ALIGN_UP(size / MEMSET_PARALLEL_CHUNKS, SZ_16K);
+
+    if (grain < MEMSET_PARALLEL_MIN_GRAIN)
+        grain = MEMSET_PARALLEL_MIN_GRAIN;
+
+    task_parallel_for(memset64_chunk, value, (u64)dst, (u64)dst + size, grain);
+}
+
+static void memcpy_bulk_chunk(u64 args_ptr, u64 start, u64 end)
+{
+    struct memcpy_bulk_args *args = (struct memcpy_bulk_args *)args_ptr;
+    u8 *dst = args->dst + start;
+    const u8 *src = args->src + start;
+    size_t size = end - start;
+
+    // Cache maintenance by VA is broadcast, so each CPU can take care of its own chunk
+    if (args->flags & MEMCPY_INVAL_SRC) {
+        dc_ivac_range((void *)ALIGN_DOWN((u64)src, CACHE_LINE_SIZE),
+                      size + ((u64)src & (CACHE_LINE_SIZE - 1)));
+        sysop("dsb sy");
+    }
+
+    // Nothing dirty may be left in the caches to be written back over what goes through the alias
+    if (args->dst_alias) {
+        dc_civac_range((void *)ALIGN_DOWN((u64)dst, CACHE_LINE_SIZE),
+                       size + ((u64)dst & (CACHE_LINE_SIZE - 1)));
+        sysop("dsb sy");
+    }
+
+    memcpy(dst + args->dst_alias, src, size);
+
+    if (args->dst_alias)
+        sysop("dsb sy");
+
+    if (args->flags & MEMCPY_CLEAN_DST) {
+        dc_cvac_range((void *)ALIGN_DOWN((u64)dst, CACHE_LINE_SIZE),
+                      size + ((u64)dst & (CACHE_LINE_SIZE - 1)));
+        sysop("dsb sy");
+    }
+}
+
+/*
+ * Copy a large buffer using all CPUs, optionally doing the cache maintenance for handing
+ * buffers to and from coprocessors in the same pass. MEMCPY_NC_DST writes straight to memory
+ * through the write-combining alias, which needs no clean afterwards and falls back to
+ * MEMCPY_CLEAN_DST when dst isn't covered by it. The destination then has to be invalidated
+ * before the CPU reads it back through a cached mapping.
+ */
+void memcpy_bulk(void *dst, const void *src, size_t size, u32 flags)
+{
+    struct memcpy_bulk_args args = {
+        .dst = dst,
+        .src = src,
+        .flags = flags & ~MEMCPY_NC_DST,
+    };
+
+    if (flags & MEMCPY_NC_DST) {
+        void *nc = mmu_nc_alias(dst, size);
+        if (nc)
+            args.dst_alias = (u64)nc - (u64)dst;
+        else
+            args.flags |= MEMCPY_CLEAN_DST;
+    }
+
+    u64 grain = ALIGN_UP(size / MEMSET_PARALLEL_CHUNKS, SZ_16K);
+
+    if (grain < MEMSET_PARALLEL_MIN_GRAIN)
+        grain = MEMSET_PARALLEL_MIN_GRAIN;
+
+    task_parallel_for(memcpy_bulk_chunk, (u64)&args, 0, size, grain);
+}
+
+struct memhash_args {
+    const u8 *src;
+    size_t size;
+    size_t block_size;
+    u64 *out;
+};
+
+static u64 memhash_block(const u8 *p, size_t len)
+{
+    const u64 *q = (const u64 *)p;
+    size_t words = len / 8;
+    u32 fwd = ~0, rev = ~0;
+
+    for (size_t i = 0; i < words; i++) {
+        __asm__("crc32cx %w0, %w0, %x1" : "+r"(fwd) : "r"(q[i]));
+        __asm__("crc32cx %w0, %w0, %x1" : "+r"(rev) : "r"(q[words - 1 - i]));
+    }
+
+    for (p += words * 8, len &= 7; len; p++, len--) {
+        __asm__("crc32cb %w0, %w0, %w1" : "+r"(fwd) : "r"(*p));
+        __asm__("crc32cb %w0, %w0, %w1" : "+r"(rev) : "r"(*p));
+    }
+
+    return ((u64)~rev << 32) | (u32)~fwd;
+}
+
+static void memhash_chunk(u64 args_ptr, u64 start, u64 end)
+{
+    struct memhash_args *args = (struct memhash_args *)args_ptr;
+
+    for (u64 i = start; i < end; i++) {
+        size_t off = i * args->block_size;
+        args->out[i] = memhash_block(args->src + off, min(args->block_size, args->size - off));
+    }
+}
+
+/*
+ * Fingerprint each block_size block of normal memory at src into out, using all CPUs, so a host
+ * can tell which blocks of a buffer it needs to resend. The low half of each hash is the CRC32C
+ * of the block, the high half the CRC32C of its 64-bit words in reverse order, with any trailing
+ * bytes hashed last. src and block_size must be 8-byte aligned. Returns the number of blocks.
+ */
+size_t memhash(const void *src, size_t size, size_t block_size, u64 *out)
+{
+    struct memhash_args args = {
+        .src = src,
+        .size = size,
+        .block_size = block_size,
+        .out = out,
+    };
+
+    if (!block_size || (block_size & 7) || ((u64)src & 7))
+        return 0;
+
+    size_t blocks = (size + block_size - 1) / block_size;
+    u64 grain = max(MEMSET_PARALLEL_MIN_GRAIN / block_size, 1);
+
+    task_parallel_for(memhash_chunk, (u64)&args, 0, blocks, grain);
+    return blocks;
+}
+
+#define MEMHASH_RANGE_BLOCK SZ_1M
+#define MEMHASH_RANGE_STACK 16
+
+/*
+ * One 64-bit hash of size bytes at src: memhash() over 1M blocks, then the same hash over the
+ * block hashes followed by size. src must be 8-byte aligned. Returns 0 if it isn't, or if there
+ * is no memory for the block hashes of a very large range.
+ */
+u64 memhash_range(const void *src, size_t size)
+{
+    u64 stack[MEMHASH_RANGE_STACK + 1];
+    size_t blocks = (size + MEMHASH_RANGE_BLOCK - 1) / MEMHASH_RANGE_BLOCK;
+    u64 *hashes = stack;
+
+    if ((u64)src & 7)
+        return 0;
+
+    if (blocks > MEMHASH_RANGE_STACK) {
+        hashes = malloc((blocks + 1) * sizeof(u64));
+        if (!hashes)
+            return 0;
+    }
+
+    memhash(src, size, MEMHASH_RANGE_BLOCK, hashes);
+    hashes[blocks] = size;
+    u64 hash = memhash_block((const u8 *)hashes, (blocks + 1) * sizeof(u64));
+
+    if (hashes != stack)
+        free(hashes);
+
+    return hash;
+}
+
+/*
+ * Compare size bytes at src against a shadow copy with 32-bit reads, so it is safe on MMIO as well
+ * as shared memory, and bring the shadow up to date. The first max changed words are reported in
+ * out; the return value counts all of them, and callers seeing more than max can fetch the shadow.
+ */
+size_t memdiff32(const void *src, void *shadow, size_t size, struct memdiff_entry *out, size_t max)
+{
+    const volatile u32 *s = src;
+    u32 *sh = shadow;
+    size_t changed = 0;
+
+    for (size_t i = 0; i < size / 4; i++) {
+        u32 v = s[i];
+
+        if (v == sh[i])
+            continue;
+
+        sh[i] = v;
+        if (changed < max) {
+            out[changed].offset = i * 4;
+            out[changed].value = v;
+        }
+        changed++;
+    }
+
+    return changed;
+}
+
+#define MEMWATCH_SPIN_US      20
+#define MEMWATCH_MAX_DELAY_US 100
+
+/*
+ * Wait until any of the watched 32-bit words no longer matches its expected value, or until the
+ * timeout passes, and return how many fired (0 on timeout). This replaces polling loops over the
+ * link for things like ring pointers and mailbox status. It spins for a short while and then
+ * backs off, there is no event to wait on for writes from coprocessors.
+ */
+size_t memwatch32(struct memwatch_entry *watch, size_t count, u32 timeout_us)
+{
+    u64 timeout = timeout_calculate(timeout_us);
+    u64 spin = timeout_calculate(MEMWATCH_SPIN_US);
+    u32 delay = 1;
+
+    while (true) {
+        size_t fired = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            struct memwatch_entry *w = &watch[i];
+
+            w->current = read32(w->addr);
+            w->fired = (w->current & w->mask) != w->value;
+            fired += w->fired;
+        }
+
+        if (fired || timeout_expired(timeout))
+            return fired;
+
+        if (timeout_expired(spin)) {
+            udelay(delay);
+            delay = min(delay * 2, MEMWATCH_MAX_DELAY_US);
+        }
+    }
+}
+
+/*
+ * Read count addresses starting at addr, stride bytes apart, with accesses of width bytes, and
+ * record which ones did not fault in bitmap (bit i of byte i / 8). If values is not NULL, the data
+ * read is stored there packed at the access width, 0 for addresses that faulted. Returns the number
+ * of readable addresses. Must be called under GUARD_SKIP: faults are detected through exc_count,
+ * and the barriers after each access make sure SErrors are taken before moving on.
+ */
+size_t memprobe(u64 addr, size_t count, u64 stride, u32 width, u8 *bitmap, void *values)
+{
+    size_t hits = 0;
+
+    if (width != 1 && width != 2 && width != 4 && width != 8)
+        return 0;
+
+    for (size_t i = 0; i < count; i++) {
+        u64 p = addr + i * stride;
+        int exc_start = exc_count;
+        u64 val = 0;
+
+        switch (width) {
+            case 1:
+                val = read8(p);
+                break;
+            case 2:
+                val = read16(p);
+                break;
+            case 4:
+                val = read32(p);
+                break;
+            case 8:
+                val = read64(p);
+                break;
+        }
+        sysop("dsb sy");
+        sysop("isb");
+
+        bool ok = exc_count == exc_start;
+        if (ok) {
+            bitmap[i / 8] |= BIT(i % 8);
+            hits++;
+        } else {
+            bitmap[i / 8] &= ~BIT(i % 8);
+            val = 0;
+        }
+
+        if (values)
+            memcpy((u8 *)values + i * width, &val, width);
+    }
+
+    return hits;
+}
+
 extern u8 _stack_top[];
 
 uint64_t ram_base = 0;
@@ -253,42 +655,77 @@ static void mmu_pt_map_l3(u64 from, u64 to, u64 size)
     }
 }
 
+/*
+ * CPU CTRR doesn't like L2 mappings crossing CTRR boundaries! By default everything below the
+ * m1n1 base is mapped as L3. With MMU_MAX_BLOCKS only the 32MB windows the m1n1 image starts and
+ * ends in are, which assumes the CTRR region is just m1n1's text and rodata.
+ */
+static bool mmu_force_l3(u64 window)
+{
+#ifdef MMU_MAX_BLOCKS
+    return window == ALIGN_DOWN((u64)_base, BIT(VADDR_L2_OFFSET_BITS)) ||
+           window == ALIGN_DOWN((u64)_rodata_end - 1, BIT(VADDR_L2_OFFSET_BITS));
+#else
+    return window >= ram_base && window < (u64)_base;
+#endif
+}
+
+/*
+ * Every 32MB window that the range fully covers gets a single L2 block, as long as the target is
+ * aligned the same way. That includes unmapping, so punching holes for carveouts only splits the
+ * windows at the edges of each hole.
+ */
 int mmu_map(u64 from, u64 to, u64 size)
 {
-    u64 chunk;
     if (from & MASK(VADDR_L3_OFFSET_BITS) || size & MASK(VADDR_L3_OFFSET_BITS))
         return -1;
 
-    // L3 mappings to boundary
-    u64 boundary = ALIGN_UP(from, MASK(VADDR_L2_OFFSET_BITS));
-    // CPU CTRR doesn't like L2 mappings crossing CTRR boundaries!
-    // Map everything below the m1n1 base as L3
-    if (boundary >= ram_base && boundary < (u64)_base)
-        boundary = ALIGN_UP((u64)_base, MASK(VADDR_L2_OFFSET_BITS));
+    while (size) {
+        u64 window = ALIGN_DOWN(from, BIT(VADDR_L2_OFFSET_BITS));
+        u64 chunk = min(size, window + BIT(VADDR_L2_OFFSET_BITS) - from);
 
-    chunk = min(size, boundary - from);
-    if (chunk) {
-        mmu_pt_map_l3(from, to, chunk);
-        from += chunk;
-        to += chunk;
-        size -= chunk;
-    }
+        if (chunk == BIT(VADDR_L2_OFFSET_BITS) && (to & VADDR_L2_ALIGN_MASK) == 0 &&
+            !mmu_force_l3(window))
+            mmu_pt_map_l2(from, to, chunk);
+        else
+            mmu_pt_map_l3(from, to, chunk);
 
-    // L2 mappings
-    chunk = ALIGN_DOWN(size, MASK(VADDR_L2_OFFSET_BITS));
-    if (chunk && (to & VADDR_L2_ALIGN_MASK) == 0) {
-        mmu_pt_map_l2(from, to, chunk);
         from += chunk;
         to += chunk;
         size -= chunk;
     }
 
-    // L3 mappings to end
-    if (size) {
-        mmu_pt_map_l3(from, to, size);
+    return 0;
+}
+
+/* Counts the valid mappings at each level, to check how much of the map uses blocks */
+int mmu_get_stats(struct mmu_stats *out, size_t size)
+{
+    struct mmu_stats stats = {0};
+
+    if (size < sizeof(stats) || !mmu_pt_L1)
+        return -1;
+
+    for (u64 i = 0; i < ENTRIES_PER_L1_TABLE; i++) {
+        if (!L1_IS_TABLE(mmu_pt_L1[i]))
+            continue;
+
+        u64 *l2 = (u64 *)(mmu_pt_L1[i] & PTE_TARGET_MASK);
+        for (u64 j = 0; j < ENTRIES_PER_L2_TABLE; j++) {
+            if (L2_IS_BLOCK(l2[j])) {
+                stats.l2_blocks++;
+            } else if (L2_IS_TABLE(l2[j])) {
+                u64 *l3 = (u64 *)(l2[j] & PTE_TARGET_MASK);
+                stats.l3_tables++;
+                for (u64 k = 0; k < ENTRIES_PER_L3_TABLE; k++)
+                    if (L3_IS_BLOCK(l3[k]))
+                        stats.l3_pages++;
+            }
+        }
     }
 
-    return 0;
+    memcpy(out, &stats, sizeof(stats));
+    return sizeof(stats);
 }
 
 static u64 mmu_make_table_pte(u64 *addr)
@@ -388,10 +825,26 @@ static void mmu_remap_ranges(void)
     }
 }
 
+/*
+ * Returns the Normal-NC (write-combining) alias of [addr, addr + size), or NULL if the range isn't
+ * covered by it. The same memory stays cacheable through its other mappings, so before writing
+ * through the alias the range must be cleaned and invalidated (nothing dirty may be written back
+ * over it later), and after it has to be invalidated before it's read through a cached mapping.
+ */
+void *mmu_nc_alias(void *addr, size_t size)
+{
+    u64 start = (u64)addr;
+
+    if (!mmu_active() || start < ram_base || start + size > ram_base + mmu_nc_alias_size)
+        return NULL;
+
+    return (void *)(start | REGION_NC_EL1);
+}
+
 void mmu_map_framebuffer(u64 addr, size_t size)
 {
     printf("MMU: Adding Normal-NC mapping at 0x%lx (0x%zx) for framebuffer\n", addr, size);
-    dc_civac_range((void *)addr, size);
+    dc_civac_range_auto((void *)addr, size);
     mmu_add_mapping(addr, addr, size, MAIR_IDX_NORMAL_NC, PERM_RW_EL0);
 }
 
@@ -413,6 +866,14 @@ static void mmu_add_default_mappings(void)
      */
     mmu_add_mapping(ram_base, ram_base, cur_boot_args.mem_size_actual, MAIR_IDX_NORMAL, PERM_RWX);
 
+    /*
+     * Create a Normal-NC (write-combining) mapping of the same range from 0xe0_0000_0000,
+     * read/writable by EL1, for framebuffer and DMA buffer writes. See mmu_nc_alias().
+     */
+    mmu_add_mapping(ram_base | REGION_NC_EL1, ram_base, cur_boot_args.mem_size_actual,
+                    MAIR_IDX_NORMAL_NC, PERM_RW);
+    mmu_nc_alias_size = cur_boot_args.mem_size_actual;
+
     /* Unmap carveout regions */
     mcc_unmap_carveouts();
 
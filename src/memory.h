@@ -9,6 +9,7 @@
 #define REGION_RWX_EL0 0x80000000000
 #define REGION_RW_EL0  0xa0000000000
 #define REGION_RX_EL1  0xc0000000000
+#define REGION_NC_EL1  0xe0000000000
 
 /*
  * https://armv8-ref.codingbelief.com/en/chapter_d4/d43_2_armv8_translation_table_level_3_descriptor_formats.html
@@ -63,6 +64,38 @@ void dc_cvac_range(void *addr, size_t length);
 void dc_cvau_range(void *addr, size_t length);
 void dc_civac_range(void *addr, size_t length);
 
+void dc_cvac_range_auto(void *addr, size_t size);
+void dc_civac_range_auto(void *addr, size_t size);
+
+void memset64_parallel(void *dst, u64 value, size_t size);
+
+#define MEMCPY_INVAL_SRC BIT(0) // invalidate the source from the caches before copying
+#define MEMCPY_CLEAN_DST BIT(1) // clean the destination to PoC after copying
+#define MEMCPY_NC_DST    BIT(2) // write the destination through the Normal-NC alias
+
+void memcpy_bulk(void *dst, const void *src, size_t size, u32 flags);
+
+struct memdiff_entry {
+    u32 offset;
+    u32 value;
+};
+
+size_t memdiff32(const void *src, void *shadow, size_t size, struct memdiff_entry *out, size_t max);
+size_t memhash(const void *src, size_t size, size_t block_size, u64 *out);
+u64 memhash_range(const void *src, size_t size);
+
+struct memwatch_entry {
+    u64 addr;
+    u32 mask;
+    u32 value;   // wait for (*addr & mask) != value
+    u32 current; // written back: the last word read
+    u32 fired;   // written back: whether the condition held
+};
+
+size_t memwatch32(struct memwatch_entry *watch, size_t count, u32 timeout_us);
+
+size_t memprobe(u64 addr, size_t count, u64 stride, u32 width, u8 *bitmap, void *values);
+
 #define DCSW_OP_DCISW  0x0
 #define DCSW_OP_DCCISW 0x1
 #define DCSW_OP_DCCSW  0x2
@@ -74,6 +107,15 @@ void mmu_shutdown(void);
 void mmu_add_mapping(u64 from, u64 to, size_t size, u8 attribute_index, u64 perms);
 void mmu_rm_mapping(u64 from, size_t size);
 void mmu_map_framebuffer(u64 addr, size_t size);
+void *mmu_nc_alias(void *addr, size_t size);
+
+struct mmu_stats {
+    u64 l2_blocks; // 32MB blocks
+    u64 l3_tables;
+    u64 l3_pages; // 16KB pages
+};
+
+int mmu_get_stats(struct mmu_stats *out, size_t size);
 
 u64 mmu_disable(void);
 void mmu_restore(u64 state);
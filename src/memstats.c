@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: MIT */
+
+#include <malloc.h>
+
+#include "memstats.h"
+#include "string.h"
+#include "utils.h"
+
+static struct memstat memstats[MEMSTAT_COUNT];
+
+void memstat_alloc(enum memstat_id id, size_t size)
+{
+    struct memstat *s = &memstats[id];
+    u64 live = __atomic_add_fetch(&s->live, size, __ATOMIC_RELAXED);
+    u64 peak = __atomic_load_n(&s->peak, __ATOMIC_RELAXED);
+
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&s->peak, &peak, live, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+        ;
+
+    __atomic_add_fetch(&s->allocs, 1, __ATOMIC_RELAXED);
+}
+
+void memstat_free(enum memstat_id id, size_t size)
+{
+    struct memstat *s = &memstats[id];
+
+    __atomic_sub_fetch(&s->live, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->frees, 1, __ATOMIC_RELAXED);
+}
+
+void memstat_reserve(enum memstat_id id, size_t size)
+{
+    __atomic_add_fetch(&memstats[id].reserved, size, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy out up to size bytes worth of counters, one struct memstat per enum memstat_id. Returns
+ * the number of entries. If reset is set, the peaks drop to the current live values and the
+ * call counters restart from zero.
+ */
+int memstat_get(struct memstat *out, size_t size, bool reset)
+{
+    int count = min(size / sizeof(*out), (size_t)MEMSTAT_COUNT);
+
+    // dlmalloc does its own bookkeeping, walking it is fine for an occasional query
+    struct mallinfo mi = mallinfo();
+    memstats[MEMSTAT_MALLOC].live = mi.uordblks;
+    memstats[MEMSTAT_MALLOC].peak = malloc_max_footprint();
+    memstats[MEMSTAT_MALLOC].reserved = malloc_footprint();
+
+    for (int i = 0; i < count; i++) {
+        struct memstat *s = &memstats[i];
+
+        out[i].live = __atomic_load_n(&s->live, __ATOMIC_RELAXED);
+        out[i].peak = __atomic_load_n(&s->peak, __ATOMIC_RELAXED);
+        out[i].reserved = __atomic_load_n(&s->reserved, __ATOMIC_RELAXED);
+        out[i].allocs = __atomic_load_n(&s->allocs, __ATOMIC_RELAXED);
+        out[i].frees = __atomic_load_n(&s->frees, __ATOMIC_RELAXED);
+
+        if (reset) {
+            __atomic_store_n(&s->peak, out[i].live, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->allocs, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->frees, 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include "types.h"
+
+enum memstat_id {
+    MEMSTAT_HEAPBLOCK, // everything carved out of the heap, never freed
+    MEMSTAT_MALLOC,    // dlmalloc, filled in from mallinfo() on query
+    MEMSTAT_POOL,      // pool page blocks handed out
+    MEMSTAT_DART,      // DART L1/L2 tables
+    MEMSTAT_HV_PT,     // hypervisor stage 2 page tables
+    MEMSTAT_USB,       // dwc3 DMA and ring buffers
+    MEMSTAT_COUNT,
+};
+
+struct memstat {
+    u64 live;     // bytes currently allocated
+    u64 peak;     // high-water mark of live
+    u64 reserved; // bytes held from the level below (heapblock), if tracked separately
+    u64 allocs;
+    u64 frees;
+};
+
+void memstat_alloc(enum memstat_id id, size_t size);
+void memstat_free(enum memstat_id id, size_t size);
+void memstat_reserve(enum memstat_id id, size_t size);
+
+int memstat_get(struct memstat *out, size_t size, bool reset);
+
+#endif
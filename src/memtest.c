@@ -0,0 +1,229 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "memtest.h"
+#include "heapblock.h"
+#include "memory.h"
+#include "smp.h"
+#include "string.h"
+#include "task.h"
+#include "uartproxy.h"
+#include "utils.h"
+#include "xnuboot.h"
+
+/*
+ * RAM pattern test for burn-in. Every pattern is first written over the whole range and only then
+ * read back, both on all CPUs, so with ranges much larger than the SLC the data has made it to
+ * DRAM and back. Zeroes go out with DC ZVA, everything else with pairs of 64-bit stores, and the
+ * checks use pairs of loads, which is about as fast as the memory system will go.
+ *
+ * The first MEMTEST_MAX_REPORT errors are kept with their addresses and reported once the pass is
+ * done, all of them are counted.
+ */
+
+#define MEMTEST_MAX_REPORT 64
+#define MEMTEST_MIN_GRAIN  SZ_32M
+#define MEMTEST_CHUNKS     (4 * MAX_CPUS)
+
+enum memtest_pattern {
+    MEMTEST_ZERO,
+    MEMTEST_ONES,
+    MEMTEST_CHECKER,
+    MEMTEST_CHECKER_INV,
+    MEMTEST_ADDR,
+    MEMTEST_ADDR_INV,
+    MEMTEST_RANDOM,
+    MEMTEST_PATTERNS,
+};
+
+static const char *memtest_names[MEMTEST_PATTERNS] = {
+    [MEMTEST_ZERO] = "zero",
+    [MEMTEST_ONES] = "ones",
+    [MEMTEST_CHECKER] = "checker",
+    [MEMTEST_CHECKER_INV] = "~checker",
+    [MEMTEST_ADDR] = "address",
+    [MEMTEST_ADDR_INV] = "~address",
+    [MEMTEST_RANDOM] = "random",
+};
+
+static u64 memtest_errors;
+static u32 memtest_reported;
+static struct memtest_error memtest_report[MEMTEST_MAX_REPORT];
+static u64 memtest_seed;
+
+static inline u64 memtest_value(u32 pattern, u64 addr)
+{
+    switch (pattern) {
+        case MEMTEST_ONES:
+            return ~0UL;
+        case MEMTEST_CHECKER:
+            return 0x5555555555555555UL;
+        case MEMTEST_CHECKER_INV:
+            return 0xaaaaaaaaaaaaaaaaUL;
+        case MEMTEST_ADDR:
+            return addr;
+        case MEMTEST_ADDR_INV:
+            return ~addr;
+        case MEMTEST_RANDOM: {
+            // Cheap per-word hash, so checking does not need the sequence that wrote it
+            u64 x = (addr ^ memtest_seed) * 0x9e3779b97f4a7c15UL;
+            return x ^ (x >> 31);
+        }
+        case MEMTEST_ZERO:
+        default:
+            return 0;
+    }
+}
+
+static void memtest_error(u64 addr, u64 expected, u64 actual)
+{
+    __atomic_add_fetch(&memtest_errors, 1, __ATOMIC_RELAXED);
+
+    u32 idx = __atomic_fetch_add(&memtest_reported, 1, __ATOMIC_RELAXED);
+    if (idx >= MEMTEST_MAX_REPORT)
+        return;
+
+    memtest_report[idx].addr = addr;
+    memtest_report[idx].expected = expected;
+    memtest_report[idx].actual = actual;
+}
+
+static void memtest_fill_chunk(u64 pattern, u64 start, u64 end)
+{
+    if (pattern == MEMTEST_ZERO) {
+        dc_zva_range((void *)start, end - start);
+        return;
+    }
+
+    for (u64 p = start; p < end; p += 16) {
+        u64 *w = (u64 *)p;
+
+        w[0] = memtest_value(pattern, p);
+        w[1] = memtest_value(pattern, p + 8);
+    }
+}
+
+static void memtest_check_chunk(u64 pattern, u64 start, u64 end)
+{
+    for (u64 p = start; p < end; p += 16) {
+        const u64 *w = (const u64 *)p;
+        u64 a = w[0], b = w[1];
+        u64 ea = memtest_value(pattern, p), eb = memtest_value(pattern, p + 8);
+
+        if (a != ea)
+            memtest_error(p, ea, a);
+        if (b != eb)
+            memtest_error(p + 8, eb, b);
+    }
+}
+
+static u64 memtest_mmu_active(void)
+{
+    return mmu_active();
+}
+
+// Secondaries run with their MMU off, which would make this a test of Device memory
+static u64 memtest_enable_secondaries(void)
+{
+    u64 enabled = 0;
+
+    smp_start_secondaries();
+
+    for (int cpu = 1; cpu < MAX_CPUS; cpu++) {
+        if (!smp_is_alive(cpu) || smp_is_busy(cpu))
+            continue;
+
+        smp_call0(cpu, memtest_mmu_active);
+        if (smp_wait(cpu))
+            continue;
+
+        mmu_init_secondary(cpu);
+        enabled |= BIT(cpu);
+    }
+
+    return enabled;
+}
+
+static void memtest_restore_secondaries(u64 enabled)
+{
+    for (int cpu = 1; cpu < MAX_CPUS; cpu++) {
+        if (!(enabled & BIT(cpu)))
+            continue;
+
+        smp_call0(cpu, mmu_disable);
+        smp_wait(cpu);
+    }
+}
+
+/*
+ * Test [start, end) with every pattern, passes times. The range is rounded inwards to 16K and is
+ * clobbered, so it must not hold anything m1n1 needs. With events set, every reported error is
+ * also sent to the host. Returns the number of bad words found.
+ */
+u64 memtest_run(u64 start, u64 end, u32 passes, bool events)
+{
+    start = ALIGN_UP(start, SZ_16K);
+    end = ALIGN_DOWN(end, SZ_16K);
+    if (end <= start || !mmu_active())
+        return 0;
+
+    u64 size = end - start;
+    u64 grain = max(ALIGN_UP(size / MEMTEST_CHUNKS, SZ_16K), (u64)MEMTEST_MIN_GRAIN);
+    u64 total = 0;
+
+    printf("memtest: testing 0x%lx..0x%lx (%ld MiB), %d passes\n", start, end, size >> 20, passes);
+
+    u64 enabled = memtest_enable_secondaries();
+
+    for (u32 pass = 0; pass < passes; pass++) {
+        memtest_errors = 0;
+        memtest_reported = 0;
+        memtest_seed = get_ticks();
+
+        for (u32 pattern = 0; pattern < MEMTEST_PATTERNS; pattern++) {
+            u64 t0 = get_ticks();
+            u64 before = memtest_errors;
+
+            task_parallel_for(memtest_fill_chunk, pattern, start, end, grain);
+            task_parallel_for(memtest_check_chunk, pattern, start, end, grain);
+
+            u64 ms = ticks_to_msecs(get_ticks() - t0);
+            printf("memtest: pass %d/%d %-8s %ld errors, %ld ms (%ld MB/s)\n", pass + 1, passes,
+                   memtest_names[pattern], memtest_errors - before, ms,
+                   ms ? 2 * size / 1000 / ms : 0);
+        }
+
+        u32 reported = min(memtest_reported, (u32)MEMTEST_MAX_REPORT);
+        for (u32 i = 0; i < reported; i++) {
+            struct memtest_error *e = &memtest_report[i];
+
+            printf("memtest: bad word at 0x%lx: expected 0x%016lx, read 0x%016lx\n", e->addr,
+                   e->expected, e->actual);
+            if (events)
+                uartproxy_send_event(EVT_MEMTEST_ERROR, e, sizeof(*e));
+        }
+        if (memtest_errors > reported)
+            printf("memtest: ... and %ld more\n", memtest_errors - reported);
+
+        total += memtest_errors;
+    }
+
+    memtest_restore_secondaries(enabled);
+
+    printf("memtest: done, %ld errors\n", total);
+    return total;
+}
+
+/*
+ * Test all RAM above the heap, up to the end of what iBoot gave us. The carveouts are outside of
+ * that, and anything loaded so far is below the heap top, which stays claimed while testing.
+ */
+u64 memtest_free_ram(u32 passes)
+{
+    void *top = heapblock_claim_top(SZ_16K);
+    u64 end = cur_boot_args.phys_base + cur_boot_args.mem_size;
+
+    u64 errors = memtest_run((u64)top, end, passes, false);
+
+    heapblock_release_top();
+    return errors;
+}
@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef MEMTEST_H
+#define MEMTEST_H
+
+#include "types.h"
+
+// Sent as EVT_MEMTEST_ERROR when running from the proxy
+struct memtest_error {
+    u64 addr;
+    u64 expected;
+    u64 actual;
+};
+
+u64 memtest_run(u64 start, u64 end, u32 passes, bool events);
+u64 memtest_free_ram(u32 passes);
+
+#endif
@@ -27,6 +27,9 @@ Environment:
 --*/
 
 #include "minlzlib.h"
+#ifndef MINLZ_SMALL
+#include <string.h>
+#endif
 
 //
 // State used for the history buffer (dictionary)
@@ -144,6 +147,49 @@ DtRepeatSymbol (
         return false;
     }
 
+#ifndef MINLZ_SMALL
+    uint8_t* dst = &Dictionary.Buffer[Dictionary.Offset];
+    const uint8_t* src = dst - Distance;
+    uint32_t chunk;
+
+    Dictionary.Offset += Length;
+
+    //
+    // Short matches aren't worth more than a byte loop, and a distance of 1
+    // repeats a single symbol.
+    //
+    if (Length < 16)
+    {
+        do
+        {
+            *dst++ = *src++;
+        } while (--Length > 0);
+        return true;
+    }
+    if (Distance == 1)
+    {
+        memset(dst, *src, Length);
+        return true;
+    }
+
+    //
+    // Otherwise copy in pieces that never overlap their source, so that each
+    // one can go through memcpy and move 8 or 16 bytes at a time. Since the
+    // source stays put, every piece is twice as long as the one before.
+    //
+    while (Length > 0)
+    {
+        chunk = (uint32_t)(dst - src);
+        if (chunk > Length)
+        {
+            chunk = Length;
+        }
+        memcpy(dst, src, chunk);
+        dst += chunk;
+        Length -= chunk;
+    }
+    return true;
+#else
     //
     // Now rewrite the stream of past symbols forward into the dictionary.
     //
@@ -152,4 +198,5 @@ DtRepeatSymbol (
         DtPutSymbol(DtGetSymbol(Distance));
     } while (--Length > 0);
     return true;
+#endif
 }
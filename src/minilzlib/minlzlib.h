@@ -32,6 +32,8 @@ Environment:
 #include <stdbool.h>
 #include <assert.h>
 
+#include "../../build/build_cfg.h"
+
 //
 // Input Buffer Management
 //
@@ -55,18 +57,22 @@ bool DtCanWrite(uint32_t* Position);
 bool DtIsComplete(uint32_t* BytesProcessed);
 
 //
-// Range Decoder
+// Range Decoder. Unless MINLZ_SMALL is set, the routines used for every bit
+// are inline functions in rangedec.h instead.
 //
+#ifdef MINLZ_SMALL
 uint8_t RcGetBitTree(uint16_t* BitModel, uint16_t Limit);
 uint8_t RcGetReverseBitTree(uint16_t* BitModel, uint8_t HighestBit);
 uint8_t RcDecodeMatchedBitTree(uint16_t* BitModel, uint8_t MatchByte);
 uint32_t RcGetFixed(uint8_t HighestBit);
-bool RcInitialize(uint16_t* ChunkSize);
 uint8_t RcIsBitSet(uint16_t* Probability);
 void RcNormalize(void);
 bool RcCanRead(void);
+#endif
+bool RcInitialize(uint16_t* ChunkSize);
 bool RcIsComplete(uint32_t* Offset);
 void RcSetDefaultProbability(uint16_t* Probability);
+#include "rangedec.h"
 
 //
 // LZMA Decoder
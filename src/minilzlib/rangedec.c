@@ -33,48 +33,7 @@ Environment:
 
 #include "minlzlib.h"
 
-//
-// The range decoder uses 11 probability bits, where 2048 is 100% chance of a 0
-//
-#define LZMA_RC_PROBABILITY_BITS            11
-#define LZMA_RC_MAX_PROBABILITY             (1 << LZMA_RC_PROBABILITY_BITS)
 const uint16_t k_LzmaRcHalfProbability = LZMA_RC_MAX_PROBABILITY / 2;
-
-//
-// The range decoder uses an exponential moving average of the last probability
-// hit (match or miss) with an adaptation rate of 5 bits (which falls in the
-// middle of its 11 bits used to encode a probability.
-//
-#define LZMA_RC_ADAPTATION_RATE_SHIFT   5
-
-//
-// The range decoder has enough precision for the range only as long as the top
-// 8 bits are still set. Once it falls below, it needs a renormalization step.
-//
-#define LZMA_RC_MIN_RANGE               (1 << 24)
-
-//
-// The range decoder must be initialized with 5 bytes, the first of which is
-// ignored
-//
-#define LZMA_RC_INIT_BYTES              5
-
-//
-// State used for the binary adaptive arithmetic coder (LZMA Range Decoder)
-//
-typedef struct _RANGE_DECODER_STATE
-{
-    //
-    // Start and end location of the current stream's range encoder buffer
-    //
-    uint8_t* Start;
-    uint8_t* Limit;
-    //
-    // Current probability range and 32-bit arithmetic encoded sequence code
-    //
-    uint32_t Range;
-    uint32_t Code;
-} RANGE_DECODER_STATE, *PRANGE_DECODER_STATE;
 RANGE_DECODER_STATE RcState;
 
 bool
@@ -119,9 +78,18 @@ RcInitialize (
     BfSeek(0, &RcState.Start);
     RcState.Limit = RcState.Start + *ChunkSize;
     *ChunkSize -= LZMA_RC_INIT_BYTES;
+#ifndef MINLZ_SMALL
+    //
+    // The inline decoder reads the chunk directly and hands the position back
+    // to the input buffer in RcIsComplete.
+    //
+    RcState.Pos = RcState.Start;
+    RcState.End = chunkEnd;
+#endif
     return true;
 }
 
+#ifdef MINLZ_SMALL
 bool
 RcCanRead (
     void
@@ -135,6 +103,7 @@ RcCanRead (
     BfSeek(0, &pos);
     return pos <= RcState.Limit;
 }
+#endif
 
 bool
 RcIsComplete (
@@ -148,10 +117,15 @@ RcIsComplete (
     // this occurred (which should be equal to the compressed size).
     //
     BfSeek(0, &pos);
+#ifndef MINLZ_SMALL
+    BfSeek((uint32_t)(RcState.Pos - pos), &pos);
+    pos = RcState.Pos;
+#endif
     *BytesProcessed = (uint32_t)(pos - RcState.Start);
     return (RcState.Code == 0);
 }
 
+#ifdef MINLZ_SMALL
 void
 RcNormalize (
     void
@@ -383,6 +357,8 @@ RcGetFixed (
     return symbol;
 }
 
+#endif
+
 void
 RcSetDefaultProbability (
     uint16_t* Probability
@@ -0,0 +1,255 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    rangedec.h
+
+Abstract:
+
+    This header file contains the state and constants of the Range Decoder.
+    Unless MINLZ_SMALL is set, it also holds inline versions of the routines
+    that run for every decoded bit, so that the LZMA decoder can keep the
+    range and code in registers across a whole bit tree, and read the input
+    straight from the current chunk instead of going through BfRead.
+
+Author:
+
+    Alex Ionescu (@aionescu) 15-Apr-2020 - Initial version
+
+Environment:
+
+    Windows & Linux, user mode and kernel mode.
+
+--*/
+
+#pragma once
+
+//
+// The range decoder uses 11 probability bits, where 2048 is 100% chance of a 0
+//
+#define LZMA_RC_PROBABILITY_BITS            11
+#define LZMA_RC_MAX_PROBABILITY             (1 << LZMA_RC_PROBABILITY_BITS)
+
+//
+// The range decoder uses an exponential moving average of the last probability
+// hit (match or miss) with an adaptation rate of 5 bits (which falls in the
+// middle of its 11 bits used to encode a probability.
+//
+#define LZMA_RC_ADAPTATION_RATE_SHIFT   5
+
+//
+// The range decoder has enough precision for the range only as long as the top
+// 8 bits are still set. Once it falls below, it needs a renormalization step.
+//
+#define LZMA_RC_MIN_RANGE               (1 << 24)
+
+//
+// The range decoder must be initialized with 5 bytes, the first of which is
+// ignored
+//
+#define LZMA_RC_INIT_BYTES              5
+
+//
+// State used for the binary adaptive arithmetic coder (LZMA Range Decoder)
+//
+typedef struct _RANGE_DECODER_STATE
+{
+    //
+    // Start and end location of the current stream's range encoder buffer
+    //
+    uint8_t* Start;
+    uint8_t* Limit;
+#ifndef MINLZ_SMALL
+    //
+    // Next input byte, and the end of the input for this chunk
+    //
+    uint8_t* Pos;
+    uint8_t* End;
+#endif
+    //
+    // Current probability range and 32-bit arithmetic encoded sequence code
+    //
+    uint32_t Range;
+    uint32_t Code;
+} RANGE_DECODER_STATE, *PRANGE_DECODER_STATE;
+extern RANGE_DECODER_STATE RcState;
+
+#ifndef MINLZ_SMALL
+static inline
+void
+RcNormalizeState (
+    PRANGE_DECODER_STATE Rc
+    )
+{
+    //
+    // See RcNormalize in rangedec.c. Past the end of the chunk, BfRead would
+    // fail and return a 0 byte, so do the same.
+    //
+    if (Rc->Range < LZMA_RC_MIN_RANGE)
+    {
+        Rc->Range <<= 8;
+        Rc->Code <<= 8;
+        if (Rc->Pos < Rc->End)
+        {
+            Rc->Code |= *Rc->Pos++;
+        }
+    }
+}
+
+static inline
+uint8_t
+RcDecodeBit (
+    PRANGE_DECODER_STATE Rc,
+    uint16_t* Probability
+    )
+{
+    uint32_t bound, prob;
+
+    //
+    // This is RcIsBitSet and RcAdapt from rangedec.c folded together. The
+    // branch stays: turning it into conditional selects makes every bit wait
+    // for the comparison, which costs more than the mispredictions do.
+    //
+    RcNormalizeState(Rc);
+    prob = *Probability;
+    bound = (Rc->Range >> LZMA_RC_PROBABILITY_BITS) * prob;
+    if (Rc->Code < bound)
+    {
+        Rc->Range = bound;
+        *Probability = (uint16_t)(prob + ((LZMA_RC_MAX_PROBABILITY - prob) >>
+                                          LZMA_RC_ADAPTATION_RATE_SHIFT));
+        return 0;
+    }
+    Rc->Range -= bound;
+    Rc->Code -= bound;
+    *Probability = (uint16_t)(prob - (prob >> LZMA_RC_ADAPTATION_RATE_SHIFT));
+    return 1;
+}
+
+static inline
+void
+RcNormalize (
+    void
+    )
+{
+    RcNormalizeState(&RcState);
+}
+
+static inline
+bool
+RcCanRead (
+    void
+    )
+{
+    return RcState.Pos <= RcState.Limit;
+}
+
+static inline
+uint8_t
+RcIsBitSet (
+    uint16_t* Probability
+    )
+{
+    return RcDecodeBit(&RcState, Probability);
+}
+
+static inline
+uint8_t
+RcGetBitTree (
+    uint16_t* BitModel,
+    uint16_t Limit
+    )
+{
+    RANGE_DECODER_STATE rc = RcState;
+    uint16_t symbol;
+
+    for (symbol = 1; symbol < Limit; )
+    {
+        symbol = (symbol << 1) | RcDecodeBit(&rc, &BitModel[symbol]);
+    }
+    RcState = rc;
+    return (symbol - Limit) & 0xFF;
+}
+
+static inline
+uint8_t
+RcGetReverseBitTree (
+    uint16_t* BitModel,
+    uint8_t HighestBit
+    )
+{
+    RANGE_DECODER_STATE rc = RcState;
+    uint16_t symbol;
+    uint8_t i, bit, result;
+
+    for (i = 0, symbol = 1, result = 0; i < HighestBit; i++)
+    {
+        bit = RcDecodeBit(&rc, &BitModel[symbol]);
+        symbol = (symbol << 1) | bit;
+        result |= bit << i;
+    }
+    RcState = rc;
+    return result;
+}
+
+static inline
+uint8_t
+RcDecodeMatchedBitTree (
+    uint16_t* BitModel,
+    uint8_t MatchByte
+    )
+{
+    RANGE_DECODER_STATE rc = RcState;
+    uint16_t symbol, bytePos, matchBit;
+    uint8_t bit;
+
+    for (bytePos = MatchByte, symbol = 1; symbol < 0x100; bytePos <<= 1)
+    {
+        matchBit = (bytePos >> 7) & 1;
+
+        bit = RcDecodeBit(&rc, &BitModel[symbol + (0x100 * (matchBit + 1))]);
+        symbol = (symbol << 1) | bit;
+
+        if (matchBit != bit)
+        {
+            while (symbol < 0x100)
+            {
+                symbol = (symbol << 1) | RcDecodeBit(&rc, &BitModel[symbol]);
+            }
+            break;
+        }
+    }
+    RcState = rc;
+    return symbol & 0xFF;
+}
+
+static inline
+uint32_t
+RcGetFixed (
+    uint8_t HighestBit
+    )
+{
+    RANGE_DECODER_STATE rc = RcState;
+    uint32_t symbol, mask;
+
+    //
+    // Direct bits are coin flips, so no branch could predict them. Halve the
+    // range and subtract it from the code: if that went negative the bit is
+    // a 0 and the subtraction gets undone through the mask.
+    //
+    symbol = 0;
+    do
+    {
+        RcNormalizeState(&rc);
+        rc.Range >>= 1;
+        rc.Code -= rc.Range;
+        mask = 0 - (rc.Code >> 31);
+        rc.Code += rc.Range & mask;
+        symbol = (symbol << 1) + (mask + 1);
+    } while (--HighestBit > 0);
+    RcState = rc;
+    return symbol;
+}
+#endif
@@ -2,11 +2,13 @@
 
 #include "adt.h"
 #include "assert.h"
+#include "coro.h"
 #include "malloc.h"
 #include "nvme.h"
 #include "pmgr.h"
 #include "rtkit.h"
 #include "sart.h"
+#include "smp.h"
 #include "string.h"
 #include "utils.h"
 
@@ -14,6 +16,22 @@
 #define NVME_ENABLE_TIMEOUT   5000000
 #define NVME_SHUTDOWN_TIMEOUT 5000000
 #define NVME_QUEUE_SIZE       64
+#define NVME_SYSLOG_INTERVAL  1000
+
+/* NVMe page size (CC.MPS = 0) and namespace block size */
+#define NVME_PAGE_SIZE  SZ_4K
+#define NVME_BLOCK_SIZE SZ_4K
+
+/*
+ * Number of IO tags kept in flight by nvme_read_blocks and the max blocks per command. Every
+ * caller claims a window of NVME_IO_TAGS tags, so up to NVME_IO_WINDOWS CPUs can share a queue;
+ * one entry is left over so the CQ can never fill up.
+ */
+#define NVME_IO_TAGS         8
+#define NVME_IO_WINDOWS      ((NVME_QUEUE_SIZE - 1) / NVME_IO_TAGS)
+#define NVME_MAX_XFER_BLOCKS 64
+#define NVME_PRPS_PER_TAG    NVME_MAX_XFER_BLOCKS
+#define NVME_PRPS_SIZE       (NVME_QUEUE_SIZE * NVME_PRPS_PER_TAG * sizeof(u64))
 
 #define NVME_CC            0x14
 #define NVME_CC_SHN        GENMASK(15, 14)
@@ -64,6 +82,10 @@
 #define NVME_CMD_FLUSH 0x00
 #define NVME_CMD_WRITE 0x01
 #define NVME_CMD_READ  0x02
+#define NVME_CMD_DSM   0x09
+
+#define NVME_DSM_AD         BIT(2) // deallocate
+#define NVME_DSM_MAX_RANGES 256
 
 struct nvme_command {
     u8 opcode;
@@ -91,6 +113,12 @@ struct nvme_completion {
     u16 status;
 };
 
+struct nvme_dsm_range {
+    u32 cattr;
+    u32 nlb;
+    u64 slba;
+};
+
 struct apple_nvmmu_tcb {
     u8 opcode;
     u8 dma_flags;
@@ -109,9 +137,20 @@ struct nvme_queue {
     struct apple_nvmmu_tcb *tcbs;
     struct nvme_command *cmds;
     struct nvme_completion *cqes;
+    u64 *prps;
 
+    /*
+     * Completions are retired by whichever waiting CPU gets cq_lock, and handed to the CPU that
+     * owns the tag through done, results and status.
+     */
+    spinlock_t cq_lock;
     u8 cq_head;
     u8 cq_phase;
+    u64 done;
+    u64 results[NVME_QUEUE_SIZE];
+    u16 status[NVME_QUEUE_SIZE];
+
+    u32 windows; // tag windows claimed by nvme_claim_tags
 
     bool adminq;
 };
@@ -119,8 +158,13 @@ struct nvme_queue {
 static_assert(sizeof(struct nvme_command) == 64, "invalid nvme_command size");
 static_assert(sizeof(struct nvme_completion) == 16, "invalid nvme_completion size");
 static_assert(sizeof(struct apple_nvmmu_tcb) == 128, "invalid apple_nvmmu_tcb size");
+static_assert(NVME_IO_TAGS <= 32, "too many NVMe IO tags");
+static_assert(NVME_QUEUE_SIZE <= 64, "NVMe tags must fit in a u64 bitmap");
+static_assert(NVME_PAGE_SIZE % (NVME_PRPS_PER_TAG * sizeof(u64)) == 0,
+              "PRP lists must not cross a page");
 
 static bool nvme_initialized = false;
+static bool nvme_started = false;
 static u8 nvme_die;
 
 static asc_dev_t *nvme_asc = NULL;
@@ -147,13 +191,22 @@ static bool alloc_queue(struct nvme_queue *q)
     if (!q->cqes)
         goto free_cmds;
 
+    /* one PRP list per tag, none of them crossing a page */
+    q->prps = memalign(SZ_16K, NVME_PRPS_SIZE);
+    if (!q->prps)
+        goto free_cqes;
+
     memset(q->tcbs, 0, NVME_QUEUE_SIZE * sizeof(*q->tcbs));
     memset(q->cmds, 0, NVME_QUEUE_SIZE * sizeof(*q->cmds));
     memset(q->cqes, 0, NVME_QUEUE_SIZE * sizeof(*q->cqes));
+    memset(q->prps, 0, NVME_PRPS_SIZE);
+    spin_init(&q->cq_lock);
     q->cq_head = 0;
     q->cq_phase = 1;
     return true;
 
+free_cqes:
+    free(q->cqes);
 free_cmds:
     free(q->cmds);
 free_tcbs:
@@ -166,6 +219,7 @@ static void free_queue(struct nvme_queue *q)
     free(q->cmds);
     free(q->tcbs);
     free(q->cqes);
+    free(q->prps);
 }
 
 static void nvme_poll_syslog(void)
@@ -174,13 +228,31 @@ static void nvme_poll_syslog(void)
     rtkit_recv(nvme_rtkit, &msg);
 }
 
+/*
+ * Nothing a command waits for arrives through the mailbox, ANS only sends syslog and management
+ * messages there. The command paths drain it every NVME_SYSLOG_INTERVAL us so that it never
+ * fills up, instead of adding mailbox MMIO to every submission and CQ poll.
+ */
+static u64 nvme_syslog_deadline;
+
+static void nvme_poll_syslog_periodic(void)
+{
+    if (!timeout_expired(nvme_syslog_deadline))
+        return;
+
+    nvme_poll_syslog();
+    nvme_syslog_deadline = timeout_calculate(NVME_SYSLOG_INTERVAL);
+}
+
 static bool nvme_ctrl_disable(void)
 {
     u64 timeout = timeout_calculate(NVME_TIMEOUT);
 
     clear32(nvme_base + NVME_CC, NVME_CC_EN);
-    while (read32(nvme_base + NVME_CSTS) & NVME_CSTS_RDY && !timeout_expired(timeout))
+    while (read32(nvme_base + NVME_CSTS) & NVME_CSTS_RDY && !timeout_expired(timeout)) {
         nvme_poll_syslog();
+        coro_yield();
+    }
 
     return !(read32(nvme_base + NVME_CSTS) & NVME_CSTS_RDY);
 }
@@ -190,8 +262,10 @@ static bool nvme_ctrl_enable(void)
     u64 timeout = timeout_calculate(NVME_ENABLE_TIMEOUT);
 
     mask32(nvme_base + NVME_CC, NVME_CC_SHN, NVME_CC_EN);
-    while (!(read32(nvme_base + NVME_CSTS) & NVME_CSTS_RDY) && !timeout_expired(timeout))
+    while (!(read32(nvme_base + NVME_CSTS) & NVME_CSTS_RDY) && !timeout_expired(timeout)) {
         nvme_poll_syslog();
+        coro_yield();
+    }
 
     return read32(nvme_base + NVME_CSTS) & NVME_CSTS_RDY;
 }
@@ -202,17 +276,16 @@ static bool nvme_ctrl_shutdown(void)
 
     mask32(nvme_base + NVME_CC, NVME_CC_SHN, FIELD_PREP(NVME_CC_SHN, NVME_CC_SHN_NORMAL));
     while (FIELD_GET(NVME_CSTS_SHST, read32(nvme_base + NVME_CSTS)) != NVME_CSTS_SHST_DONE &&
-           !timeout_expired(timeout))
+           !timeout_expired(timeout)) {
         nvme_poll_syslog();
+        coro_yield();
+    }
 
     return FIELD_GET(NVME_CSTS_SHST, read32(nvme_base + NVME_CSTS)) == NVME_CSTS_SHST_DONE;
 }
 
-static bool nvme_exec_command(struct nvme_queue *q, struct nvme_command *cmd, u64 *result)
+static void nvme_submit(struct nvme_queue *q, struct nvme_command *cmd, u8 tag)
 {
-    bool found = false;
-    u64 timeout;
-    u8 tag = 0;
     struct nvme_command *queue_cmd = &q->cmds[tag];
     struct apple_nvmmu_tcb *tcb = &q->tcbs[tag];
 
@@ -227,34 +300,36 @@ static bool nvme_exec_command(struct nvme_queue *q, struct nvme_command *cmd, u6
     tcb->prp1 = queue_cmd->prp1;
     tcb->prp2 = queue_cmd->prp2;
 
-    /* make sure ANS2 can see the command and tcb before triggering it */
+    /* make sure ANS2 can see the command, tcb and PRP list before triggering it */
     dma_wmb();
 
-    nvme_poll_syslog();
     if (q->adminq)
         write32(nvme_base + NVME_DB_LINEAR_ASQ, tag);
     else
         write32(nvme_base + NVME_DB_LINEAR_IOSQ, tag);
-    nvme_poll_syslog();
+}
 
-    timeout = timeout_calculate(NVME_TIMEOUT);
+/*
+ * Retire everything in the CQ, recording the result and (phase-stripped) status of each entry
+ * under its tag. Only one CPU does this at a time, the others go back to checking for their own
+ * tags.
+ */
+static void nvme_reap(struct nvme_queue *q)
+{
     struct nvme_completion cqe;
-    while (!timeout_expired(timeout)) {
-        nvme_poll_syslog();
 
+    if (!spin_trylock(&q->cq_lock))
+        return;
+
+    while (true) {
         /* we need a DMA read barrier here since the CQ will be updated using DMA */
         dma_rmb();
-        memcpy(&cqe, &q->cqes[q->cq_head], sizeof(cqe));
-        if ((cqe.status & 1) != q->cq_phase)
-            continue;
+        if ((q->cqes[q->cq_head].status & 1) != q->cq_phase)
+            break;
 
-        if (cqe.tag == tag) {
-            found = true;
-            if (result)
-                *result = cqe.result;
-        } else {
-            printf("nvme: invalid tag in CQ: expected %d but got %d\n", tag, cqe.tag);
-        }
+        /* and another one so the rest of the entry is not read ahead of the phase bit */
+        dma_rmb();
+        memcpy(&cqe, &q->cqes[q->cq_head], sizeof(cqe));
 
         write32(nvme_base + NVMMU_TCB_INVAL, cqe.tag);
         if (read32(nvme_base + NVMMU_TCB_STAT))
@@ -271,29 +346,123 @@ static bool nvme_exec_command(struct nvme_queue *q, struct nvme_command *cmd, u6
             write32(nvme_base + NVME_DB_ACQ, q->cq_head);
         else
             write32(nvme_base + NVME_DB_IOCQ, q->cq_head);
-        break;
+
+        if (cqe.tag >= NVME_QUEUE_SIZE) {
+            printf("nvme: invalid tag %d in CQ\n", cqe.tag);
+            continue;
+        }
+
+        q->results[cqe.tag] = cqe.result;
+        q->status[cqe.tag] = cqe.status >> 1;
+        __atomic_or_fetch(&q->done, BIT(cqe.tag), __ATOMIC_RELEASE);
     }
 
-    if (!found) {
+    spin_unlock(&q->cq_lock);
+}
+
+/*
+ * Wait for one of the commands in the tags bitmap to complete. Returns its tag and fills in the
+ * result and status, or returns -1 on timeout.
+ */
+static int nvme_wait(struct nvme_queue *q, u64 tags, u64 *result, u16 *status)
+{
+    u64 timeout = timeout_calculate(NVME_TIMEOUT);
+
+    while (!timeout_expired(timeout)) {
+        u64 done = __atomic_load_n(&q->done, __ATOMIC_ACQUIRE) & tags;
+
+        if (!done) {
+            nvme_reap(q);
+            /* RTKit is not SMP safe, leave the mailbox to the boot CPU */
+            if (!smp_id())
+                nvme_poll_syslog_periodic();
+            continue;
+        }
+
+        int tag = __builtin_ctzl(done);
+        __atomic_and_fetch(&q->done, ~BIT(tag), __ATOMIC_RELAXED);
+
+        if (result)
+            *result = q->results[tag];
+        *status = q->status[tag];
+        return tag;
+    }
+
+    return -1;
+}
+
+/*
+ * Claim a window of NVME_IO_TAGS tags on q for the caller, so that several CPUs can submit to
+ * the same queue without holding a lock. Returns the first tag or -1 if none became free.
+ */
+static int nvme_claim_tags(struct nvme_queue *q)
+{
+    u64 timeout = timeout_calculate(NVME_TIMEOUT);
+    u32 windows = __atomic_load_n(&q->windows, __ATOMIC_RELAXED);
+
+    while (!timeout_expired(timeout)) {
+        u32 free = ~windows & GENMASK(NVME_IO_WINDOWS - 1, 0);
+
+        if (!free) {
+            windows = __atomic_load_n(&q->windows, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        int window = __builtin_ctz(free);
+        if (!__atomic_compare_exchange_n(&q->windows, &windows, windows | BIT(window), false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+
+        /* forget completions of commands a previous owner gave up on */
+        u64 tags = GENMASK(NVME_IO_TAGS - 1, 0) << (window * NVME_IO_TAGS);
+        __atomic_and_fetch(&q->done, ~tags, __ATOMIC_RELAXED);
+        return window * NVME_IO_TAGS;
+    }
+
+    printf("nvme: no free tags\n");
+    return -1;
+}
+
+static void nvme_release_tags(struct nvme_queue *q, int base)
+{
+    __atomic_and_fetch(&q->windows, ~BIT(base / NVME_IO_TAGS), __ATOMIC_RELEASE);
+}
+
+static bool nvme_exec_command(struct nvme_queue *q, struct nvme_command *cmd, u64 *result)
+{
+    u16 status;
+    int ret;
+
+    int tag = nvme_claim_tags(q);
+    if (tag < 0)
+        return false;
+
+    nvme_submit(q, cmd, tag);
+
+    ret = nvme_wait(q, BIT(tag), result, &status);
+    if (ret != tag) {
+        /* as in nvme_rw_blocks, the tags stay claimed */
         printf("nvme: could not find command completion in CQ\n");
         return false;
     }
+    nvme_release_tags(q, tag);
 
-    cqe.status >>= 1;
-    if (cqe.status) {
-        printf("nvme: command failed with status %d\n", cqe.status);
+    if (status) {
+        printf("nvme: command failed with status %d\n", status);
         return false;
     }
 
     return true;
 }
 
-bool nvme_init(void)
+/*
+ * First half of nvme_init(): set up everything up to starting the ANS RTKit boot, which can then
+ * be waited for together with other coprocessors. Returns the RTKit instance or NULL.
+ */
+rtkit_dev_t *nvme_start(void)
 {
-    if (nvme_initialized) {
-        printf("nvme: already initialized\n");
-        return true;
-    }
+    if (nvme_initialized || nvme_started)
+        return NULL;
 
     int adt_path[8];
     int node = adt_path_offset_trace(adt, "/arm-io/ans", adt_path);
@@ -339,9 +508,56 @@ bool nvme_init(void)
     if (!nvme_rtkit)
         goto out_sart;
 
-    if (!rtkit_boot(nvme_rtkit))
+    if (!rtkit_boot_start(nvme_rtkit))
         goto out_rtkit;
 
+    nvme_started = true;
+    return nvme_rtkit;
+
+out_rtkit:
+    rtkit_free(nvme_rtkit);
+out_sart:
+    sart_free(nvme_sart);
+out_asc:
+    asc_free(nvme_asc);
+out_ioq:
+    free_queue(&ioq);
+out_adminq:
+    free_queue(&adminq);
+    return NULL;
+}
+
+static void nvme_free(void)
+{
+    rtkit_free(nvme_rtkit);
+    sart_free(nvme_sart);
+    asc_free(nvme_asc);
+    free_queue(&ioq);
+    free_queue(&adminq);
+}
+
+static void nvme_reset(void)
+{
+    rtkit_sleep(nvme_rtkit);
+    // Some machines call this ANS, some ANS2...
+    pmgr_reset(nvme_die, "ANS");
+    pmgr_reset(nvme_die, "ANS2");
+}
+
+bool nvme_init(void)
+{
+    if (nvme_initialized) {
+        printf("nvme: already initialized\n");
+        return true;
+    }
+
+    if (!nvme_started && !nvme_start())
+        return false;
+
+    nvme_started = false;
+    if (!rtkit_boot(nvme_rtkit))
+        goto out_free;
+
     if (poll32(nvme_base + NVME_BOOT_STATUS, 0xffffffff, NVME_BOOT_STATUS_OK, USEC_PER_SEC) < 0) {
         printf("nvme: ANS did not boot correctly.\n");
         goto out_shutdown;
@@ -410,25 +626,23 @@ out_disable_ctrl:
     nvme_ctrl_disable();
     nvme_poll_syslog();
 out_shutdown:
-    rtkit_sleep(nvme_rtkit);
-    // Some machines call this ANS, some ANS2...
-    pmgr_reset(nvme_die, "ANS");
-    pmgr_reset(nvme_die, "ANS2");
-out_rtkit:
-    rtkit_free(nvme_rtkit);
-out_sart:
-    sart_free(nvme_sart);
-out_asc:
-    asc_free(nvme_asc);
-out_ioq:
-    free_queue(&ioq);
-out_adminq:
-    free_queue(&adminq);
+    nvme_reset();
+out_free:
+    nvme_free();
     return false;
 }
 
 void nvme_shutdown(void)
 {
+    if (nvme_started) {
+        // Started early but never used, put ANS back to sleep
+        nvme_started = false;
+        if (rtkit_boot(nvme_rtkit))
+            nvme_reset();
+        nvme_free();
+        return;
+    }
+
     if (!nvme_initialized) {
         printf("nvme: trying to shut down but not initialized\n");
         return;
@@ -453,15 +667,8 @@ void nvme_shutdown(void)
     if (!nvme_ctrl_disable())
         printf("nvme: timeout while waiting for CSTS.RDY to clear\n");
 
-    rtkit_sleep(nvme_rtkit);
-    // Some machines call this ANS, some ANS2...
-    pmgr_reset(nvme_die, "ANS");
-    pmgr_reset(nvme_die, "ANS2");
-    rtkit_free(nvme_rtkit);
-    sart_free(nvme_sart);
-    asc_free(nvme_asc);
-    free_queue(&ioq);
-    free_queue(&adminq);
+    nvme_reset();
+    nvme_free();
     nvme_initialized = false;
 
     printf("nvme: shutdown done\n");
@@ -481,25 +688,151 @@ bool nvme_flush(u32 nsid)
     return nvme_exec_command(&ioq, &cmd, NULL);
 }
 
-bool nvme_read(u32 nsid, u64 lba, void *buffer)
+/*
+ * Point the command at a physically contiguous, page-aligned buffer. Transfers of up to two
+ * pages fit in PRP1/PRP2 directly, anything larger goes through the tag's PRP list.
+ */
+static void nvme_setup_prps(struct nvme_command *cmd, u64 *prp_list, u64 addr, size_t len)
+{
+    cmd->prp1 = addr;
+
+    if (len <= NVME_PAGE_SIZE)
+        return;
+
+    if (len <= 2 * NVME_PAGE_SIZE) {
+        cmd->prp2 = addr + NVME_PAGE_SIZE;
+        return;
+    }
+
+    for (size_t i = 1; i * NVME_PAGE_SIZE < len; i++)
+        prp_list[i - 1] = addr + i * NVME_PAGE_SIZE;
+    cmd->prp2 = (u64)prp_list;
+}
+
+static bool nvme_rw_blocks(u8 opcode, u32 nsid, u64 lba, u64 count, void *buffer)
 {
     struct nvme_command cmd;
     u64 buffer_addr = (u64)buffer;
+    u32 busy = 0;
+    bool ok = true;
 
     if (!nvme_initialized)
         return false;
 
     /* no need for 16K alignment here since the NVME page size is 4k */
-    if (buffer_addr & (SZ_4K - 1))
+    if (buffer_addr & (NVME_PAGE_SIZE - 1))
         return false;
 
-    memset(&cmd, 0, sizeof(cmd));
-    cmd.opcode = NVME_CMD_READ;
-    cmd.nsid = nsid;
-    cmd.prp1 = (u64)buffer_addr;
-    cmd.cdw10 = lba;
-    cmd.cdw11 = lba >> 32;
-    cmd.cdw12 = 1; // 4096 bytes
+    int base = nvme_claim_tags(&ioq);
+    if (base < 0)
+        return false;
 
-    return nvme_exec_command(&ioq, &cmd, NULL);
+    while (count || busy) {
+        /* keep up to NVME_IO_TAGS commands in flight */
+        if (ok && count && busy != GENMASK(NVME_IO_TAGS - 1, 0)) {
+            u8 tag = base + __builtin_ctz(~busy);
+            u64 blocks = min(count, (u64)NVME_MAX_XFER_BLOCKS);
+
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.opcode = opcode;
+            cmd.nsid = nsid;
+            nvme_setup_prps(&cmd, &ioq.prps[tag * NVME_PRPS_PER_TAG], buffer_addr,
+                            blocks * NVME_BLOCK_SIZE);
+            cmd.cdw10 = lba;
+            cmd.cdw11 = lba >> 32;
+            cmd.cdw12 = blocks - 1; // 0's based number of blocks
+
+            nvme_submit(&ioq, &cmd, tag);
+            busy |= BIT(tag - base);
+
+            lba += blocks;
+            count -= blocks;
+            buffer_addr += blocks * NVME_BLOCK_SIZE;
+            continue;
+        }
+
+        u16 status;
+        int tag = nvme_wait(&ioq, (u64)busy << base, NULL, &status);
+        if (tag < 0) {
+            /* keep the window claimed, its commands might still complete at any time */
+            printf("nvme: could not find command completion in CQ (pending: 0x%x)\n", busy);
+            return false;
+        }
+        busy &= ~BIT(tag - base);
+
+        if (status) {
+            printf("nvme: %s command failed with status %d\n",
+                   opcode == NVME_CMD_READ ? "read" : "write", status);
+            /* stop submitting, but still drain whatever is in flight */
+            ok = false;
+        }
+    }
+
+    nvme_release_tags(&ioq, base);
+    return ok;
+}
+
+bool nvme_read_blocks(u32 nsid, u64 lba, u64 count, void *buffer)
+{
+    return nvme_rw_blocks(NVME_CMD_READ, nsid, lba, count, buffer);
+}
+
+bool nvme_write_blocks(u32 nsid, u64 lba, u64 count, const void *buffer)
+{
+    return nvme_rw_blocks(NVME_CMD_WRITE, nsid, lba, count, (void *)buffer);
+}
+
+bool nvme_read(u32 nsid, u64 lba, void *buffer)
+{
+    return nvme_read_blocks(nsid, lba, 1, buffer);
+}
+
+bool nvme_write(u32 nsid, u64 lba, const void *buffer)
+{
+    return nvme_write_blocks(nsid, lba, 1, buffer);
+}
+
+/*
+ * Deallocate count blocks starting at lba, in dataset management commands of up to
+ * NVME_DSM_MAX_RANGES ranges each.
+ */
+bool nvme_discard(u32 nsid, u64 lba, u64 count)
+{
+    struct nvme_command cmd;
+    bool ok = true;
+
+    if (!nvme_initialized)
+        return false;
+
+    struct nvme_dsm_range *ranges = memalign(NVME_PAGE_SIZE, NVME_PAGE_SIZE);
+    if (!ranges)
+        return false;
+
+    while (ok && count) {
+        u32 nr = 0;
+
+        memset(ranges, 0, NVME_PAGE_SIZE);
+        while (count && nr < NVME_DSM_MAX_RANGES) {
+            u64 blocks = min(count, (u64)0xffffffff);
+
+            ranges[nr].nlb = blocks;
+            ranges[nr].slba = lba;
+            nr++;
+
+            lba += blocks;
+            count -= blocks;
+        }
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_CMD_DSM;
+        cmd.nsid = nsid;
+        cmd.prp1 = (u64)ranges;
+        cmd.cdw10 = nr - 1; // 0's based number of ranges
+        cmd.cdw11 = NVME_DSM_AD;
+
+        ok = nvme_exec_command(&ioq, &cmd, NULL);
+    }
+
+    free(ranges);
+    return ok;
 }
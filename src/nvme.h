@@ -3,12 +3,22 @@
 #ifndef NVME_H
 #define NVME_H
 
+#include "rtkit.h"
 #include "types.h"
 
+rtkit_dev_t *nvme_start(void);
 bool nvme_init(void);
 void nvme_shutdown(void);
 
+/*
+ * The I/O functions may be called from several CPUs at once (with their MMU on), each caller
+ * gets its own window of tags on the shared I/O queue.
+ */
 bool nvme_flush(u32 nsid);
 bool nvme_read(u32 nsid, u64 lba, void *buffer);
+bool nvme_read_blocks(u32 nsid, u64 lba, u64 count, void *buffer);
+bool nvme_write(u32 nsid, u64 lba, const void *buffer);
+bool nvme_write_blocks(u32 nsid, u64 lba, u64 count, const void *buffer);
+bool nvme_discard(u32 nsid, u64 lba, u64 count);
 
 #endif
@@ -3,22 +3,35 @@
 #include "payload.h"
 #include "adt.h"
 #include "assert.h"
+#include "bootprof.h"
 #include "chainload.h"
 #include "display.h"
 #include "heapblock.h"
 #include "kboot.h"
+#include "memtest.h"
+#include "nvme.h"
 #include "smp.h"
 #include "utils.h"
 
 #include "libfdt/libfdt.h"
+#include "lz4/lz4dec.h"
 #include "minilzlib/minlzma.h"
 #include "tinf/tinf.h"
+#include "zstd/zstddec.h"
 
 // Kernels must be 2MB aligned
 #define KERNEL_ALIGN (2 << 20)
 
+// Below this, checksumming on one CPU is faster than farming it out
+#define PARALLEL_CRC_MIN (16 << 20)
+
+#define CRC32_POLY 0xedb88320
+
 static const u8 gz_magic[] = {0x1f, 0x8b};
 static const u8 xz_magic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+static const u8 zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+static const u8 lz4_magic[] = {0x04, 0x22, 0x4d, 0x18};
+static const u8 lz4_legacy_magic[] = {0x02, 0x21, 0x4c, 0x18};
 static const u8 fdt_magic[] = {0xd0, 0x0d, 0xfe, 0xed};
 static const u8 kernel_magic[] = {'A', 'R', 'M', 0x64};          // at 0x38
 static const u8 cpio_magic[] = {'0', '7', '0', '7', '0'};        // '1' or '2' next
@@ -26,13 +39,146 @@ static const u8 img4_magic[] = {0x16, 0x04, 'I', 'M', 'G', '4'}; // IA5String 'I
 static const u8 sig_magic[] = {'m', '1', 'n', '1', '_', 's', 'i', 'g'};
 static const u8 empty[] = {0, 0, 0, 0};
 
+// Files to load from disk (payload=<partuuid>;<path>), each one treated like an appended payload
+#define MAX_DISK_PAYLOADS 4
+
 static char expect_compatible[256];
-static struct kernel_header *kernel = NULL;
-static void *fdt = NULL;
 static char *chainload_spec = NULL;
+static u32 memtest_passes = 0;
+static size_t disk_payload_cnt = 0;
+static char *disk_payloads[MAX_DISK_PAYLOADS];
+
+/*
+ * Loading a payload only records where its parts ended up; nothing is moved until all payloads
+ * have been seen, so that the placement pass can leave everything that is already usable where
+ * it is (which is the case for anything that was decompressed) and move the rest exactly once.
+ */
+static struct {
+    struct kernel_header *kernel;
+    size_t kernel_size; // bytes available at kernel, 0 if unknown (in-line)
+    void *initrd;
+    size_t initrd_size;
+    void *fdt;
+    size_t fdt_bufsize; // room for editing the FDT in place, 0 if it needs a copy
+} plan;
 
 static void *load_one_payload(void *start, size_t size);
 
+static u64 crc32_chunk(u64 data, u64 length)
+{
+    const u8 *p = (const u8 *)data;
+    u32 crc = 0xffffffff;
+
+    for (; length && ((u64)p & 7); length--)
+        __asm__("crc32b %w0, %w0, %w1" : "+r"(crc) : "r"((u32)*p++));
+    for (; length >= 8; length -= 8, p += 8)
+        __asm__("crc32x %w0, %w0, %x1" : "+r"(crc) : "r"(*(const u64 *)p));
+    for (; length; length--)
+        __asm__("crc32b %w0, %w0, %w1" : "+r"(crc) : "r"((u32)*p++));
+
+    return ~crc;
+}
+
+/* a * b modulo the CRC32 polynomial, both bit-reflected */
+static u32 crc32_multmodp(u32 a, u32 b)
+{
+    u32 p = 0;
+
+    for (u32 m = BIT(31); m; m >>= 1) {
+        if (a & m)
+            p ^= b;
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+/* CRC32 of A followed by B, given the separate CRCs and the length of B */
+static u32 crc32_combine(u32 crc_a, u32 crc_b, u64 len_b)
+{
+    u32 p = BIT(31);       // x^0
+    u32 x2n = BIT(31 - 8); // x^8, one byte
+
+    for (; len_b; len_b >>= 1) {
+        if (len_b & 1)
+            p = crc32_multmodp(x2n, p);
+        x2n = crc32_multmodp(x2n, x2n);
+    }
+
+    return crc32_multmodp(p, crc_a) ^ crc_b;
+}
+
+/*
+ * The decompressors themselves are inherently serial, but checksumming the output is not. The
+ * check of a gzip payload is split across the secondaries and runs in the background while the
+ * primary moves on to scanning and decompressing the next payloads; the result is only needed
+ * before anything gets booted. One check is in flight at a time.
+ */
+static struct {
+    bool pending;
+    bool failed;
+    int cpus[MAX_CPUS];
+    int ncpus;
+    u64 chunk;
+    u64 last; // size of the last CPU's chunk
+    u32 expected;
+    void *data;
+} crc_job;
+
+static bool payload_crc_finish(void)
+{
+    if (crc_job.pending) {
+        u32 crc = smp_wait(crc_job.cpus[0]);
+
+        for (int i = 1; i < crc_job.ncpus; i++) {
+            u32 part = smp_wait(crc_job.cpus[i]);
+            crc = crc32_combine(crc, part, i == crc_job.ncpus - 1 ? crc_job.last : crc_job.chunk);
+        }
+
+        crc_job.pending = false;
+        if (crc != crc_job.expected) {
+            printf("CRC mismatch in payload at %p: 0x%08x != 0x%08x\n", crc_job.data, crc,
+                   crc_job.expected);
+            crc_job.failed = true;
+        }
+    }
+
+    return !crc_job.failed;
+}
+
+static bool payload_crc_start(void *data, u64 length, u32 expected)
+{
+    if (!payload_crc_finish())
+        return false;
+
+    crc_job.ncpus = 0;
+    if (length >= PARALLEL_CRC_MIN)
+        for (int i = 1; i < MAX_CPUS; i++)
+            if (smp_is_alive(i) && !smp_is_busy(i))
+                crc_job.cpus[crc_job.ncpus++] = i;
+
+    if (!crc_job.ncpus) {
+        if (crc32_chunk((u64)data, length) != expected) {
+            printf("CRC mismatch in payload at %p\n", data);
+            crc_job.failed = true;
+        }
+        return !crc_job.failed;
+    }
+
+    crc_job.chunk = ALIGN_UP(length / crc_job.ncpus, 64);
+    crc_job.last = length - crc_job.chunk * (crc_job.ncpus - 1);
+    crc_job.expected = expected;
+    crc_job.data = data;
+
+    u64 off = 0;
+    for (int i = 0; i < crc_job.ncpus; i++, off += crc_job.chunk)
+        smp_call2(crc_job.cpus[i], crc32_chunk, (u64)data + off,
+                  i == crc_job.ncpus - 1 ? crc_job.last : crc_job.chunk);
+
+    crc_job.pending = true;
+    return true;
+}
+
 static void finalize_uncompression(void *dest, size_t dest_len)
 {
     // Actually reserve the space. malloc is safe after this, but...
@@ -48,26 +194,40 @@ static void finalize_uncompression(void *dest, size_t dest_len)
         // Explicitly *un*aligned or it'll fail this assert, since 64b alignment is the default
         assert(end == heapblock_alloc_aligned((u8 *)next - (u8 *)end, 1));
     }
+
+    heapblock_release_top();
 }
 
 static void *decompress_gz(void *p, size_t size)
 {
     unsigned int source_len = size, dest_len = 1 << 30; // 1 GiB should be enough hopefully
 
+    // Secondaries help with checksumming, and bringing them up allocates their stacks
+    if (!chainload_spec)
+        smp_start_secondaries();
+
     // Start at the end of the heap area, no allocation yet. The following code must not use
     // malloc or heapblock, until finalize_uncompression is called.
-    void *dest = heapblock_alloc_aligned(0, KERNEL_ALIGN);
+    void *dest = heapblock_claim_top(KERNEL_ALIGN);
 
     printf("Uncompressing... ");
-    int ret = tinf_gzip_uncompress(dest, &dest_len, p, &source_len);
+    int ret = tinf_gzip_uncompress_crc(dest, &dest_len, p, &source_len, NULL);
 
     if (ret != TINF_OK) {
         printf("Error %d\n", ret);
+        heapblock_release_top();
         return NULL;
     }
 
     printf("%d bytes uncompressed to %d bytes\n", source_len, dest_len);
 
+    u32 expected;
+    memcpy(&expected, (u8 *)p + source_len - 8, sizeof(expected));
+    if (!payload_crc_start(dest, dest_len, expected)) {
+        heapblock_release_top();
+        return NULL;
+    }
+
     finalize_uncompression(dest, dest_len);
 
     return ((u8 *)p) + source_len;
@@ -79,13 +239,14 @@ static void *decompress_xz(void *p, size_t size)
 
     // Start at the end of the heap area, no allocation yet. The following code must not use
     // malloc or heapblock, until finalize_uncompression is called.
-    void *dest = heapblock_alloc_aligned(0, KERNEL_ALIGN);
+    void *dest = heapblock_claim_top(KERNEL_ALIGN);
 
     printf("Uncompressing... ");
     int ret = XzDecode(p, &source_len, dest, &dest_len);
 
     if (!ret) {
         printf("XZ decode failed\n");
+        heapblock_release_top();
         return NULL;
     }
 
@@ -96,11 +257,59 @@ static void *decompress_xz(void *p, size_t size)
     return ((u8 *)p) + source_len;
 }
 
+static void *decompress_zstd(void *p, size_t size)
+{
+    size_t source_len = size, dest_len = 1 << 30; // 1 GiB should be enough hopefully
+
+    // Start at the end of the heap area, no allocation yet. The following code must not use
+    // malloc or heapblock, until finalize_uncompression is called.
+    void *dest = heapblock_claim_top(KERNEL_ALIGN);
+
+    printf("Uncompressing... ");
+    int ret = zstd_decompress(dest, &dest_len, p, &source_len);
+
+    if (ret != ZSTD_OK) {
+        printf("Error %d\n", ret);
+        heapblock_release_top();
+        return NULL;
+    }
+
+    printf("%ld bytes uncompressed to %ld bytes\n", source_len, dest_len);
+
+    finalize_uncompression(dest, dest_len);
+
+    return ((u8 *)p) + source_len;
+}
+
+static void *decompress_lz4(void *p, size_t size)
+{
+    size_t source_len = size, dest_len = 1 << 30; // 1 GiB should be enough hopefully
+
+    // Start at the end of the heap area, no allocation yet. The following code must not use
+    // malloc or heapblock, until finalize_uncompression is called.
+    void *dest = heapblock_claim_top(KERNEL_ALIGN);
+
+    printf("Uncompressing... ");
+    int ret = lz4_decompress(dest, &dest_len, p, &source_len);
+
+    if (ret != LZ4_OK) {
+        printf("Error %d\n", ret);
+        heapblock_release_top();
+        return NULL;
+    }
+
+    printf("%ld bytes uncompressed to %ld bytes\n", source_len, dest_len);
+
+    finalize_uncompression(dest, dest_len);
+
+    return ((u8 *)p) + source_len;
+}
+
 static void *load_fdt(void *p, size_t size)
 {
     if (fdt_node_check_compatible(p, 0, expect_compatible) == 0) {
         printf("Found a devicetree for %s at %p\n", expect_compatible, p);
-        fdt = p;
+        plan.fdt = p;
     }
     assert(!size || size == fdt_totalsize(p));
     return ((u8 *)p) + fdt_totalsize(p);
@@ -114,22 +323,19 @@ static void *load_cpio(void *p, size_t size)
         return NULL;
     }
 
-    kboot_set_initrd(p, size);
+    plan.initrd = p;
+    plan.initrd_size = size;
     return ((u8 *)p) + size;
 }
 
 static void *load_kernel(void *p, size_t size)
 {
-    kernel = p;
+    struct kernel_header *kernel = p;
 
     assert(size <= kernel->image_size);
 
-    // If this is an in-line kernel, it's probably not aligned, so we need to make a copy
-    if (((u64)kernel) & (KERNEL_ALIGN - 1)) {
-        void *new_addr = heapblock_alloc_aligned(kernel->image_size, KERNEL_ALIGN);
-        memcpy(new_addr, kernel, size ? size : kernel->image_size);
-        kernel = new_addr;
-    }
+    plan.kernel = kernel;
+    plan.kernel_size = size;
 
     /*
      * Kernel blobs unfortunately do not have an accurate file size header, so
@@ -177,8 +383,21 @@ static bool check_var(u8 **p)
             chosen[chosen_cnt++] = (char *)*p;
     } else if (IS_VAR("chainload=")) {
         chainload_spec = val;
+    } else if (IS_VAR("chainload_cache=")) {
+        chainload_set_cache(val[0] == '1');
+    } else if (IS_VAR("payload=")) {
+        if (disk_payload_cnt >= MAX_DISK_PAYLOADS)
+            printf("Too many disk payloads, ignoring %s\n", val);
+        else
+            disk_payloads[disk_payload_cnt++] = val;
     } else if (IS_VAR("display=")) {
         display_configure(val);
+    } else if (IS_VAR("handoff=")) {
+        kboot_set_handoff(val);
+    } else if (IS_VAR("memtest=")) {
+        memtest_passes = 0;
+        for (char *c = val; *c >= '0' && *c <= '9'; c++)
+            memtest_passes = memtest_passes * 10 + (*c - '0');
     } else {
         printf("Unknown variable %s\n", *p);
     }
@@ -200,6 +419,13 @@ static void *load_one_payload(void *start, size_t size)
     } else if (!memcmp(p, xz_magic, sizeof xz_magic)) {
         printf("Found an XZ compressed payload at %p\n", p);
         return decompress_xz(p, size);
+    } else if (!memcmp(p, zstd_magic, sizeof zstd_magic)) {
+        printf("Found a zstd compressed payload at %p\n", p);
+        return decompress_zstd(p, size);
+    } else if (!memcmp(p, lz4_magic, sizeof lz4_magic) ||
+               !memcmp(p, lz4_legacy_magic, sizeof lz4_legacy_magic)) {
+        printf("Found an LZ4 compressed payload at %p\n", p);
+        return decompress_lz4(p, size);
     } else if (!memcmp(p, fdt_magic, sizeof fdt_magic)) {
         return load_fdt(p, size);
     } else if (!memcmp(p, cpio_magic, sizeof cpio_magic)) {
@@ -226,6 +452,84 @@ static void *load_one_payload(void *start, size_t size)
     }
 }
 
+static void *load_disk_payload(const char *spec)
+{
+    void *p;
+    size_t size;
+
+    // Aligned for a raw kernel, so it can run from where it was read
+    if (chainload_read_file(spec, KERNEL_ALIGN, &p, &size) < 0) {
+        printf("Failed to load payload %s\n", spec);
+        return NULL;
+    }
+
+    printf("Loaded %s at %p (0x%lx bytes)\n", spec, p, size);
+
+    /*
+     * A raw kernel needs its whole image_size reserved. The file is the last thing on the heap
+     * unless the loader allocated after placing it, in which case it has to move.
+     */
+    struct kernel_header *kernel = p;
+    if (size >= sizeof(*kernel) && !memcmp(&kernel->magic, kernel_magic, sizeof kernel_magic) &&
+        kernel->image_size > size) {
+        u8 *end = (u8 *)p + size;
+
+        if (!heapblock_extend(end, kernel->image_size - size)) {
+            void *new_addr = heapblock_alloc_aligned(kernel->image_size, KERNEL_ALIGN);
+            memcpy_simd(new_addr, p, size);
+            p = new_addr;
+        }
+    }
+
+    return load_one_payload(p, size);
+}
+
+static bool load_disk_payloads(void)
+{
+    bool ok = true;
+
+    if (!disk_payload_cnt)
+        return true;
+
+    if (!nvme_init()) {
+        printf("NVMe init failed, can't load payloads from disk\n");
+        return false;
+    }
+
+    for (size_t i = 0; i < disk_payload_cnt && ok; i++)
+        ok = load_disk_payload(disk_payloads[i]) != NULL;
+
+    nvme_shutdown();
+    return ok;
+}
+
+static void payload_place(void)
+{
+    /*
+     * A devicetree that came out of a decompressor may be at the top of the heap already,
+     * page aligned. If so, grow the reservation and let kboot edit it right there.
+     */
+    u8 *fdt_end = (u8 *)plan.fdt + fdt_totalsize(plan.fdt);
+    if (!((u64)plan.fdt & (KBOOT_DT_ALIGN - 1))) {
+        size_t bufsize = kboot_dt_budget(plan.fdt);
+
+        if (heapblock_extend(fdt_end, bufsize - fdt_totalsize(plan.fdt)))
+            plan.fdt_bufsize = bufsize;
+    }
+
+    struct kernel_header *kernel = plan.kernel;
+
+    // If this is an in-line kernel, it's probably not aligned, so we need to make a copy
+    if (((u64)kernel) & (KERNEL_ALIGN - 1)) {
+        void *new_addr = heapblock_alloc_aligned(kernel->image_size, KERNEL_ALIGN);
+        memcpy_simd(new_addr, kernel, plan.kernel_size ? plan.kernel_size : kernel->image_size);
+        plan.kernel = new_addr;
+    }
+
+    if (plan.initrd)
+        kboot_set_initrd(plan.initrd, plan.initrd_size);
+}
+
 int payload_run(void)
 {
     const char *target = adt_getprop(adt, 0, "target-type", NULL);
@@ -243,19 +547,36 @@ int payload_run(void)
     }
 
     chosen_cnt = 0;
+    disk_payload_cnt = 0;
+    memtest_passes = 0;
+    memset(&plan, 0, sizeof(plan));
+    crc_job.failed = false;
 
     void *p = _payload_start;
 
     while (p)
         p = load_one_payload(p, 0);
 
+    if (!load_disk_payloads())
+        return -1;
+
+    if (!payload_crc_finish())
+        return -1;
+
+    bootprof_mark(BOOTPROF_PAYLOAD_LOAD);
+
+    // Burn-in: a machine with bad RAM stays in m1n1 instead of booting
+    if (memtest_passes && memtest_free_ram(memtest_passes)) {
+        printf("RAM test failed, not booting\n");
+        return -1;
+    }
+
     if (chainload_spec) {
         return chainload_load(chainload_spec, chosen, chosen_cnt);
     }
 
-    if (kernel && fdt) {
-        smp_start_secondaries();
-
+    if (plan.kernel && plan.fdt) {
+        // The chosen params count towards the FDT budget, so they must be known before placing it
         for (size_t i = 0; i < chosen_cnt; i++) {
             char *val = memchr(chosen[i], '=', MAX_VAR_NAME + 1);
 
@@ -265,15 +586,26 @@ int payload_run(void)
                 printf("Failed to kboot set %s='%s'\n", chosen[i], val);
         }
 
-        if (kboot_prepare_dt(fdt)) {
+        payload_place();
+        bootprof_mark(BOOTPROF_PAYLOAD_PLACE);
+        smp_start_secondaries();
+        bootprof_mark(BOOTPROF_SMP);
+
+        int ret;
+        if (plan.fdt_bufsize)
+            ret = kboot_prepare_dt_inplace(plan.fdt, plan.fdt_bufsize);
+        else
+            ret = kboot_prepare_dt(plan.fdt);
+
+        if (ret) {
             printf("Failed to prepare FDT!\n");
             return -1;
         }
 
-        return kboot_boot(kernel);
-    } else if (kernel && !fdt) {
+        return kboot_boot(plan.kernel);
+    } else if (plan.kernel && !plan.fdt) {
         printf("ERROR: Kernel found but no devicetree for %s available.\n", expect_compatible);
-    } else if (!kernel && fdt) {
+    } else if (!plan.kernel && plan.fdt) {
         printf("ERROR: Devicetree found but no kernel.\n");
     }
 
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: MIT */
 
 #include "adt.h"
+#include "coro.h"
 #include "pcie.h"
 #include "pmgr.h"
 #include "tunables.h"
@@ -117,6 +118,9 @@ static u64 port_base[8];
 
 #define SHARED_REG_COUNT 6
 
+// Shared by all ports, each one gets this long to come out of reset and for its link to settle
+#define PCIE_PORT_TIMEOUT 500000
+
 int pcie_init(void)
 {
     const char *path = "/arm-io/apcie";
@@ -260,9 +264,15 @@ int pcie_init(void)
         return -1;
     }
 
+    u64 port_config[8];
+    u32 started = 0;
+
+    /*
+     * Release every port from reset first and only then wait for them, all against the same
+     * deadline, so ports that are slow to train or empty don't hold up the others.
+     */
     for (u32 port = 0; port < port_count; port++) {
         char bridge[64];
-        int bridge_offset;
 
         /*
          * Initialize RC port.
@@ -270,7 +280,7 @@ int pcie_init(void)
 
         snprintf(bridge, sizeof(bridge), "/arm-io/apcie/pci-bridge%d", port);
 
-        if ((bridge_offset = adt_path_offset(adt, bridge)) < 0)
+        if (adt_path_offset(adt, bridge) < 0)
             continue;
 
         printf("pcie: Initializing port %d\n", port);
@@ -292,17 +302,61 @@ int pcie_init(void)
         /* PERSTN */
         set32(port_base[port] + APCIE_PORT_RESET, APCIE_PORT_RESET_DIS);
 
-        if (poll32(port_base[port] + APCIE_PORT_STATUS, APCIE_PORT_STATUS_RUN,
-                   APCIE_PORT_STATUS_RUN, 250000)) {
-            printf("pcie: Port failed to come up on %s\n", bridge);
-            return -1;
+        port_config[port] = config_base;
+        started |= BIT(port);
+
+        /* Move to the next PCIe device on this bus. */
+        config_base += (1 << 15);
+    }
+
+    u32 running = 0, ready = 0;
+    u64 timeout = timeout_calculate(PCIE_PORT_TIMEOUT);
+
+    while (ready != started && !timeout_expired(timeout)) {
+        for (u32 port = 0; port < port_count; port++) {
+            if (!(started & BIT(port)) || (ready & BIT(port)))
+                continue;
+
+            if (!(running & BIT(port))) {
+                if (read32(port_base[port] + APCIE_PORT_STATUS) & APCIE_PORT_STATUS_RUN)
+                    running |= BIT(port);
+                continue;
+            }
+
+            if (!(read32(port_base[port] + APCIE_PORT_LINKSTS) & APCIE_PORT_LINKSTS_BUSY))
+                ready |= BIT(port);
         }
 
-        if (poll32(port_base[port] + APCIE_PORT_LINKSTS, APCIE_PORT_LINKSTS_BUSY, 0, 250000)) {
+        if (ready != started)
+            coro_yield();
+    }
+
+    int ret = 0;
+
+    for (u32 port = 0; port < port_count; port++) {
+        char bridge[64];
+        int bridge_offset;
+
+        if (!(started & BIT(port)))
+            continue;
+
+        snprintf(bridge, sizeof(bridge), "/arm-io/apcie/pci-bridge%d", port);
+        bridge_offset = adt_path_offset(adt, bridge);
+
+        // A port that didn't make it is left alone, the others are still set up
+        if (!(running & BIT(port))) {
+            printf("pcie: Port failed to come up on %s\n", bridge);
+            ret = -1;
+            continue;
+        }
+        if (!(ready & BIT(port))) {
             printf("pcie: Port failed to become idle on %s\n", bridge);
-            return -1;
+            ret = -1;
+            continue;
         }
 
+        config_base = port_config[port];
+
         /* Make Designware PCIe Core registers writable. */
         set32(config_base + DWC_DBI_RO_WR, DWC_DBI_RO_WR_EN);
 
@@ -356,11 +410,11 @@ int pcie_init(void)
 
         /* Make Designware PCIe Core registers readonly. */
         clear32(config_base + DWC_DBI_RO_WR, DWC_DBI_RO_WR_EN);
-
-        /* Move to the next PCIe device on this bus. */
-        config_base += (1 << 15);
     }
 
+    if (ret)
+        return ret;
+
     pcie_initialized = true;
     printf("pcie: Initialized.\n");
 
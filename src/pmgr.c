@@ -2,6 +2,7 @@
 
 #include "pmgr.h"
 #include "adt.h"
+#include "malloc.h"
 #include "string.h"
 #include "types.h"
 #include "utils.h"
@@ -24,6 +25,8 @@
 
 #define PMGR_FLAG_VIRTUAL 0x10
 
+#define PMGR_MAX_DEPTH 16
+
 struct pmgr_device {
     u32 flags;
     u16 parent[2];
@@ -48,6 +51,14 @@ static u32 pmgr_ps_regs_len = 0;
 static const struct pmgr_device *pmgr_devices = NULL;
 static u32 pmgr_devices_len = 0;
 
+/*
+ * Built by pmgr_init(): the die 0 PS register of every device, and an id -> index map so lookups
+ * don't have to scan the devices array.
+ */
+static uintptr_t *pmgr_device_addrs = NULL;
+static u16 *pmgr_id_map = NULL; // index + 1, 0 if there is no such device
+static u32 pmgr_id_max = 0;
+
 static uintptr_t pmgr_get_psreg(u8 idx)
 {
     if (idx * 12 >= pmgr_ps_regs_len) {
@@ -82,6 +93,14 @@ static int pmgr_set_mode(uintptr_t addr, u8 target_mode)
 
 static int pmgr_find_device(u16 id, const struct pmgr_device **device)
 {
+    if (pmgr_id_map) {
+        if (id > pmgr_id_max || !pmgr_id_map[id])
+            return -1;
+
+        *device = &pmgr_devices[pmgr_id_map[id] - 1];
+        return 0;
+    }
+
     for (size_t i = 0; i < pmgr_devices_len; ++i) {
         const struct pmgr_device *i_device = &pmgr_devices[i];
         if (i_device->id != id)
@@ -96,7 +115,12 @@ static int pmgr_find_device(u16 id, const struct pmgr_device **device)
 
 static uintptr_t pmgr_device_get_addr(u8 die, const struct pmgr_device *device)
 {
-    uintptr_t addr = pmgr_get_psreg(device->psreg_idx);
+    uintptr_t addr;
+
+    if (pmgr_device_addrs && pmgr_device_addrs[device - pmgr_devices])
+        return pmgr_device_addrs[device - pmgr_devices] + PMGR_DIE_OFFSET * die;
+
+    addr = pmgr_get_psreg(device->psreg_idx);
     if (addr == 0)
         return 0;
 
@@ -106,55 +130,176 @@ static uintptr_t pmgr_device_get_addr(u8 die, const struct pmgr_device *device)
     return addr;
 }
 
-static int pmgr_set_mode_recursive(u8 die, u16 id, u8 target_mode, bool recurse)
+/*
+ * Add a device and, when enabling, its parents ahead of it. Returns the device's level: 0 for
+ * devices with no parents in the batch, otherwise one more than its highest parent.
+ */
+static int pmgr_batch_add_device(struct pmgr_batch *batch, u8 die, u16 id, int depth)
 {
-    if (!pmgr_initialized) {
-        printf("pmgr: pmgr_set_mode_recursive() called before successful pmgr_init()\n");
-        return -1;
-    }
+    const struct pmgr_device *device;
+    int level = 0;
 
     if (id == 0)
         return -1;
 
-    const struct pmgr_device *device;
-
     if (pmgr_find_device(id, &device))
         return -1;
 
-    if (!(device->flags & PMGR_FLAG_VIRTUAL)) {
-        uintptr_t addr = pmgr_device_get_addr(die, device);
-        if (!addr)
-            return -1;
-        if (pmgr_set_mode(addr, target_mode))
+    u16 index = device - pmgr_devices;
+    for (u32 i = 0; i < batch->count; i++)
+        if (batch->ent[i].index == index && batch->ent[i].die == die)
+            return batch->ent[i].level;
+
+    if (batch->mode == PMGR_PS_ACTIVE) {
+        if (depth >= PMGR_MAX_DEPTH) {
+            printf("pmgr: parent chain of %s is too deep\n", device->name);
             return -1;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (device->parent[i]) {
+                u16 parent = FIELD_GET(PMGR_DEVICE_ID, device->parent[i]);
+                int ret = pmgr_batch_add_device(batch, die, parent, depth + 1);
+                if (ret < 0)
+                    return ret;
+                level = max(level, ret + 1);
+            }
+        }
     }
-    if (!recurse)
-        return 0;
 
-    for (int i = 0; i < 2; i++) {
-        if (device->parent[i]) {
-            u16 parent = FIELD_GET(PMGR_DEVICE_ID, device->parent[i]);
-            int ret = pmgr_set_mode_recursive(die, parent, target_mode, true);
-            if (ret < 0)
-                return ret;
+    if (batch->count >= PMGR_BATCH_MAX) {
+        printf("pmgr: too many devices to switch at once\n");
+        return -1;
+    }
+
+    batch->ent[batch->count].index = index;
+    batch->ent[batch->count].die = die;
+    batch->ent[batch->count].level = level;
+    batch->ent[batch->count].done = false;
+    batch->count++;
+
+    return level;
+}
+
+void pmgr_batch_init(struct pmgr_batch *batch, bool enable)
+{
+    batch->count = 0;
+    batch->mode = enable ? PMGR_PS_ACTIVE : PMGR_PS_PWRGATE;
+}
+
+int pmgr_batch_add_id(struct pmgr_batch *batch, u32 id)
+{
+    if (!pmgr_initialized) {
+        printf("pmgr: pmgr_batch_add_id() called before successful pmgr_init()\n");
+        return -1;
+    }
+
+    u16 device = FIELD_GET(PMGR_DEVICE_ID, id);
+    u8 die = FIELD_GET(PMGR_DIE_ID, id);
+
+    return pmgr_batch_add_device(batch, die, device, 0) < 0 ? -1 : 0;
+}
+
+int pmgr_batch_start(struct pmgr_batch *batch)
+{
+    u8 max_level = 0;
+
+    for (u32 i = 0; i < batch->count; i++)
+        max_level = max(max_level, batch->ent[i].level);
+
+    // Parents are always at a lower level than their children, so go one level at a time
+    for (u8 level = 0; level <= max_level; level++) {
+        for (u32 i = 0; i < batch->count; i++) {
+            const struct pmgr_device *device = &pmgr_devices[batch->ent[i].index];
+
+            if (batch->ent[i].level != level)
+                continue;
+
+            if (device->flags & PMGR_FLAG_VIRTUAL) {
+                batch->ent[i].done = true;
+                continue;
+            }
+
+            uintptr_t addr = pmgr_device_get_addr(batch->ent[i].die, device);
+            if (!addr)
+                return -1;
+
+            mask32(addr, PMGR_PS_TARGET, FIELD_PREP(PMGR_PS_TARGET, batch->mode));
         }
     }
 
     return 0;
 }
 
+int pmgr_batch_wait(struct pmgr_batch *batch)
+{
+    u32 pending = 0;
+    int ret = 0;
+
+    for (u32 i = 0; i < batch->count; i++)
+        if (!batch->ent[i].done)
+            pending++;
+
+    for (u32 timeout = PMGR_POLL_TIMEOUT; pending && --timeout > 0;) {
+        for (u32 i = 0; i < batch->count; i++) {
+            if (batch->ent[i].done)
+                continue;
+
+            const struct pmgr_device *device = &pmgr_devices[batch->ent[i].index];
+            uintptr_t addr = pmgr_device_get_addr(batch->ent[i].die, device);
+
+            if (FIELD_GET(PMGR_PS_ACTUAL, read32(addr)) == batch->mode) {
+                batch->ent[i].done = true;
+                pending--;
+            }
+        }
+
+        if (pending)
+            udelay(1);
+    }
+
+    for (u32 i = 0; pending && i < batch->count; i++) {
+        if (batch->ent[i].done)
+            continue;
+
+        const struct pmgr_device *device = &pmgr_devices[batch->ent[i].index];
+        uintptr_t addr = pmgr_device_get_addr(batch->ent[i].die, device);
+
+        printf("pmgr: timeout while trying to set mode %x for device at 0x%lx: %x\n", batch->mode,
+               addr, read32(addr));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int pmgr_batch_run(struct pmgr_batch *batch)
+{
+    if (pmgr_batch_start(batch))
+        return -1;
+
+    return pmgr_batch_wait(batch);
+}
+
+static int pmgr_set_mode_id(u32 id, bool enable)
+{
+    struct pmgr_batch batch;
+
+    pmgr_batch_init(&batch, enable);
+    if (pmgr_batch_add_id(&batch, id))
+        return -1;
+
+    return pmgr_batch_run(&batch);
+}
+
 int pmgr_power_enable(u32 id)
 {
-    u16 device = FIELD_GET(PMGR_DEVICE_ID, id);
-    u8 die = FIELD_GET(PMGR_DIE_ID, id);
-    return pmgr_set_mode_recursive(die, device, PMGR_PS_ACTIVE, true);
+    return pmgr_set_mode_id(id, true);
 }
 
 int pmgr_power_disable(u32 id)
 {
-    u16 device = FIELD_GET(PMGR_DEVICE_ID, id);
-    u8 die = FIELD_GET(PMGR_DIE_ID, id);
-    return pmgr_set_mode_recursive(die, device, PMGR_PS_PWRGATE, false);
+    return pmgr_set_mode_id(id, false);
 }
 
 static int pmgr_adt_find_devices(const char *path, const u32 **devices, u32 *n_devices)
@@ -176,7 +321,7 @@ static int pmgr_adt_find_devices(const char *path, const u32 **devices, u32 *n_d
     return 0;
 }
 
-static int pmgr_adt_devices_set_mode(const char *path, u8 target_mode, int recurse)
+int pmgr_batch_add_adt(struct pmgr_batch *batch, const char *path)
 {
     const u32 *devices;
     u32 n_devices;
@@ -185,25 +330,36 @@ static int pmgr_adt_devices_set_mode(const char *path, u8 target_mode, int recur
     if (pmgr_adt_find_devices(path, &devices, &n_devices) < 0)
         return -1;
 
-    for (u32 i = 0; i < n_devices; ++i) {
-        u16 device = FIELD_GET(PMGR_DEVICE_ID, devices[i]);
-        u8 die = FIELD_GET(PMGR_DIE_ID, devices[i]);
-        if (pmgr_set_mode_recursive(die, device, target_mode, recurse))
+    for (u32 i = 0; i < n_devices; ++i)
+        if (pmgr_batch_add_id(batch, devices[i]))
             ret = -1;
-    }
 
     return ret;
 }
 
-int pmgr_adt_power_enable(const char *path)
+static int pmgr_adt_devices_set_mode(const char *path, bool enable)
 {
-    int ret = pmgr_adt_devices_set_mode(path, PMGR_PS_ACTIVE, true);
+    struct pmgr_batch batch;
+    int ret;
+
+    pmgr_batch_init(&batch, enable);
+    ret = pmgr_batch_add_adt(&batch, path);
+
+    // Devices that were found still get switched, but the error is reported
+    if (pmgr_batch_run(&batch))
+        ret = -1;
+
     return ret;
 }
 
+int pmgr_adt_power_enable(const char *path)
+{
+    return pmgr_adt_devices_set_mode(path, true);
+}
+
 int pmgr_adt_power_disable(const char *path)
 {
-    return pmgr_adt_devices_set_mode(path, PMGR_PS_PWRGATE, false);
+    return pmgr_adt_devices_set_mode(path, false);
 }
 
 static int pmgr_reset_device(int die, const struct pmgr_device *dev)
@@ -304,6 +460,30 @@ int pmgr_init(void)
     }
 
     pmgr_devices_len /= sizeof(*pmgr_devices);
+
+    for (size_t i = 0; i < pmgr_devices_len; ++i)
+        pmgr_id_max = max(pmgr_id_max, pmgr_devices[i].id);
+
+    pmgr_device_addrs = calloc(pmgr_devices_len, sizeof(*pmgr_device_addrs));
+    pmgr_id_map = calloc(pmgr_id_max + 1, sizeof(*pmgr_id_map));
+    if (pmgr_device_addrs && pmgr_id_map) {
+        for (size_t i = 0; i < pmgr_devices_len; ++i) {
+            const struct pmgr_device *device = &pmgr_devices[i];
+
+            // First entry wins, like the linear search
+            if (!pmgr_id_map[device->id])
+                pmgr_id_map[device->id] = i + 1;
+            if (!(device->flags & PMGR_FLAG_VIRTUAL))
+                pmgr_device_addrs[i] = pmgr_device_get_addr(0, device);
+        }
+    } else {
+        printf("pmgr: out of memory for the device table, using slow lookups\n");
+        free(pmgr_device_addrs);
+        free(pmgr_id_map);
+        pmgr_device_addrs = NULL;
+        pmgr_id_map = NULL;
+    }
+
     pmgr_initialized = 1;
 
     printf("pmgr: Cleaning up device states...\n");
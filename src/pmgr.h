@@ -10,8 +10,32 @@
 #define PMGR_DEVICE_ID GENMASK(15, 0)
 #define PMGR_DIE_ID    GENMASK(31, 28)
 
+#define PMGR_BATCH_MAX 64
+
+/*
+ * A set of power domains switched together. pmgr_batch_start() writes every target state,
+ * parents before children, and returns without waiting; pmgr_batch_wait() then polls all of the
+ * domains in one loop. Enabling also pulls in each device's parents.
+ */
+struct pmgr_batch {
+    u32 count;
+    u8 mode;
+    struct {
+        u16 index;
+        u8 die;
+        u8 level;
+        bool done;
+    } ent[PMGR_BATCH_MAX];
+};
+
 int pmgr_init(void);
 
+void pmgr_batch_init(struct pmgr_batch *batch, bool enable);
+int pmgr_batch_add_id(struct pmgr_batch *batch, u32 id);
+int pmgr_batch_add_adt(struct pmgr_batch *batch, const char *path);
+int pmgr_batch_start(struct pmgr_batch *batch);
+int pmgr_batch_wait(struct pmgr_batch *batch);
+
 int pmgr_power_enable(u32 id);
 int pmgr_power_disable(u32 id);
 
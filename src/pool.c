@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "pool.h"
+#include "assert.h"
+#include "heapblock.h"
+#include "memstats.h"
+#include "smp.h"
+#include "utils.h"
+
+/*
+ * Size-class allocator for buffers that come and go over a long proxy session (RTKit buffers,
+ * DART tables, ...), which would otherwise keep growing the heap through memalign()'s alignment
+ * padding and fragmentation.
+ *
+ * Page allocations are rounded up to a power of two number of 16K pages and always 16K aligned.
+ * Small objects (up to 2K) are carved out of single pages, with per-CPU free lists so the fast
+ * path takes no lock. Freed blocks go back on the free list for their class and are never
+ * returned to heapblock. The size must be passed back on free, so there is no per-block header.
+ */
+
+#define POOL_PAGE          SZ_16K
+#define POOL_MAX_ORDER     12 // 64MB
+#define POOL_MIN_SHIFT     6  // 64 byte small objects
+#define POOL_SMALL_CLASSES 6
+#define POOL_SMALL_MAX     (1 << (POOL_MIN_SHIFT + POOL_SMALL_CLASSES - 1))
+
+struct pool_block {
+    struct pool_block *next;
+};
+
+static struct pool_block *page_free[POOL_MAX_ORDER + 1];
+static DECLARE_SPINLOCK(page_lock);
+
+static struct {
+    struct pool_block *free[POOL_SMALL_CLASSES];
+} ALIGNED(64) small_cache[MAX_CPUS];
+
+static int page_order(size_t size)
+{
+    size_t pages = (size + POOL_PAGE - 1) / POOL_PAGE;
+    int order = 0;
+
+    while ((1UL << order) < pages)
+        order++;
+
+    return order;
+}
+
+static int small_class(size_t size)
+{
+    int cls = 0;
+
+    while ((1UL << (POOL_MIN_SHIFT + cls)) < size)
+        cls++;
+
+    return cls;
+}
+
+void *pool_alloc_pages(size_t size)
+{
+    int order = page_order(size);
+
+    if (order > POOL_MAX_ORDER)
+        return NULL;
+
+    spin_lock(&page_lock);
+
+    struct pool_block *blk = page_free[order];
+    if (blk) {
+        page_free[order] = blk->next;
+    } else {
+        blk = heapblock_alloc_aligned(POOL_PAGE << order, POOL_PAGE);
+        memstat_reserve(MEMSTAT_POOL, POOL_PAGE << order);
+    }
+
+    spin_unlock(&page_lock);
+
+    memstat_alloc(MEMSTAT_POOL, POOL_PAGE << order);
+
+    return blk;
+}
+
+void pool_free_pages(void *p, size_t size)
+{
+    struct pool_block *blk = p;
+    int order = page_order(size);
+
+    if (!p)
+        return;
+
+    assert(order <= POOL_MAX_ORDER && !((u64)p & (POOL_PAGE - 1)));
+
+    spin_lock(&page_lock);
+    blk->next = page_free[order];
+    page_free[order] = blk;
+    spin_unlock(&page_lock);
+
+    memstat_free(MEMSTAT_POOL, POOL_PAGE << order);
+}
+
+void *pool_alloc(size_t size)
+{
+    if (size > POOL_SMALL_MAX)
+        return pool_alloc_pages(size);
+
+    int cls = small_class(size);
+    struct pool_block **list = &small_cache[smp_id()].free[cls];
+
+    if (!*list) {
+        u8 *page = pool_alloc_pages(POOL_PAGE);
+        size_t obj = 1 << (POOL_MIN_SHIFT + cls);
+
+        if (!page)
+            return NULL;
+
+        for (size_t off = POOL_PAGE; off; off -= obj) {
+            struct pool_block *blk = (void *)(page + off - obj);
+            blk->next = *list;
+            *list = blk;
+        }
+    }
+
+    struct pool_block *blk = *list;
+    *list = blk->next;
+
+    return blk;
+}
+
+void pool_free(void *p, size_t size)
+{
+    struct pool_block *blk = p;
+
+    if (!p)
+        return;
+
+    if (size > POOL_SMALL_MAX) {
+        pool_free_pages(p, size);
+        return;
+    }
+
+    struct pool_block **list = &small_cache[smp_id()].free[small_class(size)];
+    blk->next = *list;
+    *list = blk;
+}
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "types.h"
+
+void *pool_alloc(size_t size);
+void pool_free(void *p, size_t size);
+
+void *pool_alloc_pages(size_t size);
+void pool_free_pages(void *p, size_t size);
+
+#endif
@@ -1,6 +1,10 @@
 /* SPDX-License-Identifier: MIT */
 
 #include "proxy.h"
+#include "admac.h"
+#include "binlog.h"
+#include "bootprof.h"
+#include "chainload.h"
 #include "dapf.h"
 #include "dart.h"
 #include "display.h"
@@ -11,26 +15,283 @@
 #include "hv.h"
 #include "iodev.h"
 #include "kboot.h"
+#include "macho.h"
 #include "malloc.h"
 #include "mcc.h"
 #include "memory.h"
+#include "memstats.h"
+#include "memtest.h"
 #include "nvme.h"
 #include "pcie.h"
 #include "pmgr.h"
+#include "rtkit.h"
+#include "smc.h"
 #include "smp.h"
 #include "string.h"
+#include "sysreg.h"
 #include "tunables.h"
 #include "types.h"
 #include "uart.h"
 #include "uartproxy.h"
+#include "uat.h"
 #include "usb.h"
 #include "utils.h"
 #include "xnuboot.h"
 
+#include "lz4/lz4dec.h"
 #include "minilzlib/minlzma.h"
 #include "tinf/tinf.h"
+#include "zstd/zstddec.h"
 
-int proxy_process(ProxyRequest *request, ProxyReply *reply)
+static bool regop_read(u16 width, u64 addr, u64 *val)
+{
+    switch (width) {
+        case 64:
+            *val = read64(addr);
+            return true;
+        case 32:
+            *val = read32(addr);
+            return true;
+        case 16:
+            *val = read16(addr);
+            return true;
+        case 8:
+            *val = read8(addr);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool regop_write(u16 width, u64 addr, u64 val)
+{
+    switch (width) {
+        case 64:
+            write64(addr, val);
+            return true;
+        case 32:
+            write32(addr, val);
+            return true;
+        case 16:
+            write16(addr, val);
+            return true;
+        case 8:
+            write8(addr, val);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool regop_mask(u16 width, u64 addr, u64 clear, u64 set, u64 *val)
+{
+    switch (width) {
+        case 64:
+            *val = mask64(addr, clear, set);
+            return true;
+        case 32:
+            *val = mask32(addr, clear, set);
+            return true;
+        case 16:
+            *val = mask16(addr, clear, set);
+            return true;
+        case 8:
+            *val = mask8(addr, clear, set);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Run a list of register operations in order, storing one result per op if results is not
+ * NULL. Stops at the first op that fails (bad op/width, poll timeout or exception) and returns
+ * the number of ops that completed successfully.
+ */
+static u64 proxy_regop_batch(const RegOp *ops, u64 count, u64 *results)
+{
+    for (u64 i = 0; i < count; i++) {
+        const RegOp *op = &ops[i];
+        int exc_start = exc_count;
+        bool ok = false;
+        u64 val = 0;
+
+        switch (op->op) {
+            case REGOP_READ:
+                ok = regop_read(op->width, op->addr, &val);
+                break;
+            case REGOP_WRITE:
+                ok = regop_write(op->width, op->addr, op->value);
+                break;
+            case REGOP_MASK:
+                ok = regop_mask(op->width, op->addr, op->mask, op->value, &val);
+                break;
+            case REGOP_POLL: {
+                u64 timeout = timeout_calculate(op->timeout);
+                while ((ok = regop_read(op->width, op->addr, &val))) {
+                    if ((val & op->mask) == op->value)
+                        break;
+                    if (timeout_expired(timeout) || exc_count != exc_start) {
+                        ok = false;
+                        break;
+                    }
+                }
+                break;
+            }
+            case REGOP_DELAY:
+                udelay(op->value);
+                ok = true;
+                break;
+        }
+
+        if (results)
+            results[i] = val;
+
+        if (!ok || exc_count != exc_start)
+            return i;
+    }
+
+    return count;
+}
+
+/*
+ * Optional accounting of where proxy time goes: per-opcode call counts and time spent in
+ * proxy_process, plus the link side of the request loop in uartproxy.c. Ops that re-enter the
+ * proxy (calls and the hypervisor) include the nested requests in their time.
+ */
+bool proxy_stats_enabled = false;
+
+static struct proxy_stats link_stats;
+static struct proxy_op_stat op_stats[PROXY_STATS_MAX_OPS];
+
+static void proxy_stats_op(u64 opcode, u64 ticks)
+{
+    u32 slot = (opcode * 0x9e3779b1) % PROXY_STATS_MAX_OPS;
+
+    for (int i = 0; i < PROXY_STATS_MAX_OPS; i++) {
+        struct proxy_op_stat *s = &op_stats[(slot + i) % PROXY_STATS_MAX_OPS];
+
+        if (s->calls && s->opcode != opcode)
+            continue;
+
+        s->opcode = opcode;
+        s->calls++;
+        s->ticks += ticks;
+        return;
+    }
+}
+
+void proxy_stats_link(u64 idle, u64 rx, u64 tx)
+{
+    link_stats.requests++;
+    link_stats.idle_ticks += idle;
+    link_stats.rx_ticks += rx;
+    link_stats.tx_ticks += tx;
+}
+
+/*
+ * Copy out a struct proxy_stats followed by as many used opcode entries as fit in size, then
+ * apply flags. Returns the number of opcode entries copied, or -1 if the header doesn't fit.
+ */
+int proxy_stats_get(void *buf, size_t size, u64 flags)
+{
+    struct proxy_stats *out = buf;
+    struct proxy_op_stat *ops = (void *)(out + 1);
+    size_t count = 0;
+
+    if (size < sizeof(*out))
+        return -1;
+
+    size_t max = (size - sizeof(*out)) / sizeof(*ops);
+
+    for (int i = 0; i < PROXY_STATS_MAX_OPS && count < max; i++)
+        if (op_stats[i].calls)
+            ops[count++] = op_stats[i];
+
+    *out = link_stats;
+    out->enabled = proxy_stats_enabled;
+    out->op_count = count;
+
+    if (flags & PROXY_STATS_RESET) {
+        memset(&link_stats, 0, sizeof(link_stats));
+        memset(op_stats, 0, sizeof(op_stats));
+    }
+    if (flags & PROXY_STATS_DISABLE)
+        proxy_stats_enabled = false;
+    if (flags & PROXY_STATS_ENABLE)
+        proxy_stats_enabled = true;
+
+    return count;
+}
+
+static int proxy_dispatch(ProxyRequest *request, ProxyReply *reply, bool async);
+
+/*
+ * Tagged requests that run on a secondary CPU while the boot CPU keeps serving the link, one at a
+ * time per CPU. Completion is reported with an EVT_ASYNC_DONE event. Exception guards are global,
+ * so async requests must not depend on them, and the CPU must not be used with P_SMP_CALL at the
+ * same time.
+ */
+static struct {
+    ProxyRequest request;
+    ProxyReply reply;
+    u32 tag;
+    volatile bool busy;
+} async_jobs[MAX_CPUS];
+
+static u64 proxy_async_run(u64 cpu)
+{
+    struct proxy_async_done done;
+
+    proxy_dispatch(&async_jobs[cpu].request, &async_jobs[cpu].reply, true);
+
+    done.tag = async_jobs[cpu].tag;
+    done.cpu = cpu;
+    done.opcode = async_jobs[cpu].reply.opcode;
+    done.status = async_jobs[cpu].reply.status;
+    done.retval = async_jobs[cpu].reply.retval;
+    uartproxy_send_event(EVT_ASYNC_DONE, &done, sizeof(done));
+
+    async_jobs[cpu].busy = false;
+    return done.retval;
+}
+
+/*
+ * args[0] holds the CPU in bits 0-7 and the tag in bits 16-31, args[1] the opcode and args[2..5]
+ * its first four arguments.
+ */
+static int proxy_async_submit(ProxyRequest *request)
+{
+    int cpu = request->args[0] & 0xff;
+    u64 opcode = request->args[1];
+
+    if (cpu >= MAX_CPUS || cpu == smp_id() || !smp_is_alive(cpu) || async_jobs[cpu].busy)
+        return -1;
+
+    switch (opcode) {
+        case P_EXIT:
+        case P_ASYNC_SUBMIT:
+        case P_ASYNC_WAIT:
+        case P_REBOOT:
+        case P_REBOOT_WARM:
+        case P_KBOOT_BOOT:
+            return -1;
+    }
+
+    // Let the previous job finish returning before its spin table slot is reused
+    smp_wait(cpu);
+
+    memset(&async_jobs[cpu].request, 0, sizeof(async_jobs[cpu].request));
+    async_jobs[cpu].request.opcode = opcode;
+    memcpy(async_jobs[cpu].request.args, &request->args[2], 4 * sizeof(u64));
+    async_jobs[cpu].tag = (request->args[0] >> 16) & 0xffff;
+    async_jobs[cpu].busy = true;
+
+    smp_call1(cpu, proxy_async_run, cpu);
+    return 0;
+}
+
+static int proxy_dispatch(ProxyRequest *request, ProxyReply *reply, bool async)
 {
     enum exc_guard_t guard_save = exc_guard;
 
@@ -103,6 +364,35 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
             reply->retval = gl2_call((void *)request->args[0], request->args[1], request->args[2],
                                      request->args[3], request->args[4]);
             break;
+        case P_EL0_CALL_BATCH:
+            reply->retval = el0_call_batch((struct el_call *)request->args[0], request->args[1],
+                                           (u64 *)request->args[2]);
+            break;
+        case P_EL1_CALL_BATCH:
+            reply->retval = el1_call_batch((struct el_call *)request->args[0], request->args[1],
+                                           (u64 *)request->args[2]);
+            break;
+        case P_GL1_CALL_BATCH:
+            reply->retval = gl1_call_batch((struct gl_call *)request->args[0], request->args[1]);
+            break;
+        case P_GL2_CALL_BATCH:
+            reply->retval = gl2_call_batch((struct gl_call *)request->args[0], request->args[1]);
+            break;
+        case P_MRS:
+            exc_guard = GUARD_SKIP | (request->args[1] ? GUARD_SILENT : 0);
+            if (!sysreg_read(request->args[0], &reply->retval))
+                reply->status = S_EXC;
+            break;
+        case P_MSR:
+            exc_guard = GUARD_SKIP | (request->args[2] ? GUARD_SILENT : 0);
+            if (!sysreg_write(request->args[0], request->args[1]))
+                reply->status = S_EXC;
+            break;
+        case P_SYSREG_DUMP:
+            exc_guard = GUARD_SKIP | (request->args[4] ? GUARD_SILENT : 0);
+            reply->retval = sysreg_dump(request->args[0], (const u32 *)request->args[1],
+                                        request->args[2], (u64 *)request->args[3]);
+            break;
         case P_GET_SIMD_STATE:
             get_simd_state((void *)request->args[0]);
             break;
@@ -112,6 +402,59 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_REBOOT:
             reboot();
             break;
+        case P_REBOOT_WARM:
+            if (chainload_restart() < 0) {
+                reply->retval = -1;
+                break;
+            }
+            // forcefully restore tps6598x IRQs
+            usb_hpm_restore_irqs(1);
+            iodev_console_flush();
+            return 1;
+        case P_GET_BOOT_PROFILE:
+            reply->retval = bootprof_get((u64 *)request->args[0], request->args[1]);
+            break;
+        case P_LINK_ECHO:
+            // Touches nothing but the request, for measuring the link itself
+            reply->retval = request->args[0];
+            break;
+        case P_LINK_EVENTS:
+            if (request->args[1] > 0xffff) {
+                reply->retval = -1;
+                break;
+            }
+            for (u64 i = 0; i < request->args[0]; i++)
+                uartproxy_send_event(EVT_LINK_TEST, (void *)request->args[2], request->args[1]);
+            reply->retval = request->args[0];
+            break;
+        case P_PROXY_STATS:
+            reply->retval =
+                proxy_stats_get((void *)request->args[0], request->args[1], request->args[2]);
+            break;
+        case P_SPINLOCK_STATS:
+            reply->retval = spinlock_stats_get((struct spinlock_stat_entry *)request->args[0],
+                                               request->args[1], request->args[2]);
+            break;
+        case P_EVENT_POLICY:
+            reply->retval = uartproxy_set_event_policy(request->args[0]);
+            break;
+        case P_EVENT_STATS:
+            reply->retval = uartproxy_event_stats((u64 *)request->args[0], request->args[1]);
+            break;
+        case P_ASYNC_SUBMIT:
+            reply->retval = proxy_async_submit(request);
+            break;
+        case P_ASYNC_WAIT:
+            if (request->args[0] < MAX_CPUS)
+                smp_wait(request->args[0]);
+            break;
+        case P_BINLOG_READ:
+            reply->retval = binlog_read((void *)request->args[0], request->args[1],
+                                        request->args[2]);
+            break;
+        case P_BINLOG_DUMP:
+            binlog_dump(request->args[0]);
+            break;
 
         case P_WRITE64:
             exc_guard = GUARD_SKIP;
@@ -214,6 +557,11 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
             exc_guard = GUARD_MARK;
             reply->retval = writeread8(request->args[0], request->args[1]);
             break;
+        case P_REGOP_BATCH:
+            exc_guard = GUARD_MARK;
+            reply->retval = proxy_regop_batch((const RegOp *)request->args[0], request->args[1],
+                                              (u64 *)request->args[2]);
+            break;
 
         case P_MEMCPY64:
             exc_guard = GUARD_RETURN;
@@ -248,6 +596,44 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
             exc_guard = GUARD_RETURN;
             memset8((void *)request->args[0], request->args[1], request->args[2]);
             break;
+        case P_MEMSET_PARALLEL:
+            exc_guard = GUARD_RETURN;
+            memset64_parallel((void *)request->args[0], request->args[1], request->args[2]);
+            break;
+        case P_MEMCPY_BULK:
+            exc_guard = GUARD_RETURN;
+            memcpy_bulk((void *)request->args[0], (void *)request->args[1], request->args[2],
+                        request->args[3]);
+            break;
+        case P_MEMDIFF32:
+            exc_guard = GUARD_RETURN;
+            reply->retval =
+                memdiff32((void *)request->args[0], (void *)request->args[1], request->args[2],
+                          (struct memdiff_entry *)request->args[3], request->args[4]);
+            break;
+        case P_MEMWATCH32:
+            exc_guard = GUARD_RETURN;
+            reply->retval = memwatch32((struct memwatch_entry *)request->args[0], request->args[1],
+                                       request->args[2]);
+            break;
+        case P_MEMPROBE:
+            exc_guard = GUARD_SKIP | GUARD_SILENT;
+            reply->retval = memprobe(request->args[0], request->args[1], request->args[2],
+                                     request->args[3], (u8 *)request->args[4],
+                                     (void *)request->args[5]);
+            break;
+        case P_MEMTEST:
+            reply->retval = memtest_run(request->args[0], request->args[1], request->args[2], true);
+            break;
+        case P_MEMHASH:
+            exc_guard = GUARD_RETURN;
+            reply->retval = memhash((void *)request->args[0], request->args[1], request->args[2],
+                                    (u64 *)request->args[3]);
+            break;
+        case P_HASH:
+            exc_guard = GUARD_RETURN;
+            reply->retval = memhash_range((void *)request->args[0], request->args[1]);
+            break;
 
         case P_IC_IALLUIS:
             ic_ialluis();
@@ -274,13 +660,13 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
             dc_zva_range((void *)request->args[0], request->args[1]);
             break;
         case P_DC_CVAC:
-            dc_cvac_range((void *)request->args[0], request->args[1]);
+            dc_cvac_range_auto((void *)request->args[0], request->args[1]);
             break;
         case P_DC_CVAU:
             dc_cvau_range((void *)request->args[0], request->args[1]);
             break;
         case P_DC_CIVAC:
-            dc_civac_range((void *)request->args[0], request->args[1]);
+            dc_civac_range_auto((void *)request->args[0], request->args[1]);
             break;
         case P_MMU_SHUTDOWN:
             mmu_shutdown();
@@ -288,6 +674,9 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_MMU_INIT:
             mmu_init();
             break;
+        case P_MMU_GET_STATS:
+            reply->retval = mmu_get_stats((struct mmu_stats *)request->args[0], request->args[1]);
+            break;
         case P_MMU_DISABLE:
             reply->retval = mmu_disable();
             break;
@@ -320,6 +709,30 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
                 reply->retval = destlen;
             break;
         }
+        case P_ZSTDDEC: {
+            size_t destlen = request->args[3], srclen = request->args[1];
+            int ret = zstd_decompress((void *)request->args[2], &destlen, (void *)request->args[0],
+                                      &srclen);
+            if (ret != ZSTD_OK)
+                reply->retval = ret;
+            else
+                reply->retval = destlen;
+            break;
+        }
+        case P_LZ4DEC: {
+            size_t destlen = request->args[3], srclen = request->args[1];
+            int ret = lz4_decompress((void *)request->args[2], &destlen, (void *)request->args[0],
+                                     &srclen);
+            if (ret != LZ4_OK)
+                reply->retval = ret;
+            else
+                reply->retval = destlen;
+            break;
+        }
+        case P_MACHO_LOAD:
+            reply->retval = macho_load((void *)request->args[0], request->args[1],
+                                       (void *)request->args[2], request->args[3]);
+            break;
 
         case P_SMP_START_SECONDARIES:
             smp_start_secondaries();
@@ -339,6 +752,17 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_SMP_SET_WFE_MODE:
             smp_set_wfe_mode(request->args[0]);
             break;
+        case P_SMP_CALL_MANY:
+            reply->retval = smp_call_many(request->args[0], (void *)request->args[1],
+                                          request->args[2], request->args[3], request->args[4],
+                                          request->args[5]);
+            break;
+        case P_SMP_WAIT_ALL:
+            smp_wait_all(request->args[0]);
+            break;
+        case P_SMP_START_PROXY:
+            reply->retval = uartproxy_start_secondary(request->args[0], request->args[1]);
+            break;
 
         case P_HEAPBLOCK_ALLOC:
             reply->retval = (u64)heapblock_alloc(request->args[0]);
@@ -352,6 +776,10 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_FREE:
             free((void *)request->args[0]);
             break;
+        case P_MEMSTATS:
+            reply->retval = memstat_get((struct memstat *)request->args[0], request->args[1],
+                                        request->args[2]);
+            break;
 
         case P_KBOOT_BOOT:
             if (kboot_boot((void *)request->args[0]) == 0)
@@ -435,6 +863,11 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_DART_UNMAP:
             dart_unmap((dart_dev_t *)request->args[0], request->args[1], request->args[2]);
             break;
+        case P_DART_MAP_SG:
+            reply->retval = dart_map_sg((dart_dev_t *)request->args[0],
+                                        (const struct dart_sg_entry *)request->args[1],
+                                        request->args[2]);
+            break;
 
         case P_HV_INIT:
             hv_init();
@@ -442,6 +875,86 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_HV_MAP:
             hv_map(request->args[0], request->args[1], request->args[2], request->args[3]);
             break;
+        case P_HV_MAP_BATCH:
+            reply->retval =
+                hv_map_batch((const struct hv_map_desc *)request->args[0], request->args[1]);
+            break;
+        case P_HV_DIRTY_START:
+            reply->retval = hv_dirty_start(request->args[0], request->args[1]);
+            break;
+        case P_HV_DIRTY_FETCH:
+            reply->retval =
+                hv_dirty_fetch((void *)request->args[0], request->args[1], request->args[2]);
+            break;
+        case P_HV_DIRTY_STOP:
+            hv_dirty_stop();
+            break;
+        case P_HV_READ_VA:
+            reply->retval =
+                hv_copy_va((void *)request->args[0], request->args[1], request->args[2], false);
+            break;
+        case P_HV_WRITE_VA:
+            reply->retval =
+                hv_copy_va((void *)request->args[1], request->args[0], request->args[2], true);
+            break;
+        case P_HV_STEP_START:
+            reply->retval = hv_step_start((const struct hv_step_cond *)request->args[0]);
+            break;
+        case P_HV_STEP_GET_STATUS:
+            reply->retval =
+                hv_step_get_status((struct hv_step_status *)request->args[0], request->args[1]);
+            break;
+        case P_HV_PROFILE_START:
+            reply->retval = hv_profile_start(request->args[0], request->args[1], request->args[2]);
+            break;
+        case P_HV_PROFILE_STOP:
+            hv_profile_stop();
+            break;
+        case P_HV_PROFILE_FETCH:
+            reply->retval =
+                hv_profile_fetch(request->args[0], (void *)request->args[1], request->args[2]);
+            break;
+        case P_HV_PMU_START:
+            reply->retval = hv_pmu_start((const struct hv_pmu_config *)request->args[0]);
+            break;
+        case P_HV_PMU_STOP:
+            hv_pmu_stop();
+            break;
+        case P_HV_PMU_FETCH:
+            reply->retval =
+                hv_pmu_fetch(request->args[0], (void *)request->args[1], request->args[2]);
+            break;
+        case P_HV_MAP_PVCHAN:
+            hv_map_pvchan(request->args[0]);
+            break;
+        case P_HV_IRQ_COUNTERS_FETCH:
+            reply->retval =
+                hv_irq_counters_fetch((void *)request->args[0], request->args[1], request->args[2]);
+            break;
+        case P_HV_SET_IRQ_DELAY:
+            hv_set_irq_delay(request->args[0]);
+            break;
+        case P_HV_GET_PENDING_EXITS:
+            reply->retval = hv_get_pending_exits((void *)request->args[0], request->args[1]);
+            break;
+        case P_HV_RESOLVE_EXIT:
+            reply->retval = hv_resolve_exit(request->args[0], request->args[1]);
+            break;
+        case P_HV_SET_VTIMER_FORWARD:
+            hv_set_vtimer_forward(request->args[0]);
+            break;
+        case P_HV_SET_TICK_IDLE_RATE:
+            hv_set_tick_idle_rate(request->args[0]);
+            break;
+        case P_HV_SET_TRACE_BUDGET:
+            hv_set_trace_budget((const struct hv_trace_budget *)request->args[0]);
+            break;
+        case P_HV_ADD_SHADOW_REGS:
+            reply->retval = hv_add_shadow_regs((const struct hv_shadow_regs *)request->args[0]);
+            break;
+        case P_HV_GET_SHADOW_REGS_COUNT:
+            reply->retval = hv_get_shadow_regs_count(request->args[0], request->args[1]);
+            break;
         case P_HV_START:
             hv_start((void *)request->args[0], &request->args[1]);
             break;
@@ -460,7 +973,7 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
                                          request->args[3]);
             break;
         case P_HV_WDT_START:
-            hv_wdt_start(request->args[0]);
+            hv_wdt_start(request->args[0], request->args[1]);
             break;
         case P_HV_START_SECONDARY:
             hv_start_secondary(request->args[0], (void *)request->args[1], &request->args[2]);
@@ -469,7 +982,7 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
             reply->retval = hv_switch_cpu(request->args[0]);
             break;
         case P_HV_SET_TIME_STEALING:
-            hv_set_time_stealing(request->args[0], request->args[1]);
+            hv_set_time_stealing(request->args[0], request->args[1], request->args[2]);
             break;
         case P_HV_PIN_CPU:
             hv_pin_cpu(request->args[0]);
@@ -477,6 +990,34 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_HV_WRITE_HCR:
             hv_write_hcr(request->args[0]);
             break;
+        case P_HV_SET_TRACE_BATCH:
+            hv_set_trace_batch(request->args[0]);
+            break;
+        case P_HV_ADD_TRACE_FILTER:
+            reply->retval = hv_add_trace_filter((const struct hv_trace_filter *)request->args[0]);
+            break;
+        case P_HV_CLEAR_TRACE_FILTERS:
+            hv_clear_trace_filters();
+            break;
+        case P_HV_ADD_NATIVE_HOOK:
+            reply->retval = hv_add_native_hook((const struct hv_native_hook *)request->args[0]);
+            break;
+        case P_HV_GET_NATIVE_HOOK_COUNT:
+            reply->retval = hv_get_native_hook_count(request->args[0], request->args[1]);
+            break;
+        case P_HV_SET_ASYNC_BPS:
+            hv_set_async_bps(request->args[0]);
+            break;
+        case P_HV_GET_STATS:
+            reply->retval = hv_get_stats(request->args[0], (struct hv_stats *)request->args[1],
+                                         request->args[2], request->args[3]);
+            break;
+        case P_HV_ADD_SYSREG_EMU:
+            reply->retval = hv_add_sysreg_emu((const struct hv_sysreg_emu *)request->args[0]);
+            break;
+        case P_HV_CLEAR_SYSREG_EMU:
+            hv_clear_sysreg_emu();
+            break;
 
         case P_FB_INIT:
             fb_init(request->args[0]);
@@ -509,6 +1050,9 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_FB_IMPROVE_LOGO:
             fb_improve_logo();
             break;
+        case P_FB_CONSOLE_SET_DEFERRED:
+            fb_console_set_deferred(request->args[0]);
+            break;
 
         case P_PCIE_INIT:
             pcie_init();
@@ -529,10 +1073,45 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_NVME_FLUSH:
             reply->retval = nvme_flush(request->args[0]);
             break;
+        case P_NVME_READ_BLOCKS:
+            reply->retval = nvme_read_blocks(request->args[0], request->args[1],
+                                             request->args[2], (void *)request->args[3]);
+            break;
+        case P_NVME_WRITE_BLOCKS:
+            reply->retval = nvme_write_blocks(request->args[0], request->args[1],
+                                              request->args[2], (void *)request->args[3]);
+            break;
+        case P_NVME_DISCARD:
+            reply->retval = nvme_discard(request->args[0], request->args[1], request->args[2]);
+            break;
 
         case P_MCC_GET_CARVEOUTS:
             reply->retval = (u64)mcc_carveouts;
             break;
+        case P_MCC_GET_CACHE_STATE:
+            reply->retval =
+                mcc_get_cache_state((struct mcc_plane_state *)request->args[0], request->args[1]);
+            break;
+        case P_MCC_SET_CACHE_WAYS:
+            reply->retval =
+                mcc_set_cache_ways(request->args[0], request->args[1], request->args[2]);
+            break;
+        case P_MCC_PLANE_READ32: {
+            u32 val = 0;
+            exc_guard = GUARD_RETURN;
+            if (mcc_plane_rw32(request->args[0], request->args[1], request->args[2], &val, false))
+                reply->retval = -1;
+            else
+                reply->retval = val;
+            break;
+        }
+        case P_MCC_PLANE_WRITE32: {
+            u32 val = request->args[3];
+            exc_guard = GUARD_RETURN;
+            reply->retval =
+                mcc_plane_rw32(request->args[0], request->args[1], request->args[2], &val, true);
+            break;
+        }
 
         case P_DISPLAY_INIT:
             reply->retval = display_init();
@@ -543,6 +1122,18 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
         case P_DISPLAY_SHUTDOWN:
             display_shutdown(request->args[0]);
             break;
+        case P_DISPLAY_SWAPCHAIN_INIT:
+            reply->retval = display_swapchain_init(request->args[0]);
+            break;
+        case P_DISPLAY_SWAPCHAIN_PRESENT:
+            reply->retval = display_swapchain_present();
+            break;
+        case P_DISPLAY_SWAPCHAIN_SHUTDOWN:
+            display_swapchain_shutdown();
+            break;
+        case P_DISPLAY_CONSOLE_SCALED:
+            reply->retval = display_console_scaled(request->args[0]);
+            break;
 
         case P_DAPF_INIT_ALL:
             reply->retval = dapf_init_all();
@@ -551,12 +1142,58 @@ int proxy_process(ProxyRequest *request, ProxyReply *reply)
             reply->retval = dapf_init((const char *)request->args[0]);
             break;
 
+        case P_UAT_TRANSLATE:
+            reply->retval = uat_translate(request->args[0], request->args[1], request->args[2],
+                                          (struct uat_extent *)request->args[3], request->args[4]);
+            break;
+        case P_UAT_READ:
+            reply->retval = uat_copy(request->args[0], (void *)request->args[1], request->args[2],
+                                     request->args[3], false);
+            break;
+        case P_UAT_WRITE:
+            reply->retval = uat_copy(request->args[0], (void *)request->args[2], request->args[1],
+                                     request->args[3], true);
+            break;
+
+        case P_ADMAC_STREAM_START:
+            reply->retval =
+                admac_stream_start(request->args[0], (struct admac_stream *)request->args[1]);
+            break;
+        case P_ADMAC_STREAM_STOP:
+            reply->retval =
+                admac_stream_stop(request->args[0], (struct admac_stream *)request->args[1]);
+            break;
+
+        case P_SMC_BATCH:
+            reply->retval = smc_batch((struct smc_batch *)request->args[0]);
+            break;
+
+        case P_RTKIT_SYSLOG_DEFER:
+            reply->retval = rtkit_set_syslog_deferred(request->args[0]);
+            break;
+        case P_RTKIT_SYSLOG_DRAIN:
+            reply->retval = rtkit_syslog_drain_all();
+            break;
+
         default:
             reply->status = S_BADCMD;
             break;
     }
     sysop("dsb sy");
     sysop("isb");
-    exc_guard = guard_save;
+    if (!async)
+        exc_guard = guard_save;
     return 0;
 }
+
+int proxy_process(ProxyRequest *request, ProxyReply *reply)
+{
+    if (!proxy_stats_enabled)
+        return proxy_dispatch(request, reply, false);
+
+    u64 start = get_ticks();
+    int ret = proxy_dispatch(request, reply, false);
+
+    proxy_stats_op(request->opcode, get_ticks() - start);
+    return ret;
+}
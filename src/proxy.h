@@ -23,6 +23,25 @@ typedef enum {
     P_GET_SIMD_STATE,
     P_PUT_SIMD_STATE,
     P_REBOOT,
+    P_BINLOG_READ,
+    P_BINLOG_DUMP,
+    P_REBOOT_WARM,
+    P_GET_BOOT_PROFILE,
+    P_LINK_ECHO,
+    P_LINK_EVENTS,
+    P_PROXY_STATS,
+    P_ASYNC_SUBMIT,
+    P_ASYNC_WAIT,
+    P_GL1_CALL_BATCH,
+    P_GL2_CALL_BATCH,
+    P_EL0_CALL_BATCH,
+    P_EL1_CALL_BATCH,
+    P_MRS,
+    P_MSR,
+    P_SYSREG_DUMP,
+    P_SPINLOCK_STATS,
+    P_EVENT_POLICY,
+    P_EVENT_STATS,
 
     P_WRITE64 = 0x100, // Generic register functions
     P_WRITE32,
@@ -48,6 +67,7 @@ typedef enum {
     P_WRITEREAD32,
     P_WRITEREAD16,
     P_WRITEREAD8,
+    P_REGOP_BATCH,
 
     P_MEMCPY64 = 0x200, // Memory block transfer functions
     P_MEMCPY32,
@@ -57,6 +77,14 @@ typedef enum {
     P_MEMSET32,
     P_MEMSET16,
     P_MEMSET8,
+    P_MEMSET_PARALLEL,
+    P_MEMCPY_BULK,
+    P_MEMDIFF32,
+    P_MEMWATCH32,
+    P_MEMPROBE,
+    P_MEMTEST,
+    P_MEMHASH,
+    P_HASH,
 
     P_IC_IALLUIS = 0x300, // Cache and memory ops
     P_IC_IALLU,
@@ -74,20 +102,28 @@ typedef enum {
     P_MMU_DISABLE,
     P_MMU_RESTORE,
     P_MMU_INIT_SECONDARY,
+    P_MMU_GET_STATS,
 
     P_XZDEC = 0x400, // Decompression and data processing ops
     P_GZDEC,
+    P_ZSTDDEC,
+    P_LZ4DEC,
+    P_MACHO_LOAD,
 
     P_SMP_START_SECONDARIES = 0x500, // SMP and system management ops
     P_SMP_CALL,
     P_SMP_CALL_SYNC,
     P_SMP_WAIT,
     P_SMP_SET_WFE_MODE,
+    P_SMP_CALL_MANY,
+    P_SMP_WAIT_ALL,
+    P_SMP_START_PROXY,
 
     P_HEAPBLOCK_ALLOC = 0x600, // Heap and memory management ops
     P_MALLOC,
     P_MEMALIGN,
     P_FREE,
+    P_MEMSTATS,
 
     P_KBOOT_BOOT = 0x700, // Kernel boot ops
     P_KBOOT_SET_CHOSEN,
@@ -116,6 +152,7 @@ typedef enum {
     P_DART_SHUTDOWN,
     P_DART_MAP,
     P_DART_UNMAP,
+    P_DART_MAP_SG,
 
     P_HV_INIT = 0xc00,
     P_HV_MAP,
@@ -130,6 +167,39 @@ typedef enum {
     P_HV_SET_TIME_STEALING,
     P_HV_PIN_CPU,
     P_HV_WRITE_HCR,
+    P_HV_SET_TRACE_BATCH,
+    P_HV_ADD_TRACE_FILTER,
+    P_HV_CLEAR_TRACE_FILTERS,
+    P_HV_ADD_NATIVE_HOOK,
+    P_HV_GET_NATIVE_HOOK_COUNT,
+    P_HV_SET_ASYNC_BPS,
+    P_HV_GET_STATS,
+    P_HV_ADD_SYSREG_EMU,
+    P_HV_CLEAR_SYSREG_EMU,
+    P_HV_MAP_BATCH,
+    P_HV_DIRTY_START,
+    P_HV_DIRTY_FETCH,
+    P_HV_DIRTY_STOP,
+    P_HV_READ_VA,
+    P_HV_WRITE_VA,
+    P_HV_STEP_START,
+    P_HV_STEP_GET_STATUS,
+    P_HV_PROFILE_START,
+    P_HV_PROFILE_STOP,
+    P_HV_PROFILE_FETCH,
+    P_HV_PMU_START,
+    P_HV_PMU_STOP,
+    P_HV_PMU_FETCH,
+    P_HV_MAP_PVCHAN,
+    P_HV_IRQ_COUNTERS_FETCH,
+    P_HV_SET_IRQ_DELAY,
+    P_HV_GET_PENDING_EXITS,
+    P_HV_RESOLVE_EXIT,
+    P_HV_SET_VTIMER_FORWARD,
+    P_HV_SET_TICK_IDLE_RATE,
+    P_HV_SET_TRACE_BUDGET,
+    P_HV_ADD_SHADOW_REGS,
+    P_HV_GET_SHADOW_REGS_COUNT,
 
     P_FB_INIT = 0xd00,
     P_FB_SHUTDOWN,
@@ -140,6 +210,7 @@ typedef enum {
     P_FB_DISPLAY_LOGO,
     P_FB_RESTORE_LOGO,
     P_FB_IMPROVE_LOGO,
+    P_FB_CONSOLE_SET_DEFERRED,
 
     P_PCIE_INIT = 0xe00,
     P_PCIE_SHUTDOWN,
@@ -148,20 +219,61 @@ typedef enum {
     P_NVME_SHUTDOWN,
     P_NVME_READ,
     P_NVME_FLUSH,
+    P_NVME_READ_BLOCKS,
+    P_NVME_WRITE_BLOCKS,
+    P_NVME_DISCARD,
 
     P_MCC_GET_CARVEOUTS = 0x1000,
+    P_MCC_GET_CACHE_STATE,
+    P_MCC_SET_CACHE_WAYS,
+    P_MCC_PLANE_READ32,
+    P_MCC_PLANE_WRITE32,
 
     P_DISPLAY_INIT = 0x1100,
     P_DISPLAY_CONFIGURE,
     P_DISPLAY_SHUTDOWN,
+    P_DISPLAY_SWAPCHAIN_INIT,
+    P_DISPLAY_SWAPCHAIN_PRESENT,
+    P_DISPLAY_SWAPCHAIN_SHUTDOWN,
+    P_DISPLAY_CONSOLE_SCALED,
 
     P_DAPF_INIT_ALL = 0x1200,
     P_DAPF_INIT,
 
+    P_UAT_TRANSLATE = 0x1300,
+    P_UAT_READ,
+    P_UAT_WRITE,
+
+    P_ADMAC_STREAM_START = 0x1400,
+    P_ADMAC_STREAM_STOP,
+
+    P_SMC_BATCH = 0x1500,
+
+    P_RTKIT_SYSLOG_DEFER = 0x1600,
+    P_RTKIT_SYSLOG_DRAIN,
+
 } ProxyOp;
 
 #define S_OK     0
 #define S_BADCMD -1
+#define S_EXC    -2
+
+typedef enum {
+    REGOP_READ = 0, // result = *addr
+    REGOP_WRITE,    // *addr = value
+    REGOP_MASK,     // result = *addr = (*addr & ~mask) | value
+    REGOP_POLL,     // wait up to timeout us for (*addr & mask) == value, result = last read
+    REGOP_DELAY,    // udelay(value)
+} RegOpType;
+
+typedef struct {
+    u16 op;
+    u16 width;
+    u32 timeout;
+    u64 addr;
+    u64 value;
+    u64 mask;
+} RegOp;
 
 typedef struct {
     u64 opcode;
@@ -174,6 +286,42 @@ typedef struct {
     u64 retval;
 } ProxyReply;
 
+#define PROXY_STATS_ENABLE  0x1
+#define PROXY_STATS_DISABLE 0x2
+#define PROXY_STATS_RESET   0x4
+
+#define PROXY_STATS_MAX_OPS 128
+
+struct proxy_op_stat {
+    u32 opcode;
+    u32 pad;
+    u64 calls;
+    u64 ticks; // CNTPCT ticks spent in proxy_process
+};
+
+struct proxy_stats {
+    u64 enabled;
+    u64 requests;   // link requests of any type
+    u64 idle_ticks; // waiting for the host to start a request
+    u64 rx_ticks;   // reading request headers and memory write data
+    u64 tx_ticks;   // memory read checksums, replies and read data
+    u64 op_count;   // struct proxy_op_stat entries that follow
+};
+
+// EVT_ASYNC_DONE payload
+struct proxy_async_done {
+    u32 tag;
+    u32 cpu;
+    u64 opcode;
+    s64 status;
+    u64 retval;
+};
+
+extern bool proxy_stats_enabled;
+
+void proxy_stats_link(u64 idle, u64 rx, u64 tx);
+int proxy_stats_get(void *buf, size_t size, u64 flags);
+
 int proxy_process(ProxyRequest *request, ProxyReply *reply);
 
 #endif
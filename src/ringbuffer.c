@@ -1,14 +1,38 @@
 #include "ringbuffer.h"
 #include "malloc.h"
+#include "string.h"
 #include "types.h"
+#include "utils.h"
+
+/*
+ * Each side reads the index it owns with a plain load and the other side's index with an
+ * acquire load, and publishes its own with a release store. That orders the data accesses
+ * against the index updates in both directions.
+ */
+static inline size_t load_acquire(size_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(size_t *p, size_t val)
+{
+    __atomic_store_n(p, val, __ATOMIC_RELEASE);
+}
 
 ringbuffer_t *ringbuffer_alloc(size_t len)
 {
-    ringbuffer_t *bfr = malloc(sizeof(*bfr));
+    size_t size = 1;
+
+    /* round up to a power of two so indices can simply be masked */
+    while (size < len)
+        size <<= 1;
+
+    ringbuffer_t *bfr = memalign(RINGBUFFER_CACHELINE, sizeof(*bfr));
     if (!bfr)
         return NULL;
 
-    bfr->buffer = malloc(len);
+    /* page aligned, so that callers can map the buffer for DMA */
+    bfr->buffer = memalign(SZ_16K, max(size, SZ_16K));
     if (!bfr->buffer) {
         free(bfr);
         return NULL;
@@ -16,7 +40,7 @@ ringbuffer_t *ringbuffer_alloc(size_t len)
 
     bfr->read = 0;
     bfr->write = 0;
-    bfr->len = len;
+    bfr->len = size;
 
     return bfr;
 }
@@ -28,19 +52,50 @@ void ringbuffer_free(ringbuffer_t *bfr)
     free(bfr);
 }
 
+size_t ringbuffer_reserve(ringbuffer_t *bfr, u8 **span)
+{
+    size_t write = bfr->write;
+    size_t avail = bfr->len - (write - load_acquire(&bfr->read));
+    size_t offset = write & (bfr->len - 1);
+
+    *span = &bfr->buffer[offset];
+    return min(avail, bfr->len - offset);
+}
+
+void ringbuffer_commit(ringbuffer_t *bfr, size_t len)
+{
+    store_release(&bfr->write, bfr->write + len);
+}
+
+size_t ringbuffer_peek(ringbuffer_t *bfr, const u8 **span)
+{
+    size_t read = bfr->read;
+    size_t avail = load_acquire(&bfr->write) - read;
+    size_t offset = read & (bfr->len - 1);
+
+    *span = &bfr->buffer[offset];
+    return min(avail, bfr->len - offset);
+}
+
+void ringbuffer_consume(ringbuffer_t *bfr, size_t len)
+{
+    store_release(&bfr->read, bfr->read + len);
+}
+
 size_t ringbuffer_read(u8 *target, size_t len, ringbuffer_t *bfr)
 {
-    size_t read;
+    size_t read = 0;
 
-    for (read = 0; read < len; ++read) {
-        if (bfr->read == bfr->write)
+    /* at most two spans, before and after the wraparound */
+    while (read < len) {
+        const u8 *span;
+        size_t avail = min(ringbuffer_peek(bfr, &span), len - read);
+        if (!avail)
             break;
 
-        *target = bfr->buffer[bfr->read];
-        target++;
-
-        bfr->read++;
-        bfr->read %= bfr->len;
+        memcpy(target + read, span, avail);
+        ringbuffer_consume(bfr, avail);
+        read += avail;
     }
 
     return read;
@@ -48,17 +103,17 @@ size_t ringbuffer_read(u8 *target, size_t len, ringbuffer_t *bfr)
 
 size_t ringbuffer_write(const u8 *src, size_t len, ringbuffer_t *bfr)
 {
-    size_t written;
+    size_t written = 0;
 
-    for (written = 0; written < len; ++written) {
-        if (((bfr->write + 1) % bfr->len) == bfr->read)
+    while (written < len) {
+        u8 *span;
+        size_t avail = min(ringbuffer_reserve(bfr, &span), len - written);
+        if (!avail)
             break;
 
-        bfr->buffer[bfr->write] = *src;
-        src++;
-
-        bfr->write++;
-        bfr->write %= bfr->len;
+        memcpy(span, src + written, avail);
+        ringbuffer_commit(bfr, avail);
+        written += avail;
     }
 
     return written;
@@ -66,13 +121,7 @@ size_t ringbuffer_write(const u8 *src, size_t len, ringbuffer_t *bfr)
 
 size_t ringbuffer_get_used(ringbuffer_t *bfr)
 {
-    size_t read = bfr->read;
-    size_t write = bfr->write;
-
-    if (write < read)
-        write += bfr->len;
-
-    return write - read;
+    return load_acquire(&bfr->write) - load_acquire(&bfr->read);
 }
 
 size_t ringbuffer_get_free(ringbuffer_t *bfr)
@@ -3,11 +3,22 @@
 
 #include "types.h"
 
+#define RINGBUFFER_CACHELINE 64
+
+/*
+ * Single-producer/single-consumer ring buffer. The producer only ever writes `write` and the
+ * consumer only ever writes `read`, which live on separate cache lines and are published with
+ * release stores, so the two sides may run on different CPUs without any locking.
+ *
+ * Indices are free-running and masked with len - 1, so len is always a power of two and the
+ * full buffer capacity is usable.
+ */
 typedef struct {
     u8 *buffer;
     size_t len;
-    size_t read;
-    size_t write;
+
+    size_t write ALIGNED(RINGBUFFER_CACHELINE);
+    size_t read ALIGNED(RINGBUFFER_CACHELINE);
 } ringbuffer_t;
 
 ringbuffer_t *ringbuffer_alloc(size_t len);
@@ -16,6 +27,14 @@ void ringbuffer_free(ringbuffer_t *bfr);
 size_t ringbuffer_read(u8 *target, size_t len, ringbuffer_t *bfr);
 size_t ringbuffer_write(const u8 *src, size_t len, ringbuffer_t *bfr);
 
+/* Producer: get the contiguous free span at the write index, then publish len bytes of it */
+size_t ringbuffer_reserve(ringbuffer_t *bfr, u8 **span);
+void ringbuffer_commit(ringbuffer_t *bfr, size_t len);
+
+/* Consumer: get the contiguous used span at the read index, then release len bytes of it */
+size_t ringbuffer_peek(ringbuffer_t *bfr, const u8 **span);
+void ringbuffer_consume(ringbuffer_t *bfr, size_t len);
+
 size_t ringbuffer_get_used(ringbuffer_t *bfr);
 size_t ringbuffer_get_free(ringbuffer_t *bfr);
 
@@ -8,6 +8,7 @@
 #include "dart.h"
 #include "iova.h"
 #include "malloc.h"
+#include "pool.h"
 #include "sart.h"
 #include "string.h"
 #include "types.h"
@@ -72,6 +73,27 @@
 
 #define IOVA_MASK GENMASK(31, 0)
 
+#define RTKIT_APP_EP_FIRST 0x20
+#define RTKIT_EP_COUNT     0x100
+
+/*
+ * Each IOP gets one DMA window that is allocated, mapped and flushed once in rtkit_init(). The
+ * buffers it asks for (syslog, crashlog, ioreport, EPIC) are carved out of it in 16K chunks,
+ * tracked one bit per chunk, and only requests that don't fit are mapped on their own.
+ */
+#define RTKIT_DMA_CHUNK     SZ_16K
+#define RTKIT_DMA_CHUNKS    64
+#define RTKIT_DMA_POOL_SIZE (RTKIT_DMA_CHUNKS * RTKIT_DMA_CHUNK)
+
+/*
+ * With deferred syslog, log messages are copied out of the shared buffer and ACKed right away
+ * (the IOP reuses the slot as soon as it sees the ACK), and only formatted when
+ * rtkit_syslog_drain() is called. Crash info is held back the same way. When the queue is full
+ * the oldest entries are dropped.
+ */
+#define RTKIT_SYSLOG_QUEUE 32
+#define RTKIT_MAX_DEVS     8
+
 enum rtkit_power_state {
     RTKIT_POWER_OFF = 0x00,
     RTKIT_POWER_SLEEP = 0x01,
@@ -80,6 +102,20 @@ enum rtkit_power_state {
     RTKIT_POWER_INIT = 0x220,
 };
 
+enum rtkit_boot_state {
+    RTKIT_BOOT_IDLE,
+    RTKIT_BOOT_HELLO,
+    RTKIT_BOOT_EPMAP,
+    RTKIT_BOOT_POWER,
+    RTKIT_BOOT_DONE,
+    RTKIT_BOOT_FAILED,
+};
+
+struct rtkit_ep_handler {
+    rtkit_ep_handler_t fn;
+    void *opaque;
+};
+
 struct rtkit_dev {
     char *name;
 
@@ -90,6 +126,10 @@ struct rtkit_dev {
 
     u64 dva_base;
 
+    void *dma_pool;
+    u64 dma_pool_dva;
+    u64 dma_used;
+
     enum rtkit_power_state iop_power;
     enum rtkit_power_state ap_power;
 
@@ -99,7 +139,19 @@ struct rtkit_dev {
 
     u32 syslog_cnt, syslog_size;
 
+    void *syslog_queue;
+    u32 syslog_stride;
+    u32 syslog_head, syslog_tail;
+    u32 syslog_dropped;
+
     bool crashed;
+    bool crashlog_pending;
+
+    enum rtkit_boot_state boot_state;
+    u64 boot_timeout;
+    u32 system_eps;
+
+    struct rtkit_ep_handler handlers[RTKIT_EP_COUNT - RTKIT_APP_EP_FIRST];
 };
 
 struct syslog_log {
@@ -125,6 +177,9 @@ struct crashlog_entry {
     u8 payload[];
 };
 
+static bool syslog_deferred;
+static rtkit_dev_t *rtkit_devs[RTKIT_MAX_DEVS];
+
 rtkit_dev_t *rtkit_init(const char *name, asc_dev_t *asc, dart_dev_t *dart,
                         iova_domain_t *dart_iovad, sart_dev_t *sart)
 {
@@ -160,6 +215,24 @@ rtkit_dev_t *rtkit_init(const char *name, asc_dev_t *asc, dart_dev_t *dart,
     int iop_node = asc_get_iop_node(asc);
     ADT_GETPROP(adt, iop_node, "asc-dram-mask", &rtk->dva_base);
 
+    if (dart || sart) {
+        rtk->dma_pool = pool_alloc_pages(RTKIT_DMA_POOL_SIZE);
+        if (rtk->dma_pool &&
+            !rtkit_map(rtk, rtk->dma_pool, RTKIT_DMA_POOL_SIZE, &rtk->dma_pool_dva)) {
+            pool_free_pages(rtk->dma_pool, RTKIT_DMA_POOL_SIZE);
+            rtk->dma_pool = NULL;
+        }
+        if (!rtk->dma_pool)
+            rtkit_printf("no DMA pool, mapping buffers one by one\n");
+    }
+
+    for (int i = 0; i < RTKIT_MAX_DEVS; i++) {
+        if (!rtkit_devs[i]) {
+            rtkit_devs[i] = rtk;
+            break;
+        }
+    }
+
     return rtk;
 
 out_free_rtk:
@@ -169,13 +242,34 @@ out_free_rtk:
 
 void rtkit_free(rtkit_dev_t *rtk)
 {
+    rtkit_syslog_drain(rtk);
+    for (int i = 0; i < RTKIT_MAX_DEVS; i++)
+        if (rtkit_devs[i] == rtk)
+            rtkit_devs[i] = NULL;
+    free(rtk->syslog_queue);
+
     rtkit_free_buffer(rtk, &rtk->syslog_bfr);
     rtkit_free_buffer(rtk, &rtk->crashlog_bfr);
     rtkit_free_buffer(rtk, &rtk->ioreport_bfr);
+    if (rtk->dma_pool) {
+        rtkit_unmap(rtk, rtk->dma_pool_dva, RTKIT_DMA_POOL_SIZE);
+        pool_free_pages(rtk->dma_pool, RTKIT_DMA_POOL_SIZE);
+    }
     free(rtk->name);
     free(rtk);
 }
 
+void rtkit_set_ep_handler(rtkit_dev_t *rtk, u8 ep, rtkit_ep_handler_t handler, void *opaque)
+{
+    if (ep < RTKIT_APP_EP_FIRST) {
+        rtkit_printf("cannot install a handler for system endpoint 0x%02x\n", ep);
+        return;
+    }
+
+    rtk->handlers[ep - RTKIT_APP_EP_FIRST].fn = handler;
+    rtk->handlers[ep - RTKIT_APP_EP_FIRST].opaque = opaque;
+}
+
 bool rtkit_send(rtkit_dev_t *rtk, const struct rtkit_message *msg)
 {
     struct asc_message asc_msg;
@@ -234,16 +328,56 @@ bool rtkit_unmap(rtkit_dev_t *rtk, u64 dva, size_t sz)
     }
 }
 
+static bool rtkit_dma_pool_alloc(rtkit_dev_t *rtk, struct rtkit_buffer *bfr, size_t sz)
+{
+    size_t chunks = sz / RTKIT_DMA_CHUNK;
+
+    if (!rtk->dma_pool || chunks > RTKIT_DMA_CHUNKS)
+        return false;
+
+    u64 mask = chunks == RTKIT_DMA_CHUNKS ? ~0UL : BIT(chunks) - 1;
+    for (size_t i = 0; i + chunks <= RTKIT_DMA_CHUNKS; i++, mask <<= 1) {
+        if (rtk->dma_used & mask)
+            continue;
+
+        rtk->dma_used |= mask;
+        bfr->bfr = rtk->dma_pool + i * RTKIT_DMA_CHUNK;
+        bfr->dva = rtk->dma_pool_dva + i * RTKIT_DMA_CHUNK;
+        bfr->sz = sz;
+        return true;
+    }
+
+    return false;
+}
+
+static bool rtkit_dma_pool_free(rtkit_dev_t *rtk, struct rtkit_buffer *bfr)
+{
+    if (!rtk->dma_pool || bfr->bfr < rtk->dma_pool ||
+        bfr->bfr >= rtk->dma_pool + RTKIT_DMA_POOL_SIZE)
+        return false;
+
+    size_t first = (bfr->bfr - rtk->dma_pool) / RTKIT_DMA_CHUNK;
+    size_t chunks = bfr->sz / RTKIT_DMA_CHUNK;
+    u64 mask = chunks == RTKIT_DMA_CHUNKS ? ~0UL : BIT(chunks) - 1;
+
+    rtk->dma_used &= ~(mask << first);
+    bfr->bfr = NULL;
+    return true;
+}
+
 bool rtkit_alloc_buffer(rtkit_dev_t *rtk, struct rtkit_buffer *bfr, size_t sz)
 {
-    bfr->bfr = memalign(SZ_16K, sz);
+    sz = ALIGN_UP(sz, 16384);
+
+    if (rtkit_dma_pool_alloc(rtk, bfr, sz))
+        return true;
+
+    bfr->bfr = pool_alloc_pages(sz);
     if (!bfr->bfr) {
         rtkit_printf("unable to allocate %zu buffer\n", sz);
         return false;
     }
 
-    sz = ALIGN_UP(sz, 16384);
-
     bfr->sz = sz;
     if (!rtkit_map(rtk, bfr->bfr, sz, &bfr->dva))
         goto error;
@@ -251,7 +385,7 @@ bool rtkit_alloc_buffer(rtkit_dev_t *rtk, struct rtkit_buffer *bfr, size_t sz)
     return true;
 
 error:
-    free(bfr->bfr);
+    pool_free_pages(bfr->bfr, sz);
     bfr->bfr = NULL;
     return false;
 }
@@ -261,10 +395,13 @@ bool rtkit_free_buffer(rtkit_dev_t *rtk, struct rtkit_buffer *bfr)
     if (!bfr->bfr || !is_heap(bfr->bfr))
         return true;
 
+    if (rtkit_dma_pool_free(rtk, bfr))
+        return true;
+
     if (!rtkit_unmap(rtk, bfr->dva, bfr->sz))
         return false;
 
-    free(bfr->bfr);
+    pool_free_pages(bfr->bfr, bfr->sz);
 
     return false;
 }
@@ -316,12 +453,9 @@ error:
     return false;
 }
 
-static void rtkit_crashed(rtkit_dev_t *rtk)
+static void rtkit_crashlog_dump(rtkit_dev_t *rtk)
 {
     struct crashlog_hdr *hdr = rtk->crashlog_bfr.bfr;
-    rtk->crashed = true;
-
-    rtkit_printf("IOP crashed!\n");
 
     if (hdr->type != 'CLHE') {
         rtkit_printf("bad crashlog header 0x%x @ %p\n", hdr->type, hdr);
@@ -344,6 +478,211 @@ static void rtkit_crashed(rtkit_dev_t *rtk)
     }
 }
 
+static void rtkit_crashed(rtkit_dev_t *rtk)
+{
+    rtk->crashed = true;
+
+    rtkit_printf("IOP crashed!\n");
+
+    if (syslog_deferred)
+        rtk->crashlog_pending = true;
+    else
+        rtkit_crashlog_dump(rtk);
+}
+
+static void rtkit_syslog_print(rtkit_dev_t *rtk, struct syslog_log *log)
+{
+    size_t len = strnlen(log->msg, rtk->syslog_size);
+
+    rtkit_printf("syslog: [%.*s]%.*s", (int)sizeof(log->context), log->context, (int)len, log->msg);
+    if (!len || log->msg[len - 1] != '\n')
+        printf("\n");
+}
+
+static void rtkit_syslog_queue(rtkit_dev_t *rtk, struct syslog_log *log)
+{
+    u32 stride = rtk->syslog_size + sizeof(struct syslog_log);
+
+    if (rtk->syslog_queue && rtk->syslog_stride != stride) {
+        free(rtk->syslog_queue);
+        rtk->syslog_queue = NULL;
+    }
+
+    if (!rtk->syslog_queue) {
+        rtk->syslog_queue = malloc(RTKIT_SYSLOG_QUEUE * stride);
+        if (!rtk->syslog_queue)
+            return;
+        rtk->syslog_stride = stride;
+        rtk->syslog_head = rtk->syslog_tail = 0;
+    }
+
+    if (rtk->syslog_head - rtk->syslog_tail == RTKIT_SYSLOG_QUEUE) {
+        rtk->syslog_tail++;
+        rtk->syslog_dropped++;
+    }
+
+    void *slot = rtk->syslog_queue + (rtk->syslog_head++ % RTKIT_SYSLOG_QUEUE) * stride;
+    memcpy(slot, log, stride);
+}
+
+int rtkit_syslog_drain(rtkit_dev_t *rtk)
+{
+    int count = 0;
+
+    if (rtk->syslog_dropped) {
+        rtkit_printf("syslog: %u messages dropped\n", rtk->syslog_dropped);
+        rtk->syslog_dropped = 0;
+    }
+
+    for (; rtk->syslog_tail != rtk->syslog_head; rtk->syslog_tail++, count++)
+        rtkit_syslog_print(rtk, rtk->syslog_queue + (rtk->syslog_tail % RTKIT_SYSLOG_QUEUE) *
+                                                        rtk->syslog_stride);
+
+    if (rtk->crashlog_pending) {
+        rtk->crashlog_pending = false;
+        rtkit_crashlog_dump(rtk);
+    }
+
+    return count;
+}
+
+int rtkit_syslog_drain_all(void)
+{
+    int count = 0;
+
+    for (int i = 0; i < RTKIT_MAX_DEVS; i++)
+        if (rtkit_devs[i])
+            count += rtkit_syslog_drain(rtkit_devs[i]);
+
+    return count;
+}
+
+bool rtkit_set_syslog_deferred(bool deferred)
+{
+    bool was = syslog_deferred;
+
+    syslog_deferred = deferred;
+    if (was && !deferred)
+        rtkit_syslog_drain_all();
+
+    return was;
+}
+
+static void rtkit_boot_advance(rtkit_dev_t *rtk, enum rtkit_boot_state state)
+{
+    rtk->boot_state = state;
+    rtk->boot_timeout = timeout_calculate(USEC_PER_SEC);
+}
+
+static bool rtkit_handle_hello(rtkit_dev_t *rtk, u64 msg0)
+{
+    struct asc_message msg;
+    u32 min_ver, max_ver, want_ver;
+
+    if (rtk->boot_state != RTKIT_BOOT_HELLO) {
+        rtkit_printf("unexpected HELLO\n");
+        return false;
+    }
+
+    min_ver = FIELD_GET(MGMT_MSG_HELLO_MINVER, msg0);
+    max_ver = FIELD_GET(MGMT_MSG_HELLO_MAXVER, msg0);
+    want_ver = min(RTKIT_MAX_VERSION, max_ver);
+
+    if (min_ver > RTKIT_MAX_VERSION || max_ver < RTKIT_MIN_VERSION) {
+        rtkit_printf("supported versions [%d,%d] must overlap versions [%d,%d]\n",
+                     RTKIT_MIN_VERSION, RTKIT_MAX_VERSION, min_ver, max_ver);
+        return false;
+    }
+
+    rtkit_printf("booting with version %d\n", want_ver);
+
+    msg.msg0 = FIELD_PREP(MGMT_TYPE, MGMT_MSG_HELLO_ACK);
+    msg.msg0 |= FIELD_PREP(MGMT_MSG_HELLO_MINVER, want_ver);
+    msg.msg0 |= FIELD_PREP(MGMT_MSG_HELLO_MAXVER, want_ver);
+    msg.msg1 = RTKIT_EP_MGMT;
+    if (!asc_send(rtk->asc, &msg)) {
+        rtkit_printf("couldn't send HELLO ack\n");
+        return false;
+    }
+
+    rtkit_boot_advance(rtk, RTKIT_BOOT_EPMAP);
+    return true;
+}
+
+static bool rtkit_handle_epmap(rtkit_dev_t *rtk, u64 msg0)
+{
+    struct asc_message msg;
+
+    if (rtk->boot_state != RTKIT_BOOT_EPMAP) {
+        rtkit_printf("unexpected endpoint map message\n");
+        return false;
+    }
+
+    u32 bitmap = FIELD_GET(MGMT_MSG_EPMAP_BITMAP, msg0);
+    u32 base = FIELD_GET(MGMT_MSG_EPMAP_BASE, msg0);
+    bool done = msg0 & MGMT_MSG_EPMAP_DONE;
+
+    // Only the system endpoints matter here, applications start their own
+    if (base == 0)
+        rtk->system_eps |= bitmap;
+
+    msg.msg0 = FIELD_PREP(MGMT_TYPE, MGMT_MSG_EPMAP_REPLY);
+    msg.msg0 |= FIELD_PREP(MGMT_MSG_EPMAP_BASE, base);
+    if (done)
+        msg.msg0 |= MGMT_MSG_EPMAP_REPLY_DONE;
+    else
+        msg.msg0 |= MGMT_MSG_EPMAP_REPLY_MORE;
+    msg.msg1 = RTKIT_EP_MGMT;
+
+    if (!asc_send(rtk->asc, &msg)) {
+        rtkit_printf("couldn't reply to endpoint map\n");
+        return false;
+    }
+
+    if (!done)
+        return true;
+
+    for (u8 ep = 0; ep < RTKIT_APP_EP_FIRST; ep++) {
+        if (!(rtk->system_eps & BIT(ep)))
+            continue;
+
+        switch (ep) {
+            case RTKIT_EP_MGMT:
+                break;
+            case RTKIT_EP_CRASHLOG:
+            case RTKIT_EP_DEBUG:
+            case RTKIT_EP_IOREPORT:
+            case RTKIT_EP_SYSLOG:
+            case RTKIT_EP_OSLOG:
+                if (!rtkit_start_ep(rtk, ep))
+                    return false;
+                break;
+            default:
+                rtkit_printf("unknown system endpoint 0x%02x\n", ep);
+        }
+    }
+
+    rtkit_boot_advance(rtk, RTKIT_BOOT_POWER);
+    return true;
+}
+
+static bool rtkit_boot_finish(rtkit_dev_t *rtk)
+{
+    struct asc_message msg;
+
+    /* this enables syslog */
+    msg.msg0 =
+        FIELD_PREP(MGMT_TYPE, MGMT_MSG_AP_PWR_STATE) | FIELD_PREP(MGMT_PWR_STATE, RTKIT_POWER_ON);
+    msg.msg1 = RTKIT_EP_MGMT;
+    if (!asc_send(rtk->asc, &msg)) {
+        rtkit_printf("unable to send AP power message\n");
+        return false;
+    }
+
+    rtkit_boot_advance(rtk, RTKIT_BOOT_DONE);
+    return true;
+}
+
 int rtkit_recv(rtkit_dev_t *rtk, struct rtkit_message *msg)
 {
     struct asc_message asc_msg;
@@ -362,16 +701,31 @@ int rtkit_recv(rtkit_dev_t *rtk, struct rtkit_message *msg)
         msg->msg = asc_msg.msg0;
         msg->ep = (u8)asc_msg.msg1;
 
-        /* if this is an app message we can just forwad it to the caller */
-        if (msg->ep >= 0x20)
-            return 1;
+        /* app messages go to their handler if there is one, or to the caller */
+        if (msg->ep >= RTKIT_APP_EP_FIRST) {
+            struct rtkit_ep_handler *handler = &rtk->handlers[msg->ep - RTKIT_APP_EP_FIRST];
+
+            if (!handler->fn)
+                return 1;
+
+            handler->fn(handler->opaque, msg->ep, msg->msg);
+            continue;
+        }
 
         u32 msgtype = FIELD_GET(MGMT_TYPE, msg->msg);
         switch (msg->ep) {
             case RTKIT_EP_MGMT:
                 switch (msgtype) {
+                    case MGMT_MSG_HELLO:
+                        ok = ok && rtkit_handle_hello(rtk, msg->msg);
+                        break;
+                    case MGMT_MSG_EPMAP:
+                        ok = ok && rtkit_handle_epmap(rtk, msg->msg);
+                        break;
                     case MGMT_MSG_IOP_PWR_STATE_ACK:
                         rtk->iop_power = FIELD_GET(MGMT_PWR_STATE, msg->msg);
+                        if (rtk->boot_state == RTKIT_BOOT_POWER && rtk->iop_power == RTKIT_POWER_ON)
+                            ok = ok && rtkit_boot_finish(rtk);
                         break;
                     case MGMT_MSG_AP_PWR_STATE_ACK:
                         rtk->ap_power = FIELD_GET(MGMT_PWR_STATE, msg->msg);
@@ -389,20 +743,23 @@ int rtkit_recv(rtkit_dev_t *rtk, struct rtkit_message *msg)
                         rtk->syslog_cnt = FIELD_GET(MSG_SYSLOG_INIT_COUNT, msg->msg);
                         rtk->syslog_size = FIELD_GET(MSG_SYSLOG_INIT_ENTRYSIZE, msg->msg);
                         break;
-                    case MSG_SYSLOG_LOG:
-#ifdef RTKIT_SYSLOG
-                    {
+                    case MSG_SYSLOG_LOG: {
                         u64 index = FIELD_GET(MSG_SYSLOG_LOG_INDEX, msg->msg);
                         u64 stride = rtk->syslog_size + sizeof(struct syslog_log);
                         struct syslog_log *log = rtk->syslog_bfr.bfr + stride * index;
-                        rtkit_printf("syslog: [%s]%s", log->context, log->msg);
-                        if (log->msg[strlen(log->msg) - 1] != '\n')
-                            printf("\n");
-                    }
+
+                        if (!rtk->syslog_bfr.bfr || index >= rtk->syslog_cnt)
+                            rtkit_printf("bad syslog index %ld\n", index);
+                        else if (syslog_deferred)
+                            rtkit_syslog_queue(rtk, log);
+#ifdef RTKIT_SYSLOG
+                        else
+                            rtkit_syslog_print(rtk, log);
 #endif
                         if (!asc_send(rtk->asc, &asc_msg))
                             rtkit_printf("failed to ack syslog\n");
                         break;
+                    }
                     default:
                         rtkit_printf("unknown syslog message %x\n", msgtype);
                 }
@@ -477,10 +834,13 @@ bool rtkit_start_ep(rtkit_dev_t *rtk, u8 ep)
     return true;
 }
 
-bool rtkit_boot(rtkit_dev_t *rtk)
+bool rtkit_boot_start(rtkit_dev_t *rtk)
 {
     struct asc_message msg;
 
+    rtk->system_eps = 0;
+    rtkit_boot_advance(rtk, RTKIT_BOOT_HELLO);
+
     /* boot the IOP if it isn't already */
     asc_cpu_start(rtk->asc);
     /* can be sent unconditionally to wake up a possibly sleeping IOP */
@@ -489,152 +849,83 @@ bool rtkit_boot(rtkit_dev_t *rtk)
     msg.msg1 = RTKIT_EP_MGMT;
     if (!asc_send(rtk->asc, &msg)) {
         rtkit_printf("unable to send wakeup message\n");
+        rtk->boot_state = RTKIT_BOOT_FAILED;
         return false;
     }
 
-    if (!asc_recv_timeout(rtk->asc, &msg, USEC_PER_SEC)) {
-        rtkit_printf("did not receive HELLO\n");
-        return false;
-    }
-
-    if (msg.msg1 != RTKIT_EP_MGMT) {
-        rtkit_printf("expected HELLO but got message for EP 0x%x", msg.msg1);
-        return false;
-    }
-
-    u32 msgtype;
-    msgtype = FIELD_GET(MGMT_TYPE, msg.msg0);
-    if (msgtype != MGMT_MSG_HELLO) {
-        rtkit_printf("expected HELLO but got message with type 0x%02x", msgtype);
-
-        return false;
-    }
-
-    u32 min_ver, max_ver, want_ver;
-    min_ver = FIELD_GET(MGMT_MSG_HELLO_MINVER, msg.msg0);
-    max_ver = FIELD_GET(MGMT_MSG_HELLO_MAXVER, msg.msg0);
-    want_ver = min(RTKIT_MAX_VERSION, max_ver);
-
-    if (min_ver > RTKIT_MAX_VERSION || max_ver < RTKIT_MIN_VERSION) {
-        rtkit_printf("supported versions [%d,%d] must overlap versions [%d,%d]\n",
-                     RTKIT_MIN_VERSION, RTKIT_MAX_VERSION, min_ver, max_ver);
-        return false;
-    }
-
-    rtkit_printf("booting with version %d\n", want_ver);
+    return true;
+}
 
-    msg.msg0 = FIELD_PREP(MGMT_TYPE, MGMT_MSG_HELLO_ACK);
-    msg.msg0 |= FIELD_PREP(MGMT_MSG_HELLO_MINVER, want_ver);
-    msg.msg0 |= FIELD_PREP(MGMT_MSG_HELLO_MAXVER, want_ver);
-    msg.msg1 = RTKIT_EP_MGMT;
-    if (!asc_send(rtk->asc, &msg)) {
-        rtkit_printf("couldn't send HELLO ack\n");
-        return false;
-    }
+/*
+ * Advance a boot started with rtkit_boot_start() as far as the messages received so far allow.
+ * Returns 1 once the IOP is up, 0 while it is still booting and -1 if booting failed.
+ */
+int rtkit_boot_poll(rtkit_dev_t *rtk)
+{
+    struct rtkit_message msg;
 
-    bool has_crashlog = false;
-    bool has_debug = false;
-    bool has_ioreport = false;
-    bool has_syslog = false;
-    bool has_oslog = false;
-    bool got_epmap = false;
-    while (!got_epmap) {
-        if (!asc_recv_timeout(rtk->asc, &msg, USEC_PER_SEC)) {
-            rtkit_printf("couldn't receive message while waiting for endpoint map\n");
-            return false;
-        }
+    while (rtk->boot_state != RTKIT_BOOT_DONE && rtk->boot_state != RTKIT_BOOT_FAILED) {
+        int ret = rtkit_recv(rtk, &msg);
 
-        if (msg.msg1 != RTKIT_EP_MGMT) {
-            rtkit_printf("expected management message while waiting for endpoint map but got "
-                         "message for endpoint 0x%x\n",
-                         msg.msg1);
-            return false;
+        if (ret == 1) {
+            rtkit_printf("unexpected message to non-system endpoint 0x%02x during boot: %lx\n",
+                         msg.ep, msg.msg);
+        } else if (ret < 0) {
+            rtk->boot_state = RTKIT_BOOT_FAILED;
+        } else if (timeout_expired(rtk->boot_timeout)) {
+            rtkit_printf("timed out while booting (state %d)\n", rtk->boot_state);
+            rtk->boot_state = RTKIT_BOOT_FAILED;
+        } else {
+            return 0;
         }
+    }
 
-        msgtype = FIELD_GET(MGMT_TYPE, msg.msg0);
-        if (msgtype != MGMT_MSG_EPMAP) {
-            rtkit_printf("expected endpoint map message but got 0x%x instead\n", msgtype);
-            return false;
-        }
+    return rtk->boot_state == RTKIT_BOOT_DONE ? 1 : -1;
+}
 
-        u32 bitmap = FIELD_GET(MGMT_MSG_EPMAP_BITMAP, msg.msg0);
-        u32 base = FIELD_GET(MGMT_MSG_EPMAP_BASE, msg.msg0);
-        for (unsigned int i = 0; i < 32; i++) {
-            if (bitmap & (1U << i)) {
-                u8 ep_idx = 32 * base + i;
-
-                if (ep_idx >= 0x20)
-                    continue;
-                switch (ep_idx) {
-                    case RTKIT_EP_CRASHLOG:
-                        has_crashlog = true;
-                        break;
-                    case RTKIT_EP_DEBUG:
-                        has_debug = true;
-                        break;
-                    case RTKIT_EP_IOREPORT:
-                        has_ioreport = true;
-                        break;
-                    case RTKIT_EP_SYSLOG:
-                        has_syslog = true;
-                        break;
-                    case RTKIT_EP_OSLOG:
-                        has_oslog = true;
-                    case RTKIT_EP_MGMT:
-                        break;
-                    default:
-                        rtkit_printf("unknown system endpoint 0x%02x\n", ep_idx);
-                }
-            }
-        }
+bool rtkit_boot_all(rtkit_dev_t **rtks, int count)
+{
+    bool ok = true;
+    int pending;
 
-        if (msg.msg0 & MGMT_MSG_EPMAP_DONE)
-            got_epmap = true;
+    // Devices that were started ahead of time just get waited for
+    for (int i = 0; i < count; i++)
+        if (rtks[i]->boot_state == RTKIT_BOOT_IDLE)
+            ok = rtkit_boot_start(rtks[i]) && ok;
 
-        msg.msg0 = FIELD_PREP(MGMT_TYPE, MGMT_MSG_EPMAP_REPLY);
-        msg.msg0 |= FIELD_PREP(MGMT_MSG_EPMAP_BASE, base);
-        if (got_epmap)
-            msg.msg0 |= MGMT_MSG_EPMAP_REPLY_DONE;
-        else
-            msg.msg0 |= MGMT_MSG_EPMAP_REPLY_MORE;
+    do {
+        pending = 0;
+        for (int i = 0; i < count; i++)
+            if (rtkit_boot_poll(rtks[i]) == 0)
+                pending++;
+    } while (pending);
 
-        msg.msg1 = RTKIT_EP_MGMT;
+    for (int i = 0; i < count; i++)
+        ok = ok && rtks[i]->boot_state == RTKIT_BOOT_DONE;
 
-        if (!asc_send(rtk->asc, &msg)) {
-            rtkit_printf("couldn't reply to endpoint map\n");
-            return false;
-        }
-    }
+    return ok;
+}
 
-    /* start all required system endpoints */
-    if (has_debug && !rtkit_start_ep(rtk, RTKIT_EP_DEBUG))
-        return false;
-    if (has_crashlog && !rtkit_start_ep(rtk, RTKIT_EP_CRASHLOG))
-        return false;
-    if (has_syslog && !rtkit_start_ep(rtk, RTKIT_EP_SYSLOG))
-        return false;
-    if (has_ioreport && !rtkit_start_ep(rtk, RTKIT_EP_IOREPORT))
-        return false;
-    if (has_oslog && !rtkit_start_ep(rtk, RTKIT_EP_OSLOG))
-        return false;
+bool rtkit_boot(rtkit_dev_t *rtk)
+{
+    return rtkit_boot_all(&rtk, 1);
+}
 
-    while (rtk->iop_power != RTKIT_POWER_ON) {
+/* Service the mailbox (and endpoint handlers) until the IOP acks the requested power state */
+static bool rtkit_wait_power(rtkit_dev_t *rtk, enum rtkit_power_state *state,
+                             enum rtkit_power_state target)
+{
+    while (*state != target) {
         struct rtkit_message rtk_msg;
         int ret = rtkit_recv(rtk, &rtk_msg);
-        if (ret == 1)
-            rtkit_printf("unexpected message to non-system endpoint 0x%02x during boot: %lx\n",
+
+        if (ret > 0) {
+            rtkit_printf("unexpected message to non-system endpoint 0x%02x during shutdown: %lx\n",
                          rtk_msg.ep, rtk_msg.msg);
-        else if (ret < 0)
+        } else if (ret < 0) {
+            rtkit_printf("IOP died during shutdown\n");
             return false;
-    }
-
-    /* this enables syslog */
-    msg.msg0 =
-        FIELD_PREP(MGMT_TYPE, MGMT_MSG_AP_PWR_STATE) | FIELD_PREP(MGMT_PWR_STATE, RTKIT_POWER_ON);
-    msg.msg1 = RTKIT_EP_MGMT;
-    if (!asc_send(rtk->asc, &msg)) {
-        rtkit_printf("unable to send AP power message\n");
-        return false;
+        }
     }
 
     return true;
@@ -656,19 +947,8 @@ static bool rtkit_switch_power_state(rtkit_dev_t *rtk, enum rtkit_power_state ta
         return false;
     }
 
-    while (rtk->ap_power != RTKIT_POWER_QUIESCED) {
-        struct rtkit_message rtk_msg;
-        int ret = rtkit_recv(rtk, &rtk_msg);
-
-        if (ret > 0) {
-            rtkit_printf("unexpected message to non-system endpoint 0x%02x during shutdown: %lx\n",
-                         rtk_msg.ep, rtk_msg.msg);
-            continue;
-        } else if (ret < 0) {
-            rtkit_printf("IOP died during shutdown\n");
-            return false;
-        }
-    }
+    if (!rtkit_wait_power(rtk, &rtk->ap_power, RTKIT_POWER_QUIESCED))
+        return false;
 
     msg.msg0 = FIELD_PREP(MGMT_TYPE, MGMT_MSG_IOP_PWR_STATE) | FIELD_PREP(MGMT_PWR_STATE, target);
     if (!asc_send(rtk->asc, &msg)) {
@@ -676,20 +956,10 @@ static bool rtkit_switch_power_state(rtkit_dev_t *rtk, enum rtkit_power_state ta
         return false;
     }
 
-    while (rtk->iop_power != target) {
-        struct rtkit_message rtk_msg;
-        int ret = rtkit_recv(rtk, &rtk_msg);
-
-        if (ret > 0) {
-            rtkit_printf("unexpected message to non-system endpoint 0x%02x during shutdown: %lx\n",
-                         rtk_msg.ep, rtk_msg.msg);
-            continue;
-        } else if (ret < 0) {
-            rtkit_printf("IOP died during shutdown\n");
-            return false;
-        }
-    }
+    if (!rtkit_wait_power(rtk, &rtk->iop_power, target))
+        return false;
 
+    rtk->boot_state = RTKIT_BOOT_IDLE;
     return true;
 }
 
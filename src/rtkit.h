@@ -16,6 +16,9 @@ struct rtkit_message {
     u64 msg;
 };
 
+/* Called from rtkit_recv() for messages to an application endpoint it is installed for */
+typedef void (*rtkit_ep_handler_t)(void *opaque, u8 ep, u64 msg);
+
 struct rtkit_buffer {
     void *bfr;
     u64 dva;
@@ -30,6 +33,16 @@ void rtkit_free(rtkit_dev_t *rtk);
 
 bool rtkit_start_ep(rtkit_dev_t *rtk, u8 ep);
 bool rtkit_boot(rtkit_dev_t *rtk);
+/*
+ * Booting split into steps, so several IOPs can come up at once: rtkit_boot_all() starts them
+ * all and then services their mailboxes in a single poll loop. Boots that are already under way
+ * are not restarted, so rtkit_boot() also works to wait for one begun by rtkit_boot_start().
+ */
+bool rtkit_boot_start(rtkit_dev_t *rtk);
+int rtkit_boot_poll(rtkit_dev_t *rtk);
+bool rtkit_boot_all(rtkit_dev_t **rtks, int count);
+
+void rtkit_set_ep_handler(rtkit_dev_t *rtk, u8 ep, rtkit_ep_handler_t handler, void *opaque);
 
 int rtkit_recv(rtkit_dev_t *rtk, struct rtkit_message *msg);
 bool rtkit_send(rtkit_dev_t *rtk, const struct rtkit_message *msg);
@@ -40,4 +53,12 @@ bool rtkit_unmap(rtkit_dev_t *rtk, u64 dva, size_t sz);
 bool rtkit_alloc_buffer(rtkit_dev_t *rtk, struct rtkit_buffer *bfr, size_t sz);
 bool rtkit_free_buffer(rtkit_dev_t *rtk, struct rtkit_buffer *bfr);
 
+/*
+ * Deferred syslog: IOP log messages (and crash info) are queued instead of printed from
+ * rtkit_recv(), and formatted by the drain calls. Turning it off drains all devices.
+ */
+bool rtkit_set_syslog_deferred(bool deferred);
+int rtkit_syslog_drain(rtkit_dev_t *rtk);
+int rtkit_syslog_drain_all(void);
+
 #endif
@@ -6,15 +6,32 @@
 #include "string.h"
 #include "utils.h"
 
+#define APPLE_SART_MAX_ENTRIES 16
+
+/* Allowed regions we track; overlapping or adjacent ones share one hardware entry */
+#define SART_MAX_REGIONS 64
+
+struct sart_range {
+    u64 start;
+    u64 end;
+};
+
 struct sart_dev {
     uintptr_t base;
     u32 protected_entries;
+    size_t size_max;
 
     void (*get_entry)(sart_dev_t *sart, int index, u8 *flags, void **paddr, size_t *size);
     bool (*set_entry)(sart_dev_t *sart, int index, u8 flags, void *paddr, size_t size);
+
+    /* What the hardware entries hold, so updates don't need to read them back */
+    struct sart_range shadow[APPLE_SART_MAX_ENTRIES];
+    /* Regions as requested by callers, sorted by start address */
+    struct sart_range regions[SART_MAX_REGIONS];
+    u32 region_count;
 };
 
-#define APPLE_SART_MAX_ENTRIES 16
+#define SART_ALIGN 0x1000
 
 /* This is probably a bitfield but the exact meaning of each bit is unknown. */
 #define APPLE_SART_FLAGS_ALLOW 0xff
@@ -134,10 +151,12 @@ sart_dev_t *sart_init(const char *adt_path)
         case 2:
             sart->get_entry = sart2_get_entry;
             sart->set_entry = sart2_set_entry;
+            sart->size_max = (size_t)APPLE_SART2_CONFIG_SIZE_MAX << APPLE_SART2_CONFIG_SIZE_SHIFT;
             break;
         case 3:
             sart->get_entry = sart3_get_entry;
             sart->set_entry = sart3_set_entry;
+            sart->size_max = (size_t)APPLE_SART3_SIZE_MAX << APPLE_SART3_SIZE_SHIFT;
             break;
         default:
             printf("sart: SART %s has unknown version %d\n", adt_path, *sart_version);
@@ -154,8 +173,11 @@ sart_dev_t *sart_init(const char *adt_path)
         size_t sz;
 
         sart->get_entry(sart, i, &flags, &paddr, &sz);
-        if (flags)
+        if (flags) {
             sart->protected_entries |= 1 << i;
+            sart->shadow[i].start = (u64)paddr;
+            sart->shadow[i].end = (u64)paddr + sz;
+        }
     }
 
     return sart;
@@ -172,46 +194,135 @@ void sart_free(sart_dev_t *sart)
     free(sart);
 }
 
-bool sart_add_allowed_region(sart_dev_t *sart, void *paddr, size_t sz)
+/*
+ * Reprogram the unprotected entries to hold the union of the tracked regions. Entries that
+ * already hold one of the merged ranges are left alone, so adding a region that extends or falls
+ * inside an existing one costs at most one entry write. Fails without touching the hardware if
+ * the union doesn't fit.
+ */
+static bool sart_sync(sart_dev_t *sart)
 {
-    for (unsigned int i = 0; i < APPLE_SART_MAX_ENTRIES; ++i) {
-        void *e_paddr;
-        u8 e_flags;
-        size_t e_sz;
+    struct sart_range merged[APPLE_SART_MAX_ENTRIES];
+    u32 free_entries = APPLE_SART_MAX_ENTRIES - __builtin_popcount(sart->protected_entries);
+    u32 count = 0;
 
-        if (sart->protected_entries & (1 << i))
+    for (u32 i = 0; i < sart->region_count; i++) {
+        const struct sart_range *r = &sart->regions[i];
+
+        if (count && r->start <= merged[count - 1].end) {
+            merged[count - 1].end = max(merged[count - 1].end, r->end);
             continue;
+        }
+        if (count == free_entries) {
+            printf("sart: no more free entries\n");
+            return false;
+        }
+        merged[count++] = *r;
+    }
+
+    for (u32 i = 0; i < count; i++) {
+        if (merged[i].end - merged[i].start > sart->size_max) {
+            printf("sart: region 0x%lx..0x%lx too large\n", merged[i].start, merged[i].end);
+            return false;
+        }
+    }
+
+    u32 placed = 0; // bitmap over merged[]
+    u32 keep = sart->protected_entries;
+
+    for (unsigned int i = 0; i < APPLE_SART_MAX_ENTRIES; ++i) {
+        if (keep & (1 << i) || sart->shadow[i].start == sart->shadow[i].end)
+            continue;
+
+        for (u32 j = 0; j < count; j++) {
+            if (!(placed & (1 << j)) && sart->shadow[i].start == merged[j].start &&
+                sart->shadow[i].end == merged[j].end) {
+                placed |= 1 << j;
+                keep |= 1 << i;
+                break;
+            }
+        }
+    }
+
+    u32 next = 0;
+    for (unsigned int i = 0; i < APPLE_SART_MAX_ENTRIES; ++i) {
+        struct sart_range *e = &sart->shadow[i];
 
-        sart->get_entry(sart, i, &e_flags, &e_paddr, &e_sz);
-        if (e_flags)
+        if (keep & (1 << i))
             continue;
 
-        return sart->set_entry(sart, i, APPLE_SART_FLAGS_ALLOW, paddr, sz);
+        while (next < count && placed & (1 << next))
+            next++;
+
+        if (next < count) {
+            if (!sart->set_entry(sart, i, APPLE_SART_FLAGS_ALLOW, (void *)merged[next].start,
+                                 merged[next].end - merged[next].start))
+                return false;
+            *e = merged[next];
+            placed |= 1 << next;
+        } else if (e->start != e->end) {
+            sart->set_entry(sart, i, 0, NULL, 0);
+            e->start = e->end = 0;
+        }
     }
 
-    printf("sart: no more free entries\n");
+    return true;
+}
+
+bool sart_add_allowed_region(sart_dev_t *sart, void *paddr, size_t sz)
+{
+    u64 start = (u64)paddr;
+    u32 i;
+
+    if (!sz || (start | sz) & (SART_ALIGN - 1))
+        return false;
+
+    if (sart->region_count == SART_MAX_REGIONS) {
+        printf("sart: no more free entries\n");
+        return false;
+    }
+
+    for (i = sart->region_count; i > 0 && sart->regions[i - 1].start > start; i--)
+        ;
+
+    memmove(&sart->regions[i + 1], &sart->regions[i],
+            (sart->region_count - i) * sizeof(*sart->regions));
+    sart->regions[i].start = start;
+    sart->regions[i].end = start + sz;
+    sart->region_count++;
+
+    if (sart_sync(sart))
+        return true;
+
+    sart->region_count--;
+    memmove(&sart->regions[i], &sart->regions[i + 1],
+            (sart->region_count - i) * sizeof(*sart->regions));
     return false;
 }
 
 bool sart_remove_allowed_region(sart_dev_t *sart, void *paddr, size_t sz)
 {
-    for (unsigned int i = 0; i < APPLE_SART_MAX_ENTRIES; ++i) {
-        void *e_paddr;
-        u8 e_flags;
-        size_t e_sz;
+    u64 start = (u64)paddr;
 
-        if (sart->protected_entries & (1 << i))
-            continue;
+    for (u32 i = 0; i < sart->region_count; i++) {
+        struct sart_range r = sart->regions[i];
 
-        sart->get_entry(sart, i, &e_flags, &e_paddr, &e_sz);
-        if (!e_flags)
-            continue;
-        if (e_paddr != paddr)
-            continue;
-        if (e_sz != sz)
+        if (r.start != start || r.end != start + sz)
             continue;
 
-        return sart->set_entry(sart, i, 0, NULL, 0);
+        sart->region_count--;
+        memmove(&sart->regions[i], &sart->regions[i + 1],
+                (sart->region_count - i) * sizeof(*sart->regions));
+
+        if (sart_sync(sart))
+            return true;
+
+        // Punching a hole split a merged range and there's no entry for the second half
+        memmove(&sart->regions[i + 1], &sart->regions[i],
+                (sart->region_count - i) * sizeof(*sart->regions));
+        sart->regions[i] = r;
+        sart->region_count++;
+        return false;
     }
 
     printf("sart: could not find entry to be removed\n");
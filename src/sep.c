@@ -18,8 +18,22 @@
 
 #define SEP_TIMEOUT 1000
 
+// GETRAND requests kept in flight at once, well within the A2I mailbox FIFO
+#define SEP_GETRAND_INFLIGHT 8
+#define SEP_RANDOM_POOL_SIZE 512
+
 static asc_dev_t *sep_asc = NULL;
 
+/*
+ * Entropy fetched ahead of use. Each GETRAND reply only carries 32 bits, so requests are issued
+ * back to back and the spare words are kept here for the next caller. Bytes are cleared as they are
+ * handed out so none of them is ever used twice.
+ */
+static struct {
+    u8 buf[SEP_RANDOM_POOL_SIZE];
+    size_t avail;
+} sep_pool;
+
 int sep_init(void)
 {
     if (!sep_asc)
@@ -29,39 +43,79 @@ int sep_init(void)
     return 0;
 }
 
-size_t sep_get_random(void *buffer, size_t len)
+/* Fetch count random words, keeping several requests in flight. Returns the number fetched. */
+static size_t sep_fetch_random(u32 *words, size_t count)
 {
     const struct asc_message msg_getrand = {.msg0 = FIELD_PREP(SEP_MSG_EP, SEP_EP_ROM) |
                                                     FIELD_PREP(SEP_MSG_CMD, SEP_MSG_GETRAND)};
-    int ret;
-    size_t done = 0;
+    size_t sent = 0, done = 0;
 
-    ret = sep_init();
-    if (ret)
-        return 0;
+    while (done < count) {
+        // Only block on a full mailbox when nothing is outstanding
+        while (sent < count && sent - done < SEP_GETRAND_INFLIGHT &&
+               (sent == done || asc_can_send(sep_asc))) {
+            if (!asc_send(sep_asc, &msg_getrand))
+                break;
+            sent++;
+        }
 
-    while (len) {
-        struct asc_message reply;
-        u32 rng;
-        size_t copy;
+        if (sent == done)
+            break;
 
-        if (!asc_send(sep_asc, &msg_getrand))
-            return done;
+        struct asc_message reply;
         if (!asc_recv_timeout(sep_asc, &reply, SEP_TIMEOUT))
-            return done;
+            break;
         if (FIELD_GET(SEP_MSG_CMD, reply.msg0) != SEP_REPLY_GETRAND) {
             printf("SEP: unexpected getrand reply: %016lx\n", reply.msg0);
-            return done;
+            break;
         }
 
-        rng = FIELD_GET(SEP_MSG_DATA, reply.msg0);
-        copy = sizeof(rng);
-        if (copy > len)
-            copy = len;
-        memcpy(buffer, &rng, copy);
-        done += copy;
-        len -= copy;
-        buffer += copy;
+        words[done++] = FIELD_GET(SEP_MSG_DATA, reply.msg0);
+    }
+
+    // Don't leave replies to abandoned requests behind for the next caller
+    for (; sent > done; sent--) {
+        struct asc_message reply;
+        if (!asc_recv_timeout(sep_asc, &reply, SEP_TIMEOUT))
+            break;
+    }
+
+    return done;
+}
+
+static size_t sep_take_random(void *buffer, size_t len)
+{
+    size_t copy = min(len, sep_pool.avail);
+    u8 *src = sep_pool.buf + sep_pool.avail - copy;
+
+    memcpy(buffer, src, copy);
+    memset(src, 0, copy);
+    sep_pool.avail -= copy;
+
+    return copy;
+}
+
+size_t sep_get_random(void *buffer, size_t len)
+{
+    int ret;
+    size_t done;
+
+    ret = sep_init();
+    if (ret)
+        return 0;
+
+    done = sep_take_random(buffer, len);
+
+    while (done < len) {
+        // Refill the whole pool in one batch, so later callers are served without the mailbox
+        size_t want = SEP_RANDOM_POOL_SIZE / sizeof(u32);
+        size_t got = sep_fetch_random((u32 *)sep_pool.buf, want);
+
+        sep_pool.avail = got * sizeof(u32);
+        done += sep_take_random(buffer + done, len - done);
+
+        if (got < want)
+            break;
     }
 
     return done;
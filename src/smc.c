@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "smc.h"
+#include "asc.h"
+#include "string.h"
+#include "utils.h"
+
+/*
+ * Runs lists of SMC key reads and writes with the host out of the loop. The SMC is brought up and
+ * owned by the host's RTKit stack (proxyclient/m1n1/fw/smc.py), so this only talks to the SMC
+ * endpoint over the mailbox: anything else that comes in meanwhile is handed back to the host
+ * to process, in order.
+ */
+
+#define SMC_EP 0x20
+
+#define SMC_NOTIFICATION 0x18
+
+#define SMC_MSG_TYPE  GENMASK(7, 0)
+#define SMC_MSG_ID    GENMASK(15, 12)
+#define SMC_MSG_SIZE  GENMASK(23, 16)
+#define SMC_MSG_WSIZE GENMASK(31, 24)
+#define SMC_MSG_KEY   GENMASK(63, 32)
+
+#define SMC_RESULT       GENMASK(7, 0)
+#define SMC_RESULT_ID    GENMASK(15, 12)
+#define SMC_RESULT_SIZE  GENMASK(31, 16)
+#define SMC_RESULT_VALUE GENMASK(63, 32)
+
+#define SMC_TIMEOUT_US 500000
+
+static asc_dev_t *smc_asc;
+
+static void smc_spill(struct smc_batch *batch, const struct asc_message *msg)
+{
+    struct asc_message *spill = (struct asc_message *)batch->spill;
+
+    if (batch->spilled >= batch->max_spill) {
+        printf("smc: dropping message %lx for endpoint %x\n", msg->msg0, msg->msg1);
+        return;
+    }
+
+    spill[batch->spilled++] = *msg;
+}
+
+static int smc_wait_reply(struct smc_batch *batch, u32 id, u64 *reply)
+{
+    struct asc_message msg;
+
+    while (asc_recv_timeout(smc_asc, &msg, SMC_TIMEOUT_US)) {
+        if ((msg.msg1 & 0xff) == SMC_EP && FIELD_GET(SMC_RESULT, msg.msg0) != SMC_NOTIFICATION &&
+            FIELD_GET(SMC_RESULT_ID, msg.msg0) == id) {
+            *reply = msg.msg0;
+            return 0;
+        }
+        smc_spill(batch, &msg);
+    }
+
+    return -1;
+}
+
+static int smc_run_op(struct smc_batch *batch, struct smc_op *op)
+{
+    u32 id = batch->msgid & 0xf;
+    u64 reply;
+
+    if (op->wsize > SMC_OP_DATA || (op->cmd != SMC_WRITE_KEY && op->rsize > SMC_OP_DATA))
+        return -1;
+    if (op->cmd == SMC_WRITE_KEY || op->cmd == SMC_RW_KEY)
+        for (int i = 0; i < op->wsize; i++)
+            write8(batch->shmem + i, op->data[i]);
+
+    struct asc_message msg = {
+        .msg0 = FIELD_PREP(SMC_MSG_TYPE, op->cmd) | FIELD_PREP(SMC_MSG_ID, id) |
+                FIELD_PREP(SMC_MSG_KEY, op->key),
+        .msg1 = SMC_EP,
+    };
+    switch (op->cmd) {
+        case SMC_GET_KEY_BY_INDEX:
+            op->rsize = 4;
+            break;
+        case SMC_GET_KEY_INFO:
+            op->rsize = SMC_KEY_INFO_SIZE;
+            break;
+        case SMC_READ_KEY:
+            msg.msg0 |= FIELD_PREP(SMC_MSG_SIZE, op->rsize);
+            break;
+        case SMC_WRITE_KEY:
+            msg.msg0 |= FIELD_PREP(SMC_MSG_SIZE, op->wsize);
+            break;
+        case SMC_RW_KEY:
+            msg.msg0 |= FIELD_PREP(SMC_MSG_SIZE, op->rsize) | FIELD_PREP(SMC_MSG_WSIZE, op->wsize);
+            break;
+        default:
+            return -1;
+    }
+
+    if (!asc_send(smc_asc, &msg))
+        return -1;
+    batch->msgid++;
+
+    if (smc_wait_reply(batch, id, &reply) < 0) {
+        printf("smc: timed out waiting for key %08x\n", op->key);
+        return -1;
+    }
+
+    op->result = FIELD_GET(SMC_RESULT, reply);
+    if (op->cmd == SMC_WRITE_KEY || op->result)
+        return 0;
+
+    // Small values come back in the reply itself, like in SMCEndpoint.read(), key info does not
+    if (op->cmd != SMC_GET_KEY_INFO && op->rsize <= 4) {
+        u32 value = FIELD_GET(SMC_RESULT_VALUE, reply);
+        memcpy(op->data, &value, op->rsize);
+        return 0;
+    }
+
+    if (op->cmd != SMC_GET_KEY_INFO)
+        op->rsize = min(FIELD_GET(SMC_RESULT_SIZE, reply), (u64)SMC_OP_DATA);
+    for (int i = 0; i < op->rsize; i++)
+        op->data[i] = read8(batch->shmem + i);
+
+    return 0;
+}
+
+/*
+ * Run batch->count key operations in order. SMC errors are stored per op and do not stop the
+ * batch, a timeout or a malformed op does. Returns the number of ops that ran.
+ */
+int smc_batch(struct smc_batch *batch)
+{
+    struct smc_op *ops = (struct smc_op *)batch->ops;
+
+    if (!smc_asc)
+        smc_asc = asc_attach("/arm-io/smc");
+    if (!smc_asc)
+        return -1;
+
+    batch->spilled = 0;
+
+    u32 i;
+    for (i = 0; i < batch->count; i++)
+        if (smc_run_op(batch, &ops[i]) < 0)
+            break;
+
+    return i;
+}
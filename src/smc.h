@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef SMC_H
+#define SMC_H
+
+#include <assert.h>
+
+#include "asc.h"
+#include "types.h"
+
+#define SMC_READ_KEY         0x10
+#define SMC_WRITE_KEY        0x11
+#define SMC_GET_KEY_BY_INDEX 0x12
+#define SMC_GET_KEY_INFO     0x13
+#define SMC_RW_KEY           0x20
+
+#define SMC_KEY_INFO_SIZE 6
+
+#define SMC_OP_DATA 120
+
+// Shared with proxyclient/m1n1/fw/smc.py
+struct smc_op {
+    u32 key;   // fourcc, first character in the top byte, or the index for SMC_GET_KEY_BY_INDEX
+    u8 cmd;    // one of the SMC_* commands above
+    u8 wsize;  // bytes of data to write
+    u8 rsize;  // in: bytes to read, out: bytes the SMC returned
+    u8 result; // SMC result code, 0 on success
+    u8 data[SMC_OP_DATA];
+};
+static_assert(sizeof(struct smc_op) == 128, "struct smc_op layout changed");
+
+struct smc_batch {
+    u64 shmem; // the SMC's shared buffer, from its initialization message
+    u32 msgid; // in: next message ID to use, out: the one after the last used
+    u32 count;
+    u64 ops;   // struct smc_op[count]
+    u64 spill; // struct asc_message[max_spill], for messages that were not replies
+    u32 max_spill;
+    u32 spilled;
+};
+
+int smc_batch(struct smc_batch *batch);
+
+#endif
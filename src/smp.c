@@ -17,12 +17,18 @@
 #define CPU_REG_CLUSTER GENMASK(10, 8)
 #define CPU_REG_DIE     GENMASK(14, 11)
 
+// How long a core gets to pick up its stack, and how long all of them get to check in
+#define SMP_CLAIM_TIMEOUT 100000
+#define SMP_START_TIMEOUT 500000
+
 struct spin_table {
     u64 mpidr;
     u64 flag;
     u64 target;
     u64 args[4];
     u64 retval;
+    u64 counted; // started by smp_call_many, decrement smp_pending when done
+    const char *type;
 };
 
 void *_reset_stack;
@@ -34,23 +40,29 @@ u8 *secondary_stacks[MAX_CPUS] = {dummy_stack};
 
 static bool wfe_mode = false;
 
-static int target_cpu;
 static struct spin_table spin_table[MAX_CPUS];
+static u32 smp_pending;
 
 extern u8 _vectors_start[0];
 
-void smp_secondary_entry(void)
+void smp_secondary_entry(void *stack, const char *type)
 {
-    struct spin_table *me = &spin_table[target_cpu];
+    int index = 0;
+
+    // Several cores may be coming up at once, the stack we were handed tells us which one we are
+    for (int i = 1; i < MAX_CPUS; i++)
+        if (secondary_stacks[i] && stack == secondary_stacks[i] + SECONDARY_STACK_SIZE)
+            index = i;
+
+    struct spin_table *me = &spin_table[index];
 
     if (in_el2())
-        msr(TPIDR_EL2, target_cpu);
+        msr(TPIDR_EL2, index);
     else
-        msr(TPIDR_EL1, target_cpu);
-
-    printf("  Index: %d (table: %p)\n\n", target_cpu, me);
+        msr(TPIDR_EL1, index);
 
     me->mpidr = mrs(MPIDR_EL1) & 0xFFFFFF;
+    me->type = type;
 
     sysop("dmb sy");
     me->flag = 1;
@@ -75,24 +87,27 @@ void smp_secondary_entry(void)
         sysop("dmb sy");
         me->target = 0;
         sysop("dmb sy");
+        if (me->counted) {
+            me->counted = 0;
+            __atomic_sub_fetch(&smp_pending, 1, __ATOMIC_RELEASE);
+        }
     }
 }
 
-static void smp_start_cpu(int index, int die, int cluster, int core, u64 rvbar, u64 cpu_start_base)
+/*
+ * Kick a core and wait only until it has taken its stack from _reset_stack: the rest of its
+ * bring-up runs while the next cores are started. Returns true if the core got that far.
+ */
+static bool smp_start_cpu(int index, int die, int cluster, int core, u64 rvbar, u64 cpu_start_base)
 {
-    int i;
-
     if (index >= MAX_CPUS)
-        return;
+        return false;
 
     if (spin_table[index].flag)
-        return;
-
-    printf("Starting CPU %d (%d:%d:%d)... ", index, die, cluster, core);
+        return false;
 
     memset(&spin_table[index], 0, sizeof(struct spin_table));
 
-    target_cpu = index;
     secondary_stacks[index] = memalign(0x4000, SECONDARY_STACK_SIZE);
     _reset_stack = secondary_stacks[index] + SECONDARY_STACK_SIZE;
 
@@ -109,19 +124,41 @@ static void smp_start_cpu(int index, int die, int cluster, int core, u64 rvbar,
     // Actually start the core
     write32(cpu_start_base + 0x8 + 4 * cluster, 1 << core);
 
-    for (i = 0; i < 500; i++) {
+    u64 timeout = timeout_calculate(SMP_CLAIM_TIMEOUT);
+    while (!timeout_expired(timeout)) {
         sysop("dmb ld");
-        if (spin_table[index].flag)
-            break;
-        udelay(1000);
+        if (!_reset_stack)
+            return true;
     }
 
-    if (i >= 500)
-        printf("Failed!\n");
-    else
-        printf("  Started.\n");
-
+    printf("Failed to start CPU %d (%d:%d:%d)\n", index, die, cluster, core);
     _reset_stack = dummy_stack + DUMMY_STACK_SIZE;
+    sysop("dmb sy");
+    return false;
+}
+
+// Wait for the cores in mask to check in, all against the same deadline
+static void smp_wait_started(u64 mask)
+{
+    u64 pending = mask;
+    u64 timeout = timeout_calculate(SMP_START_TIMEOUT);
+
+    while (pending && !timeout_expired(timeout)) {
+        sysop("dmb ld");
+        for (int i = 1; i < MAX_CPUS; i++)
+            if ((pending & BIT(i)) && spin_table[i].flag)
+                pending &= ~BIT(i);
+    }
+
+    for (int i = 1; i < MAX_CPUS; i++) {
+        if (!(mask & BIT(i)))
+            continue;
+
+        if (pending & BIT(i))
+            printf("  CPU %d: failed to check in\n", i);
+        else
+            printf("  CPU %d: MPIDR 0x%lx, %s\n", i, spin_table[i].mpidr, spin_table[i].type);
+    }
 }
 
 void smp_start_secondaries(void)
@@ -180,6 +217,8 @@ void smp_start_secondaries(void)
         cpu_nodes[cpu_id] = node;
     }
 
+    u64 started = 0;
+
     for (int i = 1; i < MAX_CPUS; i++) {
         int node = cpu_nodes[i];
 
@@ -197,9 +236,15 @@ void smp_start_secondaries(void)
         u8 cluster = FIELD_GET(CPU_REG_CLUSTER, reg);
         u8 die = FIELD_GET(CPU_REG_DIE, reg);
 
-        smp_start_cpu(i, die, cluster, core, cpu_impl_reg[0], pmgr_reg + cpu_start_off);
+        if (smp_start_cpu(i, die, cluster, core, cpu_impl_reg[0], pmgr_reg + cpu_start_off))
+            started |= BIT(i);
     }
 
+    _reset_stack = dummy_stack + DUMMY_STACK_SIZE;
+    sysop("dmb sy");
+
+    smp_wait_started(started);
+
     spin_table[0].mpidr = mrs(MPIDR_EL1) & 0xFFFFFF;
 }
 
@@ -240,6 +285,71 @@ void smp_call4(int cpu, void *func, u64 arg0, u64 arg1, u64 arg2, u64 arg3)
         sysop("dmb sy");
 }
 
+/*
+ * Start func on all alive secondaries in mask at once: every target is armed before a single
+ * SEV (or a burst of IPIs), and only then do we wait for them to pick the call up, so the CPUs
+ * start together instead of one after the other. Returns the mask of CPUs actually started.
+ */
+u64 smp_call_many(u64 mask, void *func, u64 arg0, u64 arg1, u64 arg2, u64 arg3)
+{
+    u64 flags[MAX_CPUS];
+    u64 started = 0;
+
+    for (int cpu = 1; cpu < MAX_CPUS; cpu++) {
+        struct spin_table *target = &spin_table[cpu];
+
+        if (!(mask & BIT(cpu)) || !smp_is_alive(cpu) || target->target)
+            continue;
+
+        flags[cpu] = target->flag;
+        target->args[0] = arg0;
+        target->args[1] = arg1;
+        target->args[2] = arg2;
+        target->args[3] = arg3;
+        target->counted = 1;
+        started |= BIT(cpu);
+    }
+
+    __atomic_add_fetch(&smp_pending, __builtin_popcountl(started), __ATOMIC_RELAXED);
+    sysop("dmb sy");
+
+    for (int cpu = 1; cpu < MAX_CPUS; cpu++)
+        if (started & BIT(cpu))
+            spin_table[cpu].target = (u64)func;
+    sysop("dsb sy");
+
+    if (wfe_mode) {
+        sysop("sev");
+    } else {
+        for (int cpu = 1; cpu < MAX_CPUS; cpu++)
+            if (started & BIT(cpu))
+                smp_send_ipi(cpu);
+    }
+
+    for (int cpu = 1; cpu < MAX_CPUS; cpu++)
+        if (started & BIT(cpu))
+            while (spin_table[cpu].flag == flags[cpu])
+                sysop("dmb sy");
+
+    return started;
+}
+
+/*
+ * Wait for all outstanding smp_call_many calls, and for all CPUs in mask to become idle. The
+ * former are tracked by a single completion counter, so that is all we spin on; individual CPUs
+ * are only checked afterwards, to catch anything started with smp_call4. Results can then be
+ * fetched with smp_wait().
+ */
+void smp_wait_all(u64 mask)
+{
+    while (__atomic_load_n(&smp_pending, __ATOMIC_ACQUIRE))
+        sysop("dmb sy");
+
+    for (int cpu = 1; cpu < MAX_CPUS; cpu++)
+        if (mask & BIT(cpu))
+            smp_wait(cpu);
+}
+
 u64 smp_wait(int cpu)
 {
     if (cpu >= MAX_CPUS)
@@ -273,6 +383,15 @@ bool smp_is_alive(int cpu)
     return spin_table[cpu].flag;
 }
 
+// Still running something started with smp_call*()
+bool smp_is_busy(int cpu)
+{
+    if (cpu >= MAX_CPUS)
+        return false;
+
+    return spin_table[cpu].target;
+}
+
 uint64_t smp_get_mpidr(int cpu)
 {
     if (cpu >= MAX_CPUS)
@@ -11,7 +11,7 @@
 #define SECONDARY_STACK_SIZE 0x10000
 extern u8 *secondary_stacks[MAX_CPUS];
 
-void smp_secondary_entry(void);
+void smp_secondary_entry(void *stack, const char *type);
 
 void smp_start_secondaries(void);
 
@@ -22,9 +22,13 @@ void smp_start_secondaries(void);
 
 void smp_call4(int cpu, void *func, u64 arg0, u64 arg1, u64 arg2, u64 arg3);
 
+u64 smp_call_many(u64 mask, void *func, u64 arg0, u64 arg1, u64 arg2, u64 arg3);
+
 u64 smp_wait(int cpu);
+void smp_wait_all(u64 mask);
 
 bool smp_is_alive(int cpu);
+bool smp_is_busy(int cpu);
 uint64_t smp_get_mpidr(int cpu);
 u64 smp_get_release_addr(int cpu);
 void smp_set_wfe_mode(bool new_mode);
@@ -1,5 +1,7 @@
 /* SPDX-License-Identifier: MIT */
 
+#include "bootprof.h"
+#include "chainload.h"
 #include "chickens.h"
 #include "exception.h"
 #include "smp.h"
@@ -44,6 +46,42 @@ void apply_rela(uint64_t base, struct rela_entry *rela_start, struct rela_entry
     }
 }
 
+/*
+ * RELR packed relative relocations (-z pack-relative-relocs): the addend is already in place. An
+ * even entry is the offset of a slot to relocate, an odd one is a bitmap for the 63 slots that
+ * follow the last one relocated, bit n + 1 standing for slot n. That is 8 bytes for up to 64
+ * relocations instead of 24 for each, which matters with the caches still off.
+ *
+ * Unlike RELA this adds to what is there, so remember what was applied in case we get entered
+ * again in place. The base lives in .data, .bss isn't cleared yet.
+ */
+static u64 relr_base __attribute__((section(".data")));
+
+void apply_relr(uint64_t base, u64 *relr_start, u64 *relr_end)
+{
+    u64 delta = base - relr_base;
+    u64 *where = NULL;
+
+    if (!delta)
+        return;
+
+    for (u64 *e = relr_start; e < relr_end; e++) {
+        u64 entry = *e;
+
+        if (!(entry & 1)) {
+            where = (u64 *)(base + entry);
+            *where++ += delta;
+            continue;
+        }
+
+        for (u64 bits = entry >> 1; bits; bits &= bits - 1)
+            where[__builtin_ctzl(bits)] += delta;
+        where += 63;
+    }
+
+    relr_base = base;
+}
+
 void dump_boot_args(struct boot_args *ba)
 {
     printf("  revision:     %d\n", ba->revision);
@@ -78,12 +116,15 @@ void _start_c(void *boot_args, void *base)
         msr(TPIDR_EL1, 0);
 
     memset64(_bss_start, 0, _bss_end - _bss_start);
+    bootprof_mark(BOOTPROF_START);
     boot_args_addr = (u64)boot_args;
     memcpy(&cur_boot_args, boot_args, sizeof(cur_boot_args));
 
     adt =
         (void *)(((u64)cur_boot_args.devtree) - cur_boot_args.virt_base + cur_boot_args.phys_base);
 
+    chainload_snapshot();
+
     int ret = uart_init();
     if (ret < 0) {
         debug_putc('!');
@@ -106,16 +147,23 @@ void _start_c(void *boot_args, void *base)
 /* Secondary SMP core boot */
 void _cpu_reset_c(void *stack)
 {
-    if (mrs(MPIDR_EL1) & 0xffffff)
-        uart_puts("RVBAR entry on secondary CPU");
-    else
+    const char *type;
+
+    /*
+     * Secondaries all come up at once and would only garble each other's output on the UART, so
+     * they stay quiet and smp_start_secondaries() reports them once they have checked in.
+     */
+    if (mrs(MPIDR_EL1) & 0xffffff) {
+        type = init_cpu();
+    } else {
         uart_puts("RVBAR entry on primary CPU");
 
-    printf("\n  Stack base: %p\n", stack);
-    printf("  MPIDR: 0x%lx\n", mrs(MPIDR_EL1));
-    const char *type = init_cpu();
-    printf("  CPU: %s\n", type);
+        printf("\n  Stack base: %p\n", stack);
+        printf("  MPIDR: 0x%lx\n", mrs(MPIDR_EL1));
+        type = init_cpu();
+        printf("  CPU: %s\n", type);
+    }
 
     exception_initialize();
-    smp_secondary_entry();
+    smp_secondary_entry(stack, type);
 }
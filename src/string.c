@@ -6,38 +6,7 @@
 
 // Routines based on The Public Domain C Library
 
-void *memcpy(void *s1, const void *s2, size_t n)
-{
-    char *dest = (char *)s1;
-    const char *src = (const char *)s2;
-
-    while (n--) {
-        *dest++ = *src++;
-    }
-
-    return s1;
-}
-
-void *memmove(void *s1, const void *s2, size_t n)
-{
-    char *dest = (char *)s1;
-    const char *src = (const char *)s2;
-
-    if (dest <= src) {
-        while (n--) {
-            *dest++ = *src++;
-        }
-    } else {
-        src += n;
-        dest += n;
-
-        while (n--) {
-            *--dest = *--src;
-        }
-    }
-
-    return s1;
-}
+// memcpy, memmove and memset live in string_asm.S
 
 int memcmp(const void *s1, const void *s2, size_t n)
 {
@@ -56,17 +25,6 @@ int memcmp(const void *s1, const void *s2, size_t n)
     return 0;
 }
 
-void *memset(void *s, int c, size_t n)
-{
-    unsigned char *p = (unsigned char *)s;
-
-    while (n--) {
-        *p++ = (unsigned char)c;
-    }
-
-    return s;
-}
-
 void *memchr(const void *s, int c, size_t n)
 {
     const unsigned char *p = (const unsigned char *)s;
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "sysreg.h"
+#include "exception.h"
+#include "memory.h"
+#include "smp.h"
+#include "utils.h"
+
+#define MRS_X0 0xd5200000
+#define MSR_X0 0xd5000000
+#define RET    0xd65f03c0
+
+/*
+ * One instruction slot per CPU, rewritten when the encoding changes, so repeated accesses to
+ * the same register skip the cache maintenance. Each slot owns a cache line so that CPUs never
+ * patch each other's code.
+ */
+struct sysreg_slot {
+    u32 insn;
+    u32 ret;
+    u32 pad[14];
+} ALIGNED(64);
+
+static struct sysreg_slot sysreg_slots[MAX_CPUS];
+
+typedef u64(sysreg_fn_t)(u64 val);
+
+static bool sysreg_run(u32 insn, u64 *val)
+{
+    struct sysreg_slot *slot = &sysreg_slots[smp_id()];
+    int exc_start = exc_count;
+
+    if (slot->insn != insn || slot->ret != RET) {
+        slot->insn = insn;
+        slot->ret = RET;
+        dc_cvau(slot);
+        sysop("dsb ish");
+        ic_iavau(slot);
+        sysop("dsb ish");
+        sysop("isb");
+    }
+
+    u64 addr = (u64)slot;
+    // RAM is only executable through the RX alias once the MMU is up
+    if (mmu_active())
+        addr |= REGION_RX_EL1;
+
+    *val = ((sysreg_fn_t *)addr)(*val);
+
+    return exc_count == exc_start;
+}
+
+bool sysreg_read(u32 enc, u64 *val)
+{
+    /*
+     * exc_count is shared by all CPUs, so a fault elsewhere can make it move under us. A read
+     * that faulted leaves the marker in x0 under either guard mode, a register is very
+     * unlikely to hold it by chance.
+     */
+    *val = SYSREG_FAULT;
+    if (sysreg_run(MRS_X0 | ((enc & SYSREG_ENC_MASK) << 5), val))
+        return true;
+
+    return *val != SYSREG_FAULT;
+}
+
+bool sysreg_write(u32 enc, u64 val)
+{
+    return sysreg_run(MSR_X0 | ((enc & SYSREG_ENC_MASK) << 5), &val);
+}
+
+static u64 sysreg_dump_cpu(u64 cpu_mask, u64 encs, u64 count, u64 values)
+{
+    int cpu = smp_id();
+    u64 *row = (u64 *)values + __builtin_popcountl(cpu_mask & (BIT(cpu) - 1)) * count;
+
+    for (u64 i = 0; i < count; i++)
+        if (!sysreg_read(((u32 *)encs)[i], &row[i]))
+            row[i] = SYSREG_FAULT;
+
+    return 0;
+}
+
+u64 sysreg_dump(u64 cpu_mask, const u32 *encs, u32 count, u64 *values)
+{
+    u64 self = BIT(smp_id());
+    size_t size = __builtin_popcountl(cpu_mask) * count * sizeof(u64);
+
+    // Secondaries without their MMU up bypass our caches
+    dc_cvac_range((void *)encs, count * sizeof(u32));
+    dc_civac_range(values, size);
+    sysop("dsb sy");
+
+    u64 started = smp_call_many(cpu_mask & ~self, sysreg_dump_cpu, cpu_mask, (u64)encs, count,
+                                (u64)values);
+
+    if (cpu_mask & self) {
+        sysreg_dump_cpu(cpu_mask, (u64)encs, count, (u64)values);
+        started |= self;
+    }
+
+    smp_wait_all(started & ~self);
+    dc_ivac_range(values, size);
+    sysop("dsb sy");
+
+    return started;
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef SYSREG_H
+#define SYSREG_H
+
+#include "types.h"
+
+/*
+ * Access to system registers picked at runtime. enc packs the instruction fields the same way
+ * the MRS/MSR immediate does: op0 << 14 | op1 << 11 | CRn << 7 | CRm << 3 | op2.
+ */
+#define SYSREG_ENC(op0, op1, CRn, CRm, op2)                                                        \
+    (((op0) << 14) | ((op1) << 11) | ((CRn) << 7) | ((CRm) << 3) | (op2))
+#define SYSREG_ENC_MASK 0xffff
+
+// Value of reads that faulted, the same marker GUARD_MARK leaves behind
+#define SYSREG_FAULT 0xacce5515abad1dea
+
+/*
+ * Both must run under GUARD_SKIP or GUARD_MARK for registers that may not exist; they return
+ * false if the access faulted.
+ */
+bool sysreg_read(u32 enc, u64 *val);
+bool sysreg_write(u32 enc, u64 val);
+
+/*
+ * Read count registers on all CPUs in cpu_mask in parallel. values is a matrix with one row of
+ * count entries per CPU in the mask, in ascending CPU order; reads that faulted are stored as
+ * SYSREG_FAULT. Returns the mask of CPUs that ran, the rows of offline or busy CPUs are left
+ * untouched.
+ */
+u64 sysreg_dump(u64 cpu_mask, const u32 *encs, u32 count, u64 *values);
+
+#endif
@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "task.h"
+#include "smp.h"
+#include "utils.h"
+
+/*
+ * Fork/join work stealing on top of the SMP spin tables.
+ *
+ * Every CPU has a deque of tasks: the owner pushes and pops at the tail, idle CPUs steal from
+ * the head, so work spawned close together tends to stay on one CPU while the big chunks spread
+ * out. task_join() pulls in all idle secondaries with smp_call_many() and everyone runs tasks
+ * until the group has none pending. Tasks may spawn more tasks into their own group.
+ *
+ * The deques are tiny and only locked for a handful of instructions, so a spinlock per deque is
+ * plenty; if one fills up, the task just runs inline.
+ */
+
+#define TASK_QUEUE_SIZE 256
+
+struct task {
+    task_fn fn;
+    struct task_group *group;
+    u64 args[3];
+};
+
+struct task_queue {
+    spinlock_t lock;
+    u32 head;
+    u32 tail;
+    struct task tasks[TASK_QUEUE_SIZE];
+};
+
+static struct task_queue queues[MAX_CPUS] = {
+    [0 ... MAX_CPUS - 1] = {.lock = SPINLOCK_INIT_NAMED("task_queue")},
+};
+
+static void task_run(struct task *task)
+{
+    task->fn(task->args[0], task->args[1], task->args[2]);
+    __atomic_sub_fetch(&task->group->pending, 1, __ATOMIC_RELEASE);
+}
+
+void task_spawn(struct task_group *group, task_fn fn, u64 arg0, u64 arg1, u64 arg2)
+{
+    struct task_queue *q = &queues[smp_id()];
+    struct task task = {
+        .fn = fn,
+        .group = group,
+        .args = {arg0, arg1, arg2},
+    };
+
+    __atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+
+    spin_lock(&q->lock);
+    if (q->tail - q->head < TASK_QUEUE_SIZE) {
+        q->tasks[q->tail++ % TASK_QUEUE_SIZE] = task;
+        spin_unlock(&q->lock);
+        return;
+    }
+    spin_unlock(&q->lock);
+
+    task_run(&task);
+}
+
+static bool task_pop(struct task_queue *q, struct task *task)
+{
+    bool found = false;
+
+    spin_lock(&q->lock);
+    if (q->tail != q->head) {
+        *task = q->tasks[--q->tail % TASK_QUEUE_SIZE];
+        found = true;
+    }
+    spin_unlock(&q->lock);
+
+    return found;
+}
+
+static bool task_steal(struct task_queue *q, struct task *task)
+{
+    bool found = false;
+
+    // Peek without the lock first, so idle CPUs don't hammer empty queues
+    if (__atomic_load_n(&q->tail, __ATOMIC_RELAXED) == __atomic_load_n(&q->head, __ATOMIC_RELAXED))
+        return false;
+
+    spin_lock(&q->lock);
+    if (q->tail != q->head) {
+        *task = q->tasks[q->head++ % TASK_QUEUE_SIZE];
+        found = true;
+    }
+    spin_unlock(&q->lock);
+
+    return found;
+}
+
+static u64 task_worker(u64 group_ptr, u64 a1, u64 a2, u64 a3)
+{
+    struct task_group *group = (struct task_group *)group_ptr;
+    int me = smp_id();
+    struct task task;
+
+    UNUSED(a1);
+    UNUSED(a2);
+    UNUSED(a3);
+
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE)) {
+        if (task_pop(&queues[me], &task)) {
+            task_run(&task);
+            continue;
+        }
+
+        bool stolen = false;
+        for (int i = 1; i < MAX_CPUS && !stolen; i++) {
+            int victim = (me + i) % MAX_CPUS;
+            if ((stolen = task_steal(&queues[victim], &task)))
+                task_run(&task);
+        }
+    }
+
+    return 0;
+}
+
+void task_join(struct task_group *group)
+{
+    if (!__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE))
+        return;
+
+    // Only the outermost join recruits helpers; nested joins run on whoever is already working
+    u64 helpers = 0;
+    if (smp_id() == 0)
+        helpers = smp_call_many(~BIT(0), task_worker, (u64)group, 0, 0, 0);
+
+    task_worker((u64)group, 0, 0, 0);
+
+    if (helpers)
+        smp_wait_all(helpers);
+}
+
+/*
+ * Run fn(arg, chunk_start, chunk_end) over [start, end) in chunks of grain, on all CPUs, and
+ * return when every chunk is done.
+ */
+void task_parallel_for(task_fn fn, u64 arg, u64 start, u64 end, u64 grain)
+{
+    struct task_group group = TASK_GROUP_INIT;
+
+    if (!grain)
+        grain = 1;
+
+    // Not worth waking anyone up for
+    if (end - start <= grain) {
+        if (end > start)
+            fn(arg, start, end);
+        return;
+    }
+
+    for (u64 chunk = start; chunk < end; chunk += min(grain, end - chunk))
+        task_spawn(&group, fn, arg, chunk, min(chunk + grain, end));
+
+    task_join(&group);
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef TASK_H
+#define TASK_H
+
+#include "types.h"
+
+typedef void (*task_fn)(u64 arg0, u64 arg1, u64 arg2);
+
+struct task_group {
+    u32 pending;
+};
+
+#define TASK_GROUP_INIT                                                                            \
+    {                                                                                              \
+        0                                                                                          \
+    }
+
+void task_spawn(struct task_group *group, task_fn fn, u64 arg0, u64 arg1, u64 arg2);
+void task_join(struct task_group *group);
+
+void task_parallel_for(task_fn fn, u64 arg, u64 start, u64 end, u64 grain);
+
+#endif
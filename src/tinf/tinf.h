@@ -81,6 +81,29 @@ void TINFCC tinf_init(void);
 int TINFCC tinf_uncompress(void *dest, unsigned int *destLen,
                            const void *source, unsigned int *sourceLen);
 
+/**
+ * Callback used by `tinf_uncompress_stream` to fetch more compressed input.
+ *
+ * Sets `*buf` to the next block of input and returns its size, or returns 0
+ * at the end of the input.
+ */
+typedef unsigned int (*tinf_fill_fn)(void *ctx, const unsigned char **buf);
+
+/**
+ * Decompress deflate data from a stream to `dest`.
+ *
+ * Like `tinf_uncompress`, but the compressed data is fetched incrementally
+ * by calling `fill` whenever more input is needed.
+ *
+ * @param dest pointer to where to place decompressed data
+ * @param destLen pointer to variable containing size of `dest`
+ * @param fill callback to fetch more compressed data
+ * @param ctx opaque pointer passed to `fill`
+ * @return `TINF_OK` on success, error code on error
+ */
+int TINFCC tinf_uncompress_stream(void *dest, unsigned int *destLen,
+                                  tinf_fill_fn fill, void *ctx);
+
 /**
  * Decompress `sourceLen` bytes of gzip data from `source` to `dest`.
  *
@@ -99,6 +122,21 @@ int TINFCC tinf_uncompress(void *dest, unsigned int *destLen,
 int TINFCC tinf_gzip_uncompress(void *dest, unsigned int *destLen,
                                 const void *source, unsigned int *sourceLen);
 
+/**
+ * Callback used by `tinf_gzip_uncompress_crc` to checksum the output.
+ */
+typedef unsigned int (*tinf_crc_fn)(const void *data, unsigned int length);
+
+/**
+ * Like `tinf_gzip_uncompress`, but the CRC32 of the decompressed data is
+ * computed by `crc` instead of `tinf_crc32`. If `crc` is NULL, the CRC32 is
+ * not checked, and it is up to the caller to do so using the trailer at the
+ * end of the consumed input.
+ */
+int TINFCC tinf_gzip_uncompress_crc(void *dest, unsigned int *destLen,
+                                    const void *source, unsigned int *sourceLen,
+                                    tinf_crc_fn crc);
+
 /**
  * Decompress `sourceLen` bytes of zlib data from `source` to `dest`.
  *
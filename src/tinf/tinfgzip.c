@@ -51,6 +51,14 @@ static unsigned int read_le32(const unsigned char *p)
 
 int tinf_gzip_uncompress(void *dest, unsigned int *destLen,
                          const void *source, unsigned int *sourceLen)
+{
+	return tinf_gzip_uncompress_crc(dest, destLen, source, sourceLen,
+	                                tinf_crc32);
+}
+
+int tinf_gzip_uncompress_crc(void *dest, unsigned int *destLen,
+                             const void *source, unsigned int *sourceLen,
+                             tinf_crc_fn crc)
 {
 	const unsigned char *src = (const unsigned char *) source;
 	unsigned char *dst = (unsigned char *) dest;
@@ -183,7 +191,7 @@ int tinf_gzip_uncompress(void *dest, unsigned int *destLen,
 
 	crc32 = read_le32(&src[*sourceLen - 8]);
 
-	if (crc32 != tinf_crc32(dst, dlen)) {
+	if (crc && crc32 != crc(dst, dlen)) {
 		return TINF_DATA_ERROR;
 	}
 
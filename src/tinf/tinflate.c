@@ -28,6 +28,7 @@
 #include "tinf.h"
 
 #include <assert.h>
+#include <string.h>
 #include <limits.h>
 
 #if defined(UINT_MAX) && (UINT_MAX) < 0xFFFFFFFFUL
@@ -36,16 +37,31 @@
 
 /* -- Internal data structures -- */
 
+/*
+ * Codes up to TINF_FAST_BITS long are decoded with a single lookup in
+ * a table indexed by the next TINF_FAST_BITS input bits. Each entry
+ * holds the symbol and code length as (sym << 4) | len. For prefixes
+ * of longer codes the length is 0 and the entry holds the state of the
+ * tree walk after TINF_FAST_BITS bits instead, so that decoding picks
+ * up the walk from there.
+ */
+#define TINF_FAST_BITS 10
+#define TINF_FAST_SIZE (1 << TINF_FAST_BITS)
+
 struct tinf_tree {
 	unsigned short counts[16]; /* Number of codes with a given length */
 	unsigned short symbols[288]; /* Symbols sorted by code */
+	unsigned short fast[TINF_FAST_SIZE]; /* Lookup table for short codes */
+	unsigned short fast_base; /* Number of codes up to TINF_FAST_BITS long */
 	int max_sym;
 };
 
 struct tinf_data {
 	const unsigned char *source;
 	const unsigned char *source_end;
-	unsigned int tag;
+	tinf_fill_fn fill;
+	void *fill_ctx;
+	unsigned long long tag;
 	int bitcount;
 	int overflow;
 
@@ -65,6 +81,55 @@ static unsigned int read_le16(const unsigned char *p)
 	     | ((unsigned int) p[1] << 8);
 }
 
+static unsigned long long read_le64(const unsigned char *p)
+{
+	return ((unsigned long long) read_le16(p))
+	     | ((unsigned long long) read_le16(p + 2) << 16)
+	     | ((unsigned long long) read_le16(p + 4) << 32)
+	     | ((unsigned long long) read_le16(p + 6) << 48);
+}
+
+/* Build the lookup table for codes up to TINF_FAST_BITS long */
+static void tinf_build_fast_table(struct tinf_tree *t)
+{
+	unsigned int len, i, j, code = 0, idx = 0;
+
+	for (len = 1; len <= TINF_FAST_BITS; ++len) {
+		for (i = 0; i < t->counts[len]; ++i, ++code, ++idx) {
+			unsigned int rev = 0;
+
+			/* Codes are stored starting from the most significant bit */
+			for (j = 0; j < len; ++j) {
+				rev |= ((code >> j) & 1) << (len - 1 - j);
+			}
+
+			for (j = rev; j < TINF_FAST_SIZE; j += 1 << len) {
+				t->fast[j] = (t->symbols[idx] << 4) | len;
+			}
+		}
+
+		if (len < TINF_FAST_BITS) {
+			code <<= 1;
+		}
+	}
+
+	t->fast_base = idx;
+
+	/*
+	 * The remaining prefixes are the internal nodes at this depth, and
+	 * their offset among them is what the tree walk would have computed
+	 */
+	for (i = code; i < TINF_FAST_SIZE; ++i) {
+		unsigned int rev = 0;
+
+		for (j = 0; j < TINF_FAST_BITS; ++j) {
+			rev |= ((i >> j) & 1) << (TINF_FAST_BITS - 1 - j);
+		}
+
+		t->fast[rev] = (i - code) << 4;
+	}
+}
+
 /* Build fixed Huffman trees */
 static void tinf_build_fixed_trees(struct tinf_tree *lt, struct tinf_tree *dt)
 {
@@ -106,6 +171,9 @@ static void tinf_build_fixed_trees(struct tinf_tree *lt, struct tinf_tree *dt)
 	}
 
 	dt->max_sym = 29;
+
+	tinf_build_fast_table(lt);
+	tinf_build_fast_table(dt);
 }
 
 /* Given an array of code lengths, build a tree */
@@ -172,27 +240,93 @@ static int tinf_build_tree(struct tinf_tree *t, const unsigned char *lengths,
 		t->symbols[1] = t->max_sym + 1;
 	}
 
+	tinf_build_fast_table(t);
+
 	return TINF_OK;
 }
 
 /* -- Decode functions -- */
 
+/* Check for available input, fetching more from the stream if needed */
+static int tinf_source_avail(struct tinf_data *d)
+{
+	unsigned int len;
+
+	if (d->source != d->source_end) {
+		return 1;
+	}
+
+	if (!d->fill) {
+		return 0;
+	}
+
+	len = d->fill(d->fill_ctx, &d->source);
+	d->source_end = d->source + len;
+
+	return len != 0;
+}
+
+/*
+ * Top the bit buffer up to at least 56 bits with a single 64-bit load if
+ * there are 8 bytes left in the source. Bits above bitcount are left
+ * holding the bytes that follow, which later refills OR in again.
+ */
+static int tinf_refill_fast(struct tinf_data *d)
+{
+	if (d->source_end ? d->source_end - d->source < 8 : d->fill != 0) {
+		return 0;
+	}
+
+	d->tag |= read_le64(d->source) << d->bitcount;
+	d->source += (63 - d->bitcount) >> 3;
+	d->bitcount |= 56;
+
+	return 1;
+}
+
+/* Read bytes that are available until at least num bits are buffered */
+static void tinf_refill_avail(struct tinf_data *d, int num)
+{
+	if (tinf_refill_fast(d)) {
+		return;
+	}
+
+	while (d->bitcount < num && tinf_source_avail(d)) {
+		d->tag |= (unsigned long long) *d->source++ << d->bitcount;
+		d->bitcount += 8;
+	}
+}
+
 static void tinf_refill(struct tinf_data *d, int num)
 {
 	assert(num >= 0 && num <= 32);
 
-	/* Read bytes until at least num bits available */
+	if (d->bitcount >= num) {
+		return;
+	}
+
+	tinf_refill_avail(d, num);
+
+	/* Past the end of the input, pad with zeros and flag the overflow */
 	while (d->bitcount < num) {
-		if (d->source != d->source_end) {
-			d->tag |= (unsigned int) *d->source++ << d->bitcount;
-		}
-		else {
-			d->overflow = 1;
-		}
+		d->overflow = 1;
 		d->bitcount += 8;
 	}
 
-	assert(d->bitcount <= 32);
+	assert(d->bitcount <= 64);
+}
+
+/*
+ * Return whole bytes still held in the bit buffer to the source, so that
+ * it points just past the last byte that was (partly) used
+ */
+static void tinf_unread_bytes(struct tinf_data *d)
+{
+	if (!d->fill && !d->overflow) {
+		d->source -= d->bitcount >> 3;
+		d->tag &= (1ULL << (d->bitcount & 7)) - 1;
+		d->bitcount &= 7;
+	}
 }
 
 static unsigned int tinf_getbits_no_refill(struct tinf_data *d, int num)
@@ -229,6 +363,31 @@ static int tinf_decode_symbol(struct tinf_data *d, const struct tinf_tree *t)
 {
 	int base = 0, offs = 0;
 	int len;
+	unsigned int entry;
+
+	if (d->bitcount < 15) {
+		tinf_refill_avail(d, 15);
+	}
+
+	/* Look the code up if enough bits are buffered */
+	entry = t->fast[d->tag & (TINF_FAST_SIZE - 1)];
+	len = entry & 15;
+
+	if (len && len <= d->bitcount) {
+		tinf_getbits_no_refill(d, len);
+		return entry >> 4;
+	}
+
+	if (!len && d->bitcount >= TINF_FAST_BITS) {
+		/* Long code, continue the walk after its first bits */
+		tinf_getbits_no_refill(d, TINF_FAST_BITS);
+		base = t->fast_base;
+		offs = entry >> 4;
+		len = TINF_FAST_BITS + 1;
+	}
+	else {
+		len = 1;
+	}
 
 	/*
 	 * Get more bits while code index is above number of codes
@@ -243,7 +402,7 @@ static int tinf_decode_symbol(struct tinf_data *d, const struct tinf_tree *t)
 	 * falls within the leaves we are done. Otherwise we adjust the range
 	 * of offs and add one more bit to it.
 	 */
-	for (len = 1; ; ++len) {
+	for (; ; ++len) {
 		offs = 2 * offs + tinf_getbits(d, 1);
 
 		assert(len <= 15);
@@ -388,38 +547,203 @@ static int tinf_decode_trees(struct tinf_data *d, struct tinf_tree *lt,
 
 /* -- Block inflate functions -- */
 
-/* Given a stream and two trees, inflate a block of data */
-static int tinf_inflate_block_data(struct tinf_data *d, struct tinf_tree *lt,
-                                   struct tinf_tree *dt)
+/* Extra bits and base tables for length codes */
+static const unsigned char length_bits[30] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+	1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+	4, 4, 4, 4, 5, 5, 5, 5, 0, 127
+};
+
+static const unsigned short length_base[30] = {
+	 3,  4,  5,   6,   7,   8,   9,  10,  11,  13,
+	15, 17, 19,  23,  27,  31,  35,  43,  51,  59,
+	67, 83, 99, 115, 131, 163, 195, 227, 258,   0
+};
+
+/* Extra bits and base tables for distance codes */
+static const unsigned char dist_bits[30] = {
+	0, 0,  0,  0,  1,  1,  2,  2,  3,  3,
+	4, 4,  5,  5,  6,  6,  7,  7,  8,  8,
+	9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static const unsigned short dist_base[30] = {
+	   1,    2,    3,    4,    5,    7,    9,    13,    17,    25,
+	  33,   49,   65,   97,  129,  193,  257,   385,   513,   769,
+	1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+/* Longest match */
+#define TINF_MAX_MATCH 258
+
+/* Returned by tinf_inflate_block_fast when the rest is left to the caller */
+#define TINF_FAST_CONTINUE 1
+
+/*
+ * Copy match, in pieces that don't overlap their source when it is closer
+ * than length. Short ones are left to the byte loop.
+ */
+static unsigned char *tinf_copy_match(unsigned char *dest, int offs, int length)
 {
-	/* Extra bits and base tables for length codes */
-	static const unsigned char length_bits[30] = {
-		0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
-		1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
-		4, 4, 4, 4, 5, 5, 5, 5, 0, 127
-	};
+	const unsigned char *src = dest - offs;
+	int i;
 
-	static const unsigned short length_base[30] = {
-		 3,  4,  5,   6,   7,   8,   9,  10,  11,  13,
-		15, 17, 19,  23,  27,  31,  35,  43,  51,  59,
-		67, 83, 99, 115, 131, 163, 195, 227, 258,   0
-	};
+	if (length < 16) {
+		for (i = 0; i < length; ++i) {
+			dest[i] = src[i];
+		}
+		return dest + length;
+	}
 
-	/* Extra bits and base tables for distance codes */
-	static const unsigned char dist_bits[30] = {
-		0, 0,  0,  0,  1,  1,  2,  2,  3,  3,
-		4, 4,  5,  5,  6,  6,  7,  7,  8,  8,
-		9, 9, 10, 10, 11, 11, 12, 12, 13, 13
-	};
+	if (offs == 1) {
+		memset(dest, *src, length);
+		return dest + length;
+	}
 
-	static const unsigned short dist_base[30] = {
-		   1,    2,    3,    4,    5,    7,    9,    13,    17,    25,
-		  33,   49,   65,   97,  129,  193,  257,   385,   513,   769,
-		1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
-	};
+	while (length) {
+		int block = dest - src;
+
+		if (block > length) {
+			block = length;
+		}
+
+		memcpy(dest, src, block);
+		dest += block;
+		length -= block;
+	}
+
+	return dest;
+}
+
+/* Decode a symbol from a bit buffer holding at least 15 bits */
+static int tinf_decode_symbol_fast(const struct tinf_tree *t,
+                                   unsigned long long *tag, int *bitcount)
+{
+	unsigned int entry = t->fast[*tag & (TINF_FAST_SIZE - 1)];
+	int len = entry & 15;
+	int base, offs;
+
+	if (len) {
+		*tag >>= len;
+		*bitcount -= len;
+		return entry >> 4;
+	}
+
+	/* Long code, continue the walk after its first bits */
+	base = t->fast_base;
+	offs = entry >> 4;
+	*tag >>= TINF_FAST_BITS;
+	*bitcount -= TINF_FAST_BITS;
+
+	for (len = TINF_FAST_BITS + 1; ; ++len) {
+		offs = 2 * offs + (*tag & 1);
+		*tag >>= 1;
+		--*bitcount;
+
+		assert(len <= 15);
+
+		if (offs < t->counts[len]) {
+			break;
+		}
+
+		base += t->counts[len];
+		offs -= t->counts[len];
+	}
+
+	return t->symbols[base + offs];
+}
+
+/*
+ * Inflate with the bit buffer and output pointer kept in locals for as
+ * long as a single refill per symbol cannot run out of input and the
+ * longest match fits in the output. Anything closer to either end is
+ * left to tinf_inflate_block_data.
+ */
+static int tinf_inflate_block_fast(struct tinf_data *d,
+                                   const struct tinf_tree *lt,
+                                   const struct tinf_tree *dt)
+{
+	const unsigned char *source = d->source;
+	unsigned char *dest = d->dest;
+	unsigned long long tag = d->tag;
+	int bitcount = d->bitcount;
+	int res = TINF_FAST_CONTINUE;
+
+	while ((d->source_end ? d->source_end - source >= 8 : !d->fill)
+	    && d->dest_end - dest >= TINF_MAX_MATCH) {
+		int sym, length, dist, offs;
+
+		/*
+		 * Refill to at least 56 bits, a length and distance code with
+		 * their extra bits take up to 48
+		 */
+		tag |= read_le64(source) << bitcount;
+		source += (63 - bitcount) >> 3;
+		bitcount |= 56;
+
+		sym = tinf_decode_symbol_fast(lt, &tag, &bitcount);
+
+		if (sym < 256) {
+			*dest++ = sym;
+			continue;
+		}
 
+		if (sym == 256) {
+			res = TINF_OK;
+			break;
+		}
+
+		if (sym > lt->max_sym || sym - 257 > 28 || dt->max_sym == -1) {
+			res = TINF_DATA_ERROR;
+			break;
+		}
+
+		sym -= 257;
+
+		length = length_base[sym] + (tag & ((1U << length_bits[sym]) - 1));
+		tag >>= length_bits[sym];
+		bitcount -= length_bits[sym];
+
+		dist = tinf_decode_symbol_fast(dt, &tag, &bitcount);
+
+		if (dist > dt->max_sym || dist > 29) {
+			res = TINF_DATA_ERROR;
+			break;
+		}
+
+		offs = dist_base[dist] + (tag & ((1U << dist_bits[dist]) - 1));
+		tag >>= dist_bits[dist];
+		bitcount -= dist_bits[dist];
+
+		if (offs > dest - d->dest_start) {
+			res = TINF_DATA_ERROR;
+			break;
+		}
+
+		dest = tinf_copy_match(dest, offs, length);
+	}
+
+	d->source = source;
+	d->dest = dest;
+	d->tag = tag;
+	d->bitcount = bitcount;
+
+	return res;
+}
+
+/* Given a stream and two trees, inflate a block of data */
+static int tinf_inflate_block_data(struct tinf_data *d, struct tinf_tree *lt,
+                                   struct tinf_tree *dt)
+{
 	for (;;) {
-		int sym = tinf_decode_symbol(d, lt);
+		int res = tinf_inflate_block_fast(d, lt, dt);
+		int sym;
+
+		if (res != TINF_FAST_CONTINUE) {
+			return res;
+		}
+
+		sym = tinf_decode_symbol(d, lt);
 
 		/* Check for overflow in bit reader */
 		if (d->overflow) {
@@ -434,7 +758,6 @@ static int tinf_inflate_block_data(struct tinf_data *d, struct tinf_tree *lt,
 		}
 		else {
 			int length, dist, offs;
-			int i;
 
 			/* Check for end of block */
 			if (sym == 256) {
@@ -471,12 +794,7 @@ static int tinf_inflate_block_data(struct tinf_data *d, struct tinf_tree *lt,
 				return TINF_BUF_ERROR;
 			}
 
-			/* Copy match */
-			for (i = 0; i < length; ++i) {
-				d->dest[i] = d->dest[i - offs];
-			}
-
-			d->dest += length;
+			d->dest = tinf_copy_match(d->dest, offs, length);
 		}
 	}
 }
@@ -486,24 +804,19 @@ static int tinf_inflate_uncompressed_block(struct tinf_data *d)
 {
 	unsigned int length, invlength;
 
-	if (d->source_end && d->source_end - d->source < 4) {
-		return TINF_DATA_ERROR;
-	}
-
-	/* Get length */
-	length = read_le16(d->source);
+	/* Skip the rest of the current byte */
+	tinf_getbits_no_refill(d, d->bitcount & 7);
 
-	/* Get one's complement of length */
-	invlength = read_le16(d->source + 2);
+	/* Get length and its one's complement */
+	length = tinf_getbits(d, 16);
+	invlength = tinf_getbits(d, 16);
 
-	/* Check length */
-	if (length != (~invlength & 0x0000FFFF)) {
+	if (d->overflow) {
 		return TINF_DATA_ERROR;
 	}
 
-	d->source += 4;
-
-	if (d->source_end && d->source_end - d->source < length) {
+	/* Check length */
+	if (length != (~invlength & 0x0000FFFF)) {
 		return TINF_DATA_ERROR;
 	}
 
@@ -511,14 +824,49 @@ static int tinf_inflate_uncompressed_block(struct tinf_data *d)
 		return TINF_BUF_ERROR;
 	}
 
-	/* Copy block */
-	while (length--) {
-		*d->dest++ = *d->source++;
+	/* Bytes that were already read into the bit buffer come first */
+	while (length && d->bitcount >= 8) {
+		*d->dest++ = tinf_getbits_no_refill(d, 8);
+		--length;
+	}
+
+	if (!length) {
+		return TINF_OK;
 	}
 
-	/* Make sure we start next block on a byte boundary */
+	/* The bit buffer is empty, drop the bytes it read ahead */
 	d->tag = 0;
-	d->bitcount = 0;
+
+	if (!d->fill) {
+		if (d->source_end && d->source_end - d->source < length) {
+			return TINF_DATA_ERROR;
+		}
+
+		memcpy(d->dest, d->source, length);
+		d->dest += length;
+		d->source += length;
+
+		return TINF_OK;
+	}
+
+	/* Copy block, possibly spanning several input buffers */
+	while (length) {
+		unsigned int block;
+
+		if (!tinf_source_avail(d)) {
+			return TINF_DATA_ERROR;
+		}
+
+		block = d->source_end - d->source;
+		if (block > length) {
+			block = length;
+		}
+
+		memcpy(d->dest, d->source, block);
+		d->dest += block;
+		d->source += block;
+		length -= block;
+	}
 
 	return TINF_OK;
 }
@@ -555,50 +903,34 @@ void tinf_init(void)
 	return;
 }
 
-/* Inflate stream from source to dest */
-int tinf_uncompress(void *dest, unsigned int *destLen,
-                    const void *source, unsigned int *sourceLen)
+/* Inflate all blocks of a stream */
+static int tinf_inflate(struct tinf_data *d)
 {
-	struct tinf_data d;
 	int bfinal;
 
-	/* Initialise data */
-	d.source = (const unsigned char *) source;
-	if (sourceLen && *sourceLen)
-		d.source_end = d.source + *sourceLen;
-	else
-		d.source_end = 0;
-	d.tag = 0;
-	d.bitcount = 0;
-	d.overflow = 0;
-
-	d.dest = (unsigned char *) dest;
-	d.dest_start = d.dest;
-	d.dest_end = d.dest + *destLen;
-
 	do {
 		unsigned int btype;
 		int res;
 
 		/* Read final block flag */
-		bfinal = tinf_getbits(&d, 1);
+		bfinal = tinf_getbits(d, 1);
 
 		/* Read block type (2 bits) */
-		btype = tinf_getbits(&d, 2);
+		btype = tinf_getbits(d, 2);
 
 		/* Decompress block */
 		switch (btype) {
 		case 0:
 			/* Decompress uncompressed block */
-			res = tinf_inflate_uncompressed_block(&d);
+			res = tinf_inflate_uncompressed_block(d);
 			break;
 		case 1:
 			/* Decompress block with fixed Huffman trees */
-			res = tinf_inflate_fixed_block(&d);
+			res = tinf_inflate_fixed_block(d);
 			break;
 		case 2:
 			/* Decompress block with dynamic Huffman trees */
-			res = tinf_inflate_dynamic_block(&d);
+			res = tinf_inflate_dynamic_block(d);
 			break;
 		default:
 			res = TINF_DATA_ERROR;
@@ -610,11 +942,44 @@ int tinf_uncompress(void *dest, unsigned int *destLen,
 		}
 	} while (!bfinal);
 
+	tinf_unread_bytes(d);
+
 	/* Check for overflow in bit reader */
-	if (d.overflow) {
+	if (d->overflow) {
 		return TINF_DATA_ERROR;
 	}
 
+	return TINF_OK;
+}
+
+/* Inflate stream from source to dest */
+int tinf_uncompress(void *dest, unsigned int *destLen,
+                    const void *source, unsigned int *sourceLen)
+{
+	struct tinf_data d;
+	int res;
+
+	/* Initialise data */
+	d.source = (const unsigned char *) source;
+	if (sourceLen && *sourceLen)
+		d.source_end = d.source + *sourceLen;
+	else
+		d.source_end = 0;
+	d.fill = 0;
+	d.fill_ctx = 0;
+	d.tag = 0;
+	d.bitcount = 0;
+	d.overflow = 0;
+
+	d.dest = (unsigned char *) dest;
+	d.dest_start = d.dest;
+	d.dest_end = d.dest + *destLen;
+
+	res = tinf_inflate(&d);
+	if (res != TINF_OK) {
+		return res;
+	}
+
 	if (sourceLen) {
 		unsigned int slen = d.source - (const unsigned char *)source;
 		if (!*sourceLen)
@@ -627,6 +992,34 @@ int tinf_uncompress(void *dest, unsigned int *destLen,
 	return TINF_OK;
 }
 
+/* Inflate stream fetched through a fill callback to dest */
+int tinf_uncompress_stream(void *dest, unsigned int *destLen,
+                           tinf_fill_fn fill, void *ctx)
+{
+	struct tinf_data d;
+	int res;
+
+	d.source = 0;
+	d.source_end = 0;
+	d.fill = fill;
+	d.fill_ctx = ctx;
+	d.tag = 0;
+	d.bitcount = 0;
+	d.overflow = 0;
+
+	d.dest = (unsigned char *) dest;
+	d.dest_start = d.dest;
+	d.dest_end = d.dest + *destLen;
+
+	res = tinf_inflate(&d);
+	if (res != TINF_OK) {
+		return res;
+	}
+
+	*destLen = d.dest - d.dest_start;
+	return TINF_OK;
+}
+
 /* clang -g -O1 -fsanitize=fuzzer,address -DTINF_FUZZING tinflate.c */
 #if defined(TINF_FUZZING)
 #include <limits.h>
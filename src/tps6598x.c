@@ -5,6 +5,7 @@
 #include "i2c.h"
 #include "iodev.h"
 #include "malloc.h"
+#include "string.h"
 #include "types.h"
 #include "utils.h"
 
@@ -16,6 +17,8 @@
 #define TPS_REG_POWER_STATE 0x20
 #define TPS_CMD_INVALID     0x21434d44 // !CMD
 
+#define TPS_CMD_TIMEOUT_US 1000000
+
 struct tps6598x_dev {
     i2c_dev_t *i2c;
     u8 addr;
@@ -61,14 +64,23 @@ int tps6598x_command(tps6598x_dev_t *dev, const char *cmd, const u8 *data_in, si
     if (i2c_smbus_write(dev->i2c, dev->addr, TPS_REG_CMD1, (const u8 *)cmd, 4) < 0)
         return -1;
 
-    u32 cmd_status;
-    do {
+    // Each status read is a bus transaction of its own, only back off while it is still pending
+    u64 timeout = timeout_calculate(TPS_CMD_TIMEOUT_US);
+    while (true) {
+        u32 cmd_status;
+
         if (i2c_smbus_read32(dev->i2c, dev->addr, TPS_REG_CMD1, &cmd_status))
             return -1;
+        if (cmd_status == 0)
+            break;
         if (cmd_status == TPS_CMD_INVALID)
             return -1;
+        if (timeout_expired(timeout)) {
+            printf("tps6598x: timeout waiting for command %.4s\n", cmd);
+            return -1;
+        }
         udelay(100);
-    } while (cmd_status != 0);
+    }
 
     if (len_out) {
         if (i2c_smbus_read(dev->i2c, dev->addr, TPS_REG_DATA1, data_out, len_out) !=
@@ -102,10 +114,14 @@ int tps6598x_disable_irqs(tps6598x_dev_t *dev, tps6598x_irq_state_t *state)
         printf("tps6598x: writing TPS_REG_INT_CLEAR1 failed, written: %d\n", written);
         return -1;
     }
-    written = i2c_smbus_write(dev->i2c, dev->addr, TPS_REG_INT_MASK1, zeros, sizeof(zeros));
-    if (written != sizeof(ones)) {
-        printf("tps6598x: writing TPS_REG_INT_MASK1 failed, written: %d\n", written);
-        return -1;
+
+    // Skip this if they are already masked, e.g. by an earlier stage that did not restore them
+    if (memcmp(state->int_mask1, zeros, sizeof(zeros))) {
+        written = i2c_smbus_write(dev->i2c, dev->addr, TPS_REG_INT_MASK1, zeros, sizeof(zeros));
+        if (written != sizeof(ones)) {
+            printf("tps6598x: writing TPS_REG_INT_MASK1 failed, written: %d\n", written);
+            return -1;
+        }
     }
 
 #ifdef DEBUG
@@ -1,10 +1,33 @@
 /* SPDX-License-Identifier: MIT */
 
 #include "adt.h"
+#include "assert.h"
+#include "malloc.h"
 #include "tunables.h"
 #include "types.h"
 #include "utils.h"
 
+enum tunable_format {
+    TUNABLE_GLOBAL,
+    TUNABLE_LOCAL,
+    TUNABLE_ATC,
+};
+
+/*
+ * Compiled lists are kept for as long as m1n1 runs, keyed by the ADT property they came from and
+ * the base they were resolved against. The ADT never moves, so they stay valid across proxy
+ * sessions.
+ */
+struct tunable_cache {
+    struct tunable_cache *next;
+    const void *raw;
+    uintptr_t base;
+    enum tunable_format format;
+    struct tunable_set set;
+};
+
+static struct tunable_cache *tunable_cache = NULL;
+
 struct tunable_info {
     int node_offset;
     int node_path[8];
@@ -45,65 +68,180 @@ struct tunable_global {
     u32 value;
 } PACKED;
 
-int tunables_apply_global(const char *path, const char *prop)
+struct tunable_local {
+    u32 offset;
+    u32 size;
+    u64 mask;
+    u64 value;
+} PACKED;
+
+struct tunable_atc {
+    u32 offset : 24;
+    u32 size : 8;
+    u32 mask;
+    u32 value;
+} PACKED;
+static_assert(sizeof(struct tunable_atc) == 12, "Invalid tunable_atc size");
+
+static int tunables_convert(struct tunable_info *info, enum tunable_format format,
+                            uintptr_t base, struct tunable *out)
 {
-    struct tunable_info info;
+    for (u32 i = 0; i < info->tunable_len; ++i) {
+        switch (format) {
+            case TUNABLE_GLOBAL: {
+                const struct tunable_global *tunable =
+                    &((const struct tunable_global *)info->tunable_raw)[i];
+                u64 addr;
 
-    if (tunables_adt_find(path, prop, &info, sizeof(struct tunable_global)) < 0)
-        return -1;
+                if (adt_get_reg(adt, info->node_path, "reg", tunable->reg_idx, &addr, NULL) < 0) {
+                    printf("tunable: Error getting regs with index %d\n", tunable->reg_idx);
+                    return -1;
+                }
 
-    const struct tunable_global *tunables = (const struct tunable_global *)info.tunable_raw;
-    for (u32 i = 0; i < info.tunable_len; ++i) {
-        const struct tunable_global *tunable = &tunables[i];
+                out[i].addr = addr + tunable->offset;
+                out[i].mask = tunable->mask;
+                out[i].value = tunable->value;
+                out[i].width = 4;
+                break;
+            }
+            case TUNABLE_LOCAL: {
+                const struct tunable_local *tunable =
+                    &((const struct tunable_local *)info->tunable_raw)[i];
 
-        u64 addr;
-        if (adt_get_reg(adt, info.node_path, "reg", tunable->reg_idx, &addr, NULL) < 0) {
-            printf("tunable: Error getting regs with index %d\n", tunable->reg_idx);
-            return -1;
-        }
+                if (tunable->size != 1 && tunable->size != 2 && tunable->size != 4 &&
+                    tunable->size != 8) {
+                    printf("tunable: unknown tunable size 0x%08x\n", tunable->size);
+                    return -1;
+                }
+
+                out[i].addr = base + tunable->offset;
+                out[i].mask = tunable->mask;
+                out[i].value = tunable->value;
+                out[i].width = tunable->size;
+                break;
+            }
+            case TUNABLE_ATC: {
+                const struct tunable_atc *tunable =
+                    &((const struct tunable_atc *)info->tunable_raw)[i];
 
-        mask32(addr + tunable->offset, tunable->mask, tunable->value);
+                if (tunable->size % 8 || !tunable->size || tunable->size > 64) {
+                    printf("tunable: unknown tunable size %d\n", tunable->size);
+                    return -1;
+                }
+
+                out[i].addr = base + tunable->offset;
+                out[i].mask = tunable->mask;
+                out[i].value = tunable->value;
+                out[i].width = tunable->size / 8;
+                break;
+            }
+        }
     }
 
     return 0;
 }
 
-struct tunable_local {
-    u32 offset;
-    u32 size;
-    u64 mask;
-    u64 value;
-} PACKED;
-
-int tunables_apply_local_addr(const char *path, const char *prop, uintptr_t base)
+static const struct tunable_set *tunables_compile(const char *path, const char *prop,
+                                                  enum tunable_format format, uintptr_t base)
 {
+    static const u32 item_sizes[] = {
+        [TUNABLE_GLOBAL] = sizeof(struct tunable_global),
+        [TUNABLE_LOCAL] = sizeof(struct tunable_local),
+        [TUNABLE_ATC] = sizeof(struct tunable_atc),
+    };
     struct tunable_info info;
 
-    if (tunables_adt_find(path, prop, &info, sizeof(struct tunable_local)) < 0)
-        return -1;
+    if (tunables_adt_find(path, prop, &info, item_sizes[format]) < 0)
+        return NULL;
 
-    const struct tunable_local *tunables = (const struct tunable_local *)info.tunable_raw;
-    for (u32 i = 0; i < info.tunable_len; ++i) {
-        const struct tunable_local *tunable = &tunables[i];
+    // Global tunables carry their own reg index, so the base does not matter for them
+    if (format == TUNABLE_GLOBAL)
+        base = 0;
 
-        switch (tunable->size) {
+    for (struct tunable_cache *c = tunable_cache; c; c = c->next)
+        if (c->raw == info.tunable_raw && c->base == base && c->format == format)
+            return &c->set;
+
+    struct tunable_cache *c = malloc(sizeof(*c) + info.tunable_len * sizeof(struct tunable));
+    if (!c) {
+        printf("tunable: out of memory compiling %s %s\n", path, prop);
+        return NULL;
+    }
+
+    c->raw = info.tunable_raw;
+    c->base = base;
+    c->format = format;
+    c->set.count = info.tunable_len;
+    c->set.entries = (struct tunable *)(c + 1);
+
+    if (tunables_convert(&info, format, base, c->set.entries) < 0) {
+        free(c);
+        return NULL;
+    }
+
+    c->next = tunable_cache;
+    tunable_cache = c;
+
+    return &c->set;
+}
+
+const struct tunable_set *tunables_compile_global(const char *path, const char *prop)
+{
+    return tunables_compile(path, prop, TUNABLE_GLOBAL, 0);
+}
+
+const struct tunable_set *tunables_compile_local_addr(const char *path, const char *prop,
+                                                      uintptr_t base)
+{
+    return tunables_compile(path, prop, TUNABLE_LOCAL, base);
+}
+
+const struct tunable_set *tunables_compile_atc(const char *path, const char *prop, uintptr_t base)
+{
+    return tunables_compile(path, prop, TUNABLE_ATC, base);
+}
+
+void tunables_apply_set(const struct tunable_set *set)
+{
+    const struct tunable *tunable = set->entries;
+
+    for (u32 i = 0; i < set->count; ++i, ++tunable) {
+        switch (tunable->width) {
             case 1:
-                mask8(base + tunable->offset, tunable->mask, tunable->value);
+                mask8(tunable->addr, tunable->mask, tunable->value);
                 break;
             case 2:
-                mask16(base + tunable->offset, tunable->mask, tunable->value);
+                mask16(tunable->addr, tunable->mask, tunable->value);
                 break;
             case 4:
-                mask32(base + tunable->offset, tunable->mask, tunable->value);
+                mask32(tunable->addr, tunable->mask, tunable->value);
                 break;
             case 8:
-                mask64(base + tunable->offset, tunable->mask, tunable->value);
+                mask64(tunable->addr, tunable->mask, tunable->value);
                 break;
-            default:
-                printf("tunable: unknown tunable size 0x%08x\n", tunable->size);
-                return -1;
         }
     }
+}
+
+int tunables_apply_global(const char *path, const char *prop)
+{
+    const struct tunable_set *set = tunables_compile_global(path, prop);
+
+    if (!set)
+        return -1;
+
+    tunables_apply_set(set);
+    return 0;
+}
+
+int tunables_apply_local_addr(const char *path, const char *prop, uintptr_t base)
+{
+    const struct tunable_set *set = tunables_compile_local_addr(path, prop, base);
+
+    if (!set)
+        return -1;
+
+    tunables_apply_set(set);
     return 0;
 }
 
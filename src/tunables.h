@@ -5,6 +5,19 @@
 
 #include "types.h"
 
+/* A tunable list compiled from the ADT into absolute register writes */
+struct tunable {
+    u64 addr;
+    u64 mask;
+    u64 value;
+    u32 width; // bytes
+};
+
+struct tunable_set {
+    u32 count;
+    struct tunable *entries;
+};
+
 /*
  * This function applies the tunables usually passed in the node "tunable".
  * They usually apply to multiple entries from the "reg" node.
@@ -37,6 +50,19 @@ int tunables_apply_local(const char *path, const char *prop, u32 reg_idx);
  */
 int tunables_apply_local_addr(const char *path, const char *prop, uintptr_t base);
 
+/*
+ * These compile the same properties as the functions above into a tunable_set, or return the one
+ * compiled earlier. The lists are cached for the lifetime of m1n1 and must not be freed.
+ *
+ * tunables_compile_atc() reads the packed 12-byte (offset:24, size:8, mask, value) format used by
+ * the ATC PHY nodes.
+ */
+const struct tunable_set *tunables_compile_global(const char *path, const char *prop);
+const struct tunable_set *tunables_compile_local_addr(const char *path, const char *prop,
+                                                      uintptr_t base);
+const struct tunable_set *tunables_compile_atc(const char *path, const char *prop, uintptr_t base);
+void tunables_apply_set(const struct tunable_set *set);
+
 int tunables_apply_static(void);
 
 #endif
@@ -10,9 +10,10 @@
 #include "utils.h"
 #include "vsprintf.h"
 
-#define UART_CLOCK 24000000
+#define UART_FIFO_DEPTH 16
 
 static u64 uart_base = 0;
+static bool uart_fifo = false;
 
 int uart_init(void)
 {
@@ -29,6 +30,8 @@ int uart_init(void)
         return -1;
     }
 
+    uart_fifo = read32(uart_base + UFCON) & UFCON_FIFO_ENA;
+
     return 0;
 }
 
@@ -75,12 +78,50 @@ void uart_puts(const char *s)
     uart_putchar('\n');
 }
 
+/*
+ * Room left in the TX FIFO and bytes waiting in the RX FIFO, from a single register read. Without
+ * the FIFOs enabled this degrades to the one byte holding registers.
+ */
+static size_t uart_tx_space(void)
+{
+    if (!uart_fifo)
+        return (read32(uart_base + UTRSTAT) & UTRSTAT_TXBE) ? 1 : 0;
+
+    u32 ufstat = read32(uart_base + UFSTAT);
+
+    if (ufstat & UFSTAT_TXFULL)
+        return 0;
+
+    return UART_FIFO_DEPTH - FIELD_GET(UFSTAT_TXCNT, ufstat);
+}
+
+static size_t uart_rx_count(void)
+{
+    if (!uart_fifo)
+        return (read32(uart_base + UTRSTAT) & UTRSTAT_RXD) ? 1 : 0;
+
+    u32 ufstat = read32(uart_base + UFSTAT);
+
+    if (ufstat & UFSTAT_RXFULL)
+        return UART_FIFO_DEPTH;
+
+    return FIELD_GET(UFSTAT_RXCNT, ufstat);
+}
+
 void uart_write(const void *buf, size_t count)
 {
     const u8 *p = buf;
 
-    while (count--)
-        uart_putbyte(*p++);
+    if (!uart_base)
+        return;
+
+    while (count) {
+        size_t burst = min(uart_tx_space(), count);
+
+        count -= burst;
+        while (burst--)
+            write32(uart_base + UTXH, *p++);
+    }
 }
 
 size_t uart_read(void *buf, size_t count)
@@ -88,9 +129,15 @@ size_t uart_read(void *buf, size_t count)
     u8 *p = buf;
     size_t recvd = 0;
 
-    while (count--) {
-        *p++ = uart_getbyte();
-        recvd++;
+    if (!uart_base)
+        return 0;
+
+    while (recvd < count) {
+        size_t burst = min(uart_rx_count(), count - recvd);
+
+        recvd += burst;
+        while (burst--)
+            *p++ = read32(uart_base + URXH);
     }
 
     return recvd;
@@ -105,6 +152,14 @@ void uart_setbaud(int baudrate)
     write32(uart_base + UBRDIV, ((UART_CLOCK / baudrate + 7) / 16) - 1);
 }
 
+int uart_getbaud(void)
+{
+    if (!uart_base)
+        return 0;
+
+    return UART_CLOCK / (16 * (read32(uart_base + UBRDIV) + 1));
+}
+
 void uart_flush(void)
 {
     if (!uart_base)
@@ -150,7 +205,7 @@ static ssize_t uart_iodev_can_read(void *opaque)
     if (!uart_base)
         return 0;
 
-    return (read32(uart_base + UTRSTAT) & UTRSTAT_RXD) ? 1 : 0;
+    return uart_rx_count();
 }
 
 static ssize_t uart_iodev_read(void *opaque, void *buf, size_t len)
@@ -166,15 +221,32 @@ static ssize_t uart_iodev_write(void *opaque, const void *buf, size_t len)
     return len;
 }
 
+static ssize_t uart_iodev_try_write(void *opaque, const void *buf, size_t len)
+{
+    UNUSED(opaque);
+    const u8 *p = buf;
+    size_t wrote;
+
+    if (!uart_base)
+        return len;
+
+    wrote = min(uart_tx_space(), len);
+    for (size_t i = 0; i < wrote; i++)
+        write32(uart_base + UTXH, p[i]);
+
+    return wrote;
+}
+
 static struct iodev_ops iodev_uart_ops = {
     .can_read = uart_iodev_can_read,
     .can_write = uart_iodev_can_write,
     .read = uart_iodev_read,
     .write = uart_iodev_write,
+    .try_write = uart_iodev_try_write,
 };
 
 struct iodev iodev_uart = {
     .ops = &iodev_uart_ops,
     .usage = USAGE_CONSOLE | USAGE_UARTPROXY,
-    .lock = SPINLOCK_INIT,
+    .lock = SPINLOCK_INIT_NAMED("iodev_uart"),
 };
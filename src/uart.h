@@ -5,6 +5,9 @@
 
 #include "types.h"
 
+#define UART_CLOCK    24000000
+#define UART_MAX_BAUD (UART_CLOCK / 16)
+
 int uart_init(void);
 
 void uart_putbyte(u8 c);
@@ -19,6 +22,7 @@ size_t uart_read(void *buf, size_t count);
 void uart_puts(const char *s);
 
 void uart_setbaud(int baudrate);
+int uart_getbaud(void);
 
 void uart_flush(void);
 
@@ -16,6 +16,8 @@
 #define UCON_TXMODE       GENMASK(3, 2)
 #define UCON_RXMODE       GENMASK(1, 0)
 
+#define UFCON_FIFO_ENA BIT(0)
+
 #define UCON_MODE_OFF 0
 #define UCON_MODE_IRQ 1
 
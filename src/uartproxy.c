@@ -2,13 +2,19 @@
 
 #include "uartproxy.h"
 #include "assert.h"
+#include "deflate.h"
 #include "exception.h"
 #include "iodev.h"
 #include "proxy.h"
+#include "smp.h"
 #include "string.h"
 #include "types.h"
+#include "uart.h"
+#include "usb.h"
 #include "utils.h"
 
+#include "tinf/tinf.h"
+
 #define REQ_SIZE 64
 
 typedef struct {
@@ -21,7 +27,19 @@ typedef struct {
             u64 size;
             u32 dchecksum;
         } mrequest;
+        struct {
+            u64 addr;
+            u64 size;
+            u32 chunk_size;
+        } brequest;
+        struct {
+            u64 addr;
+            u64 size;
+            u32 dchecksum;
+            u32 csize;
+        } zrequest;
         u64 features;
+        u32 baudrate;
     };
     u32 checksum;
 } UartRequest;
@@ -36,6 +54,10 @@ typedef struct {
         struct {
             u32 dchecksum;
         } mreply;
+        struct {
+            u32 seq;
+            u32 dchecksum;
+        } breply;
         struct uartproxy_msg_start start;
         u64 features;
     };
@@ -49,14 +71,27 @@ typedef struct {
     u16 event_type;
 } UartEventHdr;
 
+typedef struct {
+    u32 magic;
+    u32 seq;
+    u32 size;
+    u32 dchecksum;
+} UartBulkChunkHdr;
+
 static_assert(sizeof(UartReply) == (REPLY_SIZE + 4), "Invalid UartReply size");
 
-#define REQ_NOP      0x00AA55FF
-#define REQ_PROXY    0x01AA55FF
-#define REQ_MEMREAD  0x02AA55FF
-#define REQ_MEMWRITE 0x03AA55FF
-#define REQ_BOOT     0x04AA55FF
-#define REQ_EVENT    0x05AA55FF
+#define REQ_NOP        0x00AA55FF
+#define REQ_PROXY      0x01AA55FF
+#define REQ_MEMREAD    0x02AA55FF
+#define REQ_MEMWRITE   0x03AA55FF
+#define REQ_BOOT       0x04AA55FF
+#define REQ_EVENT      0x05AA55FF
+#define REQ_BULKWRITE  0x06AA55FF
+#define REQ_BULKACK    0x07AA55FF
+#define REQ_ZWRITE     0x08AA55FF
+#define REQ_ZREAD      0x09AA55FF
+#define REQ_SPARSEREAD 0x0AAA55FF
+#define REQ_SETBAUD    0x0BAA55FF
 
 #define ST_OK      0
 #define ST_BADCMD  -1
@@ -65,21 +100,46 @@ static_assert(sizeof(UartReply) == (REPLY_SIZE + 4), "Invalid UartReply size");
 #define ST_CSUMERR -4
 
 #define PROXY_FEAT_DISABLE_DATA_CSUMS 0x01
-#define PROXY_FEAT_ALL                (PROXY_FEAT_DISABLE_DATA_CSUMS)
+#define PROXY_FEAT_BULK_WRITE         0x02
+#define PROXY_FEAT_CRC32C             0x04
+#define PROXY_FEAT_ZWRITE             0x08
+#define PROXY_FEAT_ZREAD              0x10
+#define PROXY_FEAT_SPARSE_READ        0x20
+#define PROXY_FEAT_SET_BAUD           0x40
+#define PROXY_FEAT_ALL                                                                             \
+    (PROXY_FEAT_DISABLE_DATA_CSUMS | PROXY_FEAT_BULK_WRITE | PROXY_FEAT_CRC32C |                  \
+     PROXY_FEAT_ZWRITE | PROXY_FEAT_ZREAD | PROXY_FEAT_SPARSE_READ | PROXY_FEAT_SET_BAUD)
+
+// How long the host gets to ping us at a new baud rate before we go back to the old one
+#define BAUD_PING_TIMEOUT 500000
 
-static u32 iodev_proxy_buffer[IODEV_MAX];
+/*
+ * Receive state while looking for the start of a request (the FF 55 AA sync and the type byte).
+ * Input is read in bulk and scanned with memchr(), but never more than REQ_SIZE bytes are
+ * buffered: whatever follows the sync is then always part of that same request, never payload
+ * the request handler reads from the iodev itself.
+ */
+struct proxy_rxbuf {
+    u8 buf[REQ_SIZE];
+    u32 len;
+};
+
+static struct proxy_rxbuf iodev_proxy_buffer[IODEV_MAX];
 
 #define CHECKSUM_INIT     0xDEADBEEF
 #define CHECKSUM_FINAL    0xADDEDBAD
 #define CHECKSUM_SENTINEL 0xD0DECADE
 #define DATA_END_SENTINEL 0xB0CACC10
+#define BULK_CHUNK_MAGIC  0xB10CC0DE
 
-static bool disable_data_csums = false;
+// Negotiated per link, secondary proxy servers run their own
+static bool disable_data_csums[IODEV_MAX];
+static bool use_crc32c[IODEV_MAX];
 
 // I just totally pulled this out of my arse
 // Noinline so that this can be bailed out by exc_guard = EXC_RETURN
 // We assume this function does not use the stack
-static u32 __attribute__((noinline)) checksum_block(void *start, u32 length, u32 init)
+u32 __attribute__((noinline)) checksum_block(void *start, u32 length, u32 init)
 {
     u32 sum = init;
     u8 *d = (u8 *)start;
@@ -111,79 +171,671 @@ static inline u32 checksum(void *start, u32 length)
     return checksum_finish(checksum_start(start, length));
 }
 
-static u64 data_checksum(void *start, u32 length)
+#define CRC32C_INIT  0xFFFFFFFF
+#define CRC32C_FINAL 0xFFFFFFFF
+
+// CRC32C (Castagnoli) using the ARMv8 CRC32 instructions, 8 bytes at a time.
+// Same constraints as checksum_block: noinline and no stack usage.
+static u32 __attribute__((noinline)) crc32c_block(void *start, u32 length, u32 crc)
+{
+    u8 *d = (u8 *)start;
+
+    while (length && ((u64)d & 7)) {
+        __asm__("crc32cb %w0, %w0, %w1" : "+r"(crc) : "r"(*d++));
+        length--;
+    }
+
+    u64 *q = (u64 *)d;
+    while (length >= 8) {
+        __asm__("crc32cx %w0, %w0, %x1" : "+r"(crc) : "r"(*q++));
+        length -= 8;
+    }
+
+    d = (u8 *)q;
+    while (length--)
+        __asm__("crc32cb %w0, %w0, %w1" : "+r"(crc) : "r"(*d++));
+
+    return crc;
+}
+
+static inline u32 data_checksum_start(iodev_id_t iodev, void *start, u32 length)
+{
+    if (use_crc32c[iodev])
+        return crc32c_block(start, length, CRC32C_INIT);
+
+    return checksum_start(start, length);
+}
+
+static inline u32 data_checksum_add(iodev_id_t iodev, void *start, u32 length, u32 sum)
+{
+    if (use_crc32c[iodev])
+        return crc32c_block(start, length, sum);
+
+    return checksum_add(start, length, sum);
+}
+
+static inline u32 data_checksum_finish(iodev_id_t iodev, u32 sum)
+{
+    if (use_crc32c[iodev])
+        return sum ^ CRC32C_FINAL;
+
+    return checksum_finish(sum);
+}
+
+static u64 data_checksum(iodev_id_t iodev, void *start, u32 length)
 {
-    if (disable_data_csums) {
+    if (disable_data_csums[iodev]) {
         return CHECKSUM_SENTINEL;
     }
 
-    return checksum(start, length);
+    return data_checksum_finish(iodev, data_checksum_start(iodev, start, length));
 }
 
 iodev_id_t uartproxy_iodev;
 
-int uartproxy_run(struct uartproxy_msg_start *start)
+static void uartproxy_reply(iodev_id_t iodev, UartReply *reply)
+{
+    reply->checksum = checksum(reply, REPLY_SIZE - 4);
+    iodev_write(iodev, reply, REPLY_SIZE);
+}
+
+/*
+ * Bulk writes: after accepting the request, the host streams the buffer as a sequence of
+ * chunks, each with its own header and checksum, keeping several of them in flight. Every chunk
+ * is acknowledged with a REQ_BULKACK reply carrying its sequence number. Chunks that fail
+ * their checksum are NAKed and may be retransmitted; the transfer completes once every chunk
+ * has been received correctly. A chunk header with an out-of-range sequence number aborts it.
+ */
+static int uartproxy_bulkwrite(iodev_id_t iodev, u64 addr, u64 size, u32 chunk_size)
+{
+    u64 chunks = (size + chunk_size - 1) / chunk_size;
+    u64 remaining = chunks;
+
+    while (remaining) {
+        UartBulkChunkHdr hdr;
+        UartReply ack;
+
+        if (iodev_read(iodev, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != BULK_CHUNK_MAGIC)
+            return ST_XFRERR;
+        if (hdr.seq >= chunks)
+            return ST_INVAL;
+
+        u64 offset = (u64)hdr.seq * chunk_size;
+        if (hdr.size != min(chunk_size, size - offset))
+            return ST_INVAL;
+
+        void *p = (void *)(addr + offset);
+        if (iodev_read(iodev, p, hdr.size) != hdr.size)
+            return ST_XFRERR;
+
+        memset(&ack, 0, sizeof(ack));
+        ack.type = REQ_BULKACK;
+        ack.status = ST_OK;
+        ack.breply.seq = hdr.seq;
+
+        if (disable_data_csums[iodev]) {
+            u32 sentinel = 0;
+            if (iodev_read(iodev, &sentinel, sizeof(sentinel)) != sizeof(sentinel) ||
+                sentinel != DATA_END_SENTINEL)
+                return ST_XFRERR;
+            ack.breply.dchecksum = CHECKSUM_SENTINEL;
+        } else {
+            // The checksum covers the sequence number and size too
+            u32 sum = data_checksum_start(iodev, &hdr.seq, 2 * sizeof(u32));
+            sum = data_checksum_add(iodev, p, hdr.size, sum);
+            ack.breply.dchecksum = data_checksum_finish(iodev, sum);
+            if (ack.breply.dchecksum != hdr.dchecksum)
+                ack.status = ST_CSUMERR;
+        }
+
+        if (ack.status == ST_OK)
+            remaining--;
+
+        uartproxy_reply(iodev, &ack);
+    }
+
+    return ST_OK;
+}
+
+/*
+ * Compressed writes: the host sends a raw deflate stream of csize bytes, which is inflated
+ * straight into the target buffer as it arrives. The data checksum covers the uncompressed data.
+ */
+#define ZWRITE_BUF_SIZE 16384
+
+struct zwrite_stream {
+    iodev_id_t iodev;
+    u32 remaining;
+    bool error;
+};
+
+static u8 zwrite_buf[ZWRITE_BUF_SIZE];
+
+static unsigned int uartproxy_zwrite_fill(void *ctx, const unsigned char **buf)
+{
+    struct zwrite_stream *s = ctx;
+    u32 len = min(s->remaining, sizeof(zwrite_buf));
+
+    if (!len)
+        return 0;
+
+    if (iodev_read(s->iodev, zwrite_buf, len) != len) {
+        s->error = true;
+        s->remaining = 0;
+        return 0;
+    }
+
+    s->remaining -= len;
+    *buf = zwrite_buf;
+    return len;
+}
+
+static int uartproxy_zwrite(iodev_id_t iodev, u64 addr, u64 size, u32 csize, u32 dchecksum,
+                            u32 *checksum_val)
+{
+    struct zwrite_stream s = {iodev, csize, false};
+    unsigned int dest_len = size;
+    const unsigned char *p;
+
+    int ret = tinf_uncompress_stream((void *)addr, &dest_len, uartproxy_zwrite_fill, &s);
+
+    // Consume any trailing data so we stay in sync with the host
+    while (s.remaining)
+        uartproxy_zwrite_fill(&s, &p);
+
+    if (s.error)
+        return ST_XFRERR;
+
+    if (disable_data_csums[iodev]) {
+        u32 sentinel = 0;
+        if (iodev_read(iodev, &sentinel, sizeof(sentinel)) != sizeof(sentinel) ||
+            sentinel != DATA_END_SENTINEL)
+            return ST_XFRERR;
+    }
+
+    if (ret != TINF_OK || dest_len != size)
+        return ST_XFRERR;
+
+    *checksum_val = data_checksum(iodev, (void *)addr, size);
+    if (*checksum_val != dchecksum)
+        return ST_XFRERR;
+
+    return ST_OK;
+}
+
+/*
+ * Compressed reads: after the reply, the region follows as one raw deflate stream cut into
+ * frames, each a u32 length and that many bytes, ending with a zero length frame. As for
+ * REQ_MEMREAD, the reply's data checksum covers the uncompressed data.
+ */
+#define ZREAD_CHUNK_SIZE 16384
+
+static struct deflate_stream zread_stream;
+static u8 zread_buf[DEFLATE_BOUND(ZREAD_CHUNK_SIZE)];
+
+static void uartproxy_zread(iodev_id_t iodev, u64 addr, u64 size)
 {
-    int ret;
+    u32 clen;
+
+    deflate_init(&zread_stream);
+
+    for (u64 pos = 0; pos < size; pos += ZREAD_CHUNK_SIZE) {
+        u32 len = min(size - pos, ZREAD_CHUNK_SIZE);
+
+        clen = deflate_block(&zread_stream, (void *)addr, pos, len, pos + len == size, zread_buf);
+        iodev_queue(iodev, &clen, sizeof(clen));
+        iodev_queue(iodev, zread_buf, clen);
+    }
+
+    clen = 0;
+    iodev_queue(iodev, &clen, sizeof(clen));
+}
+
+/*
+ * Sparse reads: after the reply, the device sends a bitmap with one bit per 16K page of the range
+ * (padded to a multiple of 32 bits) marking the pages that are not all zeros, followed by just
+ * those pages. The data checksum covers the bitmap and the pages that were sent.
+ */
+#define SPARSE_PAGE_SIZE SZ_16K
+#define SPARSE_MAX_PAGES 65536
+
+static u32 sparse_bitmap[SPARSE_MAX_PAGES / 32];
+
+// Returns zero if all words are zero. Same constraints as checksum_block: noinline and no stack
+// usage, so that exc_guard = GUARD_RETURN can bail out of it.
+static u64 __attribute__((noinline)) sparse_scan_block(const u64 *p, u32 words)
+{
+    u64 acc = 0;
+
+    while (words >= 8) {
+        acc = p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7];
+        if (acc)
+            return acc;
+        p += 8;
+        words -= 8;
+    }
+
+    while (words--)
+        acc |= *p++;
+
+    return acc;
+}
+
+static inline u32 sparse_page_size(u64 size, u32 page)
+{
+    return min(size - (u64)page * SPARSE_PAGE_SIZE, SPARSE_PAGE_SIZE);
+}
+
+static inline u32 sparse_bitmap_size(u64 size)
+{
+    return ALIGN_UP(size, SPARSE_PAGE_SIZE * 32) / SPARSE_PAGE_SIZE / 8;
+}
+
+static int uartproxy_sparse_scan(iodev_id_t iodev, u64 addr, u64 size, u32 *checksum_val)
+{
+    u32 pages = ALIGN_UP(size, SPARSE_PAGE_SIZE) / SPARSE_PAGE_SIZE;
+
+    if (!size || (addr | size) & 7 || pages > SPARSE_MAX_PAGES)
+        return ST_INVAL;
+
+    memset(sparse_bitmap, 0, sparse_bitmap_size(size));
+
+    exc_count = 0;
+    exc_guard = GUARD_RETURN;
+    for (u32 i = 0; i < pages && !exc_count; i++) {
+        void *p = (void *)(addr + (u64)i * SPARSE_PAGE_SIZE);
+        if (sparse_scan_block(p, sparse_page_size(size, i) / 8))
+            sparse_bitmap[i / 32] |= BIT(i % 32);
+    }
+    exc_guard = GUARD_OFF;
+    if (exc_count)
+        return ST_XFRERR;
+
+    if (disable_data_csums[iodev]) {
+        *checksum_val = CHECKSUM_SENTINEL;
+        return ST_OK;
+    }
+
+    u32 sum = data_checksum_start(iodev, sparse_bitmap, sparse_bitmap_size(size));
+    for (u32 i = 0; i < pages; i++) {
+        if (sparse_bitmap[i / 32] & BIT(i % 32))
+            sum = data_checksum_add(iodev, (void *)(addr + (u64)i * SPARSE_PAGE_SIZE),
+                                    sparse_page_size(size, i), sum);
+    }
+    *checksum_val = data_checksum_finish(iodev, sum);
+
+    return ST_OK;
+}
+
+static void uartproxy_sparse_send(iodev_id_t iodev, u64 addr, u64 size)
+{
+    u32 pages = ALIGN_UP(size, SPARSE_PAGE_SIZE) / SPARSE_PAGE_SIZE;
+
+    iodev_queue(iodev, sparse_bitmap, sparse_bitmap_size(size));
+
+    for (u32 i = 0; i < pages; i++) {
+        if (sparse_bitmap[i / 32] & BIT(i % 32))
+            iodev_queue(iodev, (void *)(addr + (u64)i * SPARSE_PAGE_SIZE),
+                        sparse_page_size(size, i));
+    }
+}
+
+/*
+ * REQ_SETBAUD has been acknowledged at the old rate: switch over and wait for the host to show the
+ * new rate works by sending a REQ_NOP that checks out. Garbage, or nothing at all, puts the old
+ * rate back so the host can try something slower.
+ */
+static void uartproxy_switch_baud(int baudrate, u64 features)
+{
+    int old = uart_getbaud();
+    u32 window = 0;
+
+    uart_setbaud(baudrate);
+
+    u64 timeout = timeout_calculate(BAUD_PING_TIMEOUT);
+    while (!timeout_expired(timeout)) {
+        UartRequest request;
+        u8 b;
+
+        if (!iodev_can_read(IODEV_UART) || iodev_read(IODEV_UART, &b, 1) != 1)
+            continue;
+
+        window = (window >> 8) | (b << 24);
+        if (window != REQ_NOP)
+            continue;
+
+        memset(&request, 0, sizeof(request));
+        request.type = window;
+        if (iodev_read(IODEV_UART, (&request.type) + 1, REQ_SIZE - 4) != REQ_SIZE - 4 ||
+            checksum(&(request.type), REQ_SIZE - 4) != request.checksum)
+            break;
+
+        UartReply reply = {.type = REQ_NOP, .status = ST_OK, .features = features};
+        uartproxy_reply(IODEV_UART, &reply);
+        return;
+    }
+
+    uart_setbaud(old);
+}
+
+/*
+ * Links served by a proxy loop on a secondary CPU. The boot CPU's loop leaves them alone, and
+ * they don't take over uartproxy_iodev, so events keep going to the main link.
+ */
+static volatile u32 secondary_iodevs;
+
+#define SECONDARY_FEAT_MASK                                                                        \
+    (PROXY_FEAT_ZWRITE | PROXY_FEAT_ZREAD | PROXY_FEAT_SPARSE_READ | PROXY_FEAT_SET_BAUD)
+
+/* Drops everything before the first (possibly partial) sync; true if a whole one is buffered */
+static bool uartproxy_find_sync(struct proxy_rxbuf *rx)
+{
+    u8 *p = rx->buf, *end = rx->buf + rx->len;
+
+    while ((p = memchr(p, 0xff, end - p))) {
+        size_t left = end - p;
+
+        if ((left < 2 || p[1] == 0x55) && (left < 3 || p[2] == 0xaa))
+            break;
+        p++;
+    }
+
+    if (!p) {
+        rx->len = 0;
+        return false;
+    }
+
+    rx->len = end - p;
+    memmove(rx->buf, p, rx->len);
+    return rx->len >= 4;
+}
+
+/* Returns 1 once a request start is buffered, 0 if not yet and -1 if a blocking read failed */
+static int uartproxy_rx_poll(iodev_id_t iodev, bool block)
+{
+    struct proxy_rxbuf *rx = &iodev_proxy_buffer[iodev];
+    ssize_t avail = iodev_can_read(iodev);
+
+    if (avail <= 0) {
+        if (!block)
+            return 0;
+        avail = 1;
+    }
+
+    ssize_t got = iodev_read(iodev, rx->buf + rx->len, min((size_t)avail, REQ_SIZE - rx->len));
+    if (got <= 0)
+        return block ? -1 : 0;
+
+    rx->len += got;
+    return uartproxy_find_sync(rx);
+}
+
+/*
+ * Events posted from contexts that must not block on the link (HV hooks, trace batches) go
+ * through a byte ring of complete, checksummed messages. It is drained by uartproxy_flush_events(),
+ * from the HV tick without blocking and from the proxy loop before anything else is written
+ * to the link, so messages never interleave. When the ring is full the policy decides whether
+ * the new event or the oldest queued ones are dropped.
+ */
+#define EVENT_QUEUE_SIZE 0x40000
+#define EVENT_MSG_MAX    (sizeof(UartEventHdr) + 0xffff + sizeof(u32))
+
+static u8 event_queue[EVENT_QUEUE_SIZE] ALIGNED(8);
+static u64 evq_head, evq_tail; // free-running byte positions
+static u32 evq_policy = EVENT_QUEUE_DROP_NEW;
+static u64 evq_posted, evq_dropped;
+static DECLARE_SPINLOCK(evq_lock);
+
+static u8 evq_inflight[EVENT_MSG_MAX + 8] ALIGNED(8);
+static size_t evq_inflight_len, evq_inflight_off;
+static DECLARE_SPINLOCK(evq_drain_lock);
+
+static void evq_copy_in(u64 pos, const void *src, size_t len)
+{
+    size_t off = pos % EVENT_QUEUE_SIZE;
+    size_t first = min(len, EVENT_QUEUE_SIZE - off);
+
+    memcpy(event_queue + off, src, first);
+    memcpy(event_queue, (const u8 *)src + first, len - first);
+}
+
+static void evq_copy_out(u64 pos, void *dst, size_t len)
+{
+    size_t off = pos % EVENT_QUEUE_SIZE;
+    size_t first = min(len, EVENT_QUEUE_SIZE - off);
+
+    memcpy(dst, event_queue + off, first);
+    memcpy((u8 *)dst + first, event_queue, len - first);
+}
+
+// Each record is a u64 message length followed by the message, padded to 8 bytes
+static u64 evq_record_size(u64 pos)
+{
+    u64 len;
+
+    evq_copy_out(pos, &len, sizeof(len));
+    return sizeof(len) + ALIGN_UP(len, 8);
+}
+
+u32 uartproxy_set_event_policy(u32 policy)
+{
+    if (policy > EVENT_QUEUE_DROP_OLDEST)
+        return evq_policy;
+
+    // Going synchronous must not leave queued events behind the next direct send
+    if (policy == EVENT_QUEUE_SYNC)
+        uartproxy_flush_events(true);
+
+    u32 old = evq_policy;
+    evq_policy = policy;
+    return old;
+}
+
+u64 uartproxy_event_stats(u64 *posted, bool reset)
+{
+    spin_lock(&evq_lock);
+    u64 dropped = evq_dropped;
+    if (posted)
+        *posted = evq_posted;
+    if (reset)
+        evq_posted = evq_dropped = 0;
+    spin_unlock(&evq_lock);
+
+    return dropped;
+}
+
+void uartproxy_post_event(u16 event_type, void *data, u16 length)
+{
+    if (evq_policy == EVENT_QUEUE_SYNC) {
+        uartproxy_send_event(event_type, data, length);
+        return;
+    }
+
+    iodev_id_t iodev = uartproxy_iodev;
+    UartEventHdr hdr = {
+        .type = REQ_EVENT,
+        .len = length,
+        .event_type = event_type,
+    };
+    u32 csum;
+
+    if (disable_data_csums[iodev]) {
+        csum = CHECKSUM_SENTINEL;
+    } else {
+        csum = data_checksum_start(iodev, &hdr, sizeof(UartEventHdr));
+        csum = data_checksum_finish(iodev, data_checksum_add(iodev, data, length, csum));
+    }
+
+    u64 msg_len = sizeof(hdr) + length + sizeof(csum);
+    u64 rec = sizeof(msg_len) + ALIGN_UP(msg_len, 8);
+
+    spin_lock(&evq_lock);
+    evq_posted++;
+
+    while (EVENT_QUEUE_SIZE - (evq_tail - evq_head) < rec) {
+        if (evq_policy != EVENT_QUEUE_DROP_OLDEST || evq_tail == evq_head) {
+            evq_dropped++;
+            spin_unlock(&evq_lock);
+            return;
+        }
+        evq_head += evq_record_size(evq_head);
+        evq_dropped++;
+    }
+
+    u64 pos = evq_tail;
+    evq_copy_in(pos, &msg_len, sizeof(msg_len));
+    pos += sizeof(msg_len);
+    evq_copy_in(pos, &hdr, sizeof(hdr));
+    pos += sizeof(hdr);
+    evq_copy_in(pos, data, length);
+    pos += length;
+    evq_copy_in(pos, &csum, sizeof(csum));
+    evq_tail += rec;
+
+    spin_unlock(&evq_lock);
+}
+
+/*
+ * Send queued events. Without block, stops as soon as the link can't take more and returns false
+ * if anything is left; a partly sent message is finished on the next call. With block, everything
+ * is written out, which is what the proxy loop does before it writes to the link itself.
+ */
+bool uartproxy_flush_events(bool block)
+{
+    iodev_id_t iodev = uartproxy_iodev;
+    bool empty = false;
+
+    if (evq_tail == evq_head && !evq_inflight_len)
+        return true;
+
+    if (block)
+        spin_lock(&evq_drain_lock);
+    else if (!spin_trylock(&evq_drain_lock))
+        return false;
+
+    while (true) {
+        if (evq_inflight_off < evq_inflight_len) {
+            const u8 *p = evq_inflight + evq_inflight_off;
+            size_t left = evq_inflight_len - evq_inflight_off;
+            ssize_t ret = block ? iodev_write(iodev, p, left) : iodev_try_write(iodev, p, left);
+
+            if (ret <= 0 && !block)
+                break;
+            // A failed blocking write means the link is gone, drop the message
+            evq_inflight_off = ret <= 0 ? evq_inflight_len : evq_inflight_off + ret;
+            continue;
+        }
+
+        spin_lock(&evq_lock);
+        if (evq_tail == evq_head) {
+            evq_inflight_len = evq_inflight_off = 0;
+            spin_unlock(&evq_lock);
+            empty = true;
+            break;
+        }
+        u64 msg_len;
+        evq_copy_out(evq_head, &msg_len, sizeof(msg_len));
+        evq_copy_out(evq_head + sizeof(msg_len), evq_inflight, msg_len);
+        evq_head += sizeof(msg_len) + ALIGN_UP(msg_len, 8);
+        spin_unlock(&evq_lock);
+
+        evq_inflight_len = msg_len;
+        evq_inflight_off = 0;
+    }
+
+    spin_unlock(&evq_drain_lock);
+    return empty;
+}
+
+static int uartproxy_serve(struct uartproxy_msg_start *start, iodev_id_t secondary_iodev)
+{
+    bool secondary = secondary_iodev != IODEV_MAX;
+    int ret = 0;
     int running = 1;
     size_t bytes;
     u64 checksum_val;
     u64 enabled_features = 0;
+    int new_baudrate = 0;
+    u64 t_idle = get_ticks(), t_rx = 0, t_hdr = 0, t_work = 0;
 
     iodev_id_t iodev = IODEV_MAX;
 
     UartRequest request;
     UartReply reply = {REQ_BOOT};
-    if (!start) {
+    if (secondary) {
+        // Nobody may be listening yet, the host starts with a NOP
+        iodev = secondary_iodev;
+    } else if (!start) {
         // Startup notification only goes out via UART
         reply.checksum = checksum(&reply, REPLY_SIZE - 4);
         iodev_write(IODEV_UART, &reply, REPLY_SIZE);
     } else {
-        // Exceptions / hooks keep the current iodev
+        // Exceptions / hooks keep the current iodev, and report after what they queued
         iodev = uartproxy_iodev;
+        uartproxy_flush_events(true);
         reply.start = *start;
         reply.checksum = checksum(&reply, REPLY_SIZE - 4);
         iodev_write(iodev, &reply, REPLY_SIZE);
     }
 
     while (running) {
-        if (!start) {
+        // Queued events go out before this loop writes anything to the link
+        if (!secondary)
+            uartproxy_flush_events(true);
+
+        if (!start && !secondary) {
             // Look for commands from any iodev on startup
             for (iodev = 0; iodev < IODEV_MAX;) {
-                u8 b;
-                if ((iodev_get_usage(iodev) & USAGE_UARTPROXY)) {
+                uartproxy_flush_events(false);
+                if (secondary_iodevs & BIT(iodev)) {
+                    // Served from another CPU
+                } else if ((iodev_get_usage(iodev) & USAGE_UARTPROXY)) {
+                    iodev_handle_events(iodev);
+                    if (uartproxy_rx_poll(iodev, false) > 0)
+                        break;
+                } else if (iodev_get_usage(iodev) & USAGE_CONSOLE) {
+                    // Idle: let consoles catch up on deferred output
                     iodev_handle_events(iodev);
-                    if (iodev_can_read(iodev) && iodev_read(iodev, &b, 1) == 1) {
-                        iodev_proxy_buffer[iodev] >>= 8;
-                        iodev_proxy_buffer[iodev] |= b << 24;
-                        if ((iodev_proxy_buffer[iodev] & 0xffffff) == 0xAA55FF)
-                            break;
-                    }
                 }
                 iodev++;
                 if (iodev == IODEV_MAX)
                     iodev = 0;
             }
         } else {
-            // Stick to the current iodev for exceptions
+            // Stick to the current iodev for exceptions and secondary servers
+            int found;
             do {
-                u8 b;
                 iodev_handle_events(iodev);
-                if (iodev_read(iodev, &b, 1) != 1) {
+                // The host may not have opened a secondary link yet
+                while (secondary && iodev_can_read(iodev) <= 0)
+                    iodev_handle_events(iodev);
+                found = uartproxy_rx_poll(iodev, true);
+                if (found < 0) {
                     printf("Proxy: iodev read failed, exiting.\n");
                     return -1;
                 }
-                iodev_proxy_buffer[iodev] >>= 8;
-                iodev_proxy_buffer[iodev] |= b << 24;
-            } while ((iodev_proxy_buffer[iodev] & 0xffffff) != 0xAA55FF);
+            } while (!found);
         }
 
+        if (proxy_stats_enabled)
+            t_rx = get_ticks();
+
+        // The request starts with what was buffered while looking for the sync
+        struct proxy_rxbuf *rx = &iodev_proxy_buffer[iodev];
+        size_t have = rx->len;
+
         memset(&request, 0, sizeof(request));
-        request.type = iodev_proxy_buffer[iodev];
-        bytes = iodev_read(iodev, (&request.type) + 1, REQ_SIZE - 4);
-        if (bytes != REQ_SIZE - 4)
+        memcpy(&request, rx->buf, have);
+        rx->len = 0;
+        bytes = have;
+        if (have < REQ_SIZE)
+            bytes += iodev_read(iodev, (u8 *)&request + have, REQ_SIZE - have);
+        if (bytes != REQ_SIZE)
             continue;
 
+        if (proxy_stats_enabled)
+            t_hdr = get_ticks();
+
         if (checksum(&(request.type), REQ_SIZE - 4) != request.checksum) {
             memset(&reply, 0, sizeof(reply));
             reply.type = request.type;
@@ -197,7 +849,8 @@ int uartproxy_run(struct uartproxy_msg_start *start)
         reply.type = request.type;
         reply.status = ST_OK;
 
-        uartproxy_iodev = iodev;
+        if (!secondary)
+            uartproxy_iodev = iodev;
 
         switch (request.type) {
             case REQ_NOP:
@@ -205,9 +858,16 @@ int uartproxy_run(struct uartproxy_msg_start *start)
                 if (iodev == IODEV_UART) {
                     // Don't allow disabling checksums on UART
                     enabled_features &= ~PROXY_FEAT_DISABLE_DATA_CSUMS;
+                } else {
+                    // Only the UART has a baud rate to negotiate
+                    enabled_features &= ~PROXY_FEAT_SET_BAUD;
                 }
+                // Compressed and sparse transfers use static buffers owned by the main loop
+                if (secondary)
+                    enabled_features &= ~SECONDARY_FEAT_MASK;
 
-                disable_data_csums = enabled_features & PROXY_FEAT_DISABLE_DATA_CSUMS;
+                disable_data_csums[iodev] = enabled_features & PROXY_FEAT_DISABLE_DATA_CSUMS;
+                use_crc32c[iodev] = enabled_features & PROXY_FEAT_CRC32C;
                 reply.features = enabled_features;
                 break;
             case REQ_PROXY:
@@ -222,12 +882,40 @@ int uartproxy_run(struct uartproxy_msg_start *start)
                     break;
                 exc_count = 0;
                 exc_guard = GUARD_RETURN;
-                checksum_val = data_checksum((void *)request.mrequest.addr, request.mrequest.size);
+                checksum_val =
+                    data_checksum(iodev, (void *)request.mrequest.addr, request.mrequest.size);
                 exc_guard = GUARD_OFF;
                 if (exc_count)
                     reply.status = ST_XFRERR;
                 reply.mreply.dchecksum = checksum_val;
                 break;
+            case REQ_ZREAD:
+                if (secondary) {
+                    reply.status = ST_BADCMD;
+                    break;
+                }
+                if (request.mrequest.size == 0 || request.mrequest.size >= UINT32_MAX) {
+                    reply.status = ST_INVAL;
+                    break;
+                }
+                exc_count = 0;
+                exc_guard = GUARD_RETURN;
+                checksum_val =
+                    data_checksum(iodev, (void *)request.mrequest.addr, request.mrequest.size);
+                exc_guard = GUARD_OFF;
+                if (exc_count)
+                    reply.status = ST_XFRERR;
+                reply.mreply.dchecksum = checksum_val;
+                break;
+            case REQ_SPARSEREAD:
+                if (secondary) {
+                    reply.status = ST_BADCMD;
+                    break;
+                }
+                reply.status =
+                    uartproxy_sparse_scan(iodev, request.mrequest.addr, request.mrequest.size,
+                                          &reply.mreply.dchecksum);
+                break;
             case REQ_MEMWRITE:
                 exc_count = 0;
                 exc_guard = GUARD_SKIP;
@@ -247,13 +935,14 @@ int uartproxy_run(struct uartproxy_msg_start *start)
                     reply.status = ST_XFRERR;
                     break;
                 }
-                checksum_val = data_checksum((void *)request.mrequest.addr, request.mrequest.size);
+                checksum_val =
+                    data_checksum(iodev, (void *)request.mrequest.addr, request.mrequest.size);
                 reply.mreply.dchecksum = checksum_val;
                 if (reply.mreply.dchecksum != request.mrequest.dchecksum) {
                     reply.status = ST_XFRERR;
                     break;
                 }
-                if (disable_data_csums) {
+                if (disable_data_csums[iodev]) {
                     // Check the sentinel that should be present after the data
                     u32 sentinel = 0;
                     bytes = iodev_read(iodev, &sentinel, sizeof(sentinel));
@@ -263,55 +952,200 @@ int uartproxy_run(struct uartproxy_msg_start *start)
                     }
                 }
                 break;
+            case REQ_BULKWRITE:
+                if (request.brequest.size == 0 || request.brequest.chunk_size == 0 ||
+                    request.brequest.size / request.brequest.chunk_size >= UINT32_MAX) {
+                    reply.status = ST_INVAL;
+                    break;
+                }
+                exc_count = 0;
+                exc_guard = GUARD_SKIP;
+                write8(request.brequest.addr, 0);
+                write8(request.brequest.addr + request.brequest.size - 1, 0);
+                exc_guard = GUARD_OFF;
+                if (exc_count) {
+                    reply.status = ST_XFRERR;
+                    break;
+                }
+                // Tell the host to start streaming, the final reply follows the last chunk
+                uartproxy_reply(iodev, &reply);
+                reply.status = uartproxy_bulkwrite(iodev, request.brequest.addr,
+                                                   request.brequest.size,
+                                                   request.brequest.chunk_size);
+                break;
+            case REQ_ZWRITE:
+                if (secondary) {
+                    reply.status = ST_BADCMD;
+                    break;
+                }
+                if (request.zrequest.size == 0 || request.zrequest.size > UINT32_MAX) {
+                    reply.status = ST_INVAL;
+                    break;
+                }
+                exc_count = 0;
+                exc_guard = GUARD_SKIP;
+                write8(request.zrequest.addr, 0);
+                write8(request.zrequest.addr + request.zrequest.size - 1, 0);
+                exc_guard = GUARD_OFF;
+                if (exc_count) {
+                    reply.status = ST_XFRERR;
+                    break;
+                }
+                reply.status = uartproxy_zwrite(iodev, request.zrequest.addr, request.zrequest.size,
+                                                request.zrequest.csize, request.zrequest.dchecksum,
+                                                &reply.mreply.dchecksum);
+                break;
+            case REQ_SETBAUD:
+                if (secondary || iodev != IODEV_UART || !request.baudrate ||
+                    request.baudrate > UART_MAX_BAUD) {
+                    reply.status = ST_INVAL;
+                    break;
+                }
+                new_baudrate = request.baudrate;
+                break;
             default:
                 reply.status = ST_BADCMD;
                 break;
         }
         sysop("dsb sy");
         sysop("isb");
+        if (proxy_stats_enabled)
+            t_work = get_ticks();
         reply.checksum = checksum(&reply, REPLY_SIZE - 4);
-        iodev_lock(uartproxy_iodev);
-        iodev_queue(iodev, &reply, REPLY_SIZE);
 
-        if ((request.type == REQ_MEMREAD) && (reply.status == ST_OK)) {
-            iodev_queue(iodev, (void *)request.mrequest.addr, request.mrequest.size);
+        bool read_data = (request.type == REQ_MEMREAD || request.type == REQ_ZREAD ||
+                          request.type == REQ_SPARSEREAD) &&
+                         reply.status == ST_OK;
+        // Since there is no checksum, put a sentinel after the data so the receiver can check
+        // that no packets were lost.
+        u32 sentinel = DATA_END_SENTINEL;
 
-            if (disable_data_csums) {
-                // Since there is no checksum, put a sentinel after the data so the receiver
-                // can check that no packets were lost.
-                u32 sentinel = DATA_END_SENTINEL;
+        if (!read_data || request.type == REQ_MEMREAD) {
+            // The whole reply as one message
+            struct iodev_iov iov[3] = {{&reply, REPLY_SIZE}};
+            int niov = 1;
 
-                iodev_queue(iodev, &sentinel, sizeof(sentinel));
+            if (read_data) {
+                iov[niov++] = (struct iodev_iov){(void *)request.mrequest.addr,
+                                                 request.mrequest.size};
+                if (disable_data_csums[iodev])
+                    iov[niov++] = (struct iodev_iov){&sentinel, sizeof(sentinel)};
             }
-        }
 
-        iodev_unlock(uartproxy_iodev);
-        // Flush all queued data
-        iodev_write(iodev, NULL, 0);
+            iodev_writev(iodev, iov, niov);
+        } else {
+            // Compressed and sparse reads produce their payload piece by piece
+            iodev_lock(iodev);
+            iodev_queue(iodev, &reply, REPLY_SIZE);
+
+            if (request.type == REQ_ZREAD)
+                uartproxy_zread(iodev, request.mrequest.addr, request.mrequest.size);
+            else
+                uartproxy_sparse_send(iodev, request.mrequest.addr, request.mrequest.size);
+
+            if (disable_data_csums[iodev])
+                iodev_queue(iodev, &sentinel, sizeof(sentinel));
+
+            iodev_unlock(iodev);
+            // Flush all queued data
+            iodev_write(iodev, NULL, 0);
+        }
         iodev_flush(iodev);
+
+        if (proxy_stats_enabled && !secondary && t_rx && t_hdr && t_work) {
+            u64 now = get_ticks();
+            // Memory writes are bound by the link, other requests in between are device work
+            bool write = request.type == REQ_MEMWRITE || request.type == REQ_BULKWRITE ||
+                         request.type == REQ_ZWRITE;
+
+            proxy_stats_link(t_rx - t_idle, (write ? t_work : t_hdr) - t_rx, now - t_work);
+            t_idle = now;
+        } else {
+            t_idle = get_ticks();
+        }
+        t_rx = t_hdr = t_work = 0;
+
+        if (new_baudrate) {
+            uartproxy_switch_baud(new_baudrate, enabled_features);
+            new_baudrate = 0;
+        }
     }
 
     return ret;
 }
 
+int uartproxy_run(struct uartproxy_msg_start *start)
+{
+    return uartproxy_serve(start, IODEV_MAX);
+}
+
+static u64 uartproxy_secondary_entry(u64 iodev, u64 usage)
+{
+    int ret = uartproxy_serve(NULL, iodev);
+
+    printf("Proxy: secondary server on iodev %ld (CPU %d) exited (%d)\n", iodev, smp_id(), ret);
+
+    iodev_set_usage(iodev, usage);
+    if (iodev >= IODEV_USB0)
+        usb_iodev_set_irq(iodev, true);
+    __atomic_and_fetch(&secondary_iodevs, ~BIT(iodev), __ATOMIC_RELEASE);
+
+    return ret;
+}
+
+/*
+ * Run a proxy loop for iodev on a secondary CPU, so that host tools can drive the device over
+ * several links in parallel. The link is taken away from the console and, for USB, from IRQ
+ * servicing on the boot CPU, so only the serving CPU touches the controller. P_EXIT on the link
+ * ends the loop and hands the link back.
+ */
+int uartproxy_start_secondary(int cpu, iodev_id_t iodev)
+{
+    if (cpu == smp_id() || cpu >= MAX_CPUS || !smp_is_alive(cpu) || iodev >= IODEV_MAX ||
+        iodev == uartproxy_iodev || (secondary_iodevs & BIT(iodev)))
+        return -1;
+
+    // The bulk interfaces share their controller with the ACM, which the boot CPU still services
+    if (iodev >= IODEV_USB_BULK0)
+        return -1;
+
+    iodev_usage_t usage = iodev_get_usage(iodev);
+    if (!(usage & USAGE_UARTPROXY) || !iodev_get_opaque(iodev))
+        return -1;
+
+    __atomic_or_fetch(&secondary_iodevs, BIT(iodev), __ATOMIC_ACQUIRE);
+    iodev_set_usage(iodev, USAGE_UARTPROXY);
+    if (iodev >= IODEV_USB0)
+        usb_iodev_set_irq(iodev, false);
+
+    smp_call2(cpu, uartproxy_secondary_entry, iodev, usage);
+    return 0;
+}
+
 void uartproxy_send_event(u16 event_type, void *data, u16 length)
 {
+    iodev_id_t iodev = uartproxy_iodev;
     UartEventHdr hdr;
     u32 csum;
 
+    // Keep the order of anything still queued
+    uartproxy_flush_events(true);
+
     hdr.type = REQ_EVENT;
     hdr.len = length;
     hdr.event_type = event_type;
 
-    if (disable_data_csums) {
+    if (disable_data_csums[iodev]) {
         csum = CHECKSUM_SENTINEL;
     } else {
-        csum = checksum_start(&hdr, sizeof(UartEventHdr));
-        csum = checksum_finish(checksum_add(data, length, csum));
+        csum = data_checksum_start(iodev, &hdr, sizeof(UartEventHdr));
+        csum = data_checksum_finish(iodev, data_checksum_add(iodev, data, length, csum));
     }
-    iodev_lock(uartproxy_iodev);
-    iodev_queue(uartproxy_iodev, &hdr, sizeof(UartEventHdr));
-    iodev_queue(uartproxy_iodev, data, length);
-    iodev_write(uartproxy_iodev, &csum, sizeof(csum));
-    iodev_unlock(uartproxy_iodev);
+
+    struct iodev_iov iov[3] = {
+        {&hdr, sizeof(UartEventHdr)},
+        {data, length},
+        {&csum, sizeof(csum)},
+    };
+    iodev_writev(iodev, iov, 3);
 }
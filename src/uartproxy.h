@@ -30,6 +30,13 @@ typedef enum _uartproxy_exc_ret_t {
 typedef enum _uartproxy_event_type_t {
     EVT_MMIOTRACE = 1,
     EVT_IRQTRACE = 2,
+    EVT_MMIOTRACE_BATCH = 3,
+    EVT_EXC_ASYNC = 4,
+    EVT_IRQTRACE_BATCH = 5,
+    EVT_LINK_TEST = 6,
+    EVT_ASYNC_DONE = 7,
+    EVT_MEMTEST_ERROR = 8,
+    EVT_TRACE_DEMOTE = 9,
 } uartproxy_event_type_t;
 
 struct uartproxy_msg_start {
@@ -39,7 +46,19 @@ struct uartproxy_msg_start {
     void *reserved;
 };
 
+typedef enum _uartproxy_event_policy_t {
+    EVENT_QUEUE_SYNC = 0,    // post is a plain send, blocking on the link
+    EVENT_QUEUE_DROP_NEW,    // a full queue drops the event being posted
+    EVENT_QUEUE_DROP_OLDEST, // a full queue drops the oldest queued events first
+} uartproxy_event_policy_t;
+
 int uartproxy_run(struct uartproxy_msg_start *start);
+int uartproxy_start_secondary(int cpu, iodev_id_t iodev);
+u32 checksum_block(void *start, u32 length, u32 init);
 void uartproxy_send_event(u16 event_type, void *data, u16 length);
+void uartproxy_post_event(u16 event_type, void *data, u16 length);
+bool uartproxy_flush_events(bool block);
+u32 uartproxy_set_event_policy(u32 policy);
+u64 uartproxy_event_stats(u64 *posted, bool reset);
 
 #endif
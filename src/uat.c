@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "uat.h"
+#include "string.h"
+#include "utils.h"
+
+/*
+ * Walker for the AGX UAT page tables, so the proxyclient does not have to fetch every level over
+ * the link. ttbrs points at a context's TTBR0/TTBR1 pair in the GPU region, everything below is
+ * a regular 16K granule table: L1 selects on VA[38:36], L2 on VA[35:25] and L3 on VA[24:14].
+ */
+#define UAT_PAGE_BITS 14
+#define UAT_PAGE_SIZE BIT(UAT_PAGE_BITS)
+#define UAT_VA_MASK   MASK(40)
+
+#define UAT_L0_OFF 39
+#define UAT_L1_OFF 36
+#define UAT_L2_OFF 25
+#define UAT_L3_OFF 14
+
+#define UAT_L0_INDEX(va) (((va) >> UAT_L0_OFF) & 0x1)
+#define UAT_L1_INDEX(va) (((va) >> UAT_L1_OFF) & 0x7)
+#define UAT_L2_INDEX(va) (((va) >> UAT_L2_OFF) & 0x7ff)
+#define UAT_L3_INDEX(va) (((va) >> UAT_L3_OFF) & 0x7ff)
+
+#define UAT_TTBR_VALID BIT(0)
+#define UAT_TTBR_BADDR GENMASK(47, 1)
+
+#define UAT_PTE_VALID   BIT(0)
+#define UAT_PTE_TYPE    BIT(1)
+#define UAT_PTE_OFFSET  GENMASK(47, 14)
+#define UAT_PTE_PRESENT (UAT_PTE_VALID | UAT_PTE_TYPE)
+
+#define UAT_PTE_IS_VALID(pte) (((pte) & UAT_PTE_PRESENT) == UAT_PTE_PRESENT)
+
+// The last L3 table found, consecutive pages almost always share it
+struct uat_walk {
+    u64 ttbrs;
+    u64 l3_va;
+    u64 *l3;
+};
+
+static u64 *uat_walk_l3(u64 ttbrs, u64 va)
+{
+    u64 ttbr = read64(ttbrs + 8 * UAT_L0_INDEX(va));
+    if (!(ttbr & UAT_TTBR_VALID))
+        return NULL;
+
+    u64 *l1 = (u64 *)(ttbr & UAT_TTBR_BADDR);
+    u64 l1d = l1[UAT_L1_INDEX(va)];
+    if (!UAT_PTE_IS_VALID(l1d))
+        return NULL;
+
+    u64 *l2 = (u64 *)(l1d & UAT_PTE_OFFSET);
+    u64 l2d = l2[UAT_L2_INDEX(va)];
+    if (!UAT_PTE_IS_VALID(l2d))
+        return NULL;
+
+    return (u64 *)(l2d & UAT_PTE_OFFSET);
+}
+
+static u64 uat_walk_page(struct uat_walk *w, u64 va)
+{
+    va &= UAT_VA_MASK;
+
+    if (!w->l3 || (va >> UAT_L2_OFF) != w->l3_va) {
+        w->l3 = uat_walk_l3(w->ttbrs, va);
+        w->l3_va = va >> UAT_L2_OFF;
+        if (!w->l3)
+            return UAT_UNMAPPED;
+    }
+
+    u64 pte = w->l3[UAT_L3_INDEX(va)];
+    if (!UAT_PTE_IS_VALID(pte))
+        return UAT_UNMAPPED;
+
+    return pte & UAT_PTE_OFFSET;
+}
+
+/*
+ * Fills ext with the extents covering [iova, iova + size) and returns how many were used. If
+ * count runs out first the extents stop short of the end, the caller continues from there.
+ */
+ssize_t uat_translate(u64 ttbrs, u64 iova, size_t size, struct uat_extent *ext, size_t count)
+{
+    struct uat_walk w = {.ttbrs = ttbrs};
+    size_t n = 0;
+
+    if (!count)
+        return -1;
+
+    while (size) {
+        u64 off = iova & (UAT_PAGE_SIZE - 1);
+        u64 chunk = min(size, UAT_PAGE_SIZE - off);
+        u64 pa = uat_walk_page(&w, iova);
+
+        if (pa != UAT_UNMAPPED)
+            pa += off;
+
+        if (n && (ext[n - 1].paddr == UAT_UNMAPPED ? pa == UAT_UNMAPPED
+                                                   : pa == ext[n - 1].paddr + ext[n - 1].len)) {
+            ext[n - 1].len += chunk;
+        } else {
+            if (n == count)
+                break;
+            ext[n].iova = iova;
+            ext[n].paddr = pa;
+            ext[n].len = chunk;
+            n++;
+        }
+
+        iova += chunk;
+        size -= chunk;
+    }
+
+    return n;
+}
+
+// Copies between buf and GPU VA space, returns the number of bytes done before the first hole
+size_t uat_copy(u64 ttbrs, void *buf, u64 iova, size_t size, bool write)
+{
+    struct uat_walk w = {.ttbrs = ttbrs};
+    size_t done = 0;
+
+    while (done < size) {
+        u64 va = iova + done;
+        u64 off = va & (UAT_PAGE_SIZE - 1);
+        size_t chunk = min(size - done, UAT_PAGE_SIZE - off);
+        u64 pa = uat_walk_page(&w, va);
+
+        if (pa == UAT_UNMAPPED)
+            break;
+
+        // Merge physically contiguous pages into one copy
+        while (done + chunk < size) {
+            u64 next = uat_walk_page(&w, va + chunk);
+            if (next != pa + off + chunk)
+                break;
+            chunk += min(size - done - chunk, UAT_PAGE_SIZE);
+        }
+
+        if (write)
+            memcpy((void *)(pa + off), buf + done, chunk);
+        else
+            memcpy(buf + done, (void *)(pa + off), chunk);
+        done += chunk;
+    }
+
+    return done;
+}
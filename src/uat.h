@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef UAT_H
+#define UAT_H
+
+#include "types.h"
+
+#define UAT_UNMAPPED (~0UL)
+
+// A run of IOVA space that is either unmapped (paddr == UAT_UNMAPPED) or physically contiguous
+struct uat_extent {
+    u64 iova;
+    u64 paddr;
+    u64 len;
+};
+
+ssize_t uat_translate(u64 ttbrs, u64 iova, size_t size, struct uat_extent *ext, size_t count);
+size_t uat_copy(u64 ttbrs, void *buf, u64 iova, size_t size, bool write);
+
+#endif
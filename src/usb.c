@@ -2,11 +2,14 @@
 
 #include "usb.h"
 #include "adt.h"
+#include "aic.h"
 #include "dart.h"
 #include "i2c.h"
 #include "iodev.h"
 #include "malloc.h"
+#include "memory.h"
 #include "pmgr.h"
+#include "smp.h"
 #include "tps6598x.h"
 #include "types.h"
 #include "usb_dwc3.h"
@@ -34,6 +37,7 @@ struct usb_drd_regs {
 
 static tps6598x_irq_state_t tps6598x_irq_state[USB_IODEV_COUNT];
 static bool usb_is_initialized = false;
+static int usb_init_cpu = -1;
 
 static dart_dev_t *usb_dart_init(u32 idx)
 {
@@ -99,6 +103,7 @@ static int usb_drd_get_regs(u32 idx, struct usb_drd_regs *regs)
 int usb_phy_bringup(u32 idx)
 {
     char path[24];
+    struct pmgr_batch power;
 
     if (idx >= USB_IODEV_COUNT)
         return -1;
@@ -107,16 +112,21 @@ int usb_phy_bringup(u32 idx)
     if (usb_drd_get_regs(idx, &usb_regs) < 0)
         return -1;
 
+    pmgr_batch_init(&power, true);
+
     snprintf(path, sizeof(path), FMT_ATC_PATH, idx);
-    if (pmgr_adt_power_enable(path) < 0)
+    if (pmgr_batch_add_adt(&power, path) < 0)
         return -1;
 
     snprintf(path, sizeof(path), FMT_DART_PATH, idx);
-    if (pmgr_adt_power_enable(path) < 0)
+    if (pmgr_batch_add_adt(&power, path) < 0)
         return -1;
 
     snprintf(path, sizeof(path), FMT_DRD_PATH, idx);
-    if (pmgr_adt_power_enable(path) < 0)
+    if (pmgr_batch_add_adt(&power, path) < 0)
+        return -1;
+
+    if (pmgr_batch_start(&power) < 0 || pmgr_batch_wait(&power) < 0)
         return -1;
 
     write32(usb_regs.atc + 0x08, 0x01c1000f);
@@ -133,6 +143,24 @@ int usb_phy_bringup(u32 idx)
     return 0;
 }
 
+/* The first interrupt listed in the DRD node is the one raised by the DWC3 event buffer */
+static int usb_drd_get_irq(u32 idx)
+{
+    char drd_path[sizeof(FMT_DRD_PATH)];
+    u32 len;
+
+    snprintf(drd_path, sizeof(drd_path), FMT_DRD_PATH, idx);
+    int node = adt_path_offset(adt, drd_path);
+    if (node < 0)
+        return -1;
+
+    const u32 *irqs = adt_getprop(adt, node, "interrupts", &len);
+    if (!irqs || len < sizeof(*irqs))
+        return -1;
+
+    return irqs[0];
+}
+
 dwc3_dev_t *usb_iodev_bringup(u32 idx)
 {
     dart_dev_t *usb_dart = usb_dart_init(idx);
@@ -172,6 +200,20 @@ dwc3_dev_t *usb_iodev_bringup(u32 idx)
         return usb_dwc3_queue(dev, pipe, buf, count);                                              \
     }                                                                                              \
                                                                                                    \
+    static ssize_t usb_##name##_try_write(void *dev, const void *buf, size_t count)                \
+    {                                                                                              \
+        return usb_dwc3_try_write(dev, pipe, buf, count);                                          \
+    }                                                                                              \
+                                                                                                   \
+    static ssize_t usb_##name##_writev(void *dev, const struct iodev_iov *iov, int count)          \
+    {                                                                                              \
+        ssize_t sent = 0;                                                                          \
+        for (int i = 0; i < count; i++)                                                            \
+            sent += usb_dwc3_queue(dev, pipe, iov[i].base, iov[i].len);                            \
+        usb_dwc3_write(dev, pipe, NULL, 0);                                                        \
+        return sent;                                                                               \
+    }                                                                                              \
+                                                                                                   \
     static void usb_##name##_handle_events(void *dev)                                              \
     {                                                                                              \
         usb_dwc3_handle_events(dev);                                                               \
@@ -184,6 +226,7 @@ dwc3_dev_t *usb_iodev_bringup(u32 idx)
 
 USB_IODEV_WRAPPER(0, CDC_ACM_PIPE_0)
 USB_IODEV_WRAPPER(1, CDC_ACM_PIPE_1)
+USB_IODEV_WRAPPER(bulk, USB_BULK_PIPE)
 
 static struct iodev_ops iodev_usb_ops = {
     .can_read = usb_0_can_read,
@@ -191,6 +234,8 @@ static struct iodev_ops iodev_usb_ops = {
     .read = usb_0_read,
     .write = usb_0_write,
     .queue = usb_0_queue,
+    .try_write = usb_0_try_write,
+    .writev = usb_0_writev,
     .flush = usb_0_flush,
     .handle_events = usb_0_handle_events,
 };
@@ -201,14 +246,28 @@ static struct iodev_ops iodev_usb_sec_ops = {
     .read = usb_1_read,
     .write = usb_1_write,
     .queue = usb_1_queue,
+    .try_write = usb_1_try_write,
+    .writev = usb_1_writev,
     .flush = usb_1_flush,
     .handle_events = usb_1_handle_events,
 };
 
+static struct iodev_ops iodev_usb_bulk_ops = {
+    .can_read = usb_bulk_can_read,
+    .can_write = usb_bulk_can_write,
+    .read = usb_bulk_read,
+    .write = usb_bulk_write,
+    .queue = usb_bulk_queue,
+    .try_write = usb_bulk_try_write,
+    .writev = usb_bulk_writev,
+    .flush = usb_bulk_flush,
+    .handle_events = usb_bulk_handle_events,
+};
+
 struct iodev iodev_usb_vuart = {
     .ops = &iodev_usb_sec_ops,
     .usage = 0,
-    .lock = SPINLOCK_INIT,
+    .lock = SPINLOCK_INIT_NAMED("iodev_usb_vuart"),
 };
 
 static tps6598x_dev_t *hpm_init(i2c_dev_t *i2c, const char *hpm_path)
@@ -228,10 +287,86 @@ static tps6598x_dev_t *hpm_init(i2c_dev_t *i2c, const char *hpm_path)
     return tps;
 }
 
-void usb_init(void)
+typedef u64 (*usb_port_fn)(u32 idx, void *arg);
+
+static u64 usb_port_secondary(u64 fn, u64 idx, u64 arg)
+{
+    u64 ret = ((usb_port_fn)fn)(idx, (void *)arg);
+    // Same as usb_init_secondary(), leave the CPU the way we found it
+    mmu_disable();
+    return ret;
+}
+
+/*
+ * Run fn() for every port index at once and return the results in ret once all are done. The
+ * ports don't share anything but the i2c0 queue, malloc and the pmgr, which all take locks, so
+ * each one gets an idle secondary with its MMU up. Ports left over when none are free run on the
+ * calling CPU while the secondaries work on theirs.
+ */
+static void usb_for_each_port(usb_port_fn fn, void *arg, u64 *ret)
+{
+    int cpus[USB_IODEV_COUNT];
+    int cpu = MAX_CPUS - 1;
+
+    for (u32 idx = 0; idx < USB_IODEV_COUNT; idx++) {
+        cpus[idx] = -1;
+
+        for (; cpu > 0 && mmu_active(); cpu--) {
+            if (cpu == smp_id() || !smp_is_alive(cpu) || smp_is_busy(cpu))
+                continue;
+
+            mmu_init_secondary(cpu);
+            cpus[idx] = cpu--;
+            smp_call3(cpus[idx], usb_port_secondary, (u64)fn, idx, (u64)arg);
+            break;
+        }
+    }
+
+    for (u32 idx = 0; idx < USB_IODEV_COUNT; idx++)
+        if (cpus[idx] < 0)
+            ret[idx] = fn(idx, arg);
+
+    for (u32 idx = 0; idx < USB_IODEV_COUNT; idx++)
+        if (cpus[idx] >= 0)
+            ret[idx] = smp_wait(cpus[idx]);
+}
+
+static u64 usb_port_init(u32 idx, void *arg)
 {
     char hpm_path[sizeof(FMT_HPM_PATH)];
+    i2c_dev_t *i2c = arg;
+
+    snprintf(hpm_path, sizeof(hpm_path), FMT_HPM_PATH, idx);
+    if (adt_path_offset(adt, hpm_path) >= 0) {
+        tps6598x_dev_t *tps = hpm_init(i2c, hpm_path);
+        if (tps) {
+            if (tps6598x_disable_irqs(tps, &tps6598x_irq_state[idx]))
+                printf("usb: unable to disable IRQ masks for hpm%d\n", idx);
+
+            tps6598x_shutdown(tps);
+        } else {
+            printf("usb: failed to init hpm%d\n", idx);
+        }
+    }
+
+    usb_phy_bringup(idx); /* Fails on missing devices, just continue */
+    return 0;
+}
+
+static void usb_init_wait(void)
+{
+    if (usb_init_cpu < 0 || usb_init_cpu == smp_id())
+        return;
+
+    smp_wait(usb_init_cpu);
+    usb_init_cpu = -1;
+}
+
+void usb_init(void)
+{
+    u64 ret[USB_IODEV_COUNT];
 
+    usb_init_wait();
     if (usb_is_initialized)
         return;
 
@@ -241,34 +376,56 @@ void usb_init(void)
         return;
     }
 
-    for (u32 idx = 0; idx < USB_IODEV_COUNT; ++idx) {
-        snprintf(hpm_path, sizeof(hpm_path), FMT_HPM_PATH, idx);
-        if (adt_path_offset(adt, hpm_path) < 0)
-            continue; // device not present
-        tps6598x_dev_t *tps = hpm_init(i2c, hpm_path);
-        if (!tps) {
-            printf("usb: failed to init hpm%d\n", idx);
-            continue;
-        }
-
-        if (tps6598x_disable_irqs(tps, &tps6598x_irq_state[idx]))
-            printf("usb: unable to disable IRQ masks for hpm%d\n", idx);
+    // Let the controller run the HPM transactions on its own, falling back to polling if not
+    if (i2c_enable_irq(i2c))
+        printf("usb: no IRQ for i2c0, polling\n");
 
-        tps6598x_shutdown(tps);
-    }
+    usb_for_each_port(usb_port_init, i2c, ret);
 
     i2c_shutdown(i2c);
 
-    for (int idx = 0; idx < USB_IODEV_COUNT; ++idx)
-        usb_phy_bringup(idx); /* Fails on missing devices, just continue */
-
     usb_is_initialized = true;
 }
 
+static u64 usb_init_secondary(void)
+{
+    usb_init();
+    // Back to how the other secondaries run, a next stage may take this CPU over
+    mmu_disable();
+    return 0;
+}
+
+/*
+ * Most of usb_init() is spent waiting on the HPMs over i2c and on the PHYs, so it can run on a
+ * secondary while the boot CPU gets on with other things. Every entry point here waits for it to
+ * finish, and if no secondary is free usb_init() just runs synchronously when it is first needed.
+ */
+void usb_init_async(void)
+{
+    if (usb_is_initialized || usb_init_cpu >= 0)
+        return;
+
+    smp_start_secondaries();
+
+    for (int cpu = MAX_CPUS - 1; cpu > 0; cpu--) {
+        if (!smp_is_alive(cpu) || smp_is_busy(cpu))
+            continue;
+
+        // With caches and the shared page tables, so it sees the same memory and can take locks
+        mmu_init_secondary(cpu);
+        usb_init_cpu = cpu;
+        smp_call0(cpu, usb_init_secondary);
+        printf("usb: bringing up on CPU %d\n", cpu);
+        return;
+    }
+}
+
 void usb_hpm_restore_irqs(bool force)
 {
     char hpm_path[sizeof(FMT_HPM_PATH)];
 
+    usb_init_wait();
+
     i2c_dev_t *i2c = i2c_init("/arm-io/i2c0");
     if (!i2c) {
         printf("usb: i2c init failed.\n");
@@ -297,13 +454,25 @@ void usb_hpm_restore_irqs(bool force)
     i2c_shutdown(i2c);
 }
 
+static u64 usb_port_iodev_bringup(u32 idx, void *arg)
+{
+    UNUSED(arg);
+    return (u64)usb_iodev_bringup(idx);
+}
+
 void usb_iodev_init(void)
 {
+    u64 ret[USB_IODEV_COUNT];
+
+    usb_init_wait();
+
+    // Bring the controllers up together, but register them in order
+    usb_for_each_port(usb_port_iodev_bringup, NULL, ret);
+
     for (int i = 0; i < USB_IODEV_COUNT; i++) {
-        dwc3_dev_t *opaque;
+        dwc3_dev_t *opaque = (dwc3_dev_t *)ret[i];
         struct iodev *usb_iodev;
 
-        opaque = usb_iodev_bringup(i);
         if (!opaque)
             continue;
 
@@ -318,12 +487,57 @@ void usb_iodev_init(void)
 
         iodev_register_device(IODEV_USB0 + i, usb_iodev);
         printf("USB%d: initialized at %p\n", i, opaque);
+
+        // Same controller, vendor bulk interface for libusb hosts. Proxy only, the console
+        // stays on the ACM.
+        struct iodev *bulk_iodev = memalign(SPINLOCK_ALIGN, sizeof(*bulk_iodev));
+        if (!bulk_iodev)
+            continue;
+
+        bulk_iodev->ops = &iodev_usb_bulk_ops;
+        bulk_iodev->opaque = opaque;
+        bulk_iodev->usage = USAGE_UARTPROXY;
+        spin_init(&bulk_iodev->lock);
+
+        iodev_register_device(IODEV_USB_BULK0 + i, bulk_iodev);
+    }
+
+    usb_iodev_set_irq_mode(true);
+}
+
+void usb_iodev_set_irq(iodev_id_t iodev, bool enable)
+{
+    if (iodev < IODEV_USB0 || iodev >= IODEV_USB0 + USB_IODEV_COUNT)
+        return;
+
+    int i = iodev - IODEV_USB0;
+    dwc3_dev_t *opaque = iodev_get_opaque(iodev);
+    if (!opaque)
+        return;
+
+    if (!enable) {
+        usb_dwc3_disable_irq(opaque);
+        return;
     }
+
+    int irq = usb_drd_get_irq(i);
+    if (!aic || irq < 0 || usb_dwc3_enable_irq(opaque, irq) < 0)
+        printf("USB%d: IRQ mode unavailable, polling for events\n", i);
+}
+
+void usb_iodev_set_irq_mode(bool enable)
+{
+    for (int i = 0; i < USB_IODEV_COUNT; i++)
+        usb_iodev_set_irq(IODEV_USB0 + i, enable);
 }
 
 void usb_iodev_shutdown(void)
 {
+    usb_init_wait();
+
     for (int i = 0; i < USB_IODEV_COUNT; i++) {
+        free(iodev_unregister_device(IODEV_USB_BULK0 + i));
+
         struct iodev *usb_iodev = iodev_unregister_device(IODEV_USB0 + i);
         if (!usb_iodev)
             continue;
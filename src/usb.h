@@ -10,9 +10,12 @@
 dwc3_dev_t *usb_bringup(u32 idx);
 
 void usb_init(void);
+void usb_init_async(void);
 void usb_hpm_restore_irqs(bool force);
 void usb_iodev_init(void);
 void usb_iodev_shutdown(void);
 void usb_iodev_vuart_setup(iodev_id_t iodev);
+void usb_iodev_set_irq_mode(bool enable);
+void usb_iodev_set_irq(iodev_id_t iodev, bool enable);
 
 #endif
@@ -7,12 +7,15 @@
  * - https://www.beyondlogic.org/usbnutshell/usb1.shtml
  */
 
+#include "../build/build_cfg.h"
 #include "../build/build_tag.h"
 
 #include "usb_dwc3.h"
+#include "aic.h"
 #include "dart.h"
 #include "malloc.h"
 #include "memory.h"
+#include "memstats.h"
 #include "ringbuffer.h"
 #include "string.h"
 #include "types.h"
@@ -41,6 +44,14 @@
 #define CDC_INTERFACE_PROTOCOL_NONE 0x00
 #define CDC_INTERFACE_PROTOCOL_AT   0x01
 
+#define BULK_INTERFACE_CLASS    0xff
+#define BULK_INTERFACE_SUBCLASS 0x4d // 'M'
+#define BULK_INTERFACE_PROTOCOL 0x01
+#define BULK_INTERFACE_NUMBER   4
+
+/* vendor request to the bulk interface, wValue bit 0 opens/closes it like DTR on the ACMs */
+#define USB_REQUEST_BULK_SET_STATE 0x01
+
 #define DWC3_SCRATCHPAD_SIZE SZ_16K
 #define TRB_BUFFER_SIZE      SZ_16K
 #define XFER_BUFFER_SIZE     (SZ_16K * MAX_ENDPOINTS * 2)
@@ -49,13 +60,27 @@
 #define TRBS_PER_EP              (TRB_BUFFER_SIZE / (MAX_ENDPOINTS * sizeof(struct dwc3_trb)))
 #define XFER_BUFFER_BYTES_PER_EP (XFER_BUFFER_SIZE / MAX_ENDPOINTS)
 
-#define XFER_SIZE SZ_16K
+/* largest single CDC bulk transfer, split across at most CDC_XFER_TRBS chained TRBs */
+#define CDC_XFER_SIZE  (8 * SZ_16K)
+#define CDC_XFER_TRBS  2
+
+#define EP0_MAX_PACKET_HS  64
+#define EP0_MAX_PACKET_SS  512
+#define BULK_MAX_PACKET_HS 512
+#define BULK_MAX_PACKET_SS 1024
+
+/* room for a SuperSpeed companion after every endpoint of the high speed configuration */
+#define SS_CONFIGURATION_MAX_LEN 256
 
 #define SCRATCHPAD_IOVA   0xbeef0000
 #define EVENT_BUFFER_IOVA 0xdead0000
 #define XFER_BUFFER_IOVA  0xbabe0000
 #define TRB_BUFFER_IOVA   0xf00d0000
 
+/* the CDC ring buffers are mapped as well so that bulk transfers can DMA straight into them */
+#define CDC_BUFFER_IOVA_BASE      0x10000000
+#define CDC_BUFFER_IOVA(pipe, in) (CDC_BUFFER_IOVA_BASE + ((pipe)*2 + (in)) * CDC_BUFFER_SIZE)
+
 /* these map to the control endpoint 0x00/0x80 */
 #define USB_LEP_CTRL_OUT 0
 #define USB_LEP_CTRL_IN  1
@@ -74,6 +99,29 @@
 #define USB_LEP_CDC_BULK_OUT_2 8
 #define USB_LEP_CDC_BULK_IN_2  9
 
+/* these map to physical endpoints 0x05 and 0x85 */
+#define USB_LEP_BULK_OUT 10
+#define USB_LEP_BULK_IN  11
+
+#define DAIF_I BIT(7)
+
+/*
+ * The driver state is shared with the IRQ handler once IRQ mode is enabled, so everything that
+ * touches it from the main thread runs with IRQs masked. This nests, and is harmless when IRQs
+ * are masked anyway (e.g. in exception or hypervisor context).
+ */
+static inline u64 usb_dwc3_irq_save(void)
+{
+    u64 daif = mrs(DAIF);
+    msr(DAIF, daif | DAIF_I);
+    return daif;
+}
+
+static inline void usb_dwc3_irq_restore(u64 daif)
+{
+    msr(DAIF, daif);
+}
+
 /* content doesn't matter at all, this is the setting linux writes by default */
 static const u8 cdc_default_line_coding[] = {0x80, 0x25, 0x00, 0x00, 0x00, 0x00, 0x08};
 
@@ -94,6 +142,8 @@ typedef struct dwc3_dev {
     /* USB DRD */
     uintptr_t regs;
     dart_dev_t *dart;
+    /* AIC IRQ number when events are serviced from the interrupt, -1 when polled */
+    int irq;
 
     enum ep0_state ep0_state;
     const void *ep0_buffer;
@@ -104,6 +154,12 @@ typedef struct dwc3_dev {
     void *evtbuffer;
     u32 evt_buffer_offset;
 
+    /* filled in for the speed the host connected at */
+    bool superspeed;
+    u16 ep0_max_packet;
+    u16 bulk_max_packet;
+    struct usb_device_descriptor device_descriptor;
+
     void *scratchpad;
     void *xferbuffer;
     struct dwc3_trb *trbs;
@@ -111,6 +167,8 @@ typedef struct dwc3_dev {
     struct {
         bool xfer_in_progress;
         bool zlp_pending;
+        /* length of the CDC transfer in flight */
+        size_t xfer_len;
 
         void *xfer_buffer;
         uintptr_t xfer_buffer_iova;
@@ -158,12 +216,24 @@ struct cdc_dev_desc {
     const struct usb_interface_descriptor sec_interface_data;
     const struct usb_endpoint_descriptor sec_endpoint_data_in;
     const struct usb_endpoint_descriptor sec_endpoint_data_out;
+    const struct usb_interface_descriptor bulk_interface;
+    const struct usb_endpoint_descriptor bulk_endpoint_in;
+    const struct usb_endpoint_descriptor bulk_endpoint_out;
 } PACKED;
 
+/*
+ * Template for the per-device copy, bcdUSB and bMaxPacketSize0 are adjusted to the connection
+ * speed. Builds that can run at SuperSpeed report 2.1 at high speed so that the host learns about
+ * USB3 from the BOS descriptor.
+ */
 static const struct usb_device_descriptor usb_cdc_device_descriptor = {
     .bLength = sizeof(struct usb_device_descriptor),
     .bDescriptorType = USB_DEVICE_DESCRIPTOR,
+#ifdef USB_SUPERSPEED
+    .bcdUSB = 0x0210,
+#else
     .bcdUSB = 0x0200,
+#endif
     .bDeviceClass = CDC_DEVICE_CLASS,
     .bDeviceSubClass = 0, // unused
     .bDeviceProtocol = 0, // unused
@@ -183,7 +253,7 @@ static const struct cdc_dev_desc cdc_configuration_descriptor = {
             .bLength = sizeof(cdc_configuration_descriptor.configuration),
             .bDescriptorType = USB_CONFIGURATION_DESCRIPTOR,
             .wTotalLength = sizeof(cdc_configuration_descriptor),
-            .bNumInterfaces = 4,
+            .bNumInterfaces = 5,
             .bConfigurationValue = 1,
             .iConfiguration = 0,
             .bmAttributes = USB_CONFIGURATION_ATTRIBUTE_RES1 | USB_CONFIGURATION_SELF_POWERED,
@@ -327,6 +397,41 @@ static const struct cdc_dev_desc cdc_configuration_descriptor = {
             .wMaxPacketSize = 512,
             .bInterval = 10,
         },
+
+    /*
+     * raw bulk interface for the proxy, driven through libusb so that the host skips the tty
+     * layer entirely
+     */
+    .bulk_interface =
+        {
+            .bLength = sizeof(cdc_configuration_descriptor.bulk_interface),
+            .bDescriptorType = USB_INTERFACE_DESCRIPTOR,
+            .bInterfaceNumber = BULK_INTERFACE_NUMBER,
+            .bAlternateSetting = 0,
+            .bNumEndpoints = 2,
+            .bInterfaceClass = BULK_INTERFACE_CLASS,
+            .bInterfaceSubClass = BULK_INTERFACE_SUBCLASS,
+            .bInterfaceProtocol = BULK_INTERFACE_PROTOCOL,
+            .iInterface = 0,
+        },
+    .bulk_endpoint_in =
+        {
+            .bLength = sizeof(cdc_configuration_descriptor.bulk_endpoint_in),
+            .bDescriptorType = USB_ENDPOINT_DESCRIPTOR,
+            .bEndpointAddress = USB_ENDPOINT_ADDR_OUT(5),
+            .bmAttributes = USB_ENDPOINT_ATTR_TYPE_BULK,
+            .wMaxPacketSize = 512,
+            .bInterval = 0,
+        },
+    .bulk_endpoint_out =
+        {
+            .bLength = sizeof(cdc_configuration_descriptor.bulk_endpoint_out),
+            .bDescriptorType = USB_ENDPOINT_DESCRIPTOR,
+            .bEndpointAddress = USB_ENDPOINT_ADDR_IN(5),
+            .bmAttributes = USB_ENDPOINT_ATTR_TYPE_BULK,
+            .wMaxPacketSize = 512,
+            .bInterval = 0,
+        },
 };
 
 static const struct usb_device_qualifier_descriptor usb_cdc_device_qualifier_descriptor = {
@@ -340,6 +445,88 @@ static const struct usb_device_qualifier_descriptor usb_cdc_device_qualifier_des
     .bNumConfigurations = 0,
 };
 
+static const struct {
+    struct usb_bos_descriptor bos;
+    struct usb_ext_cap_descriptor usb20_ext;
+    struct usb_ss_cap_descriptor ss_cap;
+} PACKED usb_cdc_bos_descriptor = {
+    .bos =
+        {
+            .bLength = sizeof(usb_cdc_bos_descriptor.bos),
+            .bDescriptorType = USB_BOS_DESCRIPTOR,
+            .wTotalLength = sizeof(usb_cdc_bos_descriptor),
+            .bNumDeviceCaps = 2,
+        },
+    .usb20_ext =
+        {
+            .bLength = sizeof(usb_cdc_bos_descriptor.usb20_ext),
+            .bDescriptorType = USB_DEVICE_CAPABILITY_DESCRIPTOR,
+            .bDevCapabilityType = USB_CAPABILITY_USB20_EXTENSION,
+            .bmAttributes = 0, // no LPM
+        },
+    .ss_cap =
+        {
+            .bLength = sizeof(usb_cdc_bos_descriptor.ss_cap),
+            .bDescriptorType = USB_DEVICE_CAPABILITY_DESCRIPTOR,
+            .bDevCapabilityType = USB_CAPABILITY_SUPERSPEED_USB,
+            .bmAttributes = 0,
+            .wSpeedsSupported =
+                USB_SS_SPEED_SUPPORT_FULL | USB_SS_SPEED_SUPPORT_HIGH | USB_SS_SPEED_SUPPORT_SUPER,
+            .bFunctionalitySupport = 2, // everything works at high speed already
+            .bU1DevExitLat = 0x01,
+            .bU2DevExitLat = 0x01f4,
+        },
+};
+
+/*
+ * The SuperSpeed configuration is the high speed one with a companion descriptor after every
+ * endpoint and 1024 byte bulk packets. Bursts are left off since the FIFOs are not resized.
+ */
+static u8 usb_cdc_ss_configuration_descriptor[SS_CONFIGURATION_MAX_LEN];
+
+static void usb_dwc3_build_ss_configuration(void)
+{
+    const u8 *src = (const u8 *)&cdc_configuration_descriptor;
+    u8 *dst = usb_cdc_ss_configuration_descriptor;
+    size_t in = 0, out = 0;
+
+    while (in < sizeof(cdc_configuration_descriptor)) {
+        u8 len = src[in];
+        bool endpoint = src[in + 1] == USB_ENDPOINT_DESCRIPTOR;
+        size_t need = len + (endpoint ? sizeof(struct usb_ss_ep_comp_descriptor) : 0);
+
+        if (out + need > sizeof(usb_cdc_ss_configuration_descriptor)) {
+            debug_printf("usb-dwc3: SuperSpeed configuration descriptor does not fit\n");
+            memset(usb_cdc_ss_configuration_descriptor, 0,
+                   sizeof(usb_cdc_ss_configuration_descriptor));
+            return;
+        }
+
+        memcpy(&dst[out], &src[in], len);
+
+        if (endpoint) {
+            struct usb_endpoint_descriptor *ep = (void *)&dst[out];
+            struct usb_ss_ep_comp_descriptor *comp = (void *)&dst[out + len];
+            bool bulk = (ep->bmAttributes & 0b11) == USB_ENDPOINT_ATTR_TYPE_BULK;
+
+            if (bulk)
+                ep->wMaxPacketSize = BULK_MAX_PACKET_SS;
+
+            comp->bLength = sizeof(*comp);
+            comp->bDescriptorType = USB_SS_ENDPOINT_COMPANION_DESCRIPTOR;
+            comp->bMaxBurst = 0;
+            comp->bmAttributes = 0;
+            comp->wBytesPerInterval = bulk ? 0 : ep->wMaxPacketSize;
+        }
+
+        in += len;
+        out += need;
+    }
+
+    struct usb_configuration_descriptor *config = (void *)dst;
+    config->wTotalLength = out;
+}
+
 static const char *devt_names[] = {
     "DisconnEvt", "USBRst",   "ConnectDone", "ULStChng", "WkUpEvt",      "Reserved",       "EOPF",
     "SOF",        "Reserved", "ErrticErr",   "CmdCmplt", "EvntOverflow", "VndrDevTstRcved"};
@@ -400,11 +587,11 @@ static int usb_dwc3_ep_command(dwc3_dev_t *dev, u8 ep, u32 command, u32 par0, u3
     return DWC3_DEPCMD_STATUS(read32(dev->regs + DWC3_DEPCMD(ep)));
 }
 
-static int usb_dwc3_ep_configure(dwc3_dev_t *dev, u8 ep, u8 type, u32 max_packet_len)
+static int usb_dwc3_ep_set_config(dwc3_dev_t *dev, u8 ep, u8 type, u32 max_packet_len, u32 action)
 {
     u32 param0, param1;
 
-    param0 = DWC3_DEPCFG_EP_TYPE(type) | DWC3_DEPCFG_MAX_PACKET_SIZE(max_packet_len);
+    param0 = DWC3_DEPCFG_EP_TYPE(type) | DWC3_DEPCFG_MAX_PACKET_SIZE(max_packet_len) | action;
     if (type != DWC3_DEPCMD_TYPE_CONTROL)
         param0 |= DWC3_DEPCFG_FIFO_NUMBER(ep);
 
@@ -416,6 +603,14 @@ static int usb_dwc3_ep_configure(dwc3_dev_t *dev, u8 ep, u8 type, u32 max_packet
         return -1;
     }
 
+    return 0;
+}
+
+static int usb_dwc3_ep_configure(dwc3_dev_t *dev, u8 ep, u8 type, u32 max_packet_len)
+{
+    if (usb_dwc3_ep_set_config(dev, ep, type, max_packet_len, DWC3_DEPCFG_ACTION_INIT))
+        return -1;
+
     if (usb_dwc3_ep_command(dev, ep, DWC3_DEPCMD_SETTRANSFRESOURCE, 1, 0, 0)) {
         usb_debug_printf("cannot issue DWC3_DEPCMD_SETTRANSFRESOURCE EP %d.\n", ep);
         return -1;
@@ -513,9 +708,9 @@ static int usb_dwc3_ep0_start_data_recv_phase(dwc3_dev_t *dev)
         return -1;
     }
 
-    memset(dev->endpoints[USB_LEP_CTRL_OUT].xfer_buffer, 0, 64);
+    memset(dev->endpoints[USB_LEP_CTRL_OUT].xfer_buffer, 0, dev->ep0_max_packet);
 
-    return usb_dwc3_run_data_trb(dev, USB_LEP_CTRL_OUT, 64);
+    return usb_dwc3_run_data_trb(dev, USB_LEP_CTRL_OUT, dev->ep0_max_packet);
 }
 
 static void usb_dwc3_ep_set_stall(dwc3_dev_t *dev, u8 ep, u8 stall)
@@ -560,17 +755,33 @@ usb_dwc3_handle_ep0_get_descriptor(dwc3_dev_t *dev,
 
     switch (get_descriptor->type) {
         case USB_DEVICE_DESCRIPTOR:
-            descriptor = &usb_cdc_device_descriptor;
-            descriptor_len = usb_cdc_device_descriptor.bLength;
+            descriptor = &dev->device_descriptor;
+            descriptor_len = dev->device_descriptor.bLength;
             break;
         case USB_CONFIGURATION_DESCRIPTOR:
-            descriptor = &cdc_configuration_descriptor;
-            descriptor_len = cdc_configuration_descriptor.configuration.wTotalLength;
+            if (dev->superspeed) {
+                const struct usb_configuration_descriptor *config =
+                    (const void *)usb_cdc_ss_configuration_descriptor;
+                descriptor = config;
+                descriptor_len = config->wTotalLength;
+            } else {
+                descriptor = &cdc_configuration_descriptor;
+                descriptor_len = cdc_configuration_descriptor.configuration.wTotalLength;
+            }
+            break;
+        case USB_BOS_DESCRIPTOR:
+            if (dev->device_descriptor.bcdUSB < 0x0210)
+                break;
+            descriptor = &usb_cdc_bos_descriptor;
+            descriptor_len = sizeof(usb_cdc_bos_descriptor);
             break;
         case USB_STRING_DESCRIPTOR:
             usb_cdc_get_string_descriptor(get_descriptor->index, &descriptor, &descriptor_len);
             break;
         case USB_DEVICE_QUALIFIER_DESCRIPTOR:
+            /* there is no other speed to describe once we're on USB3 */
+            if (dev->superspeed)
+                break;
             descriptor = &usb_cdc_device_qualifier_descriptor;
             descriptor_len = usb_cdc_device_qualifier_descriptor.bLength;
             break;
@@ -607,6 +818,8 @@ static void usb_dwc3_ep0_handle_standard_device(dwc3_dev_t *dev,
                     clear32(dev->regs + DWC3_DALEPENA, DWC3_DALEPENA_EP(USB_LEP_CDC_BULK_OUT_2));
                     clear32(dev->regs + DWC3_DALEPENA, DWC3_DALEPENA_EP(USB_LEP_CDC_BULK_IN_2));
                     clear32(dev->regs + DWC3_DALEPENA, DWC3_DALEPENA_EP(USB_LEP_CDC_INTR_IN_2));
+                    clear32(dev->regs + DWC3_DALEPENA, DWC3_DALEPENA_EP(USB_LEP_BULK_OUT));
+                    clear32(dev->regs + DWC3_DALEPENA, DWC3_DALEPENA_EP(USB_LEP_BULK_IN));
                     dev->ep0_state = USB_DWC3_EP0_STATE_DATA_SEND_STATUS;
                     for (int i = 0; i < CDC_ACM_PIPE_MAX; i++)
                         dev->pipe[i].ready = false;
@@ -620,6 +833,8 @@ static void usb_dwc3_ep0_handle_standard_device(dwc3_dev_t *dev,
                     set32(dev->regs + DWC3_DALEPENA, DWC3_DALEPENA_EP(USB_LEP_CDC_BULK_OUT_2));
                     set32(dev->regs + DWC3_DALEPENA, DWC3_DALEPENA_EP(USB_LEP_CDC_BULK_IN_2));
                     set32(dev->regs + DWC3_DALEPENA, DWC3_DALEPENA_EP(USB_LEP_CDC_INTR_IN_2));
+                    set32(dev->regs + DWC3_DALEPENA, DWC3_DALEPENA_EP(USB_LEP_BULK_OUT));
+                    set32(dev->regs + DWC3_DALEPENA, DWC3_DALEPENA_EP(USB_LEP_BULK_IN));
                     dev->ep0_state = USB_DWC3_EP0_STATE_DATA_SEND_STATUS;
                     break;
                 default:
@@ -766,6 +981,32 @@ static void usb_dwc3_ep0_handle_class(dwc3_dev_t *dev, const union usb_setup_pac
     }
 }
 
+static void usb_dwc3_ep0_handle_vendor(dwc3_dev_t *dev, const union usb_setup_packet *setup)
+{
+    if ((setup->raw.bmRequestType & USB_REQUEST_TYPE_RECIPIENT_MASK) !=
+            USB_REQUEST_TYPE_RECIPIENT_INTERFACE ||
+        setup->raw.wIndex != BULK_INTERFACE_NUMBER) {
+        usb_dwc3_ep_set_stall(dev, 0, 1);
+        dev->ep0_state = USB_DWC3_EP0_STATE_IDLE;
+        usb_debug_printf("unsupported vendor SETUP packet\n");
+        return;
+    }
+
+    switch (setup->raw.bRequest) {
+        case USB_REQUEST_BULK_SET_STATE:
+            dev->pipe[USB_BULK_PIPE].ready = setup->raw.wValue & 1;
+            usb_debug_printf("bulk interface %s\n", (setup->raw.wValue & 1) ? "opened" : "closed");
+            usb_dwc3_start_status_phase(dev, USB_LEP_CTRL_IN);
+            dev->ep0_state = USB_DWC3_EP0_STATE_DATA_SEND_STATUS_DONE;
+            break;
+
+        default:
+            usb_dwc3_ep_set_stall(dev, 0, 1);
+            dev->ep0_state = USB_DWC3_EP0_STATE_IDLE;
+            usb_debug_printf("unsupported SETUP packet\n");
+    }
+}
+
 static void usb_dwc3_ep0_handle_setup(dwc3_dev_t *dev)
 {
     const union usb_setup_packet *setup = dev->endpoints[0].xfer_buffer;
@@ -777,6 +1018,9 @@ static void usb_dwc3_ep0_handle_setup(dwc3_dev_t *dev)
         case USB_REQUEST_TYPE_CLASS:
             usb_dwc3_ep0_handle_class(dev, setup);
             break;
+        case USB_REQUEST_TYPE_VENDOR:
+            usb_dwc3_ep0_handle_vendor(dev, setup);
+            break;
         default:
             usb_debug_printf("unsupported request type\n");
             usb_dwc3_ep_set_stall(dev, 0, 1);
@@ -868,15 +1112,73 @@ ringbuffer_t *usb_dwc3_cdc_get_ringbuffer(dwc3_dev_t *dev, u8 endpoint_number)
             return dev->pipe[CDC_ACM_PIPE_1].device2host;
         case USB_LEP_CDC_BULK_OUT_2:
             return dev->pipe[CDC_ACM_PIPE_1].host2device;
+        case USB_LEP_BULK_IN:
+            return dev->pipe[USB_BULK_PIPE].device2host;
+        case USB_LEP_BULK_OUT:
+            return dev->pipe[USB_BULK_PIPE].host2device;
         default:
             return NULL;
     }
 }
 
-static void usb_dwc3_cdc_start_bulk_out_xfer(dwc3_dev_t *dev, u8 endpoint_number)
+static uintptr_t usb_dwc3_cdc_get_iova(dwc3_dev_t *dev, u8 endpoint_number, const u8 *span)
+{
+    ringbuffer_t *bfr = usb_dwc3_cdc_get_ringbuffer(dev, endpoint_number);
+    uintptr_t iova;
+
+    switch (endpoint_number) {
+        case USB_LEP_CDC_BULK_IN:
+            iova = CDC_BUFFER_IOVA(CDC_ACM_PIPE_0, 1);
+            break;
+        case USB_LEP_CDC_BULK_OUT:
+            iova = CDC_BUFFER_IOVA(CDC_ACM_PIPE_0, 0);
+            break;
+        case USB_LEP_CDC_BULK_IN_2:
+            iova = CDC_BUFFER_IOVA(CDC_ACM_PIPE_1, 1);
+            break;
+        case USB_LEP_CDC_BULK_OUT_2:
+            iova = CDC_BUFFER_IOVA(CDC_ACM_PIPE_1, 0);
+            break;
+        case USB_LEP_BULK_IN:
+            iova = CDC_BUFFER_IOVA(USB_BULK_PIPE, 1);
+            break;
+        case USB_LEP_BULK_OUT:
+            iova = CDC_BUFFER_IOVA(USB_BULK_PIPE, 0);
+            break;
+        default:
+            return 0;
+    }
+
+    return iova + (span - bfr->buffer);
+}
+
+/*
+ * Build a TRB chain for a transfer of len bytes starting at span inside the endpoint's ring
+ * buffer, with a second TRB for whatever wraps around to the start of the buffer.
+ */
+static uintptr_t usb_dwc3_cdc_init_trbs(dwc3_dev_t *dev, u8 endpoint_number, ringbuffer_t *bfr,
+                                        const u8 *span, size_t contig, size_t len)
+{
+    struct dwc3_trb *trb = dev->endpoints[endpoint_number].trb;
+    const u8 *ptrs[CDC_XFER_TRBS] = {span, bfr->buffer};
+    size_t lens[CDC_XFER_TRBS] = {min(contig, len), len - min(contig, len)};
+    int count = lens[1] ? 2 : 1;
+
+    for (int i = 0; i < count; i++) {
+        trb[i].bpl = usb_dwc3_cdc_get_iova(dev, endpoint_number, ptrs[i]);
+        trb[i].bph = 0;
+        trb[i].size = DWC3_TRB_SIZE_LENGTH(lens[i]);
+        trb[i].ctrl = DWC3_TRB_CTRL_HWO | DWC3_TRB_CTRL_ISP_IMI | DWC3_TRBCTL_NORMAL;
+        trb[i].ctrl |= (i == count - 1) ? DWC3_TRB_CTRL_LST : DWC3_TRB_CTRL_CHN;
+    }
+
+    return dev->endpoints[endpoint_number].trb_iova;
+}
+
+static void __usb_dwc3_cdc_start_bulk_out_xfer(dwc3_dev_t *dev, u8 endpoint_number)
 {
-    struct dwc3_trb *trb;
     uintptr_t trb_iova;
+    u8 *span;
 
     if (dev->endpoints[endpoint_number].xfer_in_progress)
         return;
@@ -885,21 +1187,29 @@ static void usb_dwc3_cdc_start_bulk_out_xfer(dwc3_dev_t *dev, u8 endpoint_number
     if (!host2device)
         return;
 
-    if (ringbuffer_get_free(host2device) < XFER_SIZE)
+    /* receive straight into the ring, OUT transfers must be a multiple of the packet size */
+    size_t contig = ringbuffer_reserve(host2device, &span);
+    size_t len = min(ringbuffer_get_free(host2device), CDC_XFER_SIZE);
+    len &= ~(dev->bulk_max_packet - 1);
+    if (!len)
         return;
 
-    memset(dev->endpoints[endpoint_number].xfer_buffer, 0xaa, XFER_SIZE);
-    trb_iova = usb_dwc3_init_trb(dev, endpoint_number, &trb);
-    trb->ctrl |= DWC3_TRBCTL_NORMAL;
-    trb->size = DWC3_TRB_SIZE_LENGTH(XFER_SIZE);
+    trb_iova = usb_dwc3_cdc_init_trbs(dev, endpoint_number, host2device, span, contig, len);
 
     usb_dwc3_ep_start_transfer(dev, endpoint_number, trb_iova);
     dev->endpoints[endpoint_number].xfer_in_progress = true;
+    dev->endpoints[endpoint_number].xfer_len = len;
 }
 
-static void usb_dwc3_cdc_start_bulk_in_xfer(dwc3_dev_t *dev, u8 endpoint_number)
+static void usb_dwc3_cdc_start_bulk_out_xfer(dwc3_dev_t *dev, u8 endpoint_number)
+{
+    u64 daif = usb_dwc3_irq_save();
+    __usb_dwc3_cdc_start_bulk_out_xfer(dev, endpoint_number);
+    usb_dwc3_irq_restore(daif);
+}
+
+static void __usb_dwc3_cdc_start_bulk_in_xfer(dwc3_dev_t *dev, u8 endpoint_number)
 {
-    struct dwc3_trb *trb;
     uintptr_t trb_iova;
 
     if (dev->endpoints[endpoint_number].xfer_in_progress)
@@ -909,30 +1219,59 @@ static void usb_dwc3_cdc_start_bulk_in_xfer(dwc3_dev_t *dev, u8 endpoint_number)
     if (!device2host)
         return;
 
-    size_t len =
-        ringbuffer_read(dev->endpoints[endpoint_number].xfer_buffer, XFER_SIZE, device2host);
+    /* send straight from the ring, the data is only consumed once the transfer is done */
+    const u8 *span;
+    size_t contig = ringbuffer_peek(device2host, &span);
+    size_t len = min(ringbuffer_get_used(device2host), CDC_XFER_SIZE);
 
     if (!len && !dev->endpoints[endpoint_number].zlp_pending)
         return;
 
-    trb_iova = usb_dwc3_init_trb(dev, endpoint_number, &trb);
-    trb->ctrl |= DWC3_TRBCTL_NORMAL;
-    trb->size = DWC3_TRB_SIZE_LENGTH(len);
+    trb_iova = usb_dwc3_cdc_init_trbs(dev, endpoint_number, device2host, span, contig, len);
 
     usb_dwc3_ep_start_transfer(dev, endpoint_number, trb_iova);
     dev->endpoints[endpoint_number].xfer_in_progress = true;
-    dev->endpoints[endpoint_number].zlp_pending = (len % 512) == 0;
+    dev->endpoints[endpoint_number].xfer_len = len;
+    dev->endpoints[endpoint_number].zlp_pending = (len % dev->bulk_max_packet) == 0;
+}
+
+static void usb_dwc3_cdc_start_bulk_in_xfer(dwc3_dev_t *dev, u8 endpoint_number)
+{
+    u64 daif = usb_dwc3_irq_save();
+    __usb_dwc3_cdc_start_bulk_in_xfer(dev, endpoint_number);
+    usb_dwc3_irq_restore(daif);
+}
+
+static void usb_dwc3_cdc_handle_bulk_in_xfer_done(dwc3_dev_t *dev,
+                                                  const struct dwc3_event_depevt event)
+{
+    ringbuffer_t *device2host = usb_dwc3_cdc_get_ringbuffer(dev, event.endpoint_number);
+    if (!device2host)
+        return;
+    ringbuffer_consume(device2host, dev->endpoints[event.endpoint_number].xfer_len);
+    dev->endpoints[event.endpoint_number].xfer_len = 0;
 }
 
 static void usb_dwc3_cdc_handle_bulk_out_xfer_done(dwc3_dev_t *dev,
                                                    const struct dwc3_event_depevt event)
 {
+    struct dwc3_trb *trb = dev->endpoints[event.endpoint_number].trb;
+    size_t len = dev->endpoints[event.endpoint_number].xfer_len;
+
     ringbuffer_t *host2device = usb_dwc3_cdc_get_ringbuffer(dev, event.endpoint_number);
     if (!host2device)
         return;
-    size_t len = min(XFER_SIZE, ringbuffer_get_free(host2device));
-    ringbuffer_write(dev->endpoints[event.endpoint_number].xfer_buffer,
-                     len - dev->endpoints[event.endpoint_number].trb->size, host2device);
+
+    /* a short packet ends the whole chain, later TRBs keep their full remaining size */
+    dma_rmb();
+    for (int i = 0; i < CDC_XFER_TRBS; i++) {
+        len -= DWC3_TRB_SIZE_LENGTH(trb[i].size);
+        if (trb[i].ctrl & DWC3_TRB_CTRL_LST)
+            break;
+    }
+
+    ringbuffer_commit(host2device, len);
+    dev->endpoints[event.endpoint_number].xfer_len = 0;
 }
 
 static void usb_dwc3_handle_event_ep(dwc3_dev_t *dev, const struct dwc3_event_depevt event)
@@ -949,9 +1288,11 @@ static void usb_dwc3_handle_event_ep(dwc3_dev_t *dev, const struct dwc3_event_de
                 return;
             case USB_LEP_CDC_BULK_IN: // [[fallthrough]]
             case USB_LEP_CDC_BULK_IN_2:
-                return;
+            case USB_LEP_BULK_IN:
+                return usb_dwc3_cdc_handle_bulk_in_xfer_done(dev, event);
             case USB_LEP_CDC_BULK_OUT: // [[fallthrough]]
             case USB_LEP_CDC_BULK_OUT_2:
+            case USB_LEP_BULK_OUT:
                 return usb_dwc3_cdc_handle_bulk_out_xfer_done(dev, event);
         }
     } else if (event.endpoint_event == DWC3_DEPEVT_XFERNOTREADY) {
@@ -971,10 +1312,12 @@ static void usb_dwc3_handle_event_ep(dwc3_dev_t *dev, const struct dwc3_event_de
                 return;
             case USB_LEP_CDC_BULK_IN: // [[fallthrough]]
             case USB_LEP_CDC_BULK_IN_2:
-                return usb_dwc3_cdc_start_bulk_in_xfer(dev, event.endpoint_number);
+            case USB_LEP_BULK_IN:
+                return __usb_dwc3_cdc_start_bulk_in_xfer(dev, event.endpoint_number);
             case USB_LEP_CDC_BULK_OUT: // [[fallthrough]]
             case USB_LEP_CDC_BULK_OUT_2:
-                return usb_dwc3_cdc_start_bulk_out_xfer(dev, event.endpoint_number);
+            case USB_LEP_BULK_OUT:
+                return __usb_dwc3_cdc_start_bulk_out_xfer(dev, event.endpoint_number);
         }
     }
 
@@ -1002,16 +1345,58 @@ static void usb_dwc3_handle_event_usbrst(dwc3_dev_t *dev)
     write32(dev->regs + DWC3_DALEPENA, DWC3_DALEPENA_EP(0) | DWC3_DALEPENA_EP(1));
 }
 
+/*
+ * The endpoints are all configured for high speed at init. When the link came up at SuperSpeed
+ * (or falls back to high speed on a later connection) their packet sizes are switched over in
+ * place, the same way the DWC3 databook describes for ep0 after ConnectDone.
+ */
+static int usb_dwc3_set_speed(dwc3_dev_t *dev, bool superspeed)
+{
+    dev->device_descriptor.bcdUSB = superspeed ? 0x0320 : usb_cdc_device_descriptor.bcdUSB;
+    /* at SuperSpeed this is an exponent, 2^9 = 512 */
+    dev->device_descriptor.bMaxPacketSize0 = superspeed ? 9 : EP0_MAX_PACKET_HS;
+
+    if (superspeed == dev->superspeed)
+        return 0;
+
+    dev->superspeed = superspeed;
+    dev->ep0_max_packet = superspeed ? EP0_MAX_PACKET_SS : EP0_MAX_PACKET_HS;
+    dev->bulk_max_packet = superspeed ? BULK_MAX_PACKET_SS : BULK_MAX_PACKET_HS;
+
+    if (usb_dwc3_ep_set_config(dev, USB_LEP_CTRL_OUT, DWC3_DEPCMD_TYPE_CONTROL,
+                               dev->ep0_max_packet, DWC3_DEPCFG_ACTION_MODIFY))
+        return -1;
+    if (usb_dwc3_ep_set_config(dev, USB_LEP_CTRL_IN, DWC3_DEPCMD_TYPE_CONTROL,
+                               dev->ep0_max_packet, DWC3_DEPCFG_ACTION_MODIFY))
+        return -1;
+
+    for (int i = 0; i < CDC_ACM_PIPE_MAX; i++) {
+        if (usb_dwc3_ep_set_config(dev, dev->pipe[i].ep_in, DWC3_DEPCMD_TYPE_BULK,
+                                   dev->bulk_max_packet, DWC3_DEPCFG_ACTION_MODIFY))
+            return -1;
+        if (usb_dwc3_ep_set_config(dev, dev->pipe[i].ep_out, DWC3_DEPCMD_TYPE_BULK,
+                                   dev->bulk_max_packet, DWC3_DEPCFG_ACTION_MODIFY))
+            return -1;
+    }
+
+    return 0;
+}
+
 static void usb_dwc3_handle_event_connect_done(dwc3_dev_t *dev)
 {
     u32 speed = read32(dev->regs + DWC3_DSTS) & DWC3_DSTS_CONNECTSPD;
+    bool superspeed = speed == DWC3_DSTS_SUPERSPEED && usb_cdc_ss_configuration_descriptor[0];
 
-    if (speed != DWC3_DSTS_HIGHSPEED) {
+    if (speed != DWC3_DSTS_HIGHSPEED && !superspeed) {
         usb_debug_printf(
-            "WARNING: we only support high speed right now but %02x was requested in DSTS\n",
+            "WARNING: we only support high and super speed but %02x was requested in DSTS\n",
             speed);
     }
 
+    usb_debug_printf("connected at %s speed\n", superspeed ? "super" : "high");
+    if (usb_dwc3_set_speed(dev, superspeed))
+        usb_debug_printf("failed to reconfigure endpoints for the connection speed\n");
+
     usb_dwc3_start_setup_phase(dev);
     dev->ep0_state = USB_DWC3_EP0_STATE_SETUP_HANDLE;
 }
@@ -1042,11 +1427,8 @@ static void usb_dwc3_handle_event(dwc3_dev_t *dev, const union dwc3_event event)
         usb_debug_printf("unknown event %08x\n", event.raw);
 }
 
-void usb_dwc3_handle_events(dwc3_dev_t *dev)
+static void __usb_dwc3_handle_events(dwc3_dev_t *dev)
 {
-    if (!dev)
-        return;
-
     u32 n_events = read32(dev->regs + DWC3_GEVNTCOUNT(0)) / sizeof(union dwc3_event);
     if (n_events == 0)
         return;
@@ -1064,6 +1446,97 @@ void usb_dwc3_handle_events(dwc3_dev_t *dev)
     write32(dev->regs + DWC3_GEVNTCOUNT(0), sizeof(union dwc3_event) * n_events);
 }
 
+void usb_dwc3_handle_events(dwc3_dev_t *dev)
+{
+    if (!dev)
+        return;
+
+    u64 daif = usb_dwc3_irq_save();
+    __usb_dwc3_handle_events(dev);
+    usb_dwc3_irq_restore(daif);
+}
+
+static void usb_dwc3_irq(void *priv)
+{
+    dwc3_dev_t *dev = priv;
+
+    __usb_dwc3_handle_events(dev);
+
+    /* keep the bulk pipes moving while the main thread is busy elsewhere */
+    for (int i = 0; i < CDC_ACM_PIPE_MAX; i++) {
+        if (!dev->pipe[i].ready)
+            continue;
+        __usb_dwc3_cdc_start_bulk_out_xfer(dev, dev->pipe[i].ep_out);
+        __usb_dwc3_cdc_start_bulk_in_xfer(dev, dev->pipe[i].ep_in);
+    }
+}
+
+int usb_dwc3_enable_irq(dwc3_dev_t *dev, int irq)
+{
+    if (!dev || dev->irq >= 0)
+        return -1;
+
+    u64 daif = usb_dwc3_irq_save();
+    if (aic_register_irq(irq, usb_dwc3_irq, dev) < 0) {
+        usb_dwc3_irq_restore(daif);
+        return -1;
+    }
+    dev->irq = irq;
+    usb_dwc3_irq_restore(daif);
+
+    usb_debug_printf("servicing events from IRQ %d\n", irq);
+    return 0;
+}
+
+void usb_dwc3_disable_irq(dwc3_dev_t *dev)
+{
+    if (!dev || dev->irq < 0)
+        return;
+
+    u64 daif = usb_dwc3_irq_save();
+    aic_unregister_irq(dev->irq);
+    dev->irq = -1;
+    usb_dwc3_irq_restore(daif);
+}
+
+static void *usb_dwc3_dma_alloc(size_t size)
+{
+    void *p = memalign(SZ_16K, size);
+
+    if (p)
+        memstat_alloc(MEMSTAT_USB, size);
+
+    return p;
+}
+
+static void usb_dwc3_dma_free(void *p, size_t size)
+{
+    if (!p)
+        return;
+
+    memstat_free(MEMSTAT_USB, size);
+    free(p);
+}
+
+static ringbuffer_t *usb_dwc3_ring_alloc(void)
+{
+    ringbuffer_t *ring = ringbuffer_alloc(CDC_BUFFER_SIZE);
+
+    if (ring)
+        memstat_alloc(MEMSTAT_USB, CDC_BUFFER_SIZE);
+
+    return ring;
+}
+
+static void usb_dwc3_ring_free(ringbuffer_t *ring)
+{
+    if (!ring)
+        return;
+
+    memstat_free(MEMSTAT_USB, CDC_BUFFER_SIZE);
+    ringbuffer_free(ring);
+}
+
 dwc3_dev_t *usb_dwc3_init(uintptr_t regs, dart_dev_t *dart)
 {
     /* sanity check */
@@ -1084,21 +1557,26 @@ dwc3_dev_t *usb_dwc3_init(uintptr_t regs, dart_dev_t *dart)
 
     dev->regs = regs;
     dev->dart = dart;
+    dev->irq = -1;
+
+    dev->ep0_max_packet = EP0_MAX_PACKET_HS;
+    dev->bulk_max_packet = BULK_MAX_PACKET_HS;
+    dev->device_descriptor = usb_cdc_device_descriptor;
 
     /* allocate and map dma buffers */
-    dev->evtbuffer = memalign(SZ_16K, max(DWC3_EVENT_BUFFERS_SIZE, SZ_16K));
+    dev->evtbuffer = usb_dwc3_dma_alloc(max(DWC3_EVENT_BUFFERS_SIZE, SZ_16K));
     if (!dev->evtbuffer)
         goto error;
 
-    dev->scratchpad = memalign(SZ_16K, max(DWC3_SCRATCHPAD_SIZE, SZ_16K));
+    dev->scratchpad = usb_dwc3_dma_alloc(max(DWC3_SCRATCHPAD_SIZE, SZ_16K));
     if (!dev->scratchpad)
         goto error;
 
-    dev->trbs = memalign(SZ_16K, TRB_BUFFER_SIZE);
+    dev->trbs = usb_dwc3_dma_alloc(TRB_BUFFER_SIZE);
     if (!dev->trbs)
         goto error;
 
-    dev->xferbuffer = memalign(SZ_16K, XFER_BUFFER_SIZE);
+    dev->xferbuffer = usb_dwc3_dma_alloc(XFER_BUFFER_SIZE);
     if (!dev->xferbuffer)
         goto error;
 
@@ -1107,6 +1585,7 @@ dwc3_dev_t *usb_dwc3_init(uintptr_t regs, dart_dev_t *dart)
     memset(dev->xferbuffer, 0, XFER_BUFFER_SIZE);
     memset(dev->trbs, 0, TRB_BUFFER_SIZE);
 
+    dart_defer_flush(dev->dart);
     if (dart_map(dev->dart, EVENT_BUFFER_IOVA, dev->evtbuffer,
                  max(DWC3_EVENT_BUFFERS_SIZE, SZ_16K)))
         goto error;
@@ -1116,6 +1595,7 @@ dwc3_dev_t *usb_dwc3_init(uintptr_t regs, dart_dev_t *dart)
         goto error;
     if (dart_map(dev->dart, XFER_BUFFER_IOVA, dev->xferbuffer, XFER_BUFFER_SIZE))
         goto error;
+    dart_flush(dev->dart);
 
     /* prepare endpoint buffers */
     for (int i = 0; i < MAX_ENDPOINTS; ++i) {
@@ -1153,8 +1633,17 @@ dwc3_dev_t *usb_dwc3_init(uintptr_t regs, dart_dev_t *dart)
     mask32(dev->regs + DWC3_GCTL, DWC3_GCTL_PRTCAPDIR(DWC3_GCTL_PRTCAP_OTG),
            DWC3_GCTL_PRTCAPDIR(DWC3_GCTL_PRTCAP_DEVICE));
 
-    /* stick to USB 2.0 high speed for now */
+#ifdef USB_SUPERSPEED
+    /*
+     * the controller trains at high speed on its own if the host or PHY can't do USB3, this only
+     * gets anywhere when the ATC PHY was already brought up in USB3 mode by the previous stage
+     */
+    usb_dwc3_build_ss_configuration();
+    mask32(dev->regs + DWC3_DCFG, DWC3_DCFG_SPEED_MASK, DWC3_DCFG_SUPERSPEED);
+#else
+    /* stick to USB 2.0 high speed unless built with USB_SUPERSPEED=1 */
     mask32(dev->regs + DWC3_DCFG, DWC3_DCFG_SPEED_MASK, DWC3_DCFG_HIGHSPEED);
+#endif
 
     /* setup scratchpad at SCRATCHPAD_IOVA */
     if (usb_dwc3_command(dev, DWC3_DGCMD_SET_SCRATCHPAD_ADDR_LO, SCRATCHPAD_IOVA)) {
@@ -1182,9 +1671,9 @@ dwc3_dev_t *usb_dwc3_init(uintptr_t regs, dart_dev_t *dart)
     }
 
     /* prepare control endpoint 0 IN and OUT */
-    if (usb_dwc3_ep_configure(dev, USB_LEP_CTRL_OUT, DWC3_DEPCMD_TYPE_CONTROL, 64))
+    if (usb_dwc3_ep_configure(dev, USB_LEP_CTRL_OUT, DWC3_DEPCMD_TYPE_CONTROL, EP0_MAX_PACKET_HS))
         goto error;
-    if (usb_dwc3_ep_configure(dev, USB_LEP_CTRL_IN, DWC3_DEPCMD_TYPE_CONTROL, 64))
+    if (usb_dwc3_ep_configure(dev, USB_LEP_CTRL_IN, DWC3_DEPCMD_TYPE_CONTROL, EP0_MAX_PACKET_HS))
         goto error;
 
     /* prepare CDC ACM interfaces */
@@ -1197,24 +1686,41 @@ dwc3_dev_t *usb_dwc3_init(uintptr_t regs, dart_dev_t *dart)
     dev->pipe[CDC_ACM_PIPE_1].ep_in = USB_LEP_CDC_BULK_IN_2;
     dev->pipe[CDC_ACM_PIPE_1].ep_out = USB_LEP_CDC_BULK_OUT_2;
 
+    /* the vendor bulk interface has no notification endpoint */
+    dev->pipe[USB_BULK_PIPE].ep_in = USB_LEP_BULK_IN;
+    dev->pipe[USB_BULK_PIPE].ep_out = USB_LEP_BULK_OUT;
+
+    /* the pipe buffers aren't used before the first transfer, so flush the DART once for all */
+    dart_defer_flush(dev->dart);
     for (int i = 0; i < CDC_ACM_PIPE_MAX; i++) {
-        dev->pipe[i].host2device = ringbuffer_alloc(CDC_BUFFER_SIZE);
+        dev->pipe[i].host2device = usb_dwc3_ring_alloc();
         if (!dev->pipe[i].host2device)
             goto error;
-        dev->pipe[i].device2host = ringbuffer_alloc(CDC_BUFFER_SIZE);
+        dev->pipe[i].device2host = usb_dwc3_ring_alloc();
         if (!dev->pipe[i].device2host)
             goto error;
 
+        if (dart_map(dev->dart, CDC_BUFFER_IOVA(i, 0), dev->pipe[i].host2device->buffer,
+                     CDC_BUFFER_SIZE))
+            goto error;
+        if (dart_map(dev->dart, CDC_BUFFER_IOVA(i, 1), dev->pipe[i].device2host->buffer,
+                     CDC_BUFFER_SIZE))
+            goto error;
+
         /* prepare INTR endpoint so that we don't have to reconfigure this device later */
-        if (usb_dwc3_ep_configure(dev, dev->pipe[i].ep_intr, DWC3_DEPCMD_TYPE_INTR, 64))
+        if (dev->pipe[i].ep_intr &&
+            usb_dwc3_ep_configure(dev, dev->pipe[i].ep_intr, DWC3_DEPCMD_TYPE_INTR, 64))
             goto error;
 
         /* prepare BULK endpoints so that we don't have to reconfigure this device later */
-        if (usb_dwc3_ep_configure(dev, dev->pipe[i].ep_in, DWC3_DEPCMD_TYPE_BULK, 512))
+        if (usb_dwc3_ep_configure(dev, dev->pipe[i].ep_in, DWC3_DEPCMD_TYPE_BULK,
+                                  BULK_MAX_PACKET_HS))
             goto error;
-        if (usb_dwc3_ep_configure(dev, dev->pipe[i].ep_out, DWC3_DEPCMD_TYPE_BULK, 512))
+        if (usb_dwc3_ep_configure(dev, dev->pipe[i].ep_out, DWC3_DEPCMD_TYPE_BULK,
+                                  BULK_MAX_PACKET_HS))
             goto error;
     }
+    dart_flush(dev->dart);
 
     /* prepare first control transfer */
     dev->ep0_state = USB_DWC3_EP0_STATE_IDLE;
@@ -1235,6 +1741,8 @@ error:
 
 void usb_dwc3_shutdown(dwc3_dev_t *dev)
 {
+    usb_dwc3_disable_irq(dev);
+
     for (int i = 0; i < CDC_ACM_PIPE_MAX; i++)
         dev->pipe[i].ready = false;
 
@@ -1261,19 +1769,25 @@ void usb_dwc3_shutdown(dwc3_dev_t *dev)
     if (poll32(dev->regs + DWC3_DCTL, DWC3_DCTL_CSFTRST, 0, 1000))
         usb_debug_printf("timeout while waiting for DWC3_DCTL_CSFTRST to clear during shutdown.\n");
 
-    /* unmap and free dma buffers */
+    /* unmap and free dma buffers, the controller is halted so one DART flush will do */
+    dart_defer_flush(dev->dart);
     dart_unmap(dev->dart, TRB_BUFFER_IOVA, TRB_BUFFER_SIZE);
     dart_unmap(dev->dart, XFER_BUFFER_IOVA, XFER_BUFFER_SIZE);
     dart_unmap(dev->dart, SCRATCHPAD_IOVA, max(DWC3_SCRATCHPAD_SIZE, SZ_16K));
     dart_unmap(dev->dart, EVENT_BUFFER_IOVA, max(DWC3_EVENT_BUFFERS_SIZE, SZ_16K));
+    for (int i = 0; i < CDC_ACM_PIPE_MAX; i++) {
+        dart_unmap(dev->dart, CDC_BUFFER_IOVA(i, 0), CDC_BUFFER_SIZE);
+        dart_unmap(dev->dart, CDC_BUFFER_IOVA(i, 1), CDC_BUFFER_SIZE);
+    }
+    dart_flush(dev->dart);
 
-    free(dev->evtbuffer);
-    free(dev->scratchpad);
-    free(dev->xferbuffer);
-    free(dev->trbs);
+    usb_dwc3_dma_free(dev->evtbuffer, max(DWC3_EVENT_BUFFERS_SIZE, SZ_16K));
+    usb_dwc3_dma_free(dev->scratchpad, max(DWC3_SCRATCHPAD_SIZE, SZ_16K));
+    usb_dwc3_dma_free(dev->xferbuffer, XFER_BUFFER_SIZE);
+    usb_dwc3_dma_free(dev->trbs, TRB_BUFFER_SIZE);
     for (int i = 0; i < CDC_ACM_PIPE_MAX; i++) {
-        ringbuffer_free(dev->pipe[i].device2host);
-        ringbuffer_free(dev->pipe[i].host2device);
+        usb_dwc3_ring_free(dev->pipe[i].device2host);
+        usb_dwc3_ring_free(dev->pipe[i].host2device);
     }
 
     if (dev->dart)
@@ -1352,6 +1866,23 @@ size_t usb_dwc3_write(dwc3_dev_t *dev, cdc_acm_pipe_id_t pipe, const void *buf,
     return ret;
 }
 
+size_t usb_dwc3_try_write(dwc3_dev_t *dev, cdc_acm_pipe_id_t pipe, const void *buf, size_t count)
+{
+    if (!dev || !dev->pipe[pipe].ready)
+        return 0;
+
+    ringbuffer_t *device2host = dev->pipe[pipe].device2host;
+    if (!device2host)
+        return 0;
+
+    u8 ep = dev->pipe[pipe].ep_in;
+    size_t ret = ringbuffer_write(buf, count, device2host);
+
+    usb_dwc3_cdc_start_bulk_in_xfer(dev, ep);
+
+    return ret;
+}
+
 size_t usb_dwc3_read(dwc3_dev_t *dev, cdc_acm_pipe_id_t pipe, void *buf, size_t count)
 {
     u8 *p = buf;
@@ -609,6 +609,9 @@ union dwc3_event {
 #define DWC3_DEPCFG_EP_NUMBER(n)       (((n)&0x1f) << 25)
 #define DWC3_DEPCFG_FIFO_NUMBER(n)     (((n)&0xf) << 17)
 #define DWC3_DEPCFG_MAX_PACKET_SIZE(n) (((n)&0x7ff) << 3)
+#define DWC3_DEPCFG_ACTION_INIT        (0 << 30)
+#define DWC3_DEPCFG_ACTION_RESTORE     (1 << 30)
+#define DWC3_DEPCFG_ACTION_MODIFY      (2 << 30)
 
 #define DWC3_DEPCFG_INT_NUM(n)          (((n)&0x1f) << 0)
 #define DWC3_DEPCFG_XFER_COMPLETE_EN    BIT(8)
@@ -97,6 +97,16 @@ union usb_setup_packet {
 #define USB_ENDPOINT_DESCRIPTOR                  0x05
 #define USB_DEVICE_QUALIFIER_DESCRIPTOR          0x06
 #define USB_OTHER_SPEED_CONFIGURATION_DESCRIPTOR 0x07
+#define USB_BOS_DESCRIPTOR                       0x0f
+#define USB_DEVICE_CAPABILITY_DESCRIPTOR         0x10
+#define USB_SS_ENDPOINT_COMPANION_DESCRIPTOR     0x30
+
+#define USB_CAPABILITY_USB20_EXTENSION 0x02
+#define USB_CAPABILITY_SUPERSPEED_USB  0x03
+
+#define USB_SS_SPEED_SUPPORT_FULL  0x02
+#define USB_SS_SPEED_SUPPORT_HIGH  0x04
+#define USB_SS_SPEED_SUPPORT_SUPER 0x08
 
 #define USB_CDC_INTERFACE_FUNCTIONAL_DESCRIPTOR 0x24
 #define USB_CDC_UNION_SUBTYPE                   0x06
@@ -195,6 +205,39 @@ struct usb_device_qualifier_descriptor {
     u8 bReserved;
 } PACKED;
 
+struct usb_bos_descriptor {
+    u8 bLength;
+    u8 bDescriptorType;
+    u16 wTotalLength;
+    u8 bNumDeviceCaps;
+} PACKED;
+
+struct usb_ext_cap_descriptor {
+    u8 bLength;
+    u8 bDescriptorType;
+    u8 bDevCapabilityType;
+    u32 bmAttributes;
+} PACKED;
+
+struct usb_ss_cap_descriptor {
+    u8 bLength;
+    u8 bDescriptorType;
+    u8 bDevCapabilityType;
+    u8 bmAttributes;
+    u16 wSpeedsSupported;
+    u8 bFunctionalitySupport;
+    u8 bU1DevExitLat;
+    u16 bU2DevExitLat;
+} PACKED;
+
+struct usb_ss_ep_comp_descriptor {
+    u8 bLength;
+    u8 bDescriptorType;
+    u8 bMaxBurst;
+    u8 bmAttributes;
+    u16 wBytesPerInterval;
+} PACKED;
+
 /*
  * this macro is required because we need to convert any string literals
  * to UTF16 and because we need to calculate the correct total size of the
@@ -6,6 +6,7 @@
 #include "utils.h"
 #include "iodev.h"
 #include "smp.h"
+#include "string.h"
 #include "types.h"
 #include "vsprintf.h"
 #include "xnuboot.h"
@@ -128,39 +129,106 @@ void flush_and_reboot(void)
     reboot();
 }
 
+bool spinlock_stats_enabled = false;
+
+static spinlock_t *spinlock_registry[SPINLOCK_STATS_MAX];
+static u32 spinlock_registry_count;
+
 void spin_init(spinlock_t *lock)
 {
     lock->lock = -1;
     lock->count = 0;
+    lock->next = 0;
+    lock->serving = 0;
+    lock->registered = 0;
+    memset(&lock->stat, 0, sizeof(lock->stat));
+    lock->locked_at = 0;
+}
+
+/* Called by the new owner when stats are enabled, so after the lock is actually taken */
+static void spin_stats_acquired(spinlock_t *lock, u64 start, bool contended)
+{
+    u64 now = get_ticks();
+    u64 wait = now - start;
+
+    if (!lock->registered) {
+        lock->registered = 1;
+        u32 idx = __atomic_fetch_add(&spinlock_registry_count, 1, __ATOMIC_RELAXED);
+        if (idx < SPINLOCK_STATS_MAX)
+            spinlock_registry[idx] = lock;
+    }
+
+    lock->stat.acquired++;
+    if (contended) {
+        lock->stat.contended++;
+        lock->stat.wait_ticks += wait;
+        lock->stat.max_wait_ticks = max(lock->stat.max_wait_ticks, wait);
+    }
+    lock->locked_at = now;
 }
 
 void spin_lock(spinlock_t *lock)
 {
-    s64 tmp;
+    u32 tmp;
     s64 me = smp_id();
     if (__atomic_load_n(&lock->lock, __ATOMIC_ACQUIRE) == me) {
         lock->count++;
         return;
     }
 
-    __asm__ volatile("1:\n"
-                     "mov\t%0, -1\n"
-                     "2:\n"
-                     "\tcasa\t%0, %2, %1\n"
-                     "\tcmn\t%0, 1\n"
-                     "\tbeq\t3f\n"
-                     "\tldxr\t%0, %1\n"
-                     "\tcmn\t%0, 1\n"
-                     "\tbeq\t2b\n"
-                     "\twfe\n"
-                     "\tb\t1b\n"
-                     "3:"
-                     : "=&r"(tmp), "+m"(lock->lock)
-                     : "r"(me)
-                     : "cc", "memory");
+    bool stats = spinlock_stats_enabled;
+    u64 start = stats ? get_ticks() : 0;
+    u32 ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    bool contended = __atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE) != ticket;
 
-    assert(__atomic_load_n(&lock->lock, __ATOMIC_RELAXED) == me);
+    /*
+     * The owner's store to serving clears our exclusive monitor, which is what wakes up the
+     * WFE. sevl makes the first WFE fall through.
+     */
+    if (contended)
+        __asm__ volatile("sevl\n"
+                         "1:\n"
+                         "\twfe\n"
+                         "\tldaxr\t%w0, %1\n"
+                         "\tcmp\t%w0, %w2\n"
+                         "\tbne\t1b\n"
+                         : "=&r"(tmp), "+Q"(lock->serving)
+                         : "r"(ticket)
+                         : "cc", "memory");
+
+    assert(__atomic_load_n(&lock->lock, __ATOMIC_RELAXED) == -1);
+    __atomic_store_n(&lock->lock, me, __ATOMIC_RELAXED);
     lock->count++;
+
+    if (stats)
+        spin_stats_acquired(lock, start, contended);
+}
+
+bool spin_trylock(spinlock_t *lock)
+{
+    s64 me = smp_id();
+
+    if (__atomic_load_n(&lock->lock, __ATOMIC_ACQUIRE) == me) {
+        lock->count++;
+        return true;
+    }
+
+    /*
+     * Only take a ticket if it would be served right away. serving never passes next, so if next
+     * still equals what serving was, both are our ticket.
+     */
+    u32 ticket = __atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE);
+    if (!__atomic_compare_exchange_n(&lock->next, &ticket, ticket + 1, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+        return false;
+
+    __atomic_store_n(&lock->lock, me, __ATOMIC_RELAXED);
+    lock->count++;
+
+    if (spinlock_stats_enabled)
+        spin_stats_acquired(lock, get_ticks(), false);
+
+    return true;
 }
 
 void spin_unlock(spinlock_t *lock)
@@ -168,8 +236,47 @@ void spin_unlock(spinlock_t *lock)
     s64 me = smp_id();
     assert(__atomic_load_n(&lock->lock, __ATOMIC_RELAXED) == me);
     assert(lock->count > 0);
-    if (!--lock->count)
-        __atomic_store_n(&lock->lock, -1L, __ATOMIC_RELEASE);
+    if (--lock->count)
+        return;
+
+    if (lock->locked_at) {
+        u64 hold = get_ticks() - lock->locked_at;
+        lock->stat.hold_ticks += hold;
+        lock->stat.max_hold_ticks = max(lock->stat.max_hold_ticks, hold);
+        lock->locked_at = 0;
+    }
+
+    __atomic_store_n(&lock->lock, -1L, __ATOMIC_RELAXED);
+    __atomic_store_n(&lock->serving, lock->serving + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy out the stats of up to count locks taken since stats were first enabled, then apply flags.
+ * The numbers are read without taking the locks, so they might be slightly torn.
+ */
+int spinlock_stats_get(struct spinlock_stat_entry *out, size_t count, u64 flags)
+{
+    size_t n = min(count, (size_t)min(spinlock_registry_count, (u32)SPINLOCK_STATS_MAX));
+
+    for (size_t i = 0; i < n; i++) {
+        spinlock_t *lock = spinlock_registry[i];
+
+        memset(&out[i], 0, sizeof(out[i]));
+        out[i].addr = (u64)lock;
+        if (lock->name)
+            strncpy(out[i].name, lock->name, SPINLOCK_STATS_NAME - 1);
+        out[i].stat = lock->stat;
+    }
+
+    if (flags & SPINLOCK_STATS_RESET)
+        for (u32 i = 0; i < min(spinlock_registry_count, (u32)SPINLOCK_STATS_MAX); i++)
+            memset(&spinlock_registry[i]->stat, 0, sizeof(spinlock_registry[i]->stat));
+    if (flags & SPINLOCK_STATS_DISABLE)
+        spinlock_stats_enabled = false;
+    if (flags & SPINLOCK_STATS_ENABLE)
+        spinlock_stats_enabled = true;
+
+    return n;
 }
 
 bool is_heap(void *addr)
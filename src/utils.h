@@ -358,6 +358,7 @@ extern char _payload_end[];
  */
 void memcpy128(void *dst, void *src, size_t size);
 void memset64(void *dst, u64 value, size_t size);
+void memfill64(void *dst, u64 value, size_t size);
 void memcpy64(void *dst, void *src, size_t size);
 void memset32(void *dst, u32 value, size_t size);
 void memcpy32(void *dst, void *src, size_t size);
@@ -366,6 +367,13 @@ void memcpy16(void *dst, void *src, size_t size);
 void memset8(void *dst, u8 value, size_t size);
 void memcpy8(void *dst, void *src, size_t size);
 
+/*
+ * memcpy/memset variants using SIMD registers for large, MMU-enabled operations. These clobber
+ * FP/SIMD state and must not be used from exception or hypervisor context.
+ */
+void *memcpy_simd(void *dst, const void *src, size_t size);
+void *memset_simd(void *dst, int c, size_t size);
+
 void get_simd_state(void *state);
 void put_simd_state(void *state);
 
@@ -390,20 +398,59 @@ bool timeout_expired(u64 timeout);
 
 #define SPINLOCK_ALIGN 64
 
+// Shared with proxyclient/tools/spinlock_stats.py
+struct spinlock_stat {
+    u64 acquired;  // outermost acquisitions
+    u64 contended; // of those, how many had to wait
+    u64 wait_ticks;
+    u64 hold_ticks;
+    u64 max_wait_ticks;
+    u64 max_hold_ticks;
+};
+
+/*
+ * Recursive ticket lock: CPUs get the lock in the order they asked for it, and the owner may take
+ * it again. The stats live on their own cache line, away from the words waiters spin on.
+ */
 typedef struct {
-    s64 lock;
-    int count;
+    s64 lock;    // owning CPU, -1 if free
+    int count;   // recursion depth of the owner
+    u32 next;    // next ticket to hand out
+    u32 serving; // ticket currently holding the lock
+    u32 registered;
+    const char *name;
+
+    struct spinlock_stat stat ALIGNED(SPINLOCK_ALIGN);
+    u64 locked_at;
 } spinlock_t ALIGNED(SPINLOCK_ALIGN);
 
-#define SPINLOCK_INIT                                                                              \
+#define SPINLOCK_INIT_NAMED(n)                                                                     \
     {                                                                                              \
-        -1, 0                                                                                      \
+        .lock = -1, .name = n                                                                      \
     }
-#define DECLARE_SPINLOCK(n) spinlock_t n = SPINLOCK_INIT;
+#define SPINLOCK_INIT       SPINLOCK_INIT_NAMED(NULL)
+#define DECLARE_SPINLOCK(n) spinlock_t n = SPINLOCK_INIT_NAMED(#n);
+
+#define SPINLOCK_STATS_MAX  64
+#define SPINLOCK_STATS_NAME 24
+
+#define SPINLOCK_STATS_ENABLE  0x1
+#define SPINLOCK_STATS_DISABLE 0x2
+#define SPINLOCK_STATS_RESET   0x4
+
+struct spinlock_stat_entry {
+    u64 addr;
+    char name[SPINLOCK_STATS_NAME];
+    struct spinlock_stat stat;
+};
+
+extern bool spinlock_stats_enabled;
 
 void spin_init(spinlock_t *lock);
 void spin_lock(spinlock_t *lock);
+bool spin_trylock(spinlock_t *lock);
 void spin_unlock(spinlock_t *lock);
+int spinlock_stats_get(struct spinlock_stat_entry *out, size_t count, u64 flags);
 
 #define mdelay(m) udelay((m)*1000)
 
@@ -0,0 +1,915 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Zstandard (RFC 8878) frame decoder, for decompressing into a flat output buffer.
+ *
+ * Since the whole output is addressable, matches are resolved directly against it and no window
+ * buffer is needed. Dictionaries are not supported. The Huffman and FSE tables that can be
+ * repeated across blocks are kept in a static context.
+ */
+
+#include "zstddec.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ZSTD_MAGIC           0xfd2fb528
+#define ZSTD_SKIPPABLE_MAGIC 0x184d2a50
+#define ZSTD_SKIPPABLE_MASK  0xfffffff0
+
+#define FHD_FCS(fhd)      ((fhd) >> 6)
+#define FHD_SINGLE_SEG    0x20
+#define FHD_RESERVED      0x08
+#define FHD_CHECKSUM      0x04
+#define FHD_DICT_ID(fhd)  ((fhd) & 3)
+#define BH_LAST           1
+#define BH_TYPE(bh)       (((bh) >> 1) & 3)
+#define BH_SIZE(bh)       ((bh) >> 3)
+#define BLOCK_RAW         0
+#define BLOCK_RLE         1
+#define BLOCK_COMPRESSED  2
+#define BLOCK_MAX         (128 << 10)
+#define LIT_RAW           0
+#define LIT_RLE           1
+#define LIT_COMPRESSED    2
+#define LIT_TREELESS      3
+#define SEQ_PREDEFINED    0
+#define SEQ_RLE           1
+#define SEQ_FSE           2
+#define SEQ_REPEAT        3
+#define HUF_MAX_BITS      11
+#define HUF_MAX_WEIGHTS   255
+#define HUF_WEIGHT_LOG    6
+#define FSE_MAX_LOG       9
+#define LL_MAX_LOG        9
+#define ML_MAX_LOG        9
+#define OF_MAX_LOG        8
+#define LL_MAX_SYMBOL     35
+#define ML_MAX_SYMBOL     52
+#define OF_MAX_SYMBOL     31
+#define LL_DEFAULT_LOG    6
+#define ML_DEFAULT_LOG    6
+#define OF_DEFAULT_LOG    5
+
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+#define PRIME64_4 0x85ebca77c2b2ae63ULL
+#define PRIME64_5 0x27d4eb2f165667c5ULL
+
+#define CHECK(x)                                                                                   \
+    do {                                                                                           \
+        int _ret = (x);                                                                            \
+        if (_ret)                                                                                  \
+            return _ret;                                                                           \
+    } while (0)
+
+struct fse_entry {
+    uint8_t symbol;
+    uint8_t bits;
+    uint16_t base;
+};
+
+struct fse_table {
+    int log; // -1 if not set up yet, for SEQ_REPEAT
+    struct fse_entry e[1 << FSE_MAX_LOG];
+};
+
+struct huf_entry {
+    uint8_t symbol;
+    uint8_t bits;
+};
+
+struct huf_table {
+    int log; // -1 if not set up yet, for LIT_TREELESS
+    struct huf_entry e[1 << HUF_MAX_BITS];
+};
+
+/* Backwards bitstream; pos is the number of bits not read yet, reads past the start give 0 */
+struct bits {
+    const uint8_t *src;
+    size_t len;
+    int64_t pos;
+};
+
+static struct {
+    struct huf_table huf;
+    struct fse_table ll, of, ml;
+    struct fse_table weights;
+    uint32_t rep[3];
+    int16_t norm[256];
+    uint16_t next[256];
+    uint8_t huf_weights[HUF_MAX_WEIGHTS + 1];
+    uint8_t lit[BLOCK_MAX];
+} zs;
+
+static const int16_t ll_default[LL_MAX_SYMBOL + 1] = {
+    4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+    -1, -1, -1, -1,
+};
+
+static const int16_t ml_default[ML_MAX_SYMBOL + 1] = {
+    1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+static const int16_t of_default[29] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1,
+};
+
+static const uint32_t ll_base[LL_MAX_SYMBOL + 1] = {
+    0,  1,  2,  3,  4,  5,  6,  7,  8,   9,   10,  11,  12,   13,   14,   15,   16,    18,
+    20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536,
+};
+
+static const uint8_t ll_bits[LL_MAX_SYMBOL + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15, 16,
+};
+
+static const uint32_t ml_base[ML_MAX_SYMBOL + 1] = {
+    3,   4,   5,   6,   7,   8,    9,    10,   11,   12,   13,    14,    15,    16,
+    17,  18,  19,  20,  21,  22,   23,   24,   25,   26,   27,    28,    29,    30,
+    31,  32,  33,  34,  35,  37,   39,   41,   43,   47,   51,    59,    67,    83,
+    99,  131, 259, 515, 1027, 2051, 4099, 8195, 16387, 32771, 65539,
+};
+
+static const uint8_t ml_bits[ML_MAX_SYMBOL + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+};
+
+static int highbit(uint32_t v)
+{
+    return 31 - __builtin_clz(v);
+}
+
+static uint32_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+/* Bits [pos, pos + n) of a little endian bitstream, n <= 56, zero outside of the buffer */
+static uint64_t get_bits(const uint8_t *src, size_t len, int64_t pos, int n)
+{
+    if (!n)
+        return 0;
+
+    if (pos < 0) {
+        if (pos + n <= 0)
+            return 0;
+        return get_bits(src, len, 0, n + pos) << -pos;
+    }
+
+    size_t byte = pos >> 3;
+    uint64_t v = 0;
+
+    if (byte < len && len - byte >= 8) {
+        v = get_le64(src + byte);
+    } else {
+        for (int i = 0; i < 8 && byte + i < len; i++)
+            v |= (uint64_t)src[byte + i] << (8 * i);
+    }
+
+    return (v >> (pos & 7)) & ((1ULL << n) - 1);
+}
+
+static int bits_init(struct bits *b, const uint8_t *src, size_t len)
+{
+    // The last byte has a marker bit above the first bit of data
+    if (!len || !src[len - 1])
+        return ZSTD_DATA_ERROR;
+
+    b->src = src;
+    b->len = len;
+    b->pos = (int64_t)(len - 1) * 8 + highbit(src[len - 1]);
+    return ZSTD_OK;
+}
+
+static uint32_t bits_read(struct bits *b, int n)
+{
+    b->pos -= n;
+    return get_bits(b->src, b->len, b->pos, n);
+}
+
+static uint32_t bits_peek(struct bits *b, int n)
+{
+    return get_bits(b->src, b->len, b->pos - n, n);
+}
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * PRIME64_2, 31) * PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t v)
+{
+    return (acc ^ xxh64_round(0, v)) * PRIME64_1 + PRIME64_4;
+}
+
+static uint64_t xxh64(const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = PRIME64_1 + PRIME64_2;
+        uint64_t v2 = PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -PRIME64_1;
+
+        for (; end - p >= 32; p += 32) {
+            v1 = xxh64_round(v1, get_le64(p));
+            v2 = xxh64_round(v2, get_le64(p + 8));
+            v3 = xxh64_round(v3, get_le64(p + 16));
+            v4 = xxh64_round(v4, get_le64(p + 24));
+        }
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = PRIME64_5;
+    }
+
+    h += len;
+
+    for (; end - p >= 8; p += 8)
+        h = rotl64(h ^ xxh64_round(0, get_le64(p)), 27) * PRIME64_1 + PRIME64_4;
+    if (end - p >= 4) {
+        h = rotl64(h ^ (get_le32(p) * PRIME64_1), 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl64(h ^ (*p * PRIME64_5), 11) * PRIME64_1;
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/* Copy a match, which may overlap its own output */
+static void copy_match(uint8_t *d, size_t off, size_t len)
+{
+    const uint8_t *s = d - off;
+
+    if (off >= len) {
+        memcpy(d, s, len);
+        return;
+    }
+
+    // Everything from s onwards repeats with a period of off, so keep doubling the chunk size
+    while (len) {
+        size_t n = d - s;
+        if (n > len)
+            n = len;
+        memcpy(d, s, n);
+        d += n;
+        len -= n;
+    }
+}
+
+static int fse_build(struct fse_table *t, const int16_t *norm, int nsym, int log)
+{
+    uint32_t size = 1 << log;
+    uint32_t high = size - 1;
+
+    for (int s = 0; s < nsym; s++) {
+        if (norm[s] == -1) {
+            t->e[high--].symbol = s;
+            zs.next[s] = 1;
+        } else {
+            zs.next[s] = norm[s];
+        }
+    }
+
+    uint32_t pos = 0;
+    uint32_t step = (size >> 1) + (size >> 3) + 3;
+
+    for (int s = 0; s < nsym; s++) {
+        for (int i = 0; i < norm[s]; i++) {
+            t->e[pos].symbol = s;
+            do {
+                pos = (pos + step) & (size - 1);
+            } while (pos > high);
+        }
+    }
+
+    if (pos)
+        return ZSTD_DATA_ERROR;
+
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t next = zs.next[t->e[i].symbol]++;
+        int bits = log - highbit(next);
+
+        t->e[i].bits = bits;
+        t->e[i].base = (next << bits) - size;
+    }
+
+    t->log = log;
+    return ZSTD_OK;
+}
+
+static int fse_read_header(struct fse_table *t, const uint8_t *src, size_t len, size_t *used,
+                           int max_log, int max_symbol)
+{
+    if (!len)
+        return ZSTD_DATA_ERROR;
+
+    int log = (src[0] & 15) + 5;
+    int64_t pos = 4;
+    int32_t remaining = 1 << log;
+    int nsym = 0;
+
+    if (log > max_log)
+        return ZSTD_DATA_ERROR;
+
+    while (remaining > 0 && nsym <= max_symbol) {
+        int bits = highbit(remaining + 1) + 1;
+        uint32_t val = get_bits(src, len, pos, bits);
+        uint32_t lower_mask = (1 << (bits - 1)) - 1;
+        uint32_t threshold = (1 << bits) - 1 - (remaining + 1);
+
+        // Small values take one bit less
+        if ((val & lower_mask) < threshold) {
+            val &= lower_mask;
+            pos += bits - 1;
+        } else {
+            if (val > lower_mask)
+                val -= threshold;
+            pos += bits;
+        }
+
+        // -1 means "less than 1", which still takes up a slot
+        int prob = (int)val - 1;
+        remaining -= prob < 0 ? -prob : prob;
+        zs.norm[nsym++] = prob;
+
+        if (!prob) {
+            int repeat;
+            do {
+                repeat = get_bits(src, len, pos, 2);
+                pos += 2;
+                for (int i = 0; i < repeat && nsym <= max_symbol; i++)
+                    zs.norm[nsym++] = 0;
+            } while (repeat == 3);
+        }
+    }
+
+    *used = (pos + 7) >> 3;
+    if (remaining || *used > len)
+        return ZSTD_DATA_ERROR;
+
+    return fse_build(t, zs.norm, nsym, log);
+}
+
+static int huf_build(int nweights)
+{
+    uint8_t *weights = zs.huf_weights;
+    uint32_t sum = 0;
+    uint16_t rank_count[HUF_MAX_BITS + 1] = {0};
+    uint32_t rank_idx[HUF_MAX_BITS + 1];
+
+    for (int i = 0; i < nweights; i++) {
+        if (weights[i] > HUF_MAX_BITS)
+            return ZSTD_DATA_ERROR;
+        sum += weights[i] ? 1 << (weights[i] - 1) : 0;
+    }
+
+    if (!sum)
+        return ZSTD_DATA_ERROR;
+
+    // The last weight is implied, it brings the sum up to the next power of two
+    int max_bits = highbit(sum) + 1;
+    uint32_t left = (1 << max_bits) - sum;
+
+    if (max_bits > HUF_MAX_BITS || (left & (left - 1)))
+        return ZSTD_DATA_ERROR;
+
+    weights[nweights++] = highbit(left) + 1;
+
+    // Turn weights into code lengths in place
+    for (int i = 0; i < nweights; i++) {
+        if (weights[i])
+            weights[i] = max_bits + 1 - weights[i];
+        rank_count[weights[i]]++;
+    }
+
+    // Codes are assigned by length, longest (i.e. lowest weight) first, then in symbol order
+    rank_idx[max_bits] = 0;
+    for (int bits = max_bits; bits >= 1; bits--)
+        rank_idx[bits - 1] = rank_idx[bits] + rank_count[bits] * (1 << (max_bits - bits));
+
+    if (rank_idx[0] != (1U << max_bits))
+        return ZSTD_DATA_ERROR;
+
+    for (int i = 0; i < nweights; i++) {
+        int bits = weights[i];
+        if (!bits)
+            continue;
+
+        uint32_t count = 1 << (max_bits - bits);
+        for (uint32_t j = 0; j < count; j++) {
+            zs.huf.e[rank_idx[bits] + j].symbol = i;
+            zs.huf.e[rank_idx[bits] + j].bits = bits;
+        }
+        rank_idx[bits] += count;
+    }
+
+    zs.huf.log = max_bits;
+    return ZSTD_OK;
+}
+
+static int huf_read_table(const uint8_t *src, size_t len, size_t *used)
+{
+    uint8_t *weights = zs.huf_weights;
+    int n = 0;
+
+    if (!len)
+        return ZSTD_DATA_ERROR;
+
+    uint8_t hdr = src[0];
+
+    if (hdr >= 128) {
+        // Directly stored 4-bit weights
+        n = hdr - 127;
+        *used = 1 + (n + 1) / 2;
+        if (*used > len)
+            return ZSTD_DATA_ERROR;
+
+        for (int i = 0; i < n; i++)
+            weights[i] = (i & 1) ? src[1 + i / 2] & 15 : src[1 + i / 2] >> 4;
+
+        return huf_build(n);
+    }
+
+    // FSE compressed weights, decoded by two interleaved states
+    struct fse_table *t = &zs.weights;
+    struct bits b;
+    size_t fse_len;
+
+    *used = 1 + hdr;
+    if (*used > len)
+        return ZSTD_DATA_ERROR;
+
+    CHECK(fse_read_header(t, src + 1, hdr, &fse_len, HUF_WEIGHT_LOG, 255));
+    CHECK(bits_init(&b, src + 1 + fse_len, hdr - fse_len));
+
+    uint32_t s1 = bits_read(&b, t->log);
+    uint32_t s2 = bits_read(&b, t->log);
+
+    while (true) {
+        if (n >= HUF_MAX_WEIGHTS - 1)
+            return ZSTD_DATA_ERROR;
+
+        weights[n++] = t->e[s1].symbol;
+        s1 = t->e[s1].base + bits_read(&b, t->e[s1].bits);
+        if (b.pos < 0) {
+            weights[n++] = t->e[s2].symbol;
+            break;
+        }
+
+        weights[n++] = t->e[s2].symbol;
+        s2 = t->e[s2].base + bits_read(&b, t->e[s2].bits);
+        if (b.pos < 0) {
+            weights[n++] = t->e[s1].symbol;
+            break;
+        }
+    }
+
+    return huf_build(n);
+}
+
+static int huf_decode_stream(uint8_t *out, size_t count, const uint8_t *src, size_t len)
+{
+    struct bits b;
+    int log = zs.huf.log;
+
+    CHECK(bits_init(&b, src, len));
+
+    for (size_t i = 0; i < count; i++) {
+        struct huf_entry e = zs.huf.e[bits_peek(&b, log)];
+        out[i] = e.symbol;
+        b.pos -= e.bits;
+    }
+
+    // The stream must be consumed exactly
+    return b.pos ? ZSTD_DATA_ERROR : ZSTD_OK;
+}
+
+static int decode_literals(const uint8_t *src, size_t len, size_t *used, const uint8_t **lit,
+                           size_t *lit_len)
+{
+    if (len < 5)
+        return ZSTD_DATA_ERROR;
+
+    int type = src[0] & 3;
+    int size_format = (src[0] >> 2) & 3;
+    size_t regen, comp, hdr;
+
+    if (type == LIT_RAW || type == LIT_RLE) {
+        switch (size_format) {
+            case 1:
+                hdr = 2;
+                regen = get_le16(src) >> 4;
+                break;
+            case 3:
+                hdr = 3;
+                regen = (get_le32(src) & 0xffffff) >> 4;
+                break;
+            default:
+                hdr = 1;
+                regen = src[0] >> 3;
+                break;
+        }
+
+        if (regen > BLOCK_MAX)
+            return ZSTD_DATA_ERROR;
+
+        if (type == LIT_RAW) {
+            *used = hdr + regen;
+            if (*used > len)
+                return ZSTD_DATA_ERROR;
+            *lit = src + hdr;
+        } else {
+            *used = hdr + 1;
+            memset(zs.lit, src[hdr], regen);
+            *lit = zs.lit;
+        }
+
+        *lit_len = regen;
+        return ZSTD_OK;
+    }
+
+    int streams = size_format ? 4 : 1;
+
+    switch (size_format) {
+        case 0:
+        case 1: {
+            uint32_t v = get_le32(src) & 0xffffff;
+            hdr = 3;
+            regen = (v >> 4) & 0x3ff;
+            comp = (v >> 14) & 0x3ff;
+            break;
+        }
+        case 2: {
+            uint32_t v = get_le32(src);
+            hdr = 4;
+            regen = (v >> 4) & 0x3fff;
+            comp = (v >> 18) & 0x3fff;
+            break;
+        }
+        default: {
+            uint64_t v = get_le32(src) | ((uint64_t)src[4] << 32);
+            hdr = 5;
+            regen = (v >> 4) & 0x3ffff;
+            comp = (v >> 22) & 0x3ffff;
+            break;
+        }
+    }
+
+    if (regen > BLOCK_MAX || hdr + comp > len)
+        return ZSTD_DATA_ERROR;
+
+    const uint8_t *p = src + hdr;
+    size_t plen = comp;
+
+    if (type == LIT_COMPRESSED) {
+        size_t table_len;
+        CHECK(huf_read_table(p, plen, &table_len));
+        p += table_len;
+        plen -= table_len;
+    } else if (zs.huf.log < 0) {
+        return ZSTD_DATA_ERROR;
+    }
+
+    if (streams == 1) {
+        CHECK(huf_decode_stream(zs.lit, regen, p, plen));
+    } else {
+        if (plen < 6)
+            return ZSTD_DATA_ERROR;
+
+        size_t sizes[4] = {get_le16(p), get_le16(p + 2), get_le16(p + 4), 0};
+        size_t seg = (regen + 3) / 4;
+
+        p += 6;
+        plen -= 6;
+        if (sizes[0] + sizes[1] + sizes[2] > plen || 3 * seg > regen)
+            return ZSTD_DATA_ERROR;
+        sizes[3] = plen - sizes[0] - sizes[1] - sizes[2];
+
+        for (int i = 0; i < 4; i++) {
+            size_t count = i < 3 ? seg : regen - 3 * seg;
+            CHECK(huf_decode_stream(zs.lit + i * seg, count, p, sizes[i]));
+            p += sizes[i];
+        }
+    }
+
+    *lit = zs.lit;
+    *lit_len = regen;
+    *used = hdr + comp;
+    return ZSTD_OK;
+}
+
+static int seq_table(struct fse_table *t, int mode, const uint8_t *src, size_t len, size_t *used,
+                     const int16_t *def, int def_nsym, int def_log, int max_log, int max_symbol)
+{
+    *used = 0;
+
+    switch (mode) {
+        case SEQ_PREDEFINED:
+            return fse_build(t, def, def_nsym, def_log);
+        case SEQ_RLE:
+            if (!len || src[0] > max_symbol)
+                return ZSTD_DATA_ERROR;
+            t->log = 0;
+            t->e[0].symbol = src[0];
+            t->e[0].bits = 0;
+            t->e[0].base = 0;
+            *used = 1;
+            return ZSTD_OK;
+        case SEQ_FSE:
+            return fse_read_header(t, src, len, used, max_log, max_symbol);
+        default:
+            return t->log < 0 ? ZSTD_DATA_ERROR : ZSTD_OK;
+    }
+}
+
+static uint32_t resolve_offset(uint32_t value, uint32_t ll)
+{
+    uint32_t *rep = zs.rep;
+
+    if (value > 3) {
+        rep[2] = rep[1];
+        rep[1] = rep[0];
+        rep[0] = value - 3;
+        return rep[0];
+    }
+
+    // Repeat offsets, shifted by one if there are no literals
+    uint32_t idx = value - (ll ? 1 : 0);
+    if (!idx)
+        return rep[0];
+
+    uint32_t off = idx == 3 ? rep[0] - 1 : rep[idx];
+    if (idx != 1)
+        rep[2] = rep[1];
+    rep[1] = rep[0];
+    rep[0] = off;
+
+    return off;
+}
+
+static int decode_sequences(uint8_t *dst, size_t *pos, size_t cap, const uint8_t *src, size_t len,
+                            const uint8_t *lit, size_t lit_len)
+{
+    size_t op = *pos;
+    size_t ip = 1;
+    size_t lp = 0;
+
+    if (!len)
+        return ZSTD_DATA_ERROR;
+
+    uint32_t nseq = src[0];
+    if (nseq == 255) {
+        if (len < 3)
+            return ZSTD_DATA_ERROR;
+        nseq = get_le16(src + 1) + 0x7f00;
+        ip = 3;
+    } else if (nseq >= 128) {
+        if (len < 2)
+            return ZSTD_DATA_ERROR;
+        nseq = ((nseq - 128) << 8) + src[1];
+        ip = 2;
+    }
+
+    if (nseq) {
+        size_t used;
+
+        if (ip >= len)
+            return ZSTD_DATA_ERROR;
+
+        uint8_t modes = src[ip++];
+        if (modes & 3)
+            return ZSTD_DATA_ERROR;
+
+        CHECK(seq_table(&zs.ll, modes >> 6, src + ip, len - ip, &used, ll_default,
+                        LL_MAX_SYMBOL + 1, LL_DEFAULT_LOG, LL_MAX_LOG, LL_MAX_SYMBOL));
+        ip += used;
+        CHECK(seq_table(&zs.of, (modes >> 4) & 3, src + ip, len - ip, &used, of_default, 29,
+                        OF_DEFAULT_LOG, OF_MAX_LOG, OF_MAX_SYMBOL));
+        ip += used;
+        CHECK(seq_table(&zs.ml, (modes >> 2) & 3, src + ip, len - ip, &used, ml_default,
+                        ML_MAX_SYMBOL + 1, ML_DEFAULT_LOG, ML_MAX_LOG, ML_MAX_SYMBOL));
+        ip += used;
+
+        if (ip > len)
+            return ZSTD_DATA_ERROR;
+
+        struct bits b;
+        CHECK(bits_init(&b, src + ip, len - ip));
+
+        uint32_t ll_state = bits_read(&b, zs.ll.log);
+        uint32_t of_state = bits_read(&b, zs.of.log);
+        uint32_t ml_state = bits_read(&b, zs.ml.log);
+
+        for (uint32_t i = 0; i < nseq; i++) {
+            struct fse_entry lle = zs.ll.e[ll_state];
+            struct fse_entry ofe = zs.of.e[of_state];
+            struct fse_entry mle = zs.ml.e[ml_state];
+
+            uint32_t of_value = (1U << ofe.symbol) + bits_read(&b, ofe.symbol);
+            uint32_t ml = ml_base[mle.symbol] + bits_read(&b, ml_bits[mle.symbol]);
+            uint32_t ll = ll_base[lle.symbol] + bits_read(&b, ll_bits[lle.symbol]);
+            uint32_t off = resolve_offset(of_value, ll);
+
+            if (i != nseq - 1) {
+                ll_state = lle.base + bits_read(&b, lle.bits);
+                ml_state = mle.base + bits_read(&b, mle.bits);
+                of_state = ofe.base + bits_read(&b, ofe.bits);
+            }
+
+            if (lit_len - lp < ll)
+                return ZSTD_DATA_ERROR;
+            if (cap - op < ll + ml)
+                return ZSTD_BUF_ERROR;
+
+            memcpy(dst + op, lit + lp, ll);
+            op += ll;
+            lp += ll;
+
+            if (!off || off > op)
+                return ZSTD_DATA_ERROR;
+
+            copy_match(dst + op, off, ml);
+            op += ml;
+        }
+
+        if (b.pos)
+            return ZSTD_DATA_ERROR;
+    }
+
+    // Whatever is left of the literals goes last
+    if (cap - op < lit_len - lp)
+        return ZSTD_BUF_ERROR;
+
+    memcpy(dst + op, lit + lp, lit_len - lp);
+    op += lit_len - lp;
+
+    *pos = op;
+    return ZSTD_OK;
+}
+
+static int decode_block(uint8_t *dst, size_t *pos, size_t cap, const uint8_t *src, size_t len)
+{
+    const uint8_t *lit;
+    size_t lit_len, used;
+
+    CHECK(decode_literals(src, len, &used, &lit, &lit_len));
+
+    return decode_sequences(dst, pos, cap, src + used, len - used, lit, lit_len);
+}
+
+int zstd_decompress(void *dest, size_t *dest_len, const void *src, size_t *src_len)
+{
+    const uint8_t *in = src;
+    size_t avail = *src_len ? *src_len : SIZE_MAX - (uintptr_t)src;
+    size_t ip = 0;
+    uint8_t *dst = dest;
+    size_t op = 0;
+    uint32_t magic;
+
+    while (true) {
+        if (avail - ip < 4)
+            return ZSTD_DATA_ERROR;
+
+        magic = get_le32(in + ip);
+        if ((magic & ZSTD_SKIPPABLE_MASK) != ZSTD_SKIPPABLE_MAGIC)
+            break;
+
+        if (avail - ip < 8 || avail - ip - 8 < get_le32(in + ip + 4))
+            return ZSTD_DATA_ERROR;
+        ip += 8 + get_le32(in + ip + 4);
+    }
+
+    if (magic != ZSTD_MAGIC)
+        return ZSTD_DATA_ERROR;
+    ip += 4;
+
+    if (avail - ip < 1)
+        return ZSTD_DATA_ERROR;
+
+    uint8_t fhd = in[ip++];
+    bool single = fhd & FHD_SINGLE_SEG;
+    int dict_len = (int[]){0, 1, 2, 4}[FHD_DICT_ID(fhd)];
+    int fcs_len = FHD_FCS(fhd) ? 1 << FHD_FCS(fhd) : single;
+
+    if (fhd & FHD_RESERVED)
+        return ZSTD_DATA_ERROR;
+
+    // The window descriptor doesn't matter when decoding into a flat buffer
+    size_t hdr_len = (single ? 0 : 1) + dict_len + fcs_len;
+    if (avail - ip < hdr_len)
+        return ZSTD_DATA_ERROR;
+    if (!single)
+        ip++;
+
+    uint32_t dict_id = 0;
+    for (int i = 0; i < dict_len; i++)
+        dict_id |= in[ip++] << (8 * i);
+    if (dict_id)
+        return ZSTD_UNSUPPORTED;
+
+    uint64_t content_size = 0;
+    for (int i = 0; i < fcs_len; i++)
+        content_size |= (uint64_t)in[ip++] << (8 * i);
+    if (fcs_len == 2)
+        content_size += 256;
+
+    zs.huf.log = -1;
+    zs.ll.log = zs.of.log = zs.ml.log = -1;
+    zs.rep[0] = 1;
+    zs.rep[1] = 4;
+    zs.rep[2] = 8;
+
+    while (true) {
+        if (avail - ip < 3)
+            return ZSTD_DATA_ERROR;
+
+        uint32_t bh = in[ip] | (in[ip + 1] << 8) | (in[ip + 2] << 16);
+        size_t size = BH_SIZE(bh);
+        ip += 3;
+
+        if (size > BLOCK_MAX)
+            return ZSTD_DATA_ERROR;
+
+        switch (BH_TYPE(bh)) {
+            case BLOCK_RAW:
+                if (avail - ip < size)
+                    return ZSTD_DATA_ERROR;
+                if (*dest_len - op < size)
+                    return ZSTD_BUF_ERROR;
+                memcpy(dst + op, in + ip, size);
+                ip += size;
+                op += size;
+                break;
+            case BLOCK_RLE:
+                if (avail - ip < 1)
+                    return ZSTD_DATA_ERROR;
+                if (*dest_len - op < size)
+                    return ZSTD_BUF_ERROR;
+                memset(dst + op, in[ip], size);
+                ip++;
+                op += size;
+                break;
+            case BLOCK_COMPRESSED:
+                if (avail - ip < size)
+                    return ZSTD_DATA_ERROR;
+                CHECK(decode_block(dst, &op, *dest_len, in + ip, size));
+                ip += size;
+                break;
+            default:
+                return ZSTD_DATA_ERROR;
+        }
+
+        if (bh & BH_LAST)
+            break;
+    }
+
+    if (fhd & FHD_CHECKSUM) {
+        if (avail - ip < 4)
+            return ZSTD_DATA_ERROR;
+        if ((uint32_t)xxh64(dst, op) != get_le32(in + ip))
+            return ZSTD_DATA_ERROR;
+        ip += 4;
+    }
+
+    if (fcs_len && content_size != op)
+        return ZSTD_DATA_ERROR;
+
+    *dest_len = op;
+    *src_len = ip;
+    return ZSTD_OK;
+}
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef ZSTDDEC_H
+#define ZSTDDEC_H
+
+#include <stddef.h>
+
+#define ZSTD_OK          0
+#define ZSTD_DATA_ERROR  -1 // corrupt input or checksum mismatch
+#define ZSTD_UNSUPPORTED -2 // dictionaries
+#define ZSTD_BUF_ERROR   -3 // output does not fit
+
+/*
+ * Decompress one Zstandard frame from src into dest. Skippable frames in front of it are
+ * skipped.
+ *
+ * *src_len is the size of the input on entry (0 if unknown, the frame is self-delimiting) and is
+ * set to the number of bytes consumed. *dest_len is the size of dest on entry and is set to the
+ * decompressed size.
+ *
+ * The decoder keeps its tables in static storage, so it is not reentrant.
+ */
+int zstd_decompress(void *dest, size_t *dest_len, const void *src, size_t *src_len);
+
+#endif
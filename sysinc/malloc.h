@@ -13,4 +13,22 @@ void *realloc_in_place(void *, size_t);
 void *memalign(size_t, size_t);
 int posix_memalign(void **, size_t, size_t);
 
+#define STRUCT_MALLINFO_DECLARED 1
+struct mallinfo {
+    size_t arena;    /* non-mmapped space allocated from system */
+    size_t ordblks;  /* number of free chunks */
+    size_t smblks;   /* always 0 */
+    size_t hblks;    /* always 0 */
+    size_t hblkhd;   /* space in mmapped regions */
+    size_t usmblks;  /* maximum total allocated space */
+    size_t fsmblks;  /* always 0 */
+    size_t uordblks; /* total allocated space */
+    size_t fordblks; /* total free space */
+    size_t keepcost; /* releasable (via malloc_trim) space */
+};
+
+struct mallinfo mallinfo(void);
+size_t malloc_footprint(void);
+size_t malloc_max_footprint(void);
+
 #endif